@@ -0,0 +1,105 @@
+// ARMLifter.hpp: Definition of class `ARMLifter`.
+
+#ifndef IPASIM_ARM_LIFTER_HPP
+#define IPASIM_ARM_LIFTER_HPP
+
+#include <cstdint>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <map>
+#include <string>
+
+namespace ipasim {
+
+// Translates guest functions in ARM (not Thumb) mode to LLVM IR functions of
+// type `void (GuestCPU *)` (see `NativeTranslations.hpp`). Guest memory is
+// identity-mapped, so loads and stores simply use guest addresses as host
+// pointers. Only leaf functions built from common data processing, multiply,
+// load, store and branch instructions are supported. Functions which call
+// other ones, touch coprocessors or system registers, or branch outside of
+// themselves are rejected and stay emulated. So are functions whose use of the
+// stack cannot be bounded (see `getFrameSize`).
+class ARMLifter {
+public:
+  // Functions with bigger frames are rare. They stay emulated, so that their
+  // stack is never committed more than one `StackPool::CommitStep` at once.
+  static constexpr uint32_t MaxFrameSize = 64 * 1024;
+
+  ARMLifter(llvm::Module &M);
+
+  // Lifts function at guest address `Addr`, whose instructions (and possibly
+  // literal pools) are `Code`. Only instructions reachable from the entry
+  // point are decoded. Returns `nullptr` and sets `Error` if the function
+  // cannot be lifted.
+  llvm::Function *lift(llvm::StringRef Name, uint32_t Addr,
+                       llvm::ArrayRef<uint8_t> Code, std::string &Error);
+  // Upper bound of bytes below its entry SP that the last lifted function
+  // touches. Guest stacks are committed lazily, so the caller must commit them
+  // before running the function natively.
+  uint32_t getFrameSize() const { return FrameSize; }
+
+private:
+  enum Flag { N, Z, C, V };
+  struct AddResult {
+    llvm::Value *Result, *Carry, *Overflow;
+  };
+
+  // Finds instructions reachable from `Start`.
+  bool discover(std::string &Error);
+  // Computes `FrameSize` of instructions found by `discover`.
+  bool measureFrame(std::string &Error);
+  uint32_t fetch(uint32_t Addr) const;
+  // Lifts instruction at `Current` into the current block.
+  bool emit(uint32_t Insn, std::string &Error);
+  bool emitInstruction(uint32_t Insn, std::string &Error);
+  bool emitDataProcessing(uint32_t Insn, std::string &Error);
+  bool emitMultiply(uint32_t Insn, std::string &Error);
+  bool emitExtraLoadStore(uint32_t Insn, std::string &Error);
+  bool emitLoadStore(uint32_t Insn, std::string &Error);
+  // Common part of `emitExtraLoadStore` and `emitLoadStore`.
+  bool emitTransfer(uint32_t Insn, llvm::Value *Offset, unsigned Bits,
+                    bool Signed, std::string &Error);
+  bool emitBlockTransfer(uint32_t Insn, std::string &Error);
+
+  llvm::Value *getReg(unsigned R);
+  void setReg(unsigned R, llvm::Value *Value);
+  llvm::Value *getFlag(Flag F);
+  void setFlag(Flag F, llvm::Value *Value);
+  void setNZ(llvm::Value *Result);
+  llvm::Value *getCondition(unsigned Cond);
+  // Computes the second operand of a data processing instruction. `Carry` is
+  // set to the shifter's carry or `nullptr` if it isn't supported.
+  llvm::Value *getOperand2(uint32_t Insn, llvm::Value *&Carry);
+  // Shifts `Value` by a constant amount like the barrel shifter.
+  llvm::Value *shift(llvm::Value *Value, unsigned Type, unsigned Amount,
+                     llvm::Value *&Carry);
+  AddResult addWithCarry(llvm::Value *A, llvm::Value *B, llvm::Value *Carry);
+  llvm::Value *load(llvm::Value *Addr, unsigned Bits);
+  void store(llvm::Value *Addr, llvm::Value *Value, unsigned Bits);
+  // Ends the function, emulation continues at `Target`.
+  void emitReturn(llvm::Value *Target);
+  llvm::ConstantInt *getInt(uint32_t Value);
+
+  llvm::Module &M;
+  llvm::LLVMContext &Ctx;
+  llvm::IRBuilder<> Builder;
+  llvm::Type *Int32Ty;
+  llvm::StructType *CPUTy;
+
+  // State of the function being lifted
+  uint32_t Start = 0;
+  uint32_t Current = 0; // Address of the instruction being lifted
+  llvm::ArrayRef<uint8_t> Code;
+  llvm::Function *Func = nullptr;
+  llvm::Value *Regs[16] = {}, *Flags[4] = {};
+  std::map<uint32_t, llvm::BasicBlock *> Blocks;
+  llvm::BasicBlock *Exit = nullptr;
+  uint32_t FrameSize = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_ARM_LIFTER_HPP)
+#endif
@@ -0,0 +1,86 @@
+// AllocationProfiler.hpp: Definition of class `AllocationProfiler`.
+
+#ifndef IPASIM_ALLOCATION_PROFILER_HPP
+#define IPASIM_ALLOCATION_PROFILER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ipasim {
+
+class DynamicLoader;
+
+// Sampling profiler of `GuestHeap` allocations made for emulated code, i.e.,
+// guest `malloc`s (see `GuestMalloc`) and objects of the Objective-C runtime
+// (see `ipaSim_guestAlloc`, the runtime doesn't call it yet). About once per
+// `AllocationSampleInterval` bytes, an allocation is sampled: its size, call
+// stack (see `StackWalker`) and, for objects created by `class_createInstance`
+// and friends, class are recorded. Sampled blocks are then tracked until
+// they're freed, so that live bytes can be attributed to call sites. Other
+// allocations only decrement a per-thread counter. Like `GuestProfiler`, it
+// stores raw addresses and symbolizes them only when written.
+class AllocationProfiler {
+public:
+  AllocationProfiler(DynamicLoader &Dyld) : Dyld(Dyld) {}
+  AllocationProfiler(const AllocationProfiler &) = delete;
+
+  // Counts allocation of `Size` bytes at `Ptr` and samples it if it's time.
+  // `InGuest` must be `true` inside emulator hooks (see `StackWalker::walk`).
+  void allocate(const void *Ptr, size_t Size, bool InGuest);
+  void free(const void *Ptr);
+  // Attributes the next allocation of the current thread to Objective-C class
+  // at `Class` (if not zero). Called before each DLL wrapper, so that the class
+  // doesn't stick if the wrapped function doesn't allocate from `GuestHeap`.
+  static void expectClass(uint32_t Class) { PendingClass = Class; }
+  // Returns `true` if `Addr` is a function of `libobjc.dll` which allocates
+  // an instance of its first argument.
+  bool isAllocator(uint64_t Addr);
+  // Approximate bytes of sampled blocks which haven't been freed yet.
+  uint64_t getLiveBytes() const {
+    return LiveBytes.load(std::memory_order_relaxed);
+  }
+  // Writes live and allocated bytes by class and call stack as CSV to `Path`.
+  // Returns `false` on failure.
+  bool write(const std::string &Path);
+  // Writes the report to the `profile` cache folder.
+  bool write();
+
+private:
+  struct Site {
+    uint64_t Samples = 0;
+    uint64_t Bytes = 0, LiveBytes = 0; // Estimated from the samples
+  };
+  struct Block {
+    Site *S;
+    uint64_t Bytes;
+  };
+  // Class and stack (with the leaf frame first)
+  using SiteKey = std::pair<uint32_t, std::vector<uint32_t>>;
+
+  void sample(const void *Ptr, size_t Size, uint32_t Class, bool InGuest);
+
+  static thread_local uint32_t PendingClass;
+  static thread_local uint64_t UntilSample;
+
+  DynamicLoader &Dyld;
+  std::mutex Mutex, WriteMutex;
+  std::map<SiteKey, Site> Sites; // Never removed, so `Block::S` stays valid
+  std::unordered_map<const void *, Block> Live;
+  std::atomic<size_t> LiveCount = 0;
+  std::atomic<uint64_t> LiveBytes = 0;
+  std::chrono::steady_clock::time_point Start =
+      std::chrono::steady_clock::now();
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_ALLOCATION_PROFILER_HPP)
+#endif
@@ -0,0 +1,48 @@
+// BuildCache.hpp: Definition of class `BuildCache`.
+
+#ifndef IPASIM_BUILD_CACHE_HPP
+#define IPASIM_BUILD_CACHE_HPP
+
+#include <filesystem>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MD5.h>
+#include <string>
+
+namespace ipasim {
+
+// Hashes inputs of one output file of `HeadersAnalyzer` (e.g., bitcode of an
+// object file or arguments and input files of a link), so that the output isn't
+// created again if they didn't change. The hash is stored in a stamp file
+// inside `Dir`. Hash of `HeadersAnalyzer.exe` itself is always included.
+class BuildCache {
+public:
+  BuildCache();
+
+  // Directory with stamp files. If it's empty, nothing is up-to-date.
+  static std::filesystem::path Dir;
+
+  void add(llvm::StringRef Data);
+  // Adds contents of file `Path` if it exists. Returns `false` otherwise.
+  bool addFile(const std::string &Path);
+  // Adds arguments and contents of those that are paths to existing files,
+  // except for `Output`.
+  void addArgs(llvm::ArrayRef<const char *> Args, llvm::StringRef Output);
+  // Returns `true` if `Output` exists and was created from the same inputs.
+  // Finishes the hash, nothing can be added after calling this.
+  bool isUpToDate(const std::string &Output);
+  // Records that `Output` was created from the inputs.
+  void update(const std::string &Output);
+
+private:
+  llvm::MD5 Hasher;
+  std::string Hash;
+
+  const std::string &getHash();
+  static std::filesystem::path getStampPath(const std::string &Output);
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_BUILD_CACHE_HPP)
+#endif
@@ -0,0 +1,61 @@
+// BuildReport.hpp: Definition of classes `BuildReport` and `BuildTimer`.
+
+#ifndef IPASIM_BUILD_REPORT_HPP
+#define IPASIM_BUILD_REPORT_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ipasim {
+
+enum class BuildCounter : size_t {
+  Exports,   // Exports processed
+  Modules,   // LLVM modules emitted into object files (not reused ones)
+  Processes, // Processes spawned (e.g., linkers if `InProcessLLD` is off)
+  Count
+};
+
+// Resources used by each phase of `HeadersAnalyzer` and by each DLL or Dylib
+// job inside of them. `write` saves it as JSON (next to `report.csv`), so that
+// build performance can be tracked over time.
+class BuildReport {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Adds `N` to counter `C` of the current phase and of the job running on
+  // the calling thread (if any).
+  static void count(BuildCounter C, uint64_t N = 1);
+  static void write(const std::string &Path);
+};
+
+// Measures one phase (if `Job` is empty) or one job of the current phase. The
+// entry is added to `BuildReport` when the timer is destroyed.
+//
+// Phases are measured with CPU time and counters of all threads, since they
+// run tasks in parallel. Note that tasks scheduled by one phase can finish in
+// the next one. Jobs are measured only on the calling thread. Peak RSS is that
+// of the whole process at the end of the entry.
+class BuildTimer {
+public:
+  explicit BuildTimer(std::string Name, bool Job = false);
+  BuildTimer(const BuildTimer &) = delete;
+  ~BuildTimer();
+
+private:
+  friend class BuildReport;
+
+  std::string Name;
+  bool Job;
+  BuildReport::Clock::time_point Start;
+  uint64_t StartCPU; // In 100-nanosecond units
+  // Counters of the job or totals at the start of the phase
+  uint64_t Counts[static_cast<size_t>(BuildCounter::Count)];
+  BuildTimer *Outer; // Job of the thread that was running before this one
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_BUILD_REPORT_HPP)
+#endif
@@ -0,0 +1,82 @@
+// CPUBackend.hpp: Definition of class `CPUBackend`.
+
+#ifndef IPASIM_CPU_BACKEND_HPP
+#define IPASIM_CPU_BACKEND_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unicorn/unicorn.h>
+
+namespace ipasim {
+
+// Saved CPU state of a backend, see `CPUBackend::allocContext`.
+struct CPUContext;
+
+// Engine that executes ARMv7 code for `Emulator`. Registers, memory
+// permissions, hook types and status codes are Unicorn's, since that's what
+// the rest of IpaSimulator speaks. Other backends translate them. Memory is
+// always host memory mapped at the same guest addresses, so backends never copy
+// it.
+//
+// Crossings into native code are exits of the backend: fetches from memory
+// without `UC_PROT_EXEC` must call `UC_HOOK_MEM_FETCH_PROT` hooks and `svc`
+// must call `UC_HOOK_INTR` hooks (see `SysTranslator::handleFetchProtMem`).
+// Other hooks are only needed for tracing and debugging, backends report
+// which of them they support (see `supportsHook`).
+class CPUBackend {
+public:
+  enum Kind : uint8_t {
+    Unicorn,  // QEMU's TCG, supports all hooks
+    Dynarmic, // Dedicated ARMv7 recompiler, not built yet
+    KindCount
+  };
+
+  virtual ~CPUBackend() = default;
+
+  // Returns backend of kind `K` or `nullptr` if it's not available.
+  static std::unique_ptr<CPUBackend> create(Kind K);
+  // Returns kind of backends `Emulator`s are created with. It's
+  // `DefaultCPUBackend` unless environment variable `IPASIM_CPU_BACKEND`
+  // names another one (see `getName`). Unicorn is used whenever instruction
+  // tracing is enabled at startup.
+  static Kind getDefault();
+  static const char *getName(Kind K);
+  // Returns `false` if there is no backend called `Name`.
+  static bool parse(const char *Name, Kind &K);
+
+  virtual Kind getKind() const = 0;
+  virtual uc_err readRegs(const uc_arm_reg *RegIds, uint32_t *Values,
+                          size_t Count) = 0;
+  virtual uc_err writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                           size_t Count) = 0;
+  virtual uc_err mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms,
+                           void *Host) = 0;
+  virtual uc_err unmapMemory(uint64_t Addr, uint64_t Size) = 0;
+  virtual uc_err protectMemory(uint64_t Addr, uint64_t Size, uc_prot Perms) = 0;
+  // See `Emulator::start`.
+  virtual uc_err start(uint64_t Addr, size_t Count) = 0;
+  // Can be called from hooks. The backend returns from `start` as soon as the
+  // current instruction (or hook) finishes.
+  virtual uc_err stop() = 0;
+  // Translates code at `Addr` (with the Thumb bit like `start`) without
+  // executing it, so that its first execution is faster. Cannot be called
+  // while running. Returns `UC_ERR_ARG` if the backend doesn't translate
+  // ahead of time.
+  virtual uc_err translate(uint64_t Addr) = 0;
+  virtual uc_err allocContext(CPUContext *&Ctx) = 0;
+  virtual uc_err saveContext(CPUContext *Ctx) = 0;
+  virtual uc_err restoreContext(CPUContext *Ctx) = 0;
+  virtual uc_err freeContext(CPUContext *Ctx) = 0;
+  // Hook callbacks have Unicorn's signatures (see `uc_hook_type`). Their first
+  // argument is the backend's engine or `nullptr`, it's never used.
+  virtual bool supportsHook(uc_hook_type Type) const = 0;
+  virtual uc_err addHook(uc_hook_type Type, void *Callback, void *Data,
+                         uint64_t Begin, uint64_t End, size_t &Hook) = 0;
+  virtual uc_err removeHook(size_t Hook) = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_CPU_BACKEND_HPP)
+#endif
@@ -0,0 +1,74 @@
+// CacheFile.hpp: Helpers for files cached across runs (e.g., `PrelinkCache`).
+
+#ifndef IPASIM_CACHE_FILE_HPP
+#define IPASIM_CACHE_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// FNV-1a
+inline uint64_t hashBytes(const void *Data, size_t Size, uint64_t Hash) {
+  for (size_t I = 0; I != Size; ++I) {
+    Hash ^= static_cast<const uint8_t *>(Data)[I];
+    Hash *= 0x100000001B3;
+  }
+  return Hash;
+}
+constexpr uint64_t HashSeed = 0xCBF29CE484222325;
+
+template <typename T> void write(std::ostream &O, const T &Value) {
+  O.write(reinterpret_cast<const char *>(&Value), sizeof(T));
+}
+inline void write(std::ostream &O, const std::string &Value) {
+  write(O, static_cast<uint32_t>(Value.size()));
+  O.write(Value.data(), Value.size());
+}
+template <typename T> bool read(std::istream &I, T &Value) {
+  return static_cast<bool>(
+      I.read(reinterpret_cast<char *>(&Value), sizeof(T)));
+}
+inline bool read(std::istream &I, std::string &Value) {
+  uint32_t Size;
+  if (!read(I, Size))
+    return false;
+  Value.resize(Size);
+  return static_cast<bool>(I.read(Value.data(), Size));
+}
+
+// Returns directory `Name` inside the app's local cache folder (or inside the
+// bundle being prepared, see `beginBundle`).
+std::filesystem::path getCacheDir(const char *Name);
+// Returns paths where file `File` of cache directory `Name` should be looked
+// for, in order. Files of the app's bundle (see `openBundle`) come first.
+std::vector<std::filesystem::path> getCacheFiles(const char *Name,
+                                                 const std::string &File);
+
+// Caches of an app can be prepared offline (by `ipasim-prep`) into a bundle
+// next to it, i.e., directory `<app>.ipasim` with the same layout as the
+// cache folder. Its manifest identifies the app and the bundle's version.
+// Returns path of the bundle of app `AppPath` (a binary or a path inside an
+// `.ipa` archive).
+std::filesystem::path getBundlePath(const std::string &AppPath);
+// Lets `getCacheFiles` return files of the bundle of app `AppPath` if it has a
+// valid manifest. Returns `false` if it doesn't.
+bool openBundle(const std::string &AppPath);
+// Redirects `getCacheDir` into the bundle of app `AppPath`. Its manifest is
+// removed until `finishBundle` is called, so that it isn't used if preparation
+// fails halfway.
+bool beginBundle(const std::string &AppPath);
+bool finishBundle(const std::string &AppPath);
+// Returns a hash identifying the file's current version or `0` if the file
+// cannot be queried.
+uint64_t getFileStamp(const std::string &Path);
+
+} // namespace ipasim
+
+// !defined(IPASIM_CACHE_FILE_HPP)
+#endif
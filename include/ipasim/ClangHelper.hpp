@@ -30,10 +30,16 @@ public:
   }
   template <typename ActTy> void executeCodeGenAction() {
     ActTy Act(&LLVM.Ctx);
+    executeCodeGenAction(Act);
+  }
+  // Executes already constructed `Act`, which must use `LLVM.Ctx`.
+  template <typename ActTy> void executeCodeGenAction(ActTy &Act) {
     executeAction(Act);
     LLVM.setModule(Act.takeModule());
   }
   std::unique_ptr<clang::CodeGen::CodeGenModule> createCodeGenModule();
+  void addDLLArgs(llvm::StringRef Output, llvm::StringRef ObjectFile,
+                  llvm::StringRef ImportLib, bool Debug);
   void linkDLL(llvm::StringRef Output, llvm::StringRef ObjectFile,
                llvm::StringRef ImportLib, bool Debug);
   void addDylibArgs(llvm::StringRef Output, llvm::StringRef ObjectFile,
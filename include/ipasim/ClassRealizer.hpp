@@ -0,0 +1,66 @@
+// ClassRealizer.hpp: Definition of class `ClassRealizer`.
+
+#ifndef IPASIM_CLASS_REALIZER_HPP
+#define IPASIM_CLASS_REALIZER_HPP
+
+#include "ipasim/MachO.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// Objective-C classes of loaded images waiting to be realized ahead of their
+// first use. The runtime realizes classes of `__objc_classlist` lazily (i.e.,
+// on the first message to each of them), and realizing one (and attaching its
+// method lists and categories) shows as a stall when a screen is used for the
+// first time. So the emulation thread realizes them while it's idle instead
+// (see `UIDispatcher::runEmulation`). Classes used during the previous launch
+// (see `LaunchProfile`) are realized first, then the rest of each image in the
+// order the runtime was notified about them (dependencies first, see
+// `DynamicLoader::handleMachOs`).
+//
+// There is no way to realize a class by its pointer from outside the runtime,
+// so they are looked up by their names through `objc_lookUpClass`, which
+// realizes the found class (and its superclasses and meta-class) under the
+// runtime lock. It doesn't send `+initialize`, so no guest code runs.
+class ClassRealizer {
+public:
+  // Adds classes of image `Hdr`. Its metadata must have been mapped by the
+  // runtime first.
+  void add(const void *Hdr);
+  // Forgets image `Hdr` before it's unloaded.
+  void remove(const void *Hdr);
+  // Adds classes realized before any others. The first ones are realized
+  // first.
+  void prioritize(std::vector<std::string> Priority);
+  bool hasPending() const {
+    return PendingCount.load(std::memory_order_relaxed);
+  }
+  // Realizes at most `Count` classes. Returns `false` if there are none left.
+  bool realize(size_t Count);
+  // Returns names of classes of `Image` which have received messages (i.e.,
+  // their method caches aren't empty). Those only realized by `realize` don't
+  // have anything cached.
+  static std::vector<std::string> getUsed(MachO Image);
+
+private:
+  using LookUpFunc = void *(*)(const char *);
+
+  void updateCount();
+
+  std::atomic<size_t> PendingCount = 0;
+  std::mutex Mutex;
+  std::vector<std::string> Names; // In reverse order, so it's popped from back
+  std::deque<const void *> Images; // Not read yet
+  LookUpFunc LookUp = nullptr;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_CLASS_REALIZER_HPP)
+#endif
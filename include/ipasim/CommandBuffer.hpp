@@ -0,0 +1,39 @@
+// CommandBuffer.hpp: Definition of struct `CommandBuffer`.
+
+#ifndef IPASIM_COMMAND_BUFFER_HPP
+#define IPASIM_COMMAND_BUFFER_HPP
+
+#include "ipasim/Common.hpp"
+
+#include <cstdint>
+
+namespace ipasim {
+
+// Buffer in guest memory where Dylib wrappers of deferred functions (see
+// `deferred_functions.txt`) append their calls instead of calling into native
+// code. Each record consists of address of the DLL wrapper (which has
+// `RegisterABI`), number of argument words and the words themselves. The host
+// calls all recorded wrappers at once when the buffer is full (the wrapper
+// then executes `svc #FlushID`) and before any other call crosses into native
+// code (see `SysTranslator::flushCommands`), so calls are executed in order.
+//
+// Every guest thread has its own buffer (see `DeferredCalls`), `GuestTSD`
+// blocks point to them in slot `GuestTSD::CommandBufferKey`. So calls are
+// always executed by the host thread which recorded them, with its state (e.g.,
+// its current GL context). Without a buffer, the wrappers call native code
+// right away.
+struct CommandBuffer {
+  static constexpr uint32_t Size = 16384; // In words
+  static constexpr uint32_t HeaderWords = 2;
+  // Hypercall ID reserved for flushing the buffer. It's never assigned to DLL
+  // wrappers.
+  static constexpr uint32_t FlushID = 0xFFFFFD;
+
+  uint32_t Used; // Number of words used in `Words`
+  uint32_t Words[Size];
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_COMMAND_BUFFER_HPP)
+#endif
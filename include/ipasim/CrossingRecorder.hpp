@@ -0,0 +1,97 @@
+// CrossingRecorder.hpp: Definition of class `CrossingRecorder` and struct
+// `CrossingRecord`.
+
+#ifndef IPASIM_CROSSING_RECORDER_HPP
+#define IPASIM_CROSSING_RECORDER_HPP
+
+#include "ipasim/WrapperIndex.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ipasim {
+
+// One call from emulated into native code or one callback the other way.
+struct CrossingRecord {
+  enum KindTy : uint8_t { Call, Callback };
+  enum FlagTy : uint8_t {
+    Leaf = 0x1,      // See `WrapperInfo::Leaf`
+    Registers = 0x2, // See `WrapperInfo::Registers`, `Result` is valid
+    Pointer = 0x4,   // `Result[0]` pointed to committed host memory
+  };
+
+  uint64_t Target;
+  uint32_t Args[RegisterBlock::ArgRegs]; // R0-R3
+  uint32_t SP;
+  uint32_t Result[RegisterBlock::ResultRegs];
+  KindTy Kind;
+  uint8_t Flags;
+  // Index of argument equal to `Result[0]` (e.g., of `objc_retain`) or `-1`.
+  int8_t ResultArg;
+  uint8_t Reserved;
+};
+static_assert(sizeof(CrossingRecord) == 40);
+
+// Records crossings of the main thread's `SysTranslator` and replays them, so
+// that cost of emulation can be measured repeatably, without noise of input,
+// timing and native subsystems.
+//
+// While replaying, calls are matched to the recording in order (by target
+// only, since pointers differ between runs). Leaf wrappers with
+// `WrapperInfo::Registers` then aren't called at all, their recorded results
+// are written into the guest's registers instead. Results which were pointers
+// (except arguments returned back) are not replayed, those calls run natively.
+// Side effects of skipped calls are lost, so native state slowly departs from
+// the recorded one. When a crossing doesn't match, replaying stops and the
+// rest runs natively. Records are kept in memory and written by `finish`.
+class CrossingRecorder {
+public:
+  static constexpr size_t None = static_cast<size_t>(-1);
+
+  // Must be called before the emulation starts, from the main thread.
+  bool record(const std::string &Path);
+  bool replay(const std::string &Path);
+  // Writes the recording or reports how much was replayed. Returns `false` on
+  // failure.
+  bool finish();
+  bool isActive() const {
+    return std::this_thread::get_id() == Thread &&
+           (Mode == Recording || Mode == Replaying);
+  }
+
+  // Adds (or matches against the recording) a call of `Target` with registers
+  // `Regs` (R0-R3 and SP). Returns index of the call for `setResult` and
+  // `replayResult` or `None` if it's not recorded nor replayed.
+  size_t addCall(uint64_t Target, uint8_t Flags, const uint32_t *Regs);
+  void addCallback(uint64_t Target, const uint32_t *Args);
+  void setResult(size_t I, const RegisterBlock &Block);
+  // If call `I` can be replayed, stores its recorded result into `Block` and
+  // returns `true`.
+  bool replayResult(size_t I, RegisterBlock &Block);
+
+private:
+  enum ModeTy { Off, Recording, Replaying, Diverged };
+
+  // Returns index of the next recorded crossing if it matches.
+  size_t match(CrossingRecord::KindTy Kind, uint64_t Target);
+
+  std::atomic<ModeTy> Mode = Off;
+  std::thread::id Thread;
+  // Guards `Records` while recording, since `finish` can be called from any
+  // thread (e.g., when a host decides to exit). Replaying is done only by
+  // `Thread`.
+  std::mutex Mutex;
+  std::string Path;
+  std::vector<CrossingRecord> Records;
+  size_t Cursor = 0, Replayed = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_CROSSING_RECORDER_HPP)
+#endif
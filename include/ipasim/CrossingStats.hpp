@@ -0,0 +1,156 @@
+// CrossingStats.hpp: Definition of class `CrossingStats`.
+
+#ifndef IPASIM_CROSSING_STATS_HPP
+#define IPASIM_CROSSING_STATS_HPP
+
+#include "ipasim/EventProvider.hpp"
+#include "ipasim/GuestClock.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/TraceBuffer.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace ipasim {
+
+class DynamicLoader;
+
+// Counts calls crossing the boundary between emulated and native code and
+// measures their latencies, per target function. Each host thread records into
+// its own table, which only it and `write` ever lock. Targets are kept as raw
+// addresses and named (like HeadersAnalyzer names exports) only when written.
+// See `CountCrossings`. Crossings are also recorded into `TraceBuffer` if
+// `BinaryTrace` is enabled and sampled into ETW events (see `EventProvider`).
+// Independently of that, it collects which targets are reached at all (see
+// `WrapperCoverage`).
+class CrossingStats {
+public:
+  enum KindTy : uint8_t {
+    Wrapper,    // Guest called a DLL function and was redirected to its wrapper
+    WrapperDLL, // Guest called a DLL wrapper
+    Dynamic,    // Guest called an Objective-C method without wrapper
+    Trampoline, // Host called a guest function through a trampoline
+    Callback,   // Host called a guest function via `DynamicBackCaller`
+    KindCount
+  };
+  // Latencies are counted in buckets by the number of bits of their value in
+  // nanoseconds, so bucket `I > 0` holds latencies in `[2^(I-1), 2^I)`.
+  static constexpr size_t Buckets = 32;
+
+  // Measures one crossing from its construction to its destruction.
+  class Scope {
+  public:
+    Scope(CrossingStats &Stats, KindTy Kind, uint64_t Target)
+        : Stats(Stats), Kind(Kind), Target(Target) {
+      if constexpr (BinaryTrace)
+        Stats.Trace.addCrossing(TraceRecord::Enter, Kind, Target);
+      if constexpr (EtwEvents)
+        Sampled = EventProvider::sampleCrossing();
+      if (CountCrossings || Sampled)
+        Start = std::chrono::steady_clock::now();
+      if constexpr (AccountGuestTimes)
+        Mode = GuestTimes::enter(Kind < Trampoline ? GuestTimes::Native
+                                                   : GuestTimes::Emulated);
+    }
+    Scope(const Scope &) = delete;
+    ~Scope() {
+      if constexpr (CountCrossings)
+        Stats.record(Kind, Target, std::chrono::steady_clock::now() - Start);
+      if constexpr (BinaryTrace)
+        Stats.Trace.addCrossing(TraceRecord::Leave, Kind, Target);
+      if (Sampled)
+        writeEvent();
+      if constexpr (AccountGuestTimes)
+        GuestTimes::enter(Mode);
+    }
+
+  private:
+    void writeEvent() {
+      auto Time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - Start);
+      TraceLoggingWrite(IpaSimProvider, "Crossing",
+                        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                        TraceLoggingKeyword(CrossingEvents),
+                        TraceLoggingUInt8(Kind, "Kind"),
+                        TraceLoggingHexUInt64(Target, "Target"),
+                        TraceLoggingUInt64(Time.count(), "Nanoseconds"));
+    }
+
+    CrossingStats &Stats;
+    KindTy Kind;
+    uint64_t Target;
+    bool Sampled = false;
+    GuestTimes::ModeTy Mode;
+    std::chrono::steady_clock::time_point Start;
+  };
+
+  CrossingStats(DynamicLoader &Dyld, TraceBuffer &Trace)
+      : Dyld(Dyld), Trace(Trace) {}
+  CrossingStats(const CrossingStats &) = delete;
+
+  void record(KindTy Kind, uint64_t Target, std::chrono::nanoseconds Time);
+  // Writes all statistics as CSV into `Path` and counts of calls of wrapped
+  // functions in the format of HeadersAnalyzer's `wrapper_profile.txt` next to
+  // it (with extension `.txt`). Returns `false` on failure.
+  bool write(const std::string &Path);
+  // Writes statistics to the `profile` cache folder.
+  bool write();
+  // Returns up to `Count` wrapped functions (named like in `write`) with the
+  // most calls since the previous call of this, hottest first. Used by the
+  // performance overlay of `IpaSimApp`.
+  std::vector<std::pair<std::string, uint64_t>> takeHottest(size_t Count);
+  // Remembers that native function `Target` was called by emulated code.
+  void cover(uint64_t Target);
+  // Adds names of covered functions to list in the format of HeadersAnalyzer's
+  // `wrapper_coverage.txt` at `Path`, so that the list is a union of all runs
+  // that wrote to it. Returns `false` on failure.
+  bool writeCoverage(const std::string &Path);
+  // Writes the list into the `profile` cache folder.
+  bool writeCoverage();
+
+private:
+  struct Entry {
+    uint64_t Count = 0;
+    std::chrono::nanoseconds Total{0};
+    uint64_t Histogram[Buckets] = {};
+
+    void add(const Entry &Other) {
+      Count += Other.Count;
+      Total += Other.Total;
+      for (size_t I = 0; I != Buckets; ++I)
+        Histogram[I] += Other.Histogram[I];
+    }
+  };
+  // Entries are keyed by `KindTy` in the upper half and address in the lower.
+  struct Table {
+    std::mutex Mutex;
+    std::unordered_map<uint64_t, Entry> Entries;
+  };
+
+  Table &getTable();
+  // Merges tables of all threads.
+  std::unordered_map<uint64_t, Entry> merge();
+  // Returns name of function at `Addr` as used by HeadersAnalyzer.
+  std::string getName(uint64_t Addr);
+
+  DynamicLoader &Dyld;
+  TraceBuffer &Trace;
+  std::mutex Mutex, WriteMutex;
+  std::vector<std::unique_ptr<Table>> Tables;
+  // Counts seen by the previous `takeHottest`, guarded by `WriteMutex`.
+  std::unordered_map<uint64_t, uint64_t> HotCounts;
+  std::mutex CoverageMutex; // Guards `Covered`
+  std::unordered_set<uint64_t> Covered;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_CROSSING_STATS_HPP)
+#endif
@@ -7,14 +7,32 @@
 #include "ipasim/HAContext.hpp"
 #include "ipasim/LLDBHelper.hpp"
 #include "ipasim/LLVMHelper.hpp"
+#include "ipasim/ObjCHelper.hpp"
+#include "ipasim/PDBHelper.hpp"
+#include "ipasim/TaskGraph.hpp"
 
 #include <CodeGen/CodeGenModule.h>
 #include <filesystem>
+#include <llvm/Object/COFF.h>
+#include <llvm/Object/ObjectFile.h>
+#include <memory>
+#include <optional>
 #include <set>
 #include <string>
 
 namespace ipasim {
 
+// Contents of a `.dll` (and its PDB) read before it's analyzed. Reading doesn't
+// touch `HAContext`, so it can be done for multiple DLLs in parallel. See
+// `DLLHelper::read`.
+struct DLLInput {
+  llvm::object::OwningBinary<llvm::object::ObjectFile> Binary;
+  // `nullptr` if the `.dll` couldn't be loaded.
+  llvm::object::COFFObjectFile *COFF = nullptr;
+  ObjCScoutResults ObjC;
+  PDBHelper PDB;
+};
+
 // Represents one `.dll` file that can be either analyzed or have its wrapper
 // generated.
 class DLLHelper {
@@ -26,10 +44,21 @@ public:
         DLLPathStr(DLLPath.string()) {}
 
   // Analyzes the `.dll` and populates `HAContext` with information retrieved.
+  // Its PDB is loaded into LLDB, which is needed for `TypeComparer`.
   void load(LLDBHelper &LLDB, ClangHelper &Clang,
             clang::CodeGen::CodeGenModule *CGM);
-  // Generates wrappers associated with the `.dll`.
-  void generate(const DirContext &DC, bool Debug);
+  // Reads the `.dll`, its Objective-C metadata and also its PDB if `ReadPDB` is
+  // `true` (using `PDBHelper`). See also `DLLEntry::ExportsOnly`.
+  void read(DLLInput &Input, bool ReadPDB) const;
+  // Like the first method, but uses `Input` already read by `read`.
+  void load(const DLLInput &Input);
+  // Generates wrappers associated with the `.dll`. Their compilation and
+  // linking is scheduled in `Tasks`.
+  void generate(const DirContext &DC, TaskGraph &Tasks);
+  // Generates `WrapperIndex` and schedules linking of the wrapper DLL. Must be
+  // called after all Dylibs are linked, so that offsets of their wrappers are
+  // known.
+  void link(const DirContext &DC, bool Debug, TaskGraph &Tasks);
   // Helper method that can invoke one of the methods above on multiple DLLs.
   template <typename... ArgTys, typename FTy = void(ArgTys...)>
   static void forEach(HAContext &HAC, LLVMHelper &LLVM, FTy DLLHelper::*Func,
@@ -42,6 +71,9 @@ public:
   }
 
 private:
+  // Analyzes named exports of a DLL without PDB. See `DLLEntry::ExportsOnly`.
+  void analyzeExportTable();
+
   HAContext &HAC;
   LLVMHelper &LLVM;
   DLLGroup &Group;
@@ -52,8 +84,17 @@ private:
   std::string DLLPathStr;
   std::set<uint32_t> Exports;
 
+  std::string getPDBPath() const;
+  // Analyzes exports and Objective-C methods of the `.dll`. Functions from its
+  // PDB are analyzed by `AnalyzeFunctions` in between.
+  template <typename FTy>
+  void analyze(const DLLInput &Input, FTy &&AnalyzeFunctions);
   bool analyzeWindowsFunction(const std::string &Name, uint32_t RVA,
                               bool IgnoreDuplicates, ExportPtr &Exp);
+  void checkParamCount(ExportPtr Exp, std::optional<uint32_t> DLLCount);
+  // Sets `ExportEntry::Getter` or `Setter` if machine code of the method is
+  // just a load or store of an ivar.
+  void detectAccessor(const DLLInput &Input, ExportPtr Exp);
 };
 
 } // namespace ipasim
@@ -1,20 +1,40 @@
 // DynamicLoader.hpp: Definition of class `DynamicLoader` and some smaller
-// classes it uses.
+// classes it uses (e.g., `ImageMapping`).
 
 #ifndef IPASIM_DYNAMIC_LOADER_HPP
 #define IPASIM_DYNAMIC_LOADER_HPP
 
 #include "ipasim/Common.hpp"
 #include "ipasim/Emulator.hpp"
+#include "ipasim/GuestArena.hpp"
+#include "ipasim/GuestMemoryMap.hpp"
+#include "ipasim/Hypercalls.hpp"
+#include "ipasim/ImageSnapshot.hpp"
+#include "ipasim/IpaArchive.hpp"
+#include "ipasim/LaunchProfile.hpp"
 #include "ipasim/LoadedLibrary.hpp"
 #include "ipasim/Logger.hpp"
+#include "ipasim/MachOReader.hpp"
+#include "ipasim/MessageCache.hpp"
+#include "ipasim/ObjCPreopt.hpp"
+#include "ipasim/PrelinkCache.hpp"
+#include "ipasim/StartupReport.hpp"
 #include "ipasim/TextBlockStream.hpp"
+#include "ipasim/WrapperIndex.hpp"
 
+#include <atomic>
+#include <deque>
+#include <filesystem>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <stack>
 #include <string>
+#include <string_view>
 #include <unicorn/unicorn.h>
+#include <unordered_map>
 #include <vector>
 
 namespace ipasim {
@@ -25,16 +45,60 @@ struct BinaryPath {
   std::string Path;
   bool Relative; // `true` iff `Path` is relative to install dir
 
-  // Checks whether the binary exists.
+  // Checks whether the binary exists. See also `PackageIndex`.
   bool isFileValid() const;
 };
 
+// Index of files inside directory `gen` of the app package. It's built only
+// once, so that existence checks don't need WinRT calls, which are slow.
+class PackageIndex {
+public:
+  static PackageIndex &get();
+
+  // Returns path with the exact case as in the package or `nullptr` if there
+  // is no such file. `Path` must be relative to the install directory.
+  const std::string *find(const std::string &Path) const;
+  bool isIndexed(const std::string &Path) const;
+  const std::filesystem::path &getInstallDir() const { return InstallDir; }
+
+private:
+  PackageIndex();
+
+  std::filesystem::path InstallDir;
+  std::unordered_map<std::string, std::string> Files; // Lowercase -> real
+};
+
 // Pair of a `LoadedLibrary` and its path.
 struct LibraryInfo {
   const std::string *LibPath;
   LoadedLibrary *Lib;
 };
 
+// Information about an address as returned by `dladdr`.
+struct SymbolInfo {
+  const char *Path;
+  uint64_t Base;
+  const char *Symbol;
+  uint64_t SymbolAddr;
+};
+
+// Memory of one loaded image (see `DynamicLoader::getImageMemory`).
+struct ImageMemory {
+  const std::string *Path;
+  bool DLL;
+  // Committed bytes. Those of `Shared` are still backed by the image file (so
+  // they can be shared with other processes), `Private` ones are not (e.g.,
+  // they were copied or written to).
+  uint64_t Private, Shared;
+  uint64_t ModelBytes; // Segment content LIEF's model keeps a copy of
+};
+
+// DLL wrapper callable via `svc`. See `SysTranslator::handleInterrupt`.
+struct Hypercall {
+  uint32_t Addr;
+  bool Leaf; // See `WrapperInfo::Leaf`.
+};
+
 // Used for dyld-objc integration.
 using _dyld_objc_notify_mapped = void (*)(unsigned count,
                                           const char *const paths[],
@@ -42,12 +106,112 @@ using _dyld_objc_notify_mapped = void (*)(unsigned count,
 using _dyld_objc_notify_init = void (*)(const char *path, const void *mh);
 using _dyld_objc_notify_unmapped = void (*)(const char *path, const void *mh);
 
+// Host memory of one Mach-O image. Its address range is reserved as a
+// placeholder first and then filled piece by piece either with copy-on-write
+// views of the image file or with fresh zero pages.
+class ImageMapping {
+public:
+  ImageMapping() = default;
+  ImageMapping(const ImageMapping &) = delete;
+  ~ImageMapping();
+
+  // Returns address of the reserved range or `0` on failure. The range is
+  // reserved at `Preferred` if it's not zero and the range is free there,
+  // otherwise it's taken from `Arena` if possible.
+  uint64_t reserve(uint64_t Size, GuestArena &Arena, uint64_t Preferred = 0);
+  // Opens the image file, so that its parts can be mapped by `mapView`. For
+  // fat binaries, the best slice is selected as the image (see
+  // `MachOReader::findSlice`). Files inside `.ipa` archives (see `IpaArchive`)
+  // are used directly from the archive if they are stored or decompressed into
+  // a private buffer. Either way, their segments are copied, not mapped.
+  bool open(const std::string &Path);
+  // Returns read-only view of the selected image inside the opened file.
+  const uint8_t *getImageData() { return FileData + ImageOffset; }
+  uint64_t getImageSize() { return ImageSize; }
+  // Returns `true` if the image is only a part of the file.
+  bool isSlice() { return ImageSize != FileSize; }
+  // Returns `true` if the image has been opened from an `.ipa` archive.
+  bool isArchived() { return Archived; }
+  // Maps `Size` bytes of the image starting at `Offset` to `Addr`. Returns
+  // `false` if that's not possible (e.g., because of alignment), in which case
+  // the caller should `commit` the memory and copy the data instead.
+  bool mapView(uint64_t Addr, uint64_t Size, uint64_t Offset);
+  // Backs the given range with zero-filled read-write pages.
+  bool commit(uint64_t Addr, uint64_t Size);
+  // Maps the whole reserved range copy-on-write from `Snap`'s file instead of
+  // the image's segments.
+  bool mapSnapshot(const ImageSnapshot &Snap);
+
+private:
+  // Carves a separate placeholder out of the one containing the given range.
+  bool split(uint64_t Addr, uint64_t Size);
+  bool openArchived(const std::string &Path);
+
+  void *File = nullptr;
+  void *Section = nullptr;
+  void *SnapshotSection = nullptr;
+  const uint8_t *FileData = nullptr;
+  void *Buffer = nullptr; // Decompressed entry of an archive
+  bool Archived = false;
+  uint64_t FileSize = 0;
+  uint64_t ImageOffset = 0, ImageSize = 0;
+  uint64_t Granularity = 0;
+  bool UsePlaceholders = false;
+  std::map<uint64_t, uint64_t> Placeholders; // Start -> size
+};
+
 // Represents our dynamic loader. It tries to resemble the behavior of iOS's
 // `dyld`. The dynamic loader retains information about loaded libraries.
 class DynamicLoader {
 public:
-  DynamicLoader(Emulator &Emu);
+  // Memory is mapped through `Space` only. Engines (there is one for each host
+  // thread) replay the changes before they start emulating.
+  DynamicLoader(GuestMemoryMap &Space);
   LoadedLibrary *load(const std::string &Path);
+  // Like `load`, but takes a reference which is released by `close` (like
+  // `dlopen`). Dylibs loaded by this call (including dependencies) are
+  // unloaded when no references to them are left.
+  LoadedLibrary *open(const std::string &Path);
+  // Releases reference taken by `open` and unloads all Dylibs that aren't
+  // referenced anymore (neither by `open` nor as dependencies of other
+  // libraries). Returns `false` if `Lib` hasn't been opened.
+  bool close(LoadedLibrary *Lib);
+  // Number of libraries unloaded so far. Caches of addresses in other classes
+  // (e.g., `SysTranslator`) compare it to drop stale entries.
+  uint32_t getUnloadCount() {
+    return UnloadCount.load(std::memory_order_acquire);
+  }
+  // Returns `true` if `Addr` was inside a library which was unloaded after
+  // `getUnloadCount` returned `Since`.
+  bool wasUnloaded(uint64_t Addr, uint32_t Since);
+  // These implement `dlopen`, `dlsym` and `dlclose` of emulated code (see
+  // `SysTranslator::handleDyldFunction`). Handles are addresses of headers of
+  // the libraries. Newly loaded Mach-O images are registered with the
+  // Objective-C runtime. `Path` can be `nullptr` for the main binary.
+  uint64_t openHandle(const char *Path, uint32_t Mode);
+  // Finds symbol `Name` (without underscore prefix) using the exports' hash
+  // tables. `Caller` is used by `RTLD_NEXT` and `RTLD_SELF`.
+  uint64_t findExport(uint64_t Handle, const char *Name, uint64_t Caller);
+  bool closeHandle(uint64_t Handle);
+  // Mach-O images in the order they were loaded, as `_dyld_get_image_header`
+  // and friends index them.
+  size_t getImageCount() {
+    std::lock_guard<std::recursive_mutex> Lock(LLsMutex);
+    return Images.size();
+  }
+  // Returns `LibraryInfo` with `nullptr`s if `Index` is out of range.
+  LibraryInfo getImage(size_t Index) {
+    std::lock_guard<std::recursive_mutex> Lock(LLsMutex);
+    return Index < Images.size() ? Images[Index]
+                                 : LibraryInfo{nullptr, nullptr};
+  }
+
+  // Special handles and flags of `<dlfcn.h>`
+  static constexpr uint64_t RTLD_NEXT = uint32_t(-1),
+                            RTLD_DEFAULT = uint32_t(-2),
+                            RTLD_SELF = uint32_t(-3),
+                            RTLD_MAIN_ONLY = uint32_t(-5);
+  static constexpr uint32_t RTLD_NOLOAD = 0x10;
   // Used for dyld-objc integration. Notifies registered listeners that a new
   // library was loaded into memory. Objective-C runtime uses this to initialize
   // the library's classes.
@@ -56,14 +220,129 @@ public:
   void registerHandler(_dyld_objc_notify_mapped Mapped,
                        _dyld_objc_notify_init Init,
                        _dyld_objc_notify_unmapped Unmapped);
+  // Between these calls, `registerMachO` only collects headers. `endBatch`
+  // then notifies handlers about all of them at once. Batches can be nested.
+  void beginBatch();
+  void endBatch();
   // Finds a library that `Addr` is mapped inside.
   LibraryInfo lookup(uint64_t Addr);
+  // Implements `dladdr`. Returns `false` if `Addr` is not inside any library.
+  // `Symbol` is `nullptr` if there is no exported symbol before `Addr`.
+  bool symbolize(uint64_t Addr, SymbolInfo &Info);
+  // Updates `ObjCMethodIndex` of images containing the old and the new
+  // implementation of method `M`. `OldImp` is `0` for new methods. Also
+  // flushes `MessageCache`s.
+  void updateMethod(ObjCMethod M, uint64_t OldImp);
+  // Stores `Imp` into all registered `MessageCache`s.
+  void fillMessageCaches(uint32_t Isa, uint32_t Sel, uint32_t Imp);
+  // Invalidates all entries of all registered `MessageCache`s.
+  void flushMessageCaches();
+  // Rewrites all recorded pointers to `Target` so that they point to
+  // `NewTarget` instead. Returns number of rewritten pointers. See also
+  // `PatchCallSites`.
+  size_t patchCallSites(uint64_t Target, uint64_t NewTarget);
+  size_t getPatchedCallSites() { return PatchedCallSites; }
+  // Returns DLL wrapper with the given hypercall ID. Its `Addr` is zero if
+  // there is no such hypercall registered. Doesn't lock, wrapper DLLs can be
+  // registering their hypercalls meanwhile.
+  Hypercall getHypercall(uint32_t ID) const {
+    if (ID >= Hypercalls::MaxCount)
+      return {0, false};
+    uint64_t Entry = HypercallTable[ID].load(std::memory_order_acquire);
+    return {static_cast<uint32_t>(Entry), (Entry >> 32) != 0};
+  }
+  // Finds `WrapperIndex` inside the given wrapper DLL.
+  const WrapperIndex *getWrapperIndex(LoadedLibrary *Lib);
+  // Returns path of wrapper DLL generated for DLL `Path`.
+  static std::string getWrapperPath(const std::string &Path);
+  // Finds loaded DLL whose wrapper DLL is at `WrapperPath`.
+  LoadedLibrary *getWrappedDLL(const std::string &WrapperPath);
+  // Returns address of the DLL function wrapped by the DLL wrapper at `Addr`
+  // or `0` if there is no wrapper at `Addr`.
+  uint64_t getWrappedFunction(uint64_t Addr);
+  // Returns all loaded libraries in the order they were loaded.
+  std::vector<LibraryInfo> getLibraries();
+  std::vector<ImageMemory> getImageMemory();
+  // Releases LIEF's models which are still kept (those of prefetched binaries
+  // and of loaded ones when `TraceCategory::Loader` is enabled). Prefetched
+  // binaries are parsed again when they are loaded.
+  void trim();
+  // Returns contents of `gen/objc-preopt.bin` (loaded on first use). If there
+  // is no such file, the returned `ObjCPreopt` is empty.
+  const ObjCPreopt &getObjCPreopt();
+  // Finds preoptimized class or protocol. Returns `nullptr` if it's unknown or
+  // its DLL is not loaded.
+  void *findPreoptClass(const char *Name, bool Protocol);
   // Logging helpers
   LogStream::Handler dumpAddr(uint64_t Addr);
   LogStream::Handler dumpAddr(uint64_t Addr, const LibraryInfo &LI);
   LogStream::Handler dumpAddr(uint64_t Addr, const LibraryInfo &LI,
                               ObjCMethod M);
+  // Like `dumpAddr`, but returns the description as a string.
+  std::string describeAddr(uint64_t Addr);
   uint64_t getKernelAddr() { return KernelAddr; }
+  GuestArena &getArena() { return Arena; }
+  StartupReport &getStartupReport() { return Report; }
+  // After `LaunchProfileWindow` seconds, saves images loaded so far and their
+  // touched pages as `LaunchProfile` of app `AppPath`.
+  void recordLaunchProfile(const std::string &AppPath);
+  // Lazy bindings initially lead to `__stub_helper`, which calls
+  // `dyld_stub_binder` bound to this address. See
+  // `SysTranslator::handleStubBinder`.
+  uint64_t getStubBinderAddr() { return KernelAddr + 4; }
+  // Guest heap functions (see `GuestMalloc`) follow the stub binder inside the
+  // "kernel" page. See `SysTranslator::handleGuestMalloc`. They are followed by
+  // string functions (see `NativeStringFunctions`), `libdyld` functions (see
+  // `SysTranslator::handleDyldFunction`), thread-specific data functions (see
+  // `NativeTSD`) and spin lock functions (see `NativeSpinLocks`).
+  enum class KernelFunction : uint32_t {
+    Malloc = 8,
+    Calloc = 12,
+    Realloc = 16,
+    Free = 20,
+    Memcpy = 24,
+    Memmove = 28,
+    Memset = 32,
+    Bzero = 36,
+    Strlen = 40,
+    Strcmp = 44,
+    Memcmp = 48,
+    Dlopen = 52,
+    Dlsym = 56,
+    Dlclose = 60,
+    Dlerror = 64,
+    Dladdr = 68,
+    ImageCount = 72,
+    ImageHeader = 76,
+    ImageSlide = 80,
+    ImageName = 84,
+    Getspecific = 88,
+    Setspecific = 92,
+    KeyCreate = 96,
+    KeyDelete = 100,
+    SpinLockLock = 104,
+    SpinLockTry = 108,
+    SpinLockUnlock = 112,
+    UnfairLock = 116,
+    UnfairTrylock = 120,
+    UnfairUnlock = 124,
+  };
+  uint64_t getKernelFunctionAddr(KernelFunction F) {
+    return KernelAddr + static_cast<uint32_t>(F);
+  }
+  // ARM code that calls a guest function for each argument tuple of a frame
+  // (see `SysTranslator::callBackBatch`). It lives in its own executable page.
+  uint64_t getBatchStubAddr() { return BatchStubAddr; }
+  bool isKernelAddr(uint64_t Addr) {
+    return KernelAddr <= Addr && Addr < KernelAddr + PageSize;
+  }
+  // Returns address of symbol `Name` if it's implemented by the emulator,
+  // `0` otherwise.
+  uint64_t findKernelSymbol(std::string_view Name);
+  // Binds lazy pointer described at `Offset` in lazy binding info of the
+  // library containing `ImageAddr`. Returns the bound address or `0` on
+  // failure. Inspired by `ImageLoaderMachOCompressed::doBindFastLazySymbol`.
+  uint64_t bindLazySymbol(uint64_t ImageAddr, uint32_t Offset);
   static constexpr uint64_t alignToPageSize(uint64_t Addr) {
     return Addr & (-PageSize);
   }
@@ -79,22 +358,142 @@ private:
     _dyld_objc_notify_init Init;
     _dyld_objc_notify_unmapped Unmapped;
   };
+  // Library referenced by some binding and its symbols resolved so far.
+  struct ResolvedLibrary {
+    std::string_view Name;
+    LoadedLibrary *Lib = nullptr;
+    std::unordered_map<std::string_view, uint64_t> Symbols;
+  };
 
-  bool canSegmentsSlide(LIEF::MachO::Binary &Bin);
+  bool canSegmentsSlide(const MachOInfo &Info);
   BinaryPath resolvePath(const std::string &Path);
+  // Parses the library at `BP` and all its dependencies on multiple threads.
+  // See `ParallelLoading`.
+  void prefetch(const BinaryPath &BP);
   LoadedLibrary *loadMachO(const std::string &Path);
+  void readMachO(LIEF::MachO::Binary &Bin, MachOInfo &Info);
+  // Binds symbols of `Lib` as recorded in `Cache`.
+  bool applyPrelinkCache(LoadedDylib *Lib, const PrelinkCache &Cache);
+  // Checks that bindings in `Snap` are still valid.
+  bool canReuseBindings(const ImageSnapshot &Snap);
+  void saveSnapshot(LoadedDylib *Lib, const std::string &Path,
+                    const PrelinkCache &Cache);
+  // Releases what's needed only while loading `Lib` (e.g., LIEF's model).
+  void compact(LoadedDylib *Lib, const std::string &Path);
   LoadedLibrary *loadPE(const std::string &Path);
-  void handleMachOs(size_t HdrOffset, size_t HandlerOffset);
+  const ExportTable *findExportTable(LoadedDll *Lib, const std::string &Path);
+  // Notifies handlers starting at `HandlerOffset` about headers `Hdrs[HdrBegin]`
+  // to `Hdrs[HdrEnd - 1]`.
+  void handleMachOs(size_t HdrBegin, size_t HdrEnd, size_t HandlerOffset);
+  // Notifies all handlers about headers registered since the last call.
+  void notifyPending();
+  void recordCallSite(uint32_t *Site);
+  // Finds (or loads) library `LibName`. The returned reference stays valid.
+  ResolvedLibrary &resolveLibrary(const std::string &LibName);
+  uint64_t resolveSymbol(ResolvedLibrary &RL, std::string_view SymName);
+  uint64_t resolveSymbol(const std::string &LibName,
+                         std::string_view SymName) {
+    return resolveSymbol(resolveLibrary(LibName), SymName);
+  }
+  // Returns a copy of `S` which lives as long as the loader.
+  std::string_view intern(std::string_view S);
+  void registerRange(const std::string &Path, LoadedLibrary *Lib);
+  // Makes `Snapshot` of the current `LLs` and `Ranges` visible to readers. Must
+  // be called with `LLsMutex` locked and no library being loaded.
+  void publish();
+  // Frees `Retired` snapshots if no thread can be reading them. Must be called
+  // with `LLsMutex` locked.
+  void reclaim();
+  void addResidentRanges(const LoadedDylib::SegmentFile &Seg,
+                         std::vector<LaunchProfile::Range> &Ranges);
+  // Returns library with handle `Handle` (see `openHandle`) or `nullptr`.
+  LoadedLibrary *findHandle(uint64_t Handle);
+  LoadedLibrary *findMainBinary();
+  // Returns paths of libraries that loaded Dylibs depend on.
+  std::set<std::string> getDependencies();
+  // Notifies handlers, drops all index entries and caches pointing into the
+  // library at `Path` and frees its memory.
+  void unload(const std::string &Path);
+  void registerHypercalls(LoadedLibrary *Lib);
+  void registerMessageCache(LoadedLibrary *Lib);
 
   static constexpr int R_SCATTERED = 0x80000000; // From `<mach-o/reloc.h>`
-  Emulator &Emu;
+  GuestMemoryMap &Space;
+  GuestArena Arena;
+  StartupReport Report;
   uint64_t KernelAddr;
+  uint64_t BatchStubAddr;
   // Loaded libraries and their paths
   std::map<std::string, std::unique_ptr<LoadedLibrary>> LLs;
+  // Loaded libraries indexed by their end addresses (see `lookup`)
+  std::map<uint64_t, LibraryInfo> Ranges;
+  std::vector<LibraryInfo> LoadOrder;
+  std::vector<LibraryInfo> Images; // Those of `LoadOrder` with `hasMachO`
+  // Symbols found by `findExport` in all libraries. Cleared by `unload`.
+  std::unordered_map<std::string, uint64_t> GlobalSymbols;
+  // Guards `LLs` and `Ranges`, libraries can be loaded and looked up from any
+  // thread.
+  std::recursive_mutex LLsMutex;
+  // Immutable copy of the indexes above, so that `lookup` and `load` of
+  // libraries which are already loaded don't have to lock `LLsMutex`. A new
+  // one is published whenever the outermost `load` finishes or a library is
+  // removed and the replaced one is freed once no thread can be reading it
+  // (RCU-style). Libraries being loaded are only in `LLs` and `Ranges`, so
+  // other threads have to wait for them with `LLsMutex` locked.
+  struct Snapshot {
+    struct Range {
+      uint64_t Start, End;
+      LibraryInfo Info;
+    };
+    std::vector<Range> Ranges; // Ordered by end addresses
+    // Paths of libraries that are completely loaded. They are copied, because
+    // keys of `LLs` are freed when their library is unloaded.
+    std::unordered_map<std::string, LoadedLibrary *> Paths;
+  };
+  std::unique_ptr<Snapshot> Current; // Owns `Published`
+  std::atomic<const Snapshot *> Published = nullptr;
+  // Counts the current thread as a reader of `Published` while it exists.
+  struct SnapshotReader {
+    DynamicLoader &DL;
+    SnapshotReader(DynamicLoader &DL) : DL(DL) { ++DL.Readers; }
+    ~SnapshotReader();
+  };
+  std::atomic<uint32_t> Readers = 0; // Number of threads using `Published`
+  std::vector<std::unique_ptr<Snapshot>> Retired; // Freed when `!Readers`
+  std::atomic<bool> HasRetired = false;           // `!Retired.empty()`
+  // Mach-O binaries parsed by `prefetch` that haven't been loaded yet. Its
+  // worker threads don't hold `LLsMutex`, so it has its own lock.
+  std::mutex PrefetchedMutex;
+  std::map<std::string, std::unique_ptr<LIEF::MachO::FatBinary>> Prefetched;
+  // Nesting of `load` calls. It's read without `LLsMutex` by `lookup`.
+  std::atomic<size_t> LoadDepth = 0;
+  size_t OpenDepth = 0; // Nesting of `open` calls
+  // Address ranges of unloaded libraries, in order of unloading
+  std::vector<std::pair<uint64_t, uint64_t>> UnloadedRanges;
+  std::atomic<uint32_t> UnloadCount = 0; // Size of `UnloadedRanges`
+  // Symbols resolved by any binary, indexed by install names of their
+  // libraries. Both keys and symbol names are interned, so they can be looked
+  // up without allocating. Also guarded by `LLsMutex`.
+  std::unordered_map<std::string_view, ResolvedLibrary> ResolvedLibraries;
+  std::deque<std::string> InternedNames;
   // These are used for dyld-objc integration:
   std::vector<const void *> Hdrs; // Registered headers
   std::set<uintptr_t> HdrSet;     // Set of registered headers for faster lookup
   std::vector<MachOHandler> Handlers; // Registered handlers
+  size_t NotifiedHdrs = 0; // Prefix of `Hdrs` that handlers know about
+  size_t BatchDepth = 0;   // See `beginBatch`
+  // Bound pointers indexed by their values (used only if `PatchCallSites` is
+  // enabled).
+  std::map<uint64_t, std::vector<uint32_t *>> CallSites;
+  size_t PatchedCallSites = 0;
+  std::once_flag PreoptLoaded;
+  std::vector<uint8_t> PreoptData;
+  ObjCPreopt Preopt;
+  // Indexed by hypercall IDs. Entries are `Hypercall::Addr` with
+  // `Hypercall::Leaf` in bit 32, so that each is published by one store.
+  std::unique_ptr<std::atomic<uint64_t>[]> HypercallTable{
+      new std::atomic<uint64_t>[Hypercalls::MaxCount]()};
+  std::vector<MessageCache *> MessageCaches; // Also guarded by `LLsMutex`
 };
 
 } // namespace ipasim
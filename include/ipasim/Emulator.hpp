@@ -1,14 +1,21 @@
-// Emulator.hpp: Definition of class `Emulator`.
+// Emulator.hpp: Definition of classes `Emulator` and `HookHandle`.
 
 #ifndef IPASIM_EMULATOR_HPP
 #define IPASIM_EMULATOR_HPP
 
+#include "ipasim/CPUBackend.hpp"
+#include "ipasim/GuestMemoryMap.hpp"
+
+#include <cstddef>
+#include <memory>
 #include <unicorn/unicorn.h>
 #include <utility>
+#include <vector>
 
 namespace ipasim {
 
 class DynamicLoader;
+class Emulator;
 
 namespace hooks {
 
@@ -28,47 +35,147 @@ struct FunctionHelper<T, RetTy(ArgTys...)> {
     auto *D = reinterpret_cast<DataTy *>(Data);
     return (D->Instance->*(D->Handler))(Args...);
   }
+  static void freeData(void *Data) { delete reinterpret_cast<DataTy *>(Data); }
 };
 
 } // namespace hooks
 
-// Wraps an instance of the Unicorn emulator. Automatically reports errors.
+// Owns a hook installed by `Emulator::hook`. The hook is removed (and its data
+// freed) when the handle is destroyed or reset. Note that hooks shouldn't be
+// removed from inside of hooks.
+class HookHandle {
+public:
+  HookHandle() = default;
+  HookHandle(Emulator *Emu, size_t Hook, void *Data, void (*FreeData)(void *))
+      : Emu(Emu), Hook(Hook), Data(Data), FreeData(FreeData) {}
+  HookHandle(const HookHandle &) = delete;
+  HookHandle(HookHandle &&H) { *this = std::move(H); }
+  ~HookHandle() { reset(); }
+
+  HookHandle &operator=(const HookHandle &) = delete;
+  HookHandle &operator=(HookHandle &&H) {
+    if (this != &H) {
+      reset();
+      std::swap(Emu, H.Emu);
+      std::swap(Hook, H.Hook);
+      std::swap(Data, H.Data);
+      std::swap(FreeData, H.FreeData);
+    }
+    return *this;
+  }
+  explicit operator bool() const { return Emu; }
+  void reset();
+
+private:
+  Emulator *Emu = nullptr;
+  size_t Hook = 0;
+  void *Data = nullptr;
+  void (*FreeData)(void *) = nullptr;
+};
+
+// Wraps an instance of `CPUBackend` (see `CPUBackend::getDefault`), keeping
+// its memory in sync with the shared `GuestMemoryMap`. Automatically reports
+// errors.
 class Emulator {
 public:
-  Emulator(DynamicLoader &Dyld)
-      : UC(initUC()), Dyld(Dyld), IgnoreError(false) {}
+  Emulator(DynamicLoader &Dyld, GuestMemoryMap &Space)
+      : Backend(initBackend()), Dyld(Dyld), Space(Space), SyncedChanges(0),
+        IgnoreError(false) {
+    initMemory();
+  }
   Emulator(const Emulator &) = delete;
   Emulator(Emulator &&E)
-      : UC(nullptr), Dyld(E.Dyld), IgnoreError(E.IgnoreError) {
-    std::swap(UC, E.UC);
-  }
-  ~Emulator();
+      : Backend(std::move(E.Backend)), Dyld(E.Dyld), Space(E.Space),
+        SyncedChanges(E.SyncedChanges), IgnoreError(E.IgnoreError) {}
 
   uint32_t readReg(uc_arm_reg RegId);
   void writeReg(uc_arm_reg RegId, uint32_t Value);
+  // Like `readReg` and `writeReg`, but access `Count` registers with only one
+  // call into Unicorn.
+  void readRegs(const uc_arm_reg *RegIds, uint32_t *Values, size_t Count);
+  void writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                 size_t Count);
+  template <size_t N>
+  void readRegs(const uc_arm_reg (&RegIds)[N], uint32_t (&Values)[N]) {
+    readRegs(RegIds, Values, N);
+  }
+  template <size_t N>
+  void writeRegs(const uc_arm_reg (&RegIds)[N], const uint32_t (&Values)[N]) {
+    writeRegs(RegIds, Values, N);
+  }
+  // Maps memory into this engine and records the mapping in the shared
+  // `GuestMemoryMap`, so that other engines map it, too. Parts that are
+  // already mapped only get protection `Perms`.
   void mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms);
-  void start(uint64_t Addr);
+  // Like `mapMemory`, but used when guest code faults at `Addr` inside host
+  // memory. Maps the part of range from `Start` to `End` around `Addr` which
+  // doesn't overlap any existing region, so that neighbouring regions abut.
+  void mapHostMemory(uint64_t Addr, uint64_t Start, uint64_t End,
+                     uc_prot Perms);
+  // Unmaps whole pages of the given range from all engines.
+  void unmapMemory(uint64_t Addr, uint64_t Size);
+  // Applies changes of memory map made by other engines. Returns `true` if
+  // anything was changed.
+  bool syncMemory();
+  // Returns PC with the lowest bit set in Thumb mode, like return addresses in
+  // LR, so that it can be passed to `start`.
+  uint32_t readPC();
+  // Starts emulation at `Addr`. If its lowest bit is set, code is executed in
+  // Thumb mode, otherwise in ARM mode (like after `bx`). If `Count` is not
+  // zero, at most that many instructions are executed. Returns `false` if
+  // emulation failed.
+  bool start(uint64_t Addr, size_t Count = 0);
   void stop();
+  // Translates code at `Addr` ahead of time (see `CPUBackend::translate`).
+  // Returns `false` if the backend doesn't support that.
+  bool translate(uint64_t Addr);
+  // Saves and restores CPU state, see `SysTranslator::spawn`.
+  CPUContext *allocContext();
+  void saveContext(CPUContext *Ctx);
+  void restoreContext(CPUContext *Ctx);
+  void freeContext(CPUContext *Ctx);
+  CPUBackend::Kind getBackendKind() const { return Backend->getKind(); }
+  // Installs a hook active for addresses from `Begin` to `End` (inclusive, all
+  // addresses if `Begin > End`). It's removed when the returned handle dies.
+  // The handle is empty if the backend doesn't support hooks of `Type`.
   template <typename F>
-  void hook(uc_hook_type Type, F *Handler, void *Instance) {
-    hook(Type, reinterpret_cast<void *>(Handler), Instance);
+  [[nodiscard]] HookHandle hook(uc_hook_type Type, F *Handler, void *Instance,
+                                uint64_t Begin = 1, uint64_t End = 0) {
+    return hook(Type, reinterpret_cast<void *>(Handler), Instance, Begin, End);
   }
-  void hook(uc_hook_type Type, void *Handler, void *Instance);
+  [[nodiscard]] HookHandle hook(uc_hook_type Type, void *Handler,
+                                void *Instance, uint64_t Begin = 1,
+                                uint64_t End = 0,
+                                void (*FreeData)(void *) = nullptr);
   template <typename T, typename F>
-  void hook(uc_hook_type Type, F T::*Handler, T *Instance) {
+  [[nodiscard]] HookHandle hook(uc_hook_type Type, F T::*Handler, T *Instance,
+                                uint64_t Begin = 1, uint64_t End = 0) {
     using Helper = hooks::FunctionHelper<T, F>;
-    hook(Type, Helper::hook, new typename Helper::DataTy{Instance, Handler});
+    return hook(Type, reinterpret_cast<void *>(Helper::hook),
+                new typename Helper::DataTy{Instance, Handler}, Begin, End,
+                Helper::freeData);
   }
   // Won't report the next error.
   void ignoreNextError();
 
+  // Maximum number of registers accessed by `readRegs` or `writeRegs`
+  static constexpr size_t MaxBatch = 16;
+  // Registers used to pass arguments
+  static constexpr uc_arm_reg ArgRegs[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                           UC_ARM_REG_R2, UC_ARM_REG_R3};
+
 private:
-  uc_engine *UC;
+  friend class HookHandle;
+
+  std::unique_ptr<CPUBackend> Backend;
   DynamicLoader &Dyld;
+  GuestMemoryMap &Space;
+  size_t SyncedChanges; // Number of changes from `Space` applied to `UC`
   bool IgnoreError;
 
-  static uc_engine *initUC();
-  static void callUCStatic(uc_err Err);
+  static std::unique_ptr<CPUBackend> initBackend();
+  void initMemory();
+  bool syncMemoryLocked();
   void callUC(uc_err Err);
 };
 
@@ -0,0 +1,65 @@
+// EventProvider.hpp: Definition of class `EventProvider`.
+
+#ifndef IPASIM_EVENT_PROVIDER_HPP
+#define IPASIM_EVENT_PROVIDER_HPP
+
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+#include <TraceLoggingActivity.h>
+#include <TraceLoggingProvider.h>
+#include <cstdint>
+#include <winmeta.h>
+
+// ETW provider `IpaSim` ({d3b39fb1-bcf6-4dc2-ac33-5e1f72d11d4b}).
+TRACELOGGING_DECLARE_PROVIDER(IpaSimProvider);
+
+namespace ipasim {
+
+// Keywords of `IpaSimProvider`'s events, so that sessions (e.g., of WPR) can
+// choose which of them they want.
+enum EventKeyword : uint64_t {
+  LoaderEvents = 0x1,    // Activities `LoadImage`
+  EmulationEvents = 0x2, // Activities `Emulation` (one per `execute`)
+  CrossingEvents = 0x4,  // Events `Crossing` (see `EtwCrossingSampling`)
+  CallbackEvents = 0x8,  // Activities `Callback` (native calling guest code)
+  FaultEvents = 0x10,    // Events `FaultMapping` (see `handleMemUnmapped`)
+  ObjCEvents = 0x20,     // Activities `ObjCMapImages`
+};
+
+template <EventKeyword Keyword>
+using EventActivity =
+    TraceLoggingActivity<IpaSimProvider, Keyword, WINEVENT_LEVEL_INFO>;
+
+// Registers `IpaSimProvider` for the lifetime of `IpaSimulator`, so that guest
+// activity can be seen alongside native CPU, disk and GPU activity in tools
+// like WPA. Events are written by `TraceLoggingWrite*` macros right where they
+// happen. See `EtwEvents`.
+class EventProvider {
+public:
+  EventProvider();
+  EventProvider(const EventProvider &) = delete;
+  ~EventProvider();
+
+  static bool isEnabled(EventKeyword Keyword) {
+    return TraceLoggingProviderEnabled(IpaSimProvider, WINEVENT_LEVEL_INFO,
+                                       Keyword);
+  }
+  // Returns `true` for every `EtwCrossingSampling`-th crossing of the current
+  // thread while `CrossingEvents` are enabled. Never if it's `0`.
+  static bool sampleCrossing() {
+    if constexpr (EtwCrossingSampling == 0)
+      return false;
+    else {
+      if (!isEnabled(CrossingEvents))
+        return false;
+      thread_local uint32_t Counter = 0;
+      return ++Counter % EtwCrossingSampling == 0;
+    }
+  }
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_EVENT_PROVIDER_HPP)
+#endif
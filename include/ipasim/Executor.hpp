@@ -0,0 +1,62 @@
+// Executor.hpp: Definition of class `Executor`.
+
+#ifndef IPASIM_EXECUTOR_HPP
+#define IPASIM_EXECUTOR_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ipasim {
+
+// Pool of worker threads with pre-warmed emulator contexts (see
+// `IpaSimulator::sys`) onto which work dispatched to libdispatch queues is
+// mapped. Idle workers steal tasks from busy ones, except for tasks of serial
+// queues, which always run on the same worker, so that they stay ordered.
+class Executor {
+public:
+  Executor() = default;
+  Executor(const Executor &) = delete;
+  ~Executor();
+
+  // Schedules call `Func(Ctx)`, where `Func` can be either emulated or native.
+  // Tasks with the same non-null `SerialKey` are executed one after another in
+  // order of submission. Starts the workers if not already running.
+  void async(void *Func, void *Ctx, const void *SerialKey = nullptr);
+  size_t getWorkerCount() const { return Workers.size(); }
+
+private:
+  struct Task {
+    void *Func;
+    void *Ctx;
+  };
+  struct Worker {
+    std::mutex Mutex;
+    std::deque<Task> Tasks;  // Can be stolen by other workers
+    std::deque<Task> Serial; // Tasks of serial queues bound to this worker
+    std::thread Thread;
+  };
+
+  void start();
+  void run(size_t Index);
+  bool pop(Worker &W, Task &T);
+  bool steal(size_t Thief, Task &T);
+  void push(Worker &W, Task T, bool Serial);
+
+  std::once_flag Started;
+  std::vector<std::unique_ptr<Worker>> Workers;
+  std::atomic<size_t> NextWorker = 0; // For round-robin submission
+  std::atomic<bool> Stopping = false;
+  std::mutex WakeMutex;
+  std::condition_variable Wake;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_EXECUTOR_HPP)
+#endif
@@ -0,0 +1,56 @@
+// ExportTable.hpp: Definition of struct `ExportTable`.
+
+#ifndef IPASIM_EXPORT_TABLE_HPP
+#define IPASIM_EXPORT_TABLE_HPP
+
+#include "ipasim/Common.hpp"
+
+#include <cstdint>
+#include <string_view>
+
+namespace ipasim {
+
+// Hash table of symbols exported by name from an original DLL. It's generated
+// by `HeadersAnalyzer` into the DLL's wrapper DLL (as constant data exported as
+// `Symbol`, like `WrapperIndex`), so that `LoadedDll::findSymbol` doesn't have
+// to search the PE export directory by name. Collisions are resolved by linear
+// probing, there are always at least twice as many buckets as symbols.
+struct ExportTable {
+  static constexpr ConstexprString Symbol = "$__ipaSim_exportTable";
+  static constexpr uint32_t NotFound = static_cast<uint32_t>(-1);
+  // RVA recorded for forwarded exports. They are resolved by `GetProcAddress`.
+  static constexpr uint32_t Forwarded = 0;
+
+  uint32_t TimeDateStamp;  // Of the DLL the table was generated from
+  uint32_t Mask;           // Number of buckets minus one
+  const uint32_t *Buckets; // Indices into the arrays below or `NotFound`
+  const uint32_t *Hashes;
+  const char *const *Names;
+  const uint32_t *RVAs;
+
+  // FNV-1a
+  static constexpr uint32_t hash(std::string_view Name) {
+    uint32_t Hash = 0x811C9DC5;
+    for (char C : Name) {
+      Hash ^= static_cast<uint8_t>(C);
+      Hash *= 0x1000193;
+    }
+    return Hash;
+  }
+  // Returns RVA of symbol `Name`, `Forwarded` or `NotFound`.
+  uint32_t find(std::string_view Name) const {
+    uint32_t Hash = hash(Name);
+    for (uint32_t B = Hash & Mask;; B = (B + 1) & Mask) {
+      uint32_t I = Buckets[B];
+      if (I == NotFound)
+        return NotFound;
+      if (Hashes[I] == Hash && Name == Names[I])
+        return RVAs[I];
+    }
+  }
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_EXPORT_TABLE_HPP)
+#endif
@@ -0,0 +1,92 @@
+// FrameStats.hpp: Definition of class `FrameStats`.
+
+#ifndef IPASIM_FRAME_STATS_HPP
+#define IPASIM_FRAME_STATS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <winrt/base.h>
+
+namespace ipasim {
+
+// Measures what users of the app notice: time from the start of loading until
+// UIKit has been launched (see `runBinary`, also measured without UI) and until
+// XAML renders the first frame after that, then pacing of frames and durations
+// of turns of the guest's main run loop (see `UIDispatcher::runEmulation`).
+// Frames are seen by a handler of `CompositionTarget::Rendering` registered by
+// `attach`. It's removed after the first frame unless pacing is tracked (see
+// `track`, enabled by the stats overlay of `IpaSimApp`), so that it doesn't run
+// on every frame otherwise. Percentiles are computed from the last `MaxSamples`
+// durations, hitches (i.e., durations of at least `HitchTime`) are counted over
+// the whole run. See `ipaSim_getStats`.
+class FrameStats {
+public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr size_t MaxSamples = 4096;
+  static constexpr auto HitchTime = std::chrono::milliseconds(50);
+
+  struct Percentiles {
+    uint64_t P50 = 0, P95 = 0, P99 = 0; // In microseconds
+  };
+
+  // Durations of one kind of periodic event.
+  class Series {
+  public:
+    void add(Clock::duration Time);
+    // Returns zeros if nothing has been added yet.
+    Percentiles getPercentiles();
+    uint64_t getCount();
+    uint64_t getHitches();
+
+  private:
+    std::mutex Mutex;
+    std::array<uint32_t, MaxSamples> Samples = {}; // Microseconds, a ring
+    uint64_t Count = 0, Hitches = 0;
+  };
+
+  // Should be called when loading of the app starts. Only the first call has
+  // any effect.
+  void start();
+  // Should be called once UIKit has been launched, frames after that show
+  // guest content.
+  void launched();
+  // Registers the `Rendering` handler until the first frame. Must be called on
+  // the UI thread of a XAML app. Only the first call has any effect.
+  void attach();
+  // Starts or stops measuring intervals between frames. Must be called on the
+  // UI thread.
+  void track(bool Enable);
+  void turn(Clock::duration Time) { Turns.add(Time); }
+  // Returns microseconds from `start` to the launch or `0` if it hasn't
+  // finished yet.
+  uint64_t getLaunch() const { return Launch.load(std::memory_order_relaxed); }
+  // Returns microseconds from `start` to the first frame with guest content or
+  // `0` if there hasn't been any yet.
+  uint64_t getFirstFrame() const {
+    return FirstFrame.load(std::memory_order_relaxed);
+  }
+
+  Series Frames; // Intervals between frames
+  Series Turns;
+
+private:
+  void frame();
+  void listen(bool Enable);
+
+  std::atomic<bool> Started = false, Launched = false, Attached = false;
+  Clock::time_point Start;
+  std::atomic<uint64_t> Launch = 0, FirstFrame = 0;
+  // Used only by the UI thread.
+  Clock::time_point LastFrame;
+  bool Tracking = false;
+  winrt::event_token Token = {};
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_FRAME_STATS_HPP)
+#endif
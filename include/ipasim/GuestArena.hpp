@@ -0,0 +1,52 @@
+// GuestArena.hpp: Definition of class `GuestArena`.
+
+#ifndef IPASIM_GUEST_ARENA_HPP
+#define IPASIM_GUEST_ARENA_HPP
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+namespace ipasim {
+
+// Range of address space reserved up front, where memory visible to the
+// emulated code (images, stacks and the kernel page) is allocated next to each
+// other, so that the layout is the same on every run. The range is reserved as
+// one placeholder and parts of it are split off on demand, so nothing is
+// committed until it is allocated. See also `ArenaSize`. Ranges given back by
+// `recycle` (e.g., those of unloaded images) are reused by later reservations.
+class GuestArena {
+public:
+  GuestArena() = default;
+  GuestArena(const GuestArena &) = delete;
+
+  // Splits off a placeholder of `Size` bytes, which is rounded up to
+  // allocation granularity. Returns its address or `0` if the arena is not
+  // available or it is full, in which case the caller should allocate the
+  // memory elsewhere.
+  uint64_t reserve(uint64_t &Size);
+  // Like `reserve`, but the memory is committed as read-write.
+  void *allocate(uint64_t Size);
+  // Like `reserve`, but the placeholder is replaced by a normal reservation,
+  // parts of which can be committed later using `VirtualAllocFromApp`.
+  void *allocateReserved(uint64_t Size);
+  // Returns `true` if `Addr` was reserved from the arena.
+  bool contains(uint64_t Addr);
+  // Makes range returned by `reserve` available again. It must be a single
+  // placeholder by now.
+  void recycle(uint64_t Addr, uint64_t Size);
+
+private:
+  void initialize();
+
+  std::once_flag Initialized;
+  std::mutex Mutex; // Guards `Next` and `Recycled`
+  uint64_t Begin = 0, Next = 0, End = 0;
+  std::map<uint64_t, uint64_t> Recycled; // Start -> size
+  uint64_t Granularity = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_ARENA_HPP)
+#endif
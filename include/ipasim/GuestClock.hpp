@@ -0,0 +1,105 @@
+// GuestClock.hpp: Definition of classes `GuestClock` and `GuestTimes`.
+
+#ifndef IPASIM_GUEST_CLOCK_HPP
+#define IPASIM_GUEST_CLOCK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <thread>
+
+namespace ipasim {
+
+class GuestArena;
+class GuestMemoryMap;
+
+// Page shared by the host and emulated code, like iOS's commpage. The real one
+// is at `0xFFFF4000`, which is kernel space of 32-bit Windows processes, so
+// ours is allocated in `GuestArena` and it's only found through the functions
+// `GuestClock` binds (see `GuestClock::findSymbol`).
+struct CommPage {
+  // Odd while the host is updating `Time`. Readers retry until they see the
+  // same even value before and after reading it.
+  std::atomic<uint32_t> Seq;
+  uint32_t Reserved;
+  // Ticks of `QueryPerformanceCounter`, i.e., `mach_absolute_time`.
+  volatile uint32_t TimeLow, TimeHigh;
+  // `mach_timebase_info` converting ticks to nanoseconds.
+  uint32_t Numer, Denom;
+};
+
+// Lets emulated code read time without crossing into native code. Imports of
+// `mach_absolute_time` (and its continuous and approximate variants) and
+// `mach_timebase_info` are bound to ARM code in the same page as `CommPage`,
+// which just reads it. The host updates the page whenever an `Emulator`
+// starts and every `CommPageInterval` microseconds from its own thread, so
+// time advances in steps of at most that interval while code runs without
+// crossings. See `CommPageInterval`.
+class GuestClock {
+public:
+  GuestClock(GuestArena &Arena, GuestMemoryMap &Space);
+  GuestClock(const GuestClock &) = delete;
+  ~GuestClock();
+
+  // Starts the updating thread.
+  void start();
+  // Can be called from any thread. Does nothing if another thread is updating
+  // the page right now.
+  void update();
+  // Returns address of the implementation of symbol `Name` or `0`.
+  uint64_t findSymbol(std::string_view Name);
+  // Returns address of the page containing those implementations or `0`. It
+  // can differ between runs, so `PrelinkCache` stores offsets from it.
+  uint64_t getPageAddr() const { return reinterpret_cast<uint64_t>(Page); }
+  bool contains(uint64_t Addr) const;
+  // Used to convert ticks of `CommPage` to nanoseconds.
+  uint64_t toNanoseconds(uint64_t Ticks) const {
+    return Ticks / Frequency * 1000000000 +
+           Ticks % Frequency * 1000000000 / Frequency;
+  }
+  static uint64_t now();
+
+private:
+  CommPage *Page = nullptr;
+  uint64_t Frequency;
+  std::atomic<bool> Running = false;
+  std::thread Timer;
+};
+
+// Time of one guest thread (or the main thread of a `SysTranslator`) split into
+// time spent in emulated code and in native code it called. Modes are
+// switched by `SysTranslator::execute` and by crossings (see
+// `CrossingStats::Scope`), and the current object is switched when guest
+// threads are. Times are measured as wall time of the host thread while the
+// guest thread is running on it. See `AccountGuestTimes`.
+class GuestTimes {
+public:
+  enum ModeTy : uint8_t { None, Emulated, Native };
+
+  // Switches the current host thread's times into `Mode` and returns the
+  // previous mode.
+  static ModeTy enter(ModeTy Mode);
+  // Makes `Times` current for this host thread (it can be `nullptr`).
+  static void setCurrent(GuestTimes *Times);
+  static GuestTimes *getCurrent() { return Current; }
+
+  ModeTy getMode() const { return Mode; }
+  // In ticks of `GuestClock::now`.
+  uint64_t getEmulated() const { return Ticks[Emulated]; }
+  uint64_t getNative() const { return Ticks[Native]; }
+
+private:
+  // Adds time since `Since` to the current mode.
+  void flush(uint64_t Now);
+
+  static thread_local GuestTimes *Current;
+
+  ModeTy Mode = None;
+  uint64_t Since = 0;
+  uint64_t Ticks[3] = {};
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_CLOCK_HPP)
+#endif
@@ -0,0 +1,103 @@
+// GuestHeap.hpp: Definition of class `GuestHeap`.
+
+#ifndef IPASIM_GUEST_HEAP_HPP
+#define IPASIM_GUEST_HEAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+namespace ipasim {
+
+class GuestArena;
+class GuestMemoryMap;
+struct GuestMallocCache;
+
+// Allocator of host memory that emulated code is going to access (e.g.,
+// Objective-C runtime objects). Memory is carved out of chunks which are mapped
+// into `GuestMemoryMap` as soon as they are allocated, so that the guest never
+// faults on it (see `SysTranslator::handleMemUnmapped`). Small blocks are
+// grouped into power-of-two size classes, each with its own free list. Large
+// blocks get their own mapped region, which is released when they are freed.
+//
+// Pointers which were not allocated here are passed to the CRT, so that guest
+// code can free memory allocated by native code. See also `GuestMalloc`.
+class GuestHeap {
+public:
+  GuestHeap(GuestArena &Arena, GuestMemoryMap &Space)
+      : Arena(Arena), Space(Space) {}
+  GuestHeap(const GuestHeap &) = delete;
+
+  void *allocate(size_t Size);
+  void *allocateZeroed(size_t Count, size_t Size);
+  void *reallocate(void *Ptr, size_t Size);
+  void free(void *Ptr);
+  bool owns(const void *Ptr);
+  // Returns size of all chunks and large blocks.
+  uint64_t getRegionBytes();
+  // Discards whole pages inside free blocks, so that the system doesn't have
+  // to page them out. They stay committed and mapped, only their contents are
+  // lost. Returns number of discarded bytes.
+  uint64_t trim();
+
+  // Initializes `Cache` of a new guest thread. Returns `false` if there's no
+  // region for cacheable blocks.
+  bool initialize(GuestMallocCache &Cache);
+  // Adds up to `GuestMallocCache::BatchSize` blocks of class `Class` to
+  // `Cache`. Returns `false` if there's none left.
+  bool refill(GuestMallocCache &Cache, uint32_t Class);
+  // Frees `Count` blocks of class `Class` from `Cache` (or all of them).
+  void drain(GuestMallocCache &Cache, uint32_t Class, uint32_t Count);
+
+private:
+  // Precedes every block, so that its size is known when it's freed.
+  struct alignas(16) Header {
+    uint32_t Size;  // Usable size
+    uint32_t Class; // Index into `FreeLists` or `LargeClass`
+  };
+  struct FreeBlock {
+    FreeBlock *Next;
+  };
+
+  static constexpr uint32_t MinClassShift = 5;  // 32 B
+  static constexpr uint32_t MaxClassShift = 17; // 128 KiB
+  static constexpr uint32_t ClassCount = MaxClassShift - MinClassShift + 1;
+  static constexpr uint32_t LargeClass = ClassCount;
+  // Address space reserved for blocks of `GuestMallocCache`s.
+  static constexpr uint64_t CacheRegionSize = 64 << 20;
+
+  // Returns size class of blocks with `Size` usable bytes or `LargeClass`.
+  static uint32_t getClass(size_t Size);
+  static Header *getHeader(void *Ptr) {
+    return reinterpret_cast<Header *>(Ptr) - 1;
+  }
+  // These must be called with `Mutex` locked.
+  void *allocateSmall(uint32_t Class);
+  void *allocateLarge(size_t Size);
+  // Allocates memory of `Size` bytes and maps it into the guest.
+  uint64_t allocateRegion(size_t Size, bool FromArena);
+  bool ownsLocked(const void *Ptr);
+  bool isCacheable(uint64_t Addr) {
+    return CacheBegin <= Addr && Addr < CacheEnd;
+  }
+  void *allocateCacheable(uint32_t Class);
+
+  GuestArena &Arena;
+  GuestMemoryMap &Space;
+  std::mutex Mutex;
+  FreeBlock *FreeLists[ClassCount] = {};
+  uint64_t Cursor = 0, ChunkEnd = 0; // Unused part of the current chunk
+  std::map<uint64_t, uint64_t> Regions; // Chunks and large blocks
+  // Reserved region of `GuestMallocCache` blocks. Only its beginning up to
+  // `CacheMapped` is committed and mapped, blocks are carved from it at
+  // `CacheCursor`. Freed ones are kept separately, so that they stay cacheable.
+  uint64_t CacheBegin = 0, CacheEnd = 0, CacheCursor = 0, CacheMapped = 0;
+  bool CacheReserved = false;
+  FreeBlock *CacheFreeLists[ClassCount] = {};
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_HEAP_HPP)
+#endif
@@ -0,0 +1,55 @@
+// GuestMallocCache.hpp: Definition of struct `GuestMallocCache`.
+
+#ifndef IPASIM_GUEST_MALLOC_CACHE_HPP
+#define IPASIM_GUEST_MALLOC_CACHE_HPP
+
+#include <cstdint>
+
+namespace ipasim {
+
+// Per-thread cache of free `GuestHeap` blocks kept in guest memory, so that
+// the Dylib wrappers of `malloc` and `free` generated by `HeadersAnalyzer` can
+// serve small blocks without crossing into native code (see
+// `GuestMallocCaches`). Every `GuestTSD` block points to one in slot
+// `GuestTSD::MallocCacheKey`.
+//
+// Cached blocks are ordinary `GuestHeap` blocks of its smallest size classes,
+// they only come from a dedicated region (`Begin` to `End`), so that `free`
+// can tell them apart from other pointers by their address. Hence native code
+// can free them using `GuestHeap::free` as any other guest block. Free blocks
+// are linked through their first word. A list is refilled with `BatchSize`
+// blocks when it's empty (the wrapper executes `svc #RefillID` with the class
+// in R0) and the same number is returned to `GuestHeap` when it has
+// `MaxCount` of them (`svc #ReturnID`), see `GuestHeap::refill` and
+// `GuestHeap::drain`. Other sizes and pointers go to the "kernel" functions
+// `Malloc` and `Free` found in slots `GuestTSD::KernelMallocKey` and
+// `GuestTSD::KernelFreeKey`.
+struct GuestMallocCache {
+  static constexpr uint32_t ClassCount = 8;    // Blocks of 32 B to 4 KiB
+  static constexpr uint32_t MinClassShift = 5; // As in `GuestHeap`
+  static constexpr uint32_t HeaderSize = 16;   // `GuestHeap::Header`
+  static constexpr uint32_t BatchSize = 32;
+  static constexpr uint32_t MaxCount = 2 * BatchSize;
+  // Hypercall IDs reserved for the cache. They are never assigned to DLL
+  // wrappers.
+  static constexpr uint32_t RefillID = 0xFFFFFB;
+  static constexpr uint32_t ReturnID = 0xFFFFFA;
+
+  struct List {
+    uint32_t Head; // First free block or zero
+    uint32_t Count;
+  };
+
+  uint32_t Begin, End; // Region of cacheable blocks
+  List Lists[ClassCount];
+
+  // Returns the largest size (in usable bytes) served from class `Class`.
+  static constexpr uint32_t getMaxSize(uint32_t Class) {
+    return (uint32_t(1) << (Class + MinClassShift)) - HeaderSize;
+  }
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_MALLOC_CACHE_HPP)
+#endif
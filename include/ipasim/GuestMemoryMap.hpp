@@ -0,0 +1,85 @@
+// GuestMemoryMap.hpp: Definition of class `GuestMemoryMap`.
+
+#ifndef IPASIM_GUEST_MEMORY_MAP_HPP
+#define IPASIM_GUEST_MEMORY_MAP_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unicorn/unicorn.h>
+#include <vector>
+
+namespace ipasim {
+
+// Memory mappings shared by all `Emulator`s (there can be one for each host
+// thread, see `IpaSimulator::sys`). Guest memory is mapped at the same
+// addresses as in the host, so all engines can map the same regions.
+//
+// Every mapping (images, stacks and host memory mapped on faults) is tracked
+// here as a set of non-overlapping regions ordered by address. Mapping over
+// existing regions only changes their protection (splitting them if needed)
+// and new regions are merged with adjacent ones of the same protection, so
+// that Unicorn doesn't have to search through too many of them. Each such
+// modification is recorded as a list of `Change`s, which every engine then
+// replays on its own Unicorn instance (see `Emulator::syncMemory`).
+class GuestMemoryMap {
+public:
+  size_t getRegionCount() { return RegionCount; }
+  uint64_t getMappedBytes() { return MappedBytes; }
+  // Statistics of `mapAround`
+  size_t getFaultCount() { return Faults; }
+  uint64_t getFaultBytes() { return FaultBytes; }
+  // Maps (or unmaps) memory without an `Emulator`. Engines apply the change
+  // before they start emulating or when they fault on the memory.
+  void mapRange(uint64_t Addr, uint64_t Size, uc_prot Perms);
+  void unmapRange(uint64_t Addr, uint64_t Size);
+  // Changes protection of pages that are already mapped. Returns `false` (and
+  // does nothing) if some page in the range is not mapped.
+  bool protectRange(uint64_t Addr, uint64_t Size, uc_prot Perms);
+  // Returns `false` if the page containing `Addr` is not mapped.
+  bool getPerms(uint64_t Addr, uc_prot &Perms);
+
+private:
+  friend class Emulator;
+
+  struct Region {
+    uint64_t End;
+    uc_prot Perms;
+  };
+  struct Change {
+    enum : uint8_t { Map, Unmap, Protect } Kind;
+    uint64_t Addr, Size;
+    uc_prot Perms;
+  };
+
+  // These must be called with `Mutex` locked.
+  // Ensures that the range is mapped with protection `Perms`.
+  void map(uint64_t Addr, uint64_t Size, uc_prot Perms);
+  // Maps part of range from `Start` to `End` around `Addr` which doesn't
+  // overlap any existing region. Does nothing if `Addr` is already mapped.
+  void mapAround(uint64_t Addr, uint64_t Start, uint64_t End, uc_prot Perms);
+  // Adds new region, merging it with its neighbours if possible.
+  void add(uint64_t Start, uint64_t End, uc_prot Perms);
+  void protect(uint64_t Start, uint64_t End, uc_prot Perms);
+  void unmap(uint64_t Start, uint64_t End);
+  // Ensures that no region contains `Addr` other than at its start.
+  void splitAt(uint64_t Addr);
+  void record(Change C);
+
+  std::mutex Mutex;
+  std::map<uint64_t, Region> Regions; // Indexed by start addresses
+  std::vector<Change> Changes;
+  // Size of `Changes`, readable without locking
+  std::atomic<size_t> ChangeCount = 0;
+  std::atomic<size_t> RegionCount = 0;
+  std::atomic<uint64_t> MappedBytes = 0;
+  std::atomic<size_t> Faults = 0;
+  std::atomic<uint64_t> FaultBytes = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_MEMORY_MAP_HPP)
+#endif
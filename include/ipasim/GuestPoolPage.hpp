@@ -0,0 +1,54 @@
+// GuestPoolPage.hpp: Definition of struct `GuestPoolPage`.
+
+#ifndef IPASIM_GUEST_POOL_PAGE_HPP
+#define IPASIM_GUEST_POOL_PAGE_HPP
+
+#include <cstdint>
+
+namespace ipasim {
+
+// Hot autorelease pool page of a guest thread, kept in guest memory, so that
+// Dylib wrappers of `objc_autoreleasePoolPush`, `objc_autoreleasePoolPop` and
+// `objc_autorelease` generated by `HeadersAnalyzer` can push pools and
+// autorelease objects without crossing into native code. Every `GuestTSD`
+// block points to one in slot `GuestTSD::AutoreleasePoolKey`.
+//
+// `Objects` is a stack of autoreleased objects and boundaries of pools. Each
+// boundary is two tagged words: `Top` of the enclosing pool and the token of
+// the native pool pushed for this one (or only the tag if there's none yet).
+// Tokens returned by the guest-side push point to the first word. Native
+// pools are pushed lazily, right before the guest crosses into native code
+// inside a pool whose boundary has none (see `SysTranslator::syncPools`), so
+// that objects autoreleased by native code are drained with the guest pool,
+// too. Pools without native counterpart and autoreleased objects are thus
+// popped without crossing. Otherwise, the wrapper executes `svc #DrainID` and
+// the host releases the objects (see `SysTranslator::popPool`), which can need
+// emulated `dealloc`s.
+//
+// Pools pushed below native frames which call back into emulated code are not
+// visible to the callback (see `SysTranslator::executeCallback`), which then
+// starts with `Top` zero, i.e., it autoreleases into native pools until it
+// pushes its own. When the page is full, the wrappers fall back to the native
+// functions.
+struct GuestPoolPage {
+  static constexpr uint32_t Size = 1022; // In words, the page has 4 KiB
+  static constexpr uint32_t BoundaryWords = 2;
+  static constexpr uint32_t Tag = 1; // Objects are at least 4 bytes aligned
+  // Hypercall ID reserved for popping pools which are not empty. It's never
+  // assigned to DLL wrappers.
+  static constexpr uint32_t DrainID = 0xFFFFFC;
+
+  uint32_t Used; // Number of words used in `Objects`
+  // Index after the boundary of the innermost pool visible to the current
+  // callback or zero if there's none
+  uint32_t Top;
+  uint32_t Objects[Size];
+
+  static constexpr bool isBoundary(uint32_t Word) { return Word & Tag; }
+  static constexpr uint32_t untag(uint32_t Word) { return Word & ~Tag; }
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_POOL_PAGE_HPP)
+#endif
@@ -0,0 +1,65 @@
+// GuestProfiler.hpp: Definition of class `GuestProfiler`.
+
+#ifndef IPASIM_GUEST_PROFILER_HPP
+#define IPASIM_GUEST_PROFILER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ipasim {
+
+class DynamicLoader;
+
+// Sampling profiler of emulated code. A host thread periodically requests a
+// sample, each `SysTranslator` notices that in its block hook and records the
+// guest's call stack. Samples are stored as raw addresses and they are only
+// symbolized (using `DynamicLoader::describeAddr`) when written in the
+// collapsed stack format of flame graph tools. See `ProfileInterval`.
+class GuestProfiler {
+public:
+  GuestProfiler(DynamicLoader &Dyld) : Dyld(Dyld) {}
+  GuestProfiler(const GuestProfiler &) = delete;
+  ~GuestProfiler();
+
+  void start();
+  // Stops sampling. Samples taken so far are kept for `write`.
+  void stop();
+  // Returns `true` if a new sample was requested since the last call with the
+  // same `Seen` (which is owned by the caller).
+  bool shouldSample(uint32_t &Seen) const {
+    uint32_t Current = Tick.load(std::memory_order_relaxed);
+    if (Current == Seen)
+      return false;
+    Seen = Current;
+    return true;
+  }
+  // Records one sample, `Frames` are return addresses with the current PC
+  // first.
+  void addSample(const uint32_t *Frames, size_t Count);
+  // Writes symbolized samples to `Path`. Returns `false` on failure.
+  bool write(const std::string &Path);
+  // Writes symbolized samples to the `profile` cache folder.
+  bool write();
+
+  static constexpr size_t MaxDepth = 64;
+
+private:
+  DynamicLoader &Dyld;
+  std::atomic<uint32_t> Tick = 0;
+  std::atomic<bool> Running = false;
+  std::thread Timer;
+  std::mutex Mutex, WriteMutex;
+  // Numbers of occurrences of distinct stacks (with the leaf frame first)
+  std::map<std::vector<uint32_t>, size_t> Samples;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_PROFILER_HPP)
+#endif
@@ -0,0 +1,100 @@
+// GuestTSD.hpp: Definition of class `GuestTSD`.
+
+#ifndef IPASIM_GUEST_TSD_HPP
+#define IPASIM_GUEST_TSD_HPP
+
+#include <cstdint>
+#include <mutex>
+
+namespace ipasim {
+
+class GuestHeap;
+struct GuestMallocCache;
+
+// Thread-specific data of emulated threads laid out like on iOS. Every guest
+// thread has a block of `SlotCount` words allocated from `GuestHeap` and its
+// address in register TPIDRURO, so that inlined `pthread_getspecific` (i.e.,
+// `mrc p15, 0, rX, c13, c0, 3` followed by a load) runs as plain emulated
+// instructions. Slots below `FirstKey` are reserved for keys used by libraries
+// directly (e.g., `__PTK_FRAMEWORK_OBJC_KEY0`), the others are handed out by
+// `createKey`.
+//
+// Guest keys are not keys of the host's pthreads, but guest code only passes
+// them to `pthread_*specific` bound by `DynamicLoader::findKernelSymbol` (see
+// `NativeTSD`).
+class GuestTSD {
+public:
+  static constexpr uint32_t SlotCount = 768, FirstKey = 256;
+  // `__PTK_FRAMEWORK_OBJC_KEY2`, where the runtime of iOS keeps disposition of
+  // the value being returned (see `OptimizedReturns`).
+  static constexpr uint32_t ReturnDispositionKey = 42;
+  // `__PTK_FRAMEWORK_OBJC_KEY3`, which points to the thread's `GuestPoolPage`
+  // (see `GuestAutoreleasePools`).
+  static constexpr uint32_t AutoreleasePoolKey = 43;
+  // Not used by iOS libraries. Points to the thread's `GuestMallocCache` (see
+  // `GuestMallocCaches`).
+  static constexpr uint32_t MallocCacheKey = 255;
+  // Not used by iOS libraries. Addresses of "kernel" functions `Malloc` and
+  // `Free` (see `DynamicLoader::getKernelFunctionAddr`), which wrappers of
+  // `malloc` and `free` call for blocks they don't cache, even if the thread
+  // has no cache (see `GuestMallocCaches`).
+  static constexpr uint32_t KernelMallocKey = 253, KernelFreeKey = 252;
+  // Not used by iOS libraries. Points to the thread's `CommandBuffer` (see
+  // `DeferredCalls`).
+  static constexpr uint32_t CommandBufferKey = 254;
+  // `PTHREAD_DESTRUCTOR_ITERATIONS`
+  static constexpr uint32_t DestructorIterations = 4;
+
+  GuestTSD(GuestHeap &Heap) : Heap(Heap) {}
+  GuestTSD(const GuestTSD &) = delete;
+
+  // Returns a new zeroed block or `nullptr`. With `GuestAutoreleasePools`,
+  // `GuestMallocCaches` and `DeferredCalls`, it also gets a new
+  // `GuestPoolPage`, `GuestMallocCache` (and addresses of the kernel
+  // functions) and `CommandBuffer`, respectively.
+  uint32_t *allocate();
+  void release(uint32_t *Block);
+  // Returns `false` if all keys are in use.
+  bool createKey(uint32_t Destructor, uint32_t &Key);
+  // Returns `false` if `Key` hasn't been created. Values stored under it stay
+  // in the blocks, as with `pthread_key_delete`.
+  bool deleteKey(uint32_t Key);
+  static bool isValid(uint32_t Key) { return Key < SlotCount; }
+  // Clears values of keys with destructors in `Block` and calls
+  // `Call(Destructor, Value)` for the non-null ones until there are none left
+  // or `DestructorIterations` passes are done, as `pthread_exit` does.
+  template <typename FuncTy> void runDestructors(uint32_t *Block, FuncTy Call) {
+    for (uint32_t I = 0; I != DestructorIterations; ++I) {
+      bool Called = false;
+      for (uint32_t Key = FirstKey; Key != SlotCount; ++Key) {
+        uint32_t Destructor = getDestructor(Key);
+        if (!Destructor || !Block[Key])
+          continue;
+        uint32_t Value = Block[Key];
+        Block[Key] = 0;
+        Call(Destructor, Value);
+        Called = true;
+      }
+      if (!Called)
+        return;
+    }
+  }
+
+private:
+  GuestMallocCache *allocateCache();
+  uint32_t getDestructor(uint32_t Key) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return Used[Key] ? Destructors[Key] : 0;
+  }
+
+  GuestHeap &Heap;
+  std::mutex Mutex;
+  bool Used[SlotCount] = {};
+  uint32_t Destructors[SlotCount] = {};
+  uint32_t NextKey = FirstKey; // Where `createKey` starts searching
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_GUEST_TSD_HPP)
+#endif
@@ -4,46 +4,100 @@
 #ifndef IPASIM_HA_CONTEXT_HPP
 #define IPASIM_HA_CONTEXT_HPP
 
+#include "ipasim/CommandBuffer.hpp"
 #include "ipasim/Common.hpp"
+#include "ipasim/Hypercalls.hpp"
+#include "ipasim/MessageCache.hpp"
+#include "ipasim/ObjCPreopt.hpp"
+#include "ipasim/TaskGraph.hpp"
 
 #include <cstdint>
 #include <filesystem>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/iterator.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/Support/Allocator.h>
 #include <map>
+#include <optional>
 #include <set>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace ipasim {
 
 enum class LibType { None = 0, Dylib = 0x1, DLL = 0x2, Both = 0x3 };
 
-// Wrapper over container iterator. Plus extra `operator bool`.
-template <typename T> class ContainerPtr {
+// Entries keyed by their names. Names are interned in a hash map which maps
+// them to indices of the entries. Both names and entries are allocated from
+// bump arenas, so they never move and their `Ptr`s stay valid. Also, trivially
+// destructible entries are freed at once, without visiting them. Iteration
+// order is insertion order.
+template <typename T> class SymbolTable {
 public:
-  using VTy = typename T::iterator;
-
-  ContainerPtr() : Valid(false) {}
-  ContainerPtr(const VTy &Value) : Valid(true), Value(Value) {}
-  ContainerPtr(VTy &&Value) : Valid(true), Value(std::move(Value)) {}
-
-  operator VTy() const { return Value; }
-  auto operator*() const { return Value.operator*(); }
-  auto operator-> () const { return Value.operator->(); }
-  operator bool() const { return Valid; }
-  bool operator<(const ContainerPtr &Other) const {
-    return *Value < *Other.Value;
+  using iterator = llvm::pointee_iterator<typename std::vector<T *>::iterator>;
+  using const_iterator =
+      llvm::pointee_iterator<typename std::vector<T *>::const_iterator>;
+
+  // Stable reference to an entry. Plus extra `operator bool`. Compares by index
+  // (i.e., by insertion order), so that it's deterministic.
+  class Ptr {
+  public:
+    Ptr() : Entry(nullptr), Idx(0) {}
+    Ptr(T &Entry, uint32_t Idx) : Entry(&Entry), Idx(Idx) {}
+
+    T &operator*() const { return *Entry; }
+    T *operator->() const { return Entry; }
+    explicit operator bool() const { return Entry; }
+    uint32_t index() const { return Idx; }
+    bool operator<(const Ptr &Other) const { return Idx < Other.Idx; }
+    bool operator==(const Ptr &Other) const { return Entry == Other.Entry; }
+    bool operator!=(const Ptr &Other) const { return Entry != Other.Entry; }
+
+  private:
+    T *Entry;
+    uint32_t Idx;
+  };
+
+  SymbolTable() = default;
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+  ~SymbolTable() {
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      for (T *Entry : Entries)
+        Entry->~T();
   }
-  bool operator==(const ContainerPtr &Other) const {
-    return Value == Other.Value;
+
+  // Returns the entry named `Name`, creating it if it doesn't exist yet. The
+  // second item is `true` if it has been created. The entry is constructed
+  // from the interned name.
+  std::pair<Ptr, bool> insert(llvm::StringRef Name) {
+    auto [It, Inserted] = Index.try_emplace(Name, Entries.size());
+    if (Inserted)
+      Entries.push_back(new (Arena.Allocate<T>()) T(It->getKey()));
+    return {get(It->second), Inserted};
   }
-  bool operator!=(const ContainerPtr &Other) const {
-    return Value != Other.Value;
+  // Returns null `Ptr` if there is no entry named `Name`.
+  Ptr find(llvm::StringRef Name) {
+    auto It = Index.find(Name);
+    if (It == Index.end())
+      return Ptr();
+    return get(It->second);
   }
+  Ptr get(uint32_t Idx) { return Ptr(*Entries[Idx], Idx); }
+
+  iterator begin() { return iterator(Entries.begin()); }
+  iterator end() { return iterator(Entries.end()); }
+  const_iterator begin() const { return const_iterator(Entries.begin()); }
+  const_iterator end() const { return const_iterator(Entries.end()); }
+  size_t size() const { return Entries.size(); }
+  bool empty() const { return Entries.empty(); }
 
 private:
-  bool Valid;
-  VTy Value;
+  llvm::BumpPtrAllocator Arena;
+  std::vector<T *> Entries;
+  llvm::StringMap<uint32_t, llvm::BumpPtrAllocator> Index;
 };
 
 struct DLLEntry;
@@ -51,12 +105,12 @@ struct DLLGroup;
 struct ExportEntry;
 struct Dylib;
 struct ClassExport;
-using DylibList = std::set<Dylib>;
-using DylibPtr = ContainerPtr<DylibList>;
-using ExportList = std::set<ExportEntry>;
-using ExportPtr = ContainerPtr<ExportList>;
-using ClassExportList = std::set<ClassExport>;
-using ClassExportPtr = ContainerPtr<ClassExportList>;
+using DylibList = SymbolTable<Dylib>;
+using DylibPtr = DylibList::Ptr;
+using ExportList = SymbolTable<ExportEntry>;
+using ExportPtr = ExportList::Ptr;
+using ClassExportList = SymbolTable<ClassExport>;
+using ClassExportPtr = ClassExportList::Ptr;
 using GroupList = std::vector<DLLGroup>;
 using GroupPtr = size_t;
 using DLLEntryList = std::vector<DLLEntry>;
@@ -69,6 +123,23 @@ struct DLLEntry {
   std::string Name;
   std::vector<ExportPtr> Exports;
   ExportPtr ReferenceSymbol;
+  // Type encodings of Objective-C methods. See `WrapperIndex::MethodTypes`.
+  std::map<uint32_t, std::string> MethodTypes;
+  // Names and RVAs of all exports of the DLL, see `ExportTable`.
+  std::vector<std::pair<std::string, uint32_t>> NamedExports;
+  uint32_t TimeDateStamp = 0;
+  // Some of its exports are implemented by another DLL analyzed before it (like
+  // WinObjC's `Accelerate.dll` by our `AccelerateNative.dll`). Those are
+  // silently skipped.
+  bool Overridden = false;
+  // It has no PDB (like ANGLE's `libGLESv2.dll`), so only its export table is
+  // analyzed. Signatures of its functions come from iOS headers alone.
+  bool ExportsOnly = false;
+  // Its functions are `__stdcall`, so they are imported as `_name@N`.
+  bool StdCall = false;
+  // Compilation of its `.obj` file and linking of its stub Dylib. See
+  // `DLLHelper::generate`.
+  TaskGraph::Task *ObjectTask = nullptr, *StubTask = nullptr;
 };
 
 // DLLs are grouped by their containing folder.
@@ -77,24 +148,45 @@ struct DLLGroup {
   DLLEntryList DLLs;
 };
 
-enum class ExportStatus { NotFound = 0, Found, Overloaded, FoundInDLL };
+// `Pruned` means found in a DLL, but unused by target apps (see
+// `PruneWrappers`).
+enum class ExportStatus { NotFound = 0, Found, Overloaded, FoundInDLL, Pruned };
+
+// How arguments and return values of an export are marshaled between emulated
+// and native code, roughly ordered by cost. See `ExportEntry::getShape`.
+enum class WrapperShape {
+  None = 0,  // Data symbol
+  Trivial,   // `void -> void`
+  Register,  // Everything fits into R0-R3 (and R0-R1 for the result)
+  Stack,     // Some arguments are passed on the emulated stack
+  Float,     // Soft-float arguments or result converted to x87 or SSE
+  Stret,     // Struct returned through a pointer (see #28)
+  VaList,    // Variadic function forwarded to its `va_list` variant
+  Vararg,    // Variadic function, not handled by wrappers
+  Messenger, // Objective-C messenger (IMP lookup and tail call)
+  Dynamic,   // No wrapper, calls go through the dynamic path at runtime
+  Count
+};
+const char *toString(WrapperShape Shape);
 
-// The following structs are used in `std::set`s, so they have one key field and
-// `operator<` that compares just this field. Other fields are values and hence
-// marked `mutable` (because otherwise, `std::set` returns everyhing as `const`,
-// so that we don't change the ordering which would break internal structures of
-// `std::set`).
+// The following structs are used in `SymbolTable`s, keyed by their `Name`
+// (which is owned by the table). Other fields are values and they are marked
+// `mutable`, so that they can be updated through `const` references, too.
 
 // Represents a single exported function or data.
 struct ExportEntry {
-  ExportEntry(std::string Name)
-      : Name(move(Name)), Status(ExportStatus::NotFound), RVA(0),
+  ExportEntry(llvm::StringRef Name)
+      : Name(Name), Status(ExportStatus::NotFound), RVA(0),
         DylibType(nullptr), DLLType(nullptr), ObjCMethod(false),
         Messenger(false), Stret(false), Super(false), Super2(false),
         DylibStretOnly(false), UnhandledMessenger(false),
-        UnhandledVararg(false) {}
+        UnhandledVararg(false), Leaf(false), RegisterABI(false),
+        Deferred(false), Getter(false), Setter(false),
+        HypercallID(NoHypercall), WrapperOffset(0), IvarOffset(0) {}
 
-  std::string Name;
+  static constexpr uint32_t NoHypercall = static_cast<uint32_t>(-1);
+
+  llvm::StringRef Name;
   mutable ExportStatus Status;
   mutable uint32_t RVA; // RVA inside its DLL
   mutable bool ObjCMethod : 1;
@@ -105,15 +197,39 @@ struct ExportEntry {
   mutable bool DylibStretOnly : 1; // See #28.
   mutable bool UnhandledMessenger : 1;
   mutable bool UnhandledVararg : 1;
+  // Function never calls back into emulated code (see `leaf_functions.txt`).
+  mutable bool Leaf : 1;
+  mutable bool RegisterABI : 1; // See `RegisterWrappers`.
+  mutable bool Deferred : 1;    // See `DeferredWrappers`.
+  // Objective-C method only loads or stores ivar at `IvarOffset`. See
+  // `InlineAccessors`.
+  mutable bool Getter : 1;
+  mutable bool Setter : 1;
   mutable GroupPtr DLLGroup;
   mutable DLLPtr DLL;
   mutable DylibPtr Dylib; // First Dylib that implements this function
+  // Variant taking `va_list` which calls of this variadic function are
+  // forwarded to (see `vararg_functions.txt`).
+  mutable ExportPtr VaList;
+  mutable uint32_t HypercallID; // See `HypercallWrappers`.
+  // Offset of Dylib wrapper inside `Dylib` (or `0` if unknown). See
+  // `WrapperIndex::Offsets`.
+  mutable uint32_t WrapperOffset;
+  mutable uint32_t IvarOffset;
 
-  bool operator<(const ExportEntry &Other) const { return Name < Other.Name; }
   bool isTrivial() const {
     return !DylibStretOnly && !DylibType->getNumParams() &&
            DylibType->getReturnType()->isVoidTy();
   }
+  // Returns `true` if all Dylib arguments and the return value are integers,
+  // pointers, floating-point numbers or coerced aggregates (arrays of words),
+  // i.e., they are passed in registers or stack words. iOS armv7 code is
+  // soft-float, so even `float`s and `double`s travel in core registers.
+  bool fitsRegisters() const;
+  // Number of words occupied by Dylib arguments (in registers and on the stack)
+  // or `nullopt` if some argument is not a word-sized value.
+  std::optional<size_t> getArgWords() const;
+  WrapperShape getShape() const;
   void setType(llvm::FunctionType *T) const {
     assert(!DLLType && "Cannot change type after DLLType has been generated.");
     DylibType = T;
@@ -126,31 +242,33 @@ private:
   // `nullptr` means this is not a function
   mutable llvm::FunctionType *DylibType;
   mutable llvm::FunctionType *DLLType;
-  mutable std::vector<llvm::Type *> DLLArgs;
 };
+// There are lots of exports, so they are freed together with their arena. See
+// `SymbolTable`.
+static_assert(std::is_trivially_destructible_v<ExportEntry>,
+              "ExportEntry must be trivially destructible.");
 
 // Represents an iOS's system `.dylib`.
 struct Dylib {
-  Dylib(std::string Name) : Name(move(Name)) {}
+  Dylib(llvm::StringRef Name) : Name(Name) {}
 
-  std::string Name;
+  llvm::StringRef Name;
   mutable std::vector<ExportPtr> Exports;
   mutable std::set<std::pair<GroupPtr, DLLPtr>> ReExports; // See #23.
-
-  bool operator<(const Dylib &Other) const { return Name < Other.Name; }
+  // Dylibs whose class methods this Dylib re-exports. See `ClassExport`.
+  mutable std::set<DylibPtr> DylibReExports;
+  // Linking of its wrapper Dylib. See `HeadersAnalyzer::linkDylib`.
+  mutable TaskGraph::Task *LinkTask = nullptr;
 };
 
-// It is allowed for multiple Dylibs to export the same class.
+// It is allowed for multiple Dylibs to export the same class. Wrappers of its
+// methods are generated only into the first one of them, the others re-export
+// it.
 struct ClassExport {
-  ClassExport(std::string Name) : Name(move(Name)) {}
-
-  std::string Name;
-  // TODO: It is allowed for multiple libraries to export the same class. But
-  // currently, we generate wrappers and stubs for all the class's methods in
-  // all the wrapper libraries. We should reexport them instead.
-  mutable std::vector<DylibPtr> Dylibs;
+  ClassExport(llvm::StringRef Name) : Name(Name) {}
 
-  bool operator<(const ClassExport &Other) const { return Name < Other.Name; }
+  llvm::StringRef Name;
+  mutable std::vector<DylibPtr> Dylibs; // In order of `HAContext::iOSLibs`
 };
 
 // Context of `HeadersAnalyzer`.
@@ -160,12 +278,23 @@ public:
   DylibList iOSLibs;
   ClassExportList iOSClasses;
   GroupList DLLGroups;
-
+  uint32_t HypercallCount = 0; // Number of assigned hypercall IDs
+  ObjCPreoptBuilder Preopt;      // Filled by `ObjCMethodScout`
+  // Superclass names of Objective-C classes found in DLLs (filled in order of
+  // `DLLGroups`). See `addInheritedMethod`.
+  std::map<std::string, std::string> SuperClasses;
+
+  // Hypercall IDs must fit into the immediate operand of ARM's `svc` (Thumb
+  // wrappers pass bigger IDs in R12) and into the table of `DynamicLoader`. See
+  // `Hypercalls`.
+  static constexpr uint32_t MaxHypercalls = Hypercalls::MaxCount;
   // Messengers-related constants
   static constexpr ConstexprString MsgSendPrefix = "_objc_msgSend";
   static constexpr ConstexprString StretPostfix = "_stret";
   static constexpr ConstexprString MsgLookupPrefix = "_objc_msgLookup";
   static constexpr ConstexprString MsgNilPrefix = "__objc_msgNil";
+  // Limit of superclass chains followed by `addInheritedMethod`.
+  static constexpr size_t MaxClassDepth = 64;
 
   bool isClassMethod(const std::string &Name);
   // This is an inverse of `CGObjCCommonMac::GetNameForMethod`.
@@ -175,12 +304,23 @@ public:
   // Determines whether the given symbol should be further analyzed when found
   // in a Dylib.
   bool isInteresting(const std::string &Name, ExportPtr &Exp);
+  // Returns `true` if `isInteresting` could return `true` for the symbol. It
+  // doesn't change anything, so it can be called from multiple threads.
+  bool isExported(const std::string &Name);
+  // Headers declare methods only in the class which introduces them, so DLL
+  // methods overriding them in subclasses (e.g., `-[UIButton setFrame:]`)
+  // wouldn't be interesting. This adds such method `Name` as an export with
+  // signature of the nearest superclass's declaration and returns `true`.
+  bool addInheritedMethod(const std::string &Name);
   // Like `isInteresting` but used when the symbol is found in a DLL.
   bool isInterestingForWindows(const std::string &Name, ExportPtr &Exp,
                                uint32_t RVA, bool IgnoreDuplicates = false);
-  ExportPtr addExport(std::string &&Name) {
-    return iOSExps.insert(ExportEntry(move(Name))).first;
-  };
+  ExportPtr addExport(llvm::StringRef Name) {
+    return iOSExps.insert(Name).first;
+  }
+
+private:
+  void addClassMethod(ExportPtr Exp, const ClassExport &Class);
 };
 
 struct DirContext {
@@ -224,7 +364,7 @@ auto mapIterator(T &&Container, FTy &&Func) {
 // Dereferences iterated values.
 template <typename T> auto deref(T &&Container) {
   return mapIterator(std::forward<T>(Container),
-                     [](auto &&Value) { return *Value; });
+                     [](auto &&Value) -> decltype(auto) { return *Value; });
 }
 
 template <typename ItTy>
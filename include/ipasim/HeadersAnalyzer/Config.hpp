@@ -19,10 +19,108 @@ constexpr ipasim::LibType WarnUninterestingFunctions = ipasim::LibType::None;
 constexpr ipasim::LibType ErrorUnimplementedFunctions = ipasim::LibType::None;
 constexpr ipasim::LibType SumUnimplementedFunctions = ipasim::LibType::Both;
 constexpr bool VerboseClang = false;
+// If enabled, only declarations of functions exported from iOS Dylibs are
+// emitted when compiling Apple headers. See `DeclFilter`.
+constexpr bool FilterAppleDecls = true;
+// If enabled, `IRHelper::emitObj` also writes LLVM IR of each generated module
+// into an `.ll` file next to its object file.
+constexpr bool DumpIR = false;
+// If enabled, LLD is called in-process instead of starting `ld64.lld.exe` and
+// Microsoft's `link.exe` for each linked library. See `LLDHelper::link`.
+constexpr bool InProcessLLD = true;
+// If enabled, object files and libraries whose inputs didn't change since the
+// last run aren't emitted and linked again. See `BuildCache`.
+constexpr bool IncrementalBuild = true;
 constexpr bool IgnoreErrors = false;
 constexpr bool Sample = IPASIM_DEBUG && true;
+// If enabled, wrappers are emitted in order of their call counts listed in
+// `wrapper_profile.txt`, so that hot ones share a few pages. See
+// `HeadersAnalyzer::applyProfile`.
+constexpr bool ProfileLayout = true;
+// If enabled, Dylib wrappers of all iOS libraries are generated into one module
+// (so that helpers like messenger caches and shared wrapper bodies are emitted
+// once and calls between wrappers are direct) and linked into one Dylib. The
+// original Dylibs only re-export it. See `HeadersAnalyzer::generateDylibs`.
+constexpr bool MergedDylibs = false;
+// If not zero, Dylib wrappers are linked at distinct addresses starting at this
+// one, `DylibImageStride` bytes apart, so that `DynamicLoader` can usually load
+// them there without rebasing (see `PreferredImageAddresses`). Dylibs bigger
+// than the stride overlap the next one, which then slides.
+constexpr uint64_t DylibImageBase = 0x60000000;
+constexpr uint64_t DylibImageStride = 0x400000;
+// If enabled, wrappers are generated only for functions imported by apps listed
+// in `target_apps.txt`, Objective-C methods whose selectors they reference and
+// functions listed in `core_functions.txt`. Other functions fail at runtime.
+// See `HeadersAnalyzer::pruneExports`.
+constexpr bool PruneWrappers = false;
 // TODO: Fix `TypeComparer` and then turn this on.
 constexpr bool CompareTypes = false;
+// If enabled, PDBs are read by LLVM's native PDB reader in parallel (see
+// `PDBHelper`). LLDB is then used only if `CompareTypes` is enabled.
+constexpr bool NativePDB = !CompareTypes;
+// If enabled, Dylib wrappers are compiled into Thumb-2 code (`thumbv7s`)
+// instead of ARM code. Hypercalls are then encoded as described in
+// `Hypercalls`.
+constexpr bool ThumbWrappers = true;
+// If enabled, Dylib wrappers enter DLL wrappers via `svc #<id>` instead of
+// calling into non-executable DLL memory. See
+// `SysTranslator::handleInterrupt`.
+constexpr bool HypercallWrappers = false;
+// If enabled, non-trivial functions whose arguments and return values are
+// passed in registers and stack words (see `ExportEntry::fitsRegisters`) get
+// DLL wrappers that read them directly from emulated registers and stack, and
+// their Dylib wrappers simply jump into DLL wrappers. This includes
+// floating-point heavy APIs (e.g., CoreGraphics geometry or libm). See
+// `SysTranslator::callTarget`.
+constexpr bool RegisterWrappers = true;
+// If enabled, generated messengers look up IMPs in `MessageCache` before
+// calling `objc_msgLookup`.
+constexpr bool MessengerCaches = true;
+// If enabled, messengers with `MessengerCaches` let the host look up and call
+// IMPs missing in the cache using a single hypercall. See
+// `SysTranslator::handleMsgDispatch`.
+constexpr bool MessengerDispatch = MessengerCaches && true;
+// If enabled, wrappers of functions with the same signature share one body
+// which gets address of the function to call as an extra argument. Wrappers
+// themselves only call into it. See `IRHelper::declareShapeFunc`.
+constexpr bool SharedWrappers = true;
+// If enabled, Dylib wrappers of functions listed in `deferred_functions.txt`
+// (which must have `RegisterABI`) only record their calls into
+// `CommandBuffer`, the host executes them later in one go.
+constexpr bool DeferredWrappers = true;
+// If enabled, ANGLE's `libGLESv2.dll` is analyzed, so that `gl*` functions of
+// the OpenGLES framework get wrappers straight into it. Most of them have
+// `RegisterABI` and pointers are passed through as they are (memory is shared
+// with emulated code). Calls which only change GL state are deferred (see
+// `deferred_functions.txt`) and executed before the next call that isn't, e.g.,
+// `glFlush`, `-[EAGLContext presentRenderbuffer:]` or any `glGet*`.
+constexpr bool GLWrappers = true;
+// If enabled, Objective-C methods found in DLLs which override methods declared
+// in superclasses get wrappers, too. See `HAContext::addInheritedMethod`.
+constexpr bool InheritedWrappers = true;
+// If enabled, Dylib wrappers of Objective-C methods whose DLL implementation
+// only loads or stores an ivar (see `DLLHelper::detectAccessor`) access the
+// ivar directly in emulated code. Native objects are in memory shared with
+// emulated code, so no hypercall is needed. `nil` receivers use the normal
+// wrapper.
+constexpr bool InlineAccessors = true;
+// If enabled, Dylib wrappers of `objc_retain`, `objc_release` and similar
+// functions return right away if the object is `nil`, and `objc_storeStrong`
+// does if it would store the value that is already there. Those calls do
+// nothing, so they don't have to cross into native code at all.
+constexpr bool InlineRetainRelease = true;
+// If enabled, Dylib wrappers of `objc_autoreleasePoolPush`,
+// `objc_autoreleasePoolPop` and `objc_autorelease` use the thread's
+// `GuestPoolPage` when it has room, so that pools and autoreleased objects
+// don't cross into native code until they need to be released.
+constexpr bool InlineAutoreleasePools = true;
+// If enabled, Dylib wrappers of `malloc` and `free` serve small blocks from the
+// thread's `GuestMallocCache` (if it has one, see `GuestMallocCaches`) and
+// call `GuestHeap`'s kernel functions for the rest.
+constexpr bool InlineMalloc = true;
+// Number of threads running Clang and LLD in parallel (`0` means one per
+// hardware thread). See `TaskGraph`.
+constexpr unsigned CodeGenJobs = 0;
 
 } // namespace ipasim
 
@@ -0,0 +1,61 @@
+// HotEntries.hpp: Definition of class `HotEntries`.
+
+#ifndef IPASIM_HOT_ENTRIES_HPP
+#define IPASIM_HOT_ENTRIES_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+// Guest addresses where emulation starts most often (i.e., callbacks and
+// returns from native code, see `SysTranslator::execute`) during the first
+// `LaunchProfileWindow` seconds of a launch. They are saved in `LaunchProfile`
+// and on the next launch, the emulation thread translates them ahead of time
+// while it's idle (see `SysTranslator::pretranslate`), so that first frames and
+// animations don't stall on translation of code the guest runs every time.
+// Engines have their own translation caches, so only the one of the guest's
+// main thread is warmed up.
+class HotEntries {
+public:
+  // Maximum number of entries saved per launch
+  static constexpr size_t MaxCount = 4096;
+
+  void startRecording() { Recording.store(true, std::memory_order_relaxed); }
+  // Counts one start of emulation at `Addr`. It's only a hint, so it isn't
+  // counted if another thread is counting at the same time.
+  void count(uint64_t Addr) {
+    if (Recording.load(std::memory_order_relaxed))
+      countSlow(Addr);
+  }
+  // Stops recording and returns at most `MaxCount` entries, most frequent
+  // first.
+  std::vector<uint64_t> stopRecording();
+  // Replaces entries waiting to be translated. The first ones are translated
+  // first.
+  void schedule(std::vector<uint64_t> Addrs);
+  // Returns `false` if there is no entry waiting.
+  bool pop(uint64_t &Addr);
+  bool hasPending() const {
+    return PendingCount.load(std::memory_order_relaxed);
+  }
+  void clearPending() { schedule({}); }
+
+private:
+  void countSlow(uint64_t Addr);
+
+  std::atomic<bool> Recording = false;
+  std::atomic<size_t> PendingCount = 0;
+  std::mutex Mutex;
+  std::unordered_map<uint64_t, uint64_t> Counts;
+  std::vector<uint64_t> Pending; // In reverse order, so it's popped from back
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_HOT_ENTRIES_HPP)
+#endif
@@ -0,0 +1,25 @@
+// Hypercalls.hpp: Definition of struct `Hypercalls`.
+
+#ifndef IPASIM_HYPERCALLS_HPP
+#define IPASIM_HYPERCALLS_HPP
+
+#include <cstdint>
+
+namespace ipasim {
+
+// Encoding of `svc #ID` instructions Dylib wrappers use to call into the host
+// (see `SysTranslator::handleInterrupt`). In ARM mode, the immediate operand
+// has 24 bits, so it holds the whole ID. In Thumb mode, it has only 8 bits, so
+// IDs that don't fit are loaded into R12 and the immediate is `ThumbInR12`.
+struct Hypercalls {
+  static constexpr uint32_t ThumbInR12 = 0xFF;
+  // IDs assigned to wrappers (see `HypercallWrappers`) are below this, so that
+  // `DynamicLoader` can keep them in a fixed table. The IDs of `CommandBuffer`
+  // and messengers are above it.
+  static constexpr uint32_t MaxCount = 0x10000;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_HYPERCALLS_HPP)
+#endif
@@ -0,0 +1,60 @@
+// ImageSnapshot.hpp: Definition of class `ImageSnapshot`.
+
+#ifndef IPASIM_IMAGE_SNAPSHOT_HPP
+#define IPASIM_IMAGE_SNAPSHOT_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// On-disk copy of memory of a loaded Mach-O image, taken right after it has
+// been rebased and bound (i.e., before any of its code ran). Since images are
+// allocated from `GuestArena`, they usually land at the same address on the
+// next start, so the copy can be mapped as a whole instead of mapping and
+// rebasing segments one by one. Its bindings are reused only if every library
+// they point into is loaded at the same address again. Entries are keyed like
+// in `PrelinkCache`.
+class ImageSnapshot {
+public:
+  struct Lib {
+    std::string Path; // Key of `DynamicLoader::LLs`
+    uint64_t StartAddress;
+  };
+
+  ImageSnapshot(const std::string &Path);
+
+  // Reads the entry's header from disk. Returns `false` if there is no valid
+  // entry.
+  bool load();
+  // Saves the image's memory along with the other fields.
+  bool save();
+  // File the entry was loaded from or saved into
+  const std::filesystem::path &getFilePath() const { return File; }
+  // Offset of the image's memory inside the file. It's aligned to allocation
+  // granularity, so that it can be mapped.
+  uint64_t getDataOffset() const { return DataOffset; }
+
+  uint64_t StartAddress = 0, Size = 0;
+  uint64_t KernelAddr = 0;
+  uint64_t ClockAddr = 0; // See `GuestClock::getPageAddr`
+  std::vector<Lib> Libs; // Libraries the image's bindings point into
+
+private:
+  bool parse(std::istream &I);
+
+  static constexpr uint32_t Magic = 0x4E535049; // "IPSN"
+  static constexpr uint32_t Version = 2;
+  std::string Path;
+  uint64_t Stamp;
+  uint64_t DataOffset = 0;
+  std::filesystem::path File;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_IMAGE_SNAPSHOT_HPP)
+#endif
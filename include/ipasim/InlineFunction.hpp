@@ -0,0 +1,89 @@
+// InlineFunction.hpp: Definition of class template `InlineFunction`.
+
+#ifndef IPASIM_INLINE_FUNCTION_HPP
+#define IPASIM_INLINE_FUNCTION_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace ipasim {
+
+template <typename F, size_t Size> class InlineFunction;
+
+// Like `std::function`, but the callable object is always stored inline, so
+// there is never any heap allocation. Callables that don't fit into `Size`
+// bytes are rejected at compile time.
+template <typename RetTy, typename... ArgTys, size_t Size>
+class InlineFunction<RetTy(ArgTys...), Size> {
+public:
+  InlineFunction() : Invoke(nullptr), Manage(nullptr) {}
+  InlineFunction(std::nullptr_t) : InlineFunction() {}
+  template <typename FTy, typename = std::enable_if_t<!std::is_same_v<
+                              std::decay_t<FTy>, InlineFunction>>>
+  InlineFunction(FTy &&Func) {
+    using T = std::decay_t<FTy>;
+    static_assert(sizeof(T) <= Size, "Callable is too big.");
+    static_assert(alignof(T) <= alignof(StorageTy),
+                  "Callable is aligned too strictly.");
+
+    new (&Storage) T(std::forward<FTy>(Func));
+    Invoke = [](void *S, ArgTys... Args) -> RetTy {
+      return (*static_cast<T *>(S))(std::forward<ArgTys>(Args)...);
+    };
+    Manage = [](void *Dst, void *Src) {
+      if (Dst)
+        new (Dst) T(std::move(*static_cast<T *>(Src)));
+      static_cast<T *>(Src)->~T();
+    };
+  }
+  InlineFunction(InlineFunction &&Other)
+      : Invoke(Other.Invoke), Manage(Other.Manage) {
+    if (Manage)
+      Manage(&Storage, &Other.Storage);
+    Other.Invoke = nullptr;
+    Other.Manage = nullptr;
+  }
+  InlineFunction(const InlineFunction &) = delete;
+  ~InlineFunction() { reset(); }
+
+  InlineFunction &operator=(InlineFunction &&Other) {
+    if (this != &Other) {
+      reset();
+      Invoke = Other.Invoke;
+      Manage = Other.Manage;
+      if (Manage)
+        Manage(&Storage, &Other.Storage);
+      Other.Invoke = nullptr;
+      Other.Manage = nullptr;
+    }
+    return *this;
+  }
+  InlineFunction &operator=(const InlineFunction &) = delete;
+
+  explicit operator bool() const { return Invoke; }
+  RetTy operator()(ArgTys... Args) {
+    return Invoke(&Storage, std::forward<ArgTys>(Args)...);
+  }
+
+private:
+  using StorageTy = std::aligned_storage_t<Size, alignof(std::max_align_t)>;
+
+  void reset() {
+    if (Manage)
+      Manage(nullptr, &Storage);
+    Invoke = nullptr;
+    Manage = nullptr;
+  }
+
+  StorageTy Storage;
+  RetTy (*Invoke)(void *, ArgTys...);
+  // Moves the callable from `Src` to `Dst` (if not `nullptr`) and destroys it.
+  void (*Manage)(void *Dst, void *Src);
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_INLINE_FUNCTION_HPP)
+#endif
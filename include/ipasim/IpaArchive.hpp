@@ -0,0 +1,84 @@
+// IpaArchive.hpp: Definition of class `IpaArchive`.
+
+#ifndef IPASIM_IPA_ARCHIVE_HPP
+#define IPASIM_IPA_ARCHIVE_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace ipasim {
+
+// Read-only view of an `.ipa` file (i.e., a ZIP archive), so that apps can be
+// run without extracting them first. The archive is mapped into memory and its
+// central directory is indexed once. Stored (uncompressed) entries are then
+// read directly from the mapping and deflated ones are decompressed on demand
+// into memory provided by the caller.
+//
+// Files inside archives are addressed by paths like
+// `C:\Apps\Foo.ipa|Payload/Foo.app/Foo` (`|` cannot appear in Windows paths).
+// ZIP64 archives and encrypted entries are not supported.
+class IpaArchive {
+public:
+  struct Entry {
+    uint64_t HeaderOffset; // Offset of the local file header
+    uint64_t CompressedSize, Size;
+    uint16_t Method; // `Stored` or `Deflated`
+  };
+  static constexpr uint16_t Stored = 0, Deflated = 8;
+  static constexpr char Separator = '|';
+
+  IpaArchive() = default;
+  IpaArchive(const IpaArchive &) = delete;
+  ~IpaArchive();
+
+  // Returns archive at `Path`, opening it if it hasn't been opened yet, or
+  // `nullptr` if it cannot be opened. Archives stay open until exit.
+  static IpaArchive *get(const std::string &Path);
+  // Splits `Path` into path of an archive and path of a file inside it.
+  // Returns `false` if `Path` doesn't point inside an archive.
+  static bool split(const std::string &Path, std::string &Archive,
+                    std::string &Member);
+  static bool isArchived(const std::string &Path) {
+    return Path.find(Separator) != std::string::npos;
+  }
+  static bool isArchivePath(const std::string &Path);
+  // Returns the entry `Path` (see `split`) points to.
+  static const Entry *lookup(const std::string &Path, IpaArchive *&Archive);
+
+  bool open(const std::string &Path);
+  // Finds entry by its path inside the archive (case-insensitive, both `/` and
+  // `\` are accepted as separators).
+  const Entry *find(const std::string &Member) const;
+  // Returns path of the main executable (`Payload/X.app/X`) inside the archive
+  // or an empty string if there is none.
+  const std::string &getExecutable() const { return Executable; }
+  // Returns the entry's data if it's stored, so that it can be used without
+  // copying. Returns `nullptr` for compressed entries.
+  const uint8_t *getData(const Entry &E) const;
+  // Writes the entry's `E.Size` bytes of data into `Out`. Deflated entries are
+  // decompressed straight into it.
+  bool extract(const Entry &E, uint8_t *Out) const;
+
+private:
+  // Returns offset of the entry's data or `0` if the local header is invalid.
+  uint64_t getDataOffset(const Entry &E) const;
+
+  static std::mutex Mutex; // Guards `Archives`
+  static std::map<std::string, std::unique_ptr<IpaArchive>> Archives;
+
+  void *File = nullptr;
+  void *Section = nullptr;
+  const uint8_t *Data = nullptr;
+  uint64_t Size = 0;
+  std::unordered_map<std::string, Entry> Entries; // Normalized path -> entry
+  std::string Executable;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_IPA_ARCHIVE_HPP)
+#endif
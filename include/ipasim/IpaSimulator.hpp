@@ -1,40 +1,257 @@
-// IpaSimulator.hpp: Definition of class `IpaSimulator` and declarations of
-// functions that are part of `IpaSimLibrary`'s public API.
+// IpaSimulator.hpp: Definition of classes `IpaSimulator` and `ThreadContext`
+// and declarations of functions that are part of `IpaSimLibrary`'s public API.
 
 #ifndef IPASIM_IPA_SIMULATOR_HPP
 #define IPASIM_IPA_SIMULATOR_HPP
 
+#include "ipasim/AllocationProfiler.hpp"
+#include "ipasim/ClassRealizer.hpp"
 #include "ipasim/Common.hpp"
+#include "ipasim/CrossingRecorder.hpp"
+#include "ipasim/CrossingStats.hpp"
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/Emulator.hpp"
+#include "ipasim/EventProvider.hpp"
+#include "ipasim/Executor.hpp"
+#include "ipasim/FrameStats.hpp"
+#include "ipasim/GuestClock.hpp"
+#include "ipasim/GuestHeap.hpp"
+#include "ipasim/GuestProfiler.hpp"
+#include "ipasim/GuestTSD.hpp"
+#include "ipasim/HotEntries.hpp"
 #include "ipasim/Logger.hpp"
+#include "ipasim/NativeTranslations.hpp"
+#include "ipasim/RuntimeStats.hpp"
+#include "ipasim/StackPool.hpp"
 #include "ipasim/SysTranslator.hpp"
 #include "ipasim/TextBlockStream.hpp"
+#include "ipasim/TraceBuffer.hpp"
+#include "ipasim/Tracepoints.hpp"
+#include "ipasim/UIDispatcher.hpp"
+#include "ipasim/Watchpoints.hpp"
 
+#include <atomic>
+#include <experimental/coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
 #include <unicorn/unicorn.h>
 #include <winrt/Windows.ApplicationModel.Activation.h>
 
 namespace ipasim {
 
+// Emulation state of a host thread other than the main one. Each such thread
+// has its own Unicorn engine (which sees the same memory as all the others),
+// stack and `SysTranslator`, so that guest code can run on multiple threads in
+// parallel.
+class ThreadContext {
+public:
+  ThreadContext(DynamicLoader &Dyld, GuestMemoryMap &Space);
+  ThreadContext(const ThreadContext &) = delete;
+  ~ThreadContext();
+
+  Emulator Emu;
+  SysTranslator Sys;
+};
+
+// Stages of starting the main binary reported to `StartupHandler`.
+enum class StartupStage {
+  Loading,      // `Detail` is path of the image being loaded
+  Initializing, // Running `_objc_init` and the entry point
+  Launching,    // Calling `UIApplicationLaunched`
+  Done,
+  Failed
+};
+using StartupHandler =
+    std::function<void(StartupStage Stage, const std::string &Detail)>;
+
+class IpaSimulator;
+
+// Awaitable call of guest code returned by `IpaSimulator::callGuestAsync`.
+// While the emulation thread runs (see `UIDispatcher`), awaiting it posts
+// `Func(SysTranslator &)` there as one turn of the guest's main run loop and
+// suspends the awaiting coroutine without blocking its thread. The coroutine
+// is resumed on the UI thread if it was suspended there (through its message
+// loop), otherwise right on the emulation thread after the call. Without the
+// emulation thread or when awaited on it, the call is made synchronously like
+// `IpaSimulator::callGuest`.
+template <typename FuncTy> class GuestCall {
+public:
+  using ResultTy = std::invoke_result_t<FuncTy &, SysTranslator &>;
+
+  GuestCall(IpaSimulator &Sim, FuncTy Func) : Sim(Sim), Func(std::move(Func)) {}
+  GuestCall(const GuestCall &) = delete;
+
+  bool await_ready() const;
+  void await_suspend(std::experimental::coroutine_handle<> Handle);
+  ResultTy await_resume();
+
+private:
+  // Set once `Func` has been called on the emulation thread.
+  using StorageTy =
+      std::conditional_t<std::is_void_v<ResultTy>, std::monostate, ResultTy>;
+
+  IpaSimulator &Sim;
+  FuncTy Func;
+  std::optional<StorageTy> Result;
+};
+
 class IpaSimulator {
 public:
   IpaSimulator();
+  // Returns `SysTranslator` of the current host thread. It's created on demand
+  // when guest code is executed from a new thread for the first time.
+  SysTranslator &sys();
+  // Calls `Func(SysTranslator &)` to run guest code called by the current
+  // thread. Guest code called by the UI thread is executed on the emulation
+  // thread (see `UIDispatcher`).
+  template <typename FuncTy> auto callGuest(FuncTy &&Func) {
+    if (!UI.isUIThread())
+      return Func(sys());
+    using ResultTy = decltype(Func(Sys));
+    if constexpr (std::is_void_v<ResultTy>)
+      UI.callOnEmulation([&]() { Func(Sys); });
+    else {
+      ResultTy Result{};
+      UI.callOnEmulation([&]() { Result = Func(Sys); });
+      return Result;
+    }
+  }
+  // Like `callGuest`, but returns an awaitable (see `GuestCall`), so that
+  // native coroutines (e.g., C++/WinRT event handlers) don't have to block
+  // their thread. `Func` is stored in it until the call is made.
+  template <typename FuncTy>
+  GuestCall<std::decay_t<FuncTy>> callGuestAsync(FuncTy &&Func) {
+    return {*this, std::forward<FuncTy>(Func)};
+  }
+  // Calls `OnStartup` if there is any. Can be called from any thread.
+  void reportStartup(StartupStage Stage, const std::string &Detail = {});
+  // Replaces `OnStartup` (see `ipasim::load`). Can be called from any thread.
+  void setStartupHandler(StartupHandler Handler);
+  // Calls `Func(const SysTranslator &)` for `SysTranslator`s of all threads
+  // (see `sys`), so that their counters and gauges can be summed up.
+  template <typename FuncTy> void forEachTranslator(FuncTy &&Func) {
+    std::lock_guard<std::mutex> Lock(TranslatorsMutex);
+    Func(static_cast<const SysTranslator &>(Sys));
+    for (const SysTranslator *T : Translators)
+      Func(*T);
+  }
+  // Returns `SysTranslator::getProgress` summed over all threads, including
+  // those which have already exited.
+  uint32_t getProgress();
 
+  // Declared first, so that they can be used by the others.
+  Tracepoints Traces;
+  RuntimeStats Stats;
+  EventProvider Events;
+  GuestMemoryMap Space;
   Emulator Emu;
   DynamicLoader Dyld;
+  GuestHeap Heap;
+  GuestTSD TSD;
+  StackPool Stacks;
+  GuestClock Clock;
+  Watchpoints Watches;
+  GuestProfiler Profiler;
+  AllocationProfiler Allocations;
+  TraceBuffer Trace;
+  CrossingStats Crossings;
+  CrossingRecorder Recorder;
+  NativeTranslations Translations;
+  HotEntries Entries;
+  ClassRealizer Classes;
+  FrameStats Frames;
   std::string MainBinary;
-  SysTranslator Sys;
+  std::mutex StartupMutex;
+  StartupHandler OnStartup; // Guarded by `StartupMutex`
+  std::string ReachSymbol;           // See `ipaSim_onReached`.
+  void (*ReachCallback)() = nullptr; // See `ipaSim_onReached`.
+  // See `ipaSim_traceWindow`.
+  std::vector<std::pair<std::string, uint64_t>> TraceWindows;
+  SysTranslator Sys; // Used by the main thread
+  // Of `ThreadContext`s, see `forEachTranslator`.
+  std::mutex TranslatorsMutex;
+  std::vector<SysTranslator *> Translators;
+  std::atomic<uint32_t> RetiredProgress = 0; // Of destroyed `Translators`
   TextBlockProvider LogText;
+  std::thread::id MainThread;
+  UIDispatcher UI;
+  Executor Pool; // Declared last, so that workers are stopped first.
 };
 
-// Starts the emulation.
+template <typename FuncTy> bool GuestCall<FuncTy>::await_ready() const {
+  return !Sim.UI.isActive() || Sim.UI.isEmulationThread();
+}
+
+template <typename FuncTy>
+void GuestCall<FuncTy>::await_suspend(
+    std::experimental::coroutine_handle<> Handle) {
+  bool FromUI = Sim.UI.isUIThread();
+  Sim.UI.post([this, Handle, FromUI]() {
+    if constexpr (std::is_void_v<ResultTy>) {
+      Func(Sim.Sys);
+      Result.emplace();
+    } else
+      Result.emplace(Func(Sim.Sys));
+    if (FromUI)
+      Sim.UI.postToUI([Handle]() { Handle.resume(); });
+    else
+      Handle.resume();
+  });
+}
+
+template <typename FuncTy>
+typename GuestCall<FuncTy>::ResultTy GuestCall<FuncTy>::await_resume() {
+  if (!Result)
+    return Sim.callGuest(Func);
+  if constexpr (!std::is_void_v<ResultTy>)
+    return std::move(*Result);
+}
+
+// Starts reading images used by the previous launch of `Path` (see
+// `LaunchProfile`) in the background. It's optional, but it lets the read-ahead
+// overlap with what the caller does before `load` (e.g., copying the app).
+IPASIM_EXPORT void prefetch(const winrt::hstring &Path);
+// Loads the binary and all its dependencies. It doesn't need the UI thread, so
+// it should be called on a background one, so that the window stays
+// responsive. Progress is reported to `Handler` on the calling thread. Returns
+// `false` if the binary couldn't be loaded.
+IPASIM_EXPORT bool load(const winrt::hstring &Path, StartupHandler Handler);
+// Runs the binary loaded by `load`. Must be called on the UI thread. Unless
+// `UIBatchBudget` is zero, it only starts the emulation thread (see
+// `UIDispatcher`) and returns, the rest of startup is reported from there.
+IPASIM_EXPORT void run(
+    const winrt::Windows::ApplicationModel::Activation::LaunchActivatedEventArgs
+        &LaunchArgs);
+// Starts the emulation, i.e., calls `load` and `run` on the current thread.
 IPASIM_EXPORT void start(
     const winrt::hstring &Path,
     const winrt::Windows::ApplicationModel::Activation::LaunchActivatedEventArgs
         &LaunchArgs);
+// Releases memory that can be rebuilt when it's needed again, so that the app
+// is cheap to keep around while it's suspended. Nothing has to be done on
+// resume. Can be called from any thread, even while the guest is running.
+IPASIM_EXPORT void suspend();
 // Used to connect the logging window from `IpaSimApp` with `IpaSimLibrary`.
 IPASIM_EXPORT TextBlockProvider &logText();
+// Used by the performance overlay of `IpaSimApp`. Returns the JSON of
+// `ipaSim_getStats`.
+IPASIM_EXPORT std::string getStats();
+// Used by the performance overlay of `IpaSimApp` while it's shown. Starts or
+// stops measuring frame pacing (see `FrameStats::track`). Must be called on the
+// UI thread.
+IPASIM_EXPORT void trackFrames(bool Enable);
+// Returns wrapped functions called most since the previous call (see
+// `CrossingStats::takeHottest`). It's empty unless `CountCrossings` is enabled.
+IPASIM_EXPORT std::vector<std::pair<std::string, uint64_t>>
+getHotWrappers(size_t Count);
 // TODO: This is just a workaround, because MSVC cannot compile `Log.error`
 // calls.
 IPASIM_EXPORT void error(const char *Message);
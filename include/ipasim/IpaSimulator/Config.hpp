@@ -8,6 +8,8 @@
 
 namespace ipasim {
 
+// These switches only set which categories of `Tracepoints` are initially
+// enabled.
 #if !defined(IPASIM_PRINT_ALL)
 #define IPASIM_PRINT_ALL 0
 #endif
@@ -27,6 +29,338 @@ constexpr bool PrintMemoryWrites = IPASIM_PRINT_MEMORY_WRITES;
 #endif
 constexpr bool PrintEmuInfo = IPASIM_PRINT_EMU_INFO;
 
+// If enabled, pointers through which emulated code calls native functions that
+// have a wrapper are rewritten to point to the wrapper directly. This avoids
+// crossing into `SysTranslator::handleFetchProtMem` on subsequent calls, but
+// the patched pointers are no longer equal to the original native addresses.
+#if !defined(IPASIM_PATCH_CALL_SITES)
+#define IPASIM_PATCH_CALL_SITES 0
+#endif
+constexpr bool PatchCallSites = IPASIM_PATCH_CALL_SITES;
+
+// If enabled, calls between emulated and native code are counted and timed per
+// target function. See `CrossingStats`.
+#if !defined(IPASIM_COUNT_CROSSINGS)
+#define IPASIM_COUNT_CROSSINGS 0
+#endif
+constexpr bool CountCrossings = IPASIM_COUNT_CROSSINGS;
+
+// If enabled, native functions called by emulated code are remembered when
+// `SysTranslator` first resolves them (so it costs nothing on cached calls) and
+// `ipaSim_writeCoverage` adds them to a list HeadersAnalyzer reads as
+// `wrapper_coverage.txt`. See `CrossingStats::cover`.
+#if !defined(IPASIM_WRAPPER_COVERAGE)
+#define IPASIM_WRAPPER_COVERAGE 1
+#endif
+constexpr bool WrapperCoverage = IPASIM_WRAPPER_COVERAGE;
+
+// If enabled, functions of the main binary translated ahead of time by
+// `IpaSimLifter` (into `<binary>.lifted.dll`) run natively instead of being
+// emulated. Each one costs a code hook at its entry point and restarting
+// emulation after it returns. See `NativeTranslations`.
+#if !defined(IPASIM_NATIVE_TRANSLATIONS)
+#define IPASIM_NATIVE_TRANSLATIONS 1
+#endif
+constexpr bool NativeTranslationsEnabled = IPASIM_NATIVE_TRANSLATIONS;
+
+// If `true`, Objective-C methods without wrappers are called directly by
+// `DynamicCaller` when their signature allows it, instead of through libffi.
+// See `CallShape::Direct`.
+#if !defined(IPASIM_DIRECT_DYNAMIC_CALLS)
+#define IPASIM_DIRECT_DYNAMIC_CALLS 1
+#endif
+constexpr bool DirectDynamicCalls = IPASIM_DIRECT_DYNAMIC_CALLS;
+
+// Backend used by `Emulator`s unless environment variable `IPASIM_CPU_BACKEND`
+// says otherwise (see `CPUBackend::getDefault`).
+#if !defined(IPASIM_DEFAULT_CPU_BACKEND)
+#define IPASIM_DEFAULT_CPU_BACKEND "unicorn"
+#endif
+constexpr const char *DefaultCPUBackend = IPASIM_DEFAULT_CPU_BACKEND;
+
+// If not zero, emulation is interrupted after this many instructions, so that
+// guest threads created by `SysTranslator::spawn` can be preempted. Note that
+// Unicorn counts instructions using a code hook, so this slows down emulation.
+#if !defined(IPASIM_INSTRUCTION_BUDGET)
+#define IPASIM_INSTRUCTION_BUDGET 0
+#endif
+constexpr size_t InstructionBudget = IPASIM_INSTRUCTION_BUDGET;
+
+// If enabled, when a guest thread created by `SysTranslator::spawn` calls a
+// native function that only waits for something to happen (e.g.,
+// `dispatch_semaphore_wait` or `usleep`) while other guest threads are ready,
+// the call is made on a thread pool thread and the guest thread is parked
+// until it returns, so that the others can run meanwhile. Once all guest
+// threads are parked, the scheduler blocks on an event instead of polling
+// them. Other threads block inside the native function anyway.
+#if !defined(IPASIM_PARK_IDLE_WAITS)
+#define IPASIM_PARK_IDLE_WAITS 1
+#endif
+constexpr bool ParkIdleWaits = IPASIM_PARK_IDLE_WAITS;
+
+// If enabled, a guest thread whose `InstructionBudget` runs out four times in a
+// row inside the same `SpinWindow` bytes of code without any crossing is
+// considered busy-waiting (twice is enough if the code contains `ldrex` or
+// `strex`). It's then switched for another guest thread or, if there is none,
+// the host thread yields its core, so that whoever it waits for can run.
+#if !defined(IPASIM_SPIN_DETECTION)
+#define IPASIM_SPIN_DETECTION 1
+#endif
+constexpr bool SpinDetection = IPASIM_SPIN_DETECTION;
+constexpr uint32_t SpinWindow = 64;
+
+// If enabled, `OSSpinLock*` and `os_unfair_lock_*` functions called by
+// emulated code are bound to "kernel" functions. Contended locks yield to
+// other guest threads or wait on the host (using `WaitOnAddress`) instead of
+// spinning in emulated code (see `SysTranslator::handleSpinLockFunction`).
+#if !defined(IPASIM_NATIVE_SPIN_LOCKS)
+#define IPASIM_NATIVE_SPIN_LOCKS 1
+#endif
+constexpr bool NativeSpinLocks = IPASIM_NATIVE_SPIN_LOCKS;
+
+// If enabled, `DynamicLoader` first discovers all dependencies of a library
+// and parses (Mach-O) or loads (PE) them concurrently. Mapping and binding are
+// then still done serially in dependency order.
+#if !defined(IPASIM_PARALLEL_LOADING)
+#define IPASIM_PARALLEL_LOADING 0
+#endif
+constexpr bool ParallelLoading = IPASIM_PARALLEL_LOADING;
+
+// If enabled, resolved bindings of Mach-O binaries are cached on disk (see
+// `PrelinkCache`), so that symbols don't have to be looked up on warm starts.
+#if !defined(IPASIM_PRELINK_CACHE)
+#define IPASIM_PRELINK_CACHE 1
+#endif
+constexpr bool UsePrelinkCache = IPASIM_PRELINK_CACHE;
+
+// If enabled, memory of Mach-O images right after loading is saved on disk
+// (see `ImageSnapshot`) and mapped on warm starts instead of mapping, rebasing
+// and binding the image again. Requires `UsePrelinkCache`. Call sites are not
+// recorded for restored images, so it's disabled with `PatchCallSites`.
+#if !defined(IPASIM_IMAGE_SNAPSHOTS)
+#define IPASIM_IMAGE_SNAPSHOTS 1
+#endif
+constexpr bool UseImageSnapshots =
+    IPASIM_IMAGE_SNAPSHOTS && UsePrelinkCache && !PatchCallSites;
+
+// Size of address space reserved for guest memory (see `GuestArena`). If it is
+// `0` or exhausted, guest memory is allocated separately.
+#if !defined(IPASIM_ARENA_SIZE)
+#define IPASIM_ARENA_SIZE (512 * 1024 * 1024)
+#endif
+constexpr uint64_t ArenaSize = IPASIM_ARENA_SIZE;
+
+// If enabled, Mach-O images are reserved at the addresses they were linked
+// with if those are free, so that they don't have to be rebased and their
+// pages stay shared with the file (see `ImageMapping::reserve`). Only helps in
+// 32-bit processes and for images linked above the first allocation granule.
+#if !defined(IPASIM_PREFERRED_ADDRESSES)
+#define IPASIM_PREFERRED_ADDRESSES 1
+#endif
+constexpr bool PreferredImageAddresses = IPASIM_PREFERRED_ADDRESSES;
+
+// Number of seconds after the start of an app during which used images and
+// their pages are recorded (see `LaunchProfile`). They are prefetched on the
+// next start. `0` disables this.
+#if !defined(IPASIM_LAUNCH_PROFILE_WINDOW)
+#define IPASIM_LAUNCH_PROFILE_WINDOW 10
+#endif
+constexpr unsigned LaunchProfileWindow = IPASIM_LAUNCH_PROFILE_WINDOW;
+
+// If enabled, guest code entered most often during `LaunchProfileWindow` is
+// recorded and translated by the emulation thread while it's idle on the next
+// launch (see `HotEntries`). It needs a backend which can translate without
+// executing (see `CPUBackend::translate`).
+#if !defined(IPASIM_PRETRANSLATION)
+#define IPASIM_PRETRANSLATION 1
+#endif
+constexpr bool Pretranslation =
+    IPASIM_PRETRANSLATION && LaunchProfileWindow != 0;
+
+// If enabled, Objective-C classes of loaded images are realized by the
+// emulation thread while it's idle, those used by the previous launch first
+// (see `ClassRealizer`), instead of on the first message to each of them.
+#if !defined(IPASIM_PREREALIZE_CLASSES)
+#define IPASIM_PREREALIZE_CLASSES 1
+#endif
+constexpr bool PrerealizeClasses = IPASIM_PREREALIZE_CLASSES;
+
+// If enabled, time spent in phases of loading each library is measured and
+// saved when the main binary reaches its entry point (see `StartupReport`).
+#if !defined(IPASIM_STARTUP_REPORTS)
+#define IPASIM_STARTUP_REPORTS 1
+#endif
+constexpr bool StartupReports = IPASIM_STARTUP_REPORTS;
+
+// Maximum number of bytes of host memory mapped when guest code accesses
+// unmapped memory (see `SysTranslator::handleMemUnmapped`). It should be a
+// power of two. `0` means the whole committed region is mapped.
+#if !defined(IPASIM_FAULT_GRANULE)
+#define IPASIM_FAULT_GRANULE (1024 * 1024)
+#endif
+constexpr uint64_t FaultGranule = IPASIM_FAULT_GRANULE;
+
+// Sizes of guest stacks of the main thread and of other threads (see
+// `StackPool`). Stacks are only reserved, they are committed as they grow.
+#if !defined(IPASIM_MAIN_STACK_SIZE)
+#define IPASIM_MAIN_STACK_SIZE (8 * 1024 * 1024)
+#endif
+constexpr uint64_t MainStackSize = IPASIM_MAIN_STACK_SIZE;
+#if !defined(IPASIM_THREAD_STACK_SIZE)
+#define IPASIM_THREAD_STACK_SIZE (1024 * 1024)
+#endif
+constexpr uint64_t ThreadStackSize = IPASIM_THREAD_STACK_SIZE;
+
+// Size of chunks of `GuestHeap` from which small blocks are allocated. Each
+// chunk is mapped into the guest as a whole.
+#if !defined(IPASIM_GUEST_HEAP_CHUNK)
+#define IPASIM_GUEST_HEAP_CHUNK (1024 * 1024)
+#endif
+constexpr uint64_t GuestHeapChunk = IPASIM_GUEST_HEAP_CHUNK;
+
+// If enabled, `malloc`, `calloc`, `realloc` and `free` called by emulated code
+// are implemented by `GuestHeap` instead of the CRT wrappers, so that the guest
+// never faults on memory it allocates. Memory allocated this way must not be
+// freed by native code (other than through `ipaSim_guestFree`), though.
+#if !defined(IPASIM_GUEST_MALLOC)
+#define IPASIM_GUEST_MALLOC 0
+#endif
+constexpr bool GuestMalloc = IPASIM_GUEST_MALLOC;
+
+// If enabled, `memcpy`, `memmove`, `memset`, `bzero`, `strlen`, `strcmp` and
+// `memcmp` called by emulated code are bound to "kernel" functions that run
+// the host's implementations right inside the fetch hook, skipping the Dylib
+// and DLL wrappers (see `SysTranslator::handleStringFunction`).
+#if !defined(IPASIM_NATIVE_STRING_FUNCTIONS)
+#define IPASIM_NATIVE_STRING_FUNCTIONS 1
+#endif
+constexpr bool NativeStringFunctions = IPASIM_NATIVE_STRING_FUNCTIONS;
+
+// If enabled, `pthread_getspecific`, `pthread_setspecific`,
+// `pthread_key_create` and `pthread_key_delete` called by emulated code are
+// bound to "kernel" functions working on blocks of `GuestTSD`, which emulated
+// code can also reach directly through register TPIDRURO (see
+// `SysTranslator::handleTSDFunction`).
+#if !defined(IPASIM_NATIVE_TSD)
+#define IPASIM_NATIVE_TSD 1
+#endif
+constexpr bool NativeTSD = IPASIM_NATIVE_TSD;
+
+// If enabled, ARC's optimized return values work between emulated functions:
+// `objc_autoreleaseReturnValue` called right before returning to a caller
+// which immediately passes the result to `objc_retainAutoreleasedReturnValue`
+// (recognized by marker `mov r7, r7` at the return address) hands the object
+// over at +1 instead of putting it into the autorelease pool. Both functions
+// are DLL wrappers, so the native runtime cannot see the marker. Instead,
+// `SysTranslator::handleHandshake` does the handshake in the fetch hook with
+// the disposition stored in the guest's slot `GuestTSD::ReturnDispositionKey`.
+#if !defined(IPASIM_OPTIMIZED_RETURNS)
+#define IPASIM_OPTIMIZED_RETURNS 1
+#endif
+constexpr bool OptimizedReturns = IPASIM_OPTIMIZED_RETURNS;
+
+// If enabled, each guest thread gets a `GuestPoolPage`, where Dylib wrappers
+// push autorelease pools and autorelease objects without crossing into native
+// code (if `HeadersAnalyzer` generated them with `InlineAutoreleasePools`).
+#if !defined(IPASIM_GUEST_AUTORELEASE_POOLS)
+#define IPASIM_GUEST_AUTORELEASE_POOLS 1
+#endif
+constexpr bool GuestAutoreleasePools = IPASIM_GUEST_AUTORELEASE_POOLS;
+
+// If enabled, each guest thread gets a `CommandBuffer`, where Dylib wrappers of
+// deferred functions (if `HeadersAnalyzer` generated them with
+// `DeferredWrappers`) record their calls instead of calling native code.
+#if !defined(IPASIM_DEFERRED_CALLS)
+#define IPASIM_DEFERRED_CALLS 1
+#endif
+constexpr bool DeferredCalls = IPASIM_DEFERRED_CALLS;
+
+// If enabled, images registered while the app is starting (i.e., by
+// initializers of DLLs and by `SysTranslator::execute`) are not delivered to
+// the Objective-C runtime one by one. Instead, it receives a single
+// `_dyld_objc_notify_mapped` call with all of them right before the entry
+// point runs. See `DynamicLoader::beginBatch`.
+#if !defined(IPASIM_BATCH_STARTUP_IMAGES)
+#define IPASIM_BATCH_STARTUP_IMAGES 1
+#endif
+constexpr bool BatchStartupImages = IPASIM_BATCH_STARTUP_IMAGES;
+
+// If not zero, emulated code is sampled every this many microseconds (see
+// `GuestProfiler`). Samples are taken by a block hook, which costs much less
+// than the code hook used by `PrintInstructions`, but it's still not free.
+#if !defined(IPASIM_PROFILE_INTERVAL)
+#define IPASIM_PROFILE_INTERVAL 0
+#endif
+constexpr unsigned ProfileInterval = IPASIM_PROFILE_INTERVAL;
+
+// If not zero, allocations of `GuestHeap` made for emulated code are sampled
+// about once per this many allocated bytes (see `AllocationProfiler`). Guest
+// `malloc`s only go through `GuestHeap` if `GuestMalloc` is enabled, objects of
+// the Objective-C runtime once it calls `ipaSim_guestAlloc`.
+#if !defined(IPASIM_ALLOCATION_SAMPLE_INTERVAL)
+#define IPASIM_ALLOCATION_SAMPLE_INTERVAL 0
+#endif
+constexpr uint64_t AllocationSampleInterval = IPASIM_ALLOCATION_SAMPLE_INTERVAL;
+
+// If enabled with `GuestMalloc`, `malloc` and `free` of emulated code are bound
+// to their Dylib wrappers instead of "kernel" functions. The wrappers serve
+// small blocks from a per-thread `GuestMallocCache` in guest memory and cross
+// into native code only to refill or trim it in batches. Blocks are still
+// `GuestHeap`'s, so native code frees them the same way. Disabled while
+// `AllocationProfiler` is sampling, since it wouldn't see cached allocations.
+#if !defined(IPASIM_GUEST_MALLOC_CACHES)
+#define IPASIM_GUEST_MALLOC_CACHES 1
+#endif
+constexpr bool GuestMallocCaches =
+    IPASIM_GUEST_MALLOC_CACHES && GuestMalloc && AllocationSampleInterval == 0;
+
+// If not zero, traced instructions (see `PrintInstructions` and
+// `ipaSim_traceInstructions`) and all crossings between emulated and native
+// code are recorded into binary per-thread rings of this many records instead
+// of being logged (see `TraceBuffer`). It must be a power of two.
+#if !defined(IPASIM_BINARY_TRACE)
+#define IPASIM_BINARY_TRACE 0
+#endif
+constexpr uint64_t BinaryTraceRecords = IPASIM_BINARY_TRACE;
+constexpr bool BinaryTrace = BinaryTraceRecords != 0;
+
+// If not zero, `IpaSimLibrary` registers an ETW provider (see `EventProvider`)
+// and every this many crossings between emulated and native code of each
+// thread one is reported to it. Other events (image loads, emulation, ...) are
+// all reported. Without a listening session, each event costs a flag check.
+#if !defined(IPASIM_ETW_CROSSING_SAMPLING)
+#define IPASIM_ETW_CROSSING_SAMPLING 64
+#endif
+constexpr uint32_t EtwCrossingSampling = IPASIM_ETW_CROSSING_SAMPLING;
+constexpr bool EtwEvents = EtwCrossingSampling != 0;
+
+// If not zero, `mach_absolute_time` and `mach_timebase_info` called by emulated
+// code are bound to ARM code which reads time from a page updated by the host
+// (see `GuestClock`) instead of crossing into native code. The page is updated
+// every this many microseconds and whenever emulation starts.
+#if !defined(IPASIM_COMMPAGE_INTERVAL)
+#define IPASIM_COMMPAGE_INTERVAL 1000
+#endif
+constexpr unsigned CommPageInterval = IPASIM_COMMPAGE_INTERVAL;
+
+// If enabled, time of each guest thread is split into time spent in emulated
+// code and in native code it called (see `GuestTimes` and
+// `ipaSim_guestTimes`). It costs reading the performance counter twice per
+// crossing.
+#if !defined(IPASIM_GUEST_TIMES)
+#define IPASIM_GUEST_TIMES 0
+#endif
+constexpr bool AccountGuestTimes = IPASIM_GUEST_TIMES;
+
+// If not zero, `ipasim::run` moves the guest main thread to a dedicated
+// emulation thread and native calls which need the UI thread are marshaled to
+// it (see `UIDispatcher`). The UI thread executes them in batches of at most
+// this many microseconds before it lets XAML render a frame.
+#if !defined(IPASIM_UI_BATCH_BUDGET)
+#define IPASIM_UI_BATCH_BUDGET 8000
+#endif
+constexpr unsigned UIBatchBudget = IPASIM_UI_BATCH_BUDGET;
+
 } // namespace ipasim
 
 // !defined(IPASIM_IPA_SIMULATOR_CONFIG_HPP)
@@ -23,6 +23,10 @@ public:
   void linkDylib(llvm::StringRef Output, llvm::StringRef ObjectFile,
                  llvm::StringRef InstallName);
   void executeArgs();
+  // Runs LLD in-process. Its flavor is `lld-link` if `COFF` is `true`,
+  // otherwise `ld64.lld`. LLD has global state, so this waits for other links
+  // to finish.
+  static bool link(llvm::ArrayRef<const char *> Args, bool COFF);
 };
 
 } // namespace ipasim
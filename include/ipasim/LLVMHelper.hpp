@@ -5,8 +5,10 @@
 #define IPASIM_LLVM_HELPER_HPP
 
 #include "ipasim/HAContext.hpp"
+#include "ipasim/TaskGraph.hpp"
 
 #include <filesystem>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
@@ -15,6 +17,7 @@
 #include <llvm/Support/COM.h>
 #include <llvm/Support/StringSaver.h>
 #include <llvm/Target/TargetMachine.h>
+#include <map>
 #include <memory>
 #include <string>
 
@@ -85,14 +88,25 @@ public:
   }
 
   std::string mangleName(const llvm::Function &Func);
+  // Returns data layout of target `Triple` (created on first use). Note that it
+  // caches layouts of structures, so it should be used only with types of
+  // `Ctx`. `IRHelper`s have their own copies.
+  const llvm::DataLayout &getDataLayout(const std::string &Triple);
 
 private:
   llvm::BumpPtrAllocator A;
   std::unique_ptr<llvm::Module> Module;
+  std::map<std::string, llvm::DataLayout> DataLayouts;
 };
 
-// Helper class for generating functions in LLVM IR.
+// Helper class for generating functions in LLVM IR. Each module is created in
+// its own context, so that types and constants of one library are freed
+// together with its module instead of accumulating in `LLVMHelper::Ctx` until
+// the end. Types of exports (which live in `LLVMHelper::Ctx`) are recreated in
+// the module's context by `map`.
 class IRHelper {
+  std::unique_ptr<llvm::LLVMContext> OwnCtx;
+
 public:
   IRHelper(LLVMHelper &LLVM, llvm::StringRef Name, llvm::StringRef Path,
            llvm::StringRef Triple);
@@ -100,7 +114,17 @@ public:
   static const char *const Windows32;
   static const char *const Apple;
 
+  llvm::LLVMContext &Ctx;
   llvm::IRBuilder<> Builder;
+  llvm::Type *VoidPtrTy;
+
+  // Returns type `T` (e.g., type of an export) recreated in `Ctx`.
+  template <typename T> T *map(T *Type) {
+    return llvm::cast<T>(mapType(Type));
+  }
+  // Returns data layout of target `Triple`. Unlike `LLVMHelper`'s, it's freed
+  // along with types whose layouts it caches.
+  const llvm::DataLayout &getDataLayout(const std::string &Triple);
 
   bool isLittleEndian() const {
     return Module.getDataLayout().isLittleEndian();
@@ -112,15 +136,53 @@ public:
   llvm::Function *declareFunc(llvm::FunctionType *Type,
                               const llvm::Twine &Name);
   void defineFunc(llvm::Function *Func);
+  // Defines an exported global variable.
+  llvm::GlobalVariable *defineExport(const llvm::Twine &Name,
+                                     llvm::Constant *Init);
+  // Defines a private constant global variable.
+  llvm::GlobalVariable *definePrivate(llvm::Constant *Init);
+  // Defines an exported zero-initialized mutable global variable.
+  llvm::GlobalVariable *defineVariable(const llvm::Twine &Name,
+                                       llvm::Type *Type);
+  // Creates structure used to pass arguments and return value between Dylib
+  // and DLL wrappers. Its layout is the same on both sides, the return value
+  // (if any) is its last field.
   llvm::StructType *createParamStruct(const ExportEntry &Exp);
+  // Returns alignment which satisfies both iOS and Windows. For structures
+  // created by `createParamStruct`, returns the alignment of their fields.
+  unsigned getAlign(llvm::Type *T);
   llvm::Value *createCall(llvm::Function *Func,
                           llvm::ArrayRef<llvm::Value *> Args,
                           const llvm::Twine &Name);
   llvm::Value *createCall(llvm::FunctionType *FuncTy, llvm::Value *FuncPtr,
                           llvm::ArrayRef<llvm::Value *> Args,
-                          const llvm::Twine &Name);
+                          const llvm::Twine &Name,
+                          llvm::CallingConv::ID CC = llvm::CallingConv::C);
+  // Emits `svc #ID` with `Arg` (if any) in register R0.
+  void createHypercall(uint32_t ID, llvm::Value *Arg);
+  // Returns inline assembly of `svc #ID` (see `Hypercalls`). It clobbers R12.
+  static std::string getHypercallAsm(uint32_t ID);
+  // Emits `mrc p15, 0, rX, c13, c0, 3` and returns value of read-only thread
+  // ID register TPIDRURO (see `GuestTSD`).
+  llvm::Value *createThreadPointer();
+  // Defines an internal naked function consisting only of inline assembly
+  // `Asm`.
+  llvm::Function *defineNakedFunc(llvm::FunctionType *Type,
+                                  const llvm::Twine &Name,
+                                  const std::string &Asm);
+  // Declares an internal function with parameters of `FuncTy` followed by
+  // `TargetTy`. It holds body shared by wrappers of type `FuncTy` that differ
+  // only by their target (see `SharedWrappers`).
+  llvm::Function *declareShapeFunc(llvm::FunctionType *FuncTy,
+                                   llvm::Type *TargetTy);
+  // Forwards arguments of the current function `Func` along with `Target` to
+  // `Shape` and returns its result.
+  void createShapeCall(llvm::Function *Func, llvm::Function *Shape,
+                       llvm::Value *Target);
   void verifyFunction(llvm::Function *Func);
-  void emitObj(const std::filesystem::path &BuildDir, llvm::StringRef Path);
+  // Schedules compilation of the module into object file `Path`. Returns the
+  // scheduled task. See also `DumpIR`.
+  TaskGraph::Task *emitObj(llvm::StringRef Path, TaskGraph &Tasks);
   uint64_t getSize(llvm::Type *T) {
     return Module.getDataLayout().getTypeAllocSize(T);
   }
@@ -128,9 +190,14 @@ public:
 private:
   LLVMHelper &LLVM;
   llvm::Module Module;
-  std::unique_ptr<llvm::TargetMachine> TM;
   llvm::FunctionType *WrapperTy, *TrivialWrapperTy;
-  llvm::Type *VoidPtrTy;
+  llvm::DenseMap<llvm::Type *, llvm::Type *> Types;
+  std::map<std::string, llvm::DataLayout> DataLayouts;
+
+  llvm::Type *mapType(llvm::Type *Type);
+
+  static std::unique_ptr<llvm::TargetMachine>
+  createTargetMachine(const std::string &Triple);
 };
 
 // Ensures that the generated function is properly verified in the end via RAII.
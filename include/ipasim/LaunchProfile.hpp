@@ -0,0 +1,58 @@
+// LaunchProfile.hpp: Definition of class `LaunchProfile`.
+
+#ifndef IPASIM_LAUNCH_PROFILE_HPP
+#define IPASIM_LAUNCH_PROFILE_HPP
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// Images (and their file pages) used during the first seconds of a launch of
+// one app, recorded by `DynamicLoader::recordLaunchProfile`. On the next
+// launch, `replay` reads them in the same order ahead of the loader (similar
+// to the Windows prefetcher), so that the loader and the emulated code see
+// fewer hard page faults. Hot guest code of the launch and used Objective-C
+// classes are recorded, too (see `HotEntries` and `ClassRealizer`).
+class LaunchProfile {
+public:
+  // Part of the image (see `ImageMapping`), in bytes.
+  struct Range {
+    uint32_t Offset, Size;
+  };
+  struct Image {
+    std::string Path; // As key of `DynamicLoader::LLs`
+    bool IsDylib;
+    std::vector<Range> Ranges; // Empty for DLLs, they are loaded whole
+    // Offsets of `HotEntries` from the image's start (with the Thumb bit),
+    // most frequent first
+    std::vector<uint32_t> Entries;
+    std::vector<std::string> Classes; // See `ClassRealizer::getUsed`
+  };
+
+  LaunchProfile(const std::string &AppPath);
+
+  // Reads the profile from disk. Returns `false` if there is none.
+  bool load();
+  bool save();
+  // Prefetches pages of recorded Dylibs and loads recorded DLLs on a
+  // background thread.
+  void replay();
+
+  std::vector<Image> Images;
+
+private:
+  std::string getFileName();
+  bool parse(std::istream &I);
+
+  static constexpr uint32_t Magic = 0x504C5349; // "ISLP"
+  static constexpr uint32_t Version = 3;
+  std::string AppPath;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_LAUNCH_PROFILE_HPP)
+#endif
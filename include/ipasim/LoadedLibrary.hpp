@@ -4,33 +4,44 @@
 #define IPASIM_LOADED_LIBRARY_HPP
 
 #include "ipasim/Common.hpp"
+#include "ipasim/ExportTable.hpp"
 #include "ipasim/Logger.hpp"
 #include "ipasim/MachO.hpp"
 
 #include <LIEF/LIEF.hpp>
 #include <Windows.h>
 #include <cassert>
+#include <forward_list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace ipasim {
 
 class DynamicLoader;
 
-// Iterator over symbols of LIEF's Mach-O binary filtered by a RVA.
+// Iterator over names of symbols exported from `LoadedDylib` at one unslid
+// address. It walks a range of `LoadedDylib::ExportsByAddr`.
 class DylibSymbolIterator {
 public:
-  DylibSymbolIterator(uint64_t RVA, LIEF::MachO::it_exported_symbols Symbols)
-      : RVA(RVA), Symbols(std::move(Symbols)) {}
+  using ExportIterator =
+      std::vector<std::pair<uint64_t, const std::string *>>::const_iterator;
 
-  DylibSymbolIterator begin();
-  DylibSymbolIterator end() { return DylibSymbolIterator(RVA, Symbols.end()); }
-  DylibSymbolIterator &next();
+  DylibSymbolIterator(ExportIterator Symbols, ExportIterator End)
+      : Symbols(Symbols), End(End) {}
+
+  DylibSymbolIterator begin() { return *this; }
+  DylibSymbolIterator end() { return DylibSymbolIterator(End, End); }
   DylibSymbolIterator IPASIM_PREFIX(++);
   bool operator!=(const DylibSymbolIterator &Other);
-  LIEF::MachO::Symbol &operator*();
+  const std::string &operator*();
 
 private:
-  uint64_t RVA;
-  LIEF::MachO::it_exported_symbols Symbols;
+  ExportIterator Symbols, End;
 };
 
 // Represents a dynamic library (or executable) loaded by `DynamicLoader`.
@@ -39,43 +50,120 @@ public:
   LoadedLibrary() : StartAddress(0), Size(0), IsWrapper(false) {}
   virtual ~LoadedLibrary() = default;
 
+  // For Mach-O images, `StartAddress` is the slide, i.e., it's added to
+  // addresses the image was linked with. Their range starts `VMAddr` bytes
+  // after it, though (see `getStart`).
   uint64_t StartAddress, Size;
+  uint64_t VMAddr = 0; // Lowest address of segments as linked
   bool IsWrapper;
+  // Only Dylibs loaded by `DynamicLoader::open` (directly or as dependencies)
+  // can be unloaded, once nothing references them.
+  bool Unloadable = false;
+  uint32_t OpenCount = 0; // References taken by `DynamicLoader::open`
 
   virtual bool isDylib() = 0;
   bool isDLL() { return !isDylib(); }
-  // TODO: Check that the found symbol is inside range [StartAddress, +Size].
+  // TODO: Check that the found symbol is inside range [getStart(), +Size].
   virtual uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) = 0;
   virtual bool hasUnderscorePrefix() = 0;
+  // Returns where the image's range of `Size` bytes starts in memory.
+  uint64_t getStart() { return StartAddress + VMAddr; }
   bool isInRange(uint64_t Addr);
   void checkInRange(uint64_t Addr);
   virtual bool hasMachO() = 0;
   virtual MachO getMachO() = 0;
+  // Address of the image's header (as `dladdr` reports it).
+  virtual uint64_t getBase() = 0;
+  // Finds the nearest exported symbol at or before `Addr`. Returns its name
+  // (without underscore prefix) or `nullptr` and sets `SymAddr`.
+  virtual const char *findNearestSymbol(uint64_t Addr, uint64_t &SymAddr) = 0;
+  // Finds Objective-C method implemented at `Addr`. Must be called only if
+  // `hasMachO`.
+  ObjCMethod findMethod(uint64_t Addr) {
+    return Methods.find(getMachO(), Addr);
+  }
+  ObjCMethodIndex &getMethodIndex() { return Methods; }
+
+private:
+  ObjCMethodIndex Methods;
 };
 
-// A `.dylib` loaded via library LIEF.
+// A `.dylib` loaded either via `MachOReader` or via library LIEF.
 class LoadedDylib : public LoadedLibrary {
 public:
-  LIEF::MachO::Binary &Bin;
-
+  LoadedDylib() = default;
   LoadedDylib(std::unique_ptr<LIEF::MachO::FatBinary> &&Fat)
-      : Fat(move(Fat)), Bin(Fat->at(0)), Header(0) {}
+      : Fat(move(Fat)) {
+    Bin = &this->Fat->at(0);
+  }
+
+  // LIEF's model or `nullptr` if the binary was read by `MachOReader`.
+  LIEF::MachO::Binary *Bin = nullptr;
+  // Exported symbols and their unslid addresses
+  std::map<std::string, uint64_t> Exports;
+  std::vector<std::string> Reexports; // Install names of re-exported Dylibs
+  uint64_t HeaderAddr = 0;            // Unslid address of Mach-O header
+  uint64_t EntryPoint = 0;            // Unslid, `0` if there is none
+  // These are used for lazy binding (see `DynamicLoader::bindLazySymbol`):
+  const uint8_t *LazyBindInfo = nullptr; // Opcodes (mapped in the image)
+  size_t LazyBindSize = 0;
+  std::vector<uint64_t> SegmentAddrs;  // Slid addresses of segments
+  std::vector<std::string> DylibNames; // Indexed by ordinals minus one
+  // Slid addresses of segments and ranges of their content inside the image
+  // (used by `DynamicLoader::recordLaunchProfile`)
+  struct SegmentFile {
+    uint64_t Addr, Offset, Size;
+  };
+  std::vector<SegmentFile> SegmentFiles;
+  // Function wrapped by a wrapper Dylib's function, as encoded in its special
+  // symbol `$__ipaSim_wraps_<DLL>_<RVA>` (see `SysTranslator::translate`).
+  struct WrappedFunction {
+    std::string DLL;
+    uint64_t RVA;
+    LoadedLibrary *Lib = nullptr; // Loaded on first use
+  };
+  static constexpr ConstexprString WrapsPrefix = "$__ipaSim_wraps_";
 
   bool isDylib() override { return true; }
+  // Frees LIEF's model. Everything needed after loading is kept in the
+  // compact tables above.
+  void releaseModel() {
+    Bin = nullptr;
+    Fat.reset();
+  }
   uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) override;
-  // TODO: Use this function to implement `src/objc/dladdr.mm`.
+  // Builds hash table of all symbols that can be found in this Dylib,
+  // including those of re-exported libraries (recursively), so that
+  // `findSymbol` is a single lookup. Should be called after all re-exported
+  // libraries are loaded.
+  void flattenExports(DynamicLoader &DL);
+  // Builds reverse index of `Exports` used by `lookup` and `findWrapped`.
+  // Should be called when `Exports` are complete.
+  void indexExports();
   DylibSymbolIterator lookup(uint64_t Addr);
+  // Returns function wrapped by the wrapper at `Addr` or `nullptr`.
+  WrappedFunction *findWrapped(uint64_t Addr);
   bool hasUnderscorePrefix() override { return true; }
   bool hasMachO() override { return true; }
   MachO getMachO() override {
     if (!Header)
-      Header = StartAddress + Bin.imagebase();
+      Header = StartAddress + HeaderAddr;
     return MachO(reinterpret_cast<const void *>(Header));
   }
+  uint64_t getBase() override { return StartAddress + HeaderAddr; }
+  const char *findNearestSymbol(uint64_t Addr, uint64_t &SymAddr) override;
 
 private:
   std::unique_ptr<LIEF::MachO::FatBinary> Fat;
-  uint64_t Header;
+  uint64_t Header = 0;
+  // Slid addresses of all symbols (see `flattenExports`). Keys point into
+  // `Exports` of this and other Dylibs, into `OwnedNames`, or into loaded DLLs.
+  std::unordered_map<std::string_view, uint64_t> Symbols;
+  std::forward_list<std::string> OwnedNames;
+  bool Flattened = false;
+  // `Exports` sorted by their addresses
+  std::vector<std::pair<uint64_t, const std::string *>> ExportsByAddr;
+  std::unordered_map<uint64_t, WrappedFunction> Wrapped; // By unslid address
 };
 
 // A `.dll` loaded via Windows API.
@@ -83,17 +171,59 @@ class LoadedDll : public LoadedLibrary {
 public:
   HMODULE Ptr;
   bool MachOPoser;
+  // Symbols are looked up here (if it's available) instead of using
+  // `GetProcAddress`. See `DynamicLoader::findExportTable`.
+  const ExportTable *Table = nullptr;
 
   bool isDylib() override { return false; }
   uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) override;
+  // Calls `Func(Name, Addr)` for each symbol exported by name.
+  template <typename FuncTy> void forEachExport(FuncTy &&Func);
   bool hasUnderscorePrefix() override { return false; }
   bool hasMachO() override { return MachOPoser; }
   MachO getMachO() override {
     assert(hasMachO());
     return MachO(reinterpret_cast<const void *>(StartAddress));
   }
+  uint64_t getBase() override { return StartAddress; }
+  const char *findNearestSymbol(uint64_t Addr, uint64_t &SymAddr) override;
+
+private:
+  // Exports sorted by their addresses, built on first use. Names point into
+  // the image.
+  std::vector<std::pair<uint64_t, const char *>> ExportsByAddr;
+  std::once_flag Indexed;
 };
 
+template <typename FuncTy> void LoadedDll::forEachExport(FuncTy &&Func) {
+  auto Base = reinterpret_cast<uint64_t>(Ptr);
+  auto *DOS = reinterpret_cast<const IMAGE_DOS_HEADER *>(Base);
+  auto *NT = reinterpret_cast<const IMAGE_NT_HEADERS *>(Base + DOS->e_lfanew);
+  const IMAGE_DATA_DIRECTORY &Dir =
+      NT->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+  if (!Dir.Size)
+    return;
+
+  auto *Exports = reinterpret_cast<const IMAGE_EXPORT_DIRECTORY *>(
+      Base + Dir.VirtualAddress);
+  auto *Names = reinterpret_cast<const DWORD *>(Base + Exports->AddressOfNames);
+  auto *Ordinals =
+      reinterpret_cast<const WORD *>(Base + Exports->AddressOfNameOrdinals);
+  auto *Functions =
+      reinterpret_cast<const DWORD *>(Base + Exports->AddressOfFunctions);
+  for (DWORD I = 0; I != Exports->NumberOfNames; ++I) {
+    auto *Name = reinterpret_cast<const char *>(Base + Names[I]);
+    DWORD RVA = Functions[Ordinals[I]];
+
+    // Forwarded exports point inside the export directory, let the system
+    // resolve them.
+    if (RVA >= Dir.VirtualAddress && RVA < Dir.VirtualAddress + Dir.Size)
+      Func(Name, reinterpret_cast<uint64_t>(GetProcAddress(Ptr, Name)));
+    else
+      Func(Name, Base + RVA);
+  }
+}
+
 } // namespace ipasim
 
 // !defined(IPASIM_LOADED_LIBRARY_HPP)
@@ -225,6 +225,21 @@ private:
   std::wostream &WStr;
 };
 
+// A `Stream` that collects its output into a string. Wide characters outside
+// of ASCII are replaced by `?`.
+class StringStream : public Stream<StringStream> {
+public:
+  void write(const char *S) { Str += S; }
+  void write(const wchar_t *S) {
+    for (; *S; ++S)
+      Str += *S < 0x80 ? static_cast<char>(*S) : '?';
+  }
+  const std::string &str() const { return Str; }
+
+private:
+  std::string Str;
+};
+
 // A `Stream` that can write to multiple `Stream`s at once.
 template <typename... StreamTys>
 class AggregateStream : public Stream<AggregateStream<StreamTys...>> {
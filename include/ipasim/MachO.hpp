@@ -5,8 +5,14 @@
 
 #include "ipasim/Logger.hpp"
 
+#include <array>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <type_traits>
+#include <unordered_map>
+#include <vector>
 
 namespace ipasim {
 
@@ -19,6 +25,11 @@ public:
   const char *getName();
   // Returns empty class if this instance doesn't represent a category.
   ObjCClass getCategoryClass();
+  // These return `false` for categories.
+  bool isRealized();
+  // Returns `true` if the method cache of the class or its meta-class isn't
+  // empty.
+  bool hasCachedMethods();
 
   operator bool() { return Data; }
 
@@ -38,6 +49,12 @@ public:
   ObjCClass getClass() { return ObjCClass(Category, ClassData); }
   const char *getName();
   const char *getType();
+  uint64_t getImp();
+  bool isSameAs(const ObjCMethod &Other) const {
+    return MethodData == Other.MethodData;
+  }
+  // Returns methods of runtime's `method_list_t` at `List`.
+  static std::vector<ObjCMethod> fromList(void *ClassData, void *List);
 
   operator bool() { return MethodData; }
 
@@ -63,6 +80,43 @@ std::enable_if_t<is_stream_v<StreamTy>, StreamTy> &operator<<(StreamTy &Str,
   return Str;
 }
 
+// Segments and sections of one Mach-O image loaded in memory indexed by their
+// names, so that they can be found without walking load commands.
+class SectionTable {
+public:
+  SectionTable(const void *Hdr);
+
+  // Return slid address or `0` if there is no such segment or section.
+  uint64_t getSection(const char *SegName, const char *SectName,
+                      uint64_t *Size = nullptr);
+  uint64_t getSegment(const char *SegName, uint64_t *Size = nullptr);
+
+  // Returns table of image at `Hdr`, building it if necessary.
+  static SectionTable &get(const void *Hdr);
+  // Forgets table of image at `Hdr` before it's unloaded.
+  static void remove(const void *Hdr);
+
+private:
+  // Segment and section names (each up to 16 characters, not necessarily
+  // null-terminated).
+  using Key = std::array<char, 32>;
+  struct KeyHash {
+    size_t operator()(const Key &K) const;
+  };
+  struct Range {
+    uint64_t Addr, Size;
+  };
+
+  static Key makeKey(const char *SegName, const char *SectName);
+
+  std::unordered_map<Key, Range, KeyHash> Ranges; // Empty `SectName`s for
+                                                  // segments
+
+  static std::shared_mutex TablesMutex;
+  static std::unordered_map<const void *, std::unique_ptr<SectionTable>>
+      Tables;
+};
+
 // Helper class for reading sections, especially Objective-C-related, by
 // analyzing Mach-O headers. Note that the Mach-O binary being analyzed must be
 // loaded in memory at runtime (cf. class `ObjCMethodScout`).
@@ -84,14 +138,61 @@ public:
     *Count = Size / sizeof(T);
     return Result;
   }
+  // See `SectionTable`.
   uint64_t getSection(const char *SegName, const char *SectName,
-                      uint64_t *Size = nullptr);
+                      uint64_t *Size = nullptr) {
+    return SectionTable::get(Hdr).getSection(SegName, SectName, Size);
+  }
+  // Finds method implemented at `Addr` by enumerating all classes and
+  // categories. See also `ObjCMethodIndex`.
   ObjCMethod findMethod(uint64_t Addr);
+  // Returns classes of `__objc_classlist` (i.e., those realized lazily).
+  std::vector<ObjCClass> getClasses();
+  // Returns `true` if the image contains Objective-C metadata (i.e., section
+  // `__objc_imageinfo`).
+  bool hasObjCMetadata() {
+    return getSection(DataSegment, "__objc_imageinfo") ||
+           getSection("__DATA_CONST", "__objc_imageinfo");
+  }
 
 private:
+  friend class ObjCMethodIndex;
+
   const void *Hdr;
 
-  ObjCMethod findMethod(const char *Section, uint64_t Addr);
+  // Calls `Func(ObjCMethod)` for every method of the image until it returns
+  // `true`. Returns the method for which it did.
+  template <typename FuncTy> ObjCMethod forEachMethod(FuncTy &&Func);
+  template <typename FuncTy>
+  ObjCMethod forEachMethod(const char *Section, FuncTy &Func);
+};
+
+// Methods of one image sorted by their implementations, so that they can be
+// found by binary search instead of `MachO::findMethod`. It's built on first
+// use. The Objective-C runtime can sort method lists in place when it realizes
+// classes, so found methods are checked and the index is rebuilt if needed.
+// Methods added or changed at runtime are reported by the runtime (see
+// `DynamicLoader::updateMethod`).
+class ObjCMethodIndex {
+public:
+  ObjCMethod find(MachO Image, uint64_t Addr);
+  // Adds method `M` implemented inside this image.
+  void add(ObjCMethod M);
+  // Removes method `M` which was implemented at `Imp`.
+  void remove(ObjCMethod M, uint64_t Imp);
+
+private:
+  struct Entry {
+    uint64_t Imp;
+    ObjCMethod Method;
+  };
+
+  void build(MachO Image);
+
+  std::mutex Mutex;
+  bool Built = false;
+  std::vector<Entry> Entries;
+  std::vector<Entry> Added; // Kept across rebuilds
 };
 
 } // namespace ipasim
@@ -0,0 +1,151 @@
+// MachOReader.hpp: Definition of class `MachOReader` and struct `MachOInfo`.
+
+#ifndef IPASIM_MACHO_READER_HPP
+#define IPASIM_MACHO_READER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ipasim {
+
+// Everything `DynamicLoader::loadMachO` needs to know about a Mach-O binary.
+// It is filled either by `MachOReader` or from a LIEF model. All addresses are
+// unslid. Pointers point into the file data (or the LIEF model), so they are
+// valid only while the binary is being loaded.
+struct MachOInfo {
+  struct Segment {
+    uint64_t VMAddr, VMSize;
+    uint64_t FileOffset, FileSize;
+    uint32_t InitProt;
+    const uint8_t *Data; // File content of size `FileSize`
+  };
+  struct Dylib {
+    std::string Name;
+    bool Reexport;
+  };
+  // `Count` pointers starting at `Addr`, `Stride` bytes apart.
+  struct RebaseRun {
+    uint64_t Addr;
+    uint64_t Count;
+    uint32_t Stride;
+  };
+  struct Binding {
+    uint64_t Addr;
+    const std::string *Lib;
+    const char *Symbol;
+    bool Lazy;
+  };
+
+  uint32_t CPUType = 0;
+  uint32_t FileType = 0;
+  uint32_t Flags = 0;
+  uint64_t HeaderAddr = 0;
+  uint64_t EntryPoint = 0; // `0` if there is none
+  std::vector<Segment> Segments;
+  std::vector<Dylib> Dylibs;
+  std::vector<RebaseRun> Rebases; // Pointers to slide
+  std::vector<Binding> Bindings;
+  uint32_t LazyBindOffset = 0, LazyBindSize = 0; // In the file
+  std::vector<std::pair<std::string, uint64_t>> Exports;
+
+  // Appends to the last run of rebases if possible.
+  void addRebases(uint64_t Addr, uint64_t Count, uint32_t Stride) {
+    if (!Count)
+      return;
+    if (!Rebases.empty()) {
+      RebaseRun &Last = Rebases.back();
+      // Stride of a single pointer can be anything.
+      if (Last.Count == 1 && Addr > Last.Addr &&
+          Addr - Last.Addr <= UINT32_MAX)
+        Last.Stride = static_cast<uint32_t>(Addr - Last.Addr);
+      if (Last.Addr + Last.Count * Last.Stride == Addr &&
+          (Count == 1 || Stride == Last.Stride)) {
+        Last.Count += Count;
+        return;
+      }
+    }
+    Rebases.push_back(RebaseRun{Addr, Count, Stride});
+  }
+};
+
+// Opcodes from `<mach-o/loader.h>`.
+enum : uint8_t {
+  REBASE_TYPE_POINTER = 1,
+  REBASE_IMMEDIATE_MASK = 0x0F,
+  REBASE_OPCODE_MASK = 0xF0,
+  REBASE_OPCODE_DONE = 0x00,
+  REBASE_OPCODE_SET_TYPE_IMM = 0x10,
+  REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB = 0x20,
+  REBASE_OPCODE_ADD_ADDR_ULEB = 0x30,
+  REBASE_OPCODE_ADD_ADDR_IMM_SCALED = 0x40,
+  REBASE_OPCODE_DO_REBASE_IMM_TIMES = 0x50,
+  REBASE_OPCODE_DO_REBASE_ULEB_TIMES = 0x60,
+  REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB = 0x70,
+  REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB = 0x80,
+
+  BIND_TYPE_POINTER = 1,
+  BIND_IMMEDIATE_MASK = 0x0F,
+  BIND_OPCODE_MASK = 0xF0,
+  BIND_OPCODE_DONE = 0x00,
+  BIND_OPCODE_SET_DYLIB_ORDINAL_IMM = 0x10,
+  BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB = 0x20,
+  BIND_OPCODE_SET_DYLIB_SPECIAL_IMM = 0x30,
+  BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM = 0x40,
+  BIND_OPCODE_SET_TYPE_IMM = 0x50,
+  BIND_OPCODE_SET_ADDEND_SLEB = 0x60,
+  BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB = 0x70,
+  BIND_OPCODE_ADD_ADDR_ULEB = 0x80,
+  BIND_OPCODE_DO_BIND = 0x90,
+  BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB = 0xA0,
+  BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED = 0xB0,
+  BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB = 0xC0,
+
+  EXPORT_SYMBOL_FLAGS_KIND_MASK = 0x03,
+  EXPORT_SYMBOL_FLAGS_KIND_REGULAR = 0x00,
+  EXPORT_SYMBOL_FLAGS_REEXPORT = 0x08,
+  EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER = 0x10,
+};
+
+// Minimal reader of thin 32-bit Mach-O files. Unlike LIEF, it doesn't build an
+// object model, it decodes load commands, rebase and bind opcodes and export
+// trie directly from the file's bytes (see also `MachO::getSection`). Binaries
+// using anything unusual are rejected, LIEF should be used for those.
+class MachOReader {
+public:
+  MachOReader(const uint8_t *Data, size_t Size) : Data(Data), Size(Size) {}
+
+  // Returns `false` if the binary is not supported.
+  bool read(MachOInfo &Info);
+  // Reads only load commands (i.e., no rebases, bindings nor exports).
+  bool readLoadCommands(MachOInfo &Info);
+
+  // Finds the best ARMv7 slice of a fat binary. Thin binaries are returned
+  // whole. Returns `false` if there is no usable slice.
+  static bool findSlice(const uint8_t *Data, size_t Size, uint64_t &Offset,
+                        uint64_t &SliceSize);
+  static uint64_t readULEB128(const uint8_t *&P, const uint8_t *End);
+  static int64_t readSLEB128(const uint8_t *&P, const uint8_t *End);
+
+private:
+  bool readRebases(MachOInfo &Info, uint32_t Offset, uint32_t Size);
+  bool readBindings(MachOInfo &Info, uint32_t Offset, uint32_t Size,
+                    bool Lazy);
+  bool readExports(MachOInfo &Info, uint32_t Offset, uint32_t Size);
+  bool isInFile(uint64_t Offset, uint64_t Size) {
+    return Offset <= this->Size && Size <= this->Size - Offset;
+  }
+
+  const uint8_t *Data;
+  size_t Size;
+  uint32_t RebaseOffset = 0, RebaseSize = 0;
+  uint32_t BindOffset = 0, BindSize = 0;
+  uint32_t ExportOffset = 0, ExportSize = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_MACHO_READER_HPP)
+#endif
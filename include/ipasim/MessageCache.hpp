@@ -0,0 +1,54 @@
+// MessageCache.hpp: Definition of struct `MessageCache`.
+
+#ifndef IPASIM_MESSAGE_CACHE_HPP
+#define IPASIM_MESSAGE_CACHE_HPP
+
+#include "ipasim/Common.hpp"
+
+#include <cstdint>
+
+namespace ipasim {
+
+// Cache of `objc_msgLookup` results kept in guest memory, so that emulated
+// messengers generated by `HeadersAnalyzer` can find IMPs without crossing into
+// native code. It's exported from the wrapper of `libobjc.A.dylib` as `Symbol`.
+// Messengers fill it after each miss and so does the Objective-C runtime from
+// its own cache-fill path (see `DynamicLoader::fillMessageCaches`), so messages
+// already sent from native code are found, too.
+//
+// Entries are direct-mapped by `index(Isa, Sel)` and guarded by a sequence
+// counter: writers make `Seq` odd (using `ldrex`/`strex`) while they update
+// the entry, readers discard it if `Seq` is odd or changed while reading. An
+// entry is valid only if its `Gen` equals the cache's `Gen`, so all entries can
+// be invalidated at once by incrementing it (see
+// `DynamicLoader::flushMessageCaches`).
+struct MessageCache {
+  struct Entry {
+    uint32_t Seq;
+    uint32_t Gen;
+    uint32_t Isa;
+    uint32_t Sel;
+    uint32_t Imp;
+  };
+
+  static constexpr uint32_t Size = 4096; // Must be a power of two.
+  static constexpr ConstexprString Symbol = "$__ipaSim_msgCache";
+  // Hypercall IDs of `svc` instructions messengers execute when an IMP is not
+  // in the cache (see `SysTranslator::handleMsgDispatch`). They are never
+  // assigned to DLL wrappers.
+  static constexpr uint32_t DispatchID = 0xFFFFFE;
+  static constexpr uint32_t DispatchStretID = 0xFFFFFF;
+
+  // Objects and selectors are at least 8 and 4 bytes aligned, respectively.
+  static constexpr uint32_t index(uint32_t Isa, uint32_t Sel) {
+    return ((Isa >> 3) ^ (Sel >> 2)) & (Size - 1);
+  }
+
+  uint32_t Gen;
+  Entry Entries[Size];
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_MESSAGE_CACHE_HPP)
+#endif
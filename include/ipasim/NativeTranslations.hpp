@@ -0,0 +1,70 @@
+// NativeTranslations.hpp: Definition of class `NativeTranslations` and structs
+// `GuestCPU` and `NativeTranslation`.
+
+#ifndef IPASIM_NATIVE_TRANSLATIONS_HPP
+#define IPASIM_NATIVE_TRANSLATIONS_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+class LoadedLibrary;
+
+// Guest registers as seen by functions translated by `IpaSimLifter`. They get
+// it on entry with the state of the emulated CPU and set `R[15]` to the address
+// where emulation should continue (i.e., the return address).
+struct GuestCPU {
+  uint32_t R[16];
+  uint32_t CPSR; // Only flags N, Z, C and V are used.
+};
+
+using TranslatedFunction = void (*)(GuestCPU *CPU);
+
+// Entry of the table exported from a DLL generated by `IpaSimLifter` with name
+// `TableSymbol`. The table ends with an entry whose `Function` is `nullptr`.
+struct NativeTranslation {
+  // Relative to `LoadedLibrary::StartAddress` (i.e., the unslid address of the
+  // function), like addresses in `GuestProfiler`'s output and entries of
+  // `LaunchProfile`.
+  uint32_t Offset;
+  TranslatedFunction Function;
+  // Upper bound of bytes below SP the function accesses (see
+  // `ARMLifter::getFrameSize`).
+  uint32_t FrameSize;
+};
+
+// Guest functions which were translated ahead of time to native code. Lifted
+// DLLs of emulated binaries are loaded from `<binary>.lifted.dll` and each
+// `SysTranslator` then runs functions found in them natively instead of
+// emulating them (see `SysTranslator::handleTranslated`). See
+// `NativeTranslations` in the configuration.
+class NativeTranslations {
+public:
+  // Versioned like `LaunchProfile`, DLLs without `FrameSize` aren't loaded.
+  static constexpr const char *TableSymbol = "ipaSim_translations2";
+
+  // Loads translations of `Lib` from file `Path` next to it (if there is one).
+  // It should be called before the first `SysTranslator` is initialized,
+  // because engines install their hooks only then.
+  void load(LoadedLibrary *Lib, const std::string &Path);
+  // Returns `nullptr` if `Addr` is not an entry point of a translated function.
+  // `Offset` of the result is not used.
+  const NativeTranslation *find(uint64_t Addr) const {
+    auto It = Functions.find(Addr);
+    return It == Functions.end() ? nullptr : &It->second;
+  }
+  // Slid addresses of translated functions.
+  const std::vector<uint64_t> &getAddrs() const { return Addrs; }
+
+private:
+  std::unordered_map<uint64_t, NativeTranslation> Functions;
+  std::vector<uint64_t> Addrs;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_NATIVE_TRANSLATIONS_HPP)
+#endif
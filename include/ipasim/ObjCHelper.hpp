@@ -3,10 +3,13 @@
 #ifndef IPASIM_OBJC_HELPER_HPP
 #define IPASIM_OBJC_HELPER_HPP
 
+#include "ipasim/ObjCPreopt.hpp"
+
 #include <llvm/ObjCMetadata/ObjCMachOBinary.h>
 #include <llvm/Object/COFF.h>
-#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace ipasim {
 
@@ -14,35 +17,48 @@ namespace ipasim {
 struct ObjCMethod {
   uint32_t RVA;
   std::string Name;
+  std::string Type; // Type encoding
 
   bool operator<(const ObjCMethod &Other) const { return RVA < Other.RVA; }
 };
 
+// Everything found by `ObjCMethodScout` in one binary.
+struct ObjCScoutResults {
+  std::vector<ObjCMethod> Methods; // Sorted by RVA, without duplicates
+  std::vector<std::string> Selectors;
+  // Names and RVAs of classes and protocols
+  std::vector<std::pair<std::string, uint32_t>> Classes, Protocols;
+  // Names of classes and their superclasses
+  std::vector<std::pair<std::string, std::string>> SuperClasses;
+
+  // Adds selectors, classes and protocols to `Preopt` as DLL number `DLL`.
+  void addTo(ObjCPreoptBuilder &Preopt, uint32_t DLL) const;
+};
+
 // Helper class that can discover Objective-C methods from binary's metadata.
 // Note that the Mach-O binary being analyzed is the file, not the image loaded
-// into memory at runtime (cf. class `MachO`).
+// into memory at runtime (cf. class `MachO`). It's read from the buffer of
+// `COFF`, so the DLL isn't loaded again. Scouting doesn't have any shared
+// state, so it can run for multiple DLLs in parallel.
 class ObjCMethodScout {
 public:
-  static std::set<ObjCMethod>
-  discoverMethods(const std::string &DLLPath,
-                  llvm::object::COFFObjectFile *COFF);
+  static ObjCScoutResults discoverMethods(llvm::object::COFFObjectFile *COFF);
 
 private:
-  std::set<ObjCMethod> Results;
+  ObjCScoutResults Results;
   llvm::object::COFFObjectFile *COFF;
-  std::unique_ptr<llvm::MemoryBuffer> MB;
   std::unique_ptr<llvm::object::MachOObjectFile> MachO;
   llvm::MachOMetadata Meta;
 
   ObjCMethodScout(llvm::object::COFFObjectFile *COFF,
-                  std::unique_ptr<llvm::MemoryBuffer> &&MB,
                   std::unique_ptr<llvm::object::MachOObjectFile> &&MachO)
-      : COFF(COFF), MB(std::move(MB)), MachO(std::move(MachO)),
-        Meta(this->MachO.get()) {}
+      : COFF(COFF), MachO(std::move(MachO)), Meta(this->MachO.get()) {}
 
   void discoverMethods();
   template <typename ListTy> void findMethods(llvm::Expected<ListTy> &&List);
   template <typename ElementTy>
+  void registerElement(llvm::StringRef ElementName, const ElementTy &Element);
+  template <typename ElementTy>
   void registerOptionalMethods(llvm::StringRef ElementName,
                                const ElementTy &Element);
   void registerMethods(llvm::StringRef ElementName,
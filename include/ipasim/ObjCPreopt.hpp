@@ -0,0 +1,271 @@
+// ObjCPreopt.hpp: Definition of classes `ObjCPreopt` and `ObjCPreoptBuilder`.
+
+#ifndef IPASIM_OBJC_PREOPT_HPP
+#define IPASIM_OBJC_PREOPT_HPP
+
+#include "ipasim/CacheFile.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ipasim {
+
+// Layout of file `gen/objc-preopt.bin` generated by `HeadersAnalyzer`. It's our
+// equivalent of the Objective-C part of iOS's shared cache. It contains uniqued
+// selectors and classes and protocols of all DLLs in open-addressing hash
+// tables, so that the runtime doesn't have to build them on every launch.
+//
+// After the header, there are `DLLCount` offsets of DLL names, then
+// `SelectorCapacity` offsets of selector names, then `ClassCapacity` and
+// `ProtocolCapacity` entries and finally `StringsSize` bytes of strings. All
+// offsets point into the strings. Offset `0` marks an empty slot. Capacities
+// are powers of two.
+struct ObjCPreoptHeader {
+  uint32_t Magic; // 'IPAP'
+  uint32_t Version;
+  uint32_t DLLCount;
+  uint32_t SelectorCapacity;
+  uint32_t ClassCapacity;
+  uint32_t ProtocolCapacity;
+  uint32_t StringsSize;
+
+  static constexpr uint32_t ExpectedMagic = 'IPAP';
+  static constexpr uint32_t CurrentVersion = 1;
+};
+
+// Class or protocol defined at `RVA` in DLL number `DLL`.
+struct ObjCPreoptEntry {
+  uint32_t Name;
+  uint32_t DLL;
+  uint32_t RVA;
+};
+
+inline uint32_t hashObjCName(std::string_view Name) {
+  return static_cast<uint32_t>(hashBytes(Name.data(), Name.size(), HashSeed));
+}
+
+// Read-only view of the file's contents (see `ObjCPreoptHeader`).
+class ObjCPreopt {
+public:
+  ObjCPreopt() = default;
+  // Returns `false` if `Data` is not a valid preoptimization file.
+  bool load(const uint8_t *Data, size_t Size) {
+    if (Size < sizeof(ObjCPreoptHeader))
+      return false;
+    auto *H = reinterpret_cast<const ObjCPreoptHeader *>(Data);
+    if (H->Magic != ObjCPreoptHeader::ExpectedMagic ||
+        H->Version != ObjCPreoptHeader::CurrentVersion ||
+        !isPowerOfTwo(H->SelectorCapacity) ||
+        !isPowerOfTwo(H->ClassCapacity) ||
+        !isPowerOfTwo(H->ProtocolCapacity) || !H->StringsSize)
+      return false;
+    uint64_t Expected =
+        sizeof(ObjCPreoptHeader) +
+        (uint64_t(H->DLLCount) + H->SelectorCapacity) * sizeof(uint32_t) +
+        (uint64_t(H->ClassCapacity) + H->ProtocolCapacity) *
+            sizeof(ObjCPreoptEntry) +
+        H->StringsSize;
+    if (Size != Expected)
+      return false;
+
+    Hdr = H;
+    DLLs = reinterpret_cast<const uint32_t *>(H + 1);
+    Selectors = DLLs + H->DLLCount;
+    Classes = reinterpret_cast<const ObjCPreoptEntry *>(Selectors +
+                                                        H->SelectorCapacity);
+    Protocols = Classes + H->ClassCapacity;
+    Strings = reinterpret_cast<const char *>(Protocols + H->ProtocolCapacity);
+    // Strings must be terminated, so that they can be compared safely. Every
+    // offset must point into them and every table must have an empty slot, so
+    // that lookups stop.
+    if (Strings[H->StringsSize - 1] ||
+        !checkOffsets(DLLs, H->DLLCount, H->StringsSize,
+                      /* NeedsEmpty */ false) ||
+        !checkOffsets(Selectors, H->SelectorCapacity, H->StringsSize) ||
+        !checkEntries(Classes, H->ClassCapacity, *H) ||
+        !checkEntries(Protocols, H->ProtocolCapacity, *H)) {
+      Hdr = nullptr;
+      return false;
+    }
+    return true;
+  }
+  bool isLoaded() const { return Hdr; }
+
+  // Returns the uniqued selector or `nullptr` if it's not preoptimized.
+  const char *findSelector(const char *Name) const {
+    if (!Hdr)
+      return nullptr;
+    std::string_view N(Name);
+    uint32_t Mask = Hdr->SelectorCapacity - 1;
+    for (uint32_t I = hashObjCName(N) & Mask;; I = (I + 1) & Mask) {
+      uint32_t Offset = Selectors[I];
+      if (!Offset)
+        return nullptr;
+      if (std::string_view(Strings + Offset) == N)
+        return Strings + Offset;
+    }
+  }
+  const ObjCPreoptEntry *findClass(const char *Name) const {
+    return Hdr ? find(Classes, Hdr->ClassCapacity, Name) : nullptr;
+  }
+  const ObjCPreoptEntry *findProtocol(const char *Name) const {
+    return Hdr ? find(Protocols, Hdr->ProtocolCapacity, Name) : nullptr;
+  }
+  const char *getDLLName(const ObjCPreoptEntry &E) const {
+    return E.DLL < Hdr->DLLCount ? Strings + DLLs[E.DLL] : nullptr;
+  }
+
+private:
+  static bool isPowerOfTwo(uint32_t X) { return X && !(X & (X - 1)); }
+  // Returns `false` if any of `Count` offsets is out of `StringsSize` or, with
+  // `NeedsEmpty`, if none of them is `0`.
+  static bool checkOffsets(const uint32_t *Offsets, uint32_t Count,
+                           uint32_t StringsSize, bool NeedsEmpty = true) {
+    bool Empty = false;
+    for (uint32_t I = 0; I != Count; ++I) {
+      if (Offsets[I] >= StringsSize)
+        return false;
+      if (!Offsets[I])
+        Empty = true;
+    }
+    return Empty || !NeedsEmpty;
+  }
+  static bool checkEntries(const ObjCPreoptEntry *Table, uint32_t Capacity,
+                           const ObjCPreoptHeader &H) {
+    bool Empty = false;
+    for (uint32_t I = 0; I != Capacity; ++I) {
+      const ObjCPreoptEntry &E = Table[I];
+      if (!E.Name)
+        Empty = true;
+      else if (E.Name >= H.StringsSize || E.DLL >= H.DLLCount)
+        return false;
+    }
+    return Empty;
+  }
+  const ObjCPreoptEntry *find(const ObjCPreoptEntry *Table, uint32_t Capacity,
+                              const char *Name) const {
+    std::string_view N(Name);
+    uint32_t Mask = Capacity - 1;
+    for (uint32_t I = hashObjCName(N) & Mask;; I = (I + 1) & Mask) {
+      const ObjCPreoptEntry &E = Table[I];
+      if (!E.Name)
+        return nullptr;
+      if (std::string_view(Strings + E.Name) == N)
+        return &E;
+    }
+  }
+
+  const ObjCPreoptHeader *Hdr = nullptr;
+  const uint32_t *DLLs = nullptr;
+  const uint32_t *Selectors = nullptr;
+  const ObjCPreoptEntry *Classes = nullptr;
+  const ObjCPreoptEntry *Protocols = nullptr;
+  const char *Strings = nullptr;
+};
+
+// Collects Objective-C metadata of DLLs (see `ObjCMethodScout`) and writes them
+// out in the format described above.
+class ObjCPreoptBuilder {
+public:
+  // Returns index of the DLL for `addClass` and `addProtocol`.
+  uint32_t addDLL(const std::string &Name) {
+    DLLs.push_back(Name);
+    return static_cast<uint32_t>(DLLs.size() - 1);
+  }
+  void addSelector(const std::string &Name) { Selectors.insert(Name); }
+  // The first definition wins, like in the runtime.
+  void addClass(const std::string &Name, uint32_t DLL, uint32_t RVA) {
+    Classes.emplace(Name, Location{DLL, RVA});
+  }
+  void addProtocol(const std::string &Name, uint32_t DLL, uint32_t RVA) {
+    Protocols.emplace(Name, Location{DLL, RVA});
+  }
+
+  void write(std::ostream &O) {
+    // Offset `0` is reserved for empty slots.
+    std::string Strings(1, '\0');
+    auto Intern = [&](const std::string &S) {
+      auto Offset = static_cast<uint32_t>(Strings.size());
+      Strings.append(S.c_str(), S.size() + 1);
+      return Offset;
+    };
+
+    std::vector<uint32_t> DLLOffsets;
+    DLLOffsets.reserve(DLLs.size());
+    for (const std::string &DLL : DLLs)
+      DLLOffsets.push_back(Intern(DLL));
+    std::vector<uint32_t> SelTable(getCapacity(Selectors.size()));
+    for (const std::string &Name : Selectors)
+      SelTable[findSlot(SelTable, Name)] = Intern(Name);
+    auto ClsTable = buildTable(Classes, Intern);
+    auto ProtoTable = buildTable(Protocols, Intern);
+
+    ObjCPreoptHeader H{ObjCPreoptHeader::ExpectedMagic,
+                       ObjCPreoptHeader::CurrentVersion,
+                       static_cast<uint32_t>(DLLOffsets.size()),
+                       static_cast<uint32_t>(SelTable.size()),
+                       static_cast<uint32_t>(ClsTable.size()),
+                       static_cast<uint32_t>(ProtoTable.size()),
+                       static_cast<uint32_t>(Strings.size())};
+    ipasim::write(O, H);
+    writeVector(O, DLLOffsets);
+    writeVector(O, SelTable);
+    writeVector(O, ClsTable);
+    writeVector(O, ProtoTable);
+    O.write(Strings.data(), Strings.size());
+  }
+
+private:
+  struct Location {
+    uint32_t DLL;
+    uint32_t RVA;
+  };
+
+  // Keeps the load factor at most one half.
+  static size_t getCapacity(size_t Count) {
+    size_t Capacity = 16;
+    while (Capacity < Count * 2)
+      Capacity *= 2;
+    return Capacity;
+  }
+  static size_t findSlot(const std::vector<uint32_t> &Table,
+                         const std::string &Name) {
+    size_t Mask = Table.size() - 1;
+    size_t I = hashObjCName(Name) & Mask;
+    while (Table[I])
+      I = (I + 1) & Mask;
+    return I;
+  }
+  template <typename FTy>
+  static std::vector<ObjCPreoptEntry>
+  buildTable(const std::map<std::string, Location> &Map, FTy &Intern) {
+    std::vector<ObjCPreoptEntry> Table(getCapacity(Map.size()));
+    size_t Mask = Table.size() - 1;
+    for (auto &[Name, Loc] : Map) {
+      size_t I = hashObjCName(Name) & Mask;
+      while (Table[I].Name)
+        I = (I + 1) & Mask;
+      Table[I] = ObjCPreoptEntry{Intern(Name), Loc.DLL, Loc.RVA};
+    }
+    return Table;
+  }
+  template <typename T>
+  static void writeVector(std::ostream &O, const std::vector<T> &V) {
+    O.write(reinterpret_cast<const char *>(V.data()), V.size() * sizeof(T));
+  }
+
+  std::vector<std::string> DLLs;
+  std::set<std::string> Selectors;
+  std::map<std::string, Location> Classes, Protocols;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_OBJC_PREOPT_HPP)
+#endif
@@ -0,0 +1,36 @@
+// PDBHelper.hpp: Definition of class `PDBHelper`.
+
+#ifndef IPASIM_PDB_HELPER_HPP
+#define IPASIM_PDB_HELPER_HPP
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// Function or public symbol found in a PDB.
+struct PDBFunction {
+  std::string Name;
+  uint32_t RVA;
+  // Number of parameters if the PDB contains signature of the function.
+  std::optional<uint32_t> ParamCount;
+};
+
+// Reads PDBs (Windows debugging symbol files) using LLVM's native PDB reader.
+// Unlike `LLDBHelper`, it doesn't need an LLDB debugger nor COM, so PDBs of
+// different DLLs can be read in parallel.
+class PDBHelper {
+public:
+  // Fills `Functions` and `Publics`. Returns `false` if there was an error
+  // (which has already been reported).
+  bool load(const std::string &Path);
+
+  std::vector<PDBFunction> Functions, Publics;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_PDB_HELPER_HPP)
+#endif
@@ -0,0 +1,57 @@
+// PrelinkCache.hpp: Definition of class `PrelinkCache`.
+
+#ifndef IPASIM_PRELINK_CACHE_HPP
+#define IPASIM_PRELINK_CACHE_HPP
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// On-disk cache of resolved bindings of one Mach-O binary, so that its symbols
+// don't have to be looked up again on the next start (similar to dyld's
+// closures). An entry is keyed by the binary's path and timestamp, and it
+// becomes stale when any library its bindings point into changes (e.g., when
+// `HeadersAnalyzer` regenerates wrappers).
+class PrelinkCache {
+public:
+  struct Binding {
+    uint32_t TargetRVA; // Relative to the binary's `StartAddress`
+    uint32_t Lib;       // Index into `Libs`, `Kernel` or `Clock`
+    uint32_t Offset;    // Relative to the library's `StartAddress`
+  };
+
+  PrelinkCache(const std::string &Path);
+
+  // Reads the entry from disk. Returns `false` if there is no valid entry.
+  bool load();
+  bool save();
+  // Returns index of library `Path` in `Libs`, adding it if necessary.
+  uint32_t addLib(const std::string &Path);
+
+  // Symbols implemented by the emulator, `Offset` is relative to
+  // `DynamicLoader::getKernelAddr`.
+  static constexpr uint32_t Kernel = static_cast<uint32_t>(-1);
+  // Functions of `GuestClock`, `Offset` is relative to
+  // `GuestClock::getPageAddr`.
+  static constexpr uint32_t Clock = static_cast<uint32_t>(-2);
+  std::vector<std::string> Libs; // Paths as keys of `DynamicLoader::LLs`
+  std::vector<Binding> Bindings;
+
+private:
+  bool parse(std::istream &I);
+
+  static constexpr uint32_t Magic = 0x4C505349; // "ISPL"
+  static constexpr uint32_t Version = 3;
+  std::string Path;
+  uint64_t Stamp;
+  std::map<std::string, uint32_t> LibIndices;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_PRELINK_CACHE_HPP)
+#endif
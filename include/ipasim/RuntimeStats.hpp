@@ -0,0 +1,82 @@
+// RuntimeStats.hpp: Definition of class `RuntimeStats`.
+
+#ifndef IPASIM_RUNTIME_STATS_HPP
+#define IPASIM_RUNTIME_STATS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace ipasim {
+
+// Names of statistics (see `RuntimeStats::getName`) are keys in the output of
+// `ipaSim_getStats`, so they shouldn't change.
+enum class Stat : uint32_t {
+  EmulatorStarts,  // Calls of `uc_emu_start`
+  EmulatorStops,   // Calls of `uc_emu_stop`
+  BudgetSlices,    // Exhausted `InstructionBudget`s
+  Pretranslations, // Hot entries translated ahead (see `HotEntries`)
+  Prerealized,     // Classes realized ahead (see `ClassRealizer`)
+  KernelReturns,   // Fetch-prot. faults at the kernel return address
+  StubBinds,       // Fetch-prot. faults at `dyld_stub_binder`
+  UnslidImages,    // Mach-O images loaded at their linked address
+  GuestMallocs,    // Fetch-prot. faults handled by `GuestHeap`
+  MallocBatches,   // Refills and trims of `GuestMallocCache`s
+  StringFunctions, // Fetch-prot. faults handled by host string functions
+  DyldFunctions,   // Fetch-prot. faults handled by `libdyld` functions
+  TSDFunctions,    // Fetch-prot. faults handled by `GuestTSD`
+  SpinLocks,       // Fetch-prot. faults handled by host spin locks
+  SpinWaits,       // Contended spin locks (see `NativeSpinLocks`)
+  SpinYields,      // Busy-waits detected by `SpinDetection`
+  WrapperCalls,    // Calls of DLL wrappers
+  FastReturns,     // Of them, ARC return value handshakes done by the host
+  DeferredCalls,   // Of them, calls executed from `CommandBuffer`s
+  DylibCalls,      // Calls redirected to emulated wrappers or functions
+  DynamicCalls,    // Calls of Objective-C methods without wrappers
+  DirectCalls,     // Of them, calls which didn't need libffi
+  UnresolvedCalls, // Calls to native addresses that couldn't be resolved
+  Callbacks,       // Calls of guest functions by native code
+  UnmappedFaults,  // Accesses to unmapped memory
+  CallTargetHits,  // Lookups of already resolved call targets
+  CallTargetMisses,
+  ShapeHits, // Lookups of already decoded call shapes
+  ShapeMisses,
+  MessageCacheMisses, // IMPs looked up because of `MessageCache` misses
+  TrampolinesCreated,
+  TranslatedCalls, // Calls of functions translated by `IpaSimLifter`
+  UICalls,         // Native calls marshaled to the UI thread
+  UIBatches,       // Visits of the UI thread serving them (see `UIDispatcher`)
+  MainLoopTurns,   // Tasks and callbacks run by the emulation thread
+  ParkedWaits,     // Idle waits of guest threads moved off their host thread
+  EmulationTime, // Nanoseconds spent by outermost `uc_emu_start`s
+  NativeTime,    // Nanoseconds spent in crossings (see `CountCrossings`)
+  MainLoopTime,  // Nanoseconds spent by `MainLoopTurns`
+  ProfilerSamples,
+  HeapAllocations, // Allocations seen by `AllocationProfiler`
+  HeapBytes,       // Bytes of them
+  Count
+};
+
+// Counters of events happening during the emulation, shared by all threads.
+// They are incremented with relaxed atomics, so adding to them is cheap, but
+// values read while the emulation runs don't have to be consistent with each
+// other. See `ipaSim_getStats`, which adds gauges (like the number of loaded
+// images) computed when called.
+class RuntimeStats {
+public:
+  void add(Stat S, uint64_t Value = 1) {
+    Values[static_cast<size_t>(S)].fetch_add(Value, std::memory_order_relaxed);
+  }
+  uint64_t get(Stat S) const {
+    return Values[static_cast<size_t>(S)].load(std::memory_order_relaxed);
+  }
+  static const char *getName(Stat S);
+
+private:
+  std::atomic<uint64_t> Values[static_cast<size_t>(Stat::Count)] = {};
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_RUNTIME_STATS_HPP)
+#endif
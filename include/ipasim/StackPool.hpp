@@ -0,0 +1,70 @@
+// StackPool.hpp: Definition of class `StackPool` and struct `GuestStack`.
+
+#ifndef IPASIM_STACK_POOL_HPP
+#define IPASIM_STACK_POOL_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ipasim {
+
+class GuestArena;
+class GuestMemoryMap;
+
+// Stack of a guest thread. Memory between `Committed` and `Top` is committed
+// and mapped into the guest. The lowest page is a guard page, which is never
+// committed.
+struct GuestStack {
+  uint64_t Base, Top;
+  uint64_t Committed;
+};
+
+// Allocates guest stacks. Their address space is only reserved, pages are
+// committed when the guest touches them for the first time (see
+// `SysTranslator::handleMemUnmapped`). Stacks of finished threads are kept for
+// reuse with only their top part committed (or just their top page after
+// `trim`).
+class StackPool {
+public:
+  StackPool(GuestArena &Arena, GuestMemoryMap &Space)
+      : Arena(Arena), Space(Space) {}
+  StackPool(const StackPool &) = delete;
+
+  // Returns stack of `Size` bytes (rounded up to pages) or `nullptr` if it
+  // cannot be allocated.
+  GuestStack *acquire(uint64_t Size);
+  void release(GuestStack *S);
+  // Finds stack reserved around `Addr`.
+  GuestStack *lookup(uint64_t Addr);
+  // Commits and maps part of stack `S` down to `Addr`. Returns `false` if
+  // `Addr` is inside the guard page.
+  bool grow(GuestStack &S, uint64_t Addr);
+  // Returns bytes committed for all stacks (including unused ones).
+  uint64_t getCommittedBytes();
+  // Decommits unused stacks except for their top pages. Returns number of
+  // decommitted bytes. Stacks in use are left alone, because their threads may
+  // be running.
+  uint64_t trim();
+
+  // Number of bytes committed at once.
+  static constexpr uint64_t CommitStep = 64 * 1024;
+
+private:
+  // Commits and maps pages from `Start` up to `S.Committed`.
+  bool commit(GuestStack &S, uint64_t Start);
+
+  GuestArena &Arena;
+  GuestMemoryMap &Space;
+  std::mutex Mutex;
+  std::vector<std::unique_ptr<GuestStack>> Stacks;
+  std::map<uint64_t, GuestStack *> ByTop; // For `lookup`
+  std::vector<GuestStack *> FreeStacks;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_STACK_POOL_HPP)
+#endif
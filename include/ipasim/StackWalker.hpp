@@ -0,0 +1,48 @@
+// StackWalker.hpp: Definition of class `StackWalker` and struct `StackFrame`.
+
+#ifndef IPASIM_STACK_WALKER_HPP
+#define IPASIM_STACK_WALKER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ipasim {
+
+class SysTranslator;
+
+// One frame of a call stack found by `StackWalker`.
+struct StackFrame {
+  uint32_t Addr; // Without the Thumb bit
+  bool Native;
+};
+
+// Walks call stacks of the current thread across the boundary between emulated
+// and native code. Emulated segments follow the R7 frame chain on the guest
+// stack. When the chain returns to the kernel (i.e., the guest code was called
+// by `SysTranslator::execute`), it continues with native frames which called
+// into emulated code and then with the guest return address saved in the
+// corresponding `ExecutionContext`. Native frames are captured from the host
+// stack, only frames in DLLs loaded by `DynamicLoader` are reported (not those
+// of the emulator itself).
+class StackWalker {
+public:
+  StackWalker(SysTranslator &Sys) : Sys(Sys) {}
+
+  // Stores at most `Max` frames into `Frames` and returns their number.
+  // `InGuest` must be `true` if called from an emulator hook (the current PC is
+  // then the first frame), otherwise the first frames are those of native code
+  // called by the guest.
+  size_t walk(StackFrame *Frames, size_t Max, bool InGuest);
+  // Logs the call stack as an error (e.g., when emulation is aborted).
+  void log(bool InGuest);
+
+  static constexpr size_t MaxDepth = 64;
+
+private:
+  SysTranslator &Sys;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_STACK_WALKER_HPP)
+#endif
@@ -0,0 +1,80 @@
+// StartupReport.hpp: Definition of classes `StartupReport` and
+// `StartupTimer`.
+
+#ifndef IPASIM_STARTUP_REPORT_HPP
+#define IPASIM_STARTUP_REPORT_HPP
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+enum class StartupPhase : size_t {
+  Validate, // Checking that the file exists
+  Parse,    // Reading load commands, rebases, bindings and exports
+  Map,      // Allocating memory and mapping or copying segments
+  Rebase,
+  Bind,
+  Handlers, // `DynamicLoader::registerMachO`
+  ObjCInit, // `_objc_init`
+  Count
+};
+
+// Times spent in phases of startup by each library. `finish` saves it as JSON
+// so that loader optimizations can be compared. See also `StartupReports`.
+class StartupReport {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  StartupReport() : Start(Clock::now()) {}
+
+  void add(const std::string &Lib, StartupPhase Phase, Clock::duration Time);
+  // Should be called when the main binary reaches its entry point. Only the
+  // first call has any effect.
+  void finish();
+
+private:
+  std::string toJSON(Clock::duration Total);
+
+  using PhaseTimes =
+      std::array<Clock::duration, static_cast<size_t>(StartupPhase::Count)>;
+
+  Clock::time_point Start;
+  std::mutex Mutex;
+  std::vector<std::pair<std::string, PhaseTimes>> Libs; // In order of loading
+  std::map<std::string, size_t> LibIndices;
+  bool Finished = false;
+};
+
+// Measures phases of one library. The current phase is ended by `next`,
+// `stop` or the destructor.
+class StartupTimer {
+public:
+  StartupTimer(StartupReport &Report, const std::string &Lib,
+               StartupPhase Phase);
+  // Library `nullptr` is reported as unknown.
+  StartupTimer(StartupReport &Report, const std::string *Lib,
+               StartupPhase Phase);
+  StartupTimer(const StartupTimer &) = delete;
+  ~StartupTimer() { stop(); }
+
+  void next(StartupPhase Phase);
+  void stop();
+
+private:
+  StartupReport &Report;
+  const std::string &Lib;
+  StartupPhase Phase;
+  StartupReport::Clock::time_point Start;
+  bool Running;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_STARTUP_REPORT_HPP)
+#endif
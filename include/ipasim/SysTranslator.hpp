@@ -1,32 +1,137 @@
 // SysTranslator.hpp: Definition of classes `SysTranslator`, `DynamicCaller`,
-// `DynamicBackCaller` and `TypeDecoder`.
+// `DynamicBackCaller`, `TypeDecoder`, `TrampolineArena` and structs
+// `CallShape` and `Trampoline`.
 
 #ifndef IPASIM_SYS_TRANSLATOR_HPP
 #define IPASIM_SYS_TRANSLATOR_HPP
 
+#include "ipasim/CommandBuffer.hpp"
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/Emulator.hpp"
+#include "ipasim/GuestClock.hpp"
+#include "ipasim/GuestPoolPage.hpp"
+#include "ipasim/InlineFunction.hpp"
 #include "ipasim/LoadedLibrary.hpp"
+#include "ipasim/StackPool.hpp"
 
+#include <atomic>
+#include <deque>
 #include <ffi.h>
-#include <stack>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace ipasim {
 
+// Describes how to call a native function whose signature is given by an
+// Objective-C type encoding with arguments coming from emulated code. Note that
+// the guest uses iOS's variant of APCS, i.e., all arguments (including
+// floating-point ones) are passed in R0-R3 and then on stack, without any
+// alignment to even registers.
+struct CallShape {
+  enum ReturnKind {
+    Void,
+    Reg,     // Returned in R0
+    RegPair, // Returned in R0 and R1
+    Stret,   // Returned in memory pointed to by R0
+  } Returns;
+  ffi_cif CIF;
+  size_t ArgWords; // Number of 32-bit words taken by arguments in the guest
+  std::vector<ffi_type *> ArgTypes;
+  std::vector<size_t> ArgOffsets; // Offsets of arguments (in words)
+  // Calls native function `Addr` with the guest's argument words as they are
+  // and returns its result from `EAX` and `EDX`. It's set by `TypeDecoder` if
+  // neither the arguments nor the result need libffi (see
+  // `DirectDynamicCalls`), so that `DynamicCaller` is just an indirect call.
+  using DirectFunc = uint64_t (*)(uint64_t Addr, const uint32_t *Args);
+  DirectFunc Direct = nullptr;
+  // Storage for struct types
+  std::vector<std::unique_ptr<ffi_type>> Structs;
+  std::vector<std::unique_ptr<ffi_type *[]>> Elements;
+};
+
+// Data of a native function pointer which calls into emulated code.
+struct Trampoline {
+  const CallShape *Shape;
+  uint64_t Addr;
+};
+
+// Allocates `Trampoline`s together with their code from big chunks of
+// executable memory, so that they are not scattered across pages and can be
+// reused after being released. The code is a fixed sequence of instructions
+// calling `Entry(Tr, Args)`, where `Tr` is the `Trampoline` and `Args` points
+// to arguments the native caller passed on the stack, so no closure needs to
+// be interpreted.
+class TrampolineArena {
+public:
+  using EntryTy = void (*)(Trampoline *Tr, const uint8_t *Args);
+
+  TrampolineArena() = default;
+  TrampolineArena(const TrampolineArena &) = delete;
+  ~TrampolineArena();
+  // Returns a free trampoline and address of its code which calls `Entry`.
+  Trampoline *allocate(EntryTy Entry, void *&Code);
+  // Finds trampoline with code at `Code`.
+  Trampoline *lookup(void *Code);
+  void release(Trampoline *Tr);
+  // These can be read from any thread (see `IpaSimulator::forEachTranslator`).
+  size_t getUsed() const { return Used.load(std::memory_order_relaxed); }
+  size_t getCapacity() const {
+    return ChunkCount.load(std::memory_order_relaxed) * SlotsPerChunk;
+  }
+  uint64_t getBytes() const {
+    return ChunkCount.load(std::memory_order_relaxed) * ChunkSize;
+  }
+
+private:
+  struct Slot {
+    uint8_t Code[24]; // See `allocate`
+    Trampoline Tr;
+  };
+  struct Chunk {
+    Slot *Slots;
+    uintptr_t Code; // Address of `Slots` in the executable mapping
+  };
+
+  static constexpr size_t ChunkSize = 64 * 1024;
+  static constexpr size_t SlotsPerChunk = ChunkSize / sizeof(Slot);
+  std::vector<Chunk> Chunks;
+  std::vector<Slot *> FreeSlots;
+  std::atomic<size_t> Used = 0, ChunkCount = 0;
+};
+
 // Represents the layer in our emulator that translates function calls between
 // the host (native libraries) and the guest (emulated libraries). It also
 // controls the whole execution in order to be able to do its job.
 class SysTranslator {
 public:
-  SysTranslator(DynamicLoader &Dyld, Emulator &Emu)
-      : Dyld(Dyld), Emu(Emu), Restart(false), Continue(false),
-        RestartFromLRs(false) {}
+  SysTranslator(DynamicLoader &Dyld, Emulator &Emu) : Dyld(Dyld), Emu(Emu) {
+    // Preallocate the stacks, so that common execution doesn't allocate.
+    LRs.reserve(256);
+    Contexts.reserve(64);
+  }
+  SysTranslator(const SysTranslator &) = delete;
+  ~SysTranslator();
+  // Allocates a stack and installs emulator hooks. Must be called before the
+  // first `execute(uint64_t)`.
+  void initialize(uint64_t StackSize);
   // Starts executing the given library loaded by our `DynamicLoader`. The
   // library is initialized before `SysTranslator` starts executing its
   // entrypoint.
   void execute(LoadedLibrary *Lib);
-  // Starts execution at the specified address.
+  // Starts execution at the specified address. Can be called recursively (from
+  // native code called by the emulated code), each call has its own
+  // `ExecutionContext`.
   void execute(uint64_t Addr);
+  // Like `execute(uint64_t)`, but counted as a callback from native code (see
+  // `CrossingStats`).
+  void executeCallback(uint64_t Addr);
+  // Translates up to `Count` scheduled `HotEntries` ahead of time. Must not be
+  // called while emulation runs. Returns `false` if there is nothing left.
+  bool pretranslate(size_t Count);
   // Translates the given function pointer. It must point to an Objective-C
   // method. Returns a pointer to native function (a trampoline in case `FP`
   // pointed to an emulated function).
@@ -36,6 +141,40 @@ public:
   // their number is specified by `ArgC`. Similarly, the function can only
   // return a 32-bit-wide value or `void` (specified by `Returns`).
   void *translate(void *FP, size_t ArgC, bool Returns = false);
+  // Translates `Count` function pointers in place. `Types` are their type
+  // encodings. If `Types` (or an element of it) is `nullptr`, the type is found
+  // from Objective-C metadata like in `translate(void *)`.
+  void translate(void **FPs, const char *const *Types, size_t Count);
+  // Stores translated implementations of methods of runtime's `method_list_t`
+  // at `List` into `Imps`. The list itself is not modified.
+  void translateMethodList(void *List, void **Imps);
+  // Releases trampoline previously returned by `translate`. Should be called
+  // when the owner of the translated function pointer dies. Does nothing if
+  // `FP` is not a trampoline.
+  void release(void *FP);
+  const TrampolineArena &getTrampolines() const { return Arena; }
+  // Enables or disables logging of executed instructions (only those inside
+  // `Lib` if specified). Must not be called from inside emulator hooks. Note
+  // that Unicorn decides about code hooks when translating code, so this might
+  // not affect code that has already been executed.
+  void traceInstructions(bool Enable, LoadedLibrary *Lib = nullptr);
+  // Enables or disables logging of memory writes. See `traceInstructions`.
+  void traceMemoryWrites(bool Enable);
+  // Calls `Callback` when emulated code reaches `Addr`. See `traceInstructions`
+  // for limitations.
+  void onReached(uint64_t Addr, void (*Callback)());
+  // Records executed instructions into `TraceBuffer` from when emulated code
+  // reaches function `Addr` until it returns or until `MaxInstructions` are
+  // recorded (`0` means no limit). Only one window is recorded at a time.
+  // Outside of windows, only a code hook of the single instruction at `Addr`
+  // is installed. Must be called before emulation starts. Returns `false` if
+  // `BinaryTrace` is disabled. See `traceInstructions` for limitations.
+  bool addTraceWindow(uint64_t Addr, uint64_t MaxInstructions);
+  // Returns number of calls between emulated and native code so far. Can be
+  // read from any thread, so that hosts can detect that the guest is idle.
+  uint32_t getProgress() const {
+    return Progress.load(std::memory_order_relaxed);
+  }
   // Dynamically calls a function from a library.
   template <typename... Args>
   void call(const std::string &Lib, const std::string &Func,
@@ -59,72 +198,300 @@ public:
   template <typename... ArgTys> void callBack(void *FP, ArgTys... Args);
   // Like `callBack` but also returns a 32-bit-wide value.
   template <typename... ArgTys> void *callBackR(void *FP, ArgTys... Args);
+  // Calls (potentially emulated) `FP` `Count` times, the `I`-th time with the
+  // `ArgC` (at most 4) 32-bit-wide arguments at `Args + I * ArgC`. Results are
+  // stored into `Results` unless it's `nullptr`. If `Stop` is not `nullptr`,
+  // no more calls are made once it is `true`. Returns the number of calls made.
+  // Unlike `callBack`, emulation isn't restarted for each call, the guest loops
+  // over the arguments itself (see `DynamicLoader::getBatchStubAddr`).
+  size_t callBackBatch(void *FP, size_t ArgC, void *const *Args, size_t Count,
+                       void **Results = nullptr, const bool *Stop = nullptr);
+  // Creates a guest thread that calls (potentially emulated) `Func(Arg)`. It
+  // starts running when `runThreads` is called on the same host thread.
+  void spawn(void *Func, void *Arg);
+  // Runs guest threads created by `spawn` until all of them finish. They are
+  // multiplexed on the current host thread and preempted after running for
+  // `InstructionBudget` instructions.
+  void runThreads();
 
 private:
+  friend class StackWalker;
+
+  // Code deferred via `continueOutsideEmulation`. It's big enough to hold a
+  // `DynamicCaller`, so that it never needs to allocate.
+  using Continuation = InlineFunction<void(), 128>;
+
+  // State of one (possibly nested) call of `execute(uint64_t)`.
+  struct ExecutionContext {
+    bool Restart = false, Continue = false, RestartFromLRs = false;
+    bool Returned = false; // Emulated function returned to kernel.
+    bool Aborted = false;  // Emulation was stopped because of an error.
+    Continuation Cont;     // See `continueOutsideEmulation`.
+    uint32_t CallerLR = 0; // Guest LR when the context started
+  };
+
+  // Arguments of `callBackBatch` as read by the batch stub. They are placed on
+  // the guest stack (followed by `Args` and `Results`), so batches can nest.
+  struct BatchFrame {
+    uint32_t FP;
+    uint32_t Stop;
+    uint32_t Count; // Number of calls left when the stub returns
+    uint32_t Args;  // Always 4 words per call
+    uint32_t Results;
+  };
+  // Calls the batch stub at most this many times per emulation start.
+  static constexpr size_t BatchSize = 256;
+
+  // Host fiber that runs a native function called from inside an emulator hook.
+  // See `callInsideHook`.
+  struct HostFiber {
+    void *Handle;
+    uint64_t Addr;     // Native function to call
+    uint32_t Arg;      // Its only argument
+    uint64_t Callback; // Emulated function the native function wants to call
+    bool Done;
+  };
+
+  // Busy-wait detection state of a guest thread (see `SpinDetection`).
+  struct SpinSample {
+    uint32_t Low = 0, High = 0; // Where recent budgets ran out
+    uint32_t Progress = 0;      // `Progress` when the first of them did
+    uint32_t Slices = 0;        // Number of them
+    uint32_t Yields = 0;        // Busy-waits detected in a row
+  };
+
+  // Guest thread created by `spawn`. While it's not running, its state is saved
+  // here.
+  struct GuestThread {
+    void *Fiber; // Host fiber the thread runs on
+    CPUContext *CPU;
+    std::vector<uint32_t> LRs;
+    std::vector<ExecutionContext> Contexts;
+    void *MainFiber;
+    void *Func, *Arg;
+    GuestStack *Stack;
+    uint32_t *TSD; // See `GuestTSD`.
+    bool Done;
+    std::atomic<bool> Parked; // See `parkCall`.
+    // Set by a call of a `CallTarget::IdleWait` wrapper, consumed by the
+    // native call it makes (see `takeIdleWait`). It belongs to the thread,
+    // since other threads can run while the wrapper is emulated.
+    bool PendingIdleWait = false;
+    SpinSample Spin;
+    GuestTimes Times;
+  };
+
+  // Result of resolving target of a call from the guest into the host. It's
+  // cached by `handleFetchProtMem`, so that repeated calls to the same address
+  // don't have to look up wrappers again.
+  struct CallTarget {
+    enum KindTy {
+      WrapperDLL,    // Native wrapper, called with R0 (pointer to arguments).
+      WrapperDylib,  // Emulated wrapper, we jump to it.
+      DynamicMethod, // Objective-C method called via `DynamicCaller`.
+    } Kind;
+    uint64_t Addr;
+    // Used only for `WrapperDLL`. See `WrapperInfo`.
+    bool Leaf, Registers;
+    // Used only for `DynamicMethod`.
+    const CallShape *Shape;
+    // Used only for `WrapperDylib`. The wrapped function only waits for
+    // something to happen (see `ParkIdleWaits`).
+    bool IdleWait = false;
+    // The target must be called on the UI thread (see `UIDispatcher`).
+    bool UIThread = false;
+    // Used only for `WrapperDLL`. The target allocates an Objective-C object
+    // (see `AllocationProfiler::isAllocator`).
+    bool Allocator = false;
+    // Used only for `WrapperDLL` with `Registers`. Which side of the handshake
+    // of optimized return values the target is (see `OptimizedReturns`).
+    enum HandshakeTy : uint8_t {
+      NoHandshake,
+      AutoreleaseRV,        // `objc_autoreleaseReturnValue`
+      RetainAutoreleaseRV,  // `objc_retainAutoreleaseReturnValue`
+      RetainAutoreleasedRV, // `objc_retainAutoreleasedReturnValue`
+      ClaimAutoreleasedRV,  // `objc_unsafeClaimAutoreleasedReturnValue`
+    } Handshake = NoHandshake;
+    // Used only for `WrapperDLL`. The target is `objc_autoreleasePoolPop`,
+    // which would pop native pools `syncPools` pushed right before it.
+    bool PoolPop = false;
+  };
+
   // Emulator hooks
   bool handleFetchProtMem(uc_mem_type Type, uint64_t Addr, int Size,
                           int64_t Value);
   void handleCode(uint64_t Addr, uint32_t Size);
+  void handleBlock(uint64_t Addr, uint32_t Size);
+  void handleReached(uint64_t Addr, uint32_t Size);
+  void handleTranslated(uint64_t Addr, uint32_t Size);
+  void handleWindowStart(uint64_t Addr, uint32_t Size);
+  void handleWindowCode(uint64_t Addr, uint32_t Size);
+  void recordInstruction(uint64_t Addr);
   bool handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size, int64_t Value);
+  bool handleMemWriteProt(uc_mem_type Type, uint64_t Addr, int Size,
+                          int64_t Value);
   bool handleMemUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
                          int64_t Value);
+  void handleInterrupt(uint32_t IntNo);
+  void handleMsgDispatch(bool Stret);
+  // Call translation helpers
+  const CallShape *getCallShape(const char *Type);
+  void handleStubBinder();
+  // Returns `false` if `Addr` is not one of `DynamicLoader::KernelFunction`s.
+  bool handleGuestMalloc(uint64_t Addr);
+  bool handleStringFunction(uint64_t Addr);
+  bool handleDyldFunction(uint64_t Addr);
+  // Sets message returned by the next `dlerror`.
+  void setDlError(const char *Message, const char *Detail);
+  bool handleTSDFunction(uint64_t Addr);
+  bool handleSpinLockFunction(uint64_t Addr);
+  // Lets the holder of contended `Lock` run. `Spins` is number of previous
+  // attempts to acquire it.
+  void waitForLock(volatile long *Lock, uint32_t Spins);
+  const CallTarget *getCallTarget(uint64_t Addr);
+  // Drops call targets and trampolines which can point into libraries
+  // unloaded since the last call (see `DynamicLoader::close`).
+  void forgetUnloaded();
+  bool resolveCallTarget(uint64_t Addr, CallTarget &Target);
+  void callTarget(const CallTarget &Target);
+  void callRegisterWrapper(const CallTarget &Target);
+  // Returns `false` if `Target` must be called by the runtime after all.
+  bool handleHandshake(const CallTarget &Target);
+  // Returns value of slot `Key` in `GuestTSD` of the current guest thread.
+  uint32_t getTSDSlot(uint32_t Key);
+  // Returns `GuestPoolPage` of the current guest thread or `nullptr`.
+  GuestPoolPage *getPoolPage();
+  // Pushes native pool for the innermost guest pool if it has none yet.
+  // Called before emulated code crosses into native code.
+  void syncPools();
+  // Returns `CommandBuffer` of the current guest thread or `nullptr`.
+  CommandBuffer *getCommandBuffer();
+  // Executes calls deferred by the current guest thread after `syncPools`, so
+  // that objects they autorelease go to the innermost guest pool. Must be
+  // called before any other call into native code.
+  void flushCommands();
+  // Calls wrappers recorded in `Buffer` in order and empties it.
+  void executeCommands(CommandBuffer &Buffer);
+  // Pops guest pool whose boundary is at `Index` (and those pushed after it)
+  // along with native pools pushed for them. Must be called outside emulation.
+  void popPool(GuestPoolPage &Page, uint32_t Index);
+  size_t recordCall(const CallTarget &Target, const uint32_t *Regs = nullptr);
+  void writeResult(const RegisterBlock &Block);
+  // Calls `Func` on the UI thread if `UIThread` and we are on the emulation
+  // thread, otherwise right away (or via `parkCall` if `Park`). See
+  // `UIDispatcher::callOnUI`.
+  template <typename FuncTy>
+  void callNative(bool UIThread, FuncTy &&Func, bool Reentrant = true,
+                  bool Park = false);
+  // Returns `true` if the native call about to be made is an idle wait of a
+  // guest thread which should be parked. Must be called once per call.
+  bool takeIdleWait();
+  // Runs `Thunk(Data)` on a thread pool thread and lets other guest threads run
+  // until it returns. Must be called outside emulation by a guest thread.
+  void parkCall(void (*Thunk)(void *), void *Data);
   // Trampoline helpers
-  void *createTrampoline(void *Addr, size_t ArgC, bool Returns);
-  void handleTrampoline(void *Ret, void **Args, void *Data);
-  static void handleTrampolineStatic(ffi_cif *, void *Ret, void **Args,
-                                     void *Data);
+  void *createTrampoline(void *Addr, const CallShape &Shape);
+  // Implements `translate(void *)` for `FP` already looked up in `LI`. `Dylib`
+  // is `LI.Lib` if it's a Dylib. `Type` can be `nullptr`.
+  void *translateMethod(void *FP, const LibraryInfo &LI, LoadedDylib *Dylib,
+                        const char *Type);
+  uint64_t handleTrampoline(Trampoline *Tr, const uint8_t *Args);
+  // Entry points of trampolines (see `TrampolineArena`). They differ only in
+  // how they return the result to native callers.
+  static uint64_t handleTrampolineStatic(Trampoline *Tr, const uint8_t *Args);
+  static float handleTrampolineFloat(Trampoline *Tr, const uint8_t *Args);
+  static double handleTrampolineDouble(Trampoline *Tr, const uint8_t *Args);
   // Execution control
+  ExecutionContext &ctx() { return Contexts.back(); }
   void returnToKernel();
   void returnToEmulation();
-  void continueOutsideEmulation(std::function<void()> &&Cont);
+  void restartAt(uint32_t Addr);
+  void continueOutsideEmulation(Continuation &&Cont);
+  void callInsideHook(uint64_t Addr, uint32_t Arg, uint32_t ResumeAddr);
+  HostFiber *acquireFiber();
+  bool convertToFiber();
+  static void __stdcall hostFiberProc(void *Data);
+  void abort();
+  // Guest threads
+  void preempt();
+  // Returns `true` if the current guest thread, whose budget ran out at `PC`,
+  // is busy-waiting.
+  bool isSpinning(uint32_t PC);
+  // Lets whoever a busy-waiting guest thread waits for run.
+  void yieldSpin();
+  void switchTo(GuestThread *T);
+  static void __stdcall guestThreadProc(void *Data);
 
-  static constexpr ConstexprString WrapsPrefix = "$__ipaSim_wraps_";
   // TODO: Don't hardcode this.
   static constexpr uint64_t DLLBase = 0x1000; // Standard DLL base address
   DynamicLoader &Dyld;
   Emulator &Emu;
-  std::stack<uint32_t> LRs;               // Stack of return addresses
-  bool Restart, Continue, RestartFromLRs; // See `execute(uint64_t)`.
-  std::function<void()> Continuation;     // See `continueOutsideEmulation`.
+  std::vector<uint32_t> LRs;              // Stack of return addresses
+  std::vector<ExecutionContext> Contexts; // See `execute(uint64_t)`.
+  void *ThreadFiber = nullptr; // This host thread converted to fiber
+  // These are used by `callInsideHook`:
+  void *MainFiber = nullptr; // Fiber that runs emulation
+  HostFiber *CurrentFiber = nullptr; // Fiber that is currently running
+  std::vector<HostFiber *> FreeFibers;
+  // These are used by `runThreads`:
+  std::deque<GuestThread *> ReadyThreads;
+  GuestThread *CurrentThread = nullptr;
+  void *SchedulerFiber = nullptr;
+  CPUContext *SchedulerCPU = nullptr;
+  // Signaled when a parked guest thread can continue (see `parkCall`).
+  void *WakeEvent = nullptr;
+  GuestStack *Stack = nullptr; // Set by `initialize`
+  uint32_t *TSD = nullptr;     // Set by `initialize`, see `GuestTSD`.
+  GuestTimes Times; // Of the thread which isn't a `GuestThread`
+  SpinSample Spin;  // Of the thread running now
+  HookHandle FetchProtHook, InterruptHook, UnmappedHook, WriteProtHook,
+      CodeHook, MemWriteHook, BlockHook, ReachHook;
+  uint32_t ProfileTick = 0; // See `GuestProfiler::shouldSample`.
+  void (*ReachCallback)() = nullptr; // See `onReached`.
+  // See `addTraceWindow`.
+  struct TraceWindow {
+    uint64_t Addr, MaxInstructions;
+    HookHandle Trigger;
+  };
+  std::vector<TraceWindow> Windows;
+  std::vector<HookHandle> TranslationHooks; // See `NativeTranslations`.
+  const TraceWindow *ActiveWindow = nullptr;
+  uint32_t WindowReturn = 0, WindowSP = 0;
+  uint64_t WindowInstructions = 0;
+  HookHandle WindowHook;
+  std::atomic<uint32_t> Progress = 0;
+  std::unordered_map<uint64_t, CallTarget> CallTargets;
+  uint32_t SeenUnloads = 0; // See `forgetUnloaded`.
+  std::string DlError;       // Returned by `dlerror` if `DlFailed`
+  bool DlFailed = false;
+  // Native `objc_msgLookup` and `objc_msgLookup_stret` (see
+  // `handleMsgDispatch`)
+  uint64_t MsgLookups[2] = {};
+  // Call shapes indexed by type encodings
+  std::unordered_map<std::string, std::unique_ptr<CallShape>> CallShapes;
+  // Call shapes indexed by addresses of type encodings (see `getCallShape`)
+  std::unordered_map<const char *, const CallShape *> ShapesByType;
+  // Trampolines indexed by target address and signature
+  std::map<std::pair<uint64_t, const CallShape *>, void *> Trampolines;
+  TrampolineArena Arena;
+  // Translation (i.e., the members above) can be done from any thread.
+  std::recursive_mutex TranslationMutex;
 };
 
 // Represents a dynamic call from the guest (emulated) into the host (native).
+// Arguments are loaded from the emulator when constructed.
 class DynamicCaller {
 public:
-  DynamicCaller(Emulator &Emu)
-      : Emu(Emu), RegId(UC_ARM_REG_R0), SP(Emu.readReg(UC_ARM_REG_SP)) {}
-  void loadArg(size_t Size);
-  bool call(bool Returns, uint32_t Addr);
+  DynamicCaller(Emulator &Emu, const CallShape &Shape);
+  void call(uint64_t Addr);
 
-private:
-  template <size_t N> void call(bool Returns, uint32_t Addr) {
-    if (Returns)
-      call<N, N, true>(Addr);
-    else
-      call<N, N, false>(Addr);
-  }
-  template <size_t N, size_t C, bool Returns, typename... ArgTys>
-  void call(uint32_t Addr, ArgTys... Params) {
-    if constexpr (N > 0)
-      call<N - 1, C, Returns, ArgTys..., uint32_t>(Addr, Params...,
-                                                   Args[C - N]);
-    else
-      call<Returns, ArgTys...>(Addr, Params...);
-  }
-  template <bool Returns, typename... ArgTys>
-  void call(uint32_t Addr, ArgTys... Params) {
-    if constexpr (Returns) {
-      uint32_t RetVal =
-          reinterpret_cast<uint32_t (*)(ArgTys...)>(Addr)(Params...);
-      Emu.writeReg(UC_ARM_REG_R0, RetVal);
-    } else
-      reinterpret_cast<void (*)(ArgTys...)>(Addr)(Params...);
-  }
+  // Maximum number of 32-bit words of arguments
+  static constexpr size_t MaxArgs = 32;
 
+private:
   Emulator &Emu;
-  uc_arm_reg RegId;
-  uint32_t SP;
-  std::vector<uint32_t> Args;
+  const CallShape *Shape;
+  uint32_t Args[MaxArgs];
 };
 
 // Represents a dynamic call from the host (native) into the guest (emulated).
@@ -143,8 +510,12 @@ public:
       return reinterpret_cast<RetTy (*)(ArgTys...)>(FP)(Args...);
     } else {
       // Target load method is inside some emulated library.
-      pushArgs<UC_ARM_REG_R0>(Args...);
-      Sys.execute(Addr);
+      static_assert(sizeof...(ArgTys) <= 4, "Callback has too many arguments.");
+      if constexpr (sizeof...(ArgTys) != 0) {
+        uint32_t Values[] = {reinterpret_cast<uint32_t>(Args)...};
+        Emu.writeRegs(Emulator::ArgRegs, Values, sizeof...(ArgTys));
+      }
+      Sys.executeCallback(Addr);
 
       // Fetch return value.
       if constexpr (!std::is_same_v<RetTy, void>)
@@ -153,36 +524,29 @@ public:
   }
 
 private:
-  template <uc_arm_reg RegId> void pushArgs() {}
-  template <uc_arm_reg RegId, typename... ArgTys>
-  void pushArgs(void *Arg, ArgTys... Args) {
-    using namespace ipasim;
-
-    static_assert(UC_ARM_REG_R0 <= RegId && RegId <= UC_ARM_REG_R3,
-                  "Callback has too many arguments.");
-    Emu.writeReg(RegId, reinterpret_cast<uint32_t>(Arg));
-    pushArgs<RegId + 1>(Args...);
-  }
-
   DynamicLoader &Dyld;
   Emulator &Emu;
   SysTranslator &Sys;
-  std::vector<uint32_t> Args;
 };
 
 // Helper class for decoding Objective-C's type encodings.
 class TypeDecoder {
 public:
   TypeDecoder(const char *T) : T(T) {}
-  size_t getNextTypeSize();
   bool hasNext() { return *T; }
-
-  static const size_t InvalidSize = static_cast<size_t>(-1);
+  // Decodes the whole encoding (return type and arguments) into `Shape`.
+  bool decode(CallShape &Shape);
 
 private:
   const char *T;
 
-  size_t getNextTypeSizeImpl();
+  ffi_type *getNextType(CallShape &Shape);
+  ffi_type *getNextTypeImpl(CallShape &Shape);
+  ffi_type *createStruct(CallShape &Shape, std::vector<ffi_type *> &&Elements);
+  bool skipType();
+  void skipName();
+  void skipQualifiers();
+  void skipOffset();
 };
 
 // Implemented here because both definitions of `SysTranslator` and
@@ -5,24 +5,41 @@
 
 #include "ipasim/HAContext.hpp"
 
+#include <string>
 #include <tapi/Core/FileManager.h>
 #include <tapi/Core/InterfaceFile.h>
 #include <tapi/Core/InterfaceFileManager.h>
+#include <utility>
+#include <vector>
 
 namespace ipasim {
 
+// Contents of one `.tbd` file which are interesting for us.
+struct TBDFile {
+  TBDFile(std::string Path) : Path(move(Path)) {}
+
+  std::string Path;
+  std::string InstallName; // Empty if the file couldn't be analyzed.
+  // Exported symbols in order of appearance. Objective-C classes have the flag
+  // set.
+  std::vector<std::pair<std::string, bool>> Exports;
+};
+
 // Helper class for analyzing `.tbd` files.
 class TBDHandler {
 public:
-  TBDHandler(HAContext &HAC);
-  void handleFile(const std::string &Path);
+  TBDHandler(HAContext &HAC) : HAC(HAC) {}
+
+  // Fills `File`. This doesn't touch `HAContext`, so multiple files can be
+  // parsed in parallel.
+  static void parseFile(TBDFile &File);
+  // Adds contents of the parsed `File` into `HAContext`.
+  void addFile(const TBDFile &File);
 
 private:
   void addExport(DylibPtr Dylib, std::string &&Name);
 
   HAContext &HAC;
-  tapi::internal::FileManager FM;
-  tapi::internal::InterfaceFileManager IFM;
 };
 
 } // namespace ipasim
@@ -0,0 +1,59 @@
+// TaskGraph.hpp: Definition of class `TaskGraph`.
+
+#ifndef IPASIM_TASK_GRAPH_HPP
+#define IPASIM_TASK_GRAPH_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ipasim {
+
+// Runs tasks on a pool of worker threads, each task as soon as all tasks it
+// depends on are finished. Tasks can be added while others are running. Used
+// by `HeadersAnalyzer` to compile and link generated code (i.e., to run Clang
+// and LLD processes) while it generates more of it. Tasks mustn't touch
+// `LLVMContext` or `LLVMHelper::Saver` which are used by the main thread.
+class TaskGraph {
+public:
+  struct Task {
+    std::function<void()> Func;
+    size_t Pending; // Number of unfinished dependencies
+    std::vector<Task *> Dependents;
+    bool Done = false;
+  };
+
+  // If `Workers` is `0`, there are as many workers as hardware threads.
+  TaskGraph(unsigned Workers = 0);
+  TaskGraph(const TaskGraph &) = delete;
+  ~TaskGraph();
+
+  // Schedules `Func` to run after all `Deps` (which can be `nullptr`) finish.
+  Task *add(std::function<void()> Func,
+            std::initializer_list<Task *> Deps = {});
+  Task *add(std::function<void()> Func, const std::vector<Task *> &Deps);
+  // Waits until all tasks added so far are finished.
+  void wait();
+
+private:
+  void run();
+
+  std::vector<std::unique_ptr<Task>> Tasks;
+  std::deque<Task *> Ready;
+  size_t Unfinished = 0;
+  bool Stopping = false;
+  std::mutex Mutex;
+  std::condition_variable Wake, Finished;
+  std::vector<std::thread> Threads;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_TASK_GRAPH_HPP)
+#endif
@@ -5,38 +5,122 @@
 
 #include "ipasim/Logger.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <winrt/Windows.Foundation.Collections.h>
 #include <winrt/Windows.UI.Xaml.Controls.h>
 
 namespace ipasim {
 
-// Wrapper around control `TextBlock`.
+// Source of log lines shown by a `ListView` (which creates containers only for
+// the visible ones). Hosts without UI can provide a file instead (see
+// `ipaSim_setLogFile`). If there is neither, output is dropped.
+//
+// Complete lines are pushed into a lock-free queue from any thread and
+// appended to the view's items in batches, at most once per `FlushInterval`,
+// so that logging doesn't flood the UI thread with dispatches. Only the last
+// `LineLimit` lines are kept, so a long verbose session bounds both memory and
+// layout cost. Each item is a boxed `hstring` without the line break, colors
+// are applied by the view using `isError`.
 class TextBlockProvider {
 public:
-  TextBlockProvider() : TB(nullptr) {}
+  static constexpr std::chrono::milliseconds FlushInterval{50};
+  static constexpr size_t DefaultLineLimit = 10000;
 
-  void init(winrt::Windows::UI::Xaml::Controls::TextBlock TextBlock) {
-    TB = TextBlock;
+  TextBlockProvider() : LV(nullptr), Items(nullptr) {}
+
+  // Must be called on the UI thread.
+  void init(winrt::Windows::UI::Xaml::Controls::ListView ListView);
+  void init(std::FILE *F) { File = F; }
+  std::FILE *getFile() { return File; }
+  // Can be called from any thread. `Text` should be a whole line.
+  void push(std::wstring &&Text, bool Error);
+  // Can be called from any thread, it's applied by the next flush.
+  void setLineLimit(size_t Limit) { LineLimit = Limit ? Limit : 1; }
+
+  // The following must be called on the UI thread. Indices are those of the
+  // view's items.
+  bool isError(uint32_t Index) const {
+    return Index < Errors.size() && Errors[Index];
   }
-  winrt::Windows::UI::Xaml::Controls::TextBlock get() { return TB; }
+  // Returns index of the first line at or after `From` (wrapping around)
+  // containing `Query` (case-insensitively).
+  std::optional<uint32_t> find(std::wstring_view Query, uint32_t From) const;
+  // Returns all kept lines.
+  std::wstring getText() const;
+  // Estimates memory taken by text of kept lines. Can be called from any
+  // thread.
+  uint64_t getKeptBytes() const { return KeptBytes; }
 
 private:
-  winrt::Windows::UI::Xaml::Controls::TextBlock TB;
+  struct Line {
+    std::wstring Text;
+    bool Error;
+    Line *Next; // Older line
+  };
+
+  winrt::Windows::UI::Xaml::Controls::ListView LV;
+  winrt::Windows::Foundation::Collections::IObservableVector<
+      winrt::Windows::Foundation::IInspectable>
+      Items;
+  std::deque<bool> Errors; // Parallel to `Items`
+  std::FILE *File = nullptr;
+  std::atomic<Line *> Pending = nullptr; // Newest line
+  std::atomic<bool> FlushScheduled = false;
+  std::atomic<size_t> LineLimit = DefaultLineLimit;
+  // Lines flushed so far and their characters, for `getKeptBytes`.
+  uint64_t FlushedLines = 0, FlushedChars = 0;
+  std::atomic<uint64_t> KeptBytes = 0;
+
+  void scheduleFlush();
+  // Must be called on the UI thread.
+  void flush();
 };
 
-// A `Stream` that can append to a `TextBlock`.
+// A `Stream` that appends to `TextBlockProvider`. Fragments are collected in a
+// thread-local buffer until the line is complete, then it's passed to
+// `TextBlockProvider` at once. Incomplete lines are passed when their thread
+// exits or by `flushAll`.
 class TextBlockStream : public Stream<TextBlockStream> {
 public:
   TextBlockStream(bool Error, TextBlockProvider &TBP)
       : Error(Error), TBP(TBP) {}
 
-  void write(const char *S) { write(winrt::to_hstring(S)); }
-  void write(const wchar_t *S) { write(winrt::hstring(S)); }
+  void write(const char *S);
+  void write(const wchar_t *S);
+  // Passes incomplete lines of all threads (e.g., before the log is closed).
+  static void flushAll();
 
 private:
   bool Error;
   TextBlockProvider &TBP;
 
-  void write(const winrt::hstring &S);
+  struct LineBuffer {
+    LineBuffer();
+    ~LineBuffer();
+    void push();
+
+    std::mutex Mutex; // Only contended by `flushAll`
+    std::wstring Text;
+    bool Error = false;
+    TextBlockProvider *TBP = nullptr; // Where `Text` goes
+  };
+  static thread_local LineBuffer Buffer;
+  static std::mutex BuffersMutex;
+  static std::vector<LineBuffer *> Buffers; // Of all threads
+
+  // Prepares `Buffer` for text of this stream.
+  LineBuffer &getBuffer();
+  // Pushes the buffered line if it's complete.
+  void commit();
 };
 
 using LogStream = AggregateStream<DebugStream, TextBlockStream>;
@@ -0,0 +1,116 @@
+// TraceBuffer.hpp: Definition of class `TraceBuffer` and structs `TraceHeader`
+// and `TraceRecord`.
+
+#ifndef IPASIM_TRACE_BUFFER_HPP
+#define IPASIM_TRACE_BUFFER_HPP
+
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ipasim {
+
+class DynamicLoader;
+
+// One event of a binary trace. It has a fixed size, so that it can be written
+// without any formatting.
+struct TraceRecord {
+  enum EventTy : uint8_t {
+    Instruction, // Guest executed instruction at `PC`
+    Enter,       // Crossing of kind `Kind` to `Target` started
+    Leave,       // Crossing of kind `Kind` to `Target` returned
+    WindowStart, // Trace window of function `Target` started
+    WindowEnd,   // Trace window of function `Target` ended
+  };
+
+  uint64_t Time;    // In ticks of `QueryPerformanceCounter`
+  uint32_t PC;      // Only for `Instruction`
+  uint32_t Target;  // Only for `Enter`, `Leave` and windows
+  uint32_t Regs[6]; // R0, R1, R7, R12, SP and LR, only for `Instruction`
+  EventTy Event;
+  uint8_t Kind; // `CrossingStats::KindTy`
+  uint8_t Reserved[6];
+};
+static_assert(sizeof(TraceRecord) == 48);
+
+// Beginning of a trace file, followed by `Capacity` records.
+struct TraceHeader {
+  static constexpr char MagicValue[8] = {'I', 'P', 'A', 'T',
+                                         'R', 'A', 'C', 'E'};
+  static constexpr uint32_t CurrentVersion = 1;
+
+  char Magic[8];
+  uint32_t Version;
+  uint32_t RecordSize; // `sizeof(TraceRecord)`
+  uint64_t Capacity;   // Number of records in the ring
+  uint64_t Frequency;  // Ticks per second
+  // Number of records ever written. Record `I` is at index `I % Capacity`, so
+  // only the last `Capacity` ones are available.
+  std::atomic<uint64_t> Written;
+  uint32_t ThreadID;
+  uint8_t Reserved[20];
+};
+static_assert(sizeof(TraceHeader) == 64);
+
+// Binary trace of emulation. Each host thread writes into its own ring buffer
+// of `BinaryTraceRecords` records, which is a view of file `thread-<ID>.bin`
+// in the `trace` cache folder, so adding a record is just a copy and nothing
+// is lost if the app crashes. Tool `IpaSimTrace` decodes and symbolizes the
+// files. See `BinaryTrace`.
+class TraceBuffer {
+public:
+  static_assert((BinaryTraceRecords & (BinaryTraceRecords - 1)) == 0,
+                "Trace capacity must be a power of two.");
+
+  TraceBuffer() = default;
+  TraceBuffer(const TraceBuffer &) = delete;
+  ~TraceBuffer();
+
+  // Appends `R` to ring of the current thread. It's lock-free except for the
+  // first call on each thread, which creates the ring.
+  void add(const TraceRecord &R) {
+    Ring *Rg = getRing();
+    if (!Rg)
+      return;
+    uint64_t I = Rg->Header->Written.load(std::memory_order_relaxed);
+    Rg->Records[I & (BinaryTraceRecords - 1)] = R;
+    Rg->Header->Written.store(I + 1, std::memory_order_release);
+  }
+  void addCrossing(TraceRecord::EventTy Event, uint8_t Kind, uint64_t Target);
+  static uint64_t now();
+  // Writes addresses of loaded images next to the rings (as `images.txt`), so
+  // that the trace can be symbolized. Returns `false` on failure.
+  bool save(DynamicLoader &Dyld);
+
+private:
+  struct Ring {
+    void *File = nullptr, *Section = nullptr;
+    TraceHeader *Header = nullptr;
+    TraceRecord *Records = nullptr;
+
+    ~Ring();
+  };
+
+  Ring *getRing() {
+    thread_local Ring *Current = nullptr;
+    thread_local bool Failed = false;
+    if (!Current && !Failed) {
+      Current = createRing();
+      Failed = !Current;
+    }
+    return Current;
+  }
+  Ring *createRing();
+
+  std::mutex Mutex;
+  std::vector<std::unique_ptr<Ring>> Rings;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_TRACE_BUFFER_HPP)
+#endif
@@ -0,0 +1,54 @@
+// Tracepoints.hpp: Definition of class `Tracepoints`.
+
+#ifndef IPASIM_TRACEPOINTS_HPP
+#define IPASIM_TRACEPOINTS_HPP
+
+#include <atomic>
+#include <cstdint>
+
+namespace ipasim {
+
+enum class TraceCategory : uint32_t {
+  Loader,       // Loading and binding of libraries
+  Emulation,    // Starts and stops of the emulation
+  Crossings,    // Calls from emulated to native code
+  ObjC,         // Objective-C methods and callbacks handled dynamically
+  Trampolines,  // Calls from native to emulated code
+  Faults,       // Accesses to unmapped memory
+  Instructions, // Every executed instruction (installs a code hook)
+  MemoryWrites, // Every memory write (installs a memory hook)
+  Count
+};
+
+// Categories of diagnostic logging that can be switched at runtime (see
+// `ipaSim_setTrace`). Initially, categories are enabled according to
+// `PrintEmuInfo`, `PrintInstructions` and `PrintMemoryWrites` and then
+// according to environment variable `IPASIM_TRACE` (in the format of `set`).
+// Checking a disabled category costs a single load and branch.
+class Tracepoints {
+public:
+  Tracepoints();
+
+  bool isEnabled(TraceCategory C) const {
+    return Mask.load(std::memory_order_relaxed) & getBit(C);
+  }
+  void set(TraceCategory C, bool Enable);
+  // Applies comma-separated list `Spec` of category names, `all` or `none`.
+  // Categories prefixed by `-` are disabled. Returns `false` if there was an
+  // unknown category (other categories are still applied).
+  bool set(const char *Spec);
+  uint32_t getMask() const { return Mask.load(std::memory_order_relaxed); }
+  static const char *getName(TraceCategory C);
+
+private:
+  static constexpr uint32_t getBit(TraceCategory C) {
+    return 1U << static_cast<uint32_t>(C);
+  }
+
+  std::atomic<uint32_t> Mask;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_TRACEPOINTS_HPP)
+#endif
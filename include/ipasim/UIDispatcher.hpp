@@ -0,0 +1,106 @@
+// UIDispatcher.hpp: Definition of class `UIDispatcher`.
+
+#ifndef IPASIM_UI_DISPATCHER_HPP
+#define IPASIM_UI_DISPATCHER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace ipasim {
+
+class LoadedLibrary;
+
+// Runs the guest main thread on a dedicated emulation thread, so that long
+// guest computations don't block the XAML UI thread. Native functions which
+// need the UI thread (those of `UIKit.dll` and other XAML-backed frameworks)
+// are marshaled to it and the emulation thread waits for them. Guest code
+// called back by the UI thread is marshaled the other way. While one thread
+// waits for the other, it serves requests of the other one, so nested calls
+// work as if there was only one thread.
+//
+// The UI thread doesn't return to its message loop after each marshaled call.
+// Instead, it keeps executing calls of the emulation thread for up to
+// `UIBatchBudget` microseconds, so that a burst of UI calls costs one dispatch,
+// but rendering and input still get their turn every frame.
+class UIDispatcher {
+public:
+  using Task = std::function<void()>;
+  // Schedules a function on the message loop of the UI thread.
+  using PostFunc = std::function<void(Task)>;
+
+  UIDispatcher() = default;
+  UIDispatcher(const UIDispatcher &) = delete;
+  ~UIDispatcher();
+
+  // Starts the emulation thread. Must be called on the UI thread. Returns
+  // `false` if it's already running.
+  bool start(PostFunc Post);
+  bool isActive() const { return Active.load(std::memory_order_acquire); }
+  bool isEmulationThread() const {
+    return isActive() && std::this_thread::get_id() == EmulationThread;
+  }
+  bool isUIThread() const {
+    return isActive() && std::this_thread::get_id() == UIThread;
+  }
+  // Returns `true` if native function at `Addr` must be called on the UI
+  // thread. Results are cached per library.
+  bool needsUIThread(uint64_t Addr);
+  // Drops the cached result of `Lib`, which is being unloaded.
+  void forget(const LoadedLibrary *Lib);
+
+  // Schedules `Func` on the emulation thread.
+  void post(Task Func);
+  // Schedules `Func` on the message loop of the UI thread. Must be active.
+  void postToUI(Task Func) { Post(std::move(Func)); }
+  // Runs `Func` on the UI thread and waits for it. If `Reentrant`, guest code
+  // called back meanwhile is executed, otherwise it waits until this returns
+  // (e.g., inside emulator hooks, which cannot start nested emulation).
+  void callOnUI(const Task &Func, bool Reentrant = true);
+  // Runs `Func` on the emulation thread and waits for it, while serving UI
+  // calls of the emulation thread. It cannot simply be posted, since it's used
+  // for guest callbacks of native code (trampolines and `ipaSim_callBack*`)
+  // which return results, get arguments valid only during the call, or whose
+  // side effects the caller relies on (e.g., `layoutSubviews` overrides). The
+  // UI thread doesn't sit idle meanwhile, it executes UI calls the callback
+  // makes. Callers which can continue later use `IpaSimulator::callGuestAsync`.
+  void callOnEmulation(const Task &Func);
+
+private:
+  struct Request {
+    const Task *Func;
+    bool Done = false;
+  };
+  using Queue = std::deque<Request *>;
+
+  void runEmulation();
+  // Executes calls queued for the UI thread until none arrives for a while or
+  // `UIBatchBudget` is exhausted.
+  void drain();
+  // Waits for `R`, executing requests from `Own` (if any) meanwhile.
+  void wait(std::unique_lock<std::mutex> &Lock, Request &R, Queue *Own);
+  void execute(std::unique_lock<std::mutex> &Lock, Queue &Requests);
+
+  std::mutex Mutex;
+  std::condition_variable Changed; // Notified whenever any queue changes
+  Queue UIRequests, EmulationRequests;
+  std::deque<Task> Tasks; // Posted to the emulation thread
+  PostFunc Post;
+  bool DrainScheduled = false;
+  bool Stopping = false;
+  std::atomic<bool> Active = false;
+  std::thread Thread;
+  std::thread::id UIThread, EmulationThread;
+  std::mutex LibsMutex;
+  std::unordered_map<const LoadedLibrary *, bool> UILibs;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_UI_DISPATCHER_HPP)
+#endif
@@ -0,0 +1,20 @@
+// Unicode.hpp: Conversion of UTF-8 to UTF-16.
+
+#ifndef IPASIM_UNICODE_HPP
+#define IPASIM_UNICODE_HPP
+
+#include <cstddef>
+#include <string>
+
+namespace ipasim {
+
+// Appends UTF-8 string `S` of `Len` bytes converted to UTF-16 to `Out`. Invalid
+// sequences are replaced by U+FFFD, like `MultiByteToWideChar` does. Runs of
+// ASCII characters (which is mostly what logs consist of) are widened with
+// SSE2 or AVX2, chosen at runtime.
+void appendUTF16(std::wstring &Out, const char *S, size_t Len);
+
+} // namespace ipasim
+
+// !defined(IPASIM_UNICODE_HPP)
+#endif
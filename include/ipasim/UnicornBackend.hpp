@@ -0,0 +1,50 @@
+// UnicornBackend.hpp: Definition of class `UnicornBackend`.
+
+#ifndef IPASIM_UNICORN_BACKEND_HPP
+#define IPASIM_UNICORN_BACKEND_HPP
+
+#include "ipasim/CPUBackend.hpp"
+
+namespace ipasim {
+
+// `CPUBackend` using Unicorn. It's the slowest one, but the only one which
+// supports all hooks, so it's used for tracing and debugging.
+class UnicornBackend : public CPUBackend {
+public:
+  UnicornBackend();
+  UnicornBackend(const UnicornBackend &) = delete;
+  ~UnicornBackend() override;
+
+  // Returns `false` if `uc_open` failed.
+  bool isValid() const { return UC; }
+
+  Kind getKind() const override { return Unicorn; }
+  uc_err readRegs(const uc_arm_reg *RegIds, uint32_t *Values,
+                  size_t Count) override;
+  uc_err writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                   size_t Count) override;
+  uc_err mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms,
+                   void *Host) override;
+  uc_err unmapMemory(uint64_t Addr, uint64_t Size) override;
+  uc_err protectMemory(uint64_t Addr, uint64_t Size, uc_prot Perms) override;
+  uc_err start(uint64_t Addr, size_t Count) override;
+  uc_err stop() override;
+  uc_err translate(uint64_t Addr) override;
+  uc_err allocContext(CPUContext *&Ctx) override;
+  uc_err saveContext(CPUContext *Ctx) override;
+  uc_err restoreContext(CPUContext *Ctx) override;
+  uc_err freeContext(CPUContext *Ctx) override;
+  bool supportsHook(uc_hook_type Type) const override { return true; }
+  uc_err addHook(uc_hook_type Type, void *Callback, void *Data, uint64_t Begin,
+                 uint64_t End, size_t &Hook) override;
+  uc_err removeHook(size_t Hook) override;
+
+private:
+  uc_engine *UC = nullptr;
+  uc_context *Saved = nullptr; // CPU state kept by `translate`
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_UNICORN_BACKEND_HPP)
+#endif
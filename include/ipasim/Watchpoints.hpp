@@ -0,0 +1,83 @@
+// Watchpoints.hpp: Definition of class `Watchpoints`.
+
+#ifndef IPASIM_WATCHPOINTS_HPP
+#define IPASIM_WATCHPOINTS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unicorn/unicorn.h>
+
+namespace ipasim {
+
+class GuestMemoryMap;
+
+// Watches guest writes to specific address ranges. Pages containing watched
+// ranges are made read-only in Unicorn, so that only writes to them reach
+// `handleWrite` (via `UC_HOOK_MEM_WRITE_PROT`), the rest of the guest runs at
+// full speed. Writes are recorded into a fixed-size ring buffer of binary
+// events, which can be saved to the cache folder (`watch/events.bin`).
+//
+// Note that remapping a watched page (e.g., by `GuestMemoryMap::mapRange`)
+// makes it writable again. Engines which are currently emulating notice new
+// watches only after they restart.
+class Watchpoints {
+public:
+  // Written as is to the log file after `LogHeader`.
+  struct Event {
+    uint64_t Value;
+    uint32_t Addr;
+    uint32_t PC;
+    uint32_t Watch; // ID returned by `add`
+    uint32_t Size;
+  };
+  struct LogHeader {
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t Dropped; // Events overwritten before saving
+    uint64_t Count;
+  };
+
+  Watchpoints(GuestMemoryMap &Space) : Space(Space) {}
+  Watchpoints(const Watchpoints &) = delete;
+
+  // Returns ID of the new watchpoint or `0` if some page of the range is not
+  // mapped.
+  uint32_t add(uint64_t Addr, uint64_t Size);
+  void remove(uint32_t ID);
+  // Records write to a page which is read-only because of a watchpoint.
+  // Returns `false` if the write is not allowed (i.e., the page is not watched
+  // or it's read-only by itself).
+  bool handleWrite(uint64_t Addr, int Size, int64_t Value, uint32_t PC);
+  bool save();
+
+  static constexpr uint32_t Magic = 0x57415049; // "IPAW"
+  static constexpr uint32_t Version = 1;
+  static constexpr uint64_t Capacity = 64 * 1024; // Number of events
+
+private:
+  struct Range {
+    uint64_t Addr, Size;
+  };
+  struct Page {
+    uc_prot Perms; // Protection before it was watched
+    uint32_t Refs; // Number of watches
+  };
+
+  void unwatchPages(uint64_t Start, uint64_t End);
+
+  GuestMemoryMap &Space;
+  std::mutex Mutex;
+  std::map<uint32_t, Range> Watches;
+  std::map<uint64_t, Page> Pages;
+  uint32_t NextID = 1;
+  std::unique_ptr<Event[]> Events;
+  std::atomic<uint64_t> EventCount = 0;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_WATCHPOINTS_HPP)
+#endif
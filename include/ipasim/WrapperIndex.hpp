@@ -1,22 +1,84 @@
-// WrapperIndex.hpp: Definition of struct `WrapperIndex`.
+// WrapperIndex.hpp: Definition of structs `WrapperIndex` and `WrapperInfo`.
 
 #ifndef IPASIM_WRAPPER_INDEX_HPP
 #define IPASIM_WRAPPER_INDEX_HPP
 
+#include "ipasim/Common.hpp"
+
+#include <algorithm>
 #include <cstdint>
-#include <map>
-#include <string>
-#include <vector>
 
 namespace ipasim {
 
+// Argument of DLL wrappers with `RegisterABI`. Registers R0-R3 and SP of the
+// emulated caller, result is written into `R[0]` (and `R[1]` if it's 64-bit).
+struct RegisterBlock {
+  static constexpr uint32_t ArgRegs = 4;
+  static constexpr uint32_t ResultRegs = 2;
+
+  uint32_t R[ArgRegs];
+  uint32_t SP; // Further arguments are stack words starting here
+};
+
 // A helper data structure generated into wrapper DLLs by `HeadersAnalyzer`.
+// Every DLL wrapper has its own index which maps from original DLL RVA to
+// Dylib wrapper where it's used. It's used when calling a DLL function directly
+// from some Dylib (e.g., through a pointer from Objective-C metadata). The
+// index is emitted as constant data exported as `Symbol`, so it's searched in
+// place without any construction at load time.
 struct WrapperIndex {
-  WrapperIndex();
+  static constexpr ConstexprString Symbol = "$__ipaSim_wrapperIndex";
+  static constexpr uint32_t NotFound = static_cast<uint32_t>(-1);
+
+  uint32_t DylibCount;
+  const char *const *Dylibs;
+  uint32_t Count;
+  const uint32_t *RVAs;      // Sorted RVAs of original DLL functions
+  const uint32_t *DylibIdxs; // Indices into `Dylibs`, parallel to `RVAs`
+  // Offsets of Dylib wrappers from start of their Dylibs (or `0` if unknown),
+  // parallel to `RVAs`
+  const uint32_t *Offsets;
+  // Objective-C methods without wrappers are called dynamically (see
+  // `CallShape`). Their type encodings are listed here, so that they don't
+  // have to be found in metadata at runtime. Equal encodings share storage.
+  uint32_t MethodCount;
+  const uint32_t *MethodRVAs;     // Sorted RVAs of methods' implementations
+  const char *const *MethodTypes; // Parallel to `MethodRVAs`
+
+  // Returns index of `RVA` into `RVAs` or `NotFound`.
+  uint32_t find(uint32_t RVA) const { return find(RVAs, Count, RVA); }
+  // Returns type encoding of method implemented at `RVA` or `nullptr`.
+  const char *findMethodType(uint32_t RVA) const {
+    uint32_t I = find(MethodRVAs, MethodCount, RVA);
+    return I != NotFound ? MethodTypes[I] : nullptr;
+  }
+
+private:
+  static uint32_t find(const uint32_t *Begin, uint32_t Count, uint32_t RVA) {
+    const uint32_t *End = Begin + Count;
+    const uint32_t *It = std::lower_bound(Begin, End, RVA);
+    return It != End && *It == RVA ? static_cast<uint32_t>(It - Begin)
+                                   : NotFound;
+  }
+};
+
+// Word placed by `HeadersAnalyzer` right before each DLL wrapper (as LLVM
+// prefix data). It describes how the wrapper can be called.
+struct WrapperInfo {
+  static constexpr uint32_t Magic = 0x49505700; // "\0WPI"
+  static constexpr uint32_t MagicMask = 0xFFFFFF00;
+  // Function never calls back into emulated code.
+  static constexpr uint32_t Leaf = 0x1;
+  // Wrapper takes pointer to `RegisterBlock` instead of pointer to structure
+  // of argument pointers.
+  static constexpr uint32_t Registers = 0x2;
 
-  std::vector<std::string> Dylibs;
-  // Map from original DLL RVA to wrapper Dylib index
-  std::map<uint32_t, uint32_t> Map;
+  // Returns flags of wrapper at `Addr` or `0` if it has none.
+  static uint32_t get(uint64_t Addr) {
+    uint32_t Word =
+        reinterpret_cast<const uint32_t *>(static_cast<uintptr_t>(Addr))[-1];
+    return (Word & MagicMask) == Magic ? Word & ~MagicMask : 0;
+  }
 };
 
 } // namespace ipasim
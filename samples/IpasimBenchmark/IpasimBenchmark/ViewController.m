@@ -9,11 +9,18 @@
 #import "ViewController.h"
 
 #import <objc/runtime.h>
+#import <stdlib.h>
 
 @interface ViewController ()
 
 @property (strong, nonatomic) UILabel *status;
 @property (strong, nonatomic) UIButton *start;
+// Times of each run of each benchmark row in nanoseconds per iteration,
+// rows are in the order they were first run.
+@property (strong, nonatomic) NSMutableArray<NSString *> *names;
+@property (strong, nonatomic) NSMutableDictionary<NSString *, NSMutableArray<NSNumber *> *> *samples;
+// Set in automated mode, where only results are reported.
+@property (nonatomic) BOOL quiet;
 
 - (id)noop;
 
@@ -26,9 +33,34 @@ extern uint64_t dispatch_benchmark_f(size_t count, void *ctxt, void (*func)(void
 static void funcNoop(void *self) { [(__bridge ViewController *)self noop]; }
 static void staticNoop(void *ctx) {}
 
+// If this environment variable is set, benchmarks start right after launch, run
+// the given number of times, results are written as JSON and the app exits.
+static const char *const runsVariable = "IPASIM_BENCHMARK_RUNS";
+// Path of the JSON results (`Documents/benchmark.json` by default).
+static const char *const outputVariable = "IPASIM_BENCHMARK_OUTPUT";
+
+// Results of benchmarked calls are stored here, so that they aren't optimized
+// away.
+static volatile CGRect sinkRect = {{0, 0}, {1000, 1000}};
+static volatile float sinkFloat = 1.5f, sinkFloatResult;
+static volatile BOOL sinkBool;
+static volatile NSUInteger sinkInt;
+
+static int compareInts(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Returns the `percent`-th percentile of sorted `values` (nearest rank).
+static double percentile(NSArray<NSNumber *> *values, double percent) {
+    NSUInteger rank = (NSUInteger)ceil(percent / 100 * values.count);
+    return values[rank ? rank - 1 : 0].doubleValue;
+}
+
 @implementation ViewController
 
 - (void)log:(NSString *)message {
+    if (self.quiet)
+        return;
     self.status.text = [self.status.text stringByAppendingString:@"\n"];
     self.status.text = [self.status.text stringByAppendingString:message];
 }
@@ -37,14 +69,25 @@ static void staticNoop(void *ctx) {}
     [self log:[title stringByAppendingString:[@": " stringByAppendingString:@(time).stringValue]]];
 }
 
+- (void)record:(NSString *)title time:(uint64_t)time {
+    NSMutableArray<NSNumber *> *samples = self.samples[title];
+    if (!samples) {
+        samples = [NSMutableArray array];
+        self.samples[title] = samples;
+        [self.names addObject:title];
+    }
+    [samples addObject:@(time)];
+    [self log:title time:time];
+}
+
 - (void)benchmark:(NSString *)title count:(size_t)count block:(void(^)(void))block {
     uint64_t time = dispatch_benchmark(count, block);
-    [self log:title time:time];
+    [self record:title time:time];
 }
 
 - (void)benchmark:(NSString *)title count:(size_t)count ctx:(void *)ctx func:(void(*)(void *))func {
     uint64_t time = dispatch_benchmark_f(count, ctx, func);
-    [self log:title time:time];
+    [self record:title time:time];
 }
 
 - (id)noop {
@@ -60,7 +103,50 @@ static void staticNoop(void *ctx) {}
 
 - (void)onStart {
     [self log:@"Started."];
+    [self runBenchmarks];
+}
 
+// Runs benchmarks `runs` times, writes statistics of the results as JSON and
+// exits.
+- (void)runAutomated:(NSUInteger)runs {
+    self.quiet = YES;
+    for (NSUInteger i = 0; i != runs; ++i)
+        [self runBenchmarks];
+
+    NSMutableArray *results = [NSMutableArray array];
+    for (NSString *name in self.names) {
+        NSArray<NSNumber *> *sorted = [self.samples[name] sortedArrayUsingSelector:@selector(compare:)];
+        [results addObject:@{
+            @"name": name,
+            @"min_ns": sorted.firstObject,
+            @"median_ns": @(percentile(sorted, 50)),
+            @"p95_ns": @(percentile(sorted, 95)),
+            @"samples_ns": self.samples[name],
+        }];
+    }
+    NSDictionary *json = @{
+        @"benchmark": @"IpasimBenchmark",
+        @"runs": @(runs),
+        @"results": results,
+    };
+    NSData *data = [NSJSONSerialization dataWithJSONObject:json options:NSJSONWritingPrettyPrinted error:nil];
+
+    NSString *path;
+    const char *output = getenv(outputVariable);
+    if (output)
+        path = @(output);
+    else {
+        NSString *documents = NSSearchPathForDirectoriesInDomains(NSDocumentDirectory, NSUserDomainMask, YES).firstObject;
+        path = [documents stringByAppendingPathComponent:@"benchmark.json"];
+    }
+    if ([data writeToFile:path atomically:YES])
+        NSLog(@"IpasimBenchmark: results written to %@", path);
+    else
+        NSLog(@"IpasimBenchmark: cannot write results to %@", path);
+    exit(0);
+}
+
+- (void)runBenchmarks {
     const size_t count = 20000;
     
     [self benchmark:@"-[NSObject hash]" count:count block:^{
@@ -90,6 +176,131 @@ static void staticNoop(void *ctx) {}
     [self benchmark:@"-[ViewController noSyscalls]" count:count block:^{
         [self noSyscalls];
     }];
+
+    [self runShapeBenchmarks:count];
+    [self runCallbackBenchmarks:count];
+    [self runMemoryBenchmarks:count];
+    [self runThreadBenchmarks];
+    [self runLayoutBenchmarks];
+}
+
+// Calls into native code with different marshaling shapes (one call each).
+- (void)runShapeBenchmarks:(size_t)count {
+    [self benchmark:@"CGRectInset (stret)" count:count block:^{
+        sinkRect = CGRectInset(CGRectMake(0, 0, 1000, 1000), 0.5f, sinkFloat);
+    }];
+
+    [self benchmark:@"powf (float)" count:count block:^{
+        sinkFloatResult = powf(sinkFloat, 1.5f);
+    }];
+
+    // Two rects are 8 words, half of them is passed on the stack.
+    [self benchmark:@"CGRectIntersectsRect (stack arguments)" count:count block:^{
+        sinkBool = CGRectIntersectsRect(sinkRect, CGRectMake(1, 2, 3, 4));
+    }];
+}
+
+// Native code calling back into emulated code.
+- (void)runCallbackBenchmarks:(size_t)count {
+    enum { elements = 64 };
+    int *values = malloc(elements * sizeof(int));
+    NSMutableArray<NSNumber *> *numbers = [NSMutableArray arrayWithCapacity:elements];
+    for (int i = 0; i != elements; ++i)
+        [numbers addObject:@((i * 37) % elements)];
+
+    // Comparators are emulated, so each comparison crosses twice.
+    [self benchmark:@"qsort (64 elements)" count:count / 20 block:^{
+        for (int i = 0; i != elements; ++i)
+            values[i] = (i * 37) % elements;
+        qsort(values, elements, sizeof(int), compareInts);
+    }];
+
+    [self benchmark:@"-[NSArray sortedArrayUsingComparator:] (64 elements)" count:count / 20 block:^{
+        [numbers sortedArrayUsingComparator:^NSComparisonResult(NSNumber *a, NSNumber *b) {
+            return [a compare:b];
+        }];
+    }];
+
+    [self benchmark:@"-[NSArray enumerateObjectsUsingBlock:] (64 elements)" count:count / 20 block:^{
+        __block NSUInteger sum = 0;
+        [numbers enumerateObjectsUsingBlock:^(NSNumber *number, NSUInteger i, BOOL *stop) {
+            sum += i;
+        }];
+        sinkInt = sum;
+    }];
+    free(values);
+
+    // Reference counting alone, no allocations.
+    [self benchmark:@"CFRetain + CFRelease (100x)" count:count / 20 block:^{
+        CFTypeRef object = (__bridge CFTypeRef)numbers;
+        for (int i = 0; i != 100; ++i) {
+            CFRetain(object);
+            CFRelease(object);
+        }
+    }];
+
+    [self benchmark:@"@autoreleasepool (100 strings)" count:count / 20 block:^{
+        @autoreleasepool {
+            for (int i = 0; i != 100; ++i)
+                [NSString stringWithFormat:@"%d", i];
+        }
+    }];
+}
+
+// `memcpy` of increasing sizes, each row copies about the same amount of data.
+- (void)runMemoryBenchmarks:(size_t)count {
+    const size_t maxSize = 64 << 20;
+    char *source = calloc(maxSize, 1), *destination = calloc(maxSize, 1);
+    if (!source || !destination) {
+        [self log:@"cannot allocate memory for memcpy"];
+        free(source);
+        free(destination);
+        return;
+    }
+    for (size_t size = 1 << 10; size <= maxSize; size <<= 2) {
+        NSString *title = [NSString stringWithFormat:@"memcpy (%zu KB)", size >> 10];
+        [self benchmark:title count:MAX(((size_t)256 << 20) / size, (size_t)1) block:^{
+            memcpy(destination, source, size);
+        }];
+    }
+    free(source);
+    free(destination);
+}
+
+// `dispatch_apply` of the same total work split into 1 to N parallel pieces.
+- (void)runThreadBenchmarks {
+    NSUInteger cores = [NSProcessInfo processInfo].activeProcessorCount;
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    for (NSUInteger threads = 1; threads <= cores; threads <<= 1) {
+        NSString *title = [NSString stringWithFormat:@"dispatch_apply (%lu threads)", (unsigned long)threads];
+        size_t iterations = 1024 / threads;
+        [self benchmark:title count:100 block:^{
+            dispatch_apply(threads, queue, ^(size_t piece) {
+                for (size_t i = 0; i != iterations; ++i)
+                    [self noSyscalls];
+            });
+        }];
+    }
+}
+
+// One frame of a label with lots of text.
+- (void)runLayoutBenchmarks {
+    UILabel *label = [[UILabel alloc] initWithFrame:CGRectMake(0, 0, 320, 10000)];
+    label.numberOfLines = 0;
+    NSMutableString *text = [NSMutableString string];
+    for (int i = 0; i != 50; ++i)
+        [text appendString:@"The quick brown fox jumps over the lazy dog. "];
+    [self.view addSubview:label];
+    label.hidden = YES;
+
+    [self benchmark:@"UILabel layout (2 KB of text)" count:100 block:^{
+        label.text = nil;
+        label.text = text;
+        [label sizeToFit];
+        [label setNeedsDisplay];
+        [label layoutIfNeeded];
+    }];
+    [label removeFromSuperview];
 }
 
 - (void)viewDidLoad {
@@ -108,6 +319,18 @@ static void staticNoop(void *ctx) {}
     [self.start setTitle:@"Start" forState:UIControlStateNormal];
     [self.start addTarget:self action:@selector(onStart) forControlEvents:UIControlEventTouchUpInside];
     [self.view addSubview:self.start];
+
+    self.names = [NSMutableArray array];
+    self.samples = [NSMutableDictionary dictionary];
+
+    // Let the first frame render before starting.
+    const char *runs = getenv(runsVariable);
+    if (runs) {
+        NSUInteger count = MAX(atoi(runs), 1);
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self runAutomated:count];
+        });
+    }
 }
 
 - (void)didReceiveMemoryWarning {
@@ -7,3 +7,8 @@ file (
     COPY "${ANGLE_DIR}/bin/UAP/Win32/libEGL.dll"
         "${ANGLE_DIR}/bin/UAP/Win32/libGLESv2.dll"
     DESTINATION "${CURRENT_IPASIM_CMAKE_DIR}/bin")
+
+# `HeadersAnalyzer` links wrapper DLLs against `<DLL>.a` next to the DLL. See
+# `GLWrappers`.
+configure_file ("${ANGLE_DIR}/bin/UAP/Win32/libGLESv2.lib"
+    "${CURRENT_IPASIM_CMAKE_DIR}/bin/libGLESv2.dll.a" COPYONLY)
@@ -0,0 +1,83 @@
+## Runs `IpasimBenchmark` headless and compares its results with a baseline.
+## Usage: `benchmark.ps1 <app binary> [-Runs 10] [-Baseline baseline.json]
+## [-Save]`. With `-Save`, the results become the new baseline.
+
+param (
+    [Parameter(Mandatory = $true)][string]$Binary,
+    [int]$Runs = 10,
+    [string]$Output = "benchmark.json",
+    [string]$Baseline = "benchmark-baseline.json",
+    # Rows slower than this ratio of their baseline medians fail the run.
+    [double]$Threshold = 1.1,
+    [switch]$Save,
+    [string]$Emulator = "C:/ipaSim/build/bin/IpaSimHeadless.exe"
+)
+
+# The app starts itself and exits once results are written. See
+# `ViewController.m`.
+$env:IPASIM_BENCHMARK_RUNS = $Runs
+$env:IPASIM_BENCHMARK_OUTPUT = [IO.Path]::GetFullPath($Output)
+# Runtime statistics are printed as the last line of stderr.
+& $Emulator --log benchmark.log --stats --time 3600 $Binary 2> benchmark.err
+if ($LastExitCode -ne 0) {
+    Write-Error "emulator failed ($LastExitCode), see benchmark.log"
+    exit 1
+}
+$Results = Get-Content $Output -Raw | ConvertFrom-Json
+
+# Time to launch and, when the driver hosts the XAML app (which renders frames
+# and runs `UIDispatcher`), frame pacing and main loop turns (see `FrameStats`).
+# Headless runs only have the former, so series without samples are left out.
+$Stats = Get-Content benchmark.err | Where-Object { $_.StartsWith("{") } |
+    Select-Object -Last 1 | ConvertFrom-Json
+if ($Stats) {
+    Write-Output "launched after $($Stats.launch_us / 1000) ms"
+    if ($Stats.first_frame_us) {
+        Write-Output "first frame after $($Stats.first_frame_us / 1000) ms"
+    }
+    $Pacing = foreach ($Kind in "frame", "turn") {
+        if (-not $Stats."$($Kind)_p50_us") { continue }
+        [pscustomobject]@{
+            kind = $Kind
+            p50_ms = $Stats."$($Kind)_p50_us" / 1000
+            p95_ms = $Stats."$($Kind)_p95_us" / 1000
+            p99_ms = $Stats."$($Kind)_p99_us" / 1000
+            hitches = $Stats."$($Kind)_hitches"
+        }
+    }
+    $Pacing | Format-Table
+    $Results | Add-Member -NotePropertyName launch_ms `
+        -NotePropertyValue ($Stats.launch_us / 1000)
+    $Results | Add-Member -NotePropertyName pacing -NotePropertyValue @($Pacing)
+    $Results | ConvertTo-Json -Depth 4 | Set-Content $Output
+}
+
+if ($Save) {
+    Copy-Item $Output $Baseline
+    exit 0
+}
+if (-not (Test-Path $Baseline)) {
+    $Results.results | Format-Table name, median_ns, p95_ns, min_ns
+    exit 0
+}
+
+# Compare medians row by row.
+$Base = @{}
+foreach ($Row in (Get-Content $Baseline -Raw | ConvertFrom-Json).results) {
+    $Base[$Row.name] = $Row
+}
+$Failed = $false
+$Table = foreach ($Row in $Results.results) {
+    $Old = $Base[$Row.name]
+    $Ratio = if ($Old -and $Old.median_ns) { $Row.median_ns / $Old.median_ns }
+    if ($Ratio -gt $Threshold) { $Failed = $true }
+    [pscustomobject]@{
+        name = $Row.name
+        median_ns = $Row.median_ns
+        p95_ns = $Row.p95_ns
+        baseline_ns = $Old.median_ns
+        ratio = if ($Ratio) { "{0:N3}" -f $Ratio } else { "new" }
+    }
+}
+$Table | Format-Table
+if ($Failed) { exit 1 }
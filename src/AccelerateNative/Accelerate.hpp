@@ -0,0 +1,55 @@
+// Accelerate.hpp: Common definitions for `AccelerateNative.dll`.
+
+#ifndef IPASIM_ACCELERATE_HPP
+#define IPASIM_ACCELERATE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Types follow iOS's `<Accelerate/Accelerate.h>`. Both that and our target are
+// 32-bit, so `long` and `size_t` have the same width on both sides.
+using vDSP_Length = unsigned long;
+using vDSP_Stride = long;
+using FFTRadix = int;
+using FFTDirection = int;
+using vImagePixelCount = unsigned long;
+using vImage_Error = long;
+using vImage_Flags = uint32_t;
+using Pixel_F = float;
+
+struct DSPSplitComplex {
+  float *realp;
+  float *imagp;
+};
+
+struct vImage_Buffer {
+  void *data;
+  vImagePixelCount height;
+  vImagePixelCount width;
+  size_t rowBytes;
+};
+
+enum : int { kFFTRadix2 = 0, kFFTRadix3 = 1, kFFTRadix5 = 2 };
+enum : int { kFFTDirection_Forward = 1, kFFTDirection_Inverse = -1 };
+enum : vImage_Error {
+  kvImageNoError = 0,
+  kvImageNullPointerArgument = -21772,
+  kvImageBufferSizeMismatch = -21774,
+};
+
+#define ACCELERATE_API extern "C" __declspec(dllexport)
+
+// Kernels using AVX2 must be marked with this, so that they can be compiled
+// without enabling AVX2 for the whole DLL.
+#define ACCELERATE_AVX2 __attribute__((target("avx2")))
+
+namespace ipasim::accelerate {
+
+// Returns `true` if both the CPU and the OS support AVX2. The result is
+// computed once.
+bool hasAVX2();
+
+} // namespace ipasim::accelerate
+
+// !defined(IPASIM_ACCELERATE_HPP)
+#endif
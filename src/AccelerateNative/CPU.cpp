@@ -0,0 +1,30 @@
+// CPU.cpp: Runtime detection of CPU features.
+
+#include "Accelerate.hpp"
+
+#include <intrin.h>
+
+using namespace ipasim::accelerate;
+
+// `_xgetbv` needs this target feature.
+__attribute__((target("xsave"))) static bool detectAVX2() {
+  int Info[4];
+  __cpuid(Info, 0);
+  if (Info[0] < 7)
+    return false;
+
+  // The OS must save YMM registers on context switches.
+  __cpuid(Info, 1);
+  bool OSXSAVE = Info[2] & (1 << 27);
+  bool AVX = Info[2] & (1 << 28);
+  if (!OSXSAVE || !AVX || (_xgetbv(0) & 6) != 6)
+    return false;
+
+  __cpuidex(Info, 7, 0);
+  return Info[1] & (1 << 5);
+}
+
+bool ipasim::accelerate::hasAVX2() {
+  static const bool Result = detectAVX2();
+  return Result;
+}
@@ -0,0 +1,185 @@
+// FFT.cpp: Fast Fourier transforms of vDSP.
+
+#include "Accelerate.hpp"
+
+#include <cmath>
+#include <immintrin.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace ipasim::accelerate;
+
+// Opaque to apps, they only get pointers to it.
+struct OpaqueFFTSetup {
+  vDSP_Length Log2n;
+  // Twiddle factors of all stages of radix-2 transforms up to size `2^Log2n`.
+  // Butterflies of half-size `H` use angles `pi * J / H` for `J < H`, which are
+  // stored at index `H - 1 + J`.
+  std::vector<float> Cos, Sin;
+};
+using FFTSetup = OpaqueFFTSetup *;
+
+namespace {
+
+constexpr double Pi = 3.14159265358979323846;
+
+vDSP_Stride Stride(vDSP_Length I) { return static_cast<vDSP_Stride>(I); }
+
+// Complex numbers stored as split real and imaginary parts.
+struct SplitRef {
+  float *Re, *Im;
+  vDSP_Stride S;
+
+  float &re(vDSP_Length I) const { return Re[Stride(I) * S]; }
+  float &im(vDSP_Length I) const { return Im[Stride(I) * S]; }
+};
+
+// Butterflies of one stage over `2 * H` contiguous elements starting at `I`.
+ACCELERATE_AVX2 void butterfliesAVX2(const SplitRef &X, const float *Cos,
+                                     const float *Sin, vDSP_Length I,
+                                     vDSP_Length H, float Dir) {
+  __m256 DirV = _mm256_set1_ps(-Dir);
+  for (vDSP_Length J = 0; J != H; J += 8) {
+    __m256 WRe = _mm256_loadu_ps(Cos + J);
+    __m256 WIm = _mm256_mul_ps(_mm256_loadu_ps(Sin + J), DirV);
+    float *ARe = X.Re + I + J, *AIm = X.Im + I + J;
+    float *BRe = ARe + H, *BIm = AIm + H;
+    __m256 BR = _mm256_loadu_ps(BRe), BI = _mm256_loadu_ps(BIm);
+    __m256 TRe = _mm256_sub_ps(_mm256_mul_ps(BR, WRe), _mm256_mul_ps(BI, WIm));
+    __m256 TIm = _mm256_add_ps(_mm256_mul_ps(BR, WIm), _mm256_mul_ps(BI, WRe));
+    __m256 AR = _mm256_loadu_ps(ARe), AI = _mm256_loadu_ps(AIm);
+    _mm256_storeu_ps(BRe, _mm256_sub_ps(AR, TRe));
+    _mm256_storeu_ps(BIm, _mm256_sub_ps(AI, TIm));
+    _mm256_storeu_ps(ARe, _mm256_add_ps(AR, TRe));
+    _mm256_storeu_ps(AIm, _mm256_add_ps(AI, TIm));
+  }
+}
+
+// In-place unnormalized complex transform of size `2^Log2n`. `Dir` is `1` for
+// the forward transform (with negative exponent) and `-1` for the inverse one.
+void transform(const OpaqueFFTSetup &Setup, const SplitRef &X,
+               vDSP_Length Log2n, float Dir) {
+  vDSP_Length N = vDSP_Length(1) << Log2n;
+
+  // Bit-reversal permutation.
+  for (vDSP_Length I = 1, J = 0; I < N; ++I) {
+    vDSP_Length Bit = N >> 1;
+    for (; J & Bit; Bit >>= 1)
+      J ^= Bit;
+    J |= Bit;
+    if (I < J) {
+      std::swap(X.re(I), X.re(J));
+      std::swap(X.im(I), X.im(J));
+    }
+  }
+
+  bool Vector = X.S == 1 && hasAVX2();
+  for (vDSP_Length H = 1; H < N; H <<= 1) {
+    const float *Cos = Setup.Cos.data() + H - 1;
+    const float *Sin = Setup.Sin.data() + H - 1;
+    for (vDSP_Length I = 0; I < N; I += 2 * H) {
+      if (Vector && H >= 8) {
+        butterfliesAVX2(X, Cos, Sin, I, H, Dir);
+        continue;
+      }
+      for (vDSP_Length J = 0; J != H; ++J) {
+        float WRe = Cos[J], WIm = -Dir * Sin[J];
+        vDSP_Length A = I + J, B = A + H;
+        float TRe = X.re(B) * WRe - X.im(B) * WIm;
+        float TIm = X.re(B) * WIm + X.im(B) * WRe;
+        X.re(B) = X.re(A) - TRe;
+        X.im(B) = X.im(A) - TIm;
+        X.re(A) += TRe;
+        X.im(A) += TIm;
+      }
+    }
+  }
+}
+
+} // namespace
+
+// Only radix 2 is supported.
+ACCELERATE_API FFTSetup vDSP_create_fftsetup(vDSP_Length Log2n,
+                                             FFTRadix Radix) {
+  if (Radix != kFFTRadix2 || Log2n >= 31)
+    return nullptr;
+  auto *Setup = new (std::nothrow) OpaqueFFTSetup;
+  if (!Setup)
+    return nullptr;
+  Setup->Log2n = Log2n;
+  vDSP_Length N = vDSP_Length(1) << Log2n;
+  // Exceptions must not escape into the caller, failure is reported by
+  // returning `nullptr` like on iOS.
+  try {
+    Setup->Cos.resize(N);
+    Setup->Sin.resize(N);
+  } catch (...) {
+    delete Setup;
+    return nullptr;
+  }
+  for (vDSP_Length H = 1; H < N; H <<= 1)
+    for (vDSP_Length J = 0; J != H; ++J) {
+      double Angle = Pi * J / H;
+      Setup->Cos[H - 1 + J] = static_cast<float>(std::cos(Angle));
+      Setup->Sin[H - 1 + J] = static_cast<float>(std::sin(Angle));
+    }
+  return Setup;
+}
+ACCELERATE_API void vDSP_destroy_fftsetup(FFTSetup Setup) { delete Setup; }
+// In-place complex transform. Like in iOS, neither direction is scaled.
+ACCELERATE_API void vDSP_fft_zip(FFTSetup Setup, const DSPSplitComplex *C,
+                                 vDSP_Stride IC, vDSP_Length Log2n,
+                                 FFTDirection Direction) {
+  if (Log2n > Setup->Log2n)
+    return;
+  transform(*Setup, SplitRef{C->realp, C->imagp, IC}, Log2n,
+            static_cast<float>(Direction));
+}
+// In-place real transform of size `N = 2^Log2n`. Real data are packed like
+// complex numbers (even elements are in `realp`, odd in `imagp`). Spectrum is
+// packed as its first `N / 2` elements, except that the imaginary part of the
+// first one holds the real `N / 2`-th element. Like in iOS, forward transform
+// is scaled by 2, inverse is not scaled, so a round trip scales data by `2N`.
+//
+// It's computed as a complex transform of size `N / 2`, whose result is then
+// split into spectra of even and odd elements (or the other way around).
+ACCELERATE_API void vDSP_fft_zrip(FFTSetup Setup, const DSPSplitComplex *C,
+                                  vDSP_Stride IC, vDSP_Length Log2n,
+                                  FFTDirection Direction) {
+  if (Log2n < 1 || Log2n > Setup->Log2n)
+    return;
+  SplitRef X{C->realp, C->imagp, IC};
+  vDSP_Length M = vDSP_Length(1) << (Log2n - 1);
+  const float *Cos = Setup->Cos.data() + M - 1;
+  const float *Sin = Setup->Sin.data() + M - 1;
+
+  bool Forward = Direction == kFFTDirection_Forward;
+  if (Forward)
+    transform(*Setup, X, Log2n - 1, 1);
+
+  // For `K` and `L = M - K`, let `A = Z[K] + conj(Z[L])` and
+  // `B = Z[K] - conj(Z[L])`. Then the forward transform is `Y[K] = A - iWB`
+  // and `Y[L] = conj(A + iWB)` where `W = exp(-i * pi * K / M)`. The inverse
+  // transform uses `conj(W)` and the opposite signs instead.
+  float Re0 = X.re(0), Im0 = X.im(0);
+  float Scale = Forward ? 2 : 1;
+  X.re(0) = Scale * (Re0 + Im0);
+  X.im(0) = Scale * (Re0 - Im0);
+  float Sign = Forward ? 1 : -1;
+  for (vDSP_Length K = 1; K <= M / 2; ++K) {
+    vDSP_Length L = M - K;
+    float ARe = X.re(K) + X.re(L), AIm = X.im(K) - X.im(L);
+    float BRe = X.re(K) - X.re(L), BIm = X.im(K) + X.im(L);
+    float WRe = Cos[K], WIm = -Sign * Sin[K];
+    // `iWB`
+    float TRe = -(WRe * BIm + WIm * BRe), TIm = WRe * BRe - WIm * BIm;
+    X.re(K) = ARe - Sign * TRe;
+    X.im(K) = AIm - Sign * TIm;
+    X.re(L) = ARe + Sign * TRe;
+    X.im(L) = -(AIm + Sign * TIm);
+  }
+
+  if (!Forward)
+    transform(*Setup, X, Log2n - 1, -1);
+}
@@ -0,0 +1,266 @@
+// vDSP.cpp: Vector arithmetic, reductions and convolution of vDSP.
+
+#include "Accelerate.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+using namespace ipasim::accelerate;
+
+namespace {
+
+// Strides can be negative, so indices must be converted before multiplying.
+vDSP_Stride Stride(vDSP_Length I) { return static_cast<vDSP_Stride>(I); }
+
+// Element-wise operations. `scalar` is used for strided data and tails of
+// vectors, `vector` for 8 contiguous elements at once.
+struct Add {
+  static float scalar(float A, float B) { return A + B; }
+  ACCELERATE_AVX2 static __m256 vector(__m256 A, __m256 B) {
+    return _mm256_add_ps(A, B);
+  }
+};
+struct Sub {
+  static float scalar(float A, float B) { return A - B; }
+  ACCELERATE_AVX2 static __m256 vector(__m256 A, __m256 B) {
+    return _mm256_sub_ps(A, B);
+  }
+};
+struct Mul {
+  static float scalar(float A, float B) { return A * B; }
+  ACCELERATE_AVX2 static __m256 vector(__m256 A, __m256 B) {
+    return _mm256_mul_ps(A, B);
+  }
+};
+struct Div {
+  static float scalar(float A, float B) { return A / B; }
+  ACCELERATE_AVX2 static __m256 vector(__m256 A, __m256 B) {
+    return _mm256_div_ps(A, B);
+  }
+};
+struct Max {
+  static float scalar(float A, float B) { return std::max(A, B); }
+  ACCELERATE_AVX2 static __m256 vector(__m256 A, __m256 B) {
+    return _mm256_max_ps(A, B);
+  }
+};
+struct Min {
+  static float scalar(float A, float B) { return std::min(A, B); }
+  ACCELERATE_AVX2 static __m256 vector(__m256 A, __m256 B) {
+    return _mm256_min_ps(A, B);
+  }
+};
+
+template <typename Op>
+ACCELERATE_AVX2 void binaryAVX2(const float *A, const float *B, float *C,
+                                vDSP_Length N) {
+  vDSP_Length I = 0;
+  for (; I + 8 <= N; I += 8)
+    _mm256_storeu_ps(C + I, Op::vector(_mm256_loadu_ps(A + I),
+                                       _mm256_loadu_ps(B + I)));
+  for (; I != N; ++I)
+    C[I] = Op::scalar(A[I], B[I]);
+}
+
+// Computes `C = Op(A, B)`.
+template <typename Op>
+void binary(const float *A, vDSP_Stride IA, const float *B, vDSP_Stride IB,
+            float *C, vDSP_Stride IC, vDSP_Length N) {
+  if (IA == 1 && IB == 1 && IC == 1 && hasAVX2()) {
+    binaryAVX2<Op>(A, B, C, N);
+    return;
+  }
+  for (vDSP_Length I = 0; I != N; ++I, A += IA, B += IB, C += IC)
+    *C = Op::scalar(*A, *B);
+}
+
+template <typename Op>
+ACCELERATE_AVX2 void withScalarAVX2(const float *A, float B, float *C,
+                                    vDSP_Length N) {
+  __m256 BV = _mm256_set1_ps(B);
+  vDSP_Length I = 0;
+  for (; I + 8 <= N; I += 8)
+    _mm256_storeu_ps(C + I, Op::vector(_mm256_loadu_ps(A + I), BV));
+  for (; I != N; ++I)
+    C[I] = Op::scalar(A[I], B);
+}
+
+// Computes `C = Op(A, B)` where `B` is a scalar.
+template <typename Op>
+void withScalar(const float *A, vDSP_Stride IA, float B, float *C,
+                vDSP_Stride IC, vDSP_Length N) {
+  if (IA == 1 && IC == 1 && hasAVX2()) {
+    withScalarAVX2<Op>(A, B, C, N);
+    return;
+  }
+  for (vDSP_Length I = 0; I != N; ++I, A += IA, C += IC)
+    *C = Op::scalar(*A, B);
+}
+
+ACCELERATE_AVX2 float horizontalSum(__m256 V) {
+  __m128 S =
+      _mm_add_ps(_mm256_castps256_ps128(V), _mm256_extractf128_ps(V, 1));
+  S = _mm_add_ps(S, _mm_movehl_ps(S, S));
+  S = _mm_add_ss(S, _mm_shuffle_ps(S, S, 1));
+  return _mm_cvtss_f32(S);
+}
+
+template <typename Op>
+ACCELERATE_AVX2 float horizontal(__m256 V) {
+  alignas(32) float Values[8];
+  _mm256_store_ps(Values, V);
+  float Result = Values[0];
+  for (int I = 1; I != 8; ++I)
+    Result = Op::scalar(Result, Values[I]);
+  return Result;
+}
+
+// Folds `A` using `Op`, starting with `Init`. It must be the identity element
+// of `Op`, since the vector version uses it for each of its lanes.
+template <typename Op>
+ACCELERATE_AVX2 float reduceAVX2(const float *A, vDSP_Length N, float Init) {
+  __m256 Acc = _mm256_set1_ps(Init);
+  vDSP_Length I = 0;
+  for (; I + 8 <= N; I += 8)
+    Acc = Op::vector(Acc, _mm256_loadu_ps(A + I));
+  float Result = horizontal<Op>(Acc);
+  for (; I != N; ++I)
+    Result = Op::scalar(Result, A[I]);
+  return Result;
+}
+
+template <typename Op>
+float reduce(const float *A, vDSP_Stride IA, vDSP_Length N, float Init) {
+  if (IA == 1 && hasAVX2())
+    return reduceAVX2<Op>(A, N, Init);
+  float Result = Init;
+  for (vDSP_Length I = 0; I != N; ++I, A += IA)
+    Result = Op::scalar(Result, *A);
+  return Result;
+}
+
+ACCELERATE_AVX2 float dotProductAVX2(const float *A, const float *B,
+                                     vDSP_Length N) {
+  __m256 Acc = _mm256_setzero_ps();
+  vDSP_Length I = 0;
+  for (; I + 8 <= N; I += 8)
+    Acc = _mm256_add_ps(
+        Acc, _mm256_mul_ps(_mm256_loadu_ps(A + I), _mm256_loadu_ps(B + I)));
+  float Result = horizontalSum(Acc);
+  for (; I != N; ++I)
+    Result += A[I] * B[I];
+  return Result;
+}
+
+ACCELERATE_AVX2 void convolveAVX2(const float *A, const float *F,
+                                  vDSP_Stride IF, float *C, vDSP_Length N,
+                                  vDSP_Length P) {
+  vDSP_Length I = 0;
+  for (; I + 8 <= N; I += 8) {
+    __m256 Acc = _mm256_setzero_ps();
+    for (vDSP_Length J = 0; J != P; ++J) {
+      __m256 FV = _mm256_set1_ps(F[Stride(J) * IF]);
+      Acc = _mm256_add_ps(Acc, _mm256_mul_ps(_mm256_loadu_ps(A + I + J), FV));
+    }
+    _mm256_storeu_ps(C + I, Acc);
+  }
+  for (; I != N; ++I) {
+    float Sum = 0;
+    for (vDSP_Length J = 0; J != P; ++J)
+      Sum += A[I + J] * F[Stride(J) * IF];
+    C[I] = Sum;
+  }
+}
+
+} // namespace
+
+ACCELERATE_API void vDSP_vadd(const float *A, vDSP_Stride IA, const float *B,
+                              vDSP_Stride IB, float *C, vDSP_Stride IC,
+                              vDSP_Length N) {
+  binary<Add>(A, IA, B, IB, C, IC, N);
+}
+// Note that `vDSP_vsub` and `vDSP_vdiv` take their operands in reverse order.
+ACCELERATE_API void vDSP_vsub(const float *B, vDSP_Stride IB, const float *A,
+                              vDSP_Stride IA, float *C, vDSP_Stride IC,
+                              vDSP_Length N) {
+  binary<Sub>(A, IA, B, IB, C, IC, N);
+}
+ACCELERATE_API void vDSP_vmul(const float *A, vDSP_Stride IA, const float *B,
+                              vDSP_Stride IB, float *C, vDSP_Stride IC,
+                              vDSP_Length N) {
+  binary<Mul>(A, IA, B, IB, C, IC, N);
+}
+ACCELERATE_API void vDSP_vdiv(const float *B, vDSP_Stride IB, const float *A,
+                              vDSP_Stride IA, float *C, vDSP_Stride IC,
+                              vDSP_Length N) {
+  binary<Div>(A, IA, B, IB, C, IC, N);
+}
+ACCELERATE_API void vDSP_vsadd(const float *A, vDSP_Stride IA, const float *B,
+                               float *C, vDSP_Stride IC, vDSP_Length N) {
+  withScalar<Add>(A, IA, *B, C, IC, N);
+}
+ACCELERATE_API void vDSP_vsmul(const float *A, vDSP_Stride IA, const float *B,
+                               float *C, vDSP_Stride IC, vDSP_Length N) {
+  withScalar<Mul>(A, IA, *B, C, IC, N);
+}
+ACCELERATE_API void vDSP_vsdiv(const float *A, vDSP_Stride IA, const float *B,
+                               float *C, vDSP_Stride IC, vDSP_Length N) {
+  withScalar<Div>(A, IA, *B, C, IC, N);
+}
+ACCELERATE_API void vDSP_vclr(float *C, vDSP_Stride IC, vDSP_Length N) {
+  for (vDSP_Length I = 0; I != N; ++I, C += IC)
+    *C = 0;
+}
+ACCELERATE_API void vDSP_vfill(const float *A, float *C, vDSP_Stride IC,
+                               vDSP_Length N) {
+  float Value = *A;
+  for (vDSP_Length I = 0; I != N; ++I, C += IC)
+    *C = Value;
+}
+ACCELERATE_API void vDSP_dotpr(const float *A, vDSP_Stride IA, const float *B,
+                               vDSP_Stride IB, float *C, vDSP_Length N) {
+  if (IA == 1 && IB == 1 && hasAVX2()) {
+    *C = dotProductAVX2(A, B, N);
+    return;
+  }
+  float Sum = 0;
+  for (vDSP_Length I = 0; I != N; ++I, A += IA, B += IB)
+    Sum += *A * *B;
+  *C = Sum;
+}
+ACCELERATE_API void vDSP_sve(const float *A, vDSP_Stride IA, float *C,
+                             vDSP_Length N) {
+  *C = reduce<Add>(A, IA, N, 0);
+}
+ACCELERATE_API void vDSP_meanv(const float *A, vDSP_Stride IA, float *C,
+                               vDSP_Length N) {
+  // Like in iOS, the mean of an empty vector is NaN.
+  *C = reduce<Add>(A, IA, N, 0) / N;
+}
+ACCELERATE_API void vDSP_maxv(const float *A, vDSP_Stride IA, float *C,
+                              vDSP_Length N) {
+  *C = reduce<Max>(A, IA, N, -INFINITY);
+}
+ACCELERATE_API void vDSP_minv(const float *A, vDSP_Stride IA, float *C,
+                              vDSP_Length N) {
+  *C = reduce<Min>(A, IA, N, INFINITY);
+}
+// Computes `C[n] = sum(A[n + p] * F[p])` for `p < P`. If `IF` is negative, `F`
+// points to the last element of the filter and this is a convolution,
+// otherwise, it's a correlation.
+ACCELERATE_API void vDSP_conv(const float *A, vDSP_Stride IA, const float *F,
+                              vDSP_Stride IF, float *C, vDSP_Stride IC,
+                              vDSP_Length N, vDSP_Length P) {
+  if (IA == 1 && IC == 1 && hasAVX2()) {
+    convolveAVX2(A, F, IF, C, N, P);
+    return;
+  }
+  for (vDSP_Length I = 0; I != N; ++I, C += IC) {
+    float Sum = 0;
+    const float *AP = A + Stride(I) * IA, *FP = F;
+    for (vDSP_Length J = 0; J != P; ++J, AP += IA, FP += IF)
+      Sum += *AP * *FP;
+    *C = Sum;
+  }
+}
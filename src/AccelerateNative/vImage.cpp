@@ -0,0 +1,164 @@
+// vImage.cpp: Pixel format conversions of vImage.
+
+#include "Accelerate.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+using namespace ipasim::accelerate;
+
+namespace {
+
+vImage_Error checkBuffers(const vImage_Buffer *Src, const vImage_Buffer *Dest) {
+  if (!Src || !Dest || !Src->data || !Dest->data)
+    return kvImageNullPointerArgument;
+  if (Src->width != Dest->width || Src->height != Dest->height)
+    return kvImageBufferSizeMismatch;
+  return kvImageNoError;
+}
+
+template <typename T> T *row(const vImage_Buffer *Buf, vImagePixelCount Y) {
+  return reinterpret_cast<T *>(static_cast<uint8_t *>(Buf->data) +
+                               Y * Buf->rowBytes);
+}
+
+uint8_t toPlanar8(float Value, float Scale, float Min) {
+  // Rounds to nearest (even) like the vector version.
+  float Result = std::nearbyint((Value - Min) * Scale);
+  return static_cast<uint8_t>(std::clamp(Result, 0.0f, 255.0f));
+}
+
+ACCELERATE_AVX2 void planar8ToPlanarFAVX2(const uint8_t *Src, float *Dest,
+                                          vImagePixelCount Width, float Scale,
+                                          float Min) {
+  __m256 ScaleV = _mm256_set1_ps(Scale), MinV = _mm256_set1_ps(Min);
+  vImagePixelCount X = 0;
+  for (; X + 8 <= Width; X += 8) {
+    __m128i Bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(Src + X));
+    __m256 Values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(Bytes));
+    _mm256_storeu_ps(Dest + X,
+                     _mm256_add_ps(_mm256_mul_ps(Values, ScaleV), MinV));
+  }
+  for (; X != Width; ++X)
+    Dest[X] = Src[X] * Scale + Min;
+}
+
+ACCELERATE_AVX2 void planarFToPlanar8AVX2(const float *Src, uint8_t *Dest,
+                                          vImagePixelCount Width, float Scale,
+                                          float Min) {
+  __m256 ScaleV = _mm256_set1_ps(Scale), MinV = _mm256_set1_ps(Min);
+  __m256 Zero = _mm256_setzero_ps(), Max = _mm256_set1_ps(255);
+  vImagePixelCount X = 0;
+  for (; X + 8 <= Width; X += 8) {
+    __m256 Values =
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(Src + X), MinV), ScaleV);
+    Values = _mm256_min_ps(_mm256_max_ps(Values, Zero), Max);
+    __m256i Ints = _mm256_cvtps_epi32(Values);
+    __m128i Words = _mm_packus_epi32(_mm256_castsi256_si128(Ints),
+                                     _mm256_extracti128_si256(Ints, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(Dest + X),
+                     _mm_packus_epi16(Words, Words));
+  }
+  for (; X != Width; ++X)
+    Dest[X] = toPlanar8(Src[X], Scale, Min);
+}
+
+void permutePixel(const uint8_t *Src, uint8_t *Dest,
+                  const uint8_t PermuteMap[4]) {
+  uint8_t Pixel[4] = {Src[0], Src[1], Src[2], Src[3]};
+  for (int C = 0; C != 4; ++C)
+    Dest[C] = Pixel[PermuteMap[C]];
+}
+
+ACCELERATE_AVX2 void permuteAVX2(const uint8_t *Src, uint8_t *Dest,
+                                 vImagePixelCount Width,
+                                 const uint8_t PermuteMap[4]) {
+  // Shuffle mask that permutes each of the 8 pixels of a vector.
+  alignas(32) uint8_t Mask[32];
+  for (int I = 0; I != 32; ++I)
+    Mask[I] = static_cast<uint8_t>((I & 12) + PermuteMap[I & 3]);
+  __m256i MaskV = _mm256_load_si256(reinterpret_cast<const __m256i *>(Mask));
+  vImagePixelCount X = 0;
+  for (; X + 8 <= Width; X += 8) {
+    __m256i Pixels =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Src + X * 4));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(Dest + X * 4),
+                        _mm256_shuffle_epi8(Pixels, MaskV));
+  }
+  for (; X != Width; ++X)
+    permutePixel(Src + X * 4, Dest + X * 4, PermuteMap);
+}
+
+} // namespace
+
+// Computes `Dest = Min + Src * (Max - Min) / 255`.
+ACCELERATE_API vImage_Error
+vImageConvert_Planar8toPlanarF(const vImage_Buffer *Src,
+                               const vImage_Buffer *Dest, Pixel_F MaxFloat,
+                               Pixel_F MinFloat, vImage_Flags Flags) {
+  if (vImage_Error Error = checkBuffers(Src, Dest))
+    return Error;
+  float Scale = (MaxFloat - MinFloat) / 255;
+  bool Vector = hasAVX2();
+  for (vImagePixelCount Y = 0; Y != Src->height; ++Y) {
+    const uint8_t *S = row<uint8_t>(Src, Y);
+    float *D = row<float>(Dest, Y);
+    if (Vector) {
+      planar8ToPlanarFAVX2(S, D, Src->width, Scale, MinFloat);
+      continue;
+    }
+    for (vImagePixelCount X = 0; X != Src->width; ++X)
+      D[X] = S[X] * Scale + MinFloat;
+  }
+  return kvImageNoError;
+}
+// Computes `Dest = (Src - Min) * 255 / (Max - Min)`, rounded and clamped.
+ACCELERATE_API vImage_Error
+vImageConvert_PlanarFtoPlanar8(const vImage_Buffer *Src,
+                               const vImage_Buffer *Dest, Pixel_F MaxFloat,
+                               Pixel_F MinFloat, vImage_Flags Flags) {
+  if (vImage_Error Error = checkBuffers(Src, Dest))
+    return Error;
+  float Scale = 255 / (MaxFloat - MinFloat);
+  bool Vector = hasAVX2();
+  for (vImagePixelCount Y = 0; Y != Src->height; ++Y) {
+    const float *S = row<float>(Src, Y);
+    uint8_t *D = row<uint8_t>(Dest, Y);
+    if (Vector) {
+      planarFToPlanar8AVX2(S, D, Src->width, Scale, MinFloat);
+      continue;
+    }
+    for (vImagePixelCount X = 0; X != Src->width; ++X)
+      D[X] = toPlanar8(S[X], Scale, MinFloat);
+  }
+  return kvImageNoError;
+}
+// Channel `C` of each destination pixel is channel `PermuteMap[C]` of the
+// corresponding source pixel.
+ACCELERATE_API vImage_Error
+vImagePermuteChannels_ARGB8888(const vImage_Buffer *Src,
+                               const vImage_Buffer *Dest,
+                               const uint8_t PermuteMap[4],
+                               vImage_Flags Flags) {
+  if (vImage_Error Error = checkBuffers(Src, Dest))
+    return Error;
+  if (!PermuteMap)
+    return kvImageNullPointerArgument;
+  uint8_t Map[4];
+  for (int C = 0; C != 4; ++C)
+    Map[C] = PermuteMap[C] & 3;
+  bool Vector = hasAVX2();
+  for (vImagePixelCount Y = 0; Y != Src->height; ++Y) {
+    const uint8_t *S = row<uint8_t>(Src, Y);
+    uint8_t *D = row<uint8_t>(Dest, Y);
+    // In-place permutation is fine, each pixel is read before it's written.
+    if (Vector) {
+      permuteAVX2(S, D, Src->width, Map);
+      continue;
+    }
+    for (vImagePixelCount X = 0; X != Src->width; ++X)
+      permutePixel(S + X * 4, D + X * 4, Map);
+  }
+  return kvImageNoError;
+}
@@ -0,0 +1,814 @@
+// ARMLifter.cpp: Implementation of class `ARMLifter`.
+
+#include "ipasim/ARMLifter.hpp"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/MathExtras.h>
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace ipasim;
+using namespace llvm;
+using namespace std;
+
+namespace {
+
+constexpr unsigned Always = 0xE; // Condition of unconditional instructions
+constexpr unsigned SP = 13, LR = 14, PC = 15;
+constexpr unsigned CPSRField = 16; // Index of `GuestCPU::CPSR`
+
+uint32_t bits(uint32_t Insn, unsigned Hi, unsigned Lo) {
+  return (Insn >> Lo) & ((uint64_t(1) << (Hi - Lo + 1)) - 1);
+}
+bool bit(uint32_t Insn, unsigned I) { return (Insn >> I) & 1; }
+
+// How an instruction continues, used to find reachable instructions.
+enum class Flow { Next, Branch, Return };
+
+Flow getFlow(uint32_t Insn) {
+  if (bits(Insn, 27, 25) == 0b101 && !bit(Insn, 24))
+    return Flow::Branch;
+  if ((Insn & 0x0FFFFFF0) == 0x012FFF10) // `bx`
+    return Flow::Return;
+  // Instructions writing PC (single and multiple loads, data processing).
+  if (bits(Insn, 27, 26) == 0b01 && bit(Insn, 20) && bits(Insn, 15, 12) == PC)
+    return Flow::Return;
+  if (bits(Insn, 27, 25) == 0b100 && bit(Insn, 20) && bit(Insn, 15))
+    return Flow::Return;
+  if (bits(Insn, 27, 26) == 0 && bits(Insn, 15, 12) == PC)
+    return Flow::Return;
+  return Flow::Next;
+}
+
+uint32_t getBranchTarget(uint32_t Addr, uint32_t Insn) {
+  return Addr + 8 + (static_cast<int32_t>(Insn << 8) >> 6);
+}
+
+// Appends addresses where execution can continue after `Insn` at `Addr`.
+void getSuccessors(uint32_t Addr, uint32_t Insn, vector<uint32_t> &Succs) {
+  Flow F = getFlow(Insn);
+  if (F == Flow::Branch)
+    Succs.push_back(getBranchTarget(Addr, Insn));
+  if (F == Flow::Next || bits(Insn, 31, 28) != Always)
+    Succs.push_back(Addr + 4);
+}
+
+// Sets `Growth` to how many bytes below SP `Insn` accesses or moves SP by.
+// Returns `false` if that isn't known statically. Writes of SP from other
+// registers (`mov sp, r7` in epilogues) restore an earlier SP, since AAPCS
+// doesn't allow data below SP.
+bool getStackGrowth(uint32_t Insn, uint32_t &Growth) {
+  Growth = 0;
+  unsigned Class = bits(Insn, 27, 25), Rn = bits(Insn, 19, 16);
+  bool Up = bit(Insn, 23);
+  if (Class == 0 && (Insn & 0x90) == 0x90) {
+    // Extra load or store with an 8-bit immediate or register offset
+    if (!bits(Insn, 6, 5) || Rn != SP || Up)
+      return true;
+    Growth = bits(Insn, 11, 8) << 4 | bits(Insn, 3, 0);
+    return bit(Insn, 22);
+  }
+  if (Class <= 0b001) {
+    unsigned Op = bits(Insn, 24, 21);
+    bool Test = Op >= 0b1000 && Op <= 0b1011;
+    if (Test || bits(Insn, 15, 12) != SP || Rn != SP)
+      return true;
+    if (Op == 0b0100 && bit(Insn, 25)) // `add sp, sp, #imm`
+      return true;
+    if (Op != 0b0010 || !bit(Insn, 25)) // Not `sub sp, sp, #imm`
+      return false;
+    unsigned Rotate = bits(Insn, 11, 8) * 2;
+    Growth = bits(Insn, 7, 0);
+    if (Rotate)
+      Growth = Growth >> Rotate | Growth << (32 - Rotate);
+    return true;
+  }
+  if (Class <= 0b011) {
+    if (Rn != SP || Up)
+      return true;
+    Growth = bits(Insn, 11, 0);
+    return !bit(Insn, 25);
+  }
+  if (Class == 0b100 && Rn == SP && !Up)
+    Growth = 4 * countPopulation(bits(Insn, 15, 0));
+  return true;
+}
+
+bool isCall(uint32_t Insn) {
+  return (bits(Insn, 27, 25) == 0b101 && bit(Insn, 24)) ||
+         (Insn & 0x0FFFFFF0) == 0x012FFF30; // `blx <reg>`
+}
+
+} // namespace
+
+ARMLifter::ARMLifter(Module &M)
+    : M(M), Ctx(M.getContext()), Builder(Ctx),
+      Int32Ty(Type::getInt32Ty(Ctx)) {
+  // `GuestCPU` is just 17 words.
+  CPUTy = StructType::create(Ctx, vector<Type *>(17, Int32Ty), "GuestCPU");
+}
+
+Function *ARMLifter::lift(StringRef Name, uint32_t Addr, ArrayRef<uint8_t> Code,
+                          string &Error) {
+  Start = Addr;
+  this->Code = Code;
+  Blocks.clear();
+  if (!discover(Error) || !measureFrame(Error))
+    return nullptr;
+
+  auto *FuncTy = FunctionType::get(Builder.getVoidTy(),
+                                   {CPUTy->getPointerTo()},
+                                   /* isVarArg */ false);
+  Func = Function::Create(FuncTy, Function::InternalLinkage, Name, &M);
+  Argument *CPU = &*Func->arg_begin();
+  CPU->addAttr(Attribute::NoAlias);
+
+  // Registers live in allocas (which are promoted by optimizations) while the
+  // function runs.
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Func);
+  Builder.SetInsertPoint(Entry);
+  for (unsigned R = 0; R != 16; ++R)
+    Regs[R] = Builder.CreateAlloca(Int32Ty, nullptr, "r" + Twine(R));
+  for (Value *&F : Flags)
+    F = Builder.CreateAlloca(Builder.getInt1Ty());
+  for (unsigned R = 0; R != 16; ++R)
+    Builder.CreateStore(
+        Builder.CreateLoad(Builder.CreateStructGEP(CPUTy, CPU, R)), Regs[R]);
+  Value *CPSR =
+      Builder.CreateLoad(Builder.CreateStructGEP(CPUTy, CPU, CPSRField));
+  for (unsigned F = N; F <= V; ++F)
+    setFlag(static_cast<Flag>(F),
+            Builder.CreateTrunc(Builder.CreateLShr(CPSR, 31 - F),
+                                Builder.getInt1Ty()));
+
+  for (auto &[BlockAddr, Block] : Blocks)
+    Block = BasicBlock::Create(Ctx, "x" + utohexstr(BlockAddr), Func);
+  Exit = BasicBlock::Create(Ctx, "exit", Func);
+  Builder.CreateBr(Blocks[Start]);
+
+  for (auto &[BlockAddr, Block] : Blocks) {
+    Current = BlockAddr;
+    Builder.SetInsertPoint(Block);
+    if (!emit(fetch(Current), Error)) {
+      Error = "0x" + utohexstr(Current) + ": " + Error;
+      Func->eraseFromParent();
+      return nullptr;
+    }
+  }
+
+  // Write registers back.
+  Builder.SetInsertPoint(Exit);
+  for (unsigned R = 0; R != 16; ++R)
+    Builder.CreateStore(Builder.CreateLoad(Regs[R]),
+                        Builder.CreateStructGEP(CPUTy, CPU, R));
+  Value *CPSRPtr = Builder.CreateStructGEP(CPUTy, CPU, CPSRField);
+  CPSR = Builder.CreateAnd(Builder.CreateLoad(CPSRPtr), 0x0FFFFFFF);
+  for (unsigned F = N; F <= V; ++F)
+    CPSR = Builder.CreateOr(
+        CPSR,
+        Builder.CreateShl(
+            Builder.CreateZExt(getFlag(static_cast<Flag>(F)), Int32Ty),
+            31 - F));
+  Builder.CreateStore(CPSR, CPSRPtr);
+  Builder.CreateRetVoid();
+
+  if (verifyFunction(*Func, &errs())) {
+    Error = "invalid IR";
+    Func->eraseFromParent();
+    return nullptr;
+  }
+  return Func;
+}
+
+bool ARMLifter::discover(string &Error) {
+  vector<uint32_t> Worklist{Start};
+  while (!Worklist.empty()) {
+    uint32_t Addr = Worklist.back();
+    Worklist.pop_back();
+    if (Addr < Start || Addr - Start + 4 > Code.size() || (Addr & 3)) {
+      Error = "control flow leaves the function at 0x" + utohexstr(Addr);
+      return false;
+    }
+    if (!Blocks.emplace(Addr, nullptr).second)
+      continue;
+
+    uint32_t Insn = fetch(Addr);
+    if (isCall(Insn)) {
+      Error = "0x" + utohexstr(Addr) + ": calls another function";
+      return false;
+    }
+    getSuccessors(Addr, Insn, Worklist);
+  }
+  return true;
+}
+
+bool ARMLifter::measureFrame(string &Error) {
+  // Growth of all instructions is summed, which is an upper bound unless one of
+  // them can run more than once.
+  FrameSize = 0;
+  for (auto &Block : Blocks) {
+    uint32_t Addr = Block.first, Insn = fetch(Addr), Growth;
+    if (!getStackGrowth(Insn, Growth)) {
+      Error = "0x" + utohexstr(Addr) + ": unknown stack adjustment";
+      return false;
+    }
+    if (!Growth)
+      continue;
+    if (Growth > MaxFrameSize - FrameSize) {
+      Error = "frame bigger than " + utostr(MaxFrameSize) + " bytes";
+      return false;
+    }
+    FrameSize += Growth;
+
+    // Look for a loop back to the instruction.
+    vector<uint32_t> Worklist;
+    getSuccessors(Addr, Insn, Worklist);
+    set<uint32_t> Seen;
+    while (!Worklist.empty()) {
+      uint32_t Next = Worklist.back();
+      Worklist.pop_back();
+      if (Next == Addr) {
+        Error = "0x" + utohexstr(Addr) + ": stack grows in a loop";
+        return false;
+      }
+      if (Seen.insert(Next).second)
+        getSuccessors(Next, fetch(Next), Worklist);
+    }
+  }
+  return true;
+}
+
+uint32_t ARMLifter::fetch(uint32_t Addr) const {
+  const uint8_t *P = Code.data() + (Addr - Start);
+  return P[0] | P[1] << 8 | P[2] << 16 | uint32_t(P[3]) << 24;
+}
+
+bool ARMLifter::emit(uint32_t Insn, string &Error) {
+  unsigned Cond = bits(Insn, 31, 28);
+  if (Cond == 0xF) {
+    Error = "unconditional instruction";
+    return false;
+  }
+  // Either the instruction continues with the next one or it's conditional,
+  // so `discover` has found the next one.
+  auto NextIt = Blocks.find(Current + 4);
+  BasicBlock *Next = NextIt == Blocks.end() ? nullptr : NextIt->second;
+  if (Cond != Always) {
+    BasicBlock *Execute = BasicBlock::Create(Ctx, "", Func, Next);
+    Builder.CreateCondBr(getCondition(Cond), Execute, Next);
+    Builder.SetInsertPoint(Execute);
+  }
+
+  if (getFlow(Insn) == Flow::Branch) {
+    Builder.CreateBr(Blocks[getBranchTarget(Current, Insn)]);
+    return true;
+  }
+  if (!emitInstruction(Insn, Error))
+    return false;
+  // Returns have already terminated the block.
+  if (!Builder.GetInsertBlock()->getTerminator())
+    Builder.CreateBr(Next);
+  return true;
+}
+
+bool ARMLifter::emitInstruction(uint32_t Insn, string &Error) {
+  // Hints (`nop`, `yield`, ...)
+  if ((Insn & 0x0FFFFF00) == 0x0320F000)
+    return true;
+
+  // `bx`
+  if ((Insn & 0x0FFFFFF0) == 0x012FFF10) {
+    if (bits(Insn, 3, 0) != LR) {
+      Error = "indirect branch";
+      return false;
+    }
+    emitReturn(getReg(LR));
+    return true;
+  }
+
+  unsigned Rd = bits(Insn, 15, 12), Rm = bits(Insn, 3, 0);
+
+  // `clz`
+  if ((Insn & 0x0FFF0FF0) == 0x016F0F10) {
+    if (Rd == PC || Rm == PC) {
+      Error = "unpredictable clz";
+      return false;
+    }
+    Function *Ctlz = Intrinsic::getDeclaration(&M, Intrinsic::ctlz, {Int32Ty});
+    setReg(Rd, Builder.CreateCall(Ctlz, {getReg(Rm), Builder.getFalse()}));
+    return true;
+  }
+
+  // `movw` and `movt`
+  bool MovW = (Insn & 0x0FF00000) == 0x03000000;
+  if (MovW || (Insn & 0x0FF00000) == 0x03400000) {
+    if (Rd == PC) {
+      Error = "unpredictable movw/movt";
+      return false;
+    }
+    uint32_t Imm = bits(Insn, 19, 16) << 12 | bits(Insn, 11, 0);
+    setReg(Rd, MovW ? getInt(Imm)
+                    : Builder.CreateOr(Builder.CreateAnd(getReg(Rd), 0xFFFF),
+                                       Imm << 16));
+    return true;
+  }
+
+  // `sxtb`, `sxth`, `uxtb`, `uxth` and their accumulating variants
+  if ((Insn & 0x0FA003F0) == 0x06A00070) {
+    unsigned Rn = bits(Insn, 19, 16), Rotate = bits(Insn, 11, 10) * 8;
+    if (Rd == PC || Rm == PC) {
+      Error = "unpredictable extension";
+      return false;
+    }
+    Value *Value = getReg(Rm);
+    if (Rotate)
+      Value = Builder.CreateOr(Builder.CreateLShr(Value, Rotate),
+                               Builder.CreateShl(Value, 32 - Rotate));
+    Value = Builder.CreateTrunc(Value, bit(Insn, 20) ? Builder.getInt16Ty()
+                                                     : Builder.getInt8Ty());
+    Value = bit(Insn, 22) ? Builder.CreateZExt(Value, Int32Ty)
+                          : Builder.CreateSExt(Value, Int32Ty);
+    if (Rn != PC)
+      Value = Builder.CreateAdd(getReg(Rn), Value);
+    setReg(Rd, Value);
+    return true;
+  }
+
+  unsigned Class = bits(Insn, 27, 25);
+  if (Class == 0 && (Insn & 0x90) == 0x90)
+    return bits(Insn, 6, 5) ? emitExtraLoadStore(Insn, Error)
+                            : emitMultiply(Insn, Error);
+  if (Class <= 0b001)
+    return emitDataProcessing(Insn, Error);
+  if (Class <= 0b011) {
+    if (bit(Insn, 25) && bit(Insn, 4)) {
+      Error = "media instruction";
+      return false;
+    }
+    return emitLoadStore(Insn, Error);
+  }
+  if (Class == 0b100)
+    return emitBlockTransfer(Insn, Error);
+  Error = "coprocessor or system instruction";
+  return false;
+}
+
+bool ARMLifter::emitDataProcessing(uint32_t Insn, string &Error) {
+  enum {
+    AND, EOR, SUB, RSB, ADD, ADC, SBC, RSC,
+    TST, TEQ, CMP, CMN, ORR, MOV, BIC, MVN
+  };
+  unsigned Op = bits(Insn, 24, 21), Rn = bits(Insn, 19, 16),
+           Rd = bits(Insn, 15, 12);
+  bool S = bit(Insn, 20);
+  bool Test = Op >= TST && Op <= CMN;
+  bool Logical = Op == AND || Op == EOR || Op == TST || Op == TEQ ||
+                 Op >= ORR;
+  if (Test && !S) {
+    Error = "miscellaneous instruction";
+    return false;
+  }
+  if (Rd == PC && (Op != MOV || S)) {
+    Error = "data processing writing PC";
+    return false;
+  }
+  // PC reads differently in register-shifted operands.
+  if (!bit(Insn, 25) && bit(Insn, 4) &&
+      (bits(Insn, 3, 0) == PC || bits(Insn, 11, 8) == PC || Rn == PC)) {
+    Error = "PC in register-shifted operand";
+    return false;
+  }
+
+  Value *Carry;
+  Value *B = getOperand2(Insn, Carry);
+  if (S && Logical && !Carry) {
+    Error = "carry of register-shifted operand";
+    return false;
+  }
+  Value *A = Op == MOV || Op == MVN ? nullptr : getReg(Rn);
+  Value *Result;
+  AddResult Sum{};
+  switch (Op) {
+  case AND:
+  case TST:
+    Result = Builder.CreateAnd(A, B);
+    break;
+  case EOR:
+  case TEQ:
+    Result = Builder.CreateXor(A, B);
+    break;
+  case SUB:
+  case CMP:
+    Sum = addWithCarry(A, Builder.CreateNot(B), Builder.getTrue());
+    break;
+  case RSB:
+    Sum = addWithCarry(B, Builder.CreateNot(A), Builder.getTrue());
+    break;
+  case ADD:
+  case CMN:
+    Sum = addWithCarry(A, B, Builder.getFalse());
+    break;
+  case ADC:
+    Sum = addWithCarry(A, B, getFlag(C));
+    break;
+  case SBC:
+    Sum = addWithCarry(A, Builder.CreateNot(B), getFlag(C));
+    break;
+  case RSC:
+    Sum = addWithCarry(B, Builder.CreateNot(A), getFlag(C));
+    break;
+  case ORR:
+    Result = Builder.CreateOr(A, B);
+    break;
+  case MOV:
+    Result = B;
+    break;
+  case BIC:
+    Result = Builder.CreateAnd(A, Builder.CreateNot(B));
+    break;
+  default: // MVN
+    Result = Builder.CreateNot(B);
+    break;
+  }
+  if (!Logical)
+    Result = Sum.Result;
+
+  if (Rd == PC) {
+    emitReturn(Result);
+    return true;
+  }
+  if (!Test)
+    setReg(Rd, Result);
+  if (S) {
+    setNZ(Result);
+    setFlag(C, Logical ? Carry : Sum.Carry);
+    if (!Logical)
+      setFlag(V, Sum.Overflow);
+  }
+  return true;
+}
+
+bool ARMLifter::emitMultiply(uint32_t Insn, string &Error) {
+  unsigned Rd = bits(Insn, 19, 16), Ra = bits(Insn, 15, 12),
+           Rs = bits(Insn, 11, 8), Rm = bits(Insn, 3, 0);
+  bool S = bit(Insn, 20), Accumulate = bit(Insn, 21);
+  if (Rd == PC || Ra == PC || Rs == PC || Rm == PC) {
+    Error = "unpredictable multiply";
+    return false;
+  }
+
+  // `mul` and `mla`
+  if ((Insn & 0x0FC000F0) == 0x00000090) {
+    Value *Result = Builder.CreateMul(getReg(Rm), getReg(Rs));
+    if (Accumulate)
+      Result = Builder.CreateAdd(Result, getReg(Ra));
+    setReg(Rd, Result);
+    if (S)
+      setNZ(Result);
+    return true;
+  }
+
+  // `umull`, `umlal`, `smull` and `smlal`
+  if ((Insn & 0x0F8000F0) == 0x00800090) {
+    unsigned RdHi = Rd, RdLo = Ra;
+    if (RdHi == RdLo) {
+      Error = "unpredictable long multiply";
+      return false;
+    }
+    Type *Int64Ty = Builder.getInt64Ty();
+    bool Signed = bit(Insn, 22);
+    auto Extend = [&](Value *Value) {
+      return Signed ? Builder.CreateSExt(Value, Int64Ty)
+                    : Builder.CreateZExt(Value, Int64Ty);
+    };
+    Value *Result = Builder.CreateMul(Extend(getReg(Rm)), Extend(getReg(Rs)));
+    if (Accumulate)
+      Result = Builder.CreateAdd(
+          Result,
+          Builder.CreateOr(
+              Builder.CreateShl(Builder.CreateZExt(getReg(RdHi), Int64Ty), 32),
+              Builder.CreateZExt(getReg(RdLo), Int64Ty)));
+    setReg(RdLo, Builder.CreateTrunc(Result, Int32Ty));
+    setReg(RdHi, Builder.CreateTrunc(Builder.CreateLShr(Result, 32), Int32Ty));
+    if (S) {
+      setFlag(N, Builder.CreateICmpSLT(Result, Builder.getInt64(0)));
+      setFlag(Z, Builder.CreateICmpEQ(Result, Builder.getInt64(0)));
+    }
+    return true;
+  }
+
+  Error = "swap or exclusive access";
+  return false;
+}
+
+bool ARMLifter::emitExtraLoadStore(uint32_t Insn, string &Error) {
+  bool Load = bit(Insn, 20);
+  unsigned Type = bits(Insn, 6, 5), Rm = bits(Insn, 3, 0);
+  // Without `Load`, only `strh` is supported (the others are doubleword
+  // transfers).
+  if (!Load && Type != 1) {
+    Error = "doubleword transfer";
+    return false;
+  }
+  Value *Offset;
+  if (bit(Insn, 22))
+    Offset = getInt(bits(Insn, 11, 8) << 4 | bits(Insn, 3, 0));
+  else if (Rm == PC) {
+    Error = "PC as offset";
+    return false;
+  } else
+    Offset = getReg(Rm);
+  return emitTransfer(Insn, Offset, Type == 2 ? 8 : 16, Type != 1, Error);
+}
+
+bool ARMLifter::emitLoadStore(uint32_t Insn, string &Error) {
+  Value *Offset;
+  if (!bit(Insn, 25))
+    Offset = getInt(bits(Insn, 11, 0));
+  else if (bits(Insn, 3, 0) == PC) {
+    Error = "PC as offset";
+    return false;
+  } else {
+    Value *Carry;
+    Offset = shift(getReg(bits(Insn, 3, 0)), bits(Insn, 6, 5),
+                   bits(Insn, 11, 7), Carry);
+  }
+  return emitTransfer(Insn, Offset, bit(Insn, 22) ? 8 : 32, /* Signed */ false,
+                      Error);
+}
+
+bool ARMLifter::emitTransfer(uint32_t Insn, Value *Offset, unsigned Bits,
+                             bool Signed, string &Error) {
+  bool PreIndex = bit(Insn, 24), Up = bit(Insn, 23), Load = bit(Insn, 20);
+  bool Writeback = !PreIndex || bit(Insn, 21);
+  unsigned Rn = bits(Insn, 19, 16), Rd = bits(Insn, 15, 12);
+  if (!PreIndex && bit(Insn, 21)) {
+    Error = "unprivileged transfer";
+    return false;
+  }
+  if (Writeback && (Rn == PC || Rn == Rd)) {
+    Error = "unpredictable writeback";
+    return false;
+  }
+  if (Rd == PC && (!Load || Bits != 32)) {
+    Error = "transfer of PC";
+    return false;
+  }
+
+  Value *Base = getReg(Rn);
+  Value *OffsetAddr =
+      Up ? Builder.CreateAdd(Base, Offset) : Builder.CreateSub(Base, Offset);
+  Value *Addr = PreIndex ? OffsetAddr : Base;
+  if (Load) {
+    Value *Value = load(Addr, Bits);
+    if (Bits != 32)
+      Value = Signed ? Builder.CreateSExt(Value, Int32Ty)
+                     : Builder.CreateZExt(Value, Int32Ty);
+    if (Writeback)
+      setReg(Rn, OffsetAddr);
+    if (Rd == PC)
+      emitReturn(Value);
+    else
+      setReg(Rd, Value);
+    return true;
+  }
+
+  Value *Value = getReg(Rd);
+  if (Bits != 32)
+    Value = Builder.CreateTrunc(Value, Builder.getIntNTy(Bits));
+  store(Addr, Value, Bits);
+  if (Writeback)
+    setReg(Rn, OffsetAddr);
+  return true;
+}
+
+bool ARMLifter::emitBlockTransfer(uint32_t Insn, string &Error) {
+  bool PreIndex = bit(Insn, 24), Up = bit(Insn, 23), Writeback = bit(Insn, 21),
+       Load = bit(Insn, 20);
+  unsigned Rn = bits(Insn, 19, 16), List = bits(Insn, 15, 0);
+  if (bit(Insn, 22)) {
+    Error = "transfer of user-mode registers";
+    return false;
+  }
+  if (Rn == PC || !List) {
+    Error = "unpredictable block transfer";
+    return false;
+  }
+  if (Load && Writeback && bit(List, Rn)) {
+    Error = "load of base register with writeback";
+    return false;
+  }
+  if (!Load && bit(List, PC)) {
+    Error = "store of PC";
+    return false;
+  }
+
+  // Registers are transferred in ascending order from the lowest address.
+  int32_t Size = 4 * countPopulation(List);
+  int32_t First = Up ? (PreIndex ? 4 : 0) : (PreIndex ? -Size : 4 - Size);
+  Value *Base = getReg(Rn);
+  Value *Addr = Builder.CreateAdd(Base, getInt(First));
+  vector<pair<unsigned, Value *>> Loaded;
+  for (unsigned R = 0, I = 0; R != 16; ++R) {
+    if (!bit(List, R))
+      continue;
+    Value *RegAddr = Builder.CreateAdd(Addr, getInt(4 * I++));
+    if (Load)
+      Loaded.emplace_back(R, load(RegAddr, 32));
+    else
+      store(RegAddr, getReg(R), 32);
+  }
+  if (Writeback)
+    setReg(Rn, Up ? Builder.CreateAdd(Base, getInt(Size))
+                  : Builder.CreateSub(Base, getInt(Size)));
+  Value *Target = nullptr;
+  for (auto [R, Value] : Loaded)
+    if (R == PC)
+      Target = Value;
+    else
+      setReg(R, Value);
+  if (Target)
+    emitReturn(Target);
+  return true;
+}
+
+Value *ARMLifter::getReg(unsigned R) {
+  // PC reads as the address of the current instruction plus 8.
+  if (R == PC)
+    return getInt(Current + 8);
+  return Builder.CreateLoad(Regs[R]);
+}
+
+void ARMLifter::setReg(unsigned R, Value *Value) {
+  Builder.CreateStore(Value, Regs[R]);
+}
+
+Value *ARMLifter::getFlag(Flag F) { return Builder.CreateLoad(Flags[F]); }
+
+void ARMLifter::setFlag(Flag F, Value *Value) {
+  Builder.CreateStore(Value, Flags[F]);
+}
+
+void ARMLifter::setNZ(Value *Result) {
+  setFlag(N, Builder.CreateICmpSLT(Result, getInt(0)));
+  setFlag(Z, Builder.CreateICmpEQ(Result, getInt(0)));
+}
+
+Value *ARMLifter::getCondition(unsigned Cond) {
+  Value *Result;
+  switch (Cond >> 1) {
+  case 0: // EQ
+    Result = getFlag(Z);
+    break;
+  case 1: // CS
+    Result = getFlag(C);
+    break;
+  case 2: // MI
+    Result = getFlag(N);
+    break;
+  case 3: // VS
+    Result = getFlag(V);
+    break;
+  case 4: // HI
+    Result = Builder.CreateAnd(getFlag(C), Builder.CreateNot(getFlag(Z)));
+    break;
+  case 5: // GE
+    Result = Builder.CreateICmpEQ(getFlag(N), getFlag(V));
+    break;
+  case 6: // GT
+    Result = Builder.CreateAnd(Builder.CreateNot(getFlag(Z)),
+                               Builder.CreateICmpEQ(getFlag(N), getFlag(V)));
+    break;
+  default: // AL
+    return Builder.getTrue();
+  }
+  // Odd conditions are negations of the even ones.
+  return Cond & 1 ? Builder.CreateNot(Result) : Result;
+}
+
+Value *ARMLifter::getOperand2(uint32_t Insn, Value *&Carry) {
+  // Rotated immediate
+  if (bit(Insn, 25)) {
+    unsigned Rotate = bits(Insn, 11, 8) * 2;
+    uint32_t Imm = bits(Insn, 7, 0);
+    if (Rotate)
+      Imm = Imm >> Rotate | Imm << (32 - Rotate);
+    Carry = Rotate ? Builder.getInt1(Imm >> 31) : getFlag(C);
+    return getInt(Imm);
+  }
+
+  Value *Rm = getReg(bits(Insn, 3, 0));
+  unsigned Type = bits(Insn, 6, 5);
+  if (!bit(Insn, 4))
+    return shift(Rm, Type, bits(Insn, 11, 7), Carry);
+
+  // Shift by register. Only the bottom byte of it is used and shifts by 32 or
+  // more are well-defined. Carry is not computed.
+  Carry = nullptr;
+  Value *Amount = Builder.CreateAnd(getReg(bits(Insn, 11, 8)), 0xFF);
+  Value *InRange = Builder.CreateICmpULT(Amount, getInt(32));
+  switch (Type) {
+  case 0: // LSL
+    return Builder.CreateSelect(InRange, Builder.CreateShl(Rm, Amount),
+                                getInt(0));
+  case 1: // LSR
+    return Builder.CreateSelect(InRange, Builder.CreateLShr(Rm, Amount),
+                                getInt(0));
+  case 2: // ASR
+    return Builder.CreateAShr(
+        Rm, Builder.CreateSelect(InRange, Amount, getInt(31)));
+  default: { // ROR
+    Value *Rotate = Builder.CreateAnd(Amount, 31);
+    Value *Rotated = Builder.CreateOr(
+        Builder.CreateLShr(Rm, Rotate),
+        Builder.CreateShl(Rm, Builder.CreateSub(getInt(32), Rotate)));
+    return Builder.CreateSelect(Builder.CreateICmpEQ(Rotate, getInt(0)), Rm,
+                                Rotated);
+  }
+  }
+}
+
+Value *ARMLifter::shift(Value *Value, unsigned Type, unsigned Amount,
+                        llvm::Value *&Carry) {
+  auto Bit = [&](unsigned I) {
+    return Builder.CreateTrunc(Builder.CreateLShr(Value, I),
+                               Builder.getInt1Ty());
+  };
+  switch (Type) {
+  case 0: // LSL
+    if (!Amount) {
+      Carry = getFlag(C);
+      return Value;
+    }
+    Carry = Bit(32 - Amount);
+    return Builder.CreateShl(Value, Amount);
+  case 1: // LSR, amount 0 means 32
+    if (!Amount) {
+      Carry = Bit(31);
+      return getInt(0);
+    }
+    Carry = Bit(Amount - 1);
+    return Builder.CreateLShr(Value, Amount);
+  case 2: // ASR, amount 0 means 32
+    if (!Amount) {
+      Carry = Bit(31);
+      return Builder.CreateAShr(Value, 31);
+    }
+    Carry = Bit(Amount - 1);
+    return Builder.CreateAShr(Value, Amount);
+  default: // ROR, amount 0 means RRX
+    if (!Amount) {
+      Carry = Bit(0);
+      return Builder.CreateOr(
+          Builder.CreateLShr(Value, 1),
+          Builder.CreateShl(Builder.CreateZExt(getFlag(C), Int32Ty), 31));
+    }
+    Carry = Bit(Amount - 1);
+    return Builder.CreateOr(Builder.CreateLShr(Value, Amount),
+                            Builder.CreateShl(Value, 32 - Amount));
+  }
+}
+
+ARMLifter::AddResult ARMLifter::addWithCarry(Value *A, Value *B,
+                                             Value *Carry) {
+  Type *Int64Ty = Builder.getInt64Ty();
+  Value *Sum = Builder.CreateAdd(
+      Builder.CreateAdd(Builder.CreateZExt(A, Int64Ty),
+                        Builder.CreateZExt(B, Int64Ty)),
+      Builder.CreateZExt(Carry, Int64Ty));
+  Value *Result = Builder.CreateTrunc(Sum, Int32Ty);
+  // Signed overflow happens when both operands have a sign different from the
+  // result's.
+  Value *Overflow = Builder.CreateICmpSLT(
+      Builder.CreateAnd(Builder.CreateXor(A, Result),
+                        Builder.CreateXor(B, Result)),
+      getInt(0));
+  return {Result,
+          Builder.CreateTrunc(Builder.CreateLShr(Sum, 32), Builder.getInt1Ty()),
+          Overflow};
+}
+
+Value *ARMLifter::load(Value *Addr, unsigned Bits) {
+  // Guest memory is identity-mapped and x86 allows unaligned accesses.
+  Value *Ptr = Builder.CreateIntToPtr(Addr, Builder.getIntNTy(Bits)
+                                                ->getPointerTo());
+  return Builder.CreateAlignedLoad(Ptr, 1);
+}
+
+void ARMLifter::store(Value *Addr, Value *Value, unsigned Bits) {
+  llvm::Value *Ptr = Builder.CreateIntToPtr(
+      Addr, Builder.getIntNTy(Bits)->getPointerTo());
+  Builder.CreateAlignedStore(Value, Ptr, 1);
+}
+
+void ARMLifter::emitReturn(Value *Target) {
+  setReg(PC, Target);
+  Builder.CreateBr(Exit);
+}
+
+ConstantInt *ARMLifter::getInt(uint32_t Value) {
+  return Builder.getInt32(Value);
+}
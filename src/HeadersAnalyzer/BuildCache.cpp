@@ -0,0 +1,93 @@
+// BuildCache.cpp: Implementation of class `BuildCache`.
+
+#include "ipasim/BuildCache.hpp"
+
+#include "ipasim/Output.hpp"
+
+#include <fstream>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+using namespace ipasim;
+using namespace llvm;
+using namespace std;
+using namespace std::filesystem;
+
+namespace {
+
+string hashString(StringRef Data) {
+  MD5::MD5Result Result = MD5::hash(arrayRefFromStringRef(Data));
+  return Result.digest().str();
+}
+
+// Computed only once, it can be quite big.
+const string &getToolHash() {
+  static const string Hash = [] {
+    auto Buffer = MemoryBuffer::getFile(
+        sys::fs::getMainExecutable(nullptr, nullptr), /* FileSize */ -1,
+        /* RequiresNullTerminator */ false);
+    if (!Buffer) {
+      Log.error("cannot read HeadersAnalyzer's executable");
+      return string();
+    }
+    return hashString((*Buffer)->getBuffer());
+  }();
+  return Hash;
+}
+
+} // namespace
+
+path BuildCache::Dir;
+
+BuildCache::BuildCache() { add(getToolHash()); }
+
+void BuildCache::add(StringRef Data) {
+  // Separate inputs, so that, e.g., `{"ab", "c"}` and `{"a", "bc"}` differ.
+  Hasher.update(Data);
+  Hasher.update(StringRef("", 1));
+}
+bool BuildCache::addFile(const string &Path) {
+  auto Buffer = MemoryBuffer::getFile(Path, /* FileSize */ -1,
+                                      /* RequiresNullTerminator */ false);
+  if (!Buffer)
+    return false;
+  add(Path);
+  add((*Buffer)->getBuffer());
+  return true;
+}
+void BuildCache::addArgs(ArrayRef<const char *> Args, StringRef Output) {
+  for (const char *Arg : Args) {
+    add(Arg);
+    if (Output != Arg && sys::fs::is_regular_file(Arg))
+      addFile(Arg);
+  }
+}
+
+bool BuildCache::isUpToDate(const string &Output) {
+  if (Dir.empty() || !exists(Output))
+    return false;
+  ifstream Stamp(getStampPath(Output));
+  string StoredHash;
+  return Stamp >> StoredHash && StoredHash == getHash();
+}
+void BuildCache::update(const string &Output) {
+  if (Dir.empty())
+    return;
+  ofstream Stamp(getStampPath(Output));
+  if (!(Stamp << getHash()))
+    Log.error() << "cannot write stamp of " << Output << Log.end();
+}
+
+const string &BuildCache::getHash() {
+  if (Hash.empty()) {
+    MD5::MD5Result Result;
+    Hasher.final(Result);
+    Hash = Result.digest().str();
+  }
+  return Hash;
+}
+path BuildCache::getStampPath(const string &Output) {
+  // Outputs are in nested directories, so their paths are hashed, too.
+  return Dir / (hashString(absolute(Output).string()) + ".hash");
+}
@@ -0,0 +1,125 @@
+// BuildReport.cpp: Implementation of classes `BuildReport` and `BuildTimer`.
+
+#include "ipasim/BuildReport.hpp"
+
+#include "ipasim/Output.hpp"
+
+#include <Windows.h>
+#include <atomic>
+#include <iterator>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <mutex>
+#include <psapi.h> // For process memory information
+#include <vector>
+
+using namespace ipasim;
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+constexpr size_t CounterCount = static_cast<size_t>(BuildCounter::Count);
+constexpr const char *CounterNames[] = {"exports", "modules", "processes"};
+static_assert(size(CounterNames) == CounterCount);
+
+struct Entry {
+  string Phase, Job; // `Job` is empty for whole phases
+  BuildReport::Clock::duration Wall;
+  uint64_t CPU; // In 100-nanosecond units
+  uint64_t PeakRSS;
+  uint64_t Counts[CounterCount];
+};
+
+atomic<uint64_t> Totals[CounterCount];
+mutex EntriesMutex; // Guards also `CurrentPhase`
+vector<Entry> Entries;
+string CurrentPhase;
+thread_local BuildTimer *CurrentJob = nullptr;
+
+uint64_t toUInt64(const FILETIME &Time) {
+  return (static_cast<uint64_t>(Time.dwHighDateTime) << 32) |
+         Time.dwLowDateTime;
+}
+
+// Returns user and kernel time of the calling thread or the whole process.
+uint64_t getCPUTime(bool Thread) {
+  FILETIME Creation, Exit, Kernel, User;
+  BOOL Ok = Thread ? GetThreadTimes(GetCurrentThread(), &Creation, &Exit,
+                                    &Kernel, &User)
+                   : GetProcessTimes(GetCurrentProcess(), &Creation, &Exit,
+                                     &Kernel, &User);
+  return Ok ? toUInt64(Kernel) + toUInt64(User) : 0;
+}
+
+uint64_t getPeakRSS() {
+  PROCESS_MEMORY_COUNTERS Counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+    return 0;
+  return Counters.PeakWorkingSetSize;
+}
+
+} // namespace
+
+void BuildReport::count(BuildCounter C, uint64_t N) {
+  size_t I = static_cast<size_t>(C);
+  Totals[I] += N;
+  if (CurrentJob)
+    CurrentJob->Counts[I] += N;
+}
+
+// Times are in milliseconds, peak RSS is in bytes.
+void BuildReport::write(const string &Path) {
+  auto OS = createOutputFile(Path);
+  if (!OS)
+    return;
+
+  llvm::json::Array Array;
+  lock_guard<mutex> Lock(EntriesMutex);
+  for (const Entry &E : Entries) {
+    llvm::json::Object Obj{
+        {"phase", E.Phase},
+        {"wallMs", duration<double, milli>(E.Wall).count()},
+        {"cpuMs", E.CPU / 10000.0},
+        {"peakRss", static_cast<int64_t>(E.PeakRSS)}};
+    if (!E.Job.empty())
+      Obj["job"] = E.Job;
+    for (size_t I = 0; I != CounterCount; ++I)
+      Obj[CounterNames[I]] = static_cast<int64_t>(E.Counts[I]);
+    Array.push_back(move(Obj));
+  }
+  *OS << llvm::formatv("{0:2}", llvm::json::Value(move(Array))) << '\n';
+}
+
+BuildTimer::BuildTimer(string Name, bool Job)
+    : Name(move(Name)), Job(Job), Start(BuildReport::Clock::now()),
+      StartCPU(getCPUTime(Job)), Outer(nullptr) {
+  for (size_t I = 0; I != CounterCount; ++I)
+    Counts[I] = Job ? 0 : Totals[I].load();
+  if (Job) {
+    Outer = CurrentJob;
+    CurrentJob = this;
+  } else {
+    lock_guard<mutex> Lock(EntriesMutex);
+    CurrentPhase = this->Name;
+  }
+}
+
+BuildTimer::~BuildTimer() {
+  Entry E;
+  E.Wall = BuildReport::Clock::now() - Start;
+  E.CPU = getCPUTime(Job) - StartCPU;
+  E.PeakRSS = getPeakRSS();
+  for (size_t I = 0; I != CounterCount; ++I)
+    E.Counts[I] = Job ? Counts[I] : Totals[I] - Counts[I];
+  if (Job)
+    CurrentJob = Outer;
+
+  lock_guard<mutex> Lock(EntriesMutex);
+  if (Job) {
+    E.Phase = CurrentPhase;
+    E.Job = move(Name);
+  } else
+    E.Phase = move(Name);
+  Entries.push_back(move(E));
+}
@@ -2,10 +2,16 @@
 
 #include "ipasim/ClangHelper.hpp"
 
+#include "ipasim/BuildReport.hpp"
 #include "ipasim/HeadersAnalyzer/Config.hpp"
+#include "ipasim/LLDHelper.hpp"
 
 #include <clang/Driver/Compilation.h>
 #include <clang/Driver/Driver.h>
+#include <clang/Driver/Job.h>
+#include <clang/Driver/Tool.h>
+#include <clang/Driver/ToolChain.h>
+#include <vector>
 
 using namespace clang;
 using namespace clang::CodeGen;
@@ -42,8 +48,8 @@ unique_ptr<CodeGenModule> ClangHelper::createCodeGenModule() {
       CI.getCodeGenOpts(), *LLVM.getModule(), CI.getDiagnostics());
 }
 
-void ClangHelper::linkDLL(StringRef Output, StringRef ObjectFile,
-                          StringRef ImportLib, bool Debug) {
+void ClangHelper::addDLLArgs(StringRef Output, StringRef ObjectFile,
+                             StringRef ImportLib, bool Debug) {
   Args.add("-shared");
   Args.add("-o");
   Args.add(Output.data());
@@ -55,7 +61,10 @@ void ClangHelper::linkDLL(StringRef Output, StringRef ObjectFile,
     Args.add("-Wl,-defaultlib:msvcrtd");
   else
     Args.add("-Wl,-defaultlib:msvcrt");
-
+}
+void ClangHelper::linkDLL(StringRef Output, StringRef ObjectFile,
+                          StringRef ImportLib, bool Debug) {
+  addDLLArgs(Output, ObjectFile, ImportLib, Debug);
   executeArgs();
 }
 // TODO: Not currently used (but it's referenced from a comment at
@@ -95,6 +104,27 @@ void ClangHelper::executeArgs() {
     Log.error("cannot build `Compilation`");
     return;
   }
+
+  // Instead of starting the linker, pass its arguments to LLD in-process. They
+  // are the same for `link.exe` and `lld-link`.
+  if constexpr (InProcessLLD) {
+    const JobList &Jobs = C->getJobs();
+    const Command *Job = Jobs.size() == 1 ? &*Jobs.begin() : nullptr;
+    if (Job && Job->getCreator().isLinkJob() &&
+        Job->getCreator().getToolChain().getTriple().isOSBinFormatCOFF()) {
+      const llvm::opt::ArgStringList &JobArgs = Job->getArguments();
+      vector<const char *> LinkArgs{"lld-link"};
+      LinkArgs.insert(LinkArgs.end(), JobArgs.begin(), JobArgs.end());
+      if (!LLDHelper::link(LinkArgs, /* COFF */ true)) {
+        string CmdLine;
+        for (const char *Arg : LinkArgs)
+          CmdLine = CmdLine + " " + Arg;
+        Log.error() << "failed to link:" << CmdLine << Log.end();
+      }
+      return;
+    }
+  }
+  BuildReport::count(BuildCounter::Processes, C->getJobs().size());
   SmallVector<pair<int, const Command *>, 4> FailingCommands;
   if (TheDriver.ExecuteCompilation(*C, FailingCommands) ||
       !FailingCommands.empty()) {
@@ -2,15 +2,23 @@
 
 #include "ipasim/DLLHelper.hpp"
 
+#include "ipasim/BuildReport.hpp"
+#include "ipasim/ExportTable.hpp"
 #include "ipasim/HeadersAnalyzer/Config.hpp"
 #include "ipasim/LLDHelper.hpp"
 #include "ipasim/ObjCHelper.hpp"
+#include "ipasim/WrapperIndex.hpp"
 
-#include <fstream>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/DebugInfo/PDB/PDBSymbolFunc.h>
 #include <llvm/DebugInfo/PDB/PDBSymbolPublicSymbol.h>
 #include <llvm/Object/COFF.h>
 #include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Endian.h>
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <tuple>
 
 using namespace clang::CodeGen;
 using namespace ipasim;
@@ -20,14 +28,16 @@ using namespace llvm::pdb;
 using namespace std;
 using namespace std::filesystem;
 
-void DLLHelper::load(LLDBHelper &LLDB, ClangHelper &Clang, CodeGenModule *CGM) {
-  path PDBPath(DLLPath);
-  PDBPath.replace_extension(".pdb");
+string DLLHelper::getPDBPath() const {
+  return path(DLLPath).replace_extension(".pdb").string();
+}
 
-  LLDB.load(DLLPathStr.c_str(), PDBPath.string().c_str());
-  TypeComparer TC(*CGM, LLVM.getModule(), LLDB.getSymbolFile());
+void DLLHelper::read(DLLInput &Input, bool ReadPDB) const {
+  BuildTimer Timer(DLL.Name + " (read)", /* Job */ true);
+  if (ReadPDB && !DLL.ExportsOnly)
+    Input.PDB.load(getPDBPath());
 
-  // Load DLL.
+  // Load DLL. It's memory-mapped and kept in `Input` for the analysis.
   auto DLLFile(ObjectFile::createObjectFile(DLLPathStr));
   if (!DLLFile) {
     Log.error() << toString(DLLFile.takeError()) << " (" << DLLPathStr << ")"
@@ -39,6 +49,20 @@ void DLLHelper::load(LLDBHelper &LLDB, ClangHelper &Clang, CodeGenModule *CGM) {
     Log.error() << "expected COFF (" << DLLPathStr << ")" << Log.end();
     return;
   }
+  Input.Binary = move(*DLLFile);
+  Input.COFF = COFF;
+
+  // Release PDBs don't contain Objective-C methods, so we find them
+  // manually in the metadata. That's also where selectors, classes and
+  // protocols for `ObjCPreopt` come from.
+  Input.ObjC = ObjCMethodScout::discoverMethods(COFF);
+}
+
+template <typename FTy>
+void DLLHelper::analyze(const DLLInput &Input, FTy &&AnalyzeFunctions) {
+  COFFObjectFile *COFF = Input.COFF;
+  if (!COFF)
+    return;
 
   // Discover exports.
   for (auto &Export : COFF->export_directories()) {
@@ -51,74 +75,280 @@ void DLLHelper::load(LLDBHelper &LLDB, ClangHelper &Clang, CodeGenModule *CGM) {
     // Note that there can be aliases, so the current `ExportRVA` can
     // already be present in `Exports`, but that's OK.
     Exports.insert(ExportRVA);
+    BuildReport::count(BuildCounter::Exports);
+
+    // Remember also names for `ExportTable`.
+    StringRef Name;
+    bool Forwarder;
+    if (Export.getSymbolName(Name) || Name.empty() ||
+        Export.isForwarder(Forwarder))
+      continue;
+    DLL.NamedExports.emplace_back(Name.str(),
+                                  Forwarder ? ExportTable::Forwarded
+                                            : ExportRVA);
   }
+  DLL.TimeDateStamp = COFF->getTimeDateStamp();
 
   // Analyze functions.
-  auto Analyzer = [this](auto &&Func, bool IgnoreDuplicates = false) mutable {
-    string Name(Func.getName());
-    uint32_t RVA = Func.getRelativeVirtualAddress();
+  AnalyzeFunctions();
 
-    // If undecorated name has underscore at the beginning, use that
-    // instead.
-    string UN(Func.getUndecoratedName());
-    if (!UN.empty() && Name != UN && UN[0] == '_' &&
-        !UN.compare(1, Name.length(), Name))
-      Name = move(UN);
+  // Objective-C metadata have already been scouted in `read`.
+  Input.ObjC.addTo(HAC.Preopt, HAC.Preopt.addDLL(DLL.Name));
+  for (const auto &[Name, SuperName] : Input.ObjC.SuperClasses)
+    HAC.SuperClasses.try_emplace(Name, SuperName);
+  for (const ObjCMethod &Method : Input.ObjC.Methods) {
+    DLL.MethodTypes.try_emplace(Method.RVA, Method.Type);
+
+    // Methods not declared in headers can still override declared ones.
+    if constexpr (InheritedWrappers)
+      HAC.addInheritedMethod(Method.Name);
 
     ExportPtr Exp;
-    if (!analyzeWindowsFunction(Name, RVA, IgnoreDuplicates, Exp))
-      return;
+    if (!analyzeWindowsFunction(Method.Name, Method.RVA,
+                                /* IgnoreDuplicates */ true, Exp))
+      continue;
+    if constexpr (InlineAccessors)
+      detectAccessor(Input, Exp);
 
-    // Verify that the function has the same signature as the iOS one.
-    if constexpr (CompareTypes) {
-      // TODO: #28 is not considered here.
-      if (!TC.areEquivalent(Exp->getDylibType(), Func))
-        Log.error() << "functions' signatures are not equivalent (" << Exp->Name
-                    << ")" << Log.end();
-    } else if constexpr (is_same_v<decltype(Func), PDBSymbolFunc &>) {
-      if (!Func.getSignature()) {
-        Log.error() << "function doesn't have a signature (" << Exp->Name << ")"
-                    << Log.end();
+    // TODO: Compare signatures.
+  }
+}
+
+void DLLHelper::checkParamCount(ExportPtr Exp, optional<uint32_t> DLLCount) {
+  if (!DLLCount) {
+    Log.error() << "function doesn't have a signature (" << Exp->Name << ")"
+                << Log.end();
+    return;
+  }
+
+  // Check at least number of arguments.
+  size_t DylibCount = Exp->getDylibType()->getNumParams();
+
+  // TODO: Also check that DLL function's return type is NOT void.
+  if (DylibCount == *DLLCount + 1 &&
+      Exp->getDylibType()->getReturnType()->isVoidTy())
+    // See #28.
+    Exp->DylibStretOnly = true;
+  else if (DylibCount != *DLLCount)
+    Log.error() << "function '" << Exp->Name
+                << "' has different number of arguments in iOS "
+                   "headers and in DLL ("
+                << to_string(DylibCount) << " v. " << to_string(*DLLCount)
+                << ")" << Log.end();
+}
+
+namespace {
+
+// What `matchAccessor` found.
+struct AccessorCode {
+  bool Setter;
+  uint32_t IvarOffset;
+};
+
+// Recognizes x86 code of accessors synthesized for `assign` properties (or
+// hand-written equivalents), i.e., `self` (argument 0) and, for setters, the
+// value (argument 2) are loaded from the stack, then the ivar is loaded into
+// `eax` or stored and the function returns. An optional `ebp` frame is allowed.
+optional<AccessorCode> matchAccessor(ArrayRef<uint8_t> Code) {
+  constexpr uint8_t EAX = 0, ESP = 4, EBP = 5;
+  constexpr uint8_t NoArg = 0xFF, IvarValue = 0xFE;
+  uint8_t StackReg = ESP, FirstArg = 4;
+  // Argument index (or `IvarValue`) loaded in each register.
+  uint8_t Regs[8];
+  fill(begin(Regs), end(Regs), NoArg);
+  optional<AccessorCode> Result;
+
+  size_t I = 0;
+  if (Code.size() >= 3 && Code[0] == 0x55 &&
+      ((Code[1] == 0x8B && Code[2] == 0xEC) ||
+       (Code[1] == 0x89 && Code[2] == 0xE5))) {
+    // `push ebp; mov ebp, esp`
+    StackReg = EBP;
+    FirstArg = 8;
+    I = 3;
+  }
+  while (I < Code.size()) {
+    uint8_t Op = Code[I];
+    if (Op == 0xC3) {
+      // `ret`
+      if (!Result || (!Result->Setter && Regs[EAX] != IvarValue))
+        return nullopt;
+      return Result;
+    }
+    if (Op == 0x5D && StackReg == EBP) {
+      // `pop ebp`
+      ++I;
+      continue;
+    }
+    // `mov reg, [base + disp]` or `mov [base + disp], reg`
+    if ((Op != 0x8B && Op != 0x89) || I + 2 >= Code.size())
+      return nullopt;
+    uint8_t ModRM = Code[I + 1], Mod = ModRM >> 6, Reg = (ModRM >> 3) & 7,
+            Base = ModRM & 7;
+    I += 2;
+    if (Mod != 1 && Mod != 2)
+      return nullopt;
+    if (Base == ESP) {
+      // SIB byte `[esp]`
+      if (Code[I] != 0x24)
+        return nullopt;
+      ++I;
+    }
+    size_t DispSize = Mod == 1 ? 1 : 4;
+    if (I + DispSize >= Code.size())
+      return nullopt;
+    int32_t Disp =
+        Mod == 1 ? static_cast<int8_t>(Code[I])
+                 : static_cast<int32_t>(support::endian::read32le(&Code[I]));
+    I += DispSize;
+
+    if (Base == StackReg) {
+      // Loading an argument.
+      if (Op != 0x8B || Disp < FirstArg || (Disp - FirstArg) % 4 ||
+          (Disp - FirstArg) / 4 > 2)
+        return nullopt;
+      Regs[Reg] = static_cast<uint8_t>((Disp - FirstArg) / 4);
+      continue;
+    }
+
+    // Accessing the ivar (only once).
+    if (Regs[Base] != 0 || Disp < 0 || Result)
+      return nullopt;
+    if (Op == 0x8B) {
+      Result = {/* Setter */ false, static_cast<uint32_t>(Disp)};
+      Regs[Reg] = IvarValue;
+    } else {
+      if (Regs[Reg] != 2)
+        return nullopt;
+      Result = {/* Setter */ true, static_cast<uint32_t>(Disp)};
+    }
+  }
+  return nullopt;
+}
+
+} // namespace
+
+void DLLHelper::detectAccessor(const DLLInput &Input, ExportPtr Exp) {
+  // Only word-sized values are supported. Deferred calls must stay ordered.
+  llvm::FunctionType *Type = Exp->getDylibType();
+  auto IsWord = [&](llvm::Type *T) {
+    return T->isPointerTy() || T->isIntegerTy(32);
+  };
+  if (Exp->DylibStretOnly || Exp->Deferred || !Type->getNumParams() ||
+      !Type->getParamType(0)->isPointerTy())
+    return;
+  bool Getter = Type->getNumParams() == 2 && IsWord(Type->getReturnType());
+  bool Setter = Type->getNumParams() == 3 &&
+                Type->getReturnType()->isVoidTy() &&
+                IsWord(Type->getParamType(2));
+  if (!Getter && !Setter)
+    return;
+
+  // Accessors are short, so we need just few bytes of their code.
+  uintptr_t CodePtr;
+  if (Input.COFF->getRvaPtr(Exp->RVA, CodePtr))
+    return;
+  StringRef Data(Input.COFF->getData());
+  uintptr_t End = reinterpret_cast<uintptr_t>(Data.end());
+  if (CodePtr >= End)
+    return;
+  constexpr size_t MaxAccessorSize = 32;
+  ArrayRef<uint8_t> Code(reinterpret_cast<const uint8_t *>(CodePtr),
+                         min<size_t>(MaxAccessorSize, End - CodePtr));
+
+  optional<AccessorCode> Accessor(matchAccessor(Code));
+  if (!Accessor || Accessor->Setter != Setter)
+    return;
+  Exp->Getter = Getter;
+  Exp->Setter = Setter;
+  Exp->IvarOffset = Accessor->IvarOffset;
+}
+
+void DLLHelper::load(LLDBHelper &LLDB, ClangHelper &Clang, CodeGenModule *CGM) {
+  BuildTimer Timer(DLL.Name, /* Job */ true);
+  if (DLL.ExportsOnly) {
+    DLLInput Input;
+    read(Input, /* ReadPDB */ false);
+    analyze(Input, [&]() { analyzeExportTable(); });
+    return;
+  }
+  LLDB.load(DLLPathStr.c_str(), getPDBPath().c_str());
+  TypeComparer TC(*CGM, LLVM.getModule(), LLDB.getSymbolFile());
+
+  DLLInput Input;
+  read(Input, /* ReadPDB */ false);
+  analyze(Input, [&]() {
+    auto Analyzer = [&](auto &&Func, bool IgnoreDuplicates = false) {
+      string Name(Func.getName());
+      uint32_t RVA = Func.getRelativeVirtualAddress();
+
+      // If undecorated name has underscore at the beginning, use that
+      // instead.
+      string UN(Func.getUndecoratedName());
+      if (!UN.empty() && Name != UN && UN[0] == '_' &&
+          !UN.compare(1, Name.length(), Name))
+        Name = move(UN);
+
+      ExportPtr Exp;
+      if (!analyzeWindowsFunction(Name, RVA,
+                                  IgnoreDuplicates || DLL.Overridden, Exp))
         return;
+
+      // Verify that the function has the same signature as the iOS one.
+      if constexpr (CompareTypes) {
+        // TODO: #28 is not considered here.
+        if (!TC.areEquivalent(Exp->getDylibType(), Func))
+          Log.error() << "functions' signatures are not equivalent ("
+                      << Exp->Name << ")" << Log.end();
+      } else if constexpr (is_same_v<decltype(Func), PDBSymbolFunc &>) {
+        optional<uint32_t> Count;
+        if (auto Signature = Func.getSignature())
+          Count = Signature->getCount();
+        checkParamCount(Exp, Count);
       }
+    };
+    for (auto &Func : LLDB.enumerate<PDBSymbolFunc>())
+      Analyzer(Func);
+    for (auto &Func : LLDB.enumerate<PDBSymbolPublicSymbol>())
+      Analyzer(Func, /* IgnoreDuplicates */ true);
+  });
+}
 
-      // Check at least number of arguments.
-      size_t DylibCount = Exp->getDylibType()->getNumParams();
-      size_t DLLCount = Func.getSignature()->getCount();
-
-      // TODO: Also check that `Func`'s return type is NOT void.
-      if (DylibCount == DLLCount + 1 &&
-          Exp->getDylibType()->getReturnType()->isVoidTy())
-        // See #28.
-        Exp->DylibStretOnly = true;
-      else if (DylibCount != DLLCount)
-        Log.error() << "function '" << Exp->Name
-                    << "' has different number of arguments in iOS "
-                       "headers and in DLL ("
-                    << to_string(DylibCount) << " v. " << to_string(DLLCount)
-                    << ")" << Log.end();
+void DLLHelper::load(const DLLInput &Input) {
+  BuildTimer Timer(DLL.Name, /* Job */ true);
+  const PDBHelper &PDB = Input.PDB;
+  analyze(Input, [&]() {
+    if (DLL.ExportsOnly) {
+      analyzeExportTable();
+      return;
     }
-  };
-  for (auto &Func : LLDB.enumerate<PDBSymbolFunc>())
-    Analyzer(Func);
-  for (auto &Func : LLDB.enumerate<PDBSymbolPublicSymbol>())
-    Analyzer(Func, /* IgnoreDuplicates */ true);
+    for (const PDBFunction &Func : PDB.Functions) {
+      ExportPtr Exp;
+      if (analyzeWindowsFunction(Func.Name, Func.RVA, DLL.Overridden, Exp))
+        checkParamCount(Exp, Func.ParamCount);
+    }
+    for (const PDBFunction &Func : PDB.Publics) {
+      ExportPtr Exp;
+      analyzeWindowsFunction(Func.Name, Func.RVA, /* IgnoreDuplicates */ true,
+                             Exp);
+    }
+  });
+}
 
-  // Release PDBs don't contain Objective-C methods, so we find them
-  // manually in the metadata.
-  set<ObjCMethod> ObjCMethods(
-      ObjCMethodScout::discoverMethods(DLLPathStr, COFF));
-  for (const ObjCMethod &Method : ObjCMethods) {
-    ExportPtr Exp;
-    if (!analyzeWindowsFunction(Method.Name, Method.RVA,
-                                /* IgnoreDuplicates */ true, Exp))
+void DLLHelper::analyzeExportTable() {
+  // Undecorated names of `__stdcall` and `__cdecl` exports lack the leading
+  // underscore of iOS symbols.
+  for (const auto &[Name, RVA] : DLL.NamedExports) {
+    if (RVA == ExportTable::Forwarded)
       continue;
-
-    // TODO: Compare signatures.
+    ExportPtr Exp;
+    analyzeWindowsFunction("_" + Name, RVA, /* IgnoreDuplicates */ true, Exp);
   }
 }
 
-void DLLHelper::generate(const DirContext &DC, bool Debug) {
+void DLLHelper::generate(const DirContext &DC, TaskGraph &Tasks) {
+  BuildTimer Timer(DLL.Name, /* Job */ true);
+  BuildReport::count(BuildCounter::Exports, DLL.Exports.size());
   IRHelper IR(LLVM, DLL.Name, DLLPath.string(), IRHelper::Windows32);
   IRHelper DylibIR(LLVM, DLL.Name, DLLPath.string(), IRHelper::Apple);
 
@@ -138,18 +368,33 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
     RefSymbol->setDLLStorageClass(GlobalValue::DLLImportStorageClass);
 
   // Generate function wrappers.
+  uint32_t HypercallBase = HAC.HypercallCount;
+  vector<Constant *> Hypercalls;
+  // Bodies shared by wrappers. See `SharedWrappers`.
+  map<tuple<FunctionType *, bool, bool>, Function *> Shapes;
   for (ExportPtr Exp : DLL.Exports) {
     assert(Exp->Status == ExportStatus::FoundInDLL &&
            "Unexpected status of `ExportEntry`.");
 
     // Don't generate wrappers for Objective-C messengers. We handle those
-    // specially. Also don't generate wrappers for data.
-    if (!Exp->getDLLType() || Exp->Messenger)
+    // specially. Also don't generate wrappers for data. Variadic functions with
+    // `VaList` call its wrapper instead.
+    if (!Exp->getDLLType() || Exp->Messenger || Exp->VaList)
       continue;
 
     // Declarations.
     Function *Func =
         Exp->ObjCMethod ? nullptr : IR.declareFunc<LibType::DLL>(*Exp);
+    if (Func && DLL.StdCall) {
+      // Import libraries decorate `__stdcall` functions with the number of
+      // bytes of their arguments.
+      uint64_t Bytes = 0;
+      for (Type *ParamTy : Func->getFunctionType()->params())
+        Bytes += alignTo(IR.getSize(ParamTy), sizeof(uint32_t));
+      Func = IR.declareFunc(Exp->getDLLType(),
+                            Exp->Name + "@" + to_string(Bytes));
+      Func->setCallingConv(CallingConv::X86_StdCall);
+    }
     Function *Wrapper = IR.declareFunc<LibType::DLL>(*Exp, /* Wrapper */ true);
     Function *Stub =
         DylibIR.declareFunc<LibType::Dylib>(*Exp, /* Wrapper */ true);
@@ -159,14 +404,33 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
     if (Func)
       Func->setDLLStorageClass(Function::DLLImportStorageClass);
 
+    // Wrappers with `RegisterABI` are jumped to directly, so they cannot be
+    // hypercalls.
+    Exp->RegisterABI =
+        RegisterWrappers && !Exp->isTrivial() && Exp->fitsRegisters();
+    // Deferred calls cannot return anything. See `DeferredWrappers`.
+    Exp->Deferred = DeferredWrappers && Exp->Deferred && Exp->RegisterABI &&
+                    Exp->getDylibType()->getReturnType()->isVoidTy() &&
+                    !Exp->DylibStretOnly;
+
+    // Assign the wrapper its hypercall ID. See `HypercallWrappers`.
+    if (HypercallWrappers && !Exp->RegisterABI) {
+      if (HAC.HypercallCount < HAContext::MaxHypercalls) {
+        Exp->HypercallID = HAC.HypercallCount++;
+        Hypercalls.push_back(ConstantExpr::getBitCast(Wrapper, IR.VoidPtrTy));
+      } else
+        Log.error() << "too many hypercalls (" << Exp->Name << ")"
+                    << Log.end();
+    }
+
     // Generate the Dylib stub.
     DylibIR.defineFunc(Stub);
     DylibIR.Builder.CreateRetVoid();
 
     FunctionGuard WrapperGuard(IR, Wrapper);
 
-    // TODO: Handle variadic functions specially. For now, we simply don't
-    // call them.
+    // TODO: Handle other variadic functions than those with `VaList`, too. For
+    // now, we simply don't call them.
     if (Exp->getDLLType()->isVarArg()) {
       Exp->UnhandledVararg = true;
       Log.error() << "unhandled variadic function (" << Exp->Name << ")"
@@ -175,10 +439,126 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
       continue;
     }
 
+    // Describe the wrapper for the runtime. See `WrapperInfo`.
+    uint32_t Info = WrapperInfo::Magic;
+    if (Exp->Leaf)
+      Info |= WrapperInfo::Leaf;
+    if (Exp->RegisterABI)
+      Info |= WrapperInfo::Registers;
+    Wrapper->setPrefixData(ConstantInt::get(Type::getInt32Ty(IR.Ctx), Info));
+
+    // Compute address of the original function.
+    Value *FP;
+    if (Exp->ObjCMethod) {
+      // Objective-C methods are not exported, so we call them by
+      // computing their address using their RVA.
+      if (!DLL.ReferenceSymbol) {
+        Log.error() << "no reference function, cannot emit Objective-C "
+                       "method DLL wrappers ("
+                    << DLL.Name << ")" << Log.end();
+        continue;
+      }
+
+      // Add RVA to the reference symbol's address.
+      Value *Addr = ConstantInt::getSigned(Type::getInt32Ty(IR.Ctx),
+                                           Exp->RVA - DLL.ReferenceSymbol->RVA);
+      Value *RefPtr = IR.Builder.CreateBitCast(RefSymbol, IR.VoidPtrTy);
+      Value *ComputedPtr =
+          IR.Builder.CreateInBoundsGEP(Type::getInt8Ty(IR.Ctx), RefPtr, Addr);
+      FP = IR.Builder.CreateBitCast(
+          ComputedPtr, IR.map(Exp->getDLLType())->getPointerTo(), "fp");
+    } else
+      FP = Func;
+
+    // Wrappers of the same shape differ only by the function they call, so
+    // they pass its address to one shared body. See `SharedWrappers`. All
+    // functions of one DLL have the same calling convention.
+    Function *Body = Wrapper;
+    optional<FunctionGuard> ShapeGuard;
+    if (SharedWrappers && !Exp->isTrivial()) {
+      Function *&Shape = Shapes[{Exp->getDLLType(), Exp->DylibStretOnly,
+                                 Exp->RegisterABI}];
+      bool Defined = Shape;
+      if (!Defined)
+        Shape = IR.declareShapeFunc(Wrapper->getFunctionType(), FP->getType());
+      IR.createShapeCall(Wrapper, Shape, FP);
+      if (Defined)
+        continue;
+
+      ShapeGuard.emplace(IR, Shape);
+      Body = Shape;
+      FP = &*prev(Shape->arg_end());
+    }
+
     StructType *Struct;
     Value *SP;
     vector<Value *> Args;
-    if (Exp->isTrivial()) {
+    Value *RegsP = nullptr;
+    if (Exp->RegisterABI) {
+      // Arguments are words of `RegisterBlock` (first four of them) and of
+      // the emulated stack (the rest). iOS armv7 is soft-float and doesn't
+      // align 64-bit values to even registers, so every argument simply takes
+      // the next `size / 4` words.
+      Type *Int32Ty = Type::getInt32Ty(IR.Ctx);
+      const DataLayout &AppleDL = IR.getDataLayout(IRHelper::Apple);
+      RegsP = IR.Builder.CreateBitCast(Body->args().begin(),
+                                       Int32Ty->getPointerTo(), "regsp");
+      Value *StackP = nullptr;
+      auto GetWordPtr = [&](uint32_t WordIdx, const Twine &Name) {
+        if (WordIdx < RegisterBlock::ArgRegs)
+          return IR.Builder.CreateConstInBoundsGEP1_32(Int32Ty, RegsP,
+                                                       WordIdx, Name);
+        if (!StackP) {
+          Value *SPP = IR.Builder.CreateConstInBoundsGEP1_32(
+              Int32Ty, RegsP, RegisterBlock::ArgRegs, "spp");
+          StackP = IR.Builder.CreateIntToPtr(IR.Builder.CreateLoad(SPP, "sp"),
+                                             Int32Ty->getPointerTo(), "stackp");
+        }
+        return IR.Builder.CreateConstInBoundsGEP1_32(
+            Int32Ty, StackP, WordIdx - RegisterBlock::ArgRegs, Name);
+      };
+
+      // The guest passes stret pointer in R0. See #28.
+      uint32_t WordIdx = Exp->DylibStretOnly ? 1 : 0;
+      Args.reserve(Exp->getDLLType()->getNumParams());
+      for (auto [ArgIdx, ArgTy] :
+           withIndices(IR.map(Exp->getDLLType())->params())) {
+        string ArgNo = to_string(ArgIdx);
+        uint32_t Words = (AppleDL.getTypeAllocSize(ArgTy) + 3) / 4;
+        Value *WP = GetWordPtr(WordIdx, Twine("wp") + ArgNo);
+
+        if (Words == 1) {
+          Value *W = IR.Builder.CreateLoad(WP, Twine("w") + ArgNo);
+          Value *A;
+          if (ArgTy->isPointerTy())
+            A = IR.Builder.CreateIntToPtr(W, ArgTy, Twine("a") + ArgNo);
+          else if (ArgTy->isFloatTy())
+            A = IR.Builder.CreateBitCast(W, ArgTy, Twine("a") + ArgNo);
+          else
+            A = IR.Builder.CreateTrunc(W, ArgTy, Twine("a") + ArgNo);
+          Args.push_back(A);
+        } else {
+          // Values split between R3 and the stack are gathered first.
+          if (WordIdx < RegisterBlock::ArgRegs &&
+              WordIdx + Words > RegisterBlock::ArgRegs) {
+            Value *Tmp = IR.Builder.CreateAlloca(
+                ArrayType::get(Int32Ty, Words), nullptr, Twine("tmp") + ArgNo);
+            WP = IR.Builder.CreateBitCast(Tmp, Int32Ty->getPointerTo());
+            for (uint32_t I = 0; I != Words; ++I)
+              IR.Builder.CreateStore(
+                  IR.Builder.CreateLoad(GetWordPtr(WordIdx + I, "")),
+                  IR.Builder.CreateConstInBoundsGEP1_32(Int32Ty, WP, I));
+          }
+          Value *AP = IR.Builder.CreateBitCast(WP, ArgTy->getPointerTo(),
+                                               Twine("ap") + ArgNo);
+          Args.push_back(IR.Builder.CreateAlignedLoad(
+              AP, sizeof(uint32_t), Twine("a") + ArgNo));
+        }
+        WordIdx += Words;
+      }
+      Struct = nullptr;
+      SP = nullptr;
+    } else if (Exp->isTrivial()) {
       // Trivial functions (`void -> void`) have no arguments, so no
       // struct pointer nor type exist - we set them to `nullptr` to check
       // that we don't use them anywhere in the following code.
@@ -187,12 +567,13 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
     } else {
       // The struct pointer is the first argument.
       Struct = IR.createParamStruct(*Exp);
-      SP = IR.Builder.CreateBitCast(Wrapper->args().begin(),
+      SP = IR.Builder.CreateBitCast(Body->args().begin(),
                                     Struct->getPointerTo(), "sp");
 
       // Process arguments.
       Args.reserve(Exp->getDLLType()->getNumParams());
-      for (auto [ArgIdx, ArgTy] : withIndices(Exp->getDLLType()->params())) {
+      for (auto [ArgIdx, ArgTy] :
+           withIndices(IR.map(Exp->getDLLType())->params())) {
         if (Exp->DylibStretOnly)
           ++ArgIdx;
 
@@ -201,7 +582,8 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
         // Load argument from the structure.
         Value *APP = IR.Builder.CreateStructGEP(Struct, SP, ArgIdx,
                                                 Twine("app") + ArgNo);
-        Value *AP = IR.Builder.CreateLoad(APP, Twine("ap") + ArgNo);
+        Value *AP = IR.Builder.CreateAlignedLoad(
+            APP, IR.getAlign(ArgTy->getPointerTo()), Twine("ap") + ArgNo);
         Value *A = IR.Builder.CreateLoad(AP, Twine("a") + ArgNo);
 
         // Save the argument.
@@ -209,53 +591,49 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
       }
     }
 
-    Value *R;
-    if (Exp->ObjCMethod) {
-      // Objective-C methods are not exported, so we call them by
-      // computing their address using their RVA.
-      if (!DLL.ReferenceSymbol) {
-        Log.error() << "no reference function, cannot emit Objective-C "
-                       "method DLL wrappers ("
-                    << DLL.Name << ")" << Log.end();
-        continue;
+    // Call the original DLL function.
+    Value *R = IR.createCall(
+        Exp->getDLLType(), FP, Args, "r",
+        DLL.StdCall ? CallingConv::X86_StdCall : CallingConv::C);
+
+    // The returned structure is stored right into the guest's memory, aligned
+    // as iOS requires. See #28.
+    unsigned StretAlign =
+        R && Exp->DylibStretOnly ? IR.getDataLayout(IRHelper::Apple)
+                                       .getABITypeAlignment(R->getType())
+                                 : 0;
+    if (R && Exp->RegisterABI) {
+      if (Exp->DylibStretOnly) {
+        Value *SR = IR.Builder.CreateIntToPtr(
+            IR.Builder.CreateLoad(RegsP, "srw"),
+            R->getType()->getPointerTo(), "sr");
+        IR.Builder.CreateAlignedStore(R, SR, StretAlign);
+      } else {
+        // Return the value in R0 (and R1 if it's 64-bit).
+        if (R->getType()->isPointerTy())
+          R = IR.Builder.CreatePtrToInt(R, Type::getInt32Ty(IR.Ctx));
+        Value *RP = IR.Builder.CreateBitCast(
+            RegsP, R->getType()->getPointerTo(), "rp");
+        IR.Builder.CreateAlignedStore(R, RP, sizeof(uint32_t));
       }
-
-      // Add RVA to the reference symbol's address.
-      Value *Addr = ConstantInt::getSigned(Type::getInt32Ty(LLVM.Ctx),
-                                           Exp->RVA - DLL.ReferenceSymbol->RVA);
-      Value *RefPtr = IR.Builder.CreateBitCast(RefSymbol, LLVM.VoidPtrTy);
-      Value *ComputedPtr =
-          IR.Builder.CreateInBoundsGEP(Type::getInt8Ty(LLVM.Ctx), RefPtr, Addr);
-      Value *FP = IR.Builder.CreateBitCast(
-          ComputedPtr, Exp->getDLLType()->getPointerTo(), "fp");
-
-      // Call the original DLL function.
-      R = IR.createCall(Exp->getDLLType(), FP, Args, "r");
-    } else
-      R = IR.createCall(Func, Args, "r");
-
-    if (R) {
+    } else if (R) {
       // See #28.
       if (Exp->DylibStretOnly) {
-        // Store the return value.
-        Value *RS = IR.Builder.CreateAlloca(R->getType());
-        IR.Builder.CreateStore(R, RS);
-
         // Load stret argument from the structure.
         Value *SRPP = IR.Builder.CreateStructGEP(Struct, SP, 0, "srpp");
-        Value *SRP = IR.Builder.CreateLoad(SRPP, "srp");
+        Value *SRP = IR.Builder.CreateAlignedLoad(
+            SRPP, IR.getAlign(Struct->getElementType(0)), "srp");
         Value *SR = IR.Builder.CreateLoad(SRP, "sr");
 
-        // Copy structure's content.
-        // TODO: Don't hardcode the alignments here.
-        IR.Builder.CreateMemCpy(SR, 4, RS, 4, IR.getSize(R->getType()));
+        // Store the returned structure.
+        IR.Builder.CreateAlignedStore(R, SR, StretAlign);
       } else { // !Exp->DylibStretOnly
         // Get pointer to the return value inside the union.
         Value *RP = IR.Builder.CreateStructGEP(
-            Struct, SP, Exp->getDLLType()->getNumParams(), "rp");
+            Struct, SP, Struct->getNumElements() - 1, "rp");
 
         // Save return value back into the structure.
-        IR.Builder.CreateStore(R, RP);
+        IR.Builder.CreateAlignedStore(R, RP, IR.getAlign(R->getType()));
       }
     }
 
@@ -263,83 +641,165 @@ void DLLHelper::generate(const DirContext &DC, bool Debug) {
     IR.Builder.CreateRetVoid();
   }
 
-  // Generate `WrapperIndex`.
-  string IndexFile(
-      (DC.OutputDir / DLL.Name).replace_extension(".cpp").string());
-  {
-    ofstream OS;
-    OS.open(IndexFile, ios_base::out | ios_base::trunc);
-    if (!OS) {
-      Log.error() << "cannot create index file for " << DLL.Name << Log.end();
-      return;
-    }
+  // Export table of hypercalls, so that `DynamicLoader` can register them.
+  if constexpr (HypercallWrappers) {
+    ArrayType *TableTy = ArrayType::get(IR.VoidPtrTy, Hypercalls.size());
+    IR.defineExport("$__ipaSim_hypercalls",
+                    ConstantArray::get(TableTy, Hypercalls));
+    Type *Int32Ty = Type::getInt32Ty(IR.Ctx);
+    IR.defineExport(
+        "$__ipaSim_hypercalls_range",
+        ConstantArray::get(ArrayType::get(Int32Ty, 2),
+                           {ConstantInt::get(Int32Ty, HypercallBase),
+                            ConstantInt::get(Int32Ty, Hypercalls.size())}));
+  }
 
-    ifstream IS;
-    IS.open("./src/HeadersAnalyzer/WrapperIndex.cpp");
-    if (!IS) {
-      Log.error("cannot open WrapperIndex.cpp");
-      return;
-    }
+  // Emit `.obj` file.
+  string ObjectFile(
+      (DC.OutputDir / DLL.Name).replace_extension(".obj").string());
+  DLL.ObjectTask = IR.emitObj(ObjectFile, Tasks);
+
+  // Emit `.o` file.
+  string DylibObjectFile(
+      (DC.OutputDir / DLL.Name).replace_extension(".o").string());
+  TaskGraph::Task *DylibObject = DylibIR.emitObj(DylibObjectFile, Tasks);
+
+  // Create the stub Dylib.
+  auto LLD = std::make_shared<LLDHelper>(DC.BuildDir, LLVM);
+  LLD->addDylibArgs((DC.OutputDir / ("lib" + DLL.Name))
+                        .replace_extension(".dll.dylib")
+                        .string(),
+                    DylibObjectFile,
+                    path("/" + DLL.Name)
+                        .replace_extension(".wrapper.dll")
+                        .string());
+  DLL.StubTask = Tasks.add([LLD] { LLD->executeArgs(); }, {DylibObject});
+}
 
-    OS << IS.rdbuf();
+void DLLHelper::link(const DirContext &DC, bool Debug, TaskGraph &Tasks) {
+  BuildTimer Timer(DLL.Name, /* Job */ true);
+  IRHelper IR(LLVM, DLL.Name, DLLPath.string(), IRHelper::Windows32);
+
+  Type *Int32Ty = Type::getInt32Ty(IR.Ctx);
+  auto DefineArray = [&](Type *ElementTy, ArrayRef<Constant *> Elements) {
+    ArrayType *ArrayTy = ArrayType::get(ElementTy, Elements.size());
+    return ConstantExpr::getBitCast(
+        IR.definePrivate(ConstantArray::get(ArrayTy, Elements)),
+        ElementTy->getPointerTo());
+  };
+  auto DefineString = [&](StringRef Str) {
+    return ConstantExpr::getBitCast(
+        IR.definePrivate(ConstantDataArray::getString(IR.Ctx, Str)),
+        IR.VoidPtrTy);
+  };
 
+  // Generate `WrapperIndex`.
+  {
     // Add libraries.
-    std::map<DylibPtr, size_t> Dylibs;
-    size_t Counter = 0;
+    std::map<DylibPtr, uint32_t> Dylibs;
+    vector<Constant *> DylibNames;
     for (const ExportEntry &Exp : deref(DLL.Exports))
-      if (Exp.Dylib && Dylibs.find(Exp.Dylib) == Dylibs.end()) {
-        Dylibs[Exp.Dylib] = Counter++;
-        OS << "ADD_LIBRARY(\"" << Exp.Dylib->Name << "\");\n";
-      }
+      if (Exp.Dylib && Dylibs.try_emplace(Exp.Dylib, DylibNames.size()).second)
+        DylibNames.push_back(DefineString(Exp.Dylib->Name));
 
-    // Fill the index.
+    // Fill the index, sorted by RVA, so that it can be binary-searched.
+    std::map<uint32_t, const ExportEntry *> Map;
     for (const ExportEntry &Exp : deref(DLL.Exports))
       if (Exp.Dylib)
-        OS << "MAP(0x" << std::hex << Exp.RVA << ", " << Dylibs[Exp.Dylib]
-           << ");\n";
+        Map[Exp.RVA] = &Exp;
+    vector<Constant *> RVAs, DylibIdxs, Offsets;
+    RVAs.reserve(Map.size());
+    DylibIdxs.reserve(Map.size());
+    Offsets.reserve(Map.size());
+    for (auto [RVA, Exp] : Map) {
+      RVAs.push_back(ConstantInt::get(Int32Ty, RVA));
+      DylibIdxs.push_back(ConstantInt::get(Int32Ty, Dylibs[Exp->Dylib]));
+      Offsets.push_back(ConstantInt::get(Int32Ty, Exp->WrapperOffset));
+    }
 
-    OS << "END\n";
-    OS.flush();
-  }
+    // List methods that will be called dynamically.
+    StringMap<Constant *> Types;
+    vector<Constant *> MethodRVAs, MethodTypes;
+    for (auto &[RVA, Type] : DLL.MethodTypes) {
+      if (Map.count(RVA))
+        continue;
+      Constant *&TypeStr = Types[Type];
+      if (!TypeStr)
+        TypeStr = DefineString(Type);
+      MethodRVAs.push_back(ConstantInt::get(Int32Ty, RVA));
+      MethodTypes.push_back(TypeStr);
+    }
 
-  // Emit `.obj` file.
-  string ObjectFile(
-      (DC.OutputDir / DLL.Name).replace_extension(".obj").string());
-  IR.emitObj(DC.BuildDir, ObjectFile);
+    // The layout must match `WrapperIndex`.
+    IR.defineExport(
+        WrapperIndex::Symbol.S,
+        ConstantStruct::getAnon(
+            {ConstantInt::get(Int32Ty, DylibNames.size()),
+             DefineArray(IR.VoidPtrTy, DylibNames),
+             ConstantInt::get(Int32Ty, Map.size()),
+             DefineArray(Int32Ty, RVAs), DefineArray(Int32Ty, DylibIdxs),
+             DefineArray(Int32Ty, Offsets),
+             ConstantInt::get(Int32Ty, MethodRVAs.size()),
+             DefineArray(Int32Ty, MethodRVAs),
+             DefineArray(IR.VoidPtrTy, MethodTypes)}));
+  }
 
-  // Create the wrapper DLL.
+  // Generate `ExportTable`.
   {
-    ClangHelper Clang(DC.BuildDir, LLVM);
-    // See #24.
-    if (DLL.Name == (Debug ? "ucrtbased.dll" : "ucrtbase.dll"))
-      Clang.Args.add(
-          (DC.BuildDir / "src/crt/CMakeFiles/crtstubs.dir/stubs.cpp.obj")
-              .string()
-              .c_str());
-
-    Clang.Args.add("-I./include");
-    Clang.Args.add(IndexFile.c_str());
-
-    Clang.linkDLL(
-        (DC.GenDir / DLL.Name).replace_extension(".wrapper.dll").string(),
-        ObjectFile, path(DLLPath).replace_extension(".dll.a").string(), Debug);
+    uint32_t BucketCount = 1;
+    while (BucketCount < DLL.NamedExports.size() * 2)
+      BucketCount <<= 1;
+    vector<uint32_t> Buckets(BucketCount, ExportTable::NotFound);
+    vector<Constant *> Hashes, Names, RVAs;
+    Hashes.reserve(DLL.NamedExports.size());
+    Names.reserve(DLL.NamedExports.size());
+    RVAs.reserve(DLL.NamedExports.size());
+    for (auto &[Name, RVA] : DLL.NamedExports) {
+      uint32_t Hash = ExportTable::hash(Name);
+      uint32_t B = Hash & (BucketCount - 1);
+      while (Buckets[B] != ExportTable::NotFound)
+        B = (B + 1) & (BucketCount - 1);
+      Buckets[B] = static_cast<uint32_t>(Names.size());
+      Hashes.push_back(ConstantInt::get(Int32Ty, Hash));
+      Names.push_back(DefineString(Name));
+      RVAs.push_back(ConstantInt::get(Int32Ty, RVA));
+    }
+    vector<Constant *> BucketValues;
+    BucketValues.reserve(BucketCount);
+    for (uint32_t I : Buckets)
+      BucketValues.push_back(ConstantInt::get(Int32Ty, I));
+
+    // The layout must match `ExportTable`.
+    IR.defineExport(
+        ExportTable::Symbol.S,
+        ConstantStruct::getAnon(
+            {ConstantInt::get(Int32Ty, DLL.TimeDateStamp),
+             ConstantInt::get(Int32Ty, BucketCount - 1),
+             DefineArray(Int32Ty, BucketValues), DefineArray(Int32Ty, Hashes),
+             DefineArray(IR.VoidPtrTy, Names), DefineArray(Int32Ty, RVAs)}));
   }
 
-  // Emit `.o` file.
-  string DylibObjectFile(
-      (DC.OutputDir / DLL.Name).replace_extension(".o").string());
-  DylibIR.emitObj(DC.BuildDir, DylibObjectFile);
+  // Emit `.obj` file of the index.
+  string IndexFile(
+      (DC.OutputDir / DLL.Name).replace_extension(".index.obj").string());
+  TaskGraph::Task *Index = IR.emitObj(IndexFile, Tasks);
 
-  // Create the stub Dylib.
-  {
-    LLDHelper LLD(DC.BuildDir, LLVM);
-    LLD.linkDylib(
-        (DC.OutputDir / ("lib" + DLL.Name))
-            .replace_extension(".dll.dylib")
-            .string(),
-        DylibObjectFile,
-        path("/" + DLL.Name).replace_extension(".wrapper.dll").string());
-  }
+  // Create the wrapper DLL.
+  string ObjectFile(
+      (DC.OutputDir / DLL.Name).replace_extension(".obj").string());
+  auto Clang = std::make_shared<ClangHelper>(DC.BuildDir, LLVM);
+  // See #24.
+  if (DLL.Name == (Debug ? "ucrtbased.dll" : "ucrtbase.dll"))
+    Clang->Args.add(
+        (DC.BuildDir / "src/crt/CMakeFiles/crtstubs.dir/stubs.cpp.obj")
+            .string()
+            .c_str());
+
+  Clang->Args.add(IndexFile.c_str());
+  Clang->addDLLArgs(
+      (DC.GenDir / DLL.Name).replace_extension(".wrapper.dll").string(),
+      ObjectFile, path(DLLPath).replace_extension(".dll.a").string(), Debug);
+  Tasks.add([Clang] { Clang->executeArgs(); }, {Index, DLL.ObjectTask});
 }
 
 bool DLLHelper::analyzeWindowsFunction(const string &Name, uint32_t RVA,
@@ -374,17 +834,17 @@ bool DLLHelper::analyzeWindowsFunction(const string &Name, uint32_t RVA,
     // `SEL`, both actually `void *`). If it's a `stret` messenger, it
     // has one more parameter at the front (a `void *` for struct
     // return).
-    Exp->Stret = endsWith(Exp->Name, HAContext::StretPostfix);
+    Exp->Stret = Exp->Name.endswith(HAContext::StretPostfix.S);
     // Also recognize `Super` functions.
-    if (Exp->Name.find("Super2") != string::npos)
+    if (Exp->Name.find("Super2") != StringRef::npos)
       Exp->Super2 = true;
-    else if (Exp->Name.find("Super") != string::npos)
+    else if (Exp->Name.find("Super") != StringRef::npos)
       Exp->Super = true;
   };
 
   // Find Objective-C messengers. Note that they used to be variadic,
   // but that's deprecated and so we cannot rely on that.
-  if (startsWith(Exp->Name, HAContext::MsgSendPrefix)) {
+  if (Exp->Name.startswith(HAContext::MsgSendPrefix.S)) {
     Exp->Messenger = true;
     FlagsSetter();
 
@@ -396,7 +856,7 @@ bool DLLHelper::analyzeWindowsFunction(const string &Name, uint32_t RVA,
   // are declared as `void -> void`, but we need them to have the few
   // first arguments they base their lookup on, so that we transfer them
   // correctly.
-  if (startsWith(Exp->Name, HAContext::MsgLookupPrefix)) {
+  if (Exp->Name.startswith(HAContext::MsgLookupPrefix.S)) {
     FlagsSetter();
     Exp->setType(LLVM.LookupTy);
 
@@ -6,7 +6,9 @@
 #include "ipasim/HeadersAnalyzer/Config.hpp"
 #include "ipasim/Output.hpp"
 
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/Twine.h>
+#include <llvm/Support/MathExtras.h>
 
 using namespace ipasim;
 using namespace llvm;
@@ -23,9 +25,9 @@ template <LibType T> llvm::FunctionType *ExportEntry::getType() const {
       // Manually craft type of the DLL function. It doesn't have the first
       // parameter for struct return, but returns the struct directly instead.
       // See #28.
-      DLLArgs.reserve(DylibType->getNumParams() - 1);
-      std::copy(DylibType->param_begin() + 1, DylibType->param_end(),
-                std::back_inserter(DLLArgs));
+      // `FunctionType::get` copies the parameters, so they can be temporary.
+      vector<Type *> DLLArgs(DylibType->param_begin() + 1,
+                             DylibType->param_end());
       DLLType = llvm::FunctionType::get(
           (*DylibType->param_begin())->getPointerElementType(), DLLArgs,
           DylibType->isVarArg());
@@ -36,17 +38,109 @@ template <LibType T> llvm::FunctionType *ExportEntry::getType() const {
 template llvm::FunctionType *ExportEntry::getType<LibType::Dylib>() const;
 template llvm::FunctionType *ExportEntry::getType<LibType::DLL>() const;
 
+bool ExportEntry::fitsRegisters() const {
+  // Stret pointers are words, too. Returned structures are stored through them
+  // (see #28).
+  if (!DylibType || DylibType->isVarArg())
+    return false;
+  auto IsWords = [](Type *T) {
+    if (auto *ArrayTy = dyn_cast<ArrayType>(T))
+      return ArrayTy->getElementType()->isIntegerTy(32);
+    return T->isPointerTy() || T->isFloatTy() || T->isDoubleTy() ||
+           (T->isIntegerTy() && T->getIntegerBitWidth() <= 64);
+  };
+  // Results are returned in R0-R1 (see `RegisterBlock`).
+  Type *RetTy = DylibType->getReturnType();
+  if (!RetTy->isVoidTy() && !RetTy->isPointerTy() && !RetTy->isFloatTy() &&
+      !RetTy->isDoubleTy() && !RetTy->isIntegerTy(32) &&
+      !RetTy->isIntegerTy(64))
+    return false;
+  return all_of(DylibType->params(), IsWords);
+}
+
+optional<size_t> ExportEntry::getArgWords() const {
+  if (!DylibType)
+    return nullopt;
+  size_t Words = 0;
+  for (Type *T : DylibType->params()) {
+    if (auto *ArrayTy = dyn_cast<ArrayType>(T)) {
+      if (!ArrayTy->getElementType()->isIntegerTy(32))
+        return nullopt;
+      Words += ArrayTy->getNumElements();
+    } else if (T->isDoubleTy() || T->isIntegerTy(64))
+      // iOS's APCS doesn't align 64-bit values to even registers.
+      Words += 2;
+    else if (T->isPointerTy() || T->isFloatTy() ||
+             (T->isIntegerTy() && T->getIntegerBitWidth() <= 32))
+      ++Words;
+    else
+      return nullopt;
+  }
+  return Words;
+}
+WrapperShape ExportEntry::getShape() const {
+  if (!DylibType)
+    return WrapperShape::None;
+  if (Status != ExportStatus::FoundInDLL || UnhandledMessenger)
+    return WrapperShape::Dynamic;
+  if (Messenger)
+    return WrapperShape::Messenger;
+  if (VaList)
+    return WrapperShape::VaList;
+  if (UnhandledVararg || DylibType->isVarArg())
+    return WrapperShape::Vararg;
+  if (isTrivial())
+    return WrapperShape::Trivial;
+  if (DylibStretOnly)
+    return WrapperShape::Stret;
+  auto IsFloat = [](Type *T) { return T->isFloatTy() || T->isDoubleTy(); };
+  if (IsFloat(DylibType->getReturnType()) ||
+      any_of(DylibType->params(), IsFloat))
+    return WrapperShape::Float;
+  optional<size_t> Words(getArgWords());
+  if (fitsRegisters() && Words && *Words <= 4)
+    return WrapperShape::Register;
+  return WrapperShape::Stack;
+}
+
+const char *ipasim::toString(WrapperShape Shape) {
+  switch (Shape) {
+  case WrapperShape::None:
+    return "";
+  case WrapperShape::Trivial:
+    return "trivial";
+  case WrapperShape::Register:
+    return "register";
+  case WrapperShape::Stack:
+    return "stack";
+  case WrapperShape::Float:
+    return "float";
+  case WrapperShape::Stret:
+    return "stret";
+  case WrapperShape::VaList:
+    return "va_list";
+  case WrapperShape::Vararg:
+    return "vararg";
+  case WrapperShape::Messenger:
+    return "messenger";
+  case WrapperShape::Dynamic:
+    return "dynamic";
+  default:
+    Log.fatalError("invalid `WrapperShape`");
+  }
+}
+
 bool HAContext::isClassMethod(const string &Name) {
   return (Name[0] == '+' || Name[0] == '-') && Name[1] == '[';
 }
 ClassExportPtr HAContext::findClassMethod(const string &Name) {
   if (iOSClasses.empty() || !isClassMethod(Name))
-    return iOSClasses.end();
+    return ClassExportPtr();
 
   // Find the first space.
   size_t SpaceIdx = Name.find(' ', 2);
   if (SpaceIdx == string::npos)
-    return iOSClasses.end();
+    return ClassExportPtr();
 
   // From `[` to the first space is a class name.
   string ClassName = Name.substr(2, SpaceIdx - 2);
@@ -73,30 +167,35 @@ template <LibType LibTy> static void warnUninteresting(const string &Name) {
   }
 }
 
+void HAContext::addClassMethod(ExportPtr Exp, const ClassExport &Class) {
+  // If some class is in more than one Dylib, its wrappers are emitted only to
+  // the first one and the others re-export it. See `ClassExport`.
+  if (Class.Dylibs.empty())
+    return;
+  Exp->Dylib = Class.Dylibs.front();
+  Exp->Dylib->Exports.push_back(Exp);
+  for (DylibPtr Lib : llvm::drop_begin(Class.Dylibs, 1))
+    Lib->DylibReExports.insert(Exp->Dylib);
+}
+
 bool HAContext::isInteresting(const string &Name, ExportPtr &Exp) {
   Exp = iOSExps.find(Name);
-  if (Exp == iOSExps.end()) {
+  if (!Exp) {
     // If not found among exported functions, try if it isn't an Objective-C
     // function.
     // TODO: If it is, though, don't really export it by name from the Dylib.
     auto Class = findClassMethod(Name);
-    if (Class != iOSClasses.end()) {
-      Exp = iOSExps.insert(ExportEntry(Name)).first;
+    if (Class) {
+      Exp = addExport(Name);
       Exp->ObjCMethod = true;
-      // Note that if some class is in more than one Dylib, its wrappers will be
-      // emitted to all of them, so we can use any one of them in `WrapperIndex`
-      // (`Exp->Dylib` is used when generating `WrapperIndex`).
-      if (!Class->Dylibs.empty())
-        Exp->Dylib = Class->Dylibs.front();
-      std::for_each(Class->Dylibs.begin(), Class->Dylibs.end(),
-                    [&Exp](auto &Dylib) { Dylib->Exports.push_back(Exp); });
+      addClassMethod(Exp, *Class);
     }
     // Also, we are interested in `msgNil` and `msgLookup` families of
     // functions.
     else if (startsWith(Name, MsgNilPrefix) ||
              startsWith(Name, MsgLookupPrefix)) {
-      Exp = iOSExps.insert(ExportEntry(Name)).first;
-      Exp->Dylib = iOSLibs.find(Dylib("/usr/lib/libobjc.A.dylib"));
+      Exp = addExport(Name);
+      Exp->Dylib = iOSLibs.find("/usr/lib/libobjc.A.dylib");
       Exp->Dylib->Exports.push_back(Exp);
     } else {
       warnUninteresting<LibType::Dylib>(Name);
@@ -105,10 +204,48 @@ bool HAContext::isInteresting(const string &Name, ExportPtr &Exp) {
   }
   return true;
 }
+bool HAContext::isExported(const string &Name) {
+  return iOSExps.find(Name) || findClassMethod(Name) ||
+         startsWith(Name, MsgNilPrefix) || startsWith(Name, MsgLookupPrefix);
+}
+bool HAContext::addInheritedMethod(const string &Name) {
+  if (!isClassMethod(Name) || iOSExps.find(Name))
+    return false;
+  size_t SpaceIdx = Name.find(' ', 2);
+  if (SpaceIdx == string::npos)
+    return false;
+  string Prefix(Name.substr(0, 2)), Selector(Name.substr(SpaceIdx));
+
+  // Walk up the class hierarchy until we find a declaration of the method.
+  // The depth is limited, so that invalid metadata cannot make us loop.
+  auto It = SuperClasses.find(Name.substr(2, SpaceIdx - 2));
+  for (size_t Depth = 0; It != SuperClasses.end() && Depth != MaxClassDepth;
+       It = SuperClasses.find(It->second), ++Depth) {
+    ExportPtr Base = iOSExps.find(Prefix + It->second + Selector);
+    if (!Base || !Base->getDylibType())
+      continue;
+
+    ExportPtr Exp = addExport(Name);
+    Exp->ObjCMethod = true;
+    Exp->Status = ExportStatus::Found;
+    Exp->setType(Base->getDylibType());
+    Exp->DylibStretOnly = Base->DylibStretOnly;
+    // The overriding class is usually in the same Dylib, but it doesn't have
+    // to be listed in TBD files (if it's private).
+    if (auto Class = findClassMethod(Name))
+      addClassMethod(Exp, *Class);
+    if (!Exp->Dylib && Base->Dylib) {
+      Exp->Dylib = Base->Dylib;
+      Exp->Dylib->Exports.push_back(Exp);
+    }
+    return true;
+  }
+  return false;
+}
 bool HAContext::isInterestingForWindows(const string &Name, ExportPtr &Exp,
                                         uint32_t RVA, bool IgnoreDuplicates) {
   Exp = iOSExps.find(Name);
-  if (Exp == iOSExps.end()) {
+  if (!Exp) {
     warnUninteresting<LibType::DLL>(Name);
     return false;
   }
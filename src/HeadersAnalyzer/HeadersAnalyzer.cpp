@@ -1,42 +1,69 @@
 // HeadersAnalyzer.cpp: Main logic of tool `HeadersAnalyzer`.
 
+#include "ipasim/BuildCache.hpp"
+#include "ipasim/BuildReport.hpp"
 #include "ipasim/ClangHelper.hpp"
 #include "ipasim/DLLHelper.hpp"
+#include "ipasim/GuestMallocCache.hpp"
+#include "ipasim/GuestPoolPage.hpp"
+#include "ipasim/GuestTSD.hpp"
 #include "ipasim/HAContext.hpp"
 #include "ipasim/HeadersAnalyzer/Config.hpp"
 #include "ipasim/LLDBHelper.hpp"
 #include "ipasim/LLDHelper.hpp"
 #include "ipasim/LLVMHelper.hpp"
+#include "ipasim/MessageCache.hpp"
 #include "ipasim/ObjCHelper.hpp"
+#include "ipasim/PDBHelper.hpp"
 #include "ipasim/TapiHelper.hpp"
+#include "ipasim/TaskGraph.hpp"
 
 #include <CodeGen/CodeGenModule.h>
 #include <Plugins/SymbolFile/PDB/PDBASTParser.h>
 #include <Plugins/SymbolFile/PDB/SymbolFilePDB.h>
+#include <algorithm>
+#include <array>
+#include <clang/AST/DeclCXX.h>
 #include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/AST/Type.h>
+#include <clang/Basic/SourceManager.h>
 #include <clang/CodeGen/CodeGenABITypes.h>
 #include <clang/CodeGen/CodeGenAction.h>
 #include <clang/Driver/Compilation.h>
 #include <clang/Driver/Driver.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/MultiplexConsumer.h>
+#include <clang/Index/CodeGenNameGenerator.h>
+#include <clang/Lex/PreprocessorOptions.h>
 #include <clang/Parse/ParseAST.h>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <lldb/Core/Debugger.h>
 #include <lldb/Core/Module.h>
 #include <lldb/Symbol/ClangASTContext.h>
 #include <lldb/Symbol/ClangUtil.h>
 #include <lldb/Symbol/Type.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/DebugInfo.h>
 #include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Mangler.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/ValueSymbolTable.h>
+#include <llvm/Linker/IRMover.h>
+#include <llvm/Object/MachO.h>
+#include <llvm/Object/MachOUniversal.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Transforms/Utils/FunctionComparator.h>
+#include <map>
+#include <memory>
+#include <optional>
 #include <vector>
 
 using namespace clang;
@@ -48,10 +75,103 @@ using namespace tapi::internal;
 
 namespace {
 
+// Functions of the Objective-C runtime which do nothing (and return `nil` if
+// they return anything) when their first argument is `nil`. See
+// `InlineRetainRelease`.
+constexpr const char *NilRetainReleases[] = {
+    "_objc_retain",
+    "_objc_release",
+    "_objc_autorelease",
+    "_objc_retainAutorelease",
+    "_objc_autoreleaseReturnValue",
+    "_objc_retainAutoreleaseReturnValue",
+    "_objc_retainAutoreleasedReturnValue"};
+constexpr ConstexprString StoreStrong = "_objc_storeStrong";
+// See `InlineAutoreleasePools`.
+constexpr ConstexprString PoolPush = "_objc_autoreleasePoolPush";
+constexpr ConstexprString PoolPop = "_objc_autoreleasePoolPop";
+constexpr ConstexprString Autorelease = "_objc_autorelease";
+// See `InlineMalloc`.
+constexpr ConstexprString Malloc = "_malloc";
+constexpr ConstexprString Free = "_free";
+
+// Passes to CodeGen only declarations of functions that are exported from iOS
+// Dylibs (see `HAContext::isExported`), so that `EmitAllDecls` doesn't emit the
+// whole SDK. Other declarations (e.g., Objective-C classes with their methods)
+// are passed through.
+class DeclFilter : public MultiplexConsumer {
+public:
+  DeclFilter(HAContext &HAC, unique_ptr<ASTConsumer> Consumer)
+      : MultiplexConsumer(wrap(move(Consumer))), HAC(HAC) {}
+
+  void Initialize(ASTContext &Ctx) override {
+    MultiplexConsumer::Initialize(Ctx);
+    Names = std::make_unique<index::CodeGenNameGenerator>(Ctx);
+  }
+  bool HandleTopLevelDecl(DeclGroupRef DG) override {
+    for (Decl *D : DG)
+      if (!filter(D))
+        return false;
+    return true;
+  }
+
+private:
+  HAContext &HAC;
+  unique_ptr<index::CodeGenNameGenerator> Names;
+
+  static vector<unique_ptr<ASTConsumer>> wrap(unique_ptr<ASTConsumer> C) {
+    vector<unique_ptr<ASTConsumer>> Consumers;
+    Consumers.push_back(move(C));
+    return Consumers;
+  }
+  bool filter(Decl *D) {
+    // Functions of `extern "C"` blocks are filtered one by one.
+    if (auto *LSD = dyn_cast<LinkageSpecDecl>(D)) {
+      for (Decl *Child : LSD->decls())
+        if (!filter(Child))
+          return false;
+      return true;
+    }
+    if (auto *Func = dyn_cast<FunctionDecl>(D))
+      if (!HAC.isExported(Names->getName(Func)))
+        return true;
+    return MultiplexConsumer::HandleTopLevelDecl(DeclGroupRef(D));
+  }
+};
+
+// `EmitLLVMOnlyAction` whose declarations are filtered by `DeclFilter`.
+class FilteredEmitLLVMAction : public EmitLLVMOnlyAction {
+public:
+  FilteredEmitLLVMAction(HAContext &HAC, llvm::LLVMContext *Ctx)
+      : EmitLLVMOnlyAction(Ctx), HAC(HAC) {}
+
+protected:
+  unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                            StringRef InFile) override {
+    return std::make_unique<DeclFilter>(
+        HAC, EmitLLVMOnlyAction::CreateASTConsumer(CI, InFile));
+  }
+
+private:
+  HAContext &HAC;
+};
+
+// Module into which Dylib wrappers are generated along with helpers shared by
+// them (defined on first use).
+struct DylibModule {
+  DylibModule(LLVMHelper &LLVM, llvm::StringRef Name, llvm::StringRef Path)
+      : IR(LLVM, Name, Path, IRHelper::Apple) {}
+
+  IRHelper IR;
+  llvm::GlobalVariable *Cache = nullptr; // See `MessageCache`
+  llvm::Function *Dispatch[2] = {};      // Indexed by `Stret`
+  llvm::Function *MsgNil = nullptr;
+  llvm::Function *Flush = nullptr; // See `CommandBuffer`
+  // Bodies shared by wrappers. See `SharedWrappers`.
+  map<llvm::FunctionType *, llvm::Function *> Shapes;
+};
+
 // Encapsulates the workflow of `HeadersAnalyzer`.
-// TODO: Generate distinct wrappers only for functions with distinct signatures.
-// And then export those wrappers as aliases for all functions with the same
-// signature.
 // TODO: Also analyze WinObjC's header files to find API status information and
 // also our DLLs, e.g., our Objective-C runtime to find types of
 // assembly-implemented functions.
@@ -63,35 +183,263 @@ public:
 
   void discoverTBDs() {
     Log.info("discovering TBDs");
-
-    TBDHandler TH(HAC);
+    BuildTimer Timer("discoverTBDs");
+
+    // Files are sorted, so that the order in which they are added into
+    // `HAContext` (and hence also `ExportEntry::Dylib`) doesn't depend on the
+    // order of directory iteration.
+    vector<TBDFile> Files;
+    auto AddFiles = [&Files](vector<string> &&Paths) {
+      sort(Paths.begin(), Paths.end());
+      Files.insert(Files.end(), Paths.begin(), Paths.end());
+    };
     vector<string> Dirs{
         "./deps/apple-headers/iPhoneOS11.1.sdk/usr/lib/",
         "./deps/apple-headers/iPhoneOS11.1.sdk/System/Library/TextInput/"};
-    for (const string &Dir : Dirs)
+    for (const string &Dir : Dirs) {
+      vector<string> Paths;
       for (auto &File : directory_iterator(Dir))
-        TH.handleFile(File.path().string());
+        Paths.push_back(File.path().string());
+      AddFiles(move(Paths));
+    }
     // Discover `.tbd` files inside frameworks.
     string FrameworksDir =
         "./deps/apple-headers/iPhoneOS11.1.sdk/System/Library/Frameworks/";
+    vector<string> Paths;
     for (auto &File : directory_iterator(FrameworksDir))
       if (File.status().type() == file_type::directory &&
           !File.path().extension().compare(".framework"))
-        TH.handleFile(
+        Paths.push_back(
             (File.path() / File.path().filename().replace_extension(".tbd"))
                 .string());
+    AddFiles(move(Paths));
+
+    // Parse them in parallel, but add them into `HAContext` in order.
+    for (TBDFile &File : Files)
+      Tasks.add([&File] { TBDHandler::parseFile(File); });
+    Tasks.wait();
+    TBDHandler TH(HAC);
+    for (const TBDFile &File : Files)
+      TH.addFile(File);
+  }
+  void discoverLeaves() {
+    Log.info("discovering leaf functions");
+    BuildTimer Timer("discoverLeaves");
+
+    ifstream IS("./src/HeadersAnalyzer/leaf_functions.txt");
+    if (!IS) {
+      Log.error("cannot open leaf_functions.txt");
+      return;
+    }
+
+    string Name;
+    while (getline(IS, Name)) {
+      if (Name.empty() || Name[0] == '#')
+        continue;
+
+      auto Exp = HAC.iOSExps.find(Name);
+      if (!Exp) {
+        if constexpr (!Sample)
+          Log.warning() << "leaf function not found (" << Name << ")"
+                        << Log.end();
+        continue;
+      }
+      Exp->Leaf = true;
+    }
+  }
+  void discoverDeferred() {
+    Log.info("discovering deferred functions");
+    BuildTimer Timer("discoverDeferred");
+
+    ifstream IS("./src/HeadersAnalyzer/deferred_functions.txt");
+    if (!IS) {
+      Log.error("cannot open deferred_functions.txt");
+      return;
+    }
+
+    string Name;
+    while (getline(IS, Name)) {
+      if (Name.empty() || Name[0] == '#')
+        continue;
+
+      auto Exp = HAC.iOSExps.find(Name);
+      if (!Exp) {
+        if constexpr (!Sample)
+          Log.warning() << "deferred function not found (" << Name << ")"
+                        << Log.end();
+        continue;
+      }
+      // Deferred functions never call back into emulated code.
+      Exp->Deferred = true;
+      Exp->Leaf = true;
+    }
+  }
+  void discoverVaLists() {
+    Log.info("discovering va_list variants of variadic functions");
+    BuildTimer Timer("discoverVaLists");
 
-    // Fill `ExportEntry.Dylib` fields. This must not be done earlier since
-    // `DylibPtr`s need to be stable.
-    // TODO: Maybe don't do this and have only Objective-C methods inside
-    // `WrapperIndex`.
-    for (auto [LibPtr, Lib] : withPtrs(HAC.iOSLibs))
-      for (const ExportPtr &Exp : Lib.Exports)
-        if (!Exp->Dylib)
-          Exp->Dylib = LibPtr;
+    ifstream IS("./src/HeadersAnalyzer/vararg_functions.txt");
+    if (!IS) {
+      Log.error("cannot open vararg_functions.txt");
+      return;
+    }
+
+    string Line;
+    while (getline(IS, Line)) {
+      if (Line.empty() || Line[0] == '#')
+        continue;
+
+      size_t Space = Line.find(' ');
+      string Name(Line.substr(0, Space));
+      string VaListName(Space == string::npos ? "" : Line.substr(Space + 1));
+      auto Exp = HAC.iOSExps.find(Name);
+      auto VaList = HAC.iOSExps.find(VaListName);
+      if (!Exp || !VaList || Exp->Status != ExportStatus::FoundInDLL ||
+          VaList->Status != ExportStatus::FoundInDLL) {
+        if constexpr (!Sample)
+          Log.warning() << "variadic function or its va_list variant not "
+                           "found ("
+                        << Line << ")" << Log.end();
+        continue;
+      }
+      if (!canForwardVaList(*Exp, *VaList)) {
+        Log.error() << "cannot forward " << Name << " to " << VaListName
+                    << Log.end();
+        continue;
+      }
+      Exp->VaList = VaList;
+      // Apps usually call only the variadic function.
+      if (UsedSymbols.count(Name))
+        UsedSymbols.insert(VaListName);
+    }
+  }
+  // Returns `true` if variadic `Exp` takes the same arguments as `VaList`
+  // except for its last one, a `va_list`, and returns the same. Since the
+  // Dylib wrapper of `Exp` calls the one of `VaList` directly, they must be
+  // linked together.
+  bool canForwardVaList(const ExportEntry &Exp, const ExportEntry &VaList) {
+    llvm::FunctionType *Ty = Exp.getDylibType();
+    llvm::FunctionType *VaTy = VaList.getDylibType();
+    if (!Ty || !VaTy || !Ty->isVarArg() || VaTy->isVarArg() ||
+        Exp.ObjCMethod || Exp.DylibStretOnly || VaList.DylibStretOnly ||
+        VaTy->getNumParams() != Ty->getNumParams() + 1 ||
+        !VaTy->params().back()->isPointerTy() ||
+        (!MergedDylibs && Exp.Dylib != VaList.Dylib))
+      return false;
+    // Pointers can be to different (but equivalent) named structs.
+    auto IsSame = [](llvm::Type *A, llvm::Type *B) {
+      return A == B || (A->isPointerTy() && B->isPointerTy());
+    };
+    if (!IsSame(Ty->getReturnType(), VaTy->getReturnType()))
+      return false;
+    for (unsigned I = 0, Count = Ty->getNumParams(); I != Count; ++I)
+      if (!IsSame(Ty->getParamType(I), VaTy->getParamType(I)))
+        return false;
+    return true;
+  }
+  void discoverUsage() {
+    if constexpr (!PruneWrappers)
+      return;
+    Log.info("discovering symbols used by target apps");
+    BuildTimer Timer("discoverUsage");
+
+    // Functions and methods listed here are kept even if no app uses them.
+    ifstream CoreIS("./src/HeadersAnalyzer/core_functions.txt");
+    if (!CoreIS)
+      Log.error("cannot open core_functions.txt");
+    string Name;
+    while (getline(CoreIS, Name))
+      if (!Name.empty() && Name[0] != '#')
+        UsedSymbols.insert(Name);
+
+    // Functions and methods reached by apps at runtime (written by
+    // `IpaSimHeadless --coverage`). They are kept, too, but `pruneExports`
+    // reports those which static discovery would miss.
+    ifstream CoverageIS("./src/HeadersAnalyzer/wrapper_coverage.txt");
+    while (getline(CoverageIS, Name))
+      if (!Name.empty() && Name[0] != '#')
+        CoveredSymbols.insert(Name);
+
+    ifstream IS("./src/HeadersAnalyzer/target_apps.txt");
+    if (!IS) {
+      Log.error("cannot open target_apps.txt");
+      return;
+    }
+    string Line;
+    while (getline(IS, Line)) {
+      if (Line.empty() || Line[0] == '#')
+        continue;
+
+      // Executables of app bundles are named after them.
+      path AppPath(Line);
+      if (AppPath.extension() == ".app")
+        AppPath /= AppPath.stem();
+      else if (AppPath.extension() == ".ipa") {
+        Log.error() << "extract .ipa files first (" << Line << ")"
+                    << Log.end();
+        continue;
+      }
+      discoverUsage(AppPath);
+    }
+  }
+  void discoverUsage(const path &AppPath) {
+    using namespace llvm::object;
+
+    auto Bin = createBinary(AppPath.string());
+    if (!Bin) {
+      llvm::consumeError(Bin.takeError());
+      Log.error() << "cannot read app " << AppPath.string() << Log.end();
+      return;
+    }
+    if (auto *MachO = llvm::dyn_cast<MachOObjectFile>(Bin->getBinary())) {
+      discoverUsage(*MachO);
+      return;
+    }
+    auto *Fat = llvm::dyn_cast<MachOUniversalBinary>(Bin->getBinary());
+    if (!Fat) {
+      Log.error() << "app is not Mach-O (" << AppPath.string() << ")"
+                  << Log.end();
+      return;
+    }
+    // Symbols used by any architecture are collected.
+    for (const MachOUniversalBinary::ObjectForArch &Arch : Fat->objects()) {
+      auto MachO = Arch.getAsObjectFile();
+      if (!MachO) {
+        llvm::consumeError(MachO.takeError());
+        continue;
+      }
+      discoverUsage(**MachO);
+    }
+  }
+  void discoverUsage(const llvm::object::MachOObjectFile &MachO) {
+    // Functions and classes the app imports are undefined symbols of it.
+    for (const llvm::object::SymbolRef &Sym : MachO.symbols()) {
+      if (!(Sym.getFlags() & llvm::object::SymbolRef::SF_Undefined))
+        continue;
+      auto Name = Sym.getName();
+      if (!Name) {
+        llvm::consumeError(Name.takeError());
+        continue;
+      }
+      UsedSymbols.insert(*Name);
+    }
+
+    // Selectors the app sends (or implements) are in `__objc_methname`.
+    for (const llvm::object::SectionRef &Sec : MachO.sections()) {
+      llvm::StringRef SecName, Contents;
+      if (Sec.getName(SecName) || SecName != "__objc_methname" ||
+          Sec.getContents(Contents))
+        continue;
+      llvm::SmallVector<llvm::StringRef, 0> Selectors;
+      Contents.split(Selectors, '\0', /* MaxSplit */ -1,
+                     /* KeepEmpty */ false);
+      for (llvm::StringRef Sel : Selectors)
+        UsedSelectors.insert(Sel);
+    }
   }
   void discoverDLLs() {
     Log.info("discovering DLLs");
+    BuildTimer Timer("discoverDLLs");
 
     // Note that groups must be added just once and together because references
     // to them are invalidated after that.
@@ -107,6 +455,15 @@ public:
     // Our Objective-C runtime
     HAC.DLLGroups[I++].DLLs.push_back(DLLEntry("libobjc.dll"));
 
+    // ANGLE (copied next to us by target `AngleBinaries`). It comes without
+    // PDB and its `GL_APIENTRY` is `__stdcall`. See `GLWrappers`.
+    if constexpr (!Sample && GLWrappers) {
+      DLLEntry GL("libGLESv2.dll");
+      GL.ExportsOnly = true;
+      GL.StdCall = true;
+      HAC.DLLGroups[0].DLLs.push_back(move(GL));
+    }
+
     if constexpr (!Sample) {
       // WinObjC DLLs (i.e., Windows versions of Apple's frameworks)
       DLLGroup &FxGroup = HAC.DLLGroups[I++];
@@ -121,6 +478,13 @@ public:
         }
       }
 
+      // Our native `AccelerateNative.dll` takes precedence over WinObjC's
+      // `Accelerate.dll`, so the latter must be analyzed after it.
+      for (DLLEntry &DLL : FxGroup.DLLs)
+        DLL.Overridden = DLL.Name == "Accelerate.dll";
+      stable_partition(FxGroup.DLLs.begin(), FxGroup.DLLs.end(),
+                       [](const DLLEntry &DLL) { return !DLL.Overridden; });
+
       // Prebuilt `libdispatch.dll`
       HAC.DLLGroups[I++].DLLs.push_back(DLLEntry("libdispatch.dll"));
 
@@ -131,8 +495,29 @@ public:
   }
   void parseAppleHeaders() {
     Log.info("parsing Apple headers");
+    BuildTimer Timer("parseAppleHeaders");
+
+    StringVector Args(LLVM.Saver);
+    addAppleHeadersArgs(Args);
+    if (!loadAppleSignatures(Args.get())) {
+      // Compile parts of `iOSHeaders.mm` in parallel.
+      vector<HeadersPart> Parts(splitAppleHeaders());
+      for (HeadersPart &Part : Parts)
+        Tasks.add([this, &Part] { compileAppleHeaders(Part); });
+      Tasks.wait();
+
+      vector<string> Deps;
+      for (HeadersPart &Part : Parts) {
+        if (Part.Failed)
+          Log.fatalError("cannot compile Apple headers (" + Part.Name + ")");
+        Deps.insert(Deps.end(), Part.Deps.begin(), Part.Deps.end());
+      }
+      sort(Deps.begin(), Deps.end());
+      Deps.erase(unique(Deps.begin(), Deps.end()), Deps.end());
 
-    compileAppleHeaders();
+      mergeAppleHeaders(Parts);
+      saveAppleSignatures(Args.get(), Deps);
+    }
 
     for (const llvm::Function &Func : *LLVM.getModule())
       analyzeAppleFunction(Func);
@@ -146,6 +531,26 @@ public:
   }
   void loadDLLs() {
     Log.info("loading DLLs");
+    BuildTimer Timer("loadDLLs");
+
+    if constexpr (NativePDB) {
+      // Read DLLs and PDBs in parallel. Analyzing them updates `HAContext`,
+      // though, so that's done serially and in order.
+      vector<DLLHelper> DHs;
+      for (auto [GroupIdx, Group] : withIndices(HAC.DLLGroups))
+        for (auto [DLLIdx, DLL] : withIndices(Group.DLLs))
+          DHs.emplace_back(HAC, LLVM, Group, GroupIdx, DLL, DLLIdx);
+      vector<DLLInput> Inputs(DHs.size());
+      for (size_t I = 0, Count = DHs.size(); I != Count; ++I)
+        Tasks.add([&DHs, &Inputs, I] {
+          DHs[I].read(Inputs[I], /* ReadPDB */ true);
+        });
+      Tasks.wait();
+
+      for (size_t I = 0, Count = DHs.size(); I != Count; ++I)
+        DHs[I].load(Inputs[I]);
+      return;
+    }
 
     LLDBHelper LLDB;
     ClangHelper Clang(DC.BuildDir, LLVM);
@@ -164,24 +569,147 @@ public:
     // Load DLLs and PDBs.
     DLLHelper::forEach(HAC, LLVM, &DLLHelper::load, LLDB, Clang, CGM.get());
   }
+  // Drops DLL functions that target apps (see `discoverUsage`) can't call, so
+  // that no wrappers are generated for them. The Objective-C runtime is always
+  // kept.
+  void pruneExports() {
+    if constexpr (!PruneWrappers)
+      return;
+    Log.info("pruning unused wrappers");
+    BuildTimer Timer("pruneExports");
+
+    auto IsUsed = [this](const ExportEntry &Exp) {
+      if (!Exp.getDylibType() || Exp.Messenger ||
+          UsedSymbols.count(Exp.Name) ||
+          (Exp.Dylib && Exp.Dylib->Name == "/usr/lib/libobjc.A.dylib"))
+        return true;
+      // Methods can be called by any app that sends their selector.
+      if (!Exp.ObjCMethod)
+        return false;
+      llvm::StringRef Sel(Exp.Name.split(' ').second);
+      return UsedSelectors.count(Sel.drop_back());
+    };
+    size_t Pruned = 0, Reached = 0;
+    for (DLLGroup &Group : HAC.DLLGroups)
+      for (DLLEntry &DLL : Group.DLLs) {
+        auto End = remove_if(DLL.Exports.begin(), DLL.Exports.end(),
+                             [&](ExportPtr Exp) {
+                               if (IsUsed(*Exp))
+                                 return false;
+                               if (CoveredSymbols.count(Exp->Name)) {
+                                 Log.warning()
+                                     << "function reached at runtime isn't "
+                                        "used by target apps ("
+                                     << Exp->Name << ")" << Log.end();
+                                 ++Reached;
+                                 return false;
+                               }
+                               Exp->Status = ExportStatus::Pruned;
+                               ++Pruned;
+                               return true;
+                             });
+        DLL.Exports.erase(End, DLL.Exports.end());
+      }
+    Log.info() << "pruned " << Pruned << " unused functions" << Log.end();
+    if (Reached)
+      Log.warning() << Reached
+                    << " functions were kept only thanks to "
+                       "wrapper_coverage.txt, add their apps to "
+                       "target_apps.txt or the functions to core_functions.txt"
+                    << Log.end();
+  }
+  // Orders wrappers by their call counts in `wrapper_profile.txt`, so that hot
+  // ones are emitted (and hence laid out by the linker) next to each other at
+  // the start of each Dylib and wrapper DLL. See `ProfileLayout`.
+  void applyProfile() {
+    if constexpr (!ProfileLayout)
+      return;
+
+    ifstream IS("./src/HeadersAnalyzer/wrapper_profile.txt");
+    if (!IS) {
+      Log.error("cannot open wrapper_profile.txt");
+      return;
+    }
+    llvm::StringMap<uint64_t> Counts;
+    string Line;
+    while (getline(IS, Line)) {
+      if (Line.empty() || Line[0] == '#')
+        continue;
+      auto [Count, Name] = llvm::StringRef(Line).split(' ');
+      uint64_t Value;
+      if (Count.getAsInteger(10, Value) || Name.empty()) {
+        Log.warning() << "invalid line in wrapper_profile.txt (" << Line << ")"
+                      << Log.end();
+        continue;
+      }
+      Counts[Name.trim()] += Value;
+    }
+    if (Counts.empty())
+      return;
+    Log.info("applying wrapper profile");
+    BuildTimer Timer("applyProfile");
+
+    // Cold wrappers keep their original order.
+    auto Sort = [&Counts](vector<ExportPtr> &Exports) {
+      stable_sort(Exports.begin(), Exports.end(),
+                  [&Counts](ExportPtr A, ExportPtr B) {
+                    return Counts.lookup(A->Name) > Counts.lookup(B->Name);
+                  });
+    };
+    for (DLLGroup &Group : HAC.DLLGroups)
+      for (DLLEntry &DLL : Group.DLLs)
+        Sort(DLL.Exports);
+    for (const Dylib &Lib : HAC.iOSLibs)
+      Sort(Lib.Exports);
+  }
   void createDirs() {
     DC.OutputDir = createOutputDir((DC.BuildDir / "cg/").string().c_str());
     DC.GenDir = createOutputDir((DC.BuildDir / "gen/").string().c_str());
+    if constexpr (IncrementalBuild)
+      BuildCache::Dir =
+          createOutputDir((DC.OutputDir / "cache/").string().c_str());
   }
   void generateDLLs() {
     Log.info("generating DLLs");
+    BuildTimer Timer("generateDLLs");
 
     // Generate DLL wrappers and also stub Dylibs for them.
-    DLLHelper::forEach(HAC, LLVM, &DLLHelper::generate, DC, Debug);
+    DLLHelper::forEach(HAC, LLVM, &DLLHelper::generate, DC, Tasks);
+  }
+  void linkDLLs() {
+    Log.info("linking DLLs");
+    BuildTimer Timer("linkDLLs");
+
+    // Offsets of all wrappers must be known. See `readWrapperOffsets`.
+    Tasks.wait();
+
+    DLLHelper::forEach(HAC, LLVM, &DLLHelper::link, DC, Debug, Tasks);
+    Tasks.wait();
   }
   void generateDylibs() {
     Log.info("generating Dylibs");
+    BuildTimer Timer("generateDylibs");
+
+    // With `MergedDylibs`, wrappers of all Dylibs are generated into one
+    // module and linked into one Dylib. Its exports then point to it.
+    optional<DylibModule> Merged;
+    DylibPtr MergedLib;
+    if constexpr (MergedDylibs) {
+      Merged.emplace(LLVM, "wrappers", MergedDylibName);
+      MergedLib = HAC.iOSLibs.insert(MergedDylibName).first;
+    }
 
     size_t Unimplemented = 0;
     for (auto [LibIdx, Lib] : withIndices(HAC.iOSLibs)) {
+      if (MergedLib && &Lib == &*MergedLib)
+        continue;
       string LibNo = to_string(LibIdx);
+      BuildTimer Timer(Lib.Name.str(), /* Job */ true);
+      BuildReport::count(BuildCounter::Exports, Lib.Exports.size());
 
-      IRHelper IR(LLVM, LibNo, Lib.Name, IRHelper::Apple);
+      optional<DylibModule> Own;
+      DylibModule &M = Merged ? *Merged : Own.emplace(LLVM, LibNo, Lib.Name);
+      IRHelper &IR = M.IR;
 
       // Generate function wrappers.
       // TODO: Shouldn't we use aligned instructions?
@@ -205,6 +733,15 @@ public:
           continue;
         }
 
+        // Methods of classes exported from more than one Dylib are generated
+        // into the merged module just once.
+        if (Merged) {
+          if (Exp->Dylib == MergedLib)
+            continue;
+          Exp->Dylib = MergedLib;
+          MergedLib->Exports.push_back(Exp);
+        }
+
         // Handle Objective-C messengers specially.
         if (Exp->Messenger) {
           // Now here comes the trick. We actually declare the `msgSend`
@@ -226,14 +763,15 @@ public:
           FunctionGuard MessengerGuard(IR, MessengerFunc);
 
           // Construct name of the corresponding lookup function.
-          Twine LookupName(Twine(HAContext::MsgLookupPrefix.S) +
-                           (Exp->Name.c_str() + HAContext::MsgSendPrefix.Len));
+          string LookupName(
+              (Twine(HAContext::MsgLookupPrefix.S) +
+               Exp->Name.drop_front(HAContext::MsgSendPrefix.Len))
+                  .str());
 
           // If the corresponding lookup function doesn't exist, don't call it
           // (so that we don't have unresolved references in the resulting
           // binary).
-          if (HAC.iOSExps.find(ExportEntry(LookupName.str())) ==
-              HAC.iOSExps.end()) {
+          if (!HAC.iOSExps.find(LookupName)) {
             Exp->UnhandledMessenger = true;
             Log.error() << "lookup function not found (" << LookupName << ")"
                         << Log.end();
@@ -251,19 +789,29 @@ public:
           for (llvm::Argument &Arg : MessengerFunc->args())
             Args.push_back(&Arg);
 
-          // Call the lookup function and jump to its result.
-          llvm::Value *IMP = IR.Builder.CreateCall(LookupFunc, Args, "imp");
+          // Messages to `super` are never sent to `nil`.
+          if (!Exp->Super && !Exp->Super2)
+            createNilCheck(IR, M.MsgNil, Args, Exp->Stret);
+
+          // Call the lookup function and jump to its result. Lookups of
+          // `super` calls start at a different class than `isa`, so they are
+          // not cached.
+          llvm::Value *IMP =
+              MessengerCaches && !Exp->Super && !Exp->Super2
+                  ? createCachedLookup(IR, M.Cache, M.Dispatch[Exp->Stret],
+                                       LookupFunc, Args, Exp->Stret)
+                  : IR.Builder.CreateCall(LookupFunc, Args, "imp");
           // Also replace `super` with `super->receiver` if necessary.
           if (Exp->Super || Exp->Super2) {
             llvm::Value *Super = Args[Exp->Stret ? 1 : 0];
             llvm::Value *SuperP = IR.Builder.CreateBitCast(
-                Super, llvm::Type::getInt32PtrTy(LLVM.Ctx), "superP");
+                Super, llvm::Type::getInt32PtrTy(IR.Ctx), "superP");
             llvm::Value *ReceiverP = IR.Builder.CreateConstInBoundsGEP1_32(
-                llvm::Type::getInt32Ty(LLVM.Ctx), SuperP, 0, "receiverP");
+                llvm::Type::getInt32Ty(IR.Ctx), SuperP, 0, "receiverP");
             llvm::Value *Receiver =
                 IR.Builder.CreateLoad(ReceiverP, "receiver");
             Args[Exp->Stret ? 1 : 0] =
-                IR.Builder.CreateIntToPtr(Receiver, LLVM.VoidPtrTy);
+                IR.Builder.CreateIntToPtr(Receiver, IR.VoidPtrTy);
           }
           llvm::CallInst *Call = IR.Builder.CreateCall(
               MessengerFunc->getFunctionType(), IMP, Args);
@@ -281,13 +829,87 @@ public:
 
         FunctionGuard FuncGuard(IR, Func);
 
+        // Let native code format arguments of variadic functions.
+        if (Exp->VaList) {
+          createVaListCall(IR, *Exp, Func);
+          continue;
+        }
+
+        // Access ivars directly if possible. See `InlineAccessors`.
+        if (Exp->Getter || Exp->Setter)
+          createAccessorFastPath(IR, *Exp, Func);
+
+        // Skip calls of memory management functions that would do nothing.
+        if constexpr (InlineRetainRelease)
+          createRetainReleaseFastPath(IR, *Exp, Func);
+
+        // Use the guest-side autorelease pool page.
+        if constexpr (InlineAutoreleasePools)
+          createAutoreleasePoolFastPath(IR, *Exp, Func);
+
+        // Use the guest-side malloc cache.
+        if (InlineMalloc && createMallocFastPath(IR, *Exp, Func))
+          continue;
+
         // Handle trivial `void -> void` functions specially.
         if (Exp->isTrivial()) {
-          IR.Builder.CreateCall(Wrapper);
+          if (Exp->HypercallID != ExportEntry::NoHypercall)
+            IR.createHypercall(Exp->HypercallID, nullptr);
+          else
+            IR.Builder.CreateCall(Wrapper);
           IR.Builder.CreateRetVoid();
           continue;
         }
 
+        // Record deferred calls. See `DeferredWrappers`.
+        if (Exp->Deferred)
+          createDeferredCall(IR, M.Flush, Func, Wrapper);
+
+        // Jump to DLL wrappers with `RegisterABI` keeping arguments in place.
+        // Host reads them from the emulated registers and stack.
+        if (Exp->RegisterABI) {
+          vector<llvm::Value *> Args;
+          Args.reserve(Func->arg_size());
+          for (llvm::Argument &Arg : Func->args())
+            Args.push_back(&Arg);
+          llvm::Value *Target = IR.Builder.CreateBitCast(
+              Wrapper, Func->getFunctionType()->getPointerTo());
+          llvm::CallInst *Call =
+              IR.Builder.CreateCall(Func->getFunctionType(), Target, Args);
+          Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+          if (Func->getReturnType()->isVoidTy())
+            IR.Builder.CreateRetVoid();
+          else
+            IR.Builder.CreateRet(Call);
+          continue;
+        }
+
+        // Wrappers with the same signature differ only by the DLL wrapper
+        // they call, so they pass its address to one shared body. Hypercall
+        // IDs are immediate operands, though. See `SharedWrappers`.
+        llvm::Function *Body = Func;
+        llvm::Value *Target = Wrapper;
+        optional<FunctionGuard> ShapeGuard;
+        if (SharedWrappers && Exp->HypercallID == ExportEntry::NoHypercall) {
+          llvm::Function *&Shape = M.Shapes[Exp->getDylibType()];
+          bool Defined = Shape;
+          if (!Defined)
+            Shape = IR.declareShapeFunc(Func->getFunctionType(),
+                                        Wrapper->getType());
+          IR.createShapeCall(Func, Shape, Wrapper);
+          if (Defined)
+            continue;
+
+          ShapeGuard.emplace(IR, Shape);
+          Body = Shape;
+          Target = &*prev(Shape->arg_end());
+        }
+        vector<llvm::Argument *> Params;
+        Params.reserve(Func->arg_size());
+        for (llvm::Argument &Arg : Body->args())
+          if (Arg.getArgNo() < Func->arg_size())
+            Params.push_back(&Arg);
+
         // TODO: For some reason, order matters here a lot. Other orderings can
         // even generate wrong machine code. Or does it? Maybe the bug was
         // somewhere else...
@@ -295,90 +917,79 @@ public:
         // Reserve space for arguments.
         vector<llvm::Value *> APs;
         vector<string> ArgNos;
-        APs.reserve(Func->arg_size());
-        ArgNos.reserve(Func->arg_size());
-        for (llvm::Argument &Arg : Func->args()) {
-          string ArgNo = to_string(Arg.getArgNo());
+        APs.reserve(Params.size());
+        ArgNos.reserve(Params.size());
+        for (llvm::Argument *Arg : Params) {
+          string ArgNo = to_string(Arg->getArgNo());
           ArgNos.push_back(ArgNo);
-          APs.push_back(IR.Builder.CreateAlloca(Arg.getType(), nullptr,
+          APs.push_back(IR.Builder.CreateAlloca(Arg->getType(), nullptr,
                                                 Twine("ap") + ArgNo));
         }
 
         // Allocate the struct.
         llvm::StructType *Struct = IR.createParamStruct(*Exp);
-        llvm::Value *SP = IR.Builder.CreateAlloca(Struct, nullptr, "sp");
+        llvm::AllocaInst *SP = IR.Builder.CreateAlloca(Struct, nullptr, "sp");
+        SP->setAlignment(IR.getAlign(Struct));
 
         // Load arguments.
-        for (auto [I, Arg] : withIndices(Func->args()))
-          IR.Builder.CreateStore(&Arg, APs[I]);
+        for (auto [I, Arg] : withIndices(Params))
+          IR.Builder.CreateStore(Arg, APs[I]);
 
         // Process arguments.
-        for (auto [I, Arg] : withIndices(Func->args())) {
+        for (auto [I, Arg] : withIndices(Params)) {
           // Get pointer to the corresponding structure's element.
           llvm::Value *EP = IR.Builder.CreateStructGEP(
-              Struct, SP, Arg.getArgNo(), Twine("ep") + ArgNos[I]);
+              Struct, SP, Arg->getArgNo(), Twine("ep") + ArgNos[I]);
 
           // Store argument address in it.
-          IR.Builder.CreateStore(APs[I], EP);
+          IR.Builder.CreateAlignedStore(APs[I], EP,
+                                        IR.getAlign(APs[I]->getType()));
         }
 
         // Call the DLL wrapper function.
-        llvm::Value *VP = IR.Builder.CreateBitCast(SP, LLVM.VoidPtrTy, "vp");
-        IR.Builder.CreateCall(Wrapper, {VP});
+        llvm::Value *VP = IR.Builder.CreateBitCast(SP, IR.VoidPtrTy, "vp");
+        if (Exp->HypercallID != ExportEntry::NoHypercall)
+          IR.createHypercall(Exp->HypercallID, VP);
+        else
+          IR.Builder.CreateCall(Wrapper->getFunctionType(), Target, {VP});
 
         // Return.
-        llvm::Type *RetTy = Exp->getDylibType()->getReturnType();
+        llvm::Type *RetTy = Func->getReturnType();
         if (!RetTy->isVoidTy()) {
 
           // Get pointer to the return value inside the struct.
-          llvm::Value *RP =
-              IR.Builder.CreateStructGEP(Struct, SP, Func->arg_size(), "rp");
+          llvm::Value *RP = IR.Builder.CreateStructGEP(
+              Struct, SP, Struct->getNumElements() - 1, "rp");
 
           // Load and return it.
-          llvm::Value *R = IR.Builder.CreateLoad(RP, "r");
+          llvm::Value *R =
+              IR.Builder.CreateAlignedLoad(RP, IR.getAlign(RetTy), "r");
           IR.Builder.CreateRet(R);
         } else
           IR.Builder.CreateRetVoid();
       }
 
+      if (Merged)
+        continue;
+
       // Emit `.o` file.
       string ObjectFile((DC.OutputDir / (LibNo + ".o")).string());
-      IR.emitObj(DC.BuildDir, ObjectFile);
-
-      // We add `./` to the library name to convert it to a relative path.
-      path DylibPath(DC.GenDir / ("./" + Lib.Name));
-
-      // Initialize LLD args to create the Dylib.
-      LLDHelper LLD(DC.BuildDir, LLVM);
-      LLD.addDylibArgs(DylibPath.string(), ObjectFile, Lib.Name);
-      LLD.Args.add(("-L" + DC.OutputDir.string()).c_str());
-
-      // Add DLLs to link.
-      {
-        set<pair<GroupPtr, DLLPtr>> DLLs;
-        for (const ExportEntry &Exp : deref(Lib.Exports))
-          if (Exp.Status == ExportStatus::FoundInDLL &&
-              DLLs.insert({Exp.DLLGroup, Exp.DLL}).second) {
-            LLD.Args.add(
-                ("-l" + path(HAC.DLLGroups[Exp.DLLGroup].DLLs[Exp.DLL].Name)
-                            .replace_extension(".dll")
-                            .string())
-                    .c_str());
-          }
-      }
-
-      // Add re-exports.
-      for (auto &ReExport : Lib.ReExports) {
-        DLLGroup &Group = HAC.DLLGroups[ReExport.first];
-        DLLEntry &DLL = Group.DLLs[ReExport.second];
-        LLD.reexportLibrary(DLL.Name);
-      }
-
-      // Create output directory.
-      createOutputDir(DylibPath.parent_path().string().c_str());
+      linkDylib(Lib, ObjectFile, {IR.emitObj(ObjectFile, Tasks)});
+    }
 
-      // Link the Dylib.
-      LLD.executeArgs();
+    if (Merged) {
+      string ObjectFile((DC.OutputDir / "wrappers.o").string());
+      TaskGraph::Task *MergedTask = linkDylib(
+          *MergedLib, ObjectFile, {Merged->IR.emitObj(ObjectFile, Tasks)});
+
+      // The original Dylibs only re-export the merged one, so they are linked
+      // from an empty object file.
+      string StubFile((DC.OutputDir / "stub.o").string());
+      TaskGraph::Task *StubTask =
+          DylibModule(LLVM, "stub", "stub").IR.emitObj(StubFile, Tasks);
+      for (const Dylib &Lib : HAC.iOSLibs)
+        if (&Lib != &*MergedLib)
+          linkStubDylib(Lib, StubFile, {MergedTask, StubTask});
     }
 
     if constexpr (SumUnimplementedFunctions & LibType::DLL)
@@ -386,6 +997,96 @@ public:
         Log.error() << "functions found in Dylibs weren't found in any DLL ("
                     << Unimplemented << ")" << Log.end();
   }
+  // Install name of the Dylib containing all Dylib wrappers if `MergedDylibs`
+  // is enabled.
+  static constexpr const char *MergedDylibName =
+      "/usr/lib/libipasim_wrappers.dylib";
+  // We add `./` to the library name to convert it to a relative path.
+  path getDylibPath(const Dylib &Lib) {
+    return DC.GenDir / ("./" + Lib.Name.str());
+  }
+  // Adds re-exports of data symbols of `Lib` (see #23) into `LLD`.
+  void addReExports(const Dylib &Lib, LLDHelper &LLD,
+                    vector<TaskGraph::Task *> &Deps) {
+    for (auto &ReExport : Lib.ReExports) {
+      DLLGroup &Group = HAC.DLLGroups[ReExport.first];
+      DLLEntry &DLL = Group.DLLs[ReExport.second];
+      LLD.reexportLibrary(DLL.Name);
+      Deps.push_back(DLL.StubTask);
+    }
+  }
+  // Makes `LLD` link the Dylib at its own address (see `DylibImageBase`).
+  void addImageBase(LLDHelper &LLD) {
+    if constexpr (DylibImageBase != 0) {
+      LLD.Args.add("-image_base");
+      LLD.Args.add(("0x" + to_hex_string(NextImageBase)).c_str());
+      NextImageBase += DylibImageStride;
+    }
+  }
+  // Links Dylib `Lib` from `ObjectFile` once tasks `Deps` (which should emit
+  // it) are done. Returns the scheduled task.
+  TaskGraph::Task *linkDylib(const Dylib &Lib, const string &ObjectFile,
+                             vector<TaskGraph::Task *> Deps) {
+    path DylibPath(getDylibPath(Lib));
+
+    // Initialize LLD args to create the Dylib.
+    auto LLD = make_shared<LLDHelper>(DC.BuildDir, LLVM);
+    LLD->addDylibArgs(DylibPath.string(), ObjectFile, Lib.Name);
+    addImageBase(*LLD);
+    LLD->Args.add(("-L" + DC.OutputDir.string()).c_str());
+
+    // Add DLLs to link. Their stub Dylibs must be linked first.
+    set<pair<GroupPtr, DLLPtr>> DLLs;
+    for (const ExportEntry &Exp : deref(Lib.Exports))
+      if (Exp.Status == ExportStatus::FoundInDLL &&
+          DLLs.insert({Exp.DLLGroup, Exp.DLL}).second) {
+        DLLEntry &DLL = HAC.DLLGroups[Exp.DLLGroup].DLLs[Exp.DLL];
+        LLD->Args.add(
+            ("-l" + path(DLL.Name).replace_extension(".dll").string())
+                .c_str());
+        Deps.push_back(DLL.StubTask);
+      }
+
+    addReExports(Lib, *LLD, Deps);
+
+    // Re-export methods of classes shared with Dylibs linked before this one.
+    for (DylibPtr Other : Lib.DylibReExports) {
+      if (!Other->LinkTask) {
+        Log.error() << "cannot re-export " << Other->Name << " from "
+                    << Lib.Name << Log.end();
+        continue;
+      }
+      LLD->reexportLibrary(getDylibPath(*Other).string());
+      Deps.push_back(Other->LinkTask);
+    }
+
+    // Create output directory.
+    createOutputDir(DylibPath.parent_path().string().c_str());
+
+    // Link the Dylib. Each task updates only exports of its own Dylib.
+    return Lib.LinkTask = Tasks.add(
+        [this, LLD, DylibPath, Lib = &Lib] {
+          LLD->executeArgs();
+          readWrapperOffsets(DylibPath, *Lib);
+        },
+        Deps);
+  }
+  // Links Dylib `Lib` which only re-exports the merged Dylib (see
+  // `MergedDylibs`) and data symbols.
+  void linkStubDylib(const Dylib &Lib, const string &ObjectFile,
+                     vector<TaskGraph::Task *> Deps) {
+    path DylibPath(getDylibPath(Lib));
+
+    auto LLD = make_shared<LLDHelper>(DC.BuildDir, LLVM);
+    LLD->addDylibArgs(DylibPath.string(), ObjectFile, Lib.Name);
+    addImageBase(*LLD);
+    LLD->reexportLibrary(
+        (DC.GenDir / ("./" + string(MergedDylibName))).string());
+    addReExports(Lib, *LLD, Deps);
+
+    createOutputDir(DylibPath.parent_path().string().c_str());
+    Tasks.add([LLD] { LLD->executeArgs(); }, Deps);
+  }
   void writeExports() {
     auto ExportsOS = createOutputFile((DC.OutputDir / "exports.txt").string());
     if (!ExportsOS)
@@ -398,12 +1099,29 @@ public:
                    << HAC.DLLGroups[Exp.DLLGroup].DLLs[Exp.DLL].Name << " at "
                    << llvm::format_hex(Exp.RVA, 8) << ")\n";
   }
+  void writeObjCPreopt() {
+    Log.info("writing Objective-C preoptimization data");
+    BuildTimer Timer("writeObjCPreopt");
+
+    path Path(DC.GenDir / "objc-preopt.bin");
+    ofstream OS(Path, ios::binary);
+    if (!OS) {
+      Log.error() << "cannot write " << Path.string() << Log.end();
+      return;
+    }
+    HAC.Preopt.write(OS);
+  }
   void writeReport() {
     auto ReportOS = createOutputFile((DC.OutputDir / "report.csv").string());
     if (!ReportOS)
       return;
 
-    *ReportOS << "name,status,func,dll,rva,un_vararg,un_msg\n";
+    // Numbers of functions of each `WrapperShape` per Dylib.
+    using ShapeCounts =
+        array<size_t, static_cast<size_t>(WrapperShape::Count)>;
+    map<llvm::StringRef, ShapeCounts> Summary;
+
+    *ReportOS << "name,status,func,dll,rva,un_vararg,un_msg,shape,arg_words\n";
     for (const ExportEntry &Exp : HAC.iOSExps) {
       *ReportOS << Exp.Name << "," << static_cast<uint32_t>(Exp.Status) << ","
                 << (Exp.getDylibType() ? "1," : "0,");
@@ -413,9 +1131,39 @@ public:
       else
         *ReportOS << ",,";
       *ReportOS << (Exp.UnhandledVararg ? "1," : "0,")
-                << (Exp.UnhandledMessenger ? "1\n" : "0\n");
+                << (Exp.UnhandledMessenger ? "1," : "0,");
+
+      WrapperShape Shape = Exp.getShape();
+      *ReportOS << toString(Shape) << ",";
+      if (optional<size_t> Words = Exp.getArgWords())
+        *ReportOS << *Words;
+      *ReportOS << "\n";
+
+      if (Shape != WrapperShape::None && Exp.Dylib) {
+        auto It = Summary.try_emplace(Exp.Dylib->Name).first;
+        ++It->second[static_cast<size_t>(Shape)];
+      }
+    }
+
+    auto SummaryOS =
+        createOutputFile((DC.OutputDir / "report-summary.csv").string());
+    if (!SummaryOS)
+      return;
+    *SummaryOS << "dylib";
+    for (size_t I = 1; I != static_cast<size_t>(WrapperShape::Count); ++I)
+      *SummaryOS << "," << toString(static_cast<WrapperShape>(I));
+    *SummaryOS << "\n";
+    for (const auto &[Name, Counts] : Summary) {
+      *SummaryOS << Name;
+      for (size_t I = 1; I != Counts.size(); ++I)
+        *SummaryOS << "," << Counts[I];
+      *SummaryOS << "\n";
     }
   }
+  // Should be called last, so that all phases are included. See `BuildReport`.
+  void writeBuildReport() {
+    BuildReport::write((DC.OutputDir / "build-report.json").string());
+  }
 
 private:
   HAContext HAC;
@@ -423,11 +1171,22 @@ private:
   LLVMHelper LLVM;
   DirContext DC;
   bool Debug;
+  // Filled by `discoverUsage`, see `PruneWrappers`.
+  llvm::StringSet<> UsedSymbols, UsedSelectors, CoveredSymbols;
+  // Runs Clang and LLD while wrappers are generated. See `TaskGraph`.
+  TaskGraph Tasks{CodeGenJobs};
+  // Address the next Dylib is linked at, see `DylibImageBase`.
+  uint64_t NextImageBase = DylibImageBase;
 
   void analyzeAppleFunction(const llvm::Function &Func) {
     // We use mangled names to uniquely identify functions.
     string Name(LLVM.mangleName(Func));
 
+    // See `OverloadSuffix`.
+    size_t Suffix = Name.find(OverloadSuffix);
+    if (Suffix != string::npos)
+      Name.erase(Suffix);
+
     analyzeAppleFunction(Name, Func.getFunctionType());
   }
   void analyzeAppleFunction(const string &Name, llvm::FunctionType *Type) {
@@ -454,29 +1213,891 @@ private:
     // Save the function's signature.
     Exp->setType(Type);
   }
-  void compileAppleHeaders() {
-    ClangHelper Clang(DC.BuildDir, LLVM);
-    Clang.Args.loadConfigFile("./src/HeadersAnalyzer/analyze_ios_headers.cfg");
+  // Headers are compiled in parts, each one is `iOSHeaders.mm` with only
+  // `#include`s of one framework (and lines following them). Other lines
+  // (e.g., conditional directives) are kept in all parts.
+  struct HeadersPart {
+    string Name;
+    string Source;
+    llvm::SmallVector<char, 0> Bitcode;
+    vector<string> Deps; // Files included by the part
+    bool Failed = false;
+  };
+  static constexpr const char *HeadersPath =
+      "src/HeadersAnalyzer/iOSHeaders.mm";
+  // Functions declared with different types by different parts are renamed
+  // with this suffix (followed by a number), so that they are reported as
+  // overloaded.
+  static constexpr const char *OverloadSuffix = "$__ipaSim_overload_";
+  void addAppleHeadersArgs(StringVector &Args) {
+    Args.loadConfigFile("./src/HeadersAnalyzer/analyze_ios_headers.cfg");
     if constexpr (Sample)
-      Clang.Args.add("-DIPASIM_CG_SAMPLE");
-    Clang.initFromInvocation();
+      Args.add("-DIPASIM_CG_SAMPLE");
+  }
+  vector<HeadersPart> splitAppleHeaders() {
+    auto Buffer = llvm::MemoryBuffer::getFile(HeadersPath);
+    if (!Buffer)
+      Log.fatalError("cannot read iOSHeaders.mm");
+
+    // Find owners of lines. Empty owner means all parts.
+    vector<pair<llvm::StringRef, size_t>> Lines;
+    vector<HeadersPart> Parts;
+    llvm::StringMap<size_t> PartIndices;
+    optional<size_t> Current;
+    llvm::SmallVector<llvm::StringRef, 0> RawLines;
+    (*Buffer)->getBuffer().split(RawLines, '\n');
+    for (llvm::StringRef Line : RawLines) {
+      llvm::StringRef Trimmed(Line.trim());
+      if (Trimmed.consume_front("#include <")) {
+        // Headers outside of frameworks belong to the previous part.
+        llvm::StringRef Header(
+            Trimmed.take_until([](char C) { return C == '>'; }));
+        if (Header.contains('/') || !Current) {
+          llvm::StringRef Name(Header.split('/').first);
+          auto [It, New] = PartIndices.try_emplace(Name, Parts.size());
+          if (New)
+            Parts.push_back(HeadersPart{Name.str()});
+          Current = It->second;
+        }
+        Lines.emplace_back(Line, *Current);
+      } else if (Trimmed.startswith("#") || !Current)
+        Lines.emplace_back(Line, SIZE_MAX);
+      else
+        Lines.emplace_back(Line, *Current);
+    }
 
-    // Include all declarations in the result. See [emit-all-decls].
-    // TODO: Maybe filter them (include only those exported from iOS Dylibs).
-    Clang.CI.getLangOpts().EmitAllDecls = true;
+    // Lines of other parts are left empty, so that line numbers stay the same.
+    for (auto [I, Part] : withIndices(Parts))
+      for (auto [Line, Owner] : Lines) {
+        if (Owner == SIZE_MAX || Owner == I)
+          Part.Source += Line;
+        Part.Source += '\n';
+      }
+    return Parts;
+  }
+  // Runs in `Tasks`, so it uses its own `LLVMContext`.
+  void compileAppleHeaders(HeadersPart &Part) {
+    try {
+      LLVMHelper PartLLVM(LLVMInit);
+      ClangHelper Clang(DC.BuildDir, PartLLVM);
+      addAppleHeadersArgs(Clang.Args);
+      Clang.initFromInvocation();
+
+      // Compile source of the part instead of `iOSHeaders.mm`.
+      Clang.CI.getPreprocessorOpts().addRemappedFile(
+          HeadersPath,
+          llvm::MemoryBuffer::getMemBufferCopy(Part.Source, HeadersPath)
+              .release());
+
+      // Include all declarations in the result. See [emit-all-decls]. Unless
+      // `FilterAppleDecls` is disabled, only those exported from iOS Dylibs
+      // are actually included, though.
+      Clang.CI.getLangOpts().EmitAllDecls = true;
+
+      // But don't emit bodies, we don't need them. See [emit-bodies].
+      Clang.CI.getLangOpts().EmitBodies = false;
+
+      // Compile to LLVM IR.
+      if constexpr (FilterAppleDecls) {
+        FilteredEmitLLVMAction Act(HAC, &PartLLVM.Ctx);
+        Clang.executeCodeGenAction(Act);
+      } else
+        Clang.executeCodeGenAction<EmitLLVMOnlyAction>();
+
+      // The module is passed to the main thread as bitcode.
+      if (llvm::Module *Module = PartLLVM.getModule()) {
+        llvm::raw_svector_ostream OS(Part.Bitcode);
+        llvm::WriteBitcodeToFile(*Module, OS);
+      }
+
+      SourceManager &SM = Clang.CI.getSourceManager();
+      for (auto It = SM.fileinfo_begin(), End = SM.fileinfo_end(); It != End;
+           ++It)
+        Part.Deps.push_back(It->first->getName().str());
+    } catch (const FatalError &) {
+      Part.Failed = true;
+    }
+  }
+  // Moves declarations of all parts into one module. `IRMover` maps equivalent
+  // types of different parts to the same type, so that signatures can be
+  // compared.
+  void mergeAppleHeaders(vector<HeadersPart> &Parts) {
+    auto Merged = std::make_unique<llvm::Module>("iOSHeaders", LLVM.Ctx);
+    llvm::IRMover Mover(*Merged);
+    size_t Overloads = 0;
+    for (HeadersPart &Part : Parts) {
+      if (Part.Bitcode.empty())
+        continue;
+      auto Module = llvm::parseBitcodeFile(
+          llvm::MemoryBufferRef(
+              llvm::StringRef(Part.Bitcode.data(), Part.Bitcode.size()),
+              Part.Name),
+          LLVM.Ctx);
+      if (!Module) {
+        llvm::consumeError(Module.takeError());
+        Log.fatalError("cannot load Apple headers (" + Part.Name + ")");
+      }
 
-    // But don't emit bodies, we don't need them. See [emit-bodies].
-    Clang.CI.getLangOpts().EmitBodies = false;
+      // Functions declared by previous parts are moved under different names
+      // and then compared.
+      vector<llvm::GlobalValue *> Funcs;
+      vector<pair<string, string>> Renamed;
+      for (llvm::Function &Func : **Module) {
+        if (Merged->getFunction(Func.getName())) {
+          string Name(Func.getName().str());
+          Func.setName(Name + OverloadSuffix + to_string(Overloads++));
+          Renamed.emplace_back(move(Name), Func.getName().str());
+        }
+        Funcs.push_back(&Func);
+      }
+      if (llvm::Error Err = Mover.move(
+              move(*Module), Funcs,
+              [](llvm::GlobalValue &, llvm::IRMover::ValueAdder) {},
+              /* IsPerformingImport */ false)) {
+        llvm::consumeError(move(Err));
+        Log.fatalError("cannot merge Apple headers (" + Part.Name + ")");
+      }
+      for (auto &[Name, NewName] : Renamed) {
+        llvm::Function *Func = Merged->getFunction(Name);
+        llvm::Function *Other = Merged->getFunction(NewName);
+        if (Func && Other &&
+            Func->getFunctionType() == Other->getFunctionType())
+          Other->eraseFromParent();
+      }
 
-    // Compile to LLVM IR.
-    Clang.executeCodeGenAction<EmitLLVMOnlyAction>();
+      // Free memory early.
+      Part.Bitcode.clear();
+      Part.Bitcode.shrink_to_fit();
+    }
+    LLVM.setModule(move(Merged));
+  }
+  // IR of Apple headers contains only declarations, so it serves as a database
+  // of their signatures. It's saved as bitcode, along with a list of headers it
+  // was compiled from. Inputs of `BuildCache` are arguments of the compilation
+  // and contents of those headers.
+  string getSignaturesPath() {
+    return (DC.OutputDir / "apple-headers.bc").string();
+  }
+  // With `FilterAppleDecls`, the emitted declarations depend on TBD files, too.
+  void addFilterInputs(BuildCache &Cache) {
+    if constexpr (FilterAppleDecls) {
+      for (const ExportEntry &Exp : HAC.iOSExps)
+        Cache.add(Exp.Name);
+      for (const ClassExport &Class : HAC.iOSClasses)
+        Cache.add(Class.Name);
+    }
+  }
+  bool loadAppleSignatures(llvm::ArrayRef<const char *> Args) {
+    if constexpr (!IncrementalBuild)
+      return false;
+
+    string Path(getSignaturesPath());
+    ifstream DepsIS(Path + ".deps");
+    if (!DepsIS)
+      return false;
+    BuildCache Cache;
+    Cache.addArgs(Args, /* Output */ "");
+    addFilterInputs(Cache);
+    for (string Dep; getline(DepsIS, Dep);)
+      if (!Cache.addFile(Dep))
+        return false;
+    if (!Cache.isUpToDate(Path))
+      return false;
+
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer)
+      return false;
+    auto Module = llvm::parseBitcodeFile(**Buffer, LLVM.Ctx);
+    if (!Module) {
+      llvm::consumeError(Module.takeError());
+      Log.error("cannot load signatures of Apple headers");
+      return false;
+    }
+    LLVM.setModule(move(*Module));
+    Log.info("loaded signatures of Apple headers");
+    return true;
+  }
+  void saveAppleSignatures(llvm::ArrayRef<const char *> Args,
+                           const vector<string> &Deps) {
+    if constexpr (!IncrementalBuild)
+      return;
+
+    string Path(getSignaturesPath());
+    BuildCache Cache;
+    Cache.addArgs(Args, /* Output */ "");
+    addFilterInputs(Cache);
+    {
+      auto DepsOS(createOutputFile(Path + ".deps"));
+      if (!DepsOS)
+        return;
+      for (const string &Dep : Deps)
+        if (Cache.addFile(Dep))
+          *DepsOS << Dep << '\n';
+    }
+    {
+      auto OS(createOutputFile(Path));
+      if (!OS)
+        return;
+      llvm::WriteBitcodeToFile(*LLVM.getModule(), *OS);
+    }
+    Cache.update(Path);
+  }
+  // Emits code that returns zero if the receiver is `nil`, so that such
+  // messages don't cross into the host. Like Apple's `objc_msgSend_stret`, we
+  // leave the returned structure untouched in that case. Note that there are
+  // no tagged pointers on 32-bit ARM, so other receivers cannot be handled
+  // without looking at their class.
+  void createNilCheck(IRHelper &IR, llvm::Function *&MsgNil,
+                      llvm::ArrayRef<llvm::Value *> Args, bool Stret) {
+    using namespace llvm;
+
+    // Returning zero in both R0 and R1 covers also 64-bit and floating-point
+    // results (iOS uses the soft-float calling convention).
+    if (!MsgNil)
+      MsgNil = IR.defineNakedFunc(LLVM.SendTy, "ipaSim_msgNil",
+                                  "mov r0, #0\n\tmov r1, #0\n\tbx lr");
+
+    IRBuilder<> &B = IR.Builder;
+    Function *Func = B.GetInsertBlock()->getParent();
+    BasicBlock *NilBB = BasicBlock::Create(IR.Ctx, "nil", Func);
+    BasicBlock *SendBB = BasicBlock::Create(IR.Ctx, "send", Func);
+    B.CreateCondBr(B.CreateIsNull(Args[Stret ? 1 : 0], "isNil"), NilBB, SendBB);
+
+    B.SetInsertPoint(NilBB);
+    if (!Stret) {
+      CallInst *Call = B.CreateCall(MsgNil, Args);
+      Call->setTailCallKind(CallInst::TCK_MustTail);
+    }
+    B.CreateRetVoid();
+
+    B.SetInsertPoint(SendBB);
+  }
+  // Emits load or store of the ivar accessed by `Exp` into `Func`. It falls
+  // through to code emitted after it if the receiver is `nil`.
+  void createAccessorFastPath(IRHelper &IR, const ExportEntry &Exp,
+                              llvm::Function *Func) {
+    using namespace llvm;
+
+    IRBuilder<> &B = IR.Builder;
+    Value *Self = &*Func->arg_begin();
+    BasicBlock *FastBB = BasicBlock::Create(IR.Ctx, "fast", Func);
+    BasicBlock *SlowBB = BasicBlock::Create(IR.Ctx, "slow", Func);
+    B.CreateCondBr(B.CreateIsNull(Self, "isNil"), SlowBB, FastBB);
+
+    B.SetInsertPoint(FastBB);
+    Value *SelfP = B.CreateBitCast(Self, IR.VoidPtrTy, "selfP");
+    Value *IvarP = B.CreateConstInBoundsGEP1_32(Type::getInt8Ty(IR.Ctx), SelfP,
+                                                Exp.IvarOffset, "ivarP");
+    if (Exp.Getter) {
+      Type *RetTy = Func->getReturnType();
+      Value *P = B.CreateBitCast(IvarP, RetTy->getPointerTo());
+      B.CreateRet(B.CreateAlignedLoad(P, IR.getAlign(RetTy), "ivar"));
+    } else {
+      Value *Arg = &*std::next(Func->arg_begin(), 2);
+      Value *P = B.CreateBitCast(IvarP, Arg->getType()->getPointerTo());
+      B.CreateAlignedStore(Arg, P, IR.getAlign(Arg->getType()));
+      B.CreateRetVoid();
+    }
+
+    B.SetInsertPoint(SlowBB);
+  }
+  // Emits a return from `Func` for arguments `Exp` doesn't do anything with
+  // if it's one of `NilRetainReleases` or `objc_storeStrong`. Otherwise, or
+  // for other arguments, it falls through to code emitted after it.
+  void createRetainReleaseFastPath(IRHelper &IR, const ExportEntry &Exp,
+                                   llvm::Function *Func) {
+    using namespace llvm;
+
+    bool Store = Exp.Name == StoreStrong.S;
+    if (!Store && none_of(begin(NilRetainReleases), end(NilRetainReleases),
+                          [&](const char *Name) { return Exp.Name == Name; }))
+      return;
+    if (Func->arg_size() != (Store ? 2 : 1))
+      return;
+
+    IRBuilder<> &B = IR.Builder;
+    Value *Obj = &*prev(Func->arg_end());
+    Value *Skip;
+    if (Store) {
+      // `objc_storeStrong(location, obj)` with `*location == obj`.
+      Value *Location = &*Func->arg_begin();
+      Value *P = B.CreateBitCast(Location, Obj->getType()->getPointerTo());
+      Value *Current =
+          B.CreateAlignedLoad(P, IR.getAlign(Obj->getType()), "current");
+      Skip = B.CreateICmpEQ(Current, Obj, "same");
+    } else
+      Skip = B.CreateIsNull(Obj, "isNil");
+    BasicBlock *FastBB = BasicBlock::Create(IR.Ctx, "fast", Func);
+    BasicBlock *SlowBB = BasicBlock::Create(IR.Ctx, "slow", Func);
+    B.CreateCondBr(Skip, FastBB, SlowBB);
+
+    B.SetInsertPoint(FastBB);
+    Type *RetTy = Func->getReturnType();
+    if (RetTy->isVoidTy())
+      B.CreateRetVoid();
+    else
+      B.CreateRet(Constant::getNullValue(RetTy));
+
+    B.SetInsertPoint(SlowBB);
+  }
+  // Emits code that pushes a pool, pops it or autoreleases an object in the
+  // current thread's `GuestPoolPage` if `Exp` is `objc_autoreleasePoolPush`,
+  // `objc_autoreleasePoolPop` or `objc_autorelease`, respectively. If the page
+  // cannot be used, it falls through to code emitted after it.
+  void createAutoreleasePoolFastPath(IRHelper &IR, const ExportEntry &Exp,
+                                     llvm::Function *Func) {
+    using namespace llvm;
+
+    enum { Push, Pop, Add } Kind;
+    if (Exp.Name == PoolPush.S && Func->arg_size() == 0)
+      Kind = Push;
+    else if (Exp.Name == PoolPop.S && Func->arg_size() == 1)
+      Kind = Pop;
+    else if (Exp.Name == Autorelease.S && Func->arg_size() == 1)
+      Kind = Add;
+    else
+      return;
+
+    IRBuilder<> &B = IR.Builder;
+    Type *Int32Ty = B.getInt32Ty();
+    Type *Int32PtrTy = Int32Ty->getPointerTo();
+    BasicBlock *PageBB = BasicBlock::Create(IR.Ctx, "page", Func);
+    BasicBlock *FastBB = BasicBlock::Create(IR.Ctx, "fast", Func);
+    BasicBlock *SlowBB = BasicBlock::Create(IR.Ctx, "slow", Func);
+
+    // Find the page. The lowest bits of TPIDRURO are reserved for the CPU
+    // number on iOS.
+    Value *TSD = B.CreateIntToPtr(
+        B.CreateAnd(IR.createThreadPointer(), ~3U, "tsd"), Int32PtrTy);
+    Value *PageAddr = B.CreateAlignedLoad(
+        B.CreateConstInBoundsGEP1_32(Int32Ty, TSD,
+                                     GuestTSD::AutoreleasePoolKey),
+        4, "pageAddr");
+    B.CreateCondBr(B.CreateIsNull(PageAddr, "noPage"), SlowBB, PageBB);
+
+    // Words of the page are `Used`, `Top` and `Objects`.
+    B.SetInsertPoint(PageBB);
+    Value *Page = B.CreateIntToPtr(PageAddr, Int32PtrTy, "page");
+    Value *UsedP = B.CreateConstInBoundsGEP1_32(Int32Ty, Page, 0, "usedP");
+    Value *TopP = B.CreateConstInBoundsGEP1_32(Int32Ty, Page, 1, "topP");
+    Value *Objects = B.CreateConstInBoundsGEP1_32(Int32Ty, Page, 2, "objects");
+    auto ObjectP = [&](Value *Idx, const Twine &Name) {
+      return B.CreateInBoundsGEP(Int32Ty, Objects, Idx, Name);
+    };
+    Value *Used = B.CreateAlignedLoad(UsedP, 4, "used");
+    Value *Top = B.CreateAlignedLoad(TopP, 4, "top");
+    Type *RetTy = Func->getReturnType();
+
+    switch (Kind) {
+    case Push: {
+      // Push a boundary without native pool (see `SysTranslator::syncPools`).
+      B.CreateCondBr(
+          B.CreateICmpULE(
+              Used,
+              B.getInt32(GuestPoolPage::Size - GuestPoolPage::BoundaryWords),
+              "fits"),
+          FastBB, SlowBB);
+      B.SetInsertPoint(FastBB);
+      Value *BoundaryP = ObjectP(Used, "boundaryP");
+      B.CreateAlignedStore(
+          B.CreateOr(B.CreateShl(Top, 1), GuestPoolPage::Tag), BoundaryP, 4);
+      B.CreateAlignedStore(B.getInt32(GuestPoolPage::Tag),
+                           B.CreateConstInBoundsGEP1_32(Int32Ty, BoundaryP, 1),
+                           4);
+      Value *NewUsed =
+          B.CreateAdd(Used, B.getInt32(GuestPoolPage::BoundaryWords), "end");
+      B.CreateAlignedStore(NewUsed, TopP, 4);
+      B.CreateAlignedStore(NewUsed, UsedP, 4);
+      B.CreateRet(B.CreateBitCast(BoundaryP, RetTy));
+      break;
+    }
+    case Pop: {
+      // Native tokens are popped by the runtime.
+      Value *Token = B.CreatePtrToInt(&*Func->arg_begin(), Int32Ty, "token");
+      Value *Offset =
+          B.CreateSub(Token, B.CreatePtrToInt(Objects, Int32Ty), "offset");
+      BasicBlock *DrainBB = BasicBlock::Create(IR.Ctx, "drain", Func);
+      BasicBlock *CheckBB = BasicBlock::Create(IR.Ctx, "check", Func);
+      B.CreateCondBr(B.CreateICmpULT(
+                         Offset, B.getInt32(GuestPoolPage::Size * 4), "inPage"),
+                     CheckBB, SlowBB);
+
+      // The pool is empty if nothing was pushed after its boundary and it
+      // has no native pool.
+      B.SetInsertPoint(CheckBB);
+      Value *Idx = B.CreateLShr(Offset, 2, "idx");
+      Value *BoundaryP = ObjectP(Idx, "boundaryP");
+      Value *Native = B.CreateAlignedLoad(
+          B.CreateConstInBoundsGEP1_32(Int32Ty, BoundaryP, 1), 4, "native");
+      Value *Empty = B.CreateAnd(
+          B.CreateICmpEQ(
+              Used,
+              B.CreateAdd(Idx, B.getInt32(GuestPoolPage::BoundaryWords)),
+              "last"),
+          B.CreateICmpEQ(Native, B.getInt32(GuestPoolPage::Tag), "lazy"),
+          "empty");
+      B.CreateCondBr(Empty, FastBB, DrainBB);
+
+      B.SetInsertPoint(FastBB);
+      Value *Prev = B.CreateAlignedLoad(BoundaryP, 4, "prev");
+      B.CreateAlignedStore(B.CreateLShr(Prev, 1), TopP, 4);
+      B.CreateAlignedStore(Idx, UsedP, 4);
+      B.CreateRetVoid();
+
+      // Objects must be released by the host.
+      B.SetInsertPoint(DrainBB);
+      IR.createHypercall(GuestPoolPage::DrainID, Token);
+      B.CreateRetVoid();
+      break;
+    }
+    case Add: {
+      // Autorelease into the innermost guest pool, if there's one. The room
+      // must be the same as for pushing a boundary (see `Push`). Otherwise,
+      // after a push fell back to a native pool, the object would still go
+      // to the enclosing guest pool.
+      Value *Fits = B.CreateAnd(
+          B.CreateICmpNE(Top, B.getInt32(0), "hasPool"),
+          B.CreateICmpULE(
+              Used,
+              B.getInt32(GuestPoolPage::Size - GuestPoolPage::BoundaryWords),
+              "hasRoom"),
+          "fits");
+      B.CreateCondBr(Fits, FastBB, SlowBB);
+      B.SetInsertPoint(FastBB);
+      Value *Obj = &*Func->arg_begin();
+      B.CreateAlignedStore(B.CreatePtrToInt(Obj, Int32Ty),
+                           ObjectP(Used, "objP"), 4);
+      B.CreateAlignedStore(B.CreateAdd(Used, B.getInt32(1)), UsedP, 4);
+      B.CreateRet(B.CreateBitCast(Obj, RetTy));
+      break;
+    }
+    }
+
+    B.SetInsertPoint(SlowBB);
+  }
+  // Emits code that allocates or frees a block using the current thread's
+  // `GuestMallocCache` if `Exp` is `malloc` or `free`, respectively. Blocks it
+  // doesn't cache (or all blocks if the thread has no cache) are passed to the
+  // "kernel" functions. Returns `false` if nothing has been emitted.
+  bool createMallocFastPath(IRHelper &IR, const ExportEntry &Exp,
+                            llvm::Function *Func) {
+    using namespace llvm;
+    using Cache = GuestMallocCache;
+
+    bool IsMalloc = Exp.Name == Malloc.S;
+    if ((!IsMalloc && Exp.Name != Free.S) || Func->arg_size() != 1)
+      return false;
+
+    IRBuilder<> &B = IR.Builder;
+    Type *Int32Ty = B.getInt32Ty();
+    Type *Int32PtrTy = Int32Ty->getPointerTo();
+    BasicBlock *CacheBB = BasicBlock::Create(IR.Ctx, "cache", Func);
+    BasicBlock *FastBB = BasicBlock::Create(IR.Ctx, "fast", Func);
+    BasicBlock *KernelBB = BasicBlock::Create(IR.Ctx, "kernel", Func);
+    auto Word = [&](Value *Base, uint32_t Idx, const Twine &Name) {
+      return B.CreateConstInBoundsGEP1_32(Int32Ty, Base, Idx, Name);
+    };
+    auto Load = [&](Value *P, const Twine &Name) {
+      return B.CreateAlignedLoad(P, 4, Name);
+    };
+
+    // Find the cache.
+    Value *TSD = B.CreateIntToPtr(
+        B.CreateAnd(IR.createThreadPointer(), ~3U, "tsd"), Int32PtrTy);
+    Value *CacheAddr =
+        Load(Word(TSD, GuestTSD::MallocCacheKey, "cacheP"), "cacheAddr");
+    B.CreateCondBr(B.CreateIsNull(CacheAddr, "noCache"), KernelBB, CacheBB);
+
+    // Words of the cache are `Begin`, `End` and `Lists`.
+    B.SetInsertPoint(CacheBB);
+    Value *C = B.CreateIntToPtr(CacheAddr, Int32PtrTy, "cache");
+    Value *Arg = &*Func->arg_begin();
+    Arg = IsMalloc ? B.CreateZExtOrTrunc(Arg, Int32Ty, "size")
+                   : B.CreatePtrToInt(Arg, Int32Ty, "ptr");
+    auto ListP = [&](Value *Class, uint32_t Field, const Twine &Name) {
+      return B.CreateInBoundsGEP(
+          Int32Ty, C,
+          B.CreateAdd(B.CreateShl(Class, 1), B.getInt32(2 + Field)), Name);
+    };
+    Value *Class;
+    if (IsMalloc) {
+      // Class is the binary logarithm of the rounded up block size.
+      B.CreateCondBr(
+          B.CreateICmpULE(Arg, B.getInt32(Cache::getMaxSize(
+                                   Cache::ClassCount - 1)),
+                          "small"),
+          FastBB, KernelBB);
+      B.SetInsertPoint(FastBB);
+      Function *Ctlz = Intrinsic::getDeclaration(Func->getParent(),
+                                                 Intrinsic::ctlz, {Int32Ty});
+      Value *Bits = B.CreateSub(
+          B.getInt32(32),
+          B.CreateCall(Ctlz,
+                       {B.CreateAdd(Arg, B.getInt32(Cache::HeaderSize - 1)),
+                        B.getFalse()}),
+          "bits");
+      Class = B.CreateSelect(
+          B.CreateICmpULT(Bits, B.getInt32(Cache::MinClassShift)),
+          B.getInt32(0), B.CreateSub(Bits, B.getInt32(Cache::MinClassShift)),
+          "class");
+    } else {
+      // Only blocks from the region can be cached.
+      Value *Begin = Load(Word(C, 0, "beginP"), "begin");
+      Value *End = Load(Word(C, 1, "endP"), "end");
+      B.CreateCondBr(B.CreateICmpULT(B.CreateSub(Arg, Begin),
+                                     B.CreateSub(End, Begin), "cacheable"),
+                     FastBB, KernelBB);
+      B.SetInsertPoint(FastBB);
+      Value *ClassP = B.CreateIntToPtr(
+          B.CreateSub(Arg, B.getInt32(Cache::HeaderSize - 4)), Int32PtrTy);
+      Class = Load(ClassP, "class");
+    }
+    Value *HeadP = ListP(Class, 0, "headP");
+    Value *CountP = ListP(Class, 1, "countP");
+
+    if (IsMalloc) {
+      // Take the first block, refilling the list if it's empty.
+      BasicBlock *RefillBB = BasicBlock::Create(IR.Ctx, "refill", Func);
+      BasicBlock *PopBB = BasicBlock::Create(IR.Ctx, "pop", Func);
+      Value *Head = Load(HeadP, "head");
+      B.CreateCondBr(B.CreateIsNull(Head, "empty"), RefillBB, PopBB);
+      B.SetInsertPoint(RefillBB);
+      IR.createHypercall(Cache::RefillID, Class);
+      Value *Refilled = Load(HeadP, "refilled");
+      B.CreateCondBr(B.CreateIsNull(Refilled, "full"), KernelBB, PopBB);
+
+      B.SetInsertPoint(PopBB);
+      PHINode *Block = B.CreatePHI(Int32Ty, 2, "block");
+      Block->addIncoming(Head, FastBB);
+      Block->addIncoming(Refilled, RefillBB);
+      Value *BlockP = B.CreateIntToPtr(Block, Int32PtrTy);
+      B.CreateAlignedStore(Load(BlockP, "next"), HeadP, 4);
+      B.CreateAlignedStore(B.CreateSub(Load(CountP, "count"), B.getInt32(1)),
+                           CountP, 4);
+      // Store the usable size into the header as `GuestHeap::allocate` does.
+      B.CreateAlignedStore(
+          Arg,
+          B.CreateIntToPtr(B.CreateSub(Block, B.getInt32(Cache::HeaderSize)),
+                           Int32PtrTy),
+          4);
+      B.CreateRet(B.CreateBitCast(BlockP, Func->getReturnType()));
+    } else {
+      // Give some blocks back to `GuestHeap` if the list is too long.
+      BasicBlock *ReturnBB = BasicBlock::Create(IR.Ctx, "return", Func);
+      BasicBlock *PushBB = BasicBlock::Create(IR.Ctx, "push", Func);
+      BasicBlock *CheckBB = BasicBlock::Create(IR.Ctx, "check", Func);
+      B.CreateCondBr(
+          B.CreateICmpULT(Class, B.getInt32(Cache::ClassCount), "cached"),
+          CheckBB, KernelBB);
+      B.SetInsertPoint(CheckBB);
+      B.CreateCondBr(B.CreateICmpUGE(Load(CountP, "count"),
+                                     B.getInt32(Cache::MaxCount), "long"),
+                     ReturnBB, PushBB);
+      B.SetInsertPoint(ReturnBB);
+      IR.createHypercall(Cache::ReturnID, Class);
+      B.CreateBr(PushBB);
+
+      B.SetInsertPoint(PushBB);
+      B.CreateAlignedStore(Load(HeadP, "head"),
+                           B.CreateIntToPtr(Arg, Int32PtrTy), 4);
+      B.CreateAlignedStore(Arg, HeadP, 4);
+      B.CreateAlignedStore(B.CreateAdd(Load(CountP, "count"), B.getInt32(1)),
+                           CountP, 4);
+      B.CreateRetVoid();
+    }
+
+    // Other blocks are handled by `GuestHeap` directly.
+    B.SetInsertPoint(KernelBB);
+    Value *Kernel = B.CreateIntToPtr(
+        Load(Word(TSD,
+                  IsMalloc ? GuestTSD::KernelMallocKey
+                           : GuestTSD::KernelFreeKey,
+                  "kernelP"),
+             "kernelAddr"),
+        Func->getFunctionType()->getPointerTo());
+    CallInst *Call = B.CreateCall(Func->getFunctionType(), Kernel,
+                                  {&*Func->arg_begin()});
+    Call->setTailCall();
+    if (IsMalloc)
+      B.CreateRet(Call);
+    else
+      B.CreateRetVoid();
+    return true;
+  }
+  // Emits code that appends call of DLL wrapper `Wrapper` with arguments of
+  // `Func` into the current thread's `CommandBuffer`. The buffer is flushed by
+  // `Flush` first if there's not enough space. `Flush` is defined on first use.
+  // If the thread has no buffer, it falls through to code emitted after it.
+  void createDeferredCall(IRHelper &IR, llvm::Function *&Flush,
+                          llvm::Function *Func, llvm::Function *Wrapper) {
+    using namespace llvm;
+
+    IRBuilder<> &B = IR.Builder;
+    Type *Int32Ty = B.getInt32Ty();
+    Type *Int32PtrTy = Int32Ty->getPointerTo();
+    if (!Flush)
+      Flush = IR.defineNakedFunc(
+          FunctionType::get(B.getVoidTy(), /* isVarArg */ false),
+          "ipaSim_cmdFlush",
+          IRHelper::getHypercallAsm(CommandBuffer::FlushID) + "\n\tbx lr");
+
+    // Compute size of the record. Arguments are laid out as in the emulated
+    // registers and stack (see `DLLHelper::generate`).
+    const llvm::DataLayout &DL = IR.getDataLayout(IRHelper::Apple);
+    uint32_t Words = 0;
+    for (Argument &Arg : Func->args())
+      Words += (DL.getTypeAllocSize(Arg.getType()) + 3) / 4;
+    uint32_t RecordWords = CommandBuffer::HeaderWords + Words;
+
+    BasicBlock *BufferBB = BasicBlock::Create(IR.Ctx, "buffer", Func);
+    BasicBlock *FlushBB = BasicBlock::Create(IR.Ctx, "flush", Func);
+    BasicBlock *AppendBB = BasicBlock::Create(IR.Ctx, "append", Func);
+    BasicBlock *DirectBB = BasicBlock::Create(IR.Ctx, "direct", Func);
+
+    // Find the buffer. The lowest bits of TPIDRURO are reserved for the CPU
+    // number on iOS.
+    Value *TSD = B.CreateIntToPtr(
+        B.CreateAnd(IR.createThreadPointer(), ~3U, "tsd"), Int32PtrTy);
+    Value *BufferAddr = B.CreateAlignedLoad(
+        B.CreateConstInBoundsGEP1_32(Int32Ty, TSD, GuestTSD::CommandBufferKey),
+        4, "bufferAddr");
+    B.CreateCondBr(B.CreateIsNull(BufferAddr, "noBuffer"), DirectBB, BufferBB);
+
+    // Flush the buffer if the record doesn't fit.
+    B.SetInsertPoint(BufferBB);
+    Value *Buffer = B.CreateIntToPtr(BufferAddr, Int32PtrTy, "buffer");
+    Value *Used = B.CreateAlignedLoad(Buffer, 4, "used");
+    Value *End = B.CreateAdd(Used, B.getInt32(RecordWords), "end");
+    B.CreateCondBr(B.CreateICmpUGT(End, B.getInt32(CommandBuffer::Size),
+                                   "full"),
+                   FlushBB, AppendBB);
+    B.SetInsertPoint(FlushBB);
+    B.CreateCall(Flush);
+    B.CreateBr(AppendBB);
+
+    // Append the record.
+    B.SetInsertPoint(AppendBB);
+    PHINode *Start = B.CreatePHI(Int32Ty, 2, "start");
+    Start->addIncoming(Used, BufferBB);
+    Start->addIncoming(B.getInt32(0), FlushBB);
+    Value *RecordP = B.CreateInBoundsGEP(
+        Int32Ty, Buffer, B.CreateAdd(Start, B.getInt32(1)), "recordp");
+    B.CreateStore(B.CreatePtrToInt(Wrapper, Int32Ty),
+                  B.CreateConstInBoundsGEP1_32(Int32Ty, RecordP, 0));
+    B.CreateStore(B.getInt32(Words),
+                  B.CreateConstInBoundsGEP1_32(Int32Ty, RecordP, 1));
+    uint32_t WordIdx = CommandBuffer::HeaderWords;
+    for (Argument &Arg : Func->args()) {
+      Value *A = &Arg;
+      if (A->getType()->isIntegerTy() &&
+          A->getType()->getIntegerBitWidth() < 32)
+        A = B.CreateZExt(A, Int32Ty);
+      Value *WP = B.CreateConstInBoundsGEP1_32(Int32Ty, RecordP, WordIdx);
+      B.CreateAlignedStore(
+          A, B.CreateBitCast(WP, A->getType()->getPointerTo()), 4);
+      WordIdx += (DL.getTypeAllocSize(Arg.getType()) + 3) / 4;
+    }
+    B.CreateStore(B.CreateAdd(Start, B.getInt32(RecordWords)), Buffer);
+    B.CreateRetVoid();
+
+    B.SetInsertPoint(DirectBB);
+  }
+  // Emits body of variadic `Func` which calls Dylib function of its `va_list`
+  // variant (`Exp.VaList`). The variant's wrapper then passes the `va_list` to
+  // native code as it is. On iOS armv7, `va_list` is a pointer to argument
+  // words, which `va_start` spills to the stack right below the stacked ones.
+  // 64-bit values are not aligned there (see `DLLHelper::generate`) and
+  // smaller ones are promoted to words, so this is also how a `va_list` looks
+  // like on 32-bit x86. Pointers are the same in both, too.
+  void createVaListCall(IRHelper &IR, const ExportEntry &Exp,
+                        llvm::Function *Func) {
+    using namespace llvm;
+
+    IRBuilder<> &B = IR.Builder;
+    Function *VaList = IR.declareFunc<LibType::Dylib>(*Exp.VaList);
+    FunctionType *VaTy = VaList->getFunctionType();
+    Module *M = Func->getParent();
+
+    Value *LP = B.CreateAlloca(IR.VoidPtrTy, nullptr, "lp");
+    Value *LPP = B.CreateBitCast(LP, IR.VoidPtrTy, "lpp");
+    B.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::vastart), {LPP});
+
+    vector<Value *> Args;
+    Args.reserve(VaTy->getNumParams());
+    for (Argument &Arg : Func->args())
+      Args.push_back(
+          B.CreateBitOrPointerCast(&Arg, VaTy->getParamType(Arg.getArgNo())));
+    Args.push_back(B.CreatePointerCast(B.CreateLoad(LP, "list"),
+                                       VaTy->params().back()));
+    Value *R = B.CreateCall(VaTy, VaList, Args);
+
+    B.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::vaend), {LPP});
+    if (Func->getReturnType()->isVoidTy())
+      B.CreateRetVoid();
+    else
+      B.CreateRet(B.CreateBitOrPointerCast(R, Func->getReturnType()));
+  }
+  // Emits code that probes `MessageCache` for IMP of the message being sent
+  // and, if it's not found there, calls `LookupFunc` and caches its result.
+  // Returns the IMP. `Cache` is defined on first use. With `MessengerDispatch`,
+  // misses are instead tail-called into `Dispatch` (also defined on first use)
+  // and the host caches the IMP.
+  llvm::Value *createCachedLookup(IRHelper &IR, llvm::GlobalVariable *&Cache,
+                                  llvm::Function *&Dispatch,
+                                  llvm::Function *LookupFunc,
+                                  llvm::ArrayRef<llvm::Value *> Args,
+                                  bool Stret) {
+    using namespace llvm;
+
+    IRBuilder<> &B = IR.Builder;
+    Type *Int32Ty = B.getInt32Ty();
+    StructType *EntryTy =
+        StructType::get(IR.Ctx, SmallVector<Type *, 5>(5, Int32Ty));
+    StructType *CacheTy = StructType::get(
+        IR.Ctx, {Int32Ty, ArrayType::get(EntryTy, MessageCache::Size)});
+    if (!Cache)
+      Cache = IR.defineVariable(MessageCache::Symbol.S, CacheTy);
+    // The dispatch function consists only of the hypercall, so that the host
+    // sees arguments and return address of the original message send.
+    if (MessengerDispatch && !Dispatch)
+      Dispatch = IR.defineNakedFunc(
+          LLVM.SendTy,
+          Stret ? "ipaSim_msgDispatch_stret" : "ipaSim_msgDispatch",
+          IRHelper::getHypercallAsm(Stret ? MessageCache::DispatchStretID
+                                          : MessageCache::DispatchID));
+
+    Function *Func = B.GetInsertBlock()->getParent();
+    BasicBlock *ProbeBB = B.GetInsertBlock();
+    BasicBlock *MissBB = BasicBlock::Create(IR.Ctx, "miss", Func);
+    BasicBlock *CallBB = BasicBlock::Create(IR.Ctx, "call", Func);
+    auto Load = [&](Value *Ptr, AtomicOrdering Order, const Twine &Name) {
+      LoadInst *L = B.CreateAlignedLoad(Ptr, 4, Name);
+      L->setAtomic(Order);
+      return L;
+    };
+    auto Store = [&](Value *Val, Value *Ptr, AtomicOrdering Order) {
+      StoreInst *S = B.CreateAlignedStore(Val, Ptr, 4);
+      S->setAtomic(Order);
+    };
+
+    // Read the entry. It's valid if nobody wrote into it meanwhile. The
+    // receiver is not `nil` here (see `createNilCheck`).
+    Value *Self = B.CreatePtrToInt(Args[Stret ? 1 : 0], Int32Ty, "self");
+    Value *Sel = B.CreatePtrToInt(Args[Stret ? 2 : 1], Int32Ty, "sel");
+    Value *Isa = B.CreateAlignedLoad(
+        B.CreateIntToPtr(Self, Int32Ty->getPointerTo()), 4, "isa");
+    Value *Idx = B.CreateAnd(
+        B.CreateXor(B.CreateLShr(Isa, 3), B.CreateLShr(Sel, 2)),
+        MessageCache::Size - 1, "idx");
+    Value *EntryP = B.CreateInBoundsGEP(
+        CacheTy, Cache, {B.getInt32(0), B.getInt32(1), Idx}, "entryP");
+    Value *SeqP = B.CreateStructGEP(EntryTy, EntryP, 0, "seqP");
+    Value *Seq = Load(SeqP, AtomicOrdering::Acquire, "seq");
+    Value *Gen = Load(B.CreateStructGEP(CacheTy, Cache, 0),
+                      AtomicOrdering::Monotonic, "gen");
+    Value *Fields[4];
+    for (unsigned I = 0; I != 4; ++I)
+      Fields[I] = Load(B.CreateStructGEP(EntryTy, EntryP, I + 1),
+                       AtomicOrdering::Monotonic, "field");
+    B.CreateFence(AtomicOrdering::Acquire);
+    Value *Seq2 = Load(SeqP, AtomicOrdering::Monotonic, "seq2");
+    Value *Hit = B.CreateICmpEQ(Seq, Seq2);
+    Hit = B.CreateAnd(
+        Hit, B.CreateICmpEQ(B.CreateAnd(Seq, 1), B.getInt32(0), "even"));
+    Hit = B.CreateAnd(Hit, B.CreateICmpEQ(Fields[0], Gen));
+    Hit = B.CreateAnd(Hit, B.CreateICmpEQ(Fields[1], Isa));
+    Hit = B.CreateAnd(Hit, B.CreateICmpEQ(Fields[2], Sel));
+    Hit = B.CreateAnd(Hit, B.CreateICmpNE(Fields[3], B.getInt32(0)), "hit");
+    Value *CachedIMP =
+        B.CreateIntToPtr(Fields[3], LookupFunc->getReturnType(), "cachedImp");
+    B.CreateCondBr(Hit, CallBB, MissBB);
+
+    // Let the host look the message up and call the IMP.
+    B.SetInsertPoint(MissBB);
+    if (Dispatch) {
+      CallInst *Call = B.CreateCall(Dispatch, Args);
+      Call->setTailCallKind(CallInst::TCK_MustTail);
+      B.CreateRetVoid();
+
+      B.SetInsertPoint(CallBB);
+      PHINode *Result = B.CreatePHI(CachedIMP->getType(), 1, "imp");
+      Result->addIncoming(CachedIMP, ProbeBB);
+      return Result;
+    }
+
+    // Or look the message up and claim the entry by making its `Seq` odd. If
+    // another thread is writing into it, leave it be.
+    BasicBlock *FillBB = BasicBlock::Create(IR.Ctx, "fill", Func);
+    Value *IMP = B.CreateCall(LookupFunc, Args, "imp");
+    Value *Expected = B.CreateAnd(Seq, ~1U);
+    Value *Claim = B.CreateAtomicCmpXchg(
+        SeqP, Expected, B.CreateAdd(Expected, B.getInt32(1)),
+        AtomicOrdering::Acquire, AtomicOrdering::Monotonic);
+    B.CreateCondBr(B.CreateExtractValue(Claim, 1, "claimed"), FillBB, CallBB);
+
+    // Readers must not see the new fields before the odd `Seq`.
+    B.SetInsertPoint(FillBB);
+    B.CreateFence(AtomicOrdering::Release);
+    Value *NewFields[] = {Gen, Isa, Sel, B.CreatePtrToInt(IMP, Int32Ty)};
+    for (unsigned I = 0; I != 4; ++I)
+      Store(NewFields[I], B.CreateStructGEP(EntryTy, EntryP, I + 1),
+            AtomicOrdering::Monotonic);
+    Store(B.CreateAdd(Expected, B.getInt32(2)), SeqP, AtomicOrdering::Release);
+    B.CreateBr(CallBB);
+
+    B.SetInsertPoint(CallBB);
+    PHINode *Result = B.CreatePHI(IMP->getType(), 3, "imp");
+    Result->addIncoming(CachedIMP, ProbeBB);
+    Result->addIncoming(IMP, MissBB);
+    Result->addIncoming(IMP, FillBB);
+    return Result;
+  }
+  string getAliasName(const ExportEntry &Exp) {
+    return "$__ipaSim_wraps_" +
+           path(HAC.DLLGroups[Exp.DLLGroup].DLLs[Exp.DLL].Name)
+               .stem()
+               .string() +
+           "_" + to_string(Exp.RVA);
   }
   void createAlias(const ExportEntry &Exp, llvm::Function *Func) {
-    llvm::StringRef RVAStr = LLVM.Saver.save(to_string(Exp.RVA));
-    llvm::StringRef DLLName = LLVM.Saver.save(
-        path(HAC.DLLGroups[Exp.DLLGroup].DLLs[Exp.DLL].Name).stem().string());
-    llvm::GlobalAlias::create(
-        Twine("\01$__ipaSim_wraps_") + DLLName + "_" + RVAStr, Func);
+    llvm::GlobalAlias::create(Twine('\01') + getAliasName(Exp), Func);
+  }
+  // Finds aliases of wrappers in the linked Dylib, so that `WrapperIndex` can
+  // point right to them. See `WrapperIndex::Offsets`.
+  void readWrapperOffsets(const path &DylibPath, const Dylib &Lib) {
+    auto Bin = llvm::object::ObjectFile::createObjectFile(DylibPath.string());
+    if (!Bin) {
+      llvm::consumeError(Bin.takeError());
+      Log.error() << "cannot read linked Dylib " << Lib.Name << Log.end();
+      return;
+    }
+    auto *MachO =
+        llvm::dyn_cast<llvm::object::MachOObjectFile>(Bin->getBinary());
+    if (!MachO) {
+      Log.error() << "linked Dylib is not Mach-O (" << Lib.Name << ")"
+                  << Log.end();
+      return;
+    }
+
+    // Exported addresses are relative to the Mach-O header, i.e., to the
+    // Dylib's start address at runtime.
+    llvm::StringMap<uint64_t> Offsets;
+    llvm::Error Err = llvm::Error::success();
+    for (const llvm::object::ExportEntry &Entry : MachO->exports(Err))
+      if (Entry.name().startswith("$__ipaSim_wraps_"))
+        Offsets[Entry.name()] = Entry.address();
+    if (Err) {
+      llvm::consumeError(move(Err));
+      Log.error() << "cannot read exports of " << Lib.Name << Log.end();
+      return;
+    }
+
+    for (ExportPtr Exp : Lib.Exports)
+      if (Exp->Dylib && Exp->Dylib->Name == Lib.Name) {
+        auto It = Offsets.find(getAliasName(*Exp));
+        if (It != Offsets.end())
+          Exp->WrapperOffset = It->second;
+      }
   }
 };
 
@@ -492,18 +2113,28 @@ int main(int ArgC, char **ArgV) {
 
   try {
     HeadersAnalyzer HA(ArgV[ArgC - 1], /* Debug */ ArgC == 3);
+    HA.createDirs();
     HA.discoverTBDs();
+    HA.discoverLeaves();
+    HA.discoverDeferred();
+    HA.discoverUsage();
     HA.discoverDLLs();
     HA.parseAppleHeaders();
     HA.loadDLLs();
-    HA.createDirs();
+    HA.discoverVaLists();
+    HA.pruneExports();
+    HA.applyProfile();
     HA.generateDLLs();
     HA.generateDylibs();
+    HA.linkDLLs();
     HA.writeExports();
+    HA.writeObjCPreopt();
     HA.writeReport();
+    HA.writeBuildReport();
     Log.info("completed, exiting");
 
-    // HACK: Running destructors is too slow.
+    // HACK: Running destructors is too slow. Symbol tables of `HAContext` are
+    // freed in bulk now, but there is still lots of LLVM and Clang state.
     quick_exit(0);
   } catch (const FatalError &) {
     return 1;
@@ -0,0 +1,331 @@
+// IpaSimLifter.cpp: Ahead-of-time translator of hot guest functions.
+//
+// Usage: `IpaSimLifter [--top <N>] [--lld <path>] <binary> <guest.folded>`.
+// Finds functions of the Mach-O `<binary>` where most samples of the guest
+// profile (see `GuestProfiler`) ended, lifts the top `N` of them (32 by
+// default) to LLVM IR using `ARMLifter`, compiles them for x86 and links them
+// into `<binary>.lifted.dll` with `lld-link`. Put the DLL next to the binary
+// and `NativeTranslations` will run the functions natively.
+
+#include "ipasim/ARMLifter.hpp"
+#include "ipasim/Output.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/BinaryFormat/MachO.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Object/MachOUniversal.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace ipasim;
+using namespace llvm;
+using namespace llvm::object;
+using namespace std;
+
+namespace {
+
+// Function defined in `__text` of the binary.
+struct GuestFunction {
+  string Name;
+  uint32_t Offset; // Relative to the Mach-O header
+  ArrayRef<uint8_t> Code;
+  bool Thumb;
+  size_t Samples = 0;
+};
+
+// Finds functions of `Obj`. Each one spans until the next symbol.
+bool readFunctions(const MachOObjectFile &Obj,
+                   vector<GuestFunction> &Functions) {
+  uint64_t Base = 0;
+  for (const MachOObjectFile::LoadCommandInfo &LC : Obj.load_commands())
+    if (LC.C.cmd == MachO::LC_SEGMENT) {
+      MachO::segment_command Seg(Obj.getSegmentLoadCommand(LC));
+      if (!strcmp(Seg.segname, "__TEXT"))
+        Base = Seg.vmaddr;
+    }
+
+  const SectionRef *Text = nullptr;
+  vector<SectionRef> Sections(Obj.section_begin(), Obj.section_end());
+  for (const SectionRef &Sec : Sections) {
+    StringRef Name;
+    if (!Sec.getName(Name) && Name == "__text")
+      Text = &Sec;
+  }
+  StringRef Contents;
+  if (!Text || Text->getContents(Contents)) {
+    Log.error("cannot find section __text");
+    return false;
+  }
+  uint64_t TextAddr = Text->getAddress();
+  uint64_t TextEnd = TextAddr + Contents.size();
+
+  for (const SymbolRef &Sym : Obj.symbols()) {
+    MachO::nlist_base Entry(Obj.getSymbolTableEntry(Sym.getRawDataRefImpl()));
+    if ((Entry.n_type & MachO::N_TYPE) != MachO::N_SECT ||
+        (Entry.n_type & MachO::N_STAB))
+      continue;
+    auto Name = Sym.getName();
+    if (!Name) {
+      consumeError(Name.takeError());
+      continue;
+    }
+    uint64_t Addr = Entry.n_value;
+    if (Addr < TextAddr || Addr >= TextEnd)
+      continue;
+    Functions.push_back({Name->str(), static_cast<uint32_t>(Addr - Base),
+                         ArrayRef<uint8_t>(),
+                         (Entry.n_desc & MachO::N_ARM_THUMB_DEF) != 0});
+  }
+
+  sort(Functions.begin(), Functions.end(),
+       [](const GuestFunction &A, const GuestFunction &B) {
+         return A.Offset < B.Offset;
+       });
+  auto *Data = reinterpret_cast<const uint8_t *>(Contents.data());
+  for (size_t I = 0, Count = Functions.size(); I != Count; ++I) {
+    uint64_t Start = Functions[I].Offset + Base;
+    uint64_t End = I + 1 == Count ? TextEnd : Functions[I + 1].Offset + Base;
+    Functions[I].Code =
+        ArrayRef<uint8_t>(Data + (Start - TextAddr), End - Start);
+  }
+  return true;
+}
+
+// Attributes samples of `Path` (in the folded format) to `Functions`. Only the
+// leaf frame of each stack counts, callers aren't what is lifted.
+bool readProfile(const string &Path, StringRef Binary,
+                 vector<GuestFunction> &Functions) {
+  ifstream File(Path);
+  if (!File) {
+    Log.error() << "cannot open profile " << Path << Log.end();
+    return false;
+  }
+
+  // Frames look like `[method!]path/to/library+0x1234`.
+  string Line;
+  while (getline(File, Line)) {
+    StringRef Stack(Line);
+    auto [Frames, CountStr] = Stack.rsplit(' ');
+    size_t Count;
+    if (CountStr.getAsInteger(10, Count))
+      continue;
+    StringRef Leaf = Frames.rsplit(';').second;
+    size_t Plus = Leaf.rfind("+0x");
+    if (Plus == StringRef::npos)
+      continue;
+    StringRef Lib = Leaf.substr(0, Plus).rsplit('!').second;
+    if (Lib.empty())
+      Lib = Leaf.substr(0, Plus);
+    uint32_t Offset;
+    if (filesystem::path(Lib.str()).filename() != Binary ||
+        Leaf.substr(Plus + 3).getAsInteger(16, Offset))
+      continue;
+
+    auto It = upper_bound(Functions.begin(), Functions.end(), Offset,
+                          [](uint32_t Value, const GuestFunction &F) {
+                            return Value < F.Offset;
+                          });
+    if (It != Functions.begin())
+      (--It)->Samples += Count;
+  }
+  return true;
+}
+
+unique_ptr<TargetMachine> createTargetMachine(const string &Triple) {
+  string Error;
+  const Target *Target = TargetRegistry::lookupTarget(Triple, Error);
+  if (!Target) {
+    Log.error() << "cannot create target " << Triple << Log.end();
+    return nullptr;
+  }
+  return unique_ptr<TargetMachine>(Target->createTargetMachine(
+      Triple, "pentium4", "", TargetOptions(), /* RelocModel */ None,
+      /* CodeModel */ None, CodeGenOpt::Aggressive));
+}
+
+// Entry of the table (see `NativeTranslation`).
+struct LiftedFunction {
+  uint32_t Offset;
+  Function *Func;
+  uint32_t FrameSize;
+};
+
+// Adds table `NativeTranslations::TableSymbol` listing `Lifted` functions.
+void defineTable(Module &M, const vector<LiftedFunction> &Lifted) {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  auto *FuncPtrTy = cast<PointerType>(Lifted.front().Func->getType());
+  StructType *EntryTy = StructType::get(Ctx, {Int32Ty, FuncPtrTy, Int32Ty});
+
+  vector<Constant *> Entries;
+  for (const LiftedFunction &F : Lifted)
+    Entries.push_back(ConstantStruct::get(
+        EntryTy, {ConstantInt::get(Int32Ty, F.Offset), F.Func,
+                  ConstantInt::get(Int32Ty, F.FrameSize)}));
+  // The table is terminated by an entry without function.
+  Entries.push_back(ConstantStruct::get(
+      EntryTy,
+      {ConstantInt::get(Int32Ty, 0), ConstantPointerNull::get(FuncPtrTy),
+       ConstantInt::get(Int32Ty, 0)}));
+
+  ArrayType *TableTy = ArrayType::get(EntryTy, Entries.size());
+  auto *Table = new GlobalVariable(
+      M, TableTy, /* isConstant */ true, GlobalValue::ExternalLinkage,
+      ConstantArray::get(TableTy, Entries), "ipaSim_translations2");
+  Table->setDLLStorageClass(GlobalValue::DLLExportStorageClass);
+}
+
+} // namespace
+
+int main(int ArgC, char **ArgV) {
+  size_t Top = 32;
+  string LLD("lld-link");
+  vector<const char *> Paths;
+  for (int I = 1; I != ArgC; ++I) {
+    if (!strcmp(ArgV[I], "--top") && I + 1 < ArgC)
+      Top = strtoul(ArgV[++I], nullptr, 10);
+    else if (!strcmp(ArgV[I], "--lld") && I + 1 < ArgC)
+      LLD = ArgV[++I];
+    else
+      Paths.push_back(ArgV[I]);
+  }
+  if (Paths.size() != 2) {
+    Log.error() << "usage: " << ArgV[0]
+                << " [--top <N>] [--lld <path>] <binary> <guest.folded>"
+                << Log.end();
+    return 2;
+  }
+  string BinaryPath(Paths[0]);
+
+  // Read the binary (its ARM slice if it's fat).
+  auto Bin = createBinary(BinaryPath);
+  if (!Bin) {
+    consumeError(Bin.takeError());
+    Log.error() << "cannot read binary " << BinaryPath << Log.end();
+    return 1;
+  }
+  unique_ptr<MachOObjectFile> Slice;
+  const MachOObjectFile *Obj = dyn_cast<MachOObjectFile>(Bin->getBinary());
+  if (auto *Fat = dyn_cast<MachOUniversalBinary>(Bin->getBinary()))
+    for (const MachOUniversalBinary::ObjectForArch &Arch : Fat->objects()) {
+      if (Arch.getCPUType() != MachO::CPU_TYPE_ARM)
+        continue;
+      auto Object = Arch.getAsObjectFile();
+      if (!Object) {
+        consumeError(Object.takeError());
+        continue;
+      }
+      Slice = move(*Object);
+      Obj = Slice.get();
+      break;
+    }
+  if (!Obj || Obj->getHeader().cputype != MachO::CPU_TYPE_ARM) {
+    Log.error() << "binary has no ARM code (" << BinaryPath << ")"
+                << Log.end();
+    return 1;
+  }
+
+  vector<GuestFunction> Functions;
+  if (!readFunctions(*Obj, Functions) ||
+      !readProfile(Paths[1],
+                   filesystem::path(BinaryPath).filename().string(),
+                   Functions))
+    return 1;
+
+  // Lift the hottest functions.
+  vector<GuestFunction *> Hot;
+  for (GuestFunction &F : Functions)
+    if (F.Samples)
+      Hot.push_back(&F);
+  sort(Hot.begin(), Hot.end(), [](GuestFunction *A, GuestFunction *B) {
+    return A->Samples > B->Samples;
+  });
+  if (Hot.size() > Top)
+    Hot.resize(Top);
+
+  LLVMContext Ctx;
+  Module M(BinaryPath, Ctx);
+  ARMLifter Lifter(M);
+  vector<LiftedFunction> Lifted;
+  for (GuestFunction *F : Hot) {
+    if (F->Thumb) {
+      Log.warning() << "skipping Thumb function " << F->Name << Log.end();
+      continue;
+    }
+    string Error;
+    if (Function *Func = Lifter.lift("lifted" + F->Name, F->Offset, F->Code,
+                                     Error))
+      Lifted.push_back({F->Offset, Func, Lifter.getFrameSize()});
+    else
+      Log.warning() << "cannot lift " << F->Name << " (" << F->Samples
+                    << " samples): " << Error << Log.end();
+  }
+  if (Lifted.empty()) {
+    Log.error("no function was lifted");
+    return 1;
+  }
+  Log.info() << "lifted " << Lifted.size() << " of " << Hot.size()
+             << " hottest functions" << Log.end();
+  defineTable(M, Lifted);
+
+  // Compile for the host.
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  const string Triple("i386-pc-windows-msvc");
+  unique_ptr<TargetMachine> TM(createTargetMachine(Triple));
+  if (!TM)
+    return 1;
+  M.setTargetTriple(Triple);
+  M.setDataLayout(TM->createDataLayout());
+
+  legacy::FunctionPassManager FPM(&M);
+  legacy::PassManager PM;
+  PassManagerBuilder PMB;
+  PMB.OptLevel = 2;
+  PMB.populateFunctionPassManager(FPM);
+  PMB.populateModulePassManager(PM);
+  FPM.doInitialization();
+  for (Function &Func : M)
+    FPM.run(Func);
+  FPM.doFinalization();
+
+  string ObjPath(BinaryPath + ".lifted.obj");
+  {
+    auto Output(createOutputFile(ObjPath));
+    if (!Output)
+      return 1;
+    if (TM->addPassesToEmitFile(PM, *Output, /* DwoOut */ nullptr,
+                                TargetMachine::CGFT_ObjectFile)) {
+      Log.error() << "cannot emit object file " << ObjPath << Log.end();
+      return 1;
+    }
+    PM.run(M);
+  }
+
+  // Link the DLL.
+  string Out("/out:" + BinaryPath + ".lifted.dll");
+  SmallVector<StringRef, 8> Args{LLD,           "/dll",        "/noentry",
+                                 "/nodefaultlib", "/machine:x86", Out,
+                                 ObjPath};
+  auto Program = sys::findProgramByName(LLD);
+  if (!Program || sys::ExecuteAndWait(*Program, Args)) {
+    Log.error() << "failed to link " << Out.substr(5) << Log.end();
+    return 1;
+  }
+  return 0;
+}
@@ -2,10 +2,17 @@
 
 #include "ipasim/LLDHelper.hpp"
 
+#include "ipasim/BuildCache.hpp"
+#include "ipasim/BuildReport.hpp"
+#include "ipasim/HeadersAnalyzer/Config.hpp"
 #include "ipasim/Output.hpp"
 
+#include <lld/Common/Driver.h>
+#include <lld/Common/ErrorHandler.h>
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -53,6 +60,16 @@ void LLDHelper::linkDylib(StringRef Output, StringRef ObjectFile,
   executeArgs();
 }
 void LLDHelper::executeArgs() {
+  if constexpr (InProcessLLD) {
+    if (!link(Args.get(), /* COFF */ false)) {
+      string CmdLine;
+      for (const char *Arg : Args.get())
+        CmdLine = CmdLine + " " + Arg;
+      Log.error() << "failed to link:" << CmdLine << Log.end();
+    }
+    return;
+  }
+
   TerminationGuard TG(Args.terminate());
 
   // Convert `const char *`s to `StringRef`s.
@@ -60,6 +77,7 @@ void LLDHelper::executeArgs() {
   for (const char *Arg : Args.get())
     ArgsRef.push_back(Arg);
 
+  BuildReport::count(BuildCounter::Processes);
   if (llvm::sys::ExecuteAndWait(ArgsRef[0], ArgsRef)) {
     string CmdLine;
     for (StringRef Arg : ArgsRef)
@@ -67,3 +85,53 @@ void LLDHelper::executeArgs() {
     Log.error() << "failed to execute:" << CmdLine << Log.end();
   }
 }
+bool LLDHelper::link(ArrayRef<const char *> Args, bool COFF) {
+  // Find the output and additional inputs (libraries linked via `-l`).
+  StringRef Output;
+  vector<StringRef> LibDirs, Libs;
+  for (size_t I = 0; I != Args.size(); ++I) {
+    StringRef A(Args[I]);
+    if (COFF) {
+      if (A.startswith_lower("-out:") || A.startswith_lower("/out:"))
+        Output = A.drop_front(5);
+    } else if (A == "-o" && I + 1 < Args.size())
+      Output = Args[I + 1];
+    else if (A.startswith("-L"))
+      LibDirs.push_back(A.drop_front(2));
+    else if (A.startswith("-l"))
+      Libs.push_back(A.drop_front(2));
+  }
+
+  // Skip the link if none of its inputs changed. See `BuildCache`.
+  BuildCache Cache;
+  Cache.addArgs(Args, Output);
+  for (StringRef Lib : Libs)
+    for (StringRef Dir : LibDirs)
+      if (Cache.addFile((path(Dir.str()) / ("lib" + Lib + ".dylib").str())
+                            .string()))
+        break;
+  if (!Output.empty() && Cache.isUpToDate(Output.str()))
+    return true;
+
+  static mutex Mutex;
+  lock_guard<mutex> Lock(Mutex);
+
+  // Errors of previous links would make this one fail, too.
+  lld::errorHandler().ErrorCount = 0;
+
+  string Diag;
+  raw_string_ostream DiagOS(Diag);
+  bool Success =
+      COFF ? lld::coff::link(Args, /* CanExitEarly */ false, DiagOS)
+           : lld::mach_o::link(Args, /* CanExitEarly */ false, DiagOS);
+  DiagOS.flush();
+  if (!Diag.empty()) {
+    if (Success)
+      Log.warning() << Diag << Log.end();
+    else
+      Log.error() << Diag << Log.end();
+  }
+  if (Success && !Output.empty())
+    Cache.update(Output.str());
+  return Success;
+}
@@ -2,21 +2,29 @@
 
 #include "ipasim/LLVMHelper.hpp"
 
-#include "ipasim/ClangHelper.hpp"
+#include "ipasim/BuildCache.hpp"
+#include "ipasim/BuildReport.hpp"
 #include "ipasim/Common.hpp"
 #include "ipasim/HeadersAnalyzer/Config.hpp"
+#include "ipasim/Hypercalls.hpp"
 #include "ipasim/Output.hpp"
 
 #include <llvm/ADT/None.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Mangler.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
+#include <memory>
 
 using namespace ipasim;
 using namespace llvm;
@@ -46,36 +54,139 @@ string LLVMHelper::mangleName(const Function &Func) {
   return Name.str().str();
 }
 
-IRHelper::IRHelper(LLVMHelper &LLVM, StringRef Name, StringRef Path,
-                   StringRef Triple)
-    : LLVM(LLVM), Builder(LLVM.Ctx), Module(Name, LLVM.Ctx) {
+const DataLayout &LLVMHelper::getDataLayout(const string &Triple) {
+  auto It = DataLayouts.find(Triple);
+  if (It != DataLayouts.end())
+    return It->second;
 
-  // Get target from the triple provided.
   string Error;
   const Target *Target = TargetRegistry::lookupTarget(Triple, Error);
   if (!Target) {
-    Log.error("cannot create target");
-    return;
+    Log.error() << "cannot create target " << Triple << Log.end();
+    return DataLayouts.try_emplace(Triple, "").first->second;
   }
+  unique_ptr<TargetMachine> TM(Target->createTargetMachine(
+      Triple, "generic", "", TargetOptions(), /* RelocModel */ None));
+  return DataLayouts.try_emplace(Triple, TM->createDataLayout()).first->second;
+}
 
-  // Create basic `TargetMachine`.
-  TM.reset(Target->createTargetMachine(Triple, "generic", "", TargetOptions(),
-                                       /* RelocModel */ None));
+// Configures the target like Clang's driver (invoked with an `.ll` file) used
+// to, so that object files stay the same as when they were compiled by Clang. A
+// `"generic"` CPU (e.g., without VFP on ARM) and default optimization level
+// don't produce the same code. ARM triples are changed to Thumb ones if
+// `ThumbWrappers` is enabled.
+unique_ptr<TargetMachine> IRHelper::createTargetMachine(const string &Triple) {
+  llvm::Triple TT(Triple);
+  if (ThumbWrappers && TT.isARM())
+    TT.setArchName("thumb" + TT.getArchName().substr(3).str());
 
-  // Configure LLVM `Module`.
-  Module.setSourceFileName(Path);
-  Module.setTargetTriple(Triple);
-  Module.setDataLayout(TM->createDataLayout());
+  string Error;
+  const Target *Target = TargetRegistry::lookupTarget(TT.str(), Error);
+  if (!Target) {
+    Log.error() << "cannot create target " << TT.str() << Log.end();
+    return nullptr;
+  }
 
-  VoidPtrTy = Type::getInt8PtrTy(LLVM.Ctx);
+  const char *CPU = TT.isARM() || TT.isThumb() ? "swift" : "pentium4";
+  Optional<Reloc::Model> RM;
+  if (TT.isOSDarwin())
+    RM = Reloc::PIC_;
+  return unique_ptr<TargetMachine>(Target->createTargetMachine(
+      TT.str(), CPU, "", TargetOptions(), RM, /* CodeModel */ None,
+      CodeGenOpt::None));
+}
+
+IRHelper::IRHelper(LLVMHelper &LLVM, StringRef Name, StringRef Path,
+                   StringRef Triple)
+    : OwnCtx(make_unique<LLVMContext>()), Ctx(*OwnCtx), Builder(Ctx),
+      VoidPtrTy(Type::getInt8PtrTy(Ctx)), LLVM(LLVM), Module(Name, Ctx) {
 
   // DLL function wrappers have mostly type `(void *) -> void`.
-  Type *VoidTy = Type::getVoidTy(LLVM.Ctx);
+  Type *VoidTy = Type::getVoidTy(Ctx);
   WrapperTy = FunctionType::get(VoidTy, {VoidPtrTy}, /* isVarArg */ false);
 
   // However, wrappers for trivial functions (`void -> void`) have also trivial
   // signature `void -> void`.
   TrivialWrapperTy = FunctionType::get(VoidTy, /* isVarArg */ false);
+
+  unique_ptr<TargetMachine> TM(createTargetMachine(Triple));
+  if (!TM)
+    return;
+
+  // Configure LLVM `Module`.
+  Module.setSourceFileName(Path);
+  Module.setTargetTriple(TM->getTargetTriple().str());
+  Module.setDataLayout(TM->createDataLayout());
+}
+
+Type *IRHelper::mapType(Type *T) {
+  if (&T->getContext() == &Ctx)
+    return T;
+  if (Type *Mapped = Types.lookup(T))
+    return Mapped;
+
+  auto MapAll = [&](ArrayRef<Type *> Ts) {
+    SmallVector<Type *, 8> Result;
+    Result.reserve(Ts.size());
+    for (Type *E : Ts)
+      Result.push_back(mapType(E));
+    return Result;
+  };
+
+  Type *Result;
+  switch (T->getTypeID()) {
+  case Type::IntegerTyID:
+    Result = IntegerType::get(Ctx, T->getIntegerBitWidth());
+    break;
+  case Type::PointerTyID:
+    Result = PointerType::get(mapType(T->getPointerElementType()),
+                              T->getPointerAddressSpace());
+    break;
+  case Type::ArrayTyID:
+    Result = ArrayType::get(mapType(T->getArrayElementType()),
+                            T->getArrayNumElements());
+    break;
+  case Type::VectorTyID:
+    Result = VectorType::get(mapType(T->getVectorElementType()),
+                             T->getVectorNumElements());
+    break;
+  case Type::FunctionTyID: {
+    auto *FTy = cast<FunctionType>(T);
+    Result = FunctionType::get(mapType(FTy->getReturnType()),
+                               MapAll(FTy->params()), FTy->isVarArg());
+    break;
+  }
+  case Type::StructTyID: {
+    auto *STy = cast<StructType>(T);
+    if (STy->isLiteral()) {
+      Result = StructType::get(Ctx, MapAll(STy->elements()), STy->isPacked());
+      break;
+    }
+
+    // Named structures can be recursive, so they are registered before their
+    // bodies are mapped.
+    StructType *Named = StructType::create(Ctx, STy->getName());
+    Types[T] = Named;
+    if (!STy->isOpaque())
+      Named->setBody(MapAll(STy->elements()), STy->isPacked());
+    return Named;
+  }
+  default:
+    Result = Type::getPrimitiveType(Ctx, T->getTypeID());
+    break;
+  }
+  Types[T] = Result;
+  return Result;
+}
+
+const DataLayout &IRHelper::getDataLayout(const string &Triple) {
+  auto It = DataLayouts.find(Triple);
+  if (It != DataLayouts.end())
+    return It->second;
+
+  // Copies of `DataLayout` don't share cached structure layouts.
+  return DataLayouts.try_emplace(Triple, LLVM.getDataLayout(Triple))
+      .first->second;
 }
 
 const char *const IRHelper::Windows32 = "i386-pc-windows-msvc";
@@ -102,7 +213,7 @@ Function *IRHelper::declareFunc(const ExportEntry &Exp, bool Wrapper) {
 
   FunctionType *Type = Wrapper
                            ? (Exp.isTrivial() ? TrivialWrapperTy : WrapperTy)
-                           : Exp.getType<T>();
+                           : map(Exp.getType<T>());
 
   return declareFunc(Type, Name);
 }
@@ -112,6 +223,8 @@ template Function *IRHelper::declareFunc<LibType::DLL>(const ExportEntry &,
                                                        bool);
 
 Function *IRHelper::declareFunc(FunctionType *Type, const Twine &Name) {
+  Type = map(Type);
+
   // Note that we add prefix `\01`, so that the name doesn't get mangled since
   // it already is. LLVM will remove this prefix before emitting object code for
   // the function.
@@ -130,10 +243,32 @@ Function *IRHelper::declareFunc(FunctionType *Type, const Twine &Name) {
 
 void IRHelper::defineFunc(llvm::Function *Func) {
   // Bodies of our simple functions consist of exactly one `BasicBlock`.
-  llvm::BasicBlock *BB = llvm::BasicBlock::Create(LLVM.Ctx, "entry", Func);
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(Ctx, "entry", Func);
   Builder.SetInsertPoint(BB);
 }
 
+GlobalVariable *IRHelper::defineExport(const Twine &Name, Constant *Init) {
+  auto *Var = new GlobalVariable(Module, Init->getType(), /* isConstant */ true,
+                                 GlobalValue::ExternalLinkage, Init,
+                                 Twine('\01') + Name);
+  Var->setDLLStorageClass(GlobalValue::DLLExportStorageClass);
+  return Var;
+}
+
+GlobalVariable *IRHelper::definePrivate(Constant *Init) {
+  auto *Var = new GlobalVariable(Module, Init->getType(), /* isConstant */ true,
+                                 GlobalValue::PrivateLinkage, Init);
+  Var->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  return Var;
+}
+
+GlobalVariable *IRHelper::defineVariable(const Twine &Name, Type *Type) {
+  return new GlobalVariable(Module, Type, /* isConstant */ false,
+                            GlobalValue::ExternalLinkage,
+                            Constant::getNullValue(Type),
+                            Twine('\01') + Name);
+}
+
 // TODO: Store types with size less than pointer size directly in the structure
 // (instead of storing pointer to it as we are doing now). But make sure it'll
 // be aligned equally on both architectures.
@@ -141,32 +276,66 @@ void IRHelper::defineFunc(llvm::Function *Func) {
 // value, but it generated wrong machine code. However, we still would like to
 // share the space if possible.
 StructType *IRHelper::createParamStruct(const ExportEntry &Exp) {
-  Type *RetTy = Exp.getDylibType()->getReturnType();
+  FunctionType *DylibTy = map(Exp.getDylibType());
+  Type *RetTy = DylibTy->getReturnType();
 
   // If the function has no arguments, we don't really need a struct, we just
   // want to use the return value. We create a trivial structure type for
   // compatibility with and simplicity of our callers, though.
-  if (!Exp.getDylibType()->getNumParams())
+  if (!DylibTy->getNumParams())
     return StructType::create(RetTy, "struct");
 
   // Map parameter types to their pointers.
   vector<Type *> ParamPointers;
-  ParamPointers.reserve(Exp.getDylibType()->getNumParams() +
-                        (RetTy->isVoidTy() ? 0 : 1));
-  for (Type *Ty : Exp.getDylibType()->params()) {
+  ParamPointers.reserve(DylibTy->getNumParams() + (RetTy->isVoidTy() ? 0 : 2));
+  for (Type *Ty : DylibTy->params()) {
     ParamPointers.push_back(Ty->getPointerTo());
   }
-  if (!RetTy->isVoidTy())
+
+  // Align the return value as strictly as either platform requires. Padding
+  // is inserted explicitly, so that the offset doesn't depend on the layout.
+  if (!RetTy->isVoidTy()) {
+    uint64_t Offset = ParamPointers.size() * getSize(VoidPtrTy);
+    uint64_t Aligned = alignTo(Offset, getAlign(RetTy));
+    if (Aligned != Offset)
+      ParamPointers.push_back(
+          ArrayType::get(Type::getInt8Ty(Ctx), Aligned - Offset));
     ParamPointers.push_back(RetTy);
+  }
 
   // Create a structure that we use to store the function's arguments and return
   // value. It contains space for the return value and addresses of arguments.
   // Structure alignment is different on different platforms, that's why we
-  // create a *packed* structure.
-  // TODO: Maybe align it manually.
+  // create a *packed* structure (aligned manually above).
   // TODO: Also ensure that WinObjC's and other DLLs' structures are aligned as
   // they would be on iOS.
-  return StructType::create(ParamPointers, "struct", /* isPacked */ true);
+  StructType *Struct =
+      StructType::create(ParamPointers, "struct", /* isPacked */ true);
+
+  // Check that both sides agree on the layout.
+  const StructLayout *DLLLayout =
+      getDataLayout(Windows32).getStructLayout(Struct);
+  const StructLayout *DylibLayout =
+      getDataLayout(Apple).getStructLayout(Struct);
+  for (unsigned I = 0, E = Struct->getNumElements(); I != E; ++I)
+    if (DLLLayout->getElementOffset(I) != DylibLayout->getElementOffset(I)) {
+      Log.error() << "inconsistent layout of parameters of " << Exp.Name
+                  << Log.end();
+      break;
+    }
+  return Struct;
+}
+
+unsigned IRHelper::getAlign(Type *T) {
+  if (auto *Struct = dyn_cast<StructType>(T))
+    if (Struct->isPacked()) {
+      unsigned Align = 1;
+      for (Type *E : Struct->elements())
+        Align = max(Align, getAlign(E));
+      return Align;
+    }
+  return max(getDataLayout(Windows32).getABITypeAlignment(T),
+             getDataLayout(Apple).getABITypeAlignment(T));
 }
 
 Value *IRHelper::createCall(Function *Func, ArrayRef<Value *> Args,
@@ -178,12 +347,94 @@ Value *IRHelper::createCall(Function *Func, ArrayRef<Value *> Args,
   return Builder.CreateCall(Func, Args, Name);
 }
 Value *IRHelper::createCall(FunctionType *FuncTy, Value *FuncPtr,
-                            ArrayRef<Value *> Args, const Twine &Name) {
-  if (FuncTy->getReturnType()->isVoidTy()) {
-    Builder.CreateCall(FuncTy, FuncPtr, Args);
-    return nullptr;
-  }
-  return Builder.CreateCall(FuncTy, FuncPtr, Args, Name);
+                            ArrayRef<Value *> Args, const Twine &Name,
+                            CallingConv::ID CC) {
+  FuncTy = map(FuncTy);
+  CallInst *Call;
+  if (FuncTy->getReturnType()->isVoidTy())
+    Call = Builder.CreateCall(FuncTy, FuncPtr, Args);
+  else
+    Call = Builder.CreateCall(FuncTy, FuncPtr, Args, Name);
+  Call->setCallingConv(CC);
+  return Call->getType()->isVoidTy() ? nullptr : Call;
+}
+
+void IRHelper::createHypercall(uint32_t ID, Value *Arg) {
+  // The host can call back into emulated code while handling the hypercall, so
+  // we must treat it as a normal call and clobber all caller-saved registers.
+  string Constraints(Arg ? "{r0}" : "~{r0}");
+  Constraints += ",~{r1},~{r2},~{r3},~{r12},~{lr},~{cc},~{memory}";
+  for (int I = 0; I != 8; ++I)
+    Constraints += ",~{d" + to_string(I) + "}";
+  for (int I = 16; I != 32; ++I)
+    Constraints += ",~{d" + to_string(I) + "}";
+
+  FunctionType *Type =
+      Arg ? FunctionType::get(Builder.getVoidTy(), {Arg->getType()},
+                              /* isVarArg */ false)
+          : FunctionType::get(Builder.getVoidTy(), /* isVarArg */ false);
+  InlineAsm *Asm = InlineAsm::get(Type, getHypercallAsm(ID), Constraints,
+                                  /* hasSideEffects */ true);
+  if (Arg)
+    Builder.CreateCall(Asm, {Arg});
+  else
+    Builder.CreateCall(Asm);
+}
+
+string IRHelper::getHypercallAsm(uint32_t ID) {
+  if (!ThumbWrappers || ID < Hypercalls::ThumbInR12)
+    return "svc #" + to_string(ID);
+  return "movw r12, #" + to_string(ID & 0xFFFF) + "\n\tmovt r12, #" +
+         to_string(ID >> 16) + "\n\tsvc #" +
+         to_string(Hypercalls::ThumbInR12);
+}
+
+Value *IRHelper::createThreadPointer() {
+  FunctionType *Type =
+      FunctionType::get(Builder.getInt32Ty(), /* isVarArg */ false);
+  InlineAsm *Asm = InlineAsm::get(Type, "mrc p15, #0, $0, c13, c0, #3", "=r",
+                                  /* hasSideEffects */ false);
+  return Builder.CreateCall(Asm, {}, "tpidruro");
+}
+
+Function *IRHelper::defineNakedFunc(FunctionType *Type, const Twine &Name,
+                                    const string &Asm) {
+  Type = map(Type);
+  Function *Func =
+      Function::Create(Type, Function::InternalLinkage, Name, &Module);
+  Func->addFnAttr(Attribute::Naked);
+  Func->addFnAttr(Attribute::NoInline);
+
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Func));
+  FunctionType *AsmTy =
+      FunctionType::get(B.getVoidTy(), /* isVarArg */ false);
+  B.CreateCall(InlineAsm::get(AsmTy, Asm, "", /* hasSideEffects */ true));
+  B.CreateUnreachable();
+  return Func;
+}
+
+Function *IRHelper::declareShapeFunc(FunctionType *FuncTy, Type *TargetTy) {
+  vector<Type *> Params(FuncTy->param_begin(), FuncTy->param_end());
+  Params.push_back(TargetTy);
+  FunctionType *ShapeTy =
+      FunctionType::get(FuncTy->getReturnType(), Params, /* isVarArg */ false);
+  Function *Shape = Function::Create(ShapeTy, Function::InternalLinkage,
+                                     "$__ipaSim_shape", &Module);
+  Shape->addFnAttr(Attribute::NoInline);
+  return Shape;
+}
+
+void IRHelper::createShapeCall(Function *Func, Function *Shape,
+                               Value *Target) {
+  vector<Value *> Args;
+  Args.reserve(Func->arg_size() + 1);
+  for (Argument &Arg : Func->args())
+    Args.push_back(&Arg);
+  Args.push_back(Target);
+  if (Value *R = createCall(Shape, Args, "r"))
+    Builder.CreateRet(R);
+  else
+    Builder.CreateRetVoid();
 }
 
 void IRHelper::verifyFunction(Function *Func) {
@@ -198,27 +449,59 @@ void IRHelper::verifyFunction(Function *Func) {
 
 // Compiles the module. Inspired by LLVM tutorial:
 // https://llvm.org/docs/tutorial/LangImpl08.html.
-void IRHelper::emitObj(const path &BuildDir, StringRef Path) {
-  // Generate LLVM IR.
-  string IRPath(Path.str() + ".ll");
-  auto IROutput(createOutputFile(IRPath));
-  if (!IROutput)
-    return;
-  Module.print(*IROutput, nullptr);
-
-  // Emit object file.
-  // TODO: Doing this via `PassManager` and `addPassesToEmitFile` didn't work
-  // well (for, e.g., `UIApplicationMain`).
-  ClangHelper Clang(BuildDir, LLVM);
-  Clang.Args.add("-target");
-  Clang.Args.add(Module.getTargetTriple().c_str());
-  Clang.Args.add("-c");
-  Clang.Args.add(IRPath.c_str());
-  Clang.Args.add("-o");
-  Clang.Args.add(Path.data());
-  // TODO: Use THUMB, but make sure it's emulated correctly.
-  if (TM->getTargetTriple().isARM())
-    Clang.Args.add("-mno-thumb");
-  Clang.Args.add("-Wno-override-module");
-  Clang.executeArgs();
+TaskGraph::Task *IRHelper::emitObj(StringRef Path, TaskGraph &Tasks) {
+  // Dump LLVM IR.
+  if constexpr (DumpIR) {
+    auto IROutput(createOutputFile(Path.str() + ".ll"));
+    if (IROutput)
+      Module.print(*IROutput, nullptr);
+  }
+
+  // The module is freed (along with its context) as soon as the library is
+  // generated, so the task gets the module as bitcode and loads it into its own
+  // context.
+  auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+  {
+    raw_svector_ostream OS(*Bitcode);
+    WriteBitcodeToFile(Module, OS);
+  }
+
+  // Object file that was already emitted from the same bitcode can be reused.
+  BuildCache Cache;
+  Cache.add(Module.getTargetTriple());
+  Cache.add(StringRef(Bitcode->data(), Bitcode->size()));
+  if (Cache.isUpToDate(Path))
+    return nullptr;
+  BuildReport::count(BuildCounter::Modules);
+
+  return Tasks.add(
+      [Bitcode, Cache, Triple = Module.getTargetTriple(),
+       Path = Path.str()]() mutable {
+        LLVMContext Ctx;
+        auto M = parseBitcodeFile(
+            MemoryBufferRef(StringRef(Bitcode->data(), Bitcode->size()), Path),
+            Ctx);
+        if (!M) {
+          consumeError(M.takeError());
+          Log.error() << "cannot load bitcode of " << Path << Log.end();
+          return;
+        }
+        unique_ptr<TargetMachine> TM(createTargetMachine(Triple));
+        if (!TM)
+          return;
+
+        // Emit object file.
+        auto Output(createOutputFile(Path));
+        if (!Output)
+          return;
+        legacy::PassManager PM;
+        if (TM->addPassesToEmitFile(PM, *Output, /* DwoOut */ nullptr,
+                                    TargetMachine::CGFT_ObjectFile)) {
+          Log.error() << "cannot emit object file " << Path << Log.end();
+          return;
+        }
+        PM.run(**M);
+        Output.reset();
+        Cache.update(Path);
+      });
 }
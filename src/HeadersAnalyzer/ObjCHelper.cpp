@@ -1,39 +1,62 @@
-// ObjCHelper.cpp: Implementation of class `ObjCMethodScout`.
+// ObjCHelper.cpp: Implementation of class `ObjCMethodScout` and struct
+// `ObjCScoutResults`.
 
 #include "ipasim/ObjCHelper.hpp"
 
 #include "ipasim/Output.hpp"
 
+#include <algorithm>
+
 using namespace ipasim;
 using namespace llvm;
 using namespace llvm::object;
 using namespace std;
 
-set<ipasim::ObjCMethod> ObjCMethodScout::discoverMethods(const string &DLLPath,
-                                                         COFFObjectFile *COFF) {
+void ObjCScoutResults::addTo(ObjCPreoptBuilder &Preopt, uint32_t DLL) const {
+  for (const string &Selector : Selectors)
+    Preopt.addSelector(Selector);
+  for (const auto &[Name, RVA] : Classes)
+    Preopt.addClass(Name, DLL, RVA);
+  for (const auto &[Name, RVA] : Protocols)
+    Preopt.addProtocol(Name, DLL, RVA);
+}
+
+ObjCScoutResults ObjCMethodScout::discoverMethods(COFFObjectFile *COFF) {
   // Find pointer to Mach-O header.
   const coff_section *MhdrSection;
   if (error_code Error = COFF->getSection(".mhdr", MhdrSection)) {
     Log.error(Error.message());
-    return set<ipasim::ObjCMethod>();
+    return ObjCScoutResults();
   }
   uint32_t Offset = MhdrSection->PointerToRawData;
 
-  // Load the DLL starting with the Mach-O header.
-  auto MB(MemoryBuffer::getFileSlice(
-      DLLPath, COFF->getMemoryBufferRef().getBufferSize() - Offset, Offset));
-  if (error_code Error = MB.getError()) {
-    Log.error(Error.message());
-    return set<ipasim::ObjCMethod>();
+  // View the DLL starting with the Mach-O header.
+  StringRef Data(COFF->getData());
+  if (Offset > Data.size()) {
+    Log.error() << "invalid Mach-O header offset (" << COFF->getFileName()
+                << ")" << Log.end();
+    return ObjCScoutResults();
   }
-  auto MachO(ObjectFile::createMachOObjectFile(**MB, /* MachOPoser */ true));
+  MemoryBufferRef MB(Data.substr(Offset), COFF->getFileName());
+  auto MachO(ObjectFile::createMachOObjectFile(MB, /* MachOPoser */ true));
   if (!MachO) {
     Log.error(toString(MachO.takeError()));
-    return set<ipasim::ObjCMethod>();
+    return ObjCScoutResults();
   }
 
-  ObjCMethodScout Scout(COFF, move(*MB), move(*MachO));
+  ObjCMethodScout Scout(COFF, move(*MachO));
   Scout.discoverMethods();
+
+  // Sort methods just once. If there are multiple methods with the same RVA,
+  // the first one wins.
+  vector<ipasim::ObjCMethod> &Methods = Scout.Results.Methods;
+  stable_sort(Methods.begin(), Methods.end());
+  Methods.erase(unique(Methods.begin(), Methods.end(),
+                       [](const ipasim::ObjCMethod &A,
+                          const ipasim::ObjCMethod &B) {
+                         return A.RVA == B.RVA;
+                       }),
+                Methods.end());
   return move(Scout.Results);
 }
 
@@ -63,12 +86,38 @@ void ObjCMethodScout::findMethods(Expected<ListTy> &&List) {
       continue;
     }
 
+    registerElement(*Name, *Element);
     registerMethods(*Name, Element->instanceMethods(), /* Static */ false);
     registerMethods(*Name, Element->classMethods(), /* Static */ true);
     registerOptionalMethods(*Name, *Element);
   }
 }
 
+// Categories are not preoptimized, only their selectors are.
+template <typename ElementTy>
+void ObjCMethodScout::registerElement(StringRef, const ElementTy &) {}
+template <>
+void ObjCMethodScout::registerElement<ObjCClass>(StringRef ClassName,
+                                                 const ObjCClass &Class) {
+  uint32_t RVA = Class.getRawContent().getValue() - COFF->getImageBase();
+  Results.Classes.emplace_back(ClassName.str(), RVA);
+
+  // Root classes don't have superclasses.
+  auto SuperName = Class.getSuperClassName();
+  if (!SuperName) {
+    Log.error(toString(SuperName.takeError()));
+    return;
+  }
+  if (!SuperName->empty())
+    Results.SuperClasses.emplace_back(ClassName.str(), SuperName->str());
+}
+template <>
+void ObjCMethodScout::registerElement<ObjCProtocol>(
+    StringRef ProtocolName, const ObjCProtocol &Protocol) {
+  uint32_t RVA = Protocol.getRawContent().getValue() - COFF->getImageBase();
+  Results.Protocols.emplace_back(ProtocolName.str(), RVA);
+}
+
 template <typename ElementTy>
 void ObjCMethodScout::registerOptionalMethods(StringRef, const ElementTy &) {}
 template <>
@@ -105,8 +154,17 @@ void ObjCMethodScout::registerMethods(StringRef ElementName,
       continue;
     }
 
+    auto Type = Method.getType();
+    if (!Type) {
+      Log.error(toString(Type.takeError()));
+      continue;
+    }
+
+    Results.Selectors.push_back(Name->str());
     uint32_t RVA = *Imp - COFF->getImageBase();
-    Results.insert({RVA, (Static ? "+[" : "-[") + ElementName.str() + " " +
-                             Name->str() + "]"});
+    Results.Methods.push_back({RVA,
+                               (Static ? "+[" : "-[") + ElementName.str() +
+                                   " " + Name->str() + "]",
+                               Type->str()});
   }
 }
@@ -0,0 +1,168 @@
+// PDBHelper.cpp: Implementation of class `PDBHelper`.
+
+#include "ipasim/PDBHelper.hpp"
+
+#include "ipasim/Output.hpp"
+
+#include <llvm/DebugInfo/CodeView/LazyRandomTypeCollection.h>
+#include <llvm/DebugInfo/CodeView/SymbolDeserializer.h>
+#include <llvm/DebugInfo/CodeView/SymbolRecord.h>
+#include <llvm/DebugInfo/CodeView/TypeDeserializer.h>
+#include <llvm/DebugInfo/CodeView/TypeRecord.h>
+#include <llvm/DebugInfo/PDB/Native/DbiModuleList.h>
+#include <llvm/DebugInfo/PDB/Native/DbiStream.h>
+#include <llvm/DebugInfo/PDB/Native/ModuleDebugStream.h>
+#include <llvm/DebugInfo/PDB/Native/NativeSession.h>
+#include <llvm/DebugInfo/PDB/Native/PDBFile.h>
+#include <llvm/DebugInfo/PDB/Native/PublicsStream.h>
+#include <llvm/DebugInfo/PDB/Native/RawConstants.h>
+#include <llvm/DebugInfo/PDB/Native/SymbolStream.h>
+#include <llvm/DebugInfo/PDB/Native/TpiStream.h>
+#include <llvm/DebugInfo/PDB/PDB.h>
+#include <set>
+
+using namespace ipasim;
+using namespace llvm;
+using namespace llvm::codeview;
+using namespace llvm::pdb;
+using namespace std;
+
+bool PDBHelper::load(const string &Path) {
+  auto Fail = [&](Error Err) {
+    Log.error() << "cannot read PDB (" << Path << "): " << toString(move(Err))
+                << Log.end();
+    return false;
+  };
+
+  unique_ptr<IPDBSession> Session;
+  if (Error Err = loadDataForPDB(PDB_ReaderType::Native, Path, Session))
+    return Fail(move(Err));
+  PDBFile &File = static_cast<NativeSession &>(*Session).getPDBFile();
+
+  auto Dbi(File.getPDBDbiStream());
+  if (!Dbi)
+    return Fail(Dbi.takeError());
+  auto Symbols(File.getPDBSymbolStream());
+  if (!Symbols)
+    return Fail(Symbols.takeError());
+  auto PublicsStream(File.getPDBPublicsStream());
+  if (!PublicsStream)
+    return Fail(PublicsStream.takeError());
+  auto Tpi(File.getPDBTpiStream());
+  if (!Tpi)
+    return Fail(Tpi.takeError());
+  auto Ipi(File.getPDBIpiStream());
+  if (!Ipi)
+    return Fail(Ipi.takeError());
+
+  auto Sections(Dbi->getSectionHeaders());
+  auto ToRVA = [&](uint16_t Segment, uint32_t Offset) -> optional<uint32_t> {
+    if (!Segment || Segment > Sections.size())
+      return nullopt;
+    return Sections[Segment - 1].VirtualAddress + Offset;
+  };
+
+  // Publics are simply listed in the symbol record stream.
+  set<pair<uint32_t, string>> PublicNames;
+  for (uint32_t Offset : PublicsStream->getAddressMap()) {
+    CVSymbol Sym(Symbols->readRecord(Offset));
+    if (Sym.kind() != S_PUB32)
+      continue;
+    auto Pub(SymbolDeserializer::deserializeAs<PublicSym32>(Sym));
+    if (!Pub) {
+      consumeError(Pub.takeError());
+      continue;
+    }
+    optional<uint32_t> RVA(ToRVA(Pub->Segment, Pub->Offset));
+    if (!RVA)
+      continue;
+    Publics.push_back({Pub->Name.str(), *RVA, nullopt});
+    PublicNames.emplace(*RVA, Pub->Name.str());
+  }
+
+  // Signatures of functions are in the type stream. Functions with IDs refer to
+  // them through `LF_FUNC_ID` records in the ID stream.
+  LazyRandomTypeCollection &Types = Tpi->typeCollection();
+  LazyRandomTypeCollection &Ids = Ipi->typeCollection();
+  auto GetParamCount = [&](TypeIndex TI) -> optional<uint32_t> {
+    if (TI.isSimple() || !Types.contains(TI))
+      return nullopt;
+    CVType Type(Types.getType(TI));
+    if (Type.kind() == LF_PROCEDURE) {
+      ProcedureRecord Record;
+      if (Error Err = TypeDeserializer::deserializeAs(Type, Record)) {
+        consumeError(move(Err));
+        return nullopt;
+      }
+      return Record.getParameterCount();
+    }
+    if (Type.kind() == LF_MFUNCTION) {
+      MemberFunctionRecord Record;
+      if (Error Err = TypeDeserializer::deserializeAs(Type, Record)) {
+        consumeError(move(Err));
+        return nullopt;
+      }
+      return Record.getParameterCount();
+    }
+    return nullopt;
+  };
+  auto GetFuncType = [&](TypeIndex TI) -> TypeIndex {
+    if (TI.isSimple() || !Ids.contains(TI))
+      return TypeIndex();
+    CVType Id(Ids.getType(TI));
+    if (Id.kind() != LF_FUNC_ID)
+      return TypeIndex();
+    FuncIdRecord Record;
+    if (Error Err = TypeDeserializer::deserializeAs(Id, Record)) {
+      consumeError(move(Err));
+      return TypeIndex();
+    }
+    return Record.getFunctionType();
+  };
+
+  // Functions are in symbol streams of modules.
+  const DbiModuleList &Modules = Dbi->modules();
+  for (uint32_t I = 0, Count = Modules.getModuleCount(); I != Count; ++I) {
+    DbiModuleDescriptor Desc(Modules.getModuleDescriptor(I));
+    uint16_t StreamIdx = Desc.getModuleStreamIndex();
+    if (StreamIdx == kInvalidStreamIndex)
+      continue;
+    auto Stream(File.safelyCreateIndexedStream(StreamIdx));
+    if (!Stream) {
+      consumeError(Stream.takeError());
+      continue;
+    }
+    ModuleDebugStreamRef ModS(Desc, move(*Stream));
+    if (Error Err = ModS.reload()) {
+      consumeError(move(Err));
+      continue;
+    }
+
+    for (const CVSymbol &Sym : ModS.symbols(nullptr)) {
+      SymbolKind Kind = Sym.kind();
+      bool HasId = Kind == S_GPROC32_ID || Kind == S_LPROC32_ID;
+      if (!HasId && Kind != S_GPROC32 && Kind != S_LPROC32)
+        continue;
+      auto Proc(SymbolDeserializer::deserializeAs<ProcSym>(Sym));
+      if (!Proc) {
+        consumeError(Proc.takeError());
+        continue;
+      }
+      optional<uint32_t> RVA(ToRVA(Proc->Segment, Proc->CodeOffset));
+      if (!RVA)
+        continue;
+
+      // If the function has public symbol with underscore at the beginning,
+      // use that name instead (that's how C functions are decorated on x86).
+      string Name(Proc->Name.str());
+      string Decorated('_' + Name);
+      if (PublicNames.count({*RVA, Decorated}))
+        Name = move(Decorated);
+
+      TypeIndex FuncType(HasId ? GetFuncType(Proc->FunctionType)
+                               : Proc->FunctionType);
+      Functions.push_back({move(Name), *RVA, GetParamCount(FuncType)});
+    }
+  }
+  return true;
+}
@@ -12,13 +12,14 @@ using namespace llvm;
 using namespace std;
 using namespace tapi::internal;
 
-TBDHandler::TBDHandler(HAContext &HAC)
-    : HAC(HAC), FM(FileSystemOptions()), IFM(FM) {}
-
-void TBDHandler::handleFile(const string &Path) {
+void TBDHandler::parseFile(TBDFile &TBD) {
+  const string &Path = TBD.Path;
   bool HasTBDExtension = filesystem::path(Path).extension() == ".tbd";
 
-  // Check file.
+  // Check file. tapi's managers aren't thread-safe, so each file has its own.
+  FileSystemOptions Options;
+  FileManager FM(Options);
+  InterfaceFileManager IFM(FM);
   auto FileOrError = IFM.readFile(Path);
   if (!FileOrError) {
     // If the file hasn't `.tbd` extension, it's OK that we cannot read it.
@@ -46,16 +47,8 @@ void TBDHandler::handleFile(const string &Path) {
     return;
   }
 
-  // Save the Dylib.
-  auto InsertPair(HAC.iOSLibs.insert({File->getInstallName()}));
-  if (!InsertPair.second) {
-    // Ignore Dylibs with already-found install name, the corresponding TBD
-    // files should be identical.
-    return;
-  }
-  DylibPtr Lib(InsertPair.first);
-
   // Find exports.
+  TBD.InstallName = File->getInstallName();
   for (Symbol *Sym : File->exports()) {
     // Determine symbol name.
     string Name;
@@ -66,14 +59,7 @@ void TBDHandler::handleFile(const string &Path) {
       llvm::StringRef OriginalName(Sym->getName().data() - 1,
                                    Sym->getName().size() + 1);
 
-      // Save class.
-      auto Class = HAC.iOSClasses.insert(OriginalName.str()).first;
-      Class->Dylibs.push_back(Lib);
-
-      // Also let it appear as if special Objective-C symbols are exported even
-      // though they might not actually be listed in the TBD file.
-      addExport(Lib, "_OBJC_CLASS_$" + OriginalName.str());
-      addExport(Lib, "_OBJC_METACLASS_$" + OriginalName.str());
+      TBD.Exports.emplace_back(OriginalName.str(), /* ObjCClass */ true);
       continue;
     }
     case SymbolKind::ObjectiveCInstanceVariable:
@@ -89,14 +75,46 @@ void TBDHandler::handleFile(const string &Path) {
       continue;
     }
 
-    // Save export.
-    addExport(Lib, move(Name));
+    TBD.Exports.emplace_back(move(Name), /* ObjCClass */ false);
+  }
+}
+
+void TBDHandler::addFile(const TBDFile &File) {
+  if (File.InstallName.empty())
+    return;
+
+  // Save the Dylib.
+  auto [Lib, Inserted] = HAC.iOSLibs.insert(File.InstallName);
+  if (!Inserted) {
+    // Ignore Dylibs with already-found install name, the corresponding TBD
+    // files should be identical.
+    return;
+  }
+
+  for (const auto &[Name, ObjCClass] : File.Exports) {
+    if (!ObjCClass) {
+      addExport(Lib, string(Name));
+      continue;
+    }
+
+    // Save class.
+    auto Class = HAC.iOSClasses.insert(Name).first;
+    Class->Dylibs.push_back(Lib);
+
+    // Also let it appear as if special Objective-C symbols are exported even
+    // though they might not actually be listed in the TBD file.
+    addExport(Lib, "_OBJC_CLASS_$" + Name);
+    addExport(Lib, "_OBJC_METACLASS_$" + Name);
   }
 }
 
 void TBDHandler::addExport(DylibPtr Lib, string &&Name) {
-  ExportPtr Exp = HAC.iOSExps.find(Name);
-  if (Exp == HAC.iOSExps.end())
-    Exp = HAC.addExport(move(Name));
+  ExportPtr Exp = HAC.addExport(Name);
   Lib->Exports.push_back(Exp);
+  // Remember the first Dylib that implements the function. `DylibPtr`s are
+  // stable, so this can be done right away.
+  // TODO: Maybe don't do this and have only Objective-C methods inside
+  // `WrapperIndex`.
+  if (!Exp->Dylib)
+    Exp->Dylib = Lib;
 }
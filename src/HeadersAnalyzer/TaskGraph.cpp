@@ -0,0 +1,79 @@
+// TaskGraph.cpp: Implementation of class `TaskGraph`.
+
+#include "ipasim/TaskGraph.hpp"
+
+using namespace ipasim;
+using namespace std;
+
+TaskGraph::TaskGraph(unsigned Workers) {
+  if (!Workers)
+    Workers = max(thread::hardware_concurrency(), 1U);
+  Threads.reserve(Workers);
+  for (unsigned I = 0; I != Workers; ++I)
+    Threads.emplace_back(&TaskGraph::run, this);
+}
+
+TaskGraph::~TaskGraph() {
+  wait();
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Stopping = true;
+  }
+  Wake.notify_all();
+  for (thread &T : Threads)
+    T.join();
+}
+
+TaskGraph::Task *TaskGraph::add(function<void()> Func,
+                                initializer_list<Task *> Deps) {
+  return add(move(Func), vector<Task *>(Deps));
+}
+
+TaskGraph::Task *TaskGraph::add(function<void()> Func,
+                                const vector<Task *> &Deps) {
+  lock_guard<mutex> Lock(Mutex);
+  Task *T = Tasks.emplace_back(make_unique<Task>()).get();
+  T->Func = move(Func);
+  T->Pending = 0;
+  for (Task *Dep : Deps)
+    if (Dep && !Dep->Done) {
+      Dep->Dependents.push_back(T);
+      ++T->Pending;
+    }
+  ++Unfinished;
+  if (!T->Pending) {
+    Ready.push_back(T);
+    Wake.notify_one();
+  }
+  return T;
+}
+
+void TaskGraph::wait() {
+  unique_lock<mutex> Lock(Mutex);
+  Finished.wait(Lock, [this] { return !Unfinished; });
+}
+
+void TaskGraph::run() {
+  unique_lock<mutex> Lock(Mutex);
+  for (;;) {
+    Wake.wait(Lock, [this] { return Stopping || !Ready.empty(); });
+    if (Ready.empty())
+      return;
+    Task *T = Ready.front();
+    Ready.pop_front();
+
+    Lock.unlock();
+    T->Func();
+    T->Func = nullptr;
+    Lock.lock();
+
+    T->Done = true;
+    for (Task *D : T->Dependents)
+      if (!--D->Pending) {
+        Ready.push_back(D);
+        Wake.notify_one();
+      }
+    if (!--Unfinished)
+      Finished.notify_all();
+  }
+}
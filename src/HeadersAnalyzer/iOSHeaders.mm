@@ -1,4 +1,8 @@
 
+// Note that `HeadersAnalyzer` compiles this file in parts, one per framework.
+// Declarations belong to the part of the `#include` preceding them. See
+// `HeadersAnalyzer::splitAppleHeaders`.
+
 // See <objc/objc-api.h>.
 #define OBJC_OLD_DISPATCH_PROTOTYPES 0
 
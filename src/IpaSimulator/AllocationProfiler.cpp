@@ -0,0 +1,162 @@
+// AllocationProfiler.cpp: Implementation of class `AllocationProfiler`.
+
+#include "ipasim/AllocationProfiler.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/StackWalker.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Functions of `libobjc.dll` whose first argument is the class they allocate.
+constexpr const char *Allocators[] = {"class_createInstance", "_objc_rootAlloc",
+                                      "_objc_rootAllocWithZone", "objc_alloc",
+                                      "objc_allocWithZone"};
+
+} // namespace
+
+thread_local uint32_t AllocationProfiler::PendingClass = 0;
+thread_local uint64_t AllocationProfiler::UntilSample =
+    AllocationSampleInterval;
+
+void AllocationProfiler::allocate(const void *Ptr, size_t Size, bool InGuest) {
+  // Only the runtime's native allocations (see `ipaSim_guestAlloc`) belong to
+  // the class, a guest `malloc` after the wrapper returned doesn't.
+  uint32_t Class = 0;
+  if (!InGuest) {
+    Class = PendingClass;
+    PendingClass = 0;
+  }
+  if (!Ptr)
+    return;
+  IpaSim.Stats.add(Stat::HeapAllocations);
+  IpaSim.Stats.add(Stat::HeapBytes, Size);
+  if (Size < UntilSample) {
+    UntilSample -= Size;
+    return;
+  }
+  UntilSample = AllocationSampleInterval;
+  sample(Ptr, Size, Class, InGuest);
+}
+
+void AllocationProfiler::sample(const void *Ptr, size_t Size, uint32_t Class,
+                                bool InGuest) {
+  // Memory is being allocated, so the guest must be somewhere on the stack.
+  StackFrame Frames[StackWalker::MaxDepth];
+  size_t Count =
+      StackWalker(IpaSim.sys()).walk(Frames, StackWalker::MaxDepth, InGuest);
+  // Inside hooks, the first frame is the kernel function itself.
+  size_t First = InGuest && Count ? 1 : 0;
+  vector<uint32_t> Stack;
+  Stack.reserve(Count - First);
+  for (size_t I = First; I != Count; ++I)
+    Stack.push_back(Frames[I].Addr);
+
+  // Each sample stands for all bytes allocated since the previous one.
+  uint64_t Bytes = max<uint64_t>(Size, AllocationSampleInterval);
+  lock_guard<mutex> Lock(Mutex);
+  Site &S = Sites[{Class, move(Stack)}];
+  ++S.Samples;
+  S.Bytes += Bytes;
+  S.LiveBytes += Bytes;
+  // The block could have been freed without us noticing (e.g., by
+  // `GuestHeap::reallocate` keeping it in place).
+  auto [It, New] = Live.try_emplace(Ptr, Block{&S, Bytes});
+  if (!New) {
+    It->second.S->LiveBytes -= It->second.Bytes;
+    LiveBytes -= It->second.Bytes;
+    It->second = {&S, Bytes};
+  } else
+    ++LiveCount;
+  LiveBytes += Bytes;
+}
+
+void AllocationProfiler::free(const void *Ptr) {
+  if (!Ptr || !LiveCount.load(memory_order_relaxed))
+    return;
+  lock_guard<mutex> Lock(Mutex);
+  auto It = Live.find(Ptr);
+  if (It == Live.end())
+    return;
+  It->second.S->LiveBytes -= It->second.Bytes;
+  LiveBytes -= It->second.Bytes;
+  Live.erase(It);
+  --LiveCount;
+}
+
+bool AllocationProfiler::isAllocator(uint64_t Addr) {
+  HMODULE ObjC = GetModuleHandleW(L"libobjc.dll");
+  if (!ObjC || !Addr)
+    return false;
+  return any_of(begin(Allocators), end(Allocators), [&](const char *Name) {
+    return reinterpret_cast<uint64_t>(GetProcAddress(ObjC, Name)) == Addr;
+  });
+}
+
+bool AllocationProfiler::write(const string &Path) {
+  lock_guard<mutex> WriteLock(WriteMutex);
+  vector<pair<SiteKey, Site>> Copy;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Copy.assign(Sites.begin(), Sites.end());
+  }
+  sort(Copy.begin(), Copy.end(), [](const auto &A, const auto &B) {
+    return A.second.LiveBytes > B.second.LiveBytes;
+  });
+
+  // Classes are named by the runtime, it never unloads them.
+  using GetNameTy = const char *(*)(uintptr_t);
+  GetNameTy GetName = nullptr;
+  if (HMODULE ObjC = GetModuleHandleW(L"libobjc.dll"))
+    GetName =
+        reinterpret_cast<GetNameTy>(GetProcAddress(ObjC, "class_getName"));
+
+  // Stacks are `root;...;leaf` like in `GuestProfiler::write`.
+  double Seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - Start).count();
+  uint64_t Total = IpaSim.Stats.get(Stat::HeapBytes);
+  ofstream O(Path, ios::trunc);
+  O << "# Sampled every " << AllocationSampleInterval << " bytes, allocated "
+    << Total << " bytes in " << IpaSim.Stats.get(Stat::HeapAllocations)
+    << " allocations over " << Seconds << " s ("
+    << (Seconds > 0 ? Total / Seconds : 0) << " bytes/s).\n";
+  O << "live_bytes,allocated_bytes,samples,class,stack\n";
+  unordered_map<uint32_t, string> Names;
+  for (const auto &[Key, S] : Copy) {
+    O << S.LiveBytes << ',' << S.Bytes << ',' << S.Samples << ",\"";
+    if (Key.first && GetName)
+      if (const char *Name = GetName(Key.first))
+        O << Name;
+    O << "\",\"";
+    const vector<uint32_t> &Stack = Key.second;
+    for (auto It = Stack.rbegin(), End = Stack.rend(); It != End; ++It) {
+      auto [NameIt, New] = Names.try_emplace(*It);
+      if (New)
+        NameIt->second = Dyld.describeAddr(*It);
+      if (It != Stack.rbegin())
+        O << ';';
+      O << NameIt->second;
+    }
+    O << "\"\n";
+  }
+  return static_cast<bool>(O);
+}
+bool AllocationProfiler::write() {
+  error_code Error;
+  filesystem::path Dir(getCacheDir("profile"));
+  filesystem::create_directories(Dir, Error);
+  if (write((Dir / "allocations.csv").string()))
+    return true;
+  Log.warning("couldn't save allocation profile");
+  return false;
+}
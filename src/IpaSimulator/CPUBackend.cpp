@@ -0,0 +1,70 @@
+// CPUBackend.cpp: Implementation of class `CPUBackend`.
+
+#include "ipasim/CPUBackend.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/UnicornBackend.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+constexpr const char *Names[] = {"unicorn", "dynarmic"};
+static_assert(size(Names) == CPUBackend::KindCount);
+
+CPUBackend::Kind selectDefault() {
+  CPUBackend::Kind K = CPUBackend::Unicorn;
+  if (!CPUBackend::parse(DefaultCPUBackend, K))
+    Log.error() << "unknown default CPU backend " << DefaultCPUBackend
+                << Log.end();
+  if (const char *Name = getenv("IPASIM_CPU_BACKEND"))
+    if (!CPUBackend::parse(Name, K))
+      Log.error() << "unknown CPU backend " << Name << Log.end();
+  // Only Unicorn can trace instructions.
+  if (K != CPUBackend::Unicorn &&
+      IpaSim.Traces.isEnabled(TraceCategory::Instructions)) {
+    Log.info() << "using CPU backend unicorn for tracing" << Log.end();
+    K = CPUBackend::Unicorn;
+  }
+  return K;
+}
+
+} // namespace
+
+unique_ptr<CPUBackend> CPUBackend::create(Kind K) {
+  switch (K) {
+  case Unicorn: {
+    auto B = make_unique<UnicornBackend>();
+    if (!B->isValid())
+      return nullptr;
+    return B;
+  }
+  default:
+    // Backends other than Unicorn aren't part of this tree yet.
+    return nullptr;
+  }
+}
+
+CPUBackend::Kind CPUBackend::getDefault() {
+  static const Kind Default = selectDefault();
+  return Default;
+}
+
+const char *CPUBackend::getName(Kind K) {
+  return K < KindCount ? Names[K] : "unknown";
+}
+
+bool CPUBackend::parse(const char *Name, Kind &K) {
+  for (size_t I = 0; I != KindCount; ++I)
+    if (!strcmp(Name, Names[I])) {
+      K = static_cast<Kind>(I);
+      return true;
+    }
+  return false;
+}
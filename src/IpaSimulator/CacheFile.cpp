@@ -0,0 +1,112 @@
+// CacheFile.cpp: Implementation of helpers from `CacheFile.hpp`.
+
+#include "ipasim/CacheFile.hpp"
+
+#include "ipasim/IpaArchive.hpp"
+
+#include <Windows.h>
+#include <fstream>
+#include <winrt/Windows.Storage.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace winrt;
+using namespace Windows::Storage;
+
+namespace {
+
+constexpr uint32_t BundleMagic = 0x42505349; // "ISPB"
+constexpr uint32_t BundleVersion = 1;
+constexpr const char *ManifestName = "manifest";
+
+// Set before any image is loaded, so they don't need to be synchronized.
+filesystem::path BundleDir; // Bundle of the running app or empty
+bool Preparing = false;     // `BundleDir` is being written by `ipasim-prep`
+
+} // namespace
+
+filesystem::path ipasim::getCacheDir(const char *Name) {
+  if (Preparing)
+    return BundleDir / Name;
+  return filesystem::path(
+             ApplicationData::Current().LocalCacheFolder().Path().c_str()) /
+         Name;
+}
+
+vector<filesystem::path> ipasim::getCacheFiles(const char *Name,
+                                               const string &File) {
+  vector<filesystem::path> Files;
+  if (!BundleDir.empty() && !Preparing)
+    Files.push_back(BundleDir / Name / File);
+  Files.push_back(getCacheDir(Name) / File);
+  return Files;
+}
+
+filesystem::path ipasim::getBundlePath(const string &AppPath) {
+  // Files inside archives belong to the archive's bundle.
+  string File(AppPath.substr(0, AppPath.find(IpaArchive::Separator)));
+  return filesystem::path(File + ".ipasim");
+}
+
+bool ipasim::openBundle(const string &AppPath) {
+  if (Preparing)
+    return false;
+  filesystem::path Dir(getBundlePath(AppPath));
+  ifstream I(Dir / ManifestName, ios::binary);
+  if (!I)
+    return false;
+
+  // The artifacts check their own inputs, the manifest only makes sure they
+  // were prepared for this version of the app.
+  uint32_t Magic, Version;
+  string Path;
+  uint64_t Stamp;
+  if (!read(I, Magic) || Magic != BundleMagic || !read(I, Version) ||
+      Version != BundleVersion || !read(I, Path) || Path != AppPath ||
+      !read(I, Stamp) || Stamp != getFileStamp(AppPath))
+    return false;
+  BundleDir = move(Dir);
+  return true;
+}
+
+bool ipasim::beginBundle(const string &AppPath) {
+  error_code Error;
+  filesystem::path Dir(getBundlePath(AppPath));
+  filesystem::create_directories(Dir, Error);
+  if (Error)
+    return false;
+  filesystem::remove(Dir / ManifestName, Error);
+  if (Error)
+    return false;
+  BundleDir = move(Dir);
+  Preparing = true;
+  return true;
+}
+
+bool ipasim::finishBundle(const string &AppPath) {
+  uint64_t Stamp = getFileStamp(AppPath);
+  if (!Preparing || !Stamp)
+    return false;
+  ofstream O(BundleDir / ManifestName, ios::binary | ios::trunc);
+  write(O, BundleMagic);
+  write(O, BundleVersion);
+  write(O, AppPath);
+  write(O, Stamp);
+  O.close();
+  return static_cast<bool>(O);
+}
+
+// Combines path, size and last write time of the file.
+uint64_t ipasim::getFileStamp(const string &Path) {
+  // Files inside archives are as old as the archive itself.
+  WIN32_FILE_ATTRIBUTE_DATA Data;
+  string File(Path.substr(0, Path.find(IpaArchive::Separator)));
+  if (!GetFileAttributesExW(filesystem::path(File).c_str(),
+                            GetFileExInfoStandard, &Data))
+    return 0;
+
+  uint64_t Hash = hashBytes(Path.data(), Path.size(), HashSeed);
+  Hash = hashBytes(&Data.nFileSizeLow, sizeof(Data.nFileSizeLow), Hash);
+  Hash = hashBytes(&Data.nFileSizeHigh, sizeof(Data.nFileSizeHigh), Hash);
+  return hashBytes(&Data.ftLastWriteTime, sizeof(Data.ftLastWriteTime), Hash);
+}
@@ -0,0 +1,86 @@
+// ClassRealizer.cpp: Implementation of class `ClassRealizer`.
+
+#include "ipasim/ClassRealizer.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+
+using namespace ipasim;
+using namespace std;
+
+void ClassRealizer::add(const void *Hdr) {
+  lock_guard<mutex> Lock(Mutex);
+  Images.push_back(Hdr);
+  updateCount();
+}
+
+void ClassRealizer::remove(const void *Hdr) {
+  lock_guard<mutex> Lock(Mutex);
+  Images.erase(std::remove(Images.begin(), Images.end(), Hdr), Images.end());
+  updateCount();
+}
+
+void ClassRealizer::prioritize(vector<string> Priority) {
+  lock_guard<mutex> Lock(Mutex);
+  Names.insert(Names.end(), make_move_iterator(Priority.rbegin()),
+               make_move_iterator(Priority.rend()));
+  updateCount();
+}
+
+bool ClassRealizer::realize(size_t Count) {
+  vector<string> Batch;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    if (!LookUp) {
+      if (HMODULE ObjC = GetModuleHandleW(L"libobjc.dll"))
+        LookUp = reinterpret_cast<LookUpFunc>(
+            GetProcAddress(ObjC, "objc_lookUpClass"));
+      if (!LookUp) {
+        // Without the runtime, there is nothing to realize.
+        Names.clear();
+        Images.clear();
+        updateCount();
+        return false;
+      }
+    }
+
+    while (Batch.size() != Count) {
+      if (Names.empty()) {
+        if (Images.empty())
+          break;
+        // The image cannot be unloaded meanwhile, `remove` waits for the lock.
+        // Names are copied, so they can be looked up without it.
+        vector<ObjCClass> Classes(MachO(Images.front()).getClasses());
+        Images.pop_front();
+        for (auto I = Classes.rbegin(), End = Classes.rend(); I != End; ++I)
+          if (!I->isRealized())
+            Names.emplace_back(I->getName());
+        continue;
+      }
+      Batch.push_back(move(Names.back()));
+      Names.pop_back();
+    }
+    updateCount();
+  }
+
+  // Takes the runtime lock, so it must be called without `Mutex`, the runtime
+  // can call back into `DynamicLoader` (see `ipaSim_methodsAdded`).
+  for (const string &Name : Batch)
+    if (LookUp(Name.c_str()))
+      IpaSim.Stats.add(Stat::Prerealized);
+  return hasPending();
+}
+
+vector<string> ClassRealizer::getUsed(MachO Image) {
+  vector<string> Result;
+  for (ObjCClass Class : Image.getClasses())
+    if (Class.isRealized() && Class.hasCachedMethods())
+      Result.emplace_back(Class.getName());
+  return Result;
+}
+
+void ClassRealizer::updateCount() {
+  PendingCount.store(Names.size() + Images.size(), memory_order_relaxed);
+}
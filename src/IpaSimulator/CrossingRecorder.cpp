@@ -0,0 +1,174 @@
+// CrossingRecorder.cpp: Implementation of class `CrossingRecorder`.
+
+#include "ipasim/CrossingRecorder.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+struct RecordingHeader {
+  static constexpr char MagicValue[8] = {'I', 'P', 'A', 'R',
+                                         'E', 'C', 'R', 'D'};
+  static constexpr uint32_t CurrentVersion = 1;
+
+  char Magic[8];
+  uint32_t Version;
+  uint32_t RecordSize;
+};
+
+bool isCommitted(uint32_t Addr) {
+  MEMORY_BASIC_INFORMATION Info;
+  return Addr && VirtualQuery(reinterpret_cast<void *>(Addr), &Info,
+                              sizeof(Info)) &&
+         Info.State == MEM_COMMIT;
+}
+
+} // namespace
+
+bool CrossingRecorder::record(const string &Path) {
+  this->Path = Path;
+  Records.clear();
+  Mode = Recording;
+  Thread = this_thread::get_id();
+  return true;
+}
+
+bool CrossingRecorder::replay(const string &Path) {
+  ifstream I(Path, ios::binary | ios::ate);
+  RecordingHeader H;
+  size_t Size = I ? static_cast<size_t>(I.tellg()) : 0;
+  I.seekg(0);
+  if (!I || Size < sizeof(H) ||
+      !I.read(reinterpret_cast<char *>(&H), sizeof(H)) ||
+      memcmp(H.Magic, RecordingHeader::MagicValue, sizeof(H.Magic)) ||
+      H.Version != RecordingHeader::CurrentVersion ||
+      H.RecordSize != sizeof(CrossingRecord)) {
+    Log.error() << "invalid crossing recording: " << Path << Log.end();
+    return false;
+  }
+  Records.resize((Size - sizeof(H)) / sizeof(CrossingRecord));
+  if (!I.read(reinterpret_cast<char *>(Records.data()),
+              Records.size() * sizeof(CrossingRecord))) {
+    Log.error() << "cannot read crossing recording: " << Path << Log.end();
+    return false;
+  }
+  this->Path = Path;
+  Cursor = Replayed = 0;
+  Mode = Replaying;
+  Thread = this_thread::get_id();
+  return true;
+}
+
+bool CrossingRecorder::finish() {
+  if (Mode == Replaying || Mode == Diverged) {
+    Log.info() << "replayed " << Replayed << " of " << Cursor
+               << " matched crossings (" << Records.size() << " recorded)"
+               << Log.end();
+    Mode = Off;
+    return true;
+  }
+  lock_guard<mutex> Lock(Mutex);
+  if (Mode != Recording)
+    return true;
+  Mode = Off;
+
+  ofstream O(Path, ios::binary | ios::trunc);
+  RecordingHeader H{};
+  memcpy(H.Magic, RecordingHeader::MagicValue, sizeof(H.Magic));
+  H.Version = RecordingHeader::CurrentVersion;
+  H.RecordSize = sizeof(CrossingRecord);
+  O.write(reinterpret_cast<const char *>(&H), sizeof(H));
+  O.write(reinterpret_cast<const char *>(Records.data()),
+          Records.size() * sizeof(CrossingRecord));
+  if (!O) {
+    Log.error() << "cannot write crossing recording: " << Path << Log.end();
+    return false;
+  }
+  Log.info() << "recorded " << Records.size() << " crossings into " << Path
+             << Log.end();
+  return true;
+}
+
+size_t CrossingRecorder::match(CrossingRecord::KindTy Kind, uint64_t Target) {
+  if (Cursor != Records.size() && Records[Cursor].Kind == Kind &&
+      Records[Cursor].Target == Target)
+    return Cursor++;
+
+  Log.error() << "replay diverged at crossing " << Cursor << " ("
+              << IpaSim.Dyld.dumpAddr(Target) << "), continuing natively"
+              << Log.end();
+  Mode = Diverged;
+  return None;
+}
+
+size_t CrossingRecorder::addCall(uint64_t Target, uint8_t Flags,
+                                 const uint32_t *Regs) {
+  if (Mode == Replaying)
+    return match(CrossingRecord::Call, Target);
+
+  lock_guard<mutex> Lock(Mutex);
+  if (Mode != Recording)
+    return None;
+  CrossingRecord &R = Records.emplace_back();
+  R.Target = Target;
+  copy(Regs, Regs + RegisterBlock::ArgRegs, R.Args);
+  R.SP = Regs[RegisterBlock::ArgRegs];
+  R.Kind = CrossingRecord::Call;
+  R.Flags = Flags;
+  R.ResultArg = -1;
+  return Records.size() - 1;
+}
+
+void CrossingRecorder::addCallback(uint64_t Target, const uint32_t *Args) {
+  if (Mode == Replaying) {
+    match(CrossingRecord::Callback, Target);
+    return;
+  }
+
+  lock_guard<mutex> Lock(Mutex);
+  if (Mode != Recording)
+    return;
+  CrossingRecord &R = Records.emplace_back();
+  R.Target = Target;
+  copy(Args, Args + RegisterBlock::ArgRegs, R.Args);
+  R.Kind = CrossingRecord::Callback;
+  R.ResultArg = -1;
+}
+
+void CrossingRecorder::setResult(size_t I, const RegisterBlock &Block) {
+  if (I == None)
+    return;
+  lock_guard<mutex> Lock(Mutex);
+  if (Mode != Recording)
+    return;
+  CrossingRecord &R = Records[I];
+  copy(Block.R, Block.R + RegisterBlock::ResultRegs, R.Result);
+  auto *Arg = find(begin(R.Args), end(R.Args), R.Result[0]);
+  if (Arg != end(R.Args) && R.Result[0])
+    R.ResultArg = static_cast<int8_t>(Arg - begin(R.Args));
+  else if (isCommitted(R.Result[0]))
+    R.Flags |= CrossingRecord::Pointer;
+}
+
+bool CrossingRecorder::replayResult(size_t I, RegisterBlock &Block) {
+  if (Mode != Replaying || I == None)
+    return false;
+  const CrossingRecord &R = Records[I];
+  constexpr uint8_t Replayable =
+      CrossingRecord::Leaf | CrossingRecord::Registers;
+  if ((R.Flags & (Replayable | CrossingRecord::Pointer)) != Replayable)
+    return false;
+  uint32_t Result0 = R.ResultArg >= 0 ? Block.R[R.ResultArg] : R.Result[0];
+  copy(R.Result, R.Result + RegisterBlock::ResultRegs, Block.R);
+  Block.R[0] = Result0;
+  ++Replayed;
+  return true;
+}
@@ -0,0 +1,214 @@
+// CrossingStats.cpp: Implementation of class `CrossingStats`.
+
+#include "ipasim/CrossingStats.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/Common.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <utility>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+constexpr const char *KindNames[] = {"wrapper", "wrapper_dll", "dynamic",
+                                     "trampoline", "callback"};
+static_assert(size(KindNames) == CrossingStats::KindCount);
+
+// Adds back the underscore prefix of C functions (see
+// `LoadedLibrary::findNearestSymbol`), so that the name is mangled like in
+// HeadersAnalyzer.
+string decorate(const char *Name) {
+  if (*Name == '?' || *Name == '-' || *Name == '+' || *Name == '$')
+    return Name;
+  return '_' + string(Name);
+}
+
+} // namespace
+
+// There is only one instance, so the table can be cached per thread.
+CrossingStats::Table &CrossingStats::getTable() {
+  thread_local Table *Current = nullptr;
+  if (!Current) {
+    lock_guard<mutex> Lock(Mutex);
+    Current = Tables.emplace_back(make_unique<Table>()).get();
+  }
+  return *Current;
+}
+
+void CrossingStats::record(KindTy Kind, uint64_t Target,
+                           chrono::nanoseconds Time) {
+  size_t Bucket = 0;
+  for (auto Ns = static_cast<uint64_t>(Time.count());
+       Ns && Bucket != Buckets - 1; Ns >>= 1)
+    ++Bucket;
+
+  // Time of native code (including emulation it calls back into).
+  if (Kind == WrapperDLL || Kind == Dynamic)
+    IpaSim.Stats.add(Stat::NativeTime, static_cast<uint64_t>(Time.count()));
+
+  Table &T = getTable();
+  lock_guard<mutex> Lock(T.Mutex);
+  Entry &E = T.Entries[uint64_t(Kind) << 32 | (Target & 0xFFFFFFFF)];
+  ++E.Count;
+  E.Total += Time;
+  ++E.Histogram[Bucket];
+}
+
+string CrossingStats::getName(uint64_t Addr) {
+  LibraryInfo LI(Dyld.lookup(Addr));
+  if (!LI.Lib)
+    return Dyld.describeAddr(Addr);
+  uint64_t SymAddr = 0;
+  const char *Sym = LI.Lib->findNearestSymbol(Addr, SymAddr);
+  if (!Sym || SymAddr != Addr)
+    return Dyld.describeAddr(Addr);
+
+  // Report DLL wrappers as the functions they wrap.
+  if (LI.Lib->IsWrapper)
+    if (uint64_t Wrapped = Dyld.getWrappedFunction(Addr))
+      return getName(Wrapped);
+  return decorate(Sym);
+}
+
+unordered_map<uint64_t, CrossingStats::Entry> CrossingStats::merge() {
+  unordered_map<uint64_t, Entry> Entries;
+  lock_guard<mutex> Lock(Mutex);
+  for (const unique_ptr<Table> &T : Tables) {
+    lock_guard<mutex> TableLock(T->Mutex);
+    for (const auto &[Key, E] : T->Entries)
+      Entries[Key].add(E);
+  }
+  return Entries;
+}
+
+bool CrossingStats::write(const string &Path) {
+  lock_guard<mutex> WriteLock(WriteMutex);
+
+  // Different addresses can have the same name (e.g., a DLL function and its
+  // wrapper).
+  unordered_map<uint64_t, Entry> Entries(merge());
+  map<pair<KindTy, string>, Entry> Named;
+  for (const auto &[Key, E] : Entries)
+    Named[{static_cast<KindTy>(Key >> 32), getName(Key & 0xFFFFFFFF)}].add(E);
+
+  // Histogram is a list of `bucket:count` pairs of non-empty buckets.
+  ofstream O(Path, ios::trunc);
+  O << "kind,name,count,total_ns,histogram\n";
+  for (const auto &[Key, E] : Named) {
+    O << KindNames[Key.first] << ",\"" << Key.second << "\"," << E.Count << ','
+      << E.Total.count() << ',';
+    bool First = true;
+    for (size_t I = 0; I != Buckets; ++I)
+      if (E.Histogram[I]) {
+        O << (First ? "" : " ") << I << ':' << E.Histogram[I];
+        First = false;
+      }
+    O << '\n';
+  }
+
+  // Calls through wrappers, hottest first.
+  map<string, uint64_t> Counts;
+  for (const auto &[Key, E] : Named)
+    if (Key.first == Wrapper || Key.first == WrapperDLL)
+      Counts[Key.second] += E.Count;
+  vector<pair<uint64_t, string>> Sorted;
+  for (auto &[Name, Count] : Counts)
+    Sorted.emplace_back(Count, Name);
+  sort(Sorted.begin(), Sorted.end(), greater<>());
+  ofstream P(filesystem::path(Path).replace_extension(".txt"), ios::trunc);
+  P << "# Written by `CrossingStats`, usable as `wrapper_profile.txt`.\n";
+  for (const auto &[Count, Name] : Sorted)
+    P << Count << ' ' << Name << '\n';
+  return O && P;
+}
+vector<pair<string, uint64_t>> CrossingStats::takeHottest(size_t Count) {
+  lock_guard<mutex> WriteLock(WriteMutex);
+
+  // Only targets called meanwhile are named, so that this is cheap enough to
+  // be called every second.
+  map<string, uint64_t> Counts;
+  for (const auto &[Key, E] : merge()) {
+    auto Kind = static_cast<KindTy>(Key >> 32);
+    if (Kind != Wrapper && Kind != WrapperDLL)
+      continue;
+    uint64_t &Seen = HotCounts[Key];
+    if (E.Count != Seen)
+      Counts[getName(Key & 0xFFFFFFFF)] += E.Count - Seen;
+    Seen = E.Count;
+  }
+
+  vector<pair<string, uint64_t>> Hottest(Counts.begin(), Counts.end());
+  sort(Hottest.begin(), Hottest.end(),
+       [](const auto &A, const auto &B) { return A.second > B.second; });
+  if (Hottest.size() > Count)
+    Hottest.resize(Count);
+  return Hottest;
+}
+
+bool CrossingStats::write() {
+  error_code Error;
+  filesystem::path Dir(getCacheDir("profile"));
+  filesystem::create_directories(Dir, Error);
+  if (write((Dir / "crossings.csv").string()))
+    return true;
+  Log.warning("couldn't save crossing statistics");
+  return false;
+}
+
+void CrossingStats::cover(uint64_t Target) {
+  lock_guard<mutex> Lock(CoverageMutex);
+  Covered.insert(Target);
+}
+
+bool CrossingStats::writeCoverage(const string &Path) {
+  lock_guard<mutex> WriteLock(WriteMutex);
+
+  // Comments of the existing file are kept.
+  vector<string> Comments;
+  set<string> Names;
+  {
+    ifstream I(Path);
+    string Line;
+    while (getline(I, Line)) {
+      if (Line.empty())
+        continue;
+      if (Line[0] == '#')
+        Comments.push_back(move(Line));
+      else
+        Names.insert(move(Line));
+    }
+  }
+  {
+    lock_guard<mutex> Lock(CoverageMutex);
+    for (uint64_t Target : Covered)
+      Names.insert(getName(Target));
+  }
+
+  if (Comments.empty())
+    Comments.emplace_back(
+        "# Written by `CrossingStats`, usable as `wrapper_coverage.txt`.");
+  ofstream O(Path, ios::trunc);
+  for (const string &Comment : Comments)
+    O << Comment << '\n';
+  for (const string &Name : Names)
+    O << Name << '\n';
+  return static_cast<bool>(O);
+}
+bool CrossingStats::writeCoverage() {
+  error_code Error;
+  filesystem::path Dir(getCacheDir("profile"));
+  filesystem::create_directories(Dir, Error);
+  if (writeCoverage((Dir / "wrapper_coverage.txt").string()))
+    return true;
+  Log.warning("couldn't save wrapper coverage");
+  return false;
+}
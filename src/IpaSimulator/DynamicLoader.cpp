@@ -3,11 +3,23 @@
 #include "ipasim/DynamicLoader.hpp"
 
 #include "ipasim/Common.hpp"
+#include "ipasim/EventProvider.hpp"
 #include "ipasim/IpaSimulator.hpp"
 #include "ipasim/IpaSimulator/Config.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <filesystem>
-#include <psapi.h> // For `GetModuleInformation`
+#include <fstream>
+#include <llvm/BinaryFormat/MachO.h>
+#include <psapi.h> // For module and process memory information
+#include <set>
+#include <thread>
 #include <winrt/Windows.ApplicationModel.h>
 #include <winrt/Windows.Storage.h>
 
@@ -17,47 +29,482 @@ using namespace winrt;
 using namespace Windows::ApplicationModel;
 using namespace Windows::Storage;
 
+namespace {
+
+// DLL wrappers are named after RVAs of the functions they wrap (see
+// `IRHelper::declareFunc`).
+constexpr ConstexprString WrapperPrefix = "$__ipaSim_wrapper_";
+// See `SysTranslator::DLLBase`.
+constexpr uint64_t DLLBase = 0x1000;
+
+// Parses only the image selected by `Mapping` (if it has been opened), so
+// that other slices of fat binaries are skipped.
+unique_ptr<LIEF::MachO::FatBinary>
+parseImage(ImageMapping &Mapping, bool Opened, const string &Path) {
+  if (!Opened || (!Mapping.isSlice() && !Mapping.isArchived()))
+    return LIEF::MachO::Parser::parse(Path);
+  const uint8_t *Data = Mapping.getImageData();
+  return LIEF::MachO::Parser::parse(
+      vector<uint8_t>(Data, Data + Mapping.getImageSize()), Path);
+}
+
+// Slides `Count` pointers starting at `Ptr`, `Stride` bytes apart. We actively
+// leave NULL pointers untouched. Technically it would be correct to slide them
+// because the PAGEZERO segment slid, too. But programs probably wouldn't be
+// happy if their NULLs were non-zero.
+// TODO: Solve this as the original dyld does. Maybe by always mapping PAGEZERO
+// to address 0 or something like that.
+void slidePointers(uint8_t *Ptr, uint64_t Count, uint32_t Stride,
+                   uint32_t Slide) {
+  if (Stride == sizeof(uint32_t) &&
+      reinterpret_cast<uintptr_t>(Ptr) % alignof(uint32_t) == 0) {
+    // Contiguous pointers, the compiler can vectorize this.
+    uint32_t *Vals = reinterpret_cast<uint32_t *>(Ptr);
+    for (uint64_t I = 0; I != Count; ++I)
+      Vals[I] += Vals[I] ? Slide : 0;
+    return;
+  }
+  for (uint64_t I = 0; I != Count; ++I, Ptr += Stride) {
+    uint32_t Val;
+    memcpy(&Val, Ptr, sizeof(Val));
+    if (Val != 0) {
+      Val += Slide;
+      memcpy(Ptr, &Val, sizeof(Val));
+    }
+  }
+}
+
+// Applies `Runs` of rebases. If there are many of them, they are split into
+// chunks which are slid on multiple threads.
+void applyRebases(const vector<MachOInfo::RebaseRun> &Runs, uint32_t Slide) {
+  constexpr uint64_t ChunkSize = 16384;        // Pointers per chunk
+  constexpr uint64_t ParallelThreshold = 65536; // Total pointers
+
+  uint64_t Total = 0;
+  for (const MachOInfo::RebaseRun &Run : Runs)
+    Total += Run.Count;
+  size_t ThreadCount = thread::hardware_concurrency();
+  if (Total < ParallelThreshold || ThreadCount < 2) {
+    for (const MachOInfo::RebaseRun &Run : Runs)
+      slidePointers(reinterpret_cast<uint8_t *>(Run.Addr + Slide), Run.Count,
+                    Run.Stride, Slide);
+    return;
+  }
+
+  // Split big runs, so that chunks are of similar size.
+  vector<MachOInfo::RebaseRun> Chunks;
+  for (const MachOInfo::RebaseRun &Run : Runs)
+    for (uint64_t Done = 0; Done < Run.Count; Done += ChunkSize)
+      Chunks.push_back(MachOInfo::RebaseRun{Run.Addr + Done * Run.Stride,
+                                            min(ChunkSize, Run.Count - Done),
+                                            Run.Stride});
+
+  atomic<size_t> Next = 0;
+  auto Work = [&]() {
+    for (size_t I; (I = Next++) < Chunks.size();) {
+      const MachOInfo::RebaseRun &C = Chunks[I];
+      slidePointers(reinterpret_cast<uint8_t *>(C.Addr + Slide), C.Count,
+                    C.Stride, Slide);
+    }
+  };
+  vector<thread> Threads;
+  for (size_t I = 1; I < ThreadCount; ++I)
+    Threads.emplace_back(Work);
+  Work();
+  for (thread &T : Threads)
+    T.join();
+}
+
+string toLower(string S) {
+  transform(S.begin(), S.end(), S.begin(),
+            [](unsigned char C) { return static_cast<char>(tolower(C)); });
+  return S;
+}
+
+// Win32 attribute query is much cheaper than WinRT's `StorageFile`.
+bool isRegularFile(const filesystem::path &Path) {
+  WIN32_FILE_ATTRIBUTE_DATA Data;
+  return GetFileAttributesExW(Path.c_str(), GetFileExInfoStandard, &Data) &&
+         !(Data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+constexpr const char *IndexedDir = "gen\\";
+
+// Adds committed bytes of range [`Addr`, `Addr + Size`) to `Private` or
+// `Shared`. File-backed pages become private when they're written, which
+// changes their protection from copy-on-write to read-write.
+void queryCommitted(uint64_t Addr, uint64_t Size, uint64_t &Private,
+                    uint64_t &Shared) {
+  for (uint64_t End = Addr + Size; Addr < End;) {
+    MEMORY_BASIC_INFORMATION MBI;
+    if (!VirtualQuery(reinterpret_cast<void *>(Addr), &MBI, sizeof(MBI)))
+      return;
+    uint64_t RegionEnd =
+        min(reinterpret_cast<uint64_t>(MBI.BaseAddress) + MBI.RegionSize, End);
+    if (MBI.State == MEM_COMMIT) {
+      bool Written = MBI.Protect & (PAGE_READWRITE | PAGE_EXECUTE_READWRITE);
+      (MBI.Type == MEM_PRIVATE || Written ? Private : Shared) +=
+          RegionEnd - Addr;
+    }
+    Addr = RegionEnd;
+  }
+}
+
+// Frees memory of an image filled by `ImageMapping`. Its views and committed
+// parts are turned back into placeholders, which are then merged into one.
+// Returns `false` if the image wasn't reserved as a placeholder, in which case
+// its whole allocation is released instead. `Size` is rounded up to allocation
+// granularity.
+bool releaseImageMemory(uint64_t Addr, uint64_t &Size) {
+  SYSTEM_INFO Info;
+  GetSystemInfo(&Info);
+  Size = (Size + Info.dwAllocationGranularity - 1) /
+         Info.dwAllocationGranularity * Info.dwAllocationGranularity;
+  for (uint64_t Cur = Addr, End = Addr + Size; Cur < End;) {
+    MEMORY_BASIC_INFORMATION MBI;
+    if (!VirtualQuery(reinterpret_cast<void *>(Cur), &MBI, sizeof(MBI)))
+      break;
+    Cur = reinterpret_cast<uint64_t>(MBI.BaseAddress) + MBI.RegionSize;
+    // Written pages of a view form separate regions, the whole view is
+    // unmapped at its first one. Placeholders are reported as reserved.
+    if (MBI.Type == MEM_MAPPED)
+      UnmapViewOfFile2(GetCurrentProcess(), MBI.AllocationBase,
+                       MEM_PRESERVE_PLACEHOLDER);
+    else if (MBI.State == MEM_COMMIT &&
+             !VirtualFree(MBI.AllocationBase, 0,
+                          MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+      VirtualFree(reinterpret_cast<void *>(Addr), 0, MEM_RELEASE);
+      return false;
+    }
+  }
+  // This fails if there is only one placeholder already, which is fine.
+  VirtualFree(reinterpret_cast<void *>(Addr), Size,
+              MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS);
+  return true;
+}
+
+} // namespace
+
+PackageIndex &PackageIndex::get() {
+  static PackageIndex Index;
+  return Index;
+}
+
+PackageIndex::PackageIndex()
+    : InstallDir(Package::Current().InstalledLocation().Path().c_str()) {
+  error_code Error;
+  for (auto I = filesystem::recursive_directory_iterator(InstallDir / "gen",
+                                                         Error),
+            End = filesystem::recursive_directory_iterator();
+       I != End; I.increment(Error)) {
+    if (Error)
+      break;
+    if (!I->is_regular_file(Error))
+      continue;
+    string Path(I->path().lexically_relative(InstallDir).string());
+    Files.emplace(toLower(Path), move(Path));
+  }
+}
+
+const string *PackageIndex::find(const string &Path) const {
+  auto It = Files.find(toLower(Path));
+  return It != Files.end() ? &It->second : nullptr;
+}
+
+bool PackageIndex::isIndexed(const string &Path) const {
+  return startsWith(toLower(Path), IndexedDir);
+}
+
 bool BinaryPath::isFileValid() const {
-  if (Relative) {
-    return Package::Current()
-               .InstalledLocation()
-               .TryGetItemAsync(to_hstring(Path))
-               .get() != nullptr;
-  }
-  try {
-    StorageFile File =
-        StorageFile::GetFileFromPathAsync(to_hstring(Path)).get();
+  if (IpaArchive::isArchived(Path)) {
+    IpaArchive *Archive;
+    return IpaArchive::lookup(Path, Archive) != nullptr;
+  }
+  if (!Relative)
+    return isRegularFile(Path);
+
+  const PackageIndex &Index = PackageIndex::get();
+  if (Index.isIndexed(Path))
+    return Index.find(Path) != nullptr;
+  return isRegularFile(Index.getInstallDir() / Path);
+}
+
+ImageMapping::~ImageMapping() {
+  // Archived images point into `Buffer` or into the archive's mapping.
+  if (Buffer)
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+  else if (FileData && !Archived)
+    UnmapViewOfFile(FileData);
+  // Mapped views keep the section alive.
+  if (Section)
+    CloseHandle(Section);
+  if (SnapshotSection)
+    CloseHandle(SnapshotSection);
+  if (File)
+    CloseHandle(File);
+}
+
+uint64_t ImageMapping::reserve(uint64_t Size, GuestArena &Arena,
+                               uint64_t Preferred) {
+  SYSTEM_INFO Info;
+  GetSystemInfo(&Info);
+  Granularity = Info.dwAllocationGranularity;
+
+  // This fails if anything (including the arena) already occupies the range.
+  if (Preferred && Preferred % Granularity == 0) {
+    void *Ptr = VirtualAlloc2FromApp(
+        nullptr, reinterpret_cast<void *>(Preferred), Size,
+        MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+    if (Ptr) {
+      UsePlaceholders = true;
+      Placeholders[Preferred] = Size;
+      return Preferred;
+    }
+  }
+
+  if (uint64_t Addr = Arena.reserve(Size)) {
+    UsePlaceholders = true;
+    Placeholders[Addr] = Size;
+    return Addr;
+  }
+
+  void *Ptr = VirtualAlloc2FromApp(nullptr, nullptr, Size,
+                                   MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,
+                                   PAGE_NOACCESS, nullptr, 0);
+  if (Ptr) {
+    UsePlaceholders = true;
+    Placeholders[reinterpret_cast<uint64_t>(Ptr)] = Size;
+    return reinterpret_cast<uint64_t>(Ptr);
+  }
+
+  // Placeholders are not supported, so fall back to committing everything
+  // right away. Pages are still zero-filled lazily by the system.
+  Ptr = VirtualAllocFromApp(nullptr, Size, MEM_RESERVE | MEM_COMMIT,
+                            PAGE_READWRITE);
+  return reinterpret_cast<uint64_t>(Ptr);
+}
+
+bool ImageMapping::open(const string &Path) {
+  if (IpaArchive::isArchived(Path))
+    return openArchived(Path);
+
+  HANDLE H = CreateFile2(to_hstring(Path).c_str(), GENERIC_READ,
+                         FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (H == INVALID_HANDLE_VALUE)
+    return false;
+  File = H;
+
+  LARGE_INTEGER Size;
+  if (!GetFileSizeEx(File, &Size))
+    return false;
+  FileSize = Size.QuadPart;
+
+  Section = CreateFileMappingFromApp(File, nullptr, PAGE_WRITECOPY, 0, nullptr);
+  if (!Section)
+    return false;
+  FileData = static_cast<const uint8_t *>(
+      MapViewOfFileFromApp(Section, FILE_MAP_READ, 0, 0));
+  if (!FileData)
+    return false;
+
+  // Only the selected slice of a fat binary is ever read or mapped.
+  return MachOReader::findSlice(FileData, FileSize, ImageOffset, ImageSize);
+}
+
+bool ImageMapping::openArchived(const string &Path) {
+  Archived = true;
+  IpaArchive *Archive;
+  const IpaArchive::Entry *E = IpaArchive::lookup(Path, Archive);
+  if (!E)
+    return false;
+  FileSize = E->Size;
+  FileData = Archive->getData(*E);
+  if (!FileData) {
+    // Pages are committed lazily, so the buffer costs only what the
+    // decompressor writes.
+    Buffer = VirtualAllocFromApp(nullptr, FileSize, MEM_RESERVE | MEM_COMMIT,
+                                 PAGE_READWRITE);
+    if (!Buffer || !Archive->extract(*E, static_cast<uint8_t *>(Buffer)))
+      return false;
+    FileData = static_cast<const uint8_t *>(Buffer);
+  }
+  return MachOReader::findSlice(FileData, FileSize, ImageOffset, ImageSize);
+}
+
+bool ImageMapping::mapView(uint64_t Addr, uint64_t Size, uint64_t Offset) {
+  // The view must replace a whole placeholder, so it cannot extend past the
+  // end of the file.
+  Offset += ImageOffset;
+  if (!UsePlaceholders || !Section || Addr % Granularity ||
+      Offset % Granularity || Offset + Size > FileSize)
+    return false;
+  if (!split(Addr, Size))
+    return false;
+
+  // Segments are mapped copy-on-write, so that they can be rebased and written
+  // by the emulated code without affecting the file.
+  void *Ptr = MapViewOfFile3FromApp(
+      Section, GetCurrentProcess(), reinterpret_cast<void *>(Addr), Offset,
+      Size, MEM_REPLACE_PLACEHOLDER, PAGE_WRITECOPY, nullptr, 0);
+  if (Ptr)
     return true;
-  } catch (...) {
+
+  // Give the range back, so that it can be committed instead.
+  Placeholders[Addr] = Size;
+  return false;
+}
+
+bool ImageMapping::commit(uint64_t Addr, uint64_t Size) {
+  if (!UsePlaceholders)
+    return true;
+  if (!split(Addr, Size))
+    return false;
+  return VirtualAlloc2FromApp(nullptr, reinterpret_cast<void *>(Addr), Size,
+                              MEM_RESERVE | MEM_COMMIT |
+                                  MEM_REPLACE_PLACEHOLDER,
+                              PAGE_READWRITE, nullptr, 0) != nullptr;
+}
+
+bool ImageMapping::mapSnapshot(const ImageSnapshot &Snap) {
+  if (!UsePlaceholders || Snap.getDataOffset() % Granularity)
     return false;
+  HANDLE H = CreateFile2(Snap.getFilePath().c_str(), GENERIC_READ,
+                         FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (H == INVALID_HANDLE_VALUE)
+    return false;
+  SnapshotSection =
+      CreateFileMappingFromApp(H, nullptr, PAGE_WRITECOPY, 0, nullptr);
+  CloseHandle(H);
+  if (!SnapshotSection || !split(Snap.StartAddress, Snap.Size))
+    return false;
+
+  void *Ptr = MapViewOfFile3FromApp(
+      SnapshotSection, GetCurrentProcess(),
+      reinterpret_cast<void *>(Snap.StartAddress), Snap.getDataOffset(),
+      Snap.Size, MEM_REPLACE_PLACEHOLDER, PAGE_WRITECOPY, nullptr, 0);
+  if (Ptr)
+    return true;
+  Placeholders[Snap.StartAddress] = Snap.Size;
+  return false;
+}
+
+bool ImageMapping::split(uint64_t Addr, uint64_t Size) {
+  auto I = Placeholders.upper_bound(Addr);
+  if (I == Placeholders.begin())
+    return false;
+  --I;
+  uint64_t Start = I->first;
+  uint64_t End = Start + I->second;
+  if (Addr + Size > End)
+    return false;
+
+  // Replacing a whole placeholder doesn't need splitting.
+  if (Start != Addr || End != Addr + Size) {
+    if (!VirtualFree(reinterpret_cast<void *>(Addr), Size,
+                     MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+      return false;
+    if (Start != Addr)
+      Placeholders[Start] = Addr - Start;
+    if (End != Addr + Size)
+      Placeholders[Addr + Size] = End - Addr - Size;
   }
+  Placeholders.erase(Addr);
+  return true;
 }
 
-DynamicLoader::DynamicLoader(Emulator &Emu) : Emu(Emu) {
+DynamicLoader::DynamicLoader(GuestMemoryMap &Space) : Space(Space) {
   // Map "kernel" page.
-  void *KernelPtr =
-      _aligned_malloc(DynamicLoader::PageSize, DynamicLoader::PageSize);
+  void *KernelPtr = Arena.allocate(DynamicLoader::PageSize);
+  if (!KernelPtr)
+    KernelPtr =
+        _aligned_malloc(DynamicLoader::PageSize, DynamicLoader::PageSize);
   KernelAddr = reinterpret_cast<uint64_t>(KernelPtr);
-  Emu.mapMemory(KernelAddr, DynamicLoader::PageSize, UC_PROT_NONE);
+  Space.mapRange(KernelAddr, DynamicLoader::PageSize, UC_PROT_NONE);
+
+  // Map batch stub. It gets pointer to `SysTranslator::BatchFrame` in R0.
+  static constexpr uint32_t BatchStub[] = {
+      0xE92D4570, //       push {r4, r5, r6, r8, r10, lr}
+      0xE1A04000, //       mov r4, r0
+      0xE5945008, //       ldr r5, [r4, #8]     ; Count
+      0xE594600C, //       ldr r6, [r4, #12]    ; Args
+      0xE5948010, //       ldr r8, [r4, #16]    ; Results
+      0xE3550000, // loop: cmp r5, #0
+      0x0A00000A, //       beq done
+      0xE8B6000F, //       ldm r6!, {r0, r1, r2, r3}
+      0xE594C000, //       ldr r12, [r4]        ; FP
+      0xE12FFF3C, //       blx r12
+      0xE3580000, //       cmp r8, #0
+      0x14880004, //       strne r0, [r8], #4
+      0xE2455001, //       sub r5, r5, #1
+      0xE594C004, //       ldr r12, [r4, #4]    ; Stop
+      0xE35C0000, //       cmp r12, #0
+      0x15DCC000, //       ldrbne r12, [r12]
+      0x135C0000, //       cmpne r12, #0
+      0x0AFFFFF2, //       beq loop
+      0xE5845008, // done: str r5, [r4, #8]     ; Remaining count
+      0xE8BD8570, //       pop {r4, r5, r6, r8, r10, pc}
+  };
+  void *StubPtr = Arena.allocate(DynamicLoader::PageSize);
+  if (!StubPtr)
+    StubPtr =
+        _aligned_malloc(DynamicLoader::PageSize, DynamicLoader::PageSize);
+  memcpy(StubPtr, BatchStub, sizeof(BatchStub));
+  BatchStubAddr = reinterpret_cast<uint64_t>(StubPtr);
+  Space.mapRange(BatchStubAddr, DynamicLoader::PageSize,
+                 UC_PROT_READ | UC_PROT_EXEC);
 }
 
 LoadedLibrary *DynamicLoader::load(const string &Path) {
   BinaryPath BP(resolvePath(Path));
+  {
+    SnapshotReader Reader(*this);
+    if (const Snapshot *S = Published.load()) {
+      auto It = S->Paths.find(BP.Path);
+      if (It != S->Paths.end())
+        return It->second;
+    }
+  }
 
+  lock_guard<recursive_mutex> Lock(LLsMutex);
   auto I = LLs.find(BP.Path);
   if (I != LLs.end())
     return I->second.get();
 
   // Check that file exists.
+  StartupTimer Timer(Report, BP.Path, StartupPhase::Validate);
   if (!BP.isFileValid()) {
     Log.error() << "invalid file: " << BP.Path << Log.end();
     return nullptr;
   }
+  Timer.stop();
+
+  // Parse the whole dependency tree up front, subsequent nested calls then
+  // only use the results.
+  if constexpr (ParallelLoading)
+    if (!LoadDepth)
+      prefetch(BP);
+  ++LoadDepth;
+  // Libraries become visible to other threads when the outermost `load`
+  // finishes, i.e., after all their dependencies are loaded, too.
+  struct DepthGuard {
+    DynamicLoader &DL;
+    ~DepthGuard() {
+      // Before `LoadDepth` drops, so that `lookup` doesn't miss new ones.
+      if (DL.LoadDepth == 1)
+        DL.publish();
+      --DL.LoadDepth;
+    }
+  } Guard{*this};
 
   Log.info() << "loading library " << BP.Path << "...\n";
+  IpaSim.reportStartup(StartupStage::Loading, BP.Path);
 
+  EventActivity<LoaderEvents> Activity;
+  TraceLoggingWriteStart(Activity, "LoadImage",
+                         TraceLoggingString(BP.Path.c_str(), "Path"));
   LoadedLibrary *L;
-  if (LIEF::MachO::is_macho(BP.Path))
+  // Archives contain only Mach-O binaries.
+  if (IpaArchive::isArchived(BP.Path) || LIEF::MachO::is_macho(BP.Path))
     L = loadMachO(BP.Path);
   else if (LIEF::PE::is_pe(BP.Path))
     L = loadPE(BP.Path);
@@ -66,14 +513,256 @@ LoadedLibrary *DynamicLoader::load(const string &Path) {
     return nullptr;
   }
 
+  TraceLoggingWriteStop(
+      Activity, "LoadImage",
+      TraceLoggingHexUInt64(L ? L->StartAddress : 0, "StartAddress"),
+      TraceLoggingUInt64(L ? L->Size : 0, "Size"));
+
   // Recognize wrapper libraries.
-  if (L)
+  if (L) {
+    // Like Apple's dyld, images with Objective-C metadata are never unloaded,
+    // since the runtime can keep pointers into them (e.g., to selectors and
+    // class names) even after it has been told to forget them.
+    L->Unloadable =
+        OpenDepth && L->isDylib() &&
+        !MachO(reinterpret_cast<void *>(L->getBase())).hasObjCMetadata();
     L->IsWrapper = BP.Relative && startsWith(BP.Path, "gen\\");
+    if (L->IsWrapper && L->isDLL())
+      registerHypercalls(L);
+    else if (L->IsWrapper)
+      registerMessageCache(L);
+  }
 
   return L;
 }
 
+LoadedLibrary *DynamicLoader::open(const string &Path) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  ++OpenDepth;
+  LoadedLibrary *L = load(Path);
+  --OpenDepth;
+  if (L)
+    ++L->OpenCount;
+  return L;
+}
+
+bool DynamicLoader::close(LoadedLibrary *Lib) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  if (!Lib || !Lib->OpenCount)
+    return false;
+  // Nothing is unloaded while bindings of some library are being resolved.
+  if (--Lib->OpenCount || LoadDepth)
+    return true;
+
+  // Unloading a library can leave its dependencies unreferenced, so repeat
+  // until there is nothing more to unload.
+  for (;;) {
+    set<string> Deps(getDependencies());
+    auto It = find_if(LLs.begin(), LLs.end(), [&](const auto &P) {
+      return P.second->Unloadable && !P.second->OpenCount &&
+             !Deps.count(P.first);
+    });
+    if (It == LLs.end())
+      return true;
+    unload(string(It->first));
+  }
+}
+
+uint64_t DynamicLoader::openHandle(const char *Path, uint32_t Mode) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  if (!Path) {
+    LoadedLibrary *Main = findMainBinary();
+    return Main ? Main->getBase() : 0;
+  }
+
+  LoadedLibrary *L;
+  if (Mode & RTLD_NOLOAD) {
+    auto It = LLs.find(resolvePath(Path).Path);
+    if (It == LLs.end())
+      return 0;
+    L = It->second.get();
+    ++L->OpenCount;
+  } else {
+    size_t Loaded = LoadOrder.size();
+    L = open(Path);
+    if (!L)
+      return 0;
+
+    // Let the Objective-C runtime know about the new images. Wrappers don't
+    // contain any Objective-C metadata.
+    beginBatch();
+    for (size_t I = Loaded; I < LoadOrder.size(); ++I)
+      if (LoadOrder[I].Lib->isDylib() && !LoadOrder[I].Lib->IsWrapper)
+        registerMachO(reinterpret_cast<void *>(LoadOrder[I].Lib->getBase()));
+    endBatch();
+  }
+  return L->getBase();
+}
+
+uint64_t DynamicLoader::findExport(uint64_t Handle, const char *Name,
+                                   uint64_t Caller) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  string Plain(Name), Mangled("_" + Plain);
+  auto FindIn = [&](LoadedLibrary *L) {
+    return L->findSymbol(*this, L->hasUnderscorePrefix() ? Mangled : Plain);
+  };
+
+  // Search libraries in load order starting at `Begin`.
+  auto FindFrom = [&](size_t Begin) -> uint64_t {
+    for (size_t I = Begin; I < LoadOrder.size(); ++I)
+      if (uint64_t Addr = FindIn(LoadOrder[I].Lib))
+        return Addr;
+    return 0;
+  };
+  auto CallerIndex = [&]() -> size_t {
+    LoadedLibrary *L = lookup(Caller).Lib;
+    auto It = find_if(LoadOrder.begin(), LoadOrder.end(),
+                      [&](const LibraryInfo &LI) { return LI.Lib == L; });
+    return It - LoadOrder.begin();
+  };
+
+  switch (Handle) {
+  case RTLD_DEFAULT: {
+    auto It = GlobalSymbols.find(Plain);
+    if (It != GlobalSymbols.end())
+      return It->second;
+    uint64_t Addr = FindFrom(0);
+    // Libraries loaded later cannot change the result, unless it's `0`.
+    if (Addr)
+      GlobalSymbols.emplace(move(Plain), Addr);
+    return Addr;
+  }
+  case RTLD_NEXT:
+    return FindFrom(CallerIndex() + 1);
+  case RTLD_SELF:
+    return FindFrom(CallerIndex());
+  case RTLD_MAIN_ONLY: {
+    LoadedLibrary *Main = findMainBinary();
+    return Main ? FindIn(Main) : 0;
+  }
+  default: {
+    LoadedLibrary *L = findHandle(Handle);
+    return L ? FindIn(L) : 0;
+  }
+  }
+}
+
+bool DynamicLoader::closeHandle(uint64_t Handle) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  LoadedLibrary *L = findHandle(Handle);
+  if (!L)
+    return false;
+  // The main binary (handle of `dlopen(nullptr)`) is never unloaded.
+  return !L->OpenCount || close(L);
+}
+
+LoadedLibrary *DynamicLoader::findHandle(uint64_t Handle) {
+  LibraryInfo LI(lookup(Handle));
+  return LI.Lib && LI.Lib->getBase() == Handle ? LI.Lib : nullptr;
+}
+
+LoadedLibrary *DynamicLoader::findMainBinary() {
+  auto It = LLs.find(resolvePath(IpaSim.MainBinary).Path);
+  return It != LLs.end() ? It->second.get() : nullptr;
+}
+
+bool DynamicLoader::wasUnloaded(uint64_t Addr, uint32_t Since) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  for (size_t I = Since, End = UnloadedRanges.size(); I < End; ++I)
+    if (UnloadedRanges[I].first <= Addr && Addr < UnloadedRanges[I].second)
+      return true;
+  return false;
+}
+
+set<string> DynamicLoader::getDependencies() {
+  set<string> Deps;
+  for (auto &[Path, L] : LLs)
+    if (L->isDylib())
+      for (const string &Name : static_cast<LoadedDylib *>(L.get())->DylibNames)
+        if (BinaryPath BP(resolvePath(Name)); BP.Path != Path)
+          Deps.insert(move(BP.Path));
+  return Deps;
+}
+
+void DynamicLoader::unload(const string &Path) {
+  auto It = LLs.find(Path);
+  LoadedLibrary *Lib = It->second.get();
+  uint64_t Start = Lib->getStart(), End = Start + Lib->Size;
+  auto InImage = [&](uint64_t Addr) { return Start <= Addr && Addr < End; };
+  Log.info() << "unloading library " << Path << Log.end();
+
+  // Let the Objective-C runtime forget the image first. Handlers know only
+  // about headers they have been notified about.
+  auto Hdr = static_cast<uintptr_t>(Lib->getBase());
+  if (HdrSet.erase(Hdr)) {
+    if constexpr (PrerealizeClasses)
+      IpaSim.Classes.remove(reinterpret_cast<void *>(Hdr));
+    auto HI = find(Hdrs.begin(), Hdrs.end(), reinterpret_cast<void *>(Hdr));
+    size_t Index = HI - Hdrs.begin();
+    Hdrs.erase(HI);
+    if (Index < NotifiedHdrs) {
+      --NotifiedHdrs;
+      for (const MachOHandler &Handler : Handlers)
+        if (Handler.Unmapped)
+          Handler.Unmapped(Path.c_str(), reinterpret_cast<void *>(Hdr));
+    }
+  }
+
+  // Drop everything that points into the image. Message caches of other
+  // images can contain its methods, too.
+  MessageCaches.erase(remove_if(MessageCaches.begin(), MessageCaches.end(),
+                                [&](MessageCache *Cache) {
+                                  return InImage(
+                                      reinterpret_cast<uintptr_t>(Cache));
+                                }),
+                      MessageCaches.end());
+  flushMessageCaches();
+  for (auto CI = CallSites.begin(); CI != CallSites.end();) {
+    vector<uint32_t *> &Sites = CI->second;
+    Sites.erase(remove_if(Sites.begin(), Sites.end(),
+                          [&](uint32_t *Site) {
+                            return InImage(reinterpret_cast<uintptr_t>(Site));
+                          }),
+                Sites.end());
+    if (InImage(CI->first) || Sites.empty())
+      CI = CallSites.erase(CI);
+    else
+      ++CI;
+  }
+  for (auto RI = ResolvedLibraries.begin(); RI != ResolvedLibraries.end();)
+    if (RI->second.Lib == Lib)
+      RI = ResolvedLibraries.erase(RI);
+    else
+      ++RI;
+  if (Lib->Size)
+    Ranges.erase(End);
+  auto IsLib = [&](const LibraryInfo &LI) { return LI.Lib == Lib; };
+  LoadOrder.erase(find_if(LoadOrder.begin(), LoadOrder.end(), IsLib));
+  Images.erase(remove_if(Images.begin(), Images.end(), IsLib), Images.end());
+  GlobalSymbols.clear();
+  IpaSim.UI.forget(Lib);
+  SectionTable::remove(reinterpret_cast<void *>(Hdr));
+  UnloadedRanges.emplace_back(Start, End);
+  UnloadCount.store(static_cast<uint32_t>(UnloadedRanges.size()),
+                    memory_order_release);
+
+  // Free its memory. The address range can be used by other images then.
+  if (Lib->Size) {
+    Space.unmapRange(Start, Lib->Size);
+    uint64_t Reserved = Lib->Size;
+    if (releaseImageMemory(Start, Reserved)) {
+      if (Arena.contains(Start))
+        Arena.recycle(Start, Reserved);
+      else
+        VirtualFree(reinterpret_cast<void *>(Start), 0, MEM_RELEASE);
+    }
+  }
+  LLs.erase(It);
+  publish();
+}
+
 void DynamicLoader::registerMachO(const void *Hdr) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
   auto HdrPtr = reinterpret_cast<uintptr_t>(Hdr);
 
   // Do nothing if already registered.
@@ -81,99 +770,264 @@ void DynamicLoader::registerMachO(const void *Hdr) {
     return;
   Hdrs.push_back(Hdr);
 
-  // Fix some bindings.
+  StartupTimer Timer(Report, lookup(HdrPtr).LibPath, StartupPhase::Handlers);
+
+  // Fix some bindings. This also builds the image's `SectionTable`, which is
+  // then used by the Objective-C runtime, too.
   size_t Count;
   if (auto *FB = MachO(Hdr).getSectionData<uintptr_t **>(MachO::DataSegment,
                                                          "__fixbind", &Count))
     for (auto *EndFB = FB + Count; FB != EndFB; ++FB)
-      if (*FB)
+      if (*FB) {
         **FB = reinterpret_cast<uintptr_t *>(***FB);
+        recordCallSite(reinterpret_cast<uint32_t *>(*FB));
+      }
+
+  // Call registered handlers (unless the header is part of a batch).
+  if (!BatchDepth)
+    notifyPending();
+}
+
+void DynamicLoader::beginBatch() {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  ++BatchDepth;
+}
+
+void DynamicLoader::endBatch() {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  if (BatchDepth && !--BatchDepth)
+    notifyPending();
+}
 
-  // Call registered handlers.
-  handleMachOs(Hdrs.size() - 1, 0);
+void DynamicLoader::notifyPending() {
+  // Mark the headers as notified first, so that headers registered by the
+  // handlers themselves are not delivered twice.
+  size_t Begin = NotifiedHdrs;
+  NotifiedHdrs = Hdrs.size();
+  if (Begin != NotifiedHdrs)
+    handleMachOs(Begin, NotifiedHdrs, 0);
 }
 
-void DynamicLoader::handleMachOs(size_t HdrOffset, size_t HandlerOffset) {
+void DynamicLoader::handleMachOs(size_t HdrBegin, size_t HdrEnd,
+                                 size_t HandlerOffset) {
   // Handle Dylibs in reverse order, so that dependencies are resolved first,
   // before libraries that depend on them.
   vector<const char *> Paths;
-  Paths.reserve(Hdrs.size() - HdrOffset);
+  Paths.reserve(HdrEnd - HdrBegin);
   vector<const void *> Headers;
-  Headers.reserve(Hdrs.size() - HdrOffset);
-  for (ptrdiff_t I = Hdrs.size() - 1, End = HdrOffset - 1; I != End; --I) {
+  Headers.reserve(HdrEnd - HdrBegin);
+  for (ptrdiff_t I = HdrEnd - 1, End = HdrBegin - 1; I != End; --I) {
     // TODO: Find out paths from `LLs`.
     Paths.push_back(nullptr);
     Headers.push_back(Hdrs[I]);
   }
 
+  EventActivity<ObjCEvents> Activity;
+  TraceLoggingWriteStart(Activity, "ObjCMapImages",
+                         TraceLoggingUInt64(Headers.size(), "Count"));
+
   for (auto I = Handlers.begin() + HandlerOffset, End = Handlers.end();
        I != End; ++I) {
     MachOHandler &Handler = *I;
     Handler.Mapped(Headers.size(), Paths.data(), Headers.data());
-    for (ptrdiff_t I = Hdrs.size() - 1, End = HdrOffset - 1; I != End; --I)
+    for (const void *Hdr : Headers)
       // TODO: Find out path from `LLs`.
-      Handler.Init(nullptr, Hdrs[I]);
+      Handler.Init(nullptr, Hdr);
   }
+  TraceLoggingWriteStop(Activity, "ObjCMapImages");
+
+  // Classes of the images can be realized now. Only the runtime registers a
+  // handler, so they are added once.
+  if constexpr (PrerealizeClasses)
+    for (const void *Hdr : Headers)
+      IpaSim.Classes.add(Hdr);
 }
 
 void DynamicLoader::registerHandler(_dyld_objc_notify_mapped Mapped,
                                     _dyld_objc_notify_init Init,
                                     _dyld_objc_notify_unmapped Unmapped) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
   Handlers.push_back(MachOHandler{Mapped, Init, Unmapped});
-  handleMachOs(0, Handlers.size() - 1);
+  // Headers collected by a pending batch will be delivered by `endBatch`.
+  if (NotifiedHdrs)
+    handleMachOs(0, NotifiedHdrs, Handlers.size() - 1);
 }
 
 // Inspired by `ImageLoaderMachO::segmentsCanSlide`.
-bool DynamicLoader::canSegmentsSlide(LIEF::MachO::Binary &Bin) {
-  using namespace LIEF::MachO;
+bool DynamicLoader::canSegmentsSlide(const MachOInfo &Info) {
+  using namespace llvm::MachO;
 
-  auto FType = Bin.header().file_type();
-  return FType == FILE_TYPES::MH_DYLIB || FType == FILE_TYPES::MH_BUNDLE ||
-         (FType == FILE_TYPES::MH_EXECUTE && Bin.is_pie());
+  return Info.FileType == MH_DYLIB || Info.FileType == MH_BUNDLE ||
+         (Info.FileType == MH_EXECUTE && (Info.Flags & MH_PIE));
 }
 
 BinaryPath DynamicLoader::resolvePath(const string &Path) {
   if (!Path.empty() && Path[0] == '/') {
     // This path is something like
-    // `/System/Library/Frameworks/Foundation.framework/Foundation`.
-    return BinaryPath{filesystem::path("gen" + Path).make_preferred().string(),
-                      /* Relative */ true};
+    // `/System/Library/Frameworks/Foundation.framework/Foundation`. Use the
+    // same case as in the package, so that each library is loaded only once.
+    string GenPath(filesystem::path("gen" + Path).make_preferred().string());
+    if (const string *Real = PackageIndex::get().find(GenPath))
+      return BinaryPath{*Real, /* Relative */ true};
+    return BinaryPath{move(GenPath), /* Relative */ true};
   }
 
-  // TODO: Handle also `.ipa`-relative paths.
+  // Resolve paths relative to the app's bundle. `@rpath` is assumed to be
+  // Xcode's default `@executable_path/Frameworks`, `LC_RPATH` isn't read.
+  for (auto [Prefix, Dir] : {pair("@executable_path/", ""),
+                             pair("@rpath/", "Frameworks/")})
+    if (startsWith(Path, Prefix) && !IpaSim.MainBinary.empty()) {
+      string Rest(Dir + Path.substr(length(Prefix)));
+      const string &Main = IpaSim.MainBinary;
+      // Inside archives, the app keeps its forward slashes.
+      if (IpaArchive::isArchived(Main))
+        return BinaryPath{Main.substr(0, Main.rfind('/') + 1) + Rest,
+                          /* Relative */ false};
+      filesystem::path Full(filesystem::path(Main).parent_path() / Rest);
+      string FullPath(Full.make_preferred().string());
+      return BinaryPath{FullPath, filesystem::path(FullPath).is_relative()};
+    }
+
   return BinaryPath{Path, filesystem::path(Path).is_relative()};
 }
 
-LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
+void DynamicLoader::prefetch(const BinaryPath &Root) {
   using namespace LIEF::MachO;
 
-  auto LL = make_unique<LoadedDylib>(Parser::parse(Path));
-  LoadedDylib *LLP = LL.get();
+  mutex Mutex;
+  condition_variable Changed;
+  deque<BinaryPath> Queue{Root};
+  set<string> Seen{Root.Path};
+  size_t Busy = 0;
+
+  auto Work = [&]() {
+    unique_lock<mutex> Lock(Mutex);
+    for (;;) {
+      Changed.wait(Lock, [&]() { return !Queue.empty() || !Busy; });
+      if (Queue.empty())
+        return;
+      BinaryPath BP(move(Queue.front()));
+      Queue.pop_front();
+      ++Busy;
+      Lock.unlock();
+
+      // Errors are ignored here, they will be reported by `load`. Note that
+      // `LLs` cannot change while we are running, so it's safe to read it.
+      vector<BinaryPath> Deps;
+      try {
+        if (!LLs.count(BP.Path) && BP.isFileValid()) {
+          ImageMapping Mapping;
+          bool Opened = Mapping.open(BP.Path);
+          MachOInfo Info;
+          if (Opened && MachOReader(Mapping.getImageData(),
+                                    Mapping.getImageSize())
+                            .readLoadCommands(Info)) {
+            // Reading is cheap, `loadMachO` will simply do it again.
+            for (const MachOInfo::Dylib &Lib : Info.Dylibs)
+              Deps.push_back(resolvePath(Lib.Name));
+          } else if (IpaArchive::isArchived(BP.Path) || is_macho(BP.Path)) {
+            unique_ptr<FatBinary> Fat(parseImage(Mapping, Opened, BP.Path));
+            if (Fat && Fat->size())
+              for (DylibCommand &Lib : Fat->at(0).libraries())
+                Deps.push_back(resolvePath(Lib.name()));
+            lock_guard<mutex> PrefetchedLock(PrefetchedMutex);
+            Prefetched[BP.Path] = move(Fat);
+          } else if (LIEF::PE::is_pe(BP.Path))
+            // The DLL stays loaded, so `loadPE` only finds it.
+            LoadPackagedLibrary(to_hstring(BP.Path).c_str(), 0);
+        }
+      } catch (...) {
+      }
+
+      Lock.lock();
+      --Busy;
+      for (BinaryPath &Dep : Deps)
+        if (Seen.insert(Dep.Path).second)
+          Queue.push_back(move(Dep));
+      Changed.notify_all();
+    }
+  };
+
+  // The calling thread participates, too. The others need their own apartment,
+  // `isFileValid` can call into WinRT (see `PackageIndex`).
+  vector<thread> Threads;
+  for (size_t I = 1, Count = thread::hardware_concurrency(); I < Count; ++I)
+    Threads.emplace_back([&]() {
+      init_apartment();
+      Work();
+      uninit_apartment();
+    });
+  Work();
+  for (thread &T : Threads)
+    T.join();
+}
+
+LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
+  using namespace llvm::MachO;
 
-  // TODO: Select the correct binary more intelligently.
-  Binary &Bin = LL->Bin;
+  StartupTimer Timer(Report, Path, StartupPhase::Parse);
+
+  // Read the binary directly from its file if possible, otherwise use LIEF.
+  ImageMapping Mapping;
+  MachOInfo Info;
+  unique_ptr<LoadedDylib> LL;
+  bool Opened = Mapping.open(Path);
+  if (Opened &&
+      MachOReader(Mapping.getImageData(), Mapping.getImageSize()).read(Info))
+    LL = make_unique<LoadedDylib>();
+  else {
+    Info = MachOInfo();
+    unique_ptr<LIEF::MachO::FatBinary> Fat;
+    {
+      lock_guard<mutex> Lock(PrefetchedMutex);
+      auto P = Prefetched.find(Path);
+      if (P != Prefetched.end()) {
+        Fat = move(P->second);
+        Prefetched.erase(P);
+      }
+    }
+    if (!Fat)
+      Fat = parseImage(Mapping, Opened, Path);
+    LL = make_unique<LoadedDylib>(move(Fat));
+    readMachO(*LL->Bin, Info);
+  }
+  LoadedDylib *LLP = LL.get();
 
   LLs[Path] = move(LL);
 
+  // Exports must be available right away, because dependencies can bind to
+  // them.
+  LLP->Exports.insert(make_move_iterator(Info.Exports.begin()),
+                      make_move_iterator(Info.Exports.end()));
+  LLP->indexExports();
+  for (const MachOInfo::Dylib &Lib : Info.Dylibs) {
+    LLP->DylibNames.push_back(Lib.Name);
+    if (Lib.Reexport)
+      LLP->Reexports.push_back(Lib.Name);
+  }
+  LLP->HeaderAddr = Info.HeaderAddr;
+  LLP->EntryPoint = Info.EntryPoint;
+
   // Check header.
-  Header &Hdr = Bin.header();
-  if (Hdr.cpu_type() != CPU_TYPES::CPU_TYPE_ARM)
+  if (Info.CPUType != CPU_TYPE_ARM)
     Log.error("expected ARM binary");
   // Ensure that segments are continuous (required by `relocateSegment`).
-  if (Hdr.has(HEADER_FLAGS::MH_SPLIT_SEGS))
+  if (Info.Flags & MH_SPLIT_SEGS)
     Log.error("MH_SPLIT_SEGS not supported");
-  if (!canSegmentsSlide(Bin))
+  if (!canSegmentsSlide(Info))
     Log.error("the binary is not slideable");
 
+  Timer.next(StartupPhase::Map);
+
   // Compute total size of all segments. Note that in Mach-O, segments must
   // slide together (see `ImageLoaderMachO::segmentsMustSlideTogether`).
   // Inspired by `ImageLoaderMachO::assignSegmentAddresses`.
   uint64_t LowAddr = (uint64_t)(-1);
   uint64_t HighAddr = 0;
-  for (SegmentCommand &Seg : Bin.segments()) {
-    uint64_t SegLow = Seg.virtual_address();
+  for (const MachOInfo::Segment &Seg : Info.Segments) {
+    uint64_t SegLow = Seg.VMAddr;
     // Round to page size (as required by unicorn and what even dyld does).
-    uint64_t SegHigh = roundToPageSize(SegLow + Seg.virtual_size());
+    uint64_t SegHigh = roundToPageSize(SegLow + Seg.VMSize);
     if ((SegLow < HighAddr && SegLow >= LowAddr) ||
         (SegHigh > LowAddr && SegHigh <= HighAddr)) {
       Log.error("overlapping segments (after rounding to pagesize)");
@@ -186,87 +1040,347 @@ LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
     }
   }
 
-  // Allocate space for the segments.
+  // Reserve space for the segments. Images linked above address zero (e.g.,
+  // wrapper Dylibs, see `DylibImageBase`) are placed where they were linked if
+  // possible, so that they don't have to be rebased.
   uint64_t Size = HighAddr - LowAddr;
-  uintptr_t Addr = (uintptr_t)_aligned_malloc(Size, PageSize);
+  uint64_t Preferred = PreferredImageAddresses ? LowAddr : 0;
+  uintptr_t Addr = Mapping.reserve(Size, Arena, Preferred);
   if (!Addr)
-    Log.error("couldn't allocate memory for segments");
+    Log.winError("couldn't allocate memory for segments");
   uint64_t Slide = Addr - LowAddr;
+  if (!Slide)
+    IpaSim.Stats.add(Stat::UnslidImages);
   LLP->StartAddress = Slide;
+  LLP->VMAddr = LowAddr;
   LLP->Size = Size;
+  registerRange(Path, LLP);
+
+  // The image's memory as of the last start can be used if it's at the same
+  // address again and its bindings are still valid. It's already rebased and
+  // bound then. Referenced libraries must be loaded for the check, so it's
+  // done before mapping segments. See also #22. Libraries are measured
+  // separately.
+  ImageSnapshot Snap(Path);
+  bool Restored = false;
+  if constexpr (UseImageSnapshots) {
+    Timer.stop();
+    for (const MachOInfo::Dylib &Lib : Info.Dylibs)
+      load(Lib.Name);
+    Timer.next(StartupPhase::Map);
+    Restored = Snap.load() && Snap.StartAddress == Addr && Snap.Size == Size &&
+               canReuseBindings(Snap) && Mapping.mapSnapshot(Snap);
+  }
+
+  // If segments lie in the file exactly as in memory (which is how wrapper
+  // Dylibs are linked), the whole image is mapped by a single view. Segments
+  // then don't need to be aligned to allocation granularity to be mapped, so
+  // none of the read-only ones are copied and their pages are shared with
+  // other processes which load the same file.
+  uint64_t ViewEnd = 0;
+  if (!Restored &&
+      all_of(Info.Segments.begin(), Info.Segments.end(),
+             [&](const MachOInfo::Segment &Seg) {
+               return !Seg.FileSize || Seg.FileOffset == Seg.VMAddr - LowAddr;
+             })) {
+    uint64_t ViewSize = min(Mapping.getImageSize() / PageSize * PageSize, Size);
+    if (ViewSize && Mapping.mapView(Addr, ViewSize, 0))
+      ViewEnd = Addr + ViewSize;
+  }
 
   // Load segments. Inspired by `ImageLoaderMachO::mapSegments`.
-  for (SegmentCommand &Seg : Bin.segments()) {
+  for (const MachOInfo::Segment &Seg : Info.Segments) {
     // Convert protection.
-    uint32_t VMProt = Seg.init_protection();
+    uint32_t VMProt = Seg.InitProt;
     uc_prot Perms = UC_PROT_NONE;
-    if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_READ) {
+    if (VMProt & VM_PROT_READ) {
       Perms |= UC_PROT_READ;
     }
-    if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_WRITE) {
+    if (VMProt & VM_PROT_WRITE) {
       Perms |= UC_PROT_WRITE;
     }
-    if (VMProt & (uint32_t)VM_PROTECTIONS::VM_PROT_EXECUTE) {
+    if (VMProt & VM_PROT_EXECUTE) {
       Perms |= UC_PROT_EXEC;
     }
 
-    uint64_t VAddr = Seg.virtual_address() + Slide;
+    uint64_t VAddr = Seg.VMAddr + Slide;
+    LLP->SegmentAddrs.push_back(VAddr);
     // Emulated virtual address is actually equal to the "real" virtual
     // address.
     uint8_t *Mem = reinterpret_cast<uint8_t *>(VAddr);
-    uint64_t VSize = Seg.virtual_size();
+    uint64_t VSize = Seg.VMSize;
+    uint64_t MemSize = roundToPageSize(VSize);
 
-    if (Perms == UC_PROT_NONE) {
+    if (Restored) {
+      LLP->SegmentFiles.push_back(
+          {VAddr, Seg.FileOffset, min(Seg.FileSize, VSize)});
+      Space.mapRange(VAddr, VSize, Perms);
+    } else if (Perms == UC_PROT_NONE) {
       // No protection means we don't have to copy any data, we just map it.
-      Emu.mapMemory(VAddr, VSize, Perms);
+      if (VAddr >= ViewEnd)
+        Mapping.commit(VAddr, MemSize);
+      Space.mapRange(VAddr, VSize, Perms);
     } else {
-      // TODO: Memory-map the segment instead of copying it.
-      auto &Buff = Seg.content();
-      // TODO: Copy to the end of the allocated space if flag `SG_HIGHVM` is
-      // present.
-      memcpy(Mem, Buff.data(), Buff.size());
-      Emu.mapMemory(VAddr, VSize, Perms);
-
-      // Clear the remaining memory.
-      if (Buff.size() < VSize)
-        memset(Mem + Buff.size(), 0, VSize - Buff.size());
-    }
-
-    // Relocate addresses. Inspired by `ImageLoaderMachOClassic::rebase`.
-    if (Slide > 0) {
-      for (Relocation &Rel : Seg.relocations()) {
-        if (Rel.is_pc_relative() ||
-            Rel.origin() != RELOCATION_ORIGINS::ORIGIN_DYLDINFO ||
-            Rel.size() != 32 || (Rel.address() & R_SCATTERED) != 0)
-          Log.error("unsupported relocation");
-
-        // Find base address for this relocation. Inspired by
-        // `ImageLoaderMachOClassic::getRelocBase`.
-        uint64_t RelBase = LowAddr + Slide;
-
-        uint64_t RelAddr = RelBase + Rel.address();
-
-        // TODO: Implement what `ImageLoader::containsAddress` does.
-        if (RelAddr > VAddr + VSize || RelAddr < VAddr)
-          Log.error("relocation target out of range");
-
-        uint32_t *Val = (uint32_t *)RelAddr;
-        // We actively leave NULL pointers untouched. Technically it would be
-        // correct to slide them because the PAGEZERO segment slid, too. But
-        // programs probably wouldn't be happy if their NULLs were non-zero.
-        // TODO: Solve this as the original dyld does. Maybe by always mapping
-        // PAGEZERO to address 0 or something like that.
-        if (*Val != 0)
-          *Val = *Val + Slide;
+      // Map whole pages of the segment's file content directly, if possible.
+      uint64_t FileSize = min(Seg.FileSize, VSize);
+      LLP->SegmentFiles.push_back({VAddr, Seg.FileOffset, FileSize});
+      uint64_t Mapped = min(roundToPageSize(FileSize), MemSize);
+      if (VAddr < ViewEnd) {
+        // The segment is (at least partly) inside the image's view.
+        Mapped = min(ViewEnd - VAddr, MemSize);
+        if (FileSize < Mapped)
+          memset(Mem + FileSize, 0, Mapped - FileSize);
+        else if (FileSize > Mapped) {
+          // Its last bytes are in the file's last (partial) page.
+          if (!Mapping.commit(VAddr + Mapped, MemSize - Mapped))
+            Log.winError("couldn't commit memory for segment");
+          memcpy(Mem + Mapped, Seg.Data + Mapped, FileSize - Mapped);
+          Mapped = MemSize;
+        }
+      } else if (FileSize && Mapping.mapView(VAddr, Mapped, Seg.FileOffset)) {
+        // The last page can contain bytes of the following segment.
+        if (FileSize < Mapped)
+          memset(Mem + FileSize, 0, Mapped - FileSize);
+      } else {
+        if (!Mapping.commit(VAddr, MemSize))
+          Log.winError("couldn't commit memory for segment");
+        // TODO: Copy to the end of the allocated space if flag `SG_HIGHVM` is
+        // present.
+        memcpy(Mem, Seg.Data, FileSize);
+        Mapped = MemSize;
       }
+
+      // The remaining memory is backed by fresh pages, which are zero-filled.
+      if (Mapped < MemSize && !Mapping.commit(VAddr + Mapped, MemSize - Mapped))
+        Log.winError("couldn't commit memory for segment");
+      Space.mapRange(VAddr, VSize, Perms);
     }
   }
 
-  // Load referenced libraries. See also #22.
+  // Relocate addresses. Inspired by `ImageLoaderMachOCompressed::rebase`.
+  Timer.next(StartupPhase::Rebase);
+  if (Slide > 0 && !Restored) {
+    // TODO: Implement what `ImageLoader::containsAddress` does.
+    auto IsInRange = [&](const MachOInfo::RebaseRun &Run) {
+      uint64_t Last = Run.Addr + (Run.Count - 1) * Run.Stride + Slide;
+      return LLP->isInRange(Run.Addr + Slide) && LLP->isInRange(Last);
+    };
+    auto NewEnd = remove_if(Info.Rebases.begin(), Info.Rebases.end(),
+                            [&](const MachOInfo::RebaseRun &Run) {
+                              if (IsInRange(Run))
+                                return false;
+                              Log.error("relocation target out of range");
+                              return true;
+                            });
+    Info.Rebases.erase(NewEnd, Info.Rebases.end());
+    applyRebases(Info.Rebases, static_cast<uint32_t>(Slide));
+  }
+
+  // Load referenced libraries. See also #22. They are measured separately.
+  if constexpr (!UseImageSnapshots) {
+    Timer.stop();
+    for (const MachOInfo::Dylib &Lib : Info.Dylibs)
+      load(Lib.Name);
+  }
+  Timer.next(StartupPhase::Bind);
+  LLP->flattenExports(*this);
+
+  // Find lazy binding info inside mapped `__LINKEDIT`.
+  uint32_t LazyOffset = Info.LazyBindOffset, LazySize = Info.LazyBindSize;
+  for (const MachOInfo::Segment &Seg : Info.Segments)
+    if (LazySize && Seg.FileOffset <= LazyOffset &&
+        LazyOffset + LazySize <= Seg.FileOffset + Seg.FileSize) {
+      LLP->LazyBindInfo = reinterpret_cast<const uint8_t *>(
+          Seg.VMAddr + Slide + LazyOffset - Seg.FileOffset);
+      LLP->LazyBindSize = LazySize;
+      break;
+    }
+
+  if (Restored) {
+    if (IpaSim.Traces.isEnabled(TraceCategory::Loader))
+      Log.info() << "restored " << Path << " from its snapshot" << Log.end();
+    // Bound pointers are already in the snapshot, but they must be recorded
+    // like when they are bound below.
+    if constexpr (PatchCallSites)
+      for (const MachOInfo::Binding &B : Info.Bindings) {
+        uint64_t TargetAddr = B.Addr + Slide;
+        if ((!B.Lazy || !LLP->LazyBindInfo) && LLP->isInRange(TargetAddr))
+          recordCallSite(reinterpret_cast<uint32_t *>(TargetAddr));
+      }
+    compact(LLP, Path);
+    return LLP;
+  }
+
+  // Use bindings resolved by some previous run if possible.
+  PrelinkCache Cache(Path);
+  if constexpr (UsePrelinkCache)
+    if (Cache.load() && applyPrelinkCache(LLP, Cache)) {
+      if constexpr (UseImageSnapshots)
+        saveSnapshot(LLP, Path, Cache);
+      compact(LLP, Path);
+      return LLP;
+    }
+  bool Cacheable = UsePrelinkCache;
+
+  // Bind external symbols. They are grouped by their libraries, so that each
+  // library is looked up only once.
+  stable_sort(Info.Bindings.begin(), Info.Bindings.end(),
+              [](const MachOInfo::Binding &A, const MachOInfo::Binding &B) {
+                return A.Lib < B.Lib;
+              });
+  const string *LastLib = nullptr;
+  ResolvedLibrary *RL = nullptr;
+  for (const MachOInfo::Binding &B : Info.Bindings) {
+    // Lazy pointers are bound on first use. Until then, they point to
+    // `__stub_helper` (they have been rebased above).
+    if (B.Lazy && LLP->LazyBindInfo)
+      continue;
+
+    // Find symbol's address. Some symbols are implemented by the emulator.
+    uint64_t SymAddr = findKernelSymbol(B.Symbol);
+    if (!SymAddr) {
+      if (B.Lib != LastLib) {
+        RL = &resolveLibrary(*B.Lib);
+        LastLib = B.Lib;
+      }
+      SymAddr = resolveSymbol(*RL, B.Symbol);
+    }
+    if (!SymAddr) {
+      Cacheable = false;
+      continue;
+    }
+
+    // Bind it.
+    uint64_t TargetAddr = B.Addr + Slide;
+    LLP->checkInRange(TargetAddr);
+    *reinterpret_cast<uint32_t *>(TargetAddr) = SymAddr;
+    recordCallSite(reinterpret_cast<uint32_t *>(TargetAddr));
+
+    // Remember the binding relative to the target library.
+    if (!Cacheable)
+      continue;
+    if (isKernelAddr(SymAddr)) {
+      Cache.Bindings.push_back(PrelinkCache::Binding{
+          static_cast<uint32_t>(B.Addr), PrelinkCache::Kernel,
+          static_cast<uint32_t>(SymAddr - KernelAddr)});
+      continue;
+    }
+    if (IpaSim.Clock.contains(SymAddr)) {
+      Cache.Bindings.push_back(PrelinkCache::Binding{
+          static_cast<uint32_t>(B.Addr), PrelinkCache::Clock,
+          static_cast<uint32_t>(SymAddr - IpaSim.Clock.getPageAddr())});
+      continue;
+    }
+    LibraryInfo LI(lookup(SymAddr));
+    if (!LI.Lib) {
+      Cacheable = false;
+      continue;
+    }
+    Cache.Bindings.push_back(PrelinkCache::Binding{
+        static_cast<uint32_t>(B.Addr), Cache.addLib(*LI.LibPath),
+        static_cast<uint32_t>(SymAddr - LI.Lib->StartAddress)});
+  }
+
+  if (Cacheable && !Cache.save())
+    Log.warning() << "couldn't save prelink cache of " << Path << Log.end();
+  // Libraries of the bindings are known only if they are cacheable.
+  if constexpr (UseImageSnapshots)
+    if (Cacheable)
+      saveSnapshot(LLP, Path, Cache);
+
+  compact(LLP, Path);
+  return LLP;
+}
+
+bool DynamicLoader::canReuseBindings(const ImageSnapshot &Snap) {
+  if (Snap.KernelAddr != KernelAddr ||
+      Snap.ClockAddr != IpaSim.Clock.getPageAddr())
+    return false;
+  for (const ImageSnapshot::Lib &L : Snap.Libs) {
+    auto It = LLs.find(L.Path);
+    if (It == LLs.end() || It->second->StartAddress != L.StartAddress)
+      return false;
+  }
+  return true;
+}
+
+void DynamicLoader::saveSnapshot(LoadedDylib *Lib, const string &Path,
+                                 const PrelinkCache &Cache) {
+  ImageSnapshot Snap(Path);
+  Snap.StartAddress = Lib->getStart();
+  Snap.Size = Lib->Size;
+  Snap.KernelAddr = KernelAddr;
+  Snap.ClockAddr = IpaSim.Clock.getPageAddr();
+  for (const string &L : Cache.Libs)
+    Snap.Libs.push_back({L, LLs.at(L)->StartAddress});
+  if (!Snap.save())
+    Log.warning() << "couldn't save snapshot of " << Path << Log.end();
+}
+
+void DynamicLoader::compact(LoadedDylib *Lib, const string &Path) {
+  if (!Lib->Bin)
+    return;
+
+  if (!IpaSim.Traces.isEnabled(TraceCategory::Loader)) {
+    Lib->releaseModel();
+    return;
+  }
+
+  auto getPrivateUsage = []() -> uint64_t {
+    PROCESS_MEMORY_COUNTERS_EX Counters;
+    if (!GetProcessMemoryInfo(
+            GetCurrentProcess(),
+            reinterpret_cast<PROCESS_MEMORY_COUNTERS *>(&Counters),
+            sizeof(Counters)))
+      return 0;
+    return Counters.PrivateUsage;
+  };
+  uint64_t Before = getPrivateUsage();
+  Lib->releaseModel();
+  uint64_t After = getPrivateUsage();
+  Log.info() << "released LIEF model of " << Path << " (private bytes "
+             << Before << " -> " << After << ")" << Log.end();
+}
+
+// Fills `Info` from LIEF's model. Used for binaries that `MachOReader` cannot
+// read.
+void DynamicLoader::readMachO(LIEF::MachO::Binary &Bin, MachOInfo &Info) {
+  using namespace LIEF::MachO;
+
+  Header &Hdr = Bin.header();
+  Info.CPUType = static_cast<uint32_t>(Hdr.cpu_type());
+  Info.FileType = static_cast<uint32_t>(Hdr.file_type());
+  Info.Flags = Hdr.flags();
+  Info.HeaderAddr = Bin.imagebase();
+  if (Bin.has_entrypoint())
+    Info.EntryPoint = Bin.entrypoint();
+
+  uint64_t LowAddr = (uint64_t)(-1);
+  for (SegmentCommand &Seg : Bin.segments()) {
+    Info.Segments.push_back(MachOInfo::Segment{
+        Seg.virtual_address(), Seg.virtual_size(), Seg.file_offset(),
+        Seg.content().size(), Seg.init_protection(), Seg.content().data()});
+    LowAddr = min(LowAddr, Seg.virtual_address());
+  }
+  for (SegmentCommand &Seg : Bin.segments())
+    for (Relocation &Rel : Seg.relocations()) {
+      if (Rel.is_pc_relative() ||
+          Rel.origin() != RELOCATION_ORIGINS::ORIGIN_DYLDINFO ||
+          Rel.size() != 32 || (Rel.address() & R_SCATTERED) != 0)
+        Log.error("unsupported relocation");
+
+      // Find base address for this relocation. Inspired by
+      // `ImageLoaderMachOClassic::getRelocBase`.
+      Info.addRebases(LowAddr + Rel.address(), 1, sizeof(uint32_t));
+    }
+
   for (DylibCommand &Lib : Bin.libraries())
-    load(Lib.name());
+    Info.Dylibs.push_back(MachOInfo::Dylib{
+        Lib.name(), Lib.command() == LOAD_COMMAND_TYPES::LC_REEXPORT_DYLIB});
 
-  // Bind external symbols.
+  auto [LazyOffset, LazySize] = Bin.dyld_info().lazy_bind();
+  Info.LazyBindOffset = LazyOffset;
+  Info.LazyBindSize = LazySize;
   for (BindingInfo &BInfo : Bin.dyld_info().bindings()) {
     // Check binding's kind.
     if ((BInfo.binding_class() != BINDING_CLASS::BIND_CLASS_STANDARD &&
@@ -281,35 +1395,53 @@ LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
       continue;
     }
 
-    // Find symbol's library.
-    string LibName(BInfo.library().name());
-    LoadedLibrary *Lib = load(LibName);
-    if (!Lib) {
-      Log.error("symbol's library couldn't be loaded");
-      continue;
-    }
+    Info.Bindings.push_back(MachOInfo::Binding{
+        BInfo.address(), &BInfo.library().name(),
+        BInfo.symbol().name().c_str(),
+        BInfo.binding_class() == BINDING_CLASS::BIND_CLASS_LAZY});
+  }
 
-    // Find symbol's address.
-    string SymName(BInfo.symbol().name());
-    uint64_t SymAddr = Lib->findSymbol(*this, SymName);
-    if (!SymAddr) {
-      Log.error() << "external symbol " << SymName << " from library "
-                  << LibName << " couldn't be resolved" << Log.end();
-      continue;
-    }
+  for (Symbol &Sym : Bin.exported_symbols())
+    Info.Exports.emplace_back(Sym.name(), Sym.value());
+}
 
-    // Bind it.
-    uint64_t TargetAddr = BInfo.address() + Slide;
-    LLP->checkInRange(TargetAddr);
-    *reinterpret_cast<uint32_t *>(TargetAddr) = SymAddr;
+bool DynamicLoader::applyPrelinkCache(LoadedDylib *Lib,
+                                      const PrelinkCache &Cache) {
+  vector<LoadedLibrary *> Libs;
+  Libs.reserve(Cache.Libs.size());
+  for (const string &Path : Cache.Libs) {
+    LoadedLibrary *L = load(Path);
+    if (!L)
+      return false;
+    Libs.push_back(L);
   }
 
-  return LLP;
+  for (const PrelinkCache::Binding &B : Cache.Bindings) {
+    uint64_t SymAddr;
+    if (B.Lib == PrelinkCache::Kernel)
+      SymAddr = KernelAddr + B.Offset;
+    else if (B.Lib == PrelinkCache::Clock) {
+      // The clock could have been disabled since the entry was saved.
+      if (!IpaSim.Clock.getPageAddr())
+        return false;
+      SymAddr = IpaSim.Clock.getPageAddr() + B.Offset;
+    } else if (B.Lib < Libs.size())
+      SymAddr = Libs[B.Lib]->StartAddress + B.Offset;
+    else
+      return false;
+    uint64_t TargetAddr = Lib->StartAddress + B.TargetRVA;
+    Lib->checkInRange(TargetAddr);
+    *reinterpret_cast<uint32_t *>(TargetAddr) = SymAddr;
+    recordCallSite(reinterpret_cast<uint32_t *>(TargetAddr));
+  }
+  return true;
 }
 
 LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
   using namespace LIEF::PE;
 
+  StartupTimer Timer(Report, Path, StartupPhase::Map);
+
   // Mark the library as found.
   auto LL = make_unique<LoadedDll>();
   LoadedDll *LLP = LL.get();
@@ -323,6 +1455,8 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
     return nullptr;
   }
   LLP->Ptr = Lib;
+  if (!startsWith(Path, "gen\\"))
+    LLP->Table = findExportTable(LLP, Path);
 
   // Find out where it lies in memory.
   MODULEINFO Info;
@@ -343,23 +1477,589 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
     LLP->MachOPoser = false;
   }
 
+  registerRange(Path, LLP);
+
   // Load the library into Unicorn engine.
   uint64_t StartAddr = alignToPageSize(LLP->StartAddress);
   uint64_t Size = roundToPageSize(LLP->Size);
-  Emu.mapMemory(StartAddr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  Space.mapRange(StartAddr, Size, UC_PROT_READ | UC_PROT_WRITE);
 
   return LLP;
 }
 
+// Loads wrapper DLL of `Lib` and finds its `ExportTable`. Returns `nullptr` if
+// there is no wrapper or if it was generated from a different build of `Lib`.
+const ExportTable *DynamicLoader::findExportTable(LoadedDll *Lib,
+                                                  const string &Path) {
+  BinaryPath BP(resolvePath(getWrapperPath(Path)));
+  if (!BP.isFileValid())
+    return nullptr;
+  LoadedLibrary *Wrapper = load(BP.Path);
+  if (!Wrapper)
+    return nullptr;
+  auto *Table = reinterpret_cast<const ExportTable *>(
+      Wrapper->findSymbol(*this, ExportTable::Symbol.S));
+  if (!Table)
+    return nullptr;
+
+  auto Base = reinterpret_cast<uint64_t>(Lib->Ptr);
+  auto *DOS = reinterpret_cast<const IMAGE_DOS_HEADER *>(Base);
+  auto *NT = reinterpret_cast<const IMAGE_NT_HEADERS *>(Base + DOS->e_lfanew);
+  if (NT->FileHeader.TimeDateStamp != Table->TimeDateStamp) {
+    Log.warning() << "ignoring outdated export table of " << Path << Log.end();
+    return nullptr;
+  }
+  return Table;
+}
+
+void DynamicLoader::recordLaunchProfile(const string &AppPath) {
+  if constexpr (LaunchProfileWindow == 0)
+    return;
+
+  if constexpr (Pretranslation)
+    IpaSim.Entries.startRecording();
+  thread([this, AppPath]() {
+    this_thread::sleep_for(chrono::seconds(LaunchProfileWindow));
+
+    LaunchProfile Profile(AppPath);
+    {
+      lock_guard<recursive_mutex> Lock(LLsMutex);
+      unordered_map<LoadedLibrary *, size_t> Indices;
+      for (const LibraryInfo &LI : LoadOrder) {
+        auto *Dylib = dynamic_cast<LoadedDylib *>(LI.Lib);
+        LaunchProfile::Image Img{*LI.LibPath, Dylib != nullptr, {}, {}, {}};
+        if constexpr (PrerealizeClasses)
+          if (LI.Lib->hasMachO() && !LI.Lib->IsWrapper)
+            Img.Classes = ClassRealizer::getUsed(LI.Lib->getMachO());
+        if (Dylib) {
+          for (const LoadedDylib::SegmentFile &Seg : Dylib->SegmentFiles)
+            addResidentRanges(Seg, Img.Ranges);
+          Indices.try_emplace(Dylib, Profile.Images.size());
+        }
+        Profile.Images.push_back(move(Img));
+      }
+
+      if constexpr (Pretranslation)
+        for (uint64_t Addr : IpaSim.Entries.stopRecording()) {
+          LibraryInfo LI(lookup(Addr));
+          auto It = Indices.find(LI.Lib);
+          // Relative to the slide, like `NativeTranslation::Offset`.
+          if (It != Indices.end())
+            Profile.Images[It->second].Entries.push_back(
+                static_cast<uint32_t>(Addr - LI.Lib->StartAddress));
+        }
+    }
+
+    if (!Profile.save())
+      Log.warning() << "couldn't save launch profile of " << AppPath
+                    << Log.end();
+  }).detach();
+}
+
+// Records pages of `Seg` which have been touched (i.e., they are in the
+// working set) as ranges of the image file.
+void DynamicLoader::addResidentRanges(const LoadedDylib::SegmentFile &Seg,
+                                      vector<LaunchProfile::Range> &Ranges) {
+  size_t PageCount = roundToPageSize(Seg.Size) / PageSize;
+  vector<PSAPI_WORKING_SET_EX_INFORMATION> Pages(PageCount);
+  for (size_t I = 0; I != PageCount; ++I)
+    Pages[I].VirtualAddress = reinterpret_cast<void *>(Seg.Addr + I * PageSize);
+  if (!QueryWorkingSetEx(GetCurrentProcess(), Pages.data(),
+                         Pages.size() * sizeof(Pages[0])))
+    // Prefetch the whole segment if we cannot tell.
+    for (PSAPI_WORKING_SET_EX_INFORMATION &Page : Pages)
+      Page.VirtualAttributes.Valid = 1;
+
+  for (size_t I = 0; I != PageCount; ++I) {
+    if (!Pages[I].VirtualAttributes.Valid)
+      continue;
+    uint32_t Offset = static_cast<uint32_t>(Seg.Offset + I * PageSize);
+    uint32_t Size = static_cast<uint32_t>(
+        min<uint64_t>(PageSize, Seg.Size - I * PageSize));
+    if (!Ranges.empty() &&
+        Ranges.back().Offset + Ranges.back().Size == Offset)
+      Ranges.back().Size += Size;
+    else
+      Ranges.push_back({Offset, Size});
+  }
+}
+
 LibraryInfo DynamicLoader::lookup(uint64_t Addr) {
-  for (auto &Pair : LLs) {
-    LoadedLibrary *LL = Pair.second.get();
-    if (LL->isInRange(Addr))
-      return {&Pair.first, LL};
+  // Find the first library that ends after `Addr`. Libraries don't overlap, so
+  // it's the only candidate.
+  {
+    SnapshotReader Reader(*this);
+    if (const Snapshot *S = Published.load()) {
+      auto It = upper_bound(
+          S->Ranges.begin(), S->Ranges.end(), Addr,
+          [](uint64_t A, const Snapshot::Range &R) { return A < R.End; });
+      if (It != S->Ranges.end() && Addr >= It->Start)
+        return It->Info;
+      // Libraries of a pending `load` aren't published yet.
+      if (!LoadDepth)
+        return {nullptr, nullptr};
+    }
   }
+
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  auto It = Ranges.upper_bound(Addr);
+  if (It != Ranges.end() && It->second.Lib->isInRange(Addr))
+    return It->second;
   return {nullptr, nullptr};
 }
 
+bool DynamicLoader::symbolize(uint64_t Addr, SymbolInfo &Info) {
+  LibraryInfo LI(lookup(Addr));
+  if (!LI.Lib)
+    return false;
+  Info.Path = LI.LibPath->c_str();
+  Info.Base = LI.Lib->getBase();
+  Info.SymbolAddr = 0;
+  Info.Symbol = LI.Lib->findNearestSymbol(Addr, Info.SymbolAddr);
+  return true;
+}
+
+void DynamicLoader::updateMethod(ObjCMethod M, uint64_t OldImp) {
+  if (OldImp) {
+    LibraryInfo LI(lookup(OldImp));
+    if (LI.Lib && LI.Lib->hasMachO())
+      LI.Lib->getMethodIndex().remove(M, OldImp);
+  }
+  LibraryInfo LI(lookup(M.getImp()));
+  if (LI.Lib && LI.Lib->hasMachO())
+    LI.Lib->getMethodIndex().add(M);
+  // Cached IMPs of the method (or of methods it overrides) are stale now.
+  flushMessageCaches();
+}
+
+void DynamicLoader::fillMessageCaches(uint32_t Isa, uint32_t Sel,
+                                      uint32_t Imp) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  for (MessageCache *Cache : MessageCaches) {
+    MessageCache::Entry &E = Cache->Entries[MessageCache::index(Isa, Sel)];
+
+    // Claim the entry like generated messengers do. If somebody is writing
+    // into it, leave it be.
+    auto *Seq = reinterpret_cast<volatile LONG *>(&E.Seq);
+    LONG Expected = *Seq & ~1;
+    if (InterlockedCompareExchange(Seq, Expected + 1, Expected) != Expected)
+      continue;
+    E.Gen = Cache->Gen;
+    E.Isa = Isa;
+    E.Sel = Sel;
+    E.Imp = Imp;
+    InterlockedExchange(Seq, Expected + 2);
+  }
+}
+
+void DynamicLoader::flushMessageCaches() {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  for (MessageCache *Cache : MessageCaches)
+    InterlockedIncrement(reinterpret_cast<volatile LONG *>(&Cache->Gen));
+}
+
+// Must be called when address range of a library is known.
+void DynamicLoader::registerRange(const string &Path, LoadedLibrary *Lib) {
+  auto It = LLs.find(Path);
+  LoadOrder.push_back({&It->first, Lib});
+  if (Lib->hasMachO())
+    Images.push_back({&It->first, Lib});
+  if (!Lib->Size)
+    return;
+  // It's published by the outermost `load` together with all dependencies, so
+  // that the snapshot isn't copied for each of them.
+  Ranges[Lib->getStart() + Lib->Size] = {&It->first, Lib};
+}
+
+void DynamicLoader::publish() {
+  auto S = make_unique<Snapshot>();
+  for (auto &[Path, L] : LLs)
+    S->Paths.emplace(Path, L.get());
+  S->Ranges.reserve(Ranges.size());
+  for (auto &[End, LI] : Ranges)
+    S->Ranges.push_back({LI.Lib->getStart(), End, LI});
+
+  Published.store(S.get());
+  if (Current) {
+    Retired.push_back(move(Current));
+    HasRetired = true;
+  }
+  Current = move(S);
+  reclaim();
+}
+
+void DynamicLoader::reclaim() {
+  // Readers that come after `Published` is replaced see only the new snapshot,
+  // so once there are no readers, nobody can see the retired ones. New ones are
+  // retired only with `LLsMutex` locked, so they are covered by this check.
+  if (!Readers.load()) {
+    Retired.clear();
+    HasRetired = false;
+  }
+}
+
+DynamicLoader::SnapshotReader::~SnapshotReader() {
+  // The last reader frees snapshots retired while it was reading, so that they
+  // don't pile up until the next `publish` (which might never come). It
+  // doesn't wait for the loader, though.
+  if (!--DL.Readers && DL.HasRetired.load(memory_order_relaxed) &&
+      DL.LLsMutex.try_lock()) {
+    DL.reclaim();
+    DL.LLsMutex.unlock();
+  }
+}
+
+// Wrapper DLLs generated with `HypercallWrappers` export a table of their
+// wrappers together with range of hypercall IDs assigned to them.
+void DynamicLoader::registerHypercalls(LoadedLibrary *Lib) {
+  auto *Range = reinterpret_cast<const uint32_t *>(
+      Lib->findSymbol(*this, "$__ipaSim_hypercalls_range"));
+  auto *Table = reinterpret_cast<const uint32_t *>(
+      Lib->findSymbol(*this, "$__ipaSim_hypercalls"));
+  if (!Range || !Table)
+    return;
+
+  uint32_t Base = Range[0], Count = Range[1];
+  if (Base > Hypercalls::MaxCount || Count > Hypercalls::MaxCount - Base) {
+    Log.error() << "hypercalls of " << dumpAddr(Lib->getBase())
+                << " are out of range" << Log.end();
+    return;
+  }
+  for (uint32_t I = 0; I != Count; ++I) {
+    bool Leaf = WrapperInfo::get(Table[I]) & WrapperInfo::Leaf;
+    HypercallTable[Base + I].store(Table[I] | uint64_t(Leaf) << 32,
+                                   memory_order_release);
+  }
+}
+
+// Wrapper Dylibs containing messengers generated with `MessengerCaches` export
+// their `MessageCache`.
+void DynamicLoader::registerMessageCache(LoadedLibrary *Lib) {
+  if (auto *Cache = reinterpret_cast<MessageCache *>(
+          Lib->findSymbol(*this, MessageCache::Symbol.S)))
+    MessageCaches.push_back(Cache);
+}
+
+const WrapperIndex *DynamicLoader::getWrapperIndex(LoadedLibrary *Lib) {
+  return reinterpret_cast<const WrapperIndex *>(
+      Lib->findSymbol(*this, WrapperIndex::Symbol.S));
+}
+
+string DynamicLoader::getWrapperPath(const string &Path) {
+  return (filesystem::path("gen") /
+          filesystem::path(Path).filename().replace_extension(".wrapper.dll"))
+      .string();
+}
+
+LoadedLibrary *DynamicLoader::getWrappedDLL(const string &WrapperPath) {
+  filesystem::path Name(filesystem::path(WrapperPath).filename());
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  for (auto &[Path, LL] : LLs)
+    if (LL->isDLL() && !LL->IsWrapper &&
+        filesystem::path(getWrapperPath(Path)).filename() == Name)
+      return LL.get();
+  return nullptr;
+}
+
+uint64_t DynamicLoader::getWrappedFunction(uint64_t Addr) {
+  LibraryInfo LI(lookup(Addr));
+  if (!LI.Lib || !LI.Lib->IsWrapper)
+    return 0;
+  uint64_t SymAddr = 0;
+  const char *Sym = LI.Lib->findNearestSymbol(Addr, SymAddr);
+  if (!Sym || SymAddr != Addr || !startsWith(Sym, WrapperPrefix))
+    return 0;
+  LoadedLibrary *DLL = getWrappedDLL(*LI.LibPath);
+  if (!DLL)
+    return 0;
+  uint64_t RVA = strtoull(Sym + WrapperPrefix.Len, nullptr, 10);
+  return DLL->StartAddress + RVA - DLLBase;
+}
+
+vector<LibraryInfo> DynamicLoader::getLibraries() {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  return LoadOrder;
+}
+
+vector<ImageMemory> DynamicLoader::getImageMemory() {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  vector<ImageMemory> Result;
+  Result.reserve(LoadOrder.size());
+  for (auto [Path, L] : LoadOrder) {
+    ImageMemory M{Path, L->isDLL(), 0, 0, 0};
+    queryCommitted(L->getStart(), L->Size, M.Private, M.Shared);
+    if (!M.DLL)
+      if (LIEF::MachO::Binary *Bin = static_cast<LoadedDylib *>(L)->Bin)
+        for (const LIEF::MachO::SegmentCommand &Seg : Bin->segments())
+          M.ModelBytes += Seg.content().size();
+    Result.push_back(M);
+  }
+  return Result;
+}
+
+void DynamicLoader::trim() {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+  // Libraries being loaded (by this thread) still need their models.
+  if (LoadDepth)
+    return;
+  for (auto &[Path, L] : LLs)
+    if (!L->isDLL())
+      static_cast<LoadedDylib *>(L.get())->releaseModel();
+  lock_guard<mutex> PrefetchedLock(PrefetchedMutex);
+  Prefetched.clear();
+}
+
+const ObjCPreopt &DynamicLoader::getObjCPreopt() {
+  call_once(PreoptLoaded, [&]() {
+    filesystem::path Path(PackageIndex::get().getInstallDir() / "gen" /
+                          "objc-preopt.bin");
+    ifstream IS(Path, ios::binary | ios::ate);
+    if (!IS)
+      return;
+    PreoptData.resize(static_cast<size_t>(IS.tellg()));
+    IS.seekg(0);
+    if (!IS.read(reinterpret_cast<char *>(PreoptData.data()),
+                 PreoptData.size()) ||
+        !Preopt.load(PreoptData.data(), PreoptData.size())) {
+      Log.error() << "invalid Objective-C preoptimization data: "
+                  << Path.string() << Log.end();
+      PreoptData.clear();
+      PreoptData.shrink_to_fit();
+      return;
+    }
+    if (IpaSim.Traces.isEnabled(TraceCategory::Loader))
+      Log.info() << "loaded Objective-C preoptimization data ("
+                 << PreoptData.size() << " bytes)" << Log.end();
+  });
+  return Preopt;
+}
+
+void *DynamicLoader::findPreoptClass(const char *Name, bool Protocol) {
+  const ObjCPreopt &P = getObjCPreopt();
+  const ObjCPreoptEntry *E =
+      Protocol ? P.findProtocol(Name) : P.findClass(Name);
+  if (!E)
+    return nullptr;
+  const char *DLL = P.getDLLName(*E);
+  if (!DLL)
+    return nullptr;
+
+  // Only DLLs that are already loaded count, the runtime would not know about
+  // classes of other DLLs either.
+  HMODULE Module = GetModuleHandleW(to_hstring(DLL).c_str());
+  if (!Module)
+    return nullptr;
+  return reinterpret_cast<uint8_t *>(Module) + E->RVA;
+}
+
+uint64_t DynamicLoader::bindLazySymbol(uint64_t ImageAddr, uint32_t Offset) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+
+  LibraryInfo LI(lookup(ImageAddr));
+  if (!LI.Lib || !LI.Lib->isDylib()) {
+    Log.error() << "lazy binding requested by non-Dylib ("
+                << dumpAddr(ImageAddr) << ")" << Log.end();
+    return 0;
+  }
+  auto *Lib = static_cast<LoadedDylib *>(LI.Lib);
+  if (Offset >= Lib->LazyBindSize) {
+    Log.error() << "invalid lazy binding offset (" << Offset << ")"
+                << Log.end();
+    return 0;
+  }
+
+  // Decode the binding.
+  const uint8_t *P = Lib->LazyBindInfo + Offset;
+  const uint8_t *End = Lib->LazyBindInfo + Lib->LazyBindSize;
+  uint64_t Ordinal = 0;
+  const char *SymName = nullptr;
+  uint64_t TargetAddr = 0;
+  while (P < End) {
+    uint8_t Imm = *P & BIND_IMMEDIATE_MASK;
+    uint8_t Opcode = *P & BIND_OPCODE_MASK;
+    ++P;
+    switch (Opcode) {
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+      Ordinal = Imm;
+      continue;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+      Ordinal = MachOReader::readULEB128(P, End);
+      continue;
+    case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+      SymName = reinterpret_cast<const char *>(P);
+      P += strnlen(SymName, End - P) + 1;
+      continue;
+    case BIND_OPCODE_SET_TYPE_IMM:
+      continue;
+    case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      if (Imm >= Lib->SegmentAddrs.size())
+        break;
+      TargetAddr = Lib->SegmentAddrs[Imm] + MachOReader::readULEB128(P, End);
+      continue;
+    case BIND_OPCODE_DO_BIND: {
+      if (!SymName || !Ordinal || Ordinal > Lib->DylibNames.size() ||
+          !TargetAddr)
+        break;
+      uint64_t SymAddr = findKernelSymbol(SymName);
+      if (!SymAddr)
+        SymAddr = resolveSymbol(Lib->DylibNames[Ordinal - 1], SymName);
+      if (!SymAddr)
+        return 0;
+
+      Lib->checkInRange(TargetAddr);
+      *reinterpret_cast<uint32_t *>(TargetAddr) = SymAddr;
+      recordCallSite(reinterpret_cast<uint32_t *>(TargetAddr));
+      return SymAddr;
+    }
+    }
+
+    // Other opcodes (e.g., `BIND_OPCODE_SET_DYLIB_SPECIAL_IMM` used for
+    // flat-namespace lookups) are not supported. `BIND_OPCODE_DONE` before
+    // `BIND_OPCODE_DO_BIND` means the binding is malformed.
+    break;
+  }
+
+  Log.error() << "unsupported lazy binding at offset " << Offset << " in "
+              << *LI.LibPath << Log.end();
+  return 0;
+}
+
+DynamicLoader::ResolvedLibrary &
+DynamicLoader::resolveLibrary(const string &LibName) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+
+  auto It = ResolvedLibraries.find(LibName);
+  if (It == ResolvedLibraries.end()) {
+    string_view Name = intern(LibName);
+    It = ResolvedLibraries.try_emplace(Name).first;
+    It->second.Name = Name;
+  }
+
+  // Loading can fail or it can be in progress (for cyclic dependencies), so it
+  // is retried until it succeeds.
+  ResolvedLibrary &RL = It->second;
+  if (!RL.Lib)
+    RL.Lib = load(LibName);
+  return RL;
+}
+
+uint64_t DynamicLoader::resolveSymbol(ResolvedLibrary &RL,
+                                      string_view SymName) {
+  lock_guard<recursive_mutex> Lock(LLsMutex);
+
+  if (!RL.Lib) {
+    Log.error() << "library " << RL.Name << " of symbol " << SymName
+                << " couldn't be loaded" << Log.end();
+    return 0;
+  }
+
+  // Symbols that couldn't be resolved are cached, too, so they are reported
+  // only once.
+  auto It = RL.Symbols.find(SymName);
+  if (It != RL.Symbols.end())
+    return It->second;
+  uint64_t SymAddr = RL.Lib->findSymbol(*this, string(SymName));
+  RL.Symbols.emplace(intern(SymName), SymAddr);
+  if (!SymAddr)
+    Log.error() << "external symbol " << SymName << " from library "
+                << RL.Name << " couldn't be resolved" << Log.end();
+  return SymAddr;
+}
+
+uint64_t DynamicLoader::findKernelSymbol(string_view Name) {
+  if (Name == "dyld_stub_binder")
+    return getStubBinderAddr();
+  if constexpr (GuestMalloc) {
+    // Dylib wrappers of `malloc` and `free` fall back to the kernel functions
+    // themselves (see `GuestMallocCache`).
+    if (Name == "_malloc" && !GuestMallocCaches)
+      return getKernelFunctionAddr(KernelFunction::Malloc);
+    if (Name == "_calloc")
+      return getKernelFunctionAddr(KernelFunction::Calloc);
+    if (Name == "_realloc")
+      return getKernelFunctionAddr(KernelFunction::Realloc);
+    if (Name == "_free" && !GuestMallocCaches)
+      return getKernelFunctionAddr(KernelFunction::Free);
+  }
+  if constexpr (NativeStringFunctions) {
+    static const pair<string_view, KernelFunction> StringFunctions[] = {
+        {"_memcpy", KernelFunction::Memcpy},
+        {"_memmove", KernelFunction::Memmove},
+        {"_memset", KernelFunction::Memset},
+        {"_bzero", KernelFunction::Bzero},
+        {"_strlen", KernelFunction::Strlen},
+        {"_strcmp", KernelFunction::Strcmp},
+        {"_memcmp", KernelFunction::Memcmp}};
+    for (auto [FuncName, F] : StringFunctions)
+      if (Name == FuncName)
+        return getKernelFunctionAddr(F);
+  }
+  static const pair<string_view, KernelFunction> DyldFunctions[] = {
+      {"_dlopen", KernelFunction::Dlopen},
+      {"_dlsym", KernelFunction::Dlsym},
+      {"_dlclose", KernelFunction::Dlclose},
+      {"_dlerror", KernelFunction::Dlerror},
+      {"_dladdr", KernelFunction::Dladdr},
+      {"__dyld_image_count", KernelFunction::ImageCount},
+      {"__dyld_get_image_header", KernelFunction::ImageHeader},
+      {"__dyld_get_image_vmaddr_slide", KernelFunction::ImageSlide},
+      {"__dyld_get_image_name", KernelFunction::ImageName}};
+  for (auto [FuncName, F] : DyldFunctions)
+    if (Name == FuncName)
+      return getKernelFunctionAddr(F);
+  if constexpr (NativeTSD) {
+    static const pair<string_view, KernelFunction> TSDFunctions[] = {
+        {"_pthread_getspecific", KernelFunction::Getspecific},
+        {"_pthread_setspecific", KernelFunction::Setspecific},
+        {"_pthread_key_create", KernelFunction::KeyCreate},
+        {"_pthread_key_delete", KernelFunction::KeyDelete}};
+    for (auto [FuncName, F] : TSDFunctions)
+      if (Name == FuncName)
+        return getKernelFunctionAddr(F);
+  }
+  if constexpr (NativeSpinLocks) {
+    static const pair<string_view, KernelFunction> SpinLockFunctions[] = {
+        {"_OSSpinLockLock", KernelFunction::SpinLockLock},
+        {"_OSSpinLockTry", KernelFunction::SpinLockTry},
+        {"_OSSpinLockUnlock", KernelFunction::SpinLockUnlock},
+        {"_os_unfair_lock_lock", KernelFunction::UnfairLock},
+        {"_os_unfair_lock_trylock", KernelFunction::UnfairTrylock},
+        {"_os_unfair_lock_unlock", KernelFunction::UnfairUnlock}};
+    for (auto [FuncName, F] : SpinLockFunctions)
+      if (Name == FuncName)
+        return getKernelFunctionAddr(F);
+  }
+  return IpaSim.Clock.findSymbol(Name);
+}
+
+string_view DynamicLoader::intern(string_view S) {
+  return InternedNames.emplace_back(S);
+}
+
+void DynamicLoader::recordCallSite(uint32_t *Site) {
+  if constexpr (PatchCallSites)
+    if (*Site)
+      CallSites[*Site].push_back(Site);
+}
+
+size_t DynamicLoader::patchCallSites(uint64_t Target, uint64_t NewTarget) {
+  auto It = CallSites.find(Target);
+  if (It == CallSites.end())
+    return 0;
+
+  size_t Count = 0;
+  for (uint32_t *Site : It->second)
+    // The pointer could have been overwritten since we recorded it.
+    if (*Site == Target) {
+      *Site = NewTarget;
+      ++Count;
+    }
+  CallSites.erase(It);
+
+  PatchedCallSites += Count;
+  return Count;
+}
+
 LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr) {
   return [this, Addr](LogStream &S) {
     if (Addr == KernelAddr)
@@ -386,7 +2086,7 @@ LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr,
       return;
     }
     if (LI.Lib->hasMachO())
-      if (ObjCMethod M = LI.Lib->getMachO().findMethod(Addr)) {
+      if (ObjCMethod M = LI.Lib->findMethod(Addr)) {
         S << dumpAddr(Addr, LI, M);
         return;
       }
@@ -394,6 +2094,22 @@ LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr,
   };
 }
 
+string DynamicLoader::describeAddr(uint64_t Addr) {
+  StringStream S;
+  LibraryInfo LI(lookup(Addr));
+  if (Addr == KernelAddr)
+    S << "kernel!0x" << to_hex_string(Addr);
+  else if (!LI.Lib)
+    S << "0x" << to_hex_string(Addr);
+  else {
+    if (LI.Lib->hasMachO())
+      if (ObjCMethod M = LI.Lib->findMethod(Addr))
+        S << M << "!";
+    S << *LI.LibPath << "+0x" << to_hex_string(Addr - LI.Lib->StartAddress);
+  }
+  return S.str();
+}
+
 LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr, const LibraryInfo &LI,
                                            ObjCMethod M) {
   return
@@ -1,4 +1,4 @@
-// Emulator.cpp: Implementation of class `Emulator`.
+// Emulator.cpp: Implementation of classes `Emulator` and `HookHandle`.
 
 #include "ipasim/Emulator.hpp"
 
@@ -7,35 +7,152 @@
 #include <unicorn/unicorn.h>
 
 using namespace ipasim;
-
-Emulator::~Emulator() {
-  if (UC)
-    callUCStatic(uc_close(UC));
-}
+using namespace std;
 
 uint32_t Emulator::readReg(uc_arm_reg RegId) {
   uint32_t Result;
-  callUC(uc_reg_read(UC, RegId, &Result));
+  callUC(Backend->readRegs(&RegId, &Result, 1));
   return Result;
 }
 void Emulator::writeReg(uc_arm_reg RegId, uint32_t Value) {
-  callUC(uc_reg_write(UC, RegId, &Value));
+  callUC(Backend->writeRegs(&RegId, &Value, 1));
+}
+
+uint32_t Emulator::readPC() {
+  static constexpr uc_arm_reg Regs[] = {UC_ARM_REG_PC, UC_ARM_REG_CPSR};
+  uint32_t Values[2];
+  readRegs(Regs, Values);
+  // Bit 5 of CPSR is the Thumb state bit.
+  return Values[0] | ((Values[1] >> 5) & 1);
+}
+
+void Emulator::readRegs(const uc_arm_reg *RegIds, uint32_t *Values,
+                        size_t Count) {
+  assert(Count <= MaxBatch && "Too many registers.");
+  callUC(Backend->readRegs(RegIds, Values, Count));
+}
+void Emulator::writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                         size_t Count) {
+  assert(Count <= MaxBatch && "Too many registers.");
+  callUC(Backend->writeRegs(RegIds, Values, Count));
 }
 
-// TODO: What if the mappings overlap?
 void Emulator::mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms) {
-  if (uc_mem_map_ptr(UC, Addr, Size, Perms, reinterpret_cast<void *>(Addr)))
-    Log.error() << "couldn't map memory at 0x" << to_hex_string(Addr)
-                << " of size 0x" << to_hex_string(Size) << Log.end();
+  lock_guard<mutex> Lock(Space.Mutex);
+  Space.map(Addr, Size, Perms);
+  syncMemoryLocked();
+}
+
+void Emulator::mapHostMemory(uint64_t Addr, uint64_t Start, uint64_t End,
+                             uc_prot Perms) {
+  lock_guard<mutex> Lock(Space.Mutex);
+  Space.mapAround(Addr, Start, End, Perms);
+  syncMemoryLocked();
+}
+
+void Emulator::unmapMemory(uint64_t Addr, uint64_t Size) {
+  lock_guard<mutex> Lock(Space.Mutex);
+  Space.unmap(DynamicLoader::alignToPageSize(Addr),
+              DynamicLoader::roundToPageSize(Addr + Size));
+  syncMemoryLocked();
+}
+
+bool Emulator::syncMemory() {
+  if (Space.ChangeCount == SyncedChanges)
+    return false;
+  lock_guard<mutex> Lock(Space.Mutex);
+  return syncMemoryLocked();
+}
+
+// New engines map the current regions instead of replaying all changes.
+void Emulator::initMemory() {
+  lock_guard<mutex> Lock(Space.Mutex);
+  for (const auto &[Addr, R] : Space.Regions)
+    if (uc_err Err =
+            Backend->mapMemory(Addr, R.End - Addr, R.Perms,
+                               reinterpret_cast<void *>(Addr)))
+      Log.error() << "couldn't map shared memory at 0x" << to_hex_string(Addr)
+                  << ": " << uc_strerror(Err) << Log.end();
+  SyncedChanges = Space.Changes.size();
+}
+
+bool Emulator::syncMemoryLocked() {
+  bool Changed = false;
+  for (size_t Count = Space.Changes.size(); SyncedChanges != Count;
+       ++SyncedChanges) {
+    const GuestMemoryMap::Change &C = Space.Changes[SyncedChanges];
+    uc_err Err;
+    switch (C.Kind) {
+    case GuestMemoryMap::Change::Map:
+      Err = Backend->mapMemory(C.Addr, C.Size, C.Perms,
+                               reinterpret_cast<void *>(C.Addr));
+      break;
+    case GuestMemoryMap::Change::Unmap:
+      Err = Backend->unmapMemory(C.Addr, C.Size);
+      break;
+    case GuestMemoryMap::Change::Protect:
+      Err = Backend->protectMemory(C.Addr, C.Size, C.Perms);
+      break;
+    }
+    if (Err == UC_ERR_OK)
+      Changed = true;
+    else
+      Log.error() << "couldn't change memory map at 0x" << to_hex_string(C.Addr)
+                  << " of size 0x" << to_hex_string(C.Size) << ": "
+                  << uc_strerror(Err) << Log.end();
+  }
+  return Changed;
 }
 
-void Emulator::start(uint64_t Addr) { callUC(uc_emu_start(UC, Addr, 0, 0, 0)); }
+bool Emulator::start(uint64_t Addr, size_t Count) {
+  syncMemory();
+  IpaSim.Stats.add(Stat::EmulatorStarts);
+  IpaSim.Clock.update();
+  uc_err Err = Backend->start(Addr, Count);
+  callUC(Err);
+  return Err == UC_ERR_OK;
+}
+
+void Emulator::stop() {
+  IpaSim.Stats.add(Stat::EmulatorStops);
+  callUC(Backend->stop());
+}
 
-void Emulator::stop() { callUC(uc_emu_stop(UC)); }
+bool Emulator::translate(uint64_t Addr) {
+  syncMemory();
+  // Code can be unmapped or invalid by now, that's not an error.
+  return Backend->translate(Addr) != UC_ERR_ARG;
+}
+
+CPUContext *Emulator::allocContext() {
+  CPUContext *Ctx = nullptr;
+  callUC(Backend->allocContext(Ctx));
+  return Ctx;
+}
+void Emulator::saveContext(CPUContext *Ctx) {
+  callUC(Backend->saveContext(Ctx));
+}
+void Emulator::restoreContext(CPUContext *Ctx) {
+  callUC(Backend->restoreContext(Ctx));
+}
+void Emulator::freeContext(CPUContext *Ctx) {
+  callUC(Backend->freeContext(Ctx));
+}
 
-void Emulator::hook(uc_hook_type Type, void *Handler, void *Instance) {
-  uc_hook Hook;
-  callUC(uc_hook_add(UC, &Hook, Type, Handler, Instance, 1, 0));
+HookHandle Emulator::hook(uc_hook_type Type, void *Handler, void *Instance,
+                          uint64_t Begin, uint64_t End,
+                          void (*FreeData)(void *)) {
+  size_t Hook;
+  uc_err Err = Backend->supportsHook(Type)
+                   ? Backend->addHook(Type, Handler, Instance, Begin, End, Hook)
+                   : UC_ERR_HOOK;
+  callUC(Err);
+  if (Err != UC_ERR_OK) {
+    if (FreeData)
+      FreeData(Instance);
+    return HookHandle();
+  }
+  return HookHandle(this, Hook, Instance, FreeData);
 }
 
 void Emulator::ignoreNextError() {
@@ -43,15 +160,18 @@ void Emulator::ignoreNextError() {
   IgnoreError = true;
 }
 
-uc_engine *Emulator::initUC() {
-  uc_engine *UC;
-  callUCStatic(uc_open(UC_ARCH_ARM, UC_MODE_ARM, &UC));
-  return UC;
-}
-
-void Emulator::callUCStatic(uc_err Err) {
-  if (Err != UC_ERR_OK)
-    Log.error() << "unicorn failed: " << uc_strerror(Err) << Log.end();
+unique_ptr<CPUBackend> Emulator::initBackend() {
+  CPUBackend::Kind K = CPUBackend::getDefault();
+  if (unique_ptr<CPUBackend> B = CPUBackend::create(K))
+    return B;
+  Log.error() << "CPU backend " << CPUBackend::getName(K)
+              << " is not available" << Log.end();
+  // Fall back to Unicorn.
+  if (K != CPUBackend::Unicorn)
+    if (unique_ptr<CPUBackend> B = CPUBackend::create(CPUBackend::Unicorn))
+      return B;
+  Log.error("couldn't create any CPU backend");
+  return nullptr;
 }
 
 void Emulator::callUC(uc_err Err) {
@@ -59,8 +179,20 @@ void Emulator::callUC(uc_err Err) {
     if (IgnoreError)
       IgnoreError = false;
     else
-      Log.error() << "unicorn failed at "
+      Log.error() << CPUBackend::getName(Backend->getKind()) << " failed at "
                   << Dyld.dumpAddr(readReg(UC_ARM_REG_PC)) << ": "
                   << uc_strerror(Err) << Log.end();
   }
 }
+
+void HookHandle::reset() {
+  if (!Emu)
+    return;
+
+  Emu->callUC(Emu->Backend->removeHook(Hook));
+  if (FreeData)
+    FreeData(Data);
+  Emu = nullptr;
+  Data = nullptr;
+  FreeData = nullptr;
+}
@@ -0,0 +1,19 @@
+// EventProvider.cpp: Implementation of class `EventProvider`.
+
+#include "ipasim/EventProvider.hpp"
+
+using namespace ipasim;
+
+TRACELOGGING_DEFINE_PROVIDER(IpaSimProvider, "IpaSim",
+                             (0xd3b39fb1, 0xbcf6, 0x4dc2, 0xac, 0x33, 0x5e,
+                              0x1f, 0x72, 0xd1, 0x1d, 0x4b));
+
+EventProvider::EventProvider() {
+  if constexpr (EtwEvents)
+    TraceLoggingRegister(IpaSimProvider);
+}
+
+EventProvider::~EventProvider() {
+  if constexpr (EtwEvents)
+    TraceLoggingUnregister(IpaSimProvider);
+}
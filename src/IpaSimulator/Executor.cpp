@@ -0,0 +1,143 @@
+// Executor.cpp: Implementation of class `Executor`.
+
+#include "ipasim/Executor.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+
+#include <algorithm>
+#include <functional>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Index of worker running on the current thread (if any).
+thread_local size_t CurrentWorker = static_cast<size_t>(-1);
+
+} // namespace
+
+Executor::~Executor() {
+  if (Workers.empty())
+    return;
+
+  {
+    lock_guard<mutex> Lock(WakeMutex);
+    Stopping = true;
+  }
+  Wake.notify_all();
+  for (auto &W : Workers)
+    if (W->Thread.joinable())
+      W->Thread.join();
+}
+
+void Executor::async(void *Func, void *Ctx, const void *SerialKey) {
+  call_once(Started, &Executor::start, this);
+
+  Task T{Func, Ctx};
+  if (SerialKey) {
+    push(*Workers[hash<const void *>()(SerialKey) % Workers.size()], T, true);
+    return;
+  }
+
+  // Tasks dispatched from a worker stay on it unless there is an idle worker
+  // which steals them. Others are distributed evenly.
+  size_t Index = CurrentWorker < Workers.size()
+                     ? CurrentWorker
+                     : NextWorker++ % Workers.size();
+  push(*Workers[Index], T, false);
+}
+
+void Executor::start() {
+  // Leave one core for the main thread.
+  size_t Count = max(thread::hardware_concurrency(), 2u) - 1;
+  Workers.reserve(Count);
+  for (size_t I = 0; I != Count; ++I)
+    Workers.push_back(make_unique<Worker>());
+
+  // Threads are started after all workers exist, because they can steal from
+  // each other.
+  for (size_t I = 0; I != Count; ++I)
+    Workers[I]->Thread = thread(&Executor::run, this, I);
+}
+
+void Executor::run(size_t Index) {
+  CurrentWorker = Index;
+
+  // Create emulator context of this thread right away, so that the first task
+  // doesn't have to wait for it.
+  IpaSim.sys();
+
+  Worker &W = *Workers[Index];
+  auto HasWork = [&]() {
+    {
+      lock_guard<mutex> Lock(W.Mutex);
+      if (!W.Serial.empty() || !W.Tasks.empty())
+        return true;
+    }
+    for (auto &Other : Workers) {
+      lock_guard<mutex> Lock(Other->Mutex);
+      if (!Other->Tasks.empty())
+        return true;
+    }
+    return false;
+  };
+
+  for (;;) {
+    Task T;
+    if (pop(W, T) || steal(Index, T)) {
+      IpaSim.sys().callBack(T.Func, T.Ctx);
+      continue;
+    }
+
+    unique_lock<mutex> Lock(WakeMutex);
+    Wake.wait(Lock, [&]() { return Stopping || HasWork(); });
+    if (Stopping)
+      return;
+  }
+}
+
+bool Executor::pop(Worker &W, Task &T) {
+  lock_guard<mutex> Lock(W.Mutex);
+  if (!W.Serial.empty()) {
+    T = W.Serial.front();
+    W.Serial.pop_front();
+    return true;
+  }
+  if (!W.Tasks.empty()) {
+    T = W.Tasks.front();
+    W.Tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+// Thieves take the most recently pushed tasks, so that the owner can keep
+// executing its tasks roughly in order of submission.
+bool Executor::steal(size_t Thief, Task &T) {
+  for (size_t I = 1, Count = Workers.size(); I != Count; ++I) {
+    Worker &W = *Workers[(Thief + I) % Count];
+    lock_guard<mutex> Lock(W.Mutex);
+    if (!W.Tasks.empty()) {
+      T = W.Tasks.back();
+      W.Tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void Executor::push(Worker &W, Task T, bool Serial) {
+  {
+    lock_guard<mutex> Lock(W.Mutex);
+    (Serial ? W.Serial : W.Tasks).push_back(T);
+  }
+
+  // Acquiring the mutex ensures that no worker misses the notification.
+  { lock_guard<mutex> Lock(WakeMutex); }
+  // Serial tasks can be executed only by their worker, so wake up every one.
+  if (Serial)
+    Wake.notify_all();
+  else
+    Wake.notify_one();
+}
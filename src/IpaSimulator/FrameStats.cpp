@@ -0,0 +1,108 @@
+// FrameStats.cpp: Implementation of class `FrameStats`.
+
+#include "ipasim/FrameStats.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <winrt/Windows.Foundation.h>
+#include <winrt/Windows.UI.Xaml.Media.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace std::chrono;
+
+void FrameStats::Series::add(Clock::duration Time) {
+  uint64_t Micros = duration_cast<microseconds>(Time).count();
+  lock_guard<mutex> Lock(Mutex);
+  Samples[Count % MaxSamples] =
+      static_cast<uint32_t>(min<uint64_t>(Micros, UINT32_MAX));
+  ++Count;
+  if (Time >= HitchTime)
+    ++Hitches;
+}
+
+FrameStats::Percentiles FrameStats::Series::getPercentiles() {
+  vector<uint32_t> Sorted;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Sorted.assign(Samples.begin(),
+                  Samples.begin() + min<uint64_t>(Count, MaxSamples));
+  }
+  Percentiles P;
+  if (Sorted.empty())
+    return P;
+  sort(Sorted.begin(), Sorted.end());
+  auto Get = [&](size_t Percent) {
+    return Sorted[(Sorted.size() - 1) * Percent / 100];
+  };
+  P.P50 = Get(50);
+  P.P95 = Get(95);
+  P.P99 = Get(99);
+  return P;
+}
+
+uint64_t FrameStats::Series::getCount() {
+  lock_guard<mutex> Lock(Mutex);
+  return Count;
+}
+
+uint64_t FrameStats::Series::getHitches() {
+  lock_guard<mutex> Lock(Mutex);
+  return Hitches;
+}
+
+void FrameStats::start() {
+  if (!Started.exchange(true))
+    Start = Clock::now();
+}
+
+void FrameStats::launched() {
+  if (Started.load(memory_order_relaxed))
+    Launch.store(duration_cast<microseconds>(Clock::now() - Start).count(),
+                 memory_order_relaxed);
+  Launched.store(true, memory_order_release);
+}
+
+void FrameStats::attach() {
+  if (!Attached.exchange(true))
+    listen(true);
+}
+
+void FrameStats::track(bool Enable) {
+  Tracking = Enable;
+  // Intervals must not span the time nothing was measured.
+  LastFrame = Clock::time_point();
+  // Until the first frame, the handler is needed anyway.
+  if (!Attached.load() || FirstFrame.load(memory_order_relaxed))
+    listen(Enable);
+}
+
+void FrameStats::listen(bool Enable) {
+  using namespace winrt::Windows::UI::Xaml::Media;
+
+  if (Enable && !Token)
+    Token = CompositionTarget::Rendering(
+        [this](const winrt::Windows::Foundation::IInspectable &,
+               const winrt::Windows::Foundation::IInspectable &) { frame(); });
+  else if (!Enable && Token) {
+    CompositionTarget::Rendering(Token);
+    Token = {};
+  }
+}
+
+void FrameStats::frame() {
+  // Frames rendered before the launch don't show anything of the app.
+  if (!Launched.load(memory_order_acquire))
+    return;
+  Clock::time_point Now = Clock::now();
+  if (!FirstFrame.load(memory_order_relaxed)) {
+    FirstFrame.store(duration_cast<microseconds>(Now - Start).count(),
+                     memory_order_relaxed);
+    if (!Tracking) {
+      listen(false);
+      return;
+    }
+  } else if (LastFrame != Clock::time_point())
+    Frames.add(Now - LastFrame);
+  LastFrame = Now;
+}
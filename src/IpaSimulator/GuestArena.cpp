@@ -0,0 +1,95 @@
+// GuestArena.cpp: Implementation of class `GuestArena`.
+
+#include "ipasim/GuestArena.hpp"
+
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+
+using namespace ipasim;
+using namespace std;
+
+void GuestArena::initialize() {
+  SYSTEM_INFO Info;
+  GetSystemInfo(&Info);
+  Granularity = Info.dwAllocationGranularity;
+
+  if constexpr (ArenaSize == 0)
+    return;
+  void *Ptr = VirtualAlloc2FromApp(nullptr, nullptr, ArenaSize,
+                                   MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,
+                                   PAGE_NOACCESS, nullptr, 0);
+  // Without placeholders, there is no arena and everything is allocated
+  // separately.
+  if (!Ptr)
+    return;
+  Begin = Next = reinterpret_cast<uint64_t>(Ptr);
+  End = Next + ArenaSize;
+}
+
+uint64_t GuestArena::reserve(uint64_t &Size) {
+  call_once(Initialized, &GuestArena::initialize, this);
+
+  lock_guard<mutex> Lock(Mutex);
+  uint64_t Rounded = (Size + Granularity - 1) / Granularity * Granularity;
+  if (!Rounded)
+    return 0;
+
+  // Prefer the first recycled range which is big enough.
+  for (auto It = Recycled.begin(); It != Recycled.end(); ++It) {
+    auto [Addr, Free] = *It;
+    if (Free < Rounded)
+      continue;
+    if (Free != Rounded &&
+        !VirtualFree(reinterpret_cast<void *>(Addr), Rounded,
+                     MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+      continue;
+    Recycled.erase(It);
+    if (Free != Rounded)
+      Recycled[Addr + Rounded] = Free - Rounded;
+    Size = Rounded;
+    return Addr;
+  }
+
+  if (Rounded > End - Next)
+    return 0;
+
+  // Placeholders can only be split by "freeing" a part of them.
+  uint64_t Addr = Next;
+  if (Rounded != End - Next &&
+      !VirtualFree(reinterpret_cast<void *>(Addr), Rounded,
+                   MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+    return 0;
+  Next += Rounded;
+  Size = Rounded;
+  return Addr;
+}
+
+void *GuestArena::allocate(uint64_t Size) {
+  uint64_t Addr = reserve(Size);
+  if (!Addr)
+    return nullptr;
+  return VirtualAlloc2FromApp(
+      nullptr, reinterpret_cast<void *>(Addr), Size,
+      MEM_RESERVE | MEM_COMMIT | MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE,
+      nullptr, 0);
+}
+
+void *GuestArena::allocateReserved(uint64_t Size) {
+  uint64_t Addr = reserve(Size);
+  if (!Addr)
+    return nullptr;
+  return VirtualAlloc2FromApp(nullptr, reinterpret_cast<void *>(Addr), Size,
+                              MEM_RESERVE | MEM_REPLACE_PLACEHOLDER,
+                              PAGE_NOACCESS, nullptr, 0);
+}
+
+bool GuestArena::contains(uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+  return Begin <= Addr && Addr < Next;
+}
+
+void GuestArena::recycle(uint64_t Addr, uint64_t Size) {
+  lock_guard<mutex> Lock(Mutex);
+  Recycled[Addr] = Size;
+}
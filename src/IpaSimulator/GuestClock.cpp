@@ -0,0 +1,179 @@
+// GuestClock.cpp: Implementation of classes `GuestClock` and `GuestTimes`.
+
+#include "ipasim/GuestClock.hpp"
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/GuestArena.hpp"
+#include "ipasim/GuestMemoryMap.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <numeric>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Offsets of the functions in the page (after `CommPage`).
+constexpr size_t AbsoluteTimeOffset = 0x100;
+constexpr size_t TimebaseInfoOffset = 0x140;
+
+// `uint64_t mach_absolute_time()`. Both stubs find the page by clearing low
+// bits of PC, so they don't need any relocations.
+constexpr uint32_t AbsoluteTime[] = {
+    0xE3CFC0FF, //        bic r12, pc, #0xFF
+    0xE3CCCC0F, //        bic r12, r12, #0xF00  ; `CommPage`
+    0xE59C2000, // retry: ldr r2, [r12]         ; Seq
+    0xF57FF05B, //        dmb ish
+    0xE3120001, //        tst r2, #1
+    0x1AFFFFFB, //        bne retry
+    0xE59C0008, //        ldr r0, [r12, #8]     ; TimeLow
+    0xE59C100C, //        ldr r1, [r12, #12]    ; TimeHigh
+    0xF57FF05B, //        dmb ish
+    0xE59C3000, //        ldr r3, [r12]         ; Seq
+    0xE1520003, //        cmp r2, r3
+    0x1AFFFFF5, //        bne retry
+    0xE12FFF1E, //        bx lr
+};
+
+// `kern_return_t mach_timebase_info(mach_timebase_info_t Info)`.
+constexpr uint32_t TimebaseInfo[] = {
+    0xE3CFC0FF, // bic r12, pc, #0xFF
+    0xE3CCCC0F, // bic r12, r12, #0xF00
+    0xE59C1010, // ldr r1, [r12, #16]  ; Numer
+    0xE59C2014, // ldr r2, [r12, #20]  ; Denom
+    0xE5801000, // str r1, [r0]
+    0xE5802004, // str r2, [r0, #4]
+    0xE3A00000, // mov r0, #0          ; KERN_SUCCESS
+    0xE12FFF1E, // bx lr
+};
+
+static_assert(sizeof(CommPage) <= AbsoluteTimeOffset);
+static_assert(AbsoluteTimeOffset + sizeof(AbsoluteTime) <= TimebaseInfoOffset);
+
+uint64_t queryFrequency() {
+  LARGE_INTEGER Frequency;
+  QueryPerformanceFrequency(&Frequency);
+  return Frequency.QuadPart;
+}
+
+} // namespace
+
+thread_local GuestTimes *GuestTimes::Current = nullptr;
+
+GuestClock::GuestClock(GuestArena &Arena, GuestMemoryMap &Space)
+    : Frequency(queryFrequency()) {
+  if constexpr (CommPageInterval == 0)
+    return;
+
+  void *Ptr = Arena.allocate(DynamicLoader::PageSize);
+  if (!Ptr)
+    Ptr = _aligned_malloc(DynamicLoader::PageSize, DynamicLoader::PageSize);
+  auto *Bytes = reinterpret_cast<uint8_t *>(Ptr);
+  memcpy(Bytes + AbsoluteTimeOffset, AbsoluteTime, sizeof(AbsoluteTime));
+  memcpy(Bytes + TimebaseInfoOffset, TimebaseInfo, sizeof(TimebaseInfo));
+
+  // Nanoseconds are `Ticks * 10^9 / Frequency`. The fraction is reduced, so
+  // that it fits into 32 bits for all common frequencies (e.g., 10 MHz gives
+  // `100 / 1`).
+  Page = new (Ptr) CommPage();
+  uint64_t Divisor = gcd(uint64_t(1000000000), Frequency);
+  Page->Numer = static_cast<uint32_t>(1000000000 / Divisor);
+  Page->Denom = static_cast<uint32_t>(Frequency / Divisor);
+  update();
+
+  // The host writes the page directly, emulated code can only read it.
+  Space.mapRange(reinterpret_cast<uint64_t>(Ptr), DynamicLoader::PageSize,
+                 static_cast<uc_prot>(UC_PROT_READ | UC_PROT_EXEC));
+}
+
+GuestClock::~GuestClock() {
+  Running = false;
+  if (Timer.joinable())
+    Timer.join();
+}
+
+void GuestClock::start() {
+  if constexpr (CommPageInterval == 0)
+    return;
+  if (Running.exchange(true))
+    return;
+
+  Timer = thread([this]() {
+    auto Interval = chrono::microseconds(CommPageInterval);
+    while (Running.load(memory_order_relaxed)) {
+      this_thread::sleep_for(Interval);
+      update();
+    }
+  });
+}
+
+void GuestClock::update() {
+  if (!Page)
+    return;
+
+  // Readers never write, so the only contention is between host threads. If
+  // another one is updating the page, its time is as good as ours.
+  uint32_t Seq = Page->Seq.load(memory_order_relaxed);
+  if ((Seq & 1) ||
+      !Page->Seq.compare_exchange_strong(Seq, Seq + 1, memory_order_acquire))
+    return;
+  atomic_thread_fence(memory_order_release);
+  uint64_t Time = now();
+  Page->TimeLow = static_cast<uint32_t>(Time);
+  Page->TimeHigh = static_cast<uint32_t>(Time >> 32);
+  Page->Seq.store(Seq + 2, memory_order_release);
+}
+
+uint64_t GuestClock::findSymbol(string_view Name) {
+  if (!Page)
+    return 0;
+  uint64_t Addr = reinterpret_cast<uint64_t>(Page);
+  // There is no sleep on the host, so all of them are the same.
+  if (Name == "_mach_absolute_time" || Name == "_mach_approximate_time" ||
+      Name == "_mach_continuous_time")
+    return Addr + AbsoluteTimeOffset;
+  if (Name == "_mach_timebase_info")
+    return Addr + TimebaseInfoOffset;
+  return 0;
+}
+
+bool GuestClock::contains(uint64_t Addr) const {
+  uint64_t Start = getPageAddr();
+  return Start && Start <= Addr && Addr < Start + DynamicLoader::PageSize;
+}
+
+uint64_t GuestClock::now() {
+  LARGE_INTEGER Counter;
+  QueryPerformanceCounter(&Counter);
+  return Counter.QuadPart;
+}
+
+GuestTimes::ModeTy GuestTimes::enter(ModeTy Mode) {
+  GuestTimes *T = Current;
+  if (!T)
+    return None;
+  T->flush(GuestClock::now());
+  ModeTy Previous = T->Mode;
+  T->Mode = Mode;
+  return Previous;
+}
+
+void GuestTimes::setCurrent(GuestTimes *Times) {
+  uint64_t Now = GuestClock::now();
+  if (Current)
+    Current->flush(Now);
+  Current = Times;
+  if (Times)
+    Times->Since = Now;
+}
+
+void GuestTimes::flush(uint64_t Now) {
+  Ticks[Mode] += Now - Since;
+  Since = Now;
+}
@@ -0,0 +1,278 @@
+// GuestHeap.cpp: Implementation of class `GuestHeap`.
+
+#include "ipasim/GuestHeap.hpp"
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/GuestArena.hpp"
+#include "ipasim/GuestMallocCache.hpp"
+#include "ipasim/GuestMemoryMap.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+using namespace ipasim;
+using namespace std;
+
+void *GuestHeap::allocate(size_t Size) {
+  lock_guard<mutex> Lock(Mutex);
+  uint32_t Class = getClass(Size);
+  void *Ptr = Class == LargeClass ? allocateLarge(Size) : allocateSmall(Class);
+  if (Ptr)
+    getHeader(Ptr)->Size = static_cast<uint32_t>(Size);
+  return Ptr;
+}
+
+void *GuestHeap::allocateZeroed(size_t Count, size_t Size) {
+  if (Size && Count > SIZE_MAX / Size)
+    return nullptr;
+  void *Ptr = allocate(Count * Size);
+  // Blocks from free lists can contain old data.
+  if (Ptr)
+    memset(Ptr, 0, Count * Size);
+  return Ptr;
+}
+
+void *GuestHeap::reallocate(void *Ptr, size_t Size) {
+  if (!Ptr)
+    return allocate(Size);
+  if (!owns(Ptr))
+    return ::realloc(Ptr, Size);
+  if (!Size) {
+    free(Ptr);
+    return nullptr;
+  }
+
+  // Keep the block if it's big enough and not too big.
+  Header *H = getHeader(Ptr);
+  if (getClass(Size) == H->Class && H->Class != LargeClass) {
+    H->Size = static_cast<uint32_t>(Size);
+    return Ptr;
+  }
+
+  void *NewPtr = allocate(Size);
+  if (!NewPtr)
+    return nullptr;
+  memcpy(NewPtr, Ptr, min<size_t>(Size, H->Size));
+  free(Ptr);
+  return NewPtr;
+}
+
+void GuestHeap::free(void *Ptr) {
+  if (!Ptr)
+    return;
+
+  lock_guard<mutex> Lock(Mutex);
+  if (!ownsLocked(Ptr)) {
+    ::free(Ptr);
+    return;
+  }
+
+  Header *H = getHeader(Ptr);
+  if (H->Class != LargeClass) {
+    auto *B = reinterpret_cast<FreeBlock *>(Ptr);
+    FreeBlock *&List = isCacheable(reinterpret_cast<uint64_t>(Ptr))
+                           ? CacheFreeLists[H->Class]
+                           : FreeLists[H->Class];
+    B->Next = List;
+    List = B;
+    return;
+  }
+
+  // Large blocks are unmapped and released right away.
+  auto It = Regions.find(reinterpret_cast<uint64_t>(H));
+  Space.unmapRange(It->first, It->second - It->first);
+  if (!VirtualFree(H, 0, MEM_RELEASE))
+    Log.winError("couldn't release guest heap block");
+  Regions.erase(It);
+}
+
+bool GuestHeap::owns(const void *Ptr) {
+  lock_guard<mutex> Lock(Mutex);
+  return ownsLocked(Ptr);
+}
+
+uint32_t GuestHeap::getClass(size_t Size) {
+  size_t BlockSize = Size + sizeof(Header);
+  if (BlockSize > (size_t(1) << MaxClassShift))
+    return LargeClass;
+  uint32_t Shift = MinClassShift;
+  while ((size_t(1) << Shift) < BlockSize)
+    ++Shift;
+  return Shift - MinClassShift;
+}
+
+void *GuestHeap::allocateSmall(uint32_t Class) {
+  Header *H;
+  if (FreeBlock *B = FreeLists[Class]) {
+    FreeLists[Class] = B->Next;
+    H = getHeader(B);
+  } else {
+    uint64_t BlockSize = uint64_t(1) << (Class + MinClassShift);
+    if (ChunkEnd - Cursor < BlockSize) {
+      // The rest of the current chunk is left unused.
+      uint64_t Chunk = allocateRegion(GuestHeapChunk, /* FromArena */ true);
+      if (!Chunk)
+        return nullptr;
+      Cursor = Chunk;
+      ChunkEnd = Chunk + GuestHeapChunk;
+    }
+    H = reinterpret_cast<Header *>(Cursor);
+    Cursor += BlockSize;
+  }
+  H->Class = Class;
+  return H + 1;
+}
+
+void *GuestHeap::allocateLarge(size_t Size) {
+  uint64_t Addr = allocateRegion(
+      DynamicLoader::roundToPageSize(Size + sizeof(Header)),
+      /* FromArena */ false);
+  if (!Addr)
+    return nullptr;
+  auto *H = reinterpret_cast<Header *>(Addr);
+  H->Class = LargeClass;
+  return H + 1;
+}
+
+uint64_t GuestHeap::allocateRegion(size_t Size, bool FromArena) {
+  // Large blocks don't come from the arena, because it cannot take their
+  // memory back.
+  void *Ptr = FromArena ? Arena.allocate(Size) : nullptr;
+  if (!Ptr)
+    Ptr = VirtualAllocFromApp(nullptr, Size, MEM_RESERVE | MEM_COMMIT,
+                              PAGE_READWRITE);
+  if (!Ptr) {
+    Log.winError("couldn't allocate guest heap memory");
+    return 0;
+  }
+
+  auto Addr = reinterpret_cast<uint64_t>(Ptr);
+  Space.mapRange(Addr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  Regions[Addr] = Addr + Size;
+  return Addr;
+}
+
+uint64_t GuestHeap::getRegionBytes() {
+  lock_guard<mutex> Lock(Mutex);
+  uint64_t Bytes = 0;
+  for (const auto &[Start, End] : Regions)
+    Bytes += End - Start;
+  return Bytes;
+}
+
+uint64_t GuestHeap::trim() {
+  lock_guard<mutex> Lock(Mutex);
+  uint64_t Bytes = 0;
+  for (uint32_t Class = 0; Class != ClassCount; ++Class) {
+    // Smaller blocks cannot contain a whole page besides their `Next` link.
+    if ((uint64_t(1) << (Class + MinClassShift)) < 2 * DynamicLoader::PageSize)
+      continue;
+    for (FreeBlock *B = FreeLists[Class]; B; B = B->Next) {
+      auto Addr = reinterpret_cast<uint64_t>(B);
+      uint64_t Start = DynamicLoader::roundToPageSize(Addr + sizeof(FreeBlock));
+      uint64_t End = DynamicLoader::alignToPageSize(Addr + getHeader(B)->Size);
+      if (Start >= End)
+        continue;
+      if (DiscardVirtualMemory(reinterpret_cast<void *>(Start), End - Start) ==
+          ERROR_SUCCESS)
+        Bytes += End - Start;
+    }
+  }
+  return Bytes;
+}
+
+bool GuestHeap::initialize(GuestMallocCache &Cache) {
+  // The guest computes classes and finds headers itself.
+  static_assert(GuestMallocCache::MinClassShift == MinClassShift);
+  static_assert(GuestMallocCache::HeaderSize == sizeof(Header));
+  static_assert(GuestMallocCache::ClassCount <= ClassCount);
+
+  lock_guard<mutex> Lock(Mutex);
+  if (!CacheReserved) {
+    CacheReserved = true;
+    void *Ptr = Arena.allocateReserved(CacheRegionSize);
+    if (!Ptr)
+      Ptr = VirtualAllocFromApp(nullptr, CacheRegionSize, MEM_RESERVE,
+                                PAGE_READWRITE);
+    if (!Ptr)
+      Log.winError("couldn't reserve guest malloc cache region");
+    CacheBegin = CacheCursor = CacheMapped = reinterpret_cast<uint64_t>(Ptr);
+    CacheEnd = Ptr ? CacheBegin + CacheRegionSize : 0;
+  }
+  if (!CacheBegin)
+    return false;
+  Cache.Begin = static_cast<uint32_t>(CacheBegin);
+  Cache.End = static_cast<uint32_t>(CacheEnd);
+  return true;
+}
+
+bool GuestHeap::refill(GuestMallocCache &Cache, uint32_t Class) {
+  if (Class >= GuestMallocCache::ClassCount)
+    return false;
+  GuestMallocCache::List &L = Cache.Lists[Class];
+  lock_guard<mutex> Lock(Mutex);
+  for (uint32_t I = 0; I != GuestMallocCache::BatchSize; ++I) {
+    void *Ptr = allocateCacheable(Class);
+    if (!Ptr)
+      break;
+    reinterpret_cast<FreeBlock *>(Ptr)->Next =
+        reinterpret_cast<FreeBlock *>(static_cast<uintptr_t>(L.Head));
+    L.Head = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(Ptr));
+    ++L.Count;
+  }
+  return L.Head;
+}
+
+void GuestHeap::drain(GuestMallocCache &Cache, uint32_t Class,
+                      uint32_t Count) {
+  if (Class >= GuestMallocCache::ClassCount)
+    return;
+  GuestMallocCache::List &L = Cache.Lists[Class];
+  lock_guard<mutex> Lock(Mutex);
+  for (; L.Head && Count; --Count) {
+    auto *B = reinterpret_cast<FreeBlock *>(static_cast<uintptr_t>(L.Head));
+    L.Head = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(B->Next));
+    --L.Count;
+    B->Next = CacheFreeLists[Class];
+    CacheFreeLists[Class] = B;
+  }
+}
+
+void *GuestHeap::allocateCacheable(uint32_t Class) {
+  Header *H;
+  if (FreeBlock *B = CacheFreeLists[Class]) {
+    CacheFreeLists[Class] = B->Next;
+    H = getHeader(B);
+  } else {
+    uint64_t BlockSize = uint64_t(1) << (Class + MinClassShift);
+    if (CacheEnd - CacheCursor < BlockSize)
+      return nullptr;
+    // Commit and map the region in chunks, as the rest of the heap.
+    if (CacheMapped - CacheCursor < BlockSize) {
+      uint64_t Size = min<uint64_t>(GuestHeapChunk, CacheEnd - CacheMapped);
+      if (!VirtualAllocFromApp(reinterpret_cast<void *>(CacheMapped), Size,
+                               MEM_COMMIT, PAGE_READWRITE)) {
+        Log.winError("couldn't commit guest malloc cache region");
+        return nullptr;
+      }
+      Space.mapRange(CacheMapped, Size, UC_PROT_READ | UC_PROT_WRITE);
+      Regions[CacheMapped] = CacheMapped + Size;
+      CacheMapped += Size;
+    }
+    H = reinterpret_cast<Header *>(CacheCursor);
+    CacheCursor += BlockSize;
+  }
+  H->Class = Class;
+  return H + 1;
+}
+
+bool GuestHeap::ownsLocked(const void *Ptr) {
+  auto Addr = reinterpret_cast<uint64_t>(Ptr);
+  auto It = Regions.upper_bound(Addr);
+  return It != Regions.begin() && Addr < prev(It)->second;
+}
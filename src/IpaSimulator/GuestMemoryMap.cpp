@@ -0,0 +1,170 @@
+// GuestMemoryMap.cpp: Implementation of class `GuestMemoryMap`.
+
+#include "ipasim/GuestMemoryMap.hpp"
+
+#include "ipasim/DynamicLoader.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+using namespace ipasim;
+using namespace std;
+
+void GuestMemoryMap::mapRange(uint64_t Addr, uint64_t Size, uc_prot Perms) {
+  lock_guard<mutex> Lock(Mutex);
+  map(Addr, Size, Perms);
+}
+
+void GuestMemoryMap::unmapRange(uint64_t Addr, uint64_t Size) {
+  lock_guard<mutex> Lock(Mutex);
+  unmap(DynamicLoader::alignToPageSize(Addr),
+        DynamicLoader::roundToPageSize(Addr + Size));
+}
+
+bool GuestMemoryMap::protectRange(uint64_t Addr, uint64_t Size,
+                                  uc_prot Perms) {
+  uint64_t Start = DynamicLoader::alignToPageSize(Addr);
+  uint64_t End = DynamicLoader::roundToPageSize(Addr + Size);
+  lock_guard<mutex> Lock(Mutex);
+
+  // Check that there are no gaps.
+  auto It = Regions.upper_bound(Start);
+  if (It == Regions.begin() || prev(It)->second.End <= Start)
+    return false;
+  for (--It; It->second.End < End; ++It) {
+    auto Next = next(It);
+    if (Next == Regions.end() || Next->first != It->second.End)
+      return false;
+  }
+
+  protect(Start, End, Perms);
+  return true;
+}
+
+bool GuestMemoryMap::getPerms(uint64_t Addr, uc_prot &Perms) {
+  lock_guard<mutex> Lock(Mutex);
+  auto It = Regions.upper_bound(Addr);
+  if (It == Regions.begin() || prev(It)->second.End <= Addr)
+    return false;
+  Perms = prev(It)->second.Perms;
+  return true;
+}
+
+void GuestMemoryMap::map(uint64_t Addr, uint64_t Size, uc_prot Perms) {
+  uint64_t Start = DynamicLoader::alignToPageSize(Addr);
+  uint64_t End = DynamicLoader::roundToPageSize(Addr + Size);
+
+  // Find parts of the range which are already mapped, but with different
+  // protection, and gaps between them.
+  vector<pair<uint64_t, uint64_t>> Protects, Gaps;
+  auto It = Regions.upper_bound(Start);
+  if (It != Regions.begin() && prev(It)->second.End > Start)
+    --It;
+  uint64_t Cursor = Start;
+  for (; It != Regions.end() && It->first < End; ++It) {
+    if (It->first > Cursor)
+      Gaps.emplace_back(Cursor, It->first);
+    uint64_t OverlapEnd = min(End, It->second.End);
+    if (It->second.Perms != Perms)
+      Protects.emplace_back(max(Cursor, It->first), OverlapEnd);
+    Cursor = OverlapEnd;
+  }
+  if (Cursor < End)
+    Gaps.emplace_back(Cursor, End);
+
+  for (auto [PStart, PEnd] : Protects)
+    protect(PStart, PEnd, Perms);
+  for (auto [GStart, GEnd] : Gaps)
+    add(GStart, GEnd, Perms);
+}
+
+void GuestMemoryMap::mapAround(uint64_t Addr, uint64_t Start, uint64_t End,
+                               uc_prot Perms) {
+  Start = DynamicLoader::alignToPageSize(Start);
+  End = DynamicLoader::roundToPageSize(End);
+
+  // Shrink the range to the gap between existing regions.
+  auto Next = Regions.upper_bound(Addr);
+  if (Next != Regions.begin()) {
+    auto Prev = prev(Next);
+    if (Prev->second.End > Addr)
+      // Already mapped (e.g., by another engine).
+      return;
+    Start = max(Start, Prev->second.End);
+  }
+  if (Next != Regions.end())
+    End = min(End, Next->first);
+
+  add(Start, End, Perms);
+  ++Faults;
+  FaultBytes += End - Start;
+}
+
+void GuestMemoryMap::add(uint64_t Start, uint64_t End, uc_prot Perms) {
+  MappedBytes += End - Start;
+
+  // Merge with neighbours. Unicorn cannot extend regions, so they have to be
+  // unmapped and mapped again. That's cheap, because memory is not copied,
+  // the host memory stays where it is.
+  uint64_t NewStart = Start, NewEnd = End;
+  auto Next = Regions.find(End);
+  if (Next != Regions.end() && Next->second.Perms == Perms) {
+    NewEnd = Next->second.End;
+    record({Change::Unmap, End, NewEnd - End, Perms});
+    Regions.erase(Next);
+  }
+  auto Prev = Regions.lower_bound(Start);
+  if (Prev != Regions.begin()) {
+    --Prev;
+    if (Prev->second.End == Start && Prev->second.Perms == Perms) {
+      NewStart = Prev->first;
+      record({Change::Unmap, NewStart, Start - NewStart, Perms});
+      Regions.erase(Prev);
+    }
+  }
+
+  record({Change::Map, NewStart, NewEnd - NewStart, Perms});
+  Regions[NewStart] = Region{NewEnd, Perms};
+  RegionCount = Regions.size();
+}
+
+void GuestMemoryMap::protect(uint64_t Start, uint64_t End, uc_prot Perms) {
+  // Unicorn splits its regions the same way.
+  splitAt(Start);
+  splitAt(End);
+  for (auto It = Regions.find(Start); It != Regions.end() && It->first < End;
+       ++It)
+    It->second.Perms = Perms;
+  record({Change::Protect, Start, End - Start, Perms});
+  RegionCount = Regions.size();
+}
+
+void GuestMemoryMap::unmap(uint64_t Start, uint64_t End) {
+  splitAt(Start);
+  splitAt(End);
+  auto It = Regions.lower_bound(Start);
+  while (It != Regions.end() && It->first < End) {
+    uint64_t Size = It->second.End - It->first;
+    record({Change::Unmap, It->first, Size, It->second.Perms});
+    MappedBytes -= Size;
+    It = Regions.erase(It);
+  }
+  RegionCount = Regions.size();
+}
+
+void GuestMemoryMap::splitAt(uint64_t Addr) {
+  auto It = Regions.upper_bound(Addr);
+  if (It == Regions.begin())
+    return;
+  --It;
+  if (It->first == Addr || It->second.End <= Addr)
+    return;
+  Regions[Addr] = Region{It->second.End, It->second.Perms};
+  It->second.End = Addr;
+}
+
+void GuestMemoryMap::record(Change C) {
+  Changes.push_back(C);
+  ChangeCount = Changes.size();
+}
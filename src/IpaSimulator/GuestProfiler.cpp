@@ -0,0 +1,94 @@
+// GuestProfiler.cpp: Implementation of class `GuestProfiler`.
+
+#include "ipasim/GuestProfiler.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+
+using namespace ipasim;
+using namespace std;
+
+// Samples are not written here, `Log` might have already been destroyed.
+GuestProfiler::~GuestProfiler() {
+  Running = false;
+  if (Timer.joinable())
+    Timer.join();
+}
+
+void GuestProfiler::start() {
+  if constexpr (ProfileInterval == 0)
+    return;
+  if (Running.exchange(true))
+    return;
+
+  Timer = thread([this]() {
+    // Samples are also saved periodically, since apps are usually killed
+    // rather than exited.
+    constexpr auto FlushPeriod = chrono::seconds(10);
+    auto Interval = chrono::microseconds(ProfileInterval);
+    auto LastFlush = chrono::steady_clock::now();
+    while (Running.load(memory_order_relaxed)) {
+      this_thread::sleep_for(Interval);
+      Tick.fetch_add(1, memory_order_relaxed);
+      auto Now = chrono::steady_clock::now();
+      if (Now - LastFlush >= FlushPeriod) {
+        LastFlush = Now;
+        write();
+      }
+    }
+  });
+}
+
+void GuestProfiler::stop() {
+  if (!Running.exchange(false))
+    return;
+  Timer.join();
+}
+
+void GuestProfiler::addSample(const uint32_t *Frames, size_t Count) {
+  IpaSim.Stats.add(Stat::ProfilerSamples);
+  vector<uint32_t> Stack(Frames, Frames + Count);
+  lock_guard<mutex> Lock(Mutex);
+  ++Samples[move(Stack)];
+}
+
+bool GuestProfiler::write(const string &Path) {
+  lock_guard<mutex> WriteLock(WriteMutex);
+  map<vector<uint32_t>, size_t> Copy;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Copy = Samples;
+  }
+
+  // Each line is `root;...;leaf count`.
+  unordered_map<uint32_t, string> Names;
+  ofstream O(Path, ios::trunc);
+  for (const auto &[Stack, Count] : Copy) {
+    for (auto It = Stack.rbegin(), End = Stack.rend(); It != End; ++It) {
+      auto [NameIt, New] = Names.try_emplace(*It);
+      if (New)
+        NameIt->second = Dyld.describeAddr(*It);
+      if (It != Stack.rbegin())
+        O << ';';
+      O << NameIt->second;
+    }
+    O << ' ' << Count << '\n';
+  }
+  return static_cast<bool>(O);
+}
+bool GuestProfiler::write() {
+  error_code Error;
+  filesystem::path Dir(getCacheDir("profile"));
+  filesystem::create_directories(Dir, Error);
+  if (write((Dir / "guest.folded").string()))
+    return true;
+  Log.warning("couldn't save guest profile");
+  return false;
+}
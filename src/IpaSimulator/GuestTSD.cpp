@@ -0,0 +1,91 @@
+// GuestTSD.cpp: Implementation of class `GuestTSD`.
+
+#include "ipasim/GuestTSD.hpp"
+
+#include "ipasim/CommandBuffer.hpp"
+#include "ipasim/GuestHeap.hpp"
+#include "ipasim/GuestMallocCache.hpp"
+#include "ipasim/GuestPoolPage.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+using namespace ipasim;
+using namespace std;
+
+uint32_t *GuestTSD::allocate() {
+  auto *Block = static_cast<uint32_t *>(
+      Heap.allocateZeroed(SlotCount, sizeof(uint32_t)));
+  // Without the page, wrappers simply use native pools.
+  if constexpr (GuestAutoreleasePools)
+    if (Block)
+      Block[AutoreleasePoolKey] = reinterpret_cast<uintptr_t>(
+          Heap.allocateZeroed(1, sizeof(GuestPoolPage)));
+  if constexpr (GuestMallocCaches)
+    if (Block) {
+      using KernelFunction = DynamicLoader::KernelFunction;
+
+      Block[MallocCacheKey] = reinterpret_cast<uintptr_t>(allocateCache());
+      Block[KernelMallocKey] = static_cast<uint32_t>(
+          IpaSim.Dyld.getKernelFunctionAddr(KernelFunction::Malloc));
+      Block[KernelFreeKey] = static_cast<uint32_t>(
+          IpaSim.Dyld.getKernelFunctionAddr(KernelFunction::Free));
+    }
+  // Without the buffer, deferred functions are called right away.
+  if constexpr (DeferredCalls)
+    if (Block)
+      Block[CommandBufferKey] = reinterpret_cast<uintptr_t>(
+          Heap.allocateZeroed(1, sizeof(CommandBuffer)));
+  return Block;
+}
+
+GuestMallocCache *GuestTSD::allocateCache() {
+  auto *Cache = static_cast<GuestMallocCache *>(
+      Heap.allocateZeroed(1, sizeof(GuestMallocCache)));
+  if (!Cache)
+    return nullptr;
+  if (!Heap.initialize(*Cache)) {
+    Heap.free(Cache);
+    return nullptr;
+  }
+  return Cache;
+}
+
+void GuestTSD::release(uint32_t *Block) {
+  if (!Block)
+    return;
+  if (auto *Cache =
+          reinterpret_cast<GuestMallocCache *>(Block[MallocCacheKey])) {
+    for (uint32_t Class = 0; Class != GuestMallocCache::ClassCount; ++Class)
+      Heap.drain(*Cache, Class, UINT32_MAX);
+    Heap.free(Cache);
+  }
+  if (void *Page = reinterpret_cast<void *>(Block[AutoreleasePoolKey]))
+    Heap.free(Page);
+  if (void *Buffer = reinterpret_cast<void *>(Block[CommandBufferKey]))
+    Heap.free(Buffer);
+  Heap.free(Block);
+}
+
+bool GuestTSD::createKey(uint32_t Destructor, uint32_t &Key) {
+  lock_guard<mutex> Lock(Mutex);
+  for (uint32_t I = 0; I != SlotCount - FirstKey; ++I) {
+    uint32_t K = FirstKey + (NextKey - FirstKey + I) % (SlotCount - FirstKey);
+    if (Used[K])
+      continue;
+    Used[K] = true;
+    Destructors[K] = Destructor;
+    NextKey = K + 1 == SlotCount ? FirstKey : K + 1;
+    Key = K;
+    return true;
+  }
+  return false;
+}
+
+bool GuestTSD::deleteKey(uint32_t Key) {
+  lock_guard<mutex> Lock(Mutex);
+  if (Key < FirstKey || Key >= SlotCount || !Used[Key])
+    return false;
+  Used[Key] = false;
+  Destructors[Key] = 0;
+  return true;
+}
@@ -0,0 +1,51 @@
+// HotEntries.cpp: Implementation of class `HotEntries`.
+
+#include "ipasim/HotEntries.hpp"
+
+#include <algorithm>
+
+using namespace ipasim;
+using namespace std;
+
+void HotEntries::countSlow(uint64_t Addr) {
+  unique_lock<mutex> Lock(Mutex, try_to_lock);
+  if (Lock && Recording.load(memory_order_relaxed))
+    ++Counts[Addr];
+}
+
+vector<uint64_t> HotEntries::stopRecording() {
+  Recording.store(false, memory_order_relaxed);
+  vector<pair<uint64_t, uint64_t>> Sorted;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Sorted.assign(Counts.begin(), Counts.end());
+    Counts.clear();
+  }
+  size_t Count = min(Sorted.size(), MaxCount);
+  partial_sort(
+      Sorted.begin(), Sorted.begin() + Count, Sorted.end(),
+      [](const auto &A, const auto &B) { return A.second > B.second; });
+
+  vector<uint64_t> Addrs;
+  Addrs.reserve(Count);
+  for (size_t I = 0; I != Count; ++I)
+    Addrs.push_back(Sorted[I].first);
+  return Addrs;
+}
+
+void HotEntries::schedule(vector<uint64_t> Addrs) {
+  reverse(Addrs.begin(), Addrs.end());
+  lock_guard<mutex> Lock(Mutex);
+  Pending = move(Addrs);
+  PendingCount.store(Pending.size(), memory_order_relaxed);
+}
+
+bool HotEntries::pop(uint64_t &Addr) {
+  lock_guard<mutex> Lock(Mutex);
+  if (Pending.empty())
+    return false;
+  Addr = Pending.back();
+  Pending.pop_back();
+  PendingCount.store(Pending.size(), memory_order_relaxed);
+  return true;
+}
@@ -0,0 +1,105 @@
+// ImageSnapshot.cpp: Implementation of class `ImageSnapshot`.
+
+#include "ipasim/ImageSnapshot.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/Common.hpp"
+
+#include <Windows.h>
+#include <fstream>
+
+using namespace ipasim;
+using namespace std;
+
+ImageSnapshot::ImageSnapshot(const string &Path)
+    : Path(Path), Stamp(getFileStamp(Path)) {}
+
+bool ImageSnapshot::load() {
+  if (!Stamp)
+    return false;
+  for (const filesystem::path &Candidate :
+       getCacheFiles("snapshots", to_hex_string(Stamp))) {
+    ifstream I(Candidate, ios::binary);
+    if (I && parse(I)) {
+      File = Candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ImageSnapshot::parse(istream &I) {
+  uint32_t FileMagic, FileVersion, LibCount;
+  string FilePath;
+  if (!read(I, FileMagic) || FileMagic != Magic || !read(I, FileVersion) ||
+      FileVersion != Version || !read(I, FilePath) || FilePath != Path ||
+      !read(I, StartAddress) || !read(I, Size) || !read(I, KernelAddr) ||
+      !read(I, ClockAddr) || !read(I, DataOffset) || !read(I, LibCount))
+    return false;
+
+  // Libraries that have changed would have to be bound again, so such entry
+  // is useless.
+  Libs.resize(LibCount);
+  for (Lib &L : Libs) {
+    uint64_t LibStamp;
+    if (!read(I, L.Path) || !read(I, L.StartAddress) || !read(I, LibStamp) ||
+        getFileStamp(L.Path) != LibStamp)
+      return false;
+  }
+
+  // Check that the whole image is present.
+  I.seekg(0, ios::end);
+  return static_cast<uint64_t>(I.tellg()) >= DataOffset + Size;
+}
+
+bool ImageSnapshot::save() {
+  if (!Stamp)
+    return false;
+  error_code Error;
+  filesystem::path Dir(getCacheDir("snapshots"));
+  filesystem::create_directories(Dir, Error);
+  File = Dir / to_hex_string(Stamp);
+  // Other processes (e.g., instances started by `IpaSimHeadless --instances`)
+  // might be mapping the entry, so it's written aside and then moved over it.
+  filesystem::path Temp(File);
+  Temp += "." + to_string(GetCurrentProcessId());
+  ofstream O(Temp, ios::binary | ios::trunc);
+  if (!O)
+    return false;
+
+  write(O, Magic);
+  write(O, Version);
+  write(O, Path);
+  write(O, StartAddress);
+  write(O, Size);
+  write(O, KernelAddr);
+  write(O, ClockAddr);
+  // This is not known yet, so it's written after the libraries.
+  streamoff DataOffsetPos = O.tellp();
+  write(O, DataOffset);
+  write(O, static_cast<uint32_t>(Libs.size()));
+  for (const Lib &L : Libs) {
+    write(O, L.Path);
+    write(O, L.StartAddress);
+    write(O, getFileStamp(L.Path));
+  }
+
+  SYSTEM_INFO Info;
+  GetSystemInfo(&Info);
+  uint64_t Granularity = Info.dwAllocationGranularity;
+  uint64_t End = static_cast<uint64_t>(O.tellp());
+  DataOffset = (End + Granularity - 1) / Granularity * Granularity;
+  O.seekp(DataOffsetPos);
+  write(O, DataOffset);
+  O.seekp(End);
+  for (uint64_t I = End; I != DataOffset; ++I)
+    O.put(0);
+  O.write(reinterpret_cast<const char *>(StartAddress), Size);
+  O.close();
+  if (!O || !MoveFileExW(Temp.c_str(), File.c_str(),
+                         MOVEFILE_REPLACE_EXISTING)) {
+    filesystem::remove(Temp, Error);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,428 @@
+// IpaArchive.cpp: Implementation of class `IpaArchive`.
+
+#include "ipasim/IpaArchive.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/Logger.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+
+using namespace ipasim;
+using namespace std;
+
+mutex IpaArchive::Mutex;
+map<string, unique_ptr<IpaArchive>> IpaArchive::Archives;
+
+namespace {
+
+// ZIP signatures.
+constexpr uint32_t LocalHeaderSig = 0x04034B50;
+constexpr uint32_t CentralHeaderSig = 0x02014B50;
+constexpr uint32_t EndSig = 0x06054B50;
+// Fixed sizes of ZIP structures.
+constexpr uint64_t LocalHeaderSize = 30;
+constexpr uint64_t CentralHeaderSize = 46;
+constexpr uint64_t EndSize = 22;
+
+uint16_t read16(const uint8_t *P) { return P[0] | (P[1] << 8); }
+uint32_t read32(const uint8_t *P) {
+  return read16(P) | uint32_t(read16(P + 2)) << 16;
+}
+
+// Lowercase with forward slashes, so that lookups are case-insensitive like the
+// file system of the host.
+string normalize(string Path) {
+  transform(Path.begin(), Path.end(), Path.begin(), [](unsigned char C) {
+    return C == '\\' ? '/' : static_cast<char>(tolower(C));
+  });
+  return Path;
+}
+
+// Decompressor of raw Deflate streams (RFC 1951). The output size is known
+// from the central directory, so all output goes directly into one buffer and
+// back-references are resolved from it, without any sliding window.
+class Inflater {
+public:
+  Inflater(const uint8_t *In, uint64_t InSize, uint8_t *Out, uint64_t OutSize)
+      : In(In), InEnd(In + InSize), Out(Out), OutPos(0), OutSize(OutSize) {}
+
+  bool run() {
+    bool Final;
+    do {
+      Final = bits(1);
+      switch (bits(2)) {
+      case 0:
+        if (!stored())
+          return false;
+        break;
+      case 1:
+        fixedTables();
+        if (!codes())
+          return false;
+        break;
+      case 2:
+        if (!dynamicTables() || !codes())
+          return false;
+        break;
+      default:
+        return false;
+      }
+    } while (!Final && !Failed);
+    return !Failed && OutPos == OutSize;
+  }
+
+private:
+  static constexpr unsigned MaxBits = 15;
+
+  // Canonical Huffman code, decoded bit by bit using counts of codes of each
+  // length (like zlib's `puff`).
+  struct Huffman {
+    uint16_t Count[MaxBits + 1];
+    uint16_t Symbol[288];
+
+    bool build(const uint8_t *Lengths, unsigned N) {
+      memset(Count, 0, sizeof(Count));
+      for (unsigned I = 0; I != N; ++I)
+        ++Count[Lengths[I]];
+      if (Count[0] == N)
+        return true; // Nothing to decode, but that's valid.
+      int Left = 1;
+      for (unsigned Len = 1; Len <= MaxBits; ++Len) {
+        Left = (Left << 1) - Count[Len];
+        if (Left < 0)
+          return false; // Over-subscribed
+      }
+      uint16_t Offsets[MaxBits + 1];
+      Offsets[1] = 0;
+      for (unsigned Len = 1; Len != MaxBits; ++Len)
+        Offsets[Len + 1] = Offsets[Len] + Count[Len];
+      for (unsigned I = 0; I != N; ++I)
+        if (Lengths[I])
+          Symbol[Offsets[Lengths[I]]++] = I;
+      return true;
+    }
+  };
+
+  unsigned bits(unsigned N) {
+    while (BitCount < N) {
+      if (In == InEnd) {
+        Failed = true;
+        return 0;
+      }
+      BitBuf |= uint32_t(*In++) << BitCount;
+      BitCount += 8;
+    }
+    unsigned Value = BitBuf & ((1u << N) - 1);
+    BitBuf >>= N;
+    BitCount -= N;
+    return Value;
+  }
+
+  int decode(const Huffman &H) {
+    int Code = 0, First = 0, Index = 0;
+    for (unsigned Len = 1; Len <= MaxBits; ++Len) {
+      Code |= bits(1);
+      int Count = H.Count[Len];
+      if (Code - Count < First)
+        return H.Symbol[Index + (Code - First)];
+      Index += Count;
+      First = (First + Count) << 1;
+      Code <<= 1;
+      if (Failed)
+        return -1;
+    }
+    return -1;
+  }
+
+  bool stored() {
+    // Skip to a byte boundary. Whole bytes can't be left in the bit buffer,
+    // because it's filled only as needed.
+    BitBuf = 0;
+    BitCount = 0;
+    if (InEnd - In < 4)
+      return false;
+    unsigned Len = read16(In), NLen = read16(In + 2);
+    In += 4;
+    if (Len != (~NLen & 0xFFFF) || uint64_t(InEnd - In) < Len ||
+        OutSize - OutPos < Len)
+      return false;
+    memcpy(Out + OutPos, In, Len);
+    In += Len;
+    OutPos += Len;
+    return true;
+  }
+
+  void fixedTables() {
+    uint8_t Lengths[288 + 30];
+    memset(Lengths, 8, 144);
+    memset(Lengths + 144, 9, 112);
+    memset(Lengths + 256, 7, 24);
+    memset(Lengths + 280, 8, 8);
+    memset(Lengths + 288, 5, 30);
+    LitLen.build(Lengths, 288);
+    Dist.build(Lengths + 288, 30);
+  }
+
+  bool dynamicTables() {
+    static constexpr uint8_t Order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                          11, 4,  12, 3, 13, 2, 14, 1, 15};
+    unsigned NLen = bits(5) + 257, NDist = bits(5) + 1, NCode = bits(4) + 4;
+    if (NLen > 286 || NDist > 30)
+      return false;
+    uint8_t Lengths[286 + 30] = {};
+    for (unsigned I = 0; I != NCode; ++I)
+      Lengths[Order[I]] = bits(3);
+    Huffman Code;
+    if (!Code.build(Lengths, 19))
+      return false;
+
+    memset(Lengths, 0, 19);
+    for (unsigned I = 0; I != NLen + NDist;) {
+      int Symbol = decode(Code);
+      if (Symbol < 0)
+        return false;
+      if (Symbol < 16) {
+        Lengths[I++] = Symbol;
+        continue;
+      }
+      uint8_t Len = 0;
+      unsigned Repeat;
+      if (Symbol == 16) {
+        if (!I)
+          return false;
+        Len = Lengths[I - 1];
+        Repeat = 3 + bits(2);
+      } else if (Symbol == 17)
+        Repeat = 3 + bits(3);
+      else
+        Repeat = 11 + bits(7);
+      if (I + Repeat > NLen + NDist)
+        return false;
+      while (Repeat--)
+        Lengths[I++] = Len;
+    }
+    // There must be an end-of-block code.
+    if (!Lengths[256])
+      return false;
+    return !Failed && LitLen.build(Lengths, NLen) &&
+           Dist.build(Lengths + NLen, NDist);
+  }
+
+  bool codes() {
+    static constexpr uint16_t LenBase[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr uint8_t LenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr uint16_t DistBase[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static constexpr uint8_t DistExtra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                              3, 3, 4,  4,  5,  5,  6,  6,
+                                              7, 7, 8,  8,  9,  9,  10, 10,
+                                              11, 11, 12, 12, 13, 13};
+    for (;;) {
+      int Symbol = decode(LitLen);
+      if (Symbol < 0)
+        return false;
+      if (Symbol < 256) {
+        if (OutPos == OutSize)
+          return false;
+        Out[OutPos++] = Symbol;
+        continue;
+      }
+      if (Symbol == 256)
+        return true;
+
+      Symbol -= 257;
+      if (Symbol >= 29)
+        return false;
+      uint64_t Len = LenBase[Symbol] + bits(LenExtra[Symbol]);
+      int DistSymbol = decode(Dist);
+      if (DistSymbol < 0 || DistSymbol >= 30)
+        return false;
+      uint64_t Distance = DistBase[DistSymbol] + bits(DistExtra[DistSymbol]);
+      if (Failed || Distance > OutPos || OutSize - OutPos < Len)
+        return false;
+      // Byte by byte, since the ranges can overlap.
+      uint8_t *Dest = Out + OutPos;
+      const uint8_t *Src = Dest - Distance;
+      for (uint64_t I = 0; I != Len; ++I)
+        Dest[I] = Src[I];
+      OutPos += Len;
+    }
+  }
+
+  const uint8_t *In, *InEnd;
+  uint8_t *Out;
+  uint64_t OutPos, OutSize;
+  uint32_t BitBuf = 0;
+  unsigned BitCount = 0;
+  bool Failed = false;
+  Huffman LitLen, Dist;
+};
+
+} // namespace
+
+IpaArchive::~IpaArchive() {
+  if (Data)
+    UnmapViewOfFile(Data);
+  if (Section)
+    CloseHandle(Section);
+  if (File)
+    CloseHandle(File);
+}
+
+IpaArchive *IpaArchive::get(const string &Path) {
+  lock_guard<mutex> Lock(Mutex);
+  auto [It, New] = Archives.try_emplace(normalize(Path));
+  if (New) {
+    auto Archive = make_unique<IpaArchive>();
+    if (Archive->open(Path))
+      It->second = move(Archive);
+    else
+      Log.error() << "cannot open archive " << Path << Log.end();
+  }
+  return It->second.get();
+}
+
+bool IpaArchive::split(const string &Path, string &Archive, string &Member) {
+  size_t Sep = Path.find(Separator);
+  if (Sep == string::npos)
+    return false;
+  Archive = Path.substr(0, Sep);
+  Member = Path.substr(Sep + 1);
+  return true;
+}
+
+bool IpaArchive::isArchivePath(const string &Path) {
+  return Path.size() >= 4 && normalize(Path.substr(Path.size() - 4)) == ".ipa";
+}
+
+const IpaArchive::Entry *IpaArchive::lookup(const string &Path,
+                                            IpaArchive *&Archive) {
+  string ArchivePath, Member;
+  if (!split(Path, ArchivePath, Member))
+    return nullptr;
+  Archive = get(ArchivePath);
+  return Archive ? Archive->find(Member) : nullptr;
+}
+
+bool IpaArchive::open(const string &Path) {
+  HANDLE H = CreateFile2(filesystem::path(Path).c_str(), GENERIC_READ,
+                         FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (H == INVALID_HANDLE_VALUE)
+    return false;
+  File = H;
+
+  LARGE_INTEGER FileSize;
+  if (!GetFileSizeEx(File, &FileSize) || FileSize.QuadPart < EndSize)
+    return false;
+  Size = FileSize.QuadPart;
+  Section = CreateFileMappingFromApp(File, nullptr, PAGE_READONLY, 0, nullptr);
+  if (!Section)
+    return false;
+  Data = static_cast<const uint8_t *>(
+      MapViewOfFileFromApp(Section, FILE_MAP_READ, 0, 0));
+  if (!Data)
+    return false;
+
+  // Find the end of central directory record. It's followed only by a comment
+  // of at most 64 KiB.
+  const uint8_t *End = nullptr;
+  for (uint64_t Off = Size - EndSize, Min = Off > 0xFFFF ? Off - 0xFFFF : 0;;
+       --Off) {
+    if (read32(Data + Off) == EndSig) {
+      End = Data + Off;
+      break;
+    }
+    if (Off == Min)
+      return false;
+  }
+  uint16_t Count = read16(End + 10);
+  // The directory precedes the end record.
+  uint64_t DirOffset = read32(End + 16);
+  if (DirOffset > uint64_t(End - Data))
+    return false;
+
+  // Index the central directory.
+  Entries.reserve(Count);
+  const uint8_t *P = Data + DirOffset, *DirEnd = End;
+  for (uint16_t I = 0; I != Count; ++I) {
+    if (uint64_t(DirEnd - P) < CentralHeaderSize ||
+        read32(P) != CentralHeaderSig)
+      return false;
+    uint16_t Flags = read16(P + 8);
+    uint16_t NameLen = read16(P + 28), ExtraLen = read16(P + 30),
+             CommentLen = read16(P + 32);
+    uint64_t RecordSize = CentralHeaderSize + NameLen + ExtraLen + CommentLen;
+    if (uint64_t(DirEnd - P) < RecordSize)
+      return false;
+    string Name(reinterpret_cast<const char *>(P + CentralHeaderSize),
+                NameLen);
+    Entry E{read32(P + 42), read32(P + 20), read32(P + 24), read16(P + 10)};
+    P += RecordSize;
+    // Stored data is used in place (see `getData`), so all `Size` bytes of it
+    // must be inside the archive.
+    if (E.Method == Stored && E.Size != E.CompressedSize)
+      return false;
+
+    // Skip directories and entries we cannot read.
+    if (Name.empty() || Name.back() == '/' || (Flags & 1) ||
+        (E.Method != Stored && E.Method != Deflated))
+      continue;
+
+    // The main executable is `Payload/X.app/X`.
+    if (Executable.empty() && !Name.compare(0, 8, "Payload/")) {
+      size_t Slash = Name.find('/', 8);
+      if (Slash != string::npos && Slash > 12 &&
+          !Name.compare(Slash - 4, 4, ".app") &&
+          !Name.compare(Slash + 1, string::npos, Name, 8, Slash - 12))
+        Executable = Name;
+    }
+    Entries.emplace(normalize(move(Name)), E);
+  }
+  return true;
+}
+
+const IpaArchive::Entry *IpaArchive::find(const string &Member) const {
+  auto It = Entries.find(normalize(Member));
+  return It != Entries.end() ? &It->second : nullptr;
+}
+
+uint64_t IpaArchive::getDataOffset(const Entry &E) const {
+  // The local header has its own (possibly different) extra field.
+  if (E.HeaderOffset + LocalHeaderSize > Size ||
+      read32(Data + E.HeaderOffset) != LocalHeaderSig)
+    return 0;
+  const uint8_t *H = Data + E.HeaderOffset;
+  uint64_t Offset =
+      E.HeaderOffset + LocalHeaderSize + read16(H + 26) + read16(H + 28);
+  if (Offset + E.CompressedSize > Size)
+    return 0;
+  return Offset;
+}
+
+const uint8_t *IpaArchive::getData(const Entry &E) const {
+  if (E.Method != Stored)
+    return nullptr;
+  uint64_t Offset = getDataOffset(E);
+  return Offset ? Data + Offset : nullptr;
+}
+
+bool IpaArchive::extract(const Entry &E, uint8_t *Out) const {
+  uint64_t Offset = getDataOffset(E);
+  if (!Offset)
+    return false;
+  if (E.Method == Stored) {
+    memcpy(Out, Data + Offset, E.Size);
+    return true;
+  }
+  return Inflater(Data + Offset, E.CompressedSize, Out, E.Size).run();
+}
@@ -66,8 +66,39 @@ static IAsyncOperation<StorageFolder> copyFolder(StorageFolder Source,
   co_return Dest;
 }
 
+// Returns the page showing progress of the startup. Must be called on the UI
+// thread of the emulation's window.
+static IpaSimApp::MainPage getMainPage() {
+  if (auto F = Window::Current().Content().try_as<Frame>())
+    return F.Content().try_as<IpaSimApp::MainPage>();
+  return nullptr;
+}
+
+static hstring describeStage(ipasim::StartupStage Stage, const string &Detail) {
+  switch (Stage) {
+  case ipasim::StartupStage::Loading: {
+    string Name(Detail.substr(Detail.find_last_of("/\\") + 1));
+    return to_hstring("Loading " + Name + "...");
+  }
+  case ipasim::StartupStage::Initializing:
+    return L"Initializing...";
+  case ipasim::StartupStage::Launching:
+    return L"Launching...";
+  case ipasim::StartupStage::Done:
+    return L"Done.";
+  default:
+    return L"Failed.";
+  }
+}
+
 // TODO: Move these into `IpaSimLibrary` when possible.
 static IAsyncAction startCore(LaunchActivatedEventArgs LaunchArgs) {
+  // Steps touching XAML or running the emulated app must happen on this
+  // thread. Everything else may run on background threads, so that the window
+  // stays responsive.
+  apartment_context UIThread;
+  CoreDispatcher Dispatcher(Window::Current().Dispatcher());
+
   // Ask user for folder containing the binary.
   FolderPicker FP;
   FP.FileTypeFilter().Append(L"*");
@@ -96,21 +127,52 @@ static IAsyncAction startCore(LaunchActivatedEventArgs LaunchArgs) {
   // Display binary's name in the title.
   ApplicationView::GetForCurrentView().Title(to_hstring(BinaryName));
 
-  // Copy the folder into app's data.
+  // Copy the folder into app's data. Meanwhile, images used by the previous
+  // launch are read ahead (the binary will have the same path as then).
   // TODO: Without this, files inside the folder cannot be opened by standard
   // C++ means (e.g., `fstream`). But maybe we could workaround that.
   // TODO: Delete old files first.
-  Folder = co_await copyFolder(Folder,
-                               ApplicationData::Current().LocalCacheFolder());
+  StorageFolder Cache(ApplicationData::Current().LocalCacheFolder());
+  ipasim::prefetch(Cache.Path() + L"\\" + Folder.Name() + L"\\" + Bin.Name());
+  if (auto Page = getMainPage())
+    Page.Status(L"Copying the app...");
+  Folder = co_await copyFolder(Folder, Cache);
   Bin = co_await Folder.GetFileAsync(Bin.Name());
+  hstring BinPath(Bin.Path());
 
-  // Execute the main logic inside `IpaSimLibrary`.
-  ipasim::start(Bin.Path(), LaunchArgs);
+  // Load the binary and its dependencies on a background thread. Progress is
+  // marshaled to the UI thread (or shown directly if it's reported there). The
+  // app itself runs on the emulation thread, so the final stage is reported
+  // from there, too.
+  auto ShowStatus = [Dispatcher](ipasim::StartupStage Stage, hstring Status) {
+    auto Show = [Stage, Status]() {
+      if (auto Page = getMainPage()) {
+        if (Stage == ipasim::StartupStage::Done)
+          Page.Loaded(true); // Changes status to "Done.".
+        else
+          Page.Status(Status);
+      }
+    };
+    if (Dispatcher.HasThreadAccess())
+      Show();
+    else
+      Dispatcher.RunAsync(CoreDispatcherPriority::Normal, Show);
+  };
+  co_await resume_background();
+  bool Loaded = ipasim::load(
+      BinPath, [ShowStatus](ipasim::StartupStage Stage, const string &Detail) {
+        ShowStatus(Stage, describeStage(Stage, Detail));
+      });
+  co_await UIThread;
+  if (!Loaded) {
+    if (auto Page = getMainPage())
+      Page.Fail(L"Cannot load the app, see the log for details.");
+    co_return;
+  }
 
-  // Change status from "Loading..." to "Done.".
-  if (auto F = Window::Current().Content().try_as<Frame>())
-    if (auto Page = F.Content().try_as<IpaSimApp::MainPage>())
-      Page.Loaded(true);
+  // Execute the main logic inside `IpaSimLibrary`. It usually returns before
+  // the app is launched, see `StartupStage::Done` above.
+  ipasim::run(LaunchArgs);
 }
 static IAsyncAction start(LaunchActivatedEventArgs LaunchArgs) {
   if constexpr (ShowLogWindow) {
@@ -218,7 +280,7 @@ void App::OnLaunched(LaunchActivatedEventArgs const &e) {
 /// <param name="e">Details about the suspend request.</param>
 void App::OnSuspending([[maybe_unused]] IInspectable const &sender,
                        [[maybe_unused]] SuspendingEventArgs const &e) {
-  // Save application state and stop any background activity
+  ipasim::suspend();
 }
 
 /// <summary>
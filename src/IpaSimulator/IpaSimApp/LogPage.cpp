@@ -4,17 +4,81 @@
 #if __has_include("LogPage.g.cpp")
 #include "LogPage.g.cpp"
 #endif
+#include "StatsOverlay.h"
 
 #include "ipasim/IpaSimulator.hpp"
 
+#include <winrt/Windows.System.h>
+#include <winrt/Windows.UI.Xaml.Input.h>
+#include <winrt/Windows.UI.Xaml.Media.h>
+
 using namespace winrt;
+using namespace Windows::Foundation;
+using namespace Windows::Storage;
+using namespace Windows::Storage::Pickers;
+using namespace Windows::System;
+using namespace Windows::UI;
 using namespace Windows::UI::Xaml;
+using namespace Windows::UI::Xaml::Controls;
+using namespace Windows::UI::Xaml::Input;
+using namespace Windows::UI::Xaml::Media;
 
 namespace winrt::IpaSimApp::implementation {
 
 LogPage::LogPage() {
   InitializeComponent();
-  ipasim::logText().init(logText());
+  ipasim::logText().init(logList());
+}
+
+void LogPage::SearchKeyDown(const IInspectable &,
+                            const KeyRoutedEventArgs &Args) {
+  if (Args.Key() != VirtualKey::Enter)
+    return;
+  Args.Handled(true);
+
+  // Continue after the previous match.
+  int32_t Selected = logList().SelectedIndex();
+  auto From = static_cast<uint32_t>(Selected + 1);
+  std::wstring Query(searchText().Text());
+  if (auto Index = ipasim::logText().find(Query, From)) {
+    logList().SelectedIndex(*Index);
+    logList().ScrollIntoView(logList().SelectedItem());
+  }
+}
+
+fire_and_forget LogPage::ExportClick(const IInspectable &,
+                                     const RoutedEventArgs &) {
+  auto Strong(get_strong());
+  FileSavePicker Picker;
+  Picker.SuggestedFileName(L"log");
+  Picker.FileTypeChoices().Insert(
+      L"Text", single_threaded_vector<hstring>({L".txt"}));
+  StorageFile File(co_await Picker.PickSaveFileAsync());
+  if (!File)
+    co_return;
+  co_await FileIO::WriteTextAsync(File, ipasim::logText().getText());
+}
+
+void LogPage::StatsChecked(const IInspectable &, const RoutedEventArgs &) {
+  statsOverlay().Visibility(Xaml::Visibility::Visible);
+  statsOverlay().Start();
+}
+
+void LogPage::StatsUnchecked(const IInspectable &, const RoutedEventArgs &) {
+  statsOverlay().Stop();
+  statsOverlay().Visibility(Xaml::Visibility::Collapsed);
+}
+
+// Containers are recycled, so colors must be set for each item they show.
+void LogPage::LogContainerChanging(
+    const ListViewBase &, const ContainerContentChangingEventArgs &Args) {
+  if (Args.InRecycleQueue())
+    return;
+  auto Text(Args.ItemContainer().ContentTemplateRoot().as<TextBlock>());
+  if (ipasim::logText().isError(static_cast<uint32_t>(Args.ItemIndex())))
+    Text.Foreground(SolidColorBrush(Colors::Red()));
+  else
+    Text.ClearValue(TextBlock::ForegroundProperty());
 }
 
 } // namespace winrt::IpaSimApp::implementation
@@ -6,6 +6,19 @@ namespace winrt::IpaSimApp::implementation {
 
 struct LogPage : LogPageT<LogPage> {
   LogPage();
+
+  void SearchKeyDown(const Windows::Foundation::IInspectable &Sender,
+                     const Windows::UI::Xaml::Input::KeyRoutedEventArgs &Args);
+  fire_and_forget ExportClick(const Windows::Foundation::IInspectable &Sender,
+                              const Windows::UI::Xaml::RoutedEventArgs &Args);
+  void StatsChecked(const Windows::Foundation::IInspectable &Sender,
+                    const Windows::UI::Xaml::RoutedEventArgs &Args);
+  void StatsUnchecked(const Windows::Foundation::IInspectable &Sender,
+                      const Windows::UI::Xaml::RoutedEventArgs &Args);
+  void LogContainerChanging(
+      const Windows::UI::Xaml::Controls::ListViewBase &Sender,
+      const Windows::UI::Xaml::Controls::ContainerContentChangingEventArgs
+          &Args);
 };
 
 } // namespace winrt::IpaSimApp::implementation
@@ -13,10 +13,24 @@ bool MainPage::Loaded() { return loaded_; }
 
 void MainPage::Loaded(bool value) {
   loaded_ = value;
+  progressRing().IsActive(!value);
   if (value)
     statusText().Text(L"Done.");
   else
     statusText().Text(L"Loading...");
 }
 
+hstring MainPage::Status() { return statusText().Text(); }
+
+void MainPage::Status(const hstring &value) {
+  if (!loaded_)
+    statusText().Text(value);
+}
+
+void MainPage::Fail(const hstring &Message) {
+  loaded_ = true;
+  progressRing().IsActive(false);
+  statusText().Text(Message);
+}
+
 } // namespace winrt::IpaSimApp::implementation
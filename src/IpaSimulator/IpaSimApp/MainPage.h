@@ -13,6 +13,11 @@ struct MainPage : MainPageT<MainPage> {
 
   bool Loaded();
   void Loaded(bool value);
+  // Describes the current startup stage. Ignored once the app is loaded, since
+  // updates from the loading thread can arrive late.
+  hstring Status();
+  void Status(const hstring &value);
+  void Fail(const hstring &Message);
 
 private:
   bool loaded_;
@@ -0,0 +1,133 @@
+#include "pch.h"
+
+#include "StatsOverlay.h"
+#if __has_include("StatsOverlay.g.cpp")
+#include "StatsOverlay.g.cpp"
+#endif
+
+#include "ipasim/IpaSimulator.hpp"
+
+#include <winrt/Windows.ApplicationModel.DataTransfer.h>
+
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+using namespace std::chrono;
+using namespace winrt;
+using namespace Windows::ApplicationModel::DataTransfer;
+using namespace Windows::Data::Json;
+using namespace Windows::Foundation;
+using namespace Windows::UI::Xaml;
+
+namespace {
+
+constexpr size_t HotCount = 5;
+
+// Categories of `ipaSim_writeMemoryReport`.
+constexpr pair<const wchar_t *, const wchar_t *> MemoryNames[] = {
+    {L"mem_dylib_private", L"dylibs"},
+    {L"mem_dylib_shared", L"dylibs (shared)"},
+    {L"mem_dll_private", L"DLLs"},
+    {L"mem_dll_shared", L"DLLs (shared)"},
+    {L"mem_lief_models", L"LIEF models"},
+    {L"mem_stacks", L"stacks"},
+    {L"mem_heap", L"heap"},
+    {L"mem_trampolines", L"trampolines"},
+    {L"mem_jit", L"JIT"},
+    {L"mem_log", L"log"}};
+
+} // namespace
+
+namespace winrt::IpaSimApp::implementation {
+
+StatsOverlay::StatsOverlay() {
+  InitializeComponent();
+  Timer.Interval(seconds(1));
+  Timer.Tick([this](const IInspectable &, const IInspectable &) { update(); });
+}
+
+void StatsOverlay::Start() {
+  // The first sample only sets the baseline.
+  Last = nullptr;
+  ipasim::trackFrames(true);
+  update();
+  Timer.Start();
+}
+
+void StatsOverlay::Stop() {
+  Timer.Stop();
+  ipasim::trackFrames(false);
+}
+
+void StatsOverlay::update() {
+  JsonObject Now(JsonObject::Parse(to_hstring(ipasim::getStats())));
+  auto Time = steady_clock::now();
+  auto Hot(ipasim::getHotWrappers(HotCount));
+  JsonObject Prev(Last);
+  double Seconds = duration<double>(Time - LastTime).count();
+  Last = Now;
+  LastTime = Time;
+  if (!Prev || Seconds <= 0)
+    return;
+
+  auto Delta = [&](const wchar_t *Name) {
+    return Now.GetNamedNumber(Name, 0) - Prev.GetNamedNumber(Name, 0);
+  };
+  auto Rate = [&](const wchar_t *Name) { return Delta(Name) / Seconds; };
+  auto MB = [&](const wchar_t *Name) {
+    return Now.GetNamedNumber(Name, 0) / (1024 * 1024);
+  };
+
+  wostringstream O;
+  O << fixed << setprecision(1);
+  // Instructions are counted in whole `InstructionBudget`s.
+  O << L"Emulation  " << Rate(L"guest_instructions") / 1e6 << L" MIPS\n";
+  O << L"Crossings  wrappers " << Rate(L"wrapper_calls") << L"/s, dylibs "
+    << Rate(L"dylib_calls") << L"/s, dynamic " << Rate(L"dynamic_calls")
+    << L"/s (direct " << Rate(L"direct_calls") << L"/s), translated "
+    << Rate(L"translated_calls") << L"/s, UI " << Rate(L"ui_calls")
+    << L"/s\n";
+  O << L"Callbacks  " << Rate(L"callbacks") << L"/s\n";
+  O << L"Faults     unmapped " << Rate(L"unmapped_faults")
+    << L"/s, on-demand mappings " << Rate(L"fault_mappings") << L"/s\n";
+  // A turn is an event handler, timer or other task of the main run loop.
+  double Turns = Delta(L"main_loop_turns");
+  O << L"Main loop  ";
+  if (Turns)
+    O << Delta(L"main_loop_ns") / Turns / 1e6 << L" ms/turn, "
+      << Turns / Seconds << L" turns/s\n";
+  else
+    O << L"idle\n";
+  // Frame times are intervals between frames rendered by XAML while the
+  // overlay is shown.
+  auto Ms = [&](const wchar_t *Name) {
+    return Now.GetNamedNumber(Name, 0) / 1000;
+  };
+  O << L"Frames     launch " << Ms(L"launch_us") << L" ms, first "
+    << Ms(L"first_frame_us") << L" ms, p50 " << Ms(L"frame_p50_us")
+    << L" ms, p95 " << Ms(L"frame_p95_us") << L" ms, p99 "
+    << Ms(L"frame_p99_us") << L" ms, "
+    << Now.GetNamedNumber(L"frame_hitches", 0) << L" hitches\n";
+  // Allocations are only seen with `IPASIM_ALLOCATION_SAMPLE_INTERVAL`.
+  O << L"Heap       " << Rate(L"heap_allocations") << L" allocs/s, "
+    << Rate(L"heap_bytes") / (1024 * 1024) << L" MB/s, "
+    << MB(L"heap_live_bytes") << L" MB live\n";
+  O << L"Memory     " << MB(L"mem_private_total") << L" MB private\n";
+  for (const auto &[Name, Label] : MemoryNames)
+    O << L"  " << setw(16) << left << Label << right << MB(Name) << L" MB\n";
+  O << L"Hottest wrappers";
+  if (Hot.empty())
+    O << L" (none, needs `IPASIM_COUNT_CROSSINGS`)";
+  for (const auto &[Name, Count] : Hot)
+    O << L"\n  " << setw(8) << Count << L"  " << to_hstring(Name).c_str();
+  statsText().Text(O.str());
+}
+
+void StatsOverlay::CopyClick(const IInspectable &, const RoutedEventArgs &) {
+  DataPackage Package;
+  Package.SetText(statsText().Text());
+  Clipboard::SetContent(Package);
+}
+
+} // namespace winrt::IpaSimApp::implementation
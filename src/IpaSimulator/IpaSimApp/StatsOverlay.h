@@ -0,0 +1,37 @@
+#pragma once
+
+#include "StatsOverlay.g.h"
+
+#include <winrt/Windows.Data.Json.h>
+
+#include <chrono>
+
+namespace winrt::IpaSimApp::implementation {
+
+// Shows rates of `IpaSimLibrary`'s runtime statistics over the last second,
+// so that testers can see why a screen is slow and copy the numbers into bug
+// reports.
+struct StatsOverlay : StatsOverlayT<StatsOverlay> {
+  StatsOverlay();
+
+  void Start();
+  void Stop();
+  void CopyClick(const Windows::Foundation::IInspectable &Sender,
+                 const Windows::UI::Xaml::RoutedEventArgs &Args);
+
+private:
+  void update();
+
+  Windows::UI::Xaml::DispatcherTimer Timer;
+  Windows::Data::Json::JsonObject Last{nullptr};
+  std::chrono::steady_clock::time_point LastTime;
+};
+
+} // namespace winrt::IpaSimApp::implementation
+
+namespace winrt::IpaSimApp::factory_implementation {
+
+struct StatsOverlay
+    : StatsOverlayT<StatsOverlay, implementation::StatsOverlay> {};
+
+} // namespace winrt::IpaSimApp::factory_implementation
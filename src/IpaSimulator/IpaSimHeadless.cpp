@@ -0,0 +1,266 @@
+// IpaSimHeadless.cpp: Command-line host of `IpaSimLibrary` without UI. It runs
+// an app binary and exits when one of the given conditions is met, so that the
+// emulator can be run from scripts (e.g., to benchmark it).
+
+#include <Windows.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Implemented by `IpaSimLibrary` (see `IpaSimulator.cpp`).
+extern "C" void ipaSim_run(const char *Path);
+extern "C" bool ipaSim_setLogFile(const char *Path);
+extern "C" void ipaSim_flushLog();
+extern "C" void ipaSim_onReached(const char *Symbol, void (*Callback)());
+extern "C" uint32_t ipaSim_progress();
+extern "C" bool ipaSim_writeProfile(const char *Path);
+extern "C" bool ipaSim_writeCrossings(const char *Path);
+extern "C" bool ipaSim_writeAllocations(const char *Path);
+extern "C" bool ipaSim_writeCoverage(const char *Path);
+extern "C" bool ipaSim_saveTrace();
+extern "C" bool ipaSim_recordCrossings(const char *Path);
+extern "C" bool ipaSim_replayCrossings(const char *Path);
+extern "C" bool ipaSim_finishRecording();
+extern "C" size_t ipaSim_getStats(char *Buffer, size_t Size);
+extern "C" bool ipaSim_writeMemoryReport(const char *Path);
+extern "C" bool ipaSim_setTrace(const char *Spec);
+extern "C" void ipaSim_traceWindow(const char *Symbol,
+                                   uint64_t MaxInstructions);
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+bool WriteProfiles = false, PrintStats = false;
+const char *Coverage = nullptr, *MemoryReport = nullptr;
+atomic<bool> Finished = false;
+
+// Can be called from any thread, including from inside emulator hooks.
+void finish(const char *Reason, int Code) {
+  if (Finished.exchange(true))
+    return;
+  fprintf(stderr, "IpaSimHeadless: %s\n", Reason);
+  ipaSim_finishRecording();
+  if (WriteProfiles) {
+    ipaSim_writeProfile(nullptr);
+    ipaSim_writeCrossings(nullptr);
+    ipaSim_writeAllocations(nullptr);
+    ipaSim_saveTrace();
+  }
+  if (Coverage)
+    ipaSim_writeCoverage(Coverage);
+  if (MemoryReport && !ipaSim_writeMemoryReport(MemoryReport))
+    fprintf(stderr, "IpaSimHeadless: cannot write memory report %s\n",
+            MemoryReport);
+  if (PrintStats) {
+    vector<char> Stats(ipaSim_getStats(nullptr, 0) + 1);
+    ipaSim_getStats(Stats.data(), Stats.size());
+    fprintf(stderr, "%s\n", Stats.data());
+  }
+  ipaSim_flushLog();
+  fflush(stdout);
+  // Other threads might still be emulating, so we don't run destructors.
+  _Exit(Code);
+}
+
+void usage(const char *Name) {
+  fprintf(stderr,
+          "usage: %s [options] path-to-binary-or-ipa\n"
+          "  --log <file>      write log into <file> (default: stdout)\n"
+          "  --time <seconds>  exit after <seconds>\n"
+          "  --until <symbol>  exit when [library!]<symbol> is reached\n"
+          "  --idle <seconds>  exit when the guest doesn't call native code\n"
+          "                    for <seconds>\n"
+          "  --trace <list>    enable trace categories (e.g. loader,objc)\n"
+          "  --window <symbol> <count>\n"
+          "                    record binary trace of <symbol> until it\n"
+          "                    returns or for <count> instructions (if not 0)\n"
+          "  --profile         write guest and allocation profiles, crossing\n"
+          "                    statistics and list of images for binary trace\n"
+          "                    on exit\n"
+          "  --stats           print runtime statistics as JSON on exit\n"
+          "  --coverage <file> add called native functions to <file>\n"
+          "  --memory <file>   write memory footprint by owner into <file>\n"
+          "  --record <file>   record crossings of the main thread\n"
+          "  --replay <file>   replay recorded results of native calls\n"
+          "  --instances <n>   run <n> instances of the app in parallel (each\n"
+          "                    in its own process, writing <file>.<i>)\n"
+          "Exits with 1 if the time runs out before <symbol> is reached.\n",
+          Name);
+}
+
+// Appends `Arg` to command line `Cmd`, quoted as the C runtime expects.
+void appendArg(string &Cmd, const string &Arg) {
+  if (!Cmd.empty())
+    Cmd += ' ';
+  Cmd += '"';
+  size_t Backslashes = 0;
+  for (char C : Arg) {
+    if (C == '\\') {
+      ++Backslashes;
+      Cmd += C;
+      continue;
+    }
+    // Backslashes followed by a quote must be escaped, too.
+    if (C == '"')
+      Cmd.append(Backslashes + 1, '\\');
+    Backslashes = 0;
+    Cmd += C;
+  }
+  Cmd.append(Backslashes, '\\');
+  Cmd += '"';
+}
+
+// Runs `Count` copies of this process with the same arguments (except
+// `--instances`) and returns the worst exit code. Every instance is a separate
+// process, because `IpaSimLibrary` and the Objective-C runtime keep global
+// state. They still share memory of read-only images: DLLs are shared by the
+// system and Dylibs are mapped from the same files (see `ImageMapping` and
+// `ImageSnapshot`).
+int runInstances(int ArgC, char **ArgV, unsigned Count) {
+  vector<HANDLE> Processes;
+  for (unsigned Instance = 0; Instance != Count; ++Instance) {
+    string Cmd;
+    for (int I = 0; I != ArgC; ++I) {
+      if (!strcmp(ArgV[I], "--instances")) {
+        ++I;
+        continue;
+      }
+      // Instances must not write into the same log or report file.
+      if ((!strcmp(ArgV[I], "--log") || !strcmp(ArgV[I], "--memory")) &&
+          I + 1 != ArgC) {
+        appendArg(Cmd, ArgV[I]);
+        appendArg(Cmd, string(ArgV[++I]) + '.' + to_string(Instance));
+        continue;
+      }
+      appendArg(Cmd, ArgV[I]);
+    }
+
+    STARTUPINFOA SI = {sizeof(SI)};
+    PROCESS_INFORMATION PI;
+    if (!CreateProcessA(nullptr, Cmd.data(), nullptr, nullptr,
+                        /* bInheritHandles */ TRUE, 0, nullptr, nullptr, &SI,
+                        &PI)) {
+      fprintf(stderr, "IpaSimHeadless: cannot start instance %u\n", Instance);
+      continue;
+    }
+    CloseHandle(PI.hThread);
+    Processes.push_back(PI.hProcess);
+  }
+  if (Processes.size() != Count)
+    return 2;
+
+  int Result = 0;
+  for (HANDLE P : Processes) {
+    WaitForSingleObject(P, INFINITE);
+    DWORD Code;
+    if (!GetExitCodeProcess(P, &Code))
+      Code = 2;
+    if (static_cast<int>(Code) > Result)
+      Result = Code;
+    CloseHandle(P);
+  }
+  return Result;
+}
+
+} // namespace
+
+int main(int ArgC, char **ArgV) {
+  // Parse arguments.
+  const char *Log = nullptr, *Until = nullptr, *Binary = nullptr;
+  const char *Record = nullptr, *Replay = nullptr;
+  double TimeLimit = 0, IdleLimit = 0;
+  unsigned Instances = 0;
+  for (int I = 1; I != ArgC; ++I) {
+    const char *Arg = ArgV[I];
+    bool HasValue = I + 1 != ArgC;
+    if (!strcmp(Arg, "--log") && HasValue)
+      Log = ArgV[++I];
+    else if (!strcmp(Arg, "--time") && HasValue)
+      TimeLimit = strtod(ArgV[++I], nullptr);
+    else if (!strcmp(Arg, "--until") && HasValue)
+      Until = ArgV[++I];
+    else if (!strcmp(Arg, "--idle") && HasValue)
+      IdleLimit = strtod(ArgV[++I], nullptr);
+    else if (!strcmp(Arg, "--trace") && HasValue) {
+      if (!ipaSim_setTrace(ArgV[++I]))
+        fprintf(stderr, "IpaSimHeadless: unknown trace category in %s\n",
+                ArgV[I]);
+    } else if (!strcmp(Arg, "--window") && I + 2 < ArgC) {
+      ipaSim_traceWindow(ArgV[I + 1], strtoull(ArgV[I + 2], nullptr, 10));
+      I += 2;
+    } else if (!strcmp(Arg, "--profile"))
+      WriteProfiles = true;
+    else if (!strcmp(Arg, "--stats"))
+      PrintStats = true;
+    else if (!strcmp(Arg, "--coverage") && HasValue)
+      Coverage = ArgV[++I];
+    else if (!strcmp(Arg, "--memory") && HasValue)
+      MemoryReport = ArgV[++I];
+    else if (!strcmp(Arg, "--record") && HasValue)
+      Record = ArgV[++I];
+    else if (!strcmp(Arg, "--replay") && HasValue)
+      Replay = ArgV[++I];
+    else if (!strcmp(Arg, "--instances") && HasValue)
+      Instances = strtoul(ArgV[++I], nullptr, 10);
+    else if (Arg[0] != '-' && !Binary)
+      Binary = Arg;
+    else {
+      usage(ArgV[0]);
+      return 2;
+    }
+  }
+  if (!Binary) {
+    usage(ArgV[0]);
+    return 2;
+  }
+  if (Instances > 1)
+    return runInstances(ArgC, ArgV, Instances);
+
+  if (!ipaSim_setLogFile(Log)) {
+    fprintf(stderr, "IpaSimHeadless: cannot open log file %s\n", Log);
+    return 2;
+  }
+  if (Record)
+    ipaSim_recordCrossings(Record);
+  if (Replay && !ipaSim_replayCrossings(Replay))
+    return 2;
+  if (Until)
+    ipaSim_onReached(Until, []() { finish("reached symbol", 0); });
+
+  // Time limit and idleness are checked periodically.
+  if (TimeLimit > 0 || IdleLimit > 0)
+    thread([=]() {
+      auto Start = steady_clock::now(), LastChange = Start;
+      uint32_t Last = ipaSim_progress();
+      for (;;) {
+        this_thread::sleep_for(milliseconds(100));
+        auto Now = steady_clock::now();
+        if (TimeLimit > 0 && Now - Start >= duration<double>(TimeLimit))
+          finish("time limit reached", Until ? 1 : 0);
+        uint32_t Current = ipaSim_progress();
+        if (Current != Last) {
+          Last = Current;
+          LastChange = Now;
+        } else if (IdleLimit > 0 &&
+                   Now - LastChange >= duration<double>(IdleLimit))
+          finish("guest is idle", 0);
+      }
+    }).detach();
+
+  ipaSim_run(Binary);
+
+  // The app might still be running (e.g., on other threads), so we wait for
+  // one of the conditions.
+  if (TimeLimit > 0 || IdleLimit > 0)
+    for (;;)
+      this_thread::sleep_for(hours(1));
+  finish(Until ? "exited before reaching symbol" : "exited", Until ? 1 : 0);
+}
@@ -0,0 +1,108 @@
+// IpaSimPrep.cpp: Tool `ipasim-prep`, which prepares an app for fast launches.
+// It runs the app once without UI, like `IpaSimHeadless`, but everything
+// `IpaSimLibrary` caches across runs (prelinked bindings, the launch profile,
+// image snapshots, the guest profile and crossing statistics) is written into
+// the app's bundle (`<app>.ipasim`, see `CacheFile.hpp`) instead of the local
+// cache folder. The bundle is used automatically by later launches while the
+// app doesn't change, so they are as fast as the second one from the start.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+// Implemented by `IpaSimLibrary` (see `IpaSimulator.cpp`).
+extern "C" void ipaSim_run(const char *Path);
+extern "C" bool ipaSim_setLogFile(const char *Path);
+extern "C" void ipaSim_flushLog();
+extern "C" bool ipaSim_beginBundle(const char *Path);
+extern "C" bool ipaSim_finishBundle();
+extern "C" bool ipaSim_writeProfile(const char *Path);
+extern "C" bool ipaSim_writeCrossings(const char *Path);
+extern "C" bool ipaSim_writeCoverage(const char *Path);
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Longer than `LaunchProfileWindow`, so that the launch profile is complete.
+constexpr double DefaultTime = 30;
+
+atomic<bool> Finished = false;
+
+void finish() {
+  if (Finished.exchange(true))
+    return;
+  // These are optional (profiling can be disabled), the other caches are
+  // written by the library as the app runs.
+  ipaSim_writeProfile(nullptr);
+  ipaSim_writeCrossings(nullptr);
+  ipaSim_writeCoverage(nullptr);
+  int Code = 0;
+  if (!ipaSim_finishBundle()) {
+    fprintf(stderr, "ipasim-prep: cannot write the bundle\n");
+    Code = 1;
+  }
+  ipaSim_flushLog();
+  fflush(stdout);
+  // Other threads might still be emulating, so we don't run destructors.
+  _Exit(Code);
+}
+
+void usage(const char *Name) {
+  fprintf(stderr,
+          "usage: %s [options] path-to-binary-or-ipa\n"
+          "  --log <file>      write log into <file> (default: stdout)\n"
+          "  --time <seconds>  run the app for <seconds> (default: %g)\n"
+          "Writes caches of the app into bundle <app>.ipasim next to it.\n",
+          Name, DefaultTime);
+}
+
+} // namespace
+
+int main(int ArgC, char **ArgV) {
+  const char *Log = nullptr, *Binary = nullptr;
+  double Time = DefaultTime;
+  for (int I = 1; I != ArgC; ++I) {
+    const char *Arg = ArgV[I];
+    bool HasValue = I + 1 != ArgC;
+    if (!strcmp(Arg, "--log") && HasValue)
+      Log = ArgV[++I];
+    else if (!strcmp(Arg, "--time") && HasValue)
+      Time = strtod(ArgV[++I], nullptr);
+    else if (Arg[0] != '-' && !Binary)
+      Binary = Arg;
+    else {
+      usage(ArgV[0]);
+      return 2;
+    }
+  }
+  if (!Binary || Time <= 0) {
+    usage(ArgV[0]);
+    return 2;
+  }
+
+  if (!ipaSim_setLogFile(Log)) {
+    fprintf(stderr, "ipasim-prep: cannot open log file %s\n", Log);
+    return 2;
+  }
+  if (!ipaSim_beginBundle(Binary)) {
+    fprintf(stderr, "ipasim-prep: cannot create bundle of %s\n", Binary);
+    return 2;
+  }
+
+  thread([=]() {
+    this_thread::sleep_for(duration<double>(Time));
+    finish();
+  }).detach();
+
+  ipaSim_run(Binary);
+
+  // The app might still be running (e.g., on other threads), so its caches
+  // are written only after the time runs out.
+  for (;;)
+    this_thread::sleep_for(hours(1));
+}
@@ -0,0 +1,187 @@
+// IpaSimTrace.cpp: Offline decoder of binary traces written by `TraceBuffer`.
+// It prints records of all threads ordered by time. Addresses are shown as
+// offsets inside images listed in `images.txt` (see `ipaSim_saveTrace`) and
+// addresses inside Dylibs are also symbolized using their export tries.
+//
+// Usage: `IpaSimTrace <trace-folder> [<max-records>]`.
+
+#include "ipasim/MachOReader.hpp"
+#include "ipasim/TraceBuffer.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+struct Image {
+  uint64_t Start, Size;
+  string Path;
+  // Exports sorted by their offsets from `Start` (only for Dylibs)
+  vector<pair<uint64_t, string>> Exports;
+};
+
+// Images indexed by their end addresses.
+map<uint64_t, Image> Images;
+
+void loadExports(Image &Img) {
+  ifstream IS(Img.Path, ios::binary);
+  vector<uint8_t> Data((istreambuf_iterator<char>(IS)),
+                       istreambuf_iterator<char>());
+  uint64_t Offset, Size;
+  MachOInfo Info;
+  if (!MachOReader::findSlice(Data.data(), Data.size(), Offset, Size) ||
+      !MachOReader(Data.data() + Offset, Size).read(Info))
+    return;
+  // The image's range starts at its lowest segment (see
+  // `LoadedLibrary::getStart`).
+  uint64_t Low = UINT64_MAX;
+  for (const MachOInfo::Segment &Seg : Info.Segments)
+    Low = min(Low, Seg.VMAddr);
+  for (auto &[Name, Addr] : Info.Exports)
+    Img.Exports.emplace_back(Addr - Low, move(Name));
+  sort(Img.Exports.begin(), Img.Exports.end());
+}
+
+bool loadImages(const filesystem::path &Dir) {
+  ifstream IS(Dir / "images.txt");
+  if (!IS)
+    return false;
+  string Line;
+  while (getline(IS, Line)) {
+    istringstream LS(Line);
+    string Start, Size, Kind;
+    Image Img;
+    if (!(LS >> Start >> Size >> Kind) || !getline(LS >> ws, Img.Path))
+      continue;
+    Img.Start = strtoull(Start.c_str(), nullptr, 16);
+    Img.Size = strtoull(Size.c_str(), nullptr, 16);
+    if (Kind == "dylib")
+      loadExports(Img);
+    uint64_t End = Img.Start + Img.Size;
+    Images.emplace(End, move(Img));
+  }
+  return true;
+}
+
+string symbolize(uint64_t Addr) {
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "0x%" PRIx64, Addr);
+  auto It = Images.upper_bound(Addr);
+  if (It == Images.end() || Addr < It->second.Start)
+    return Buf;
+
+  const Image &Img = It->second;
+  uint64_t Offset = Addr - Img.Start;
+  string Result(filesystem::path(Img.Path).filename().string());
+  // Thumb functions have their lowest bit set.
+  auto Sym = upper_bound(
+      Img.Exports.begin(), Img.Exports.end(), Offset | 1,
+      [](uint64_t Addr, const pair<uint64_t, string> &E) {
+        return Addr < E.first;
+      });
+  if (Sym != Img.Exports.begin()) {
+    --Sym;
+    snprintf(Buf, sizeof(Buf), "+0x%" PRIx64, Offset - (Sym->first & ~1ULL));
+    return Result + "!" + Sym->second + Buf;
+  }
+  snprintf(Buf, sizeof(Buf), "+0x%" PRIx64, Offset);
+  return Result + Buf;
+}
+
+struct Event {
+  TraceRecord R;
+  uint32_t ThreadID;
+  bool operator<(const Event &Other) const { return R.Time < Other.R.Time; }
+};
+
+// Reads records still present in the ring of file `Path`.
+bool readRing(const filesystem::path &Path, vector<Event> &Events,
+              uint64_t &Frequency) {
+  ifstream IS(Path, ios::binary);
+  TraceHeader H;
+  if (!IS.read(reinterpret_cast<char *>(&H), sizeof(H)) ||
+      memcmp(H.Magic, TraceHeader::MagicValue, sizeof(H.Magic)) ||
+      H.Version != TraceHeader::CurrentVersion ||
+      H.RecordSize != sizeof(TraceRecord) || !H.Capacity)
+    return false;
+  Frequency = H.Frequency;
+
+  uint64_t Written = H.Written.load();
+  uint64_t First = Written > H.Capacity ? Written - H.Capacity : 0;
+  vector<TraceRecord> Records(min(Written, H.Capacity));
+  if (!IS.read(reinterpret_cast<char *>(Records.data()),
+               Records.size() * sizeof(TraceRecord)))
+    return false;
+  for (uint64_t I = First; I != Written; ++I)
+    Events.push_back(Event{Records[I % H.Capacity], H.ThreadID});
+  return true;
+}
+
+void print(const Event &E, uint64_t Origin, uint64_t Frequency) {
+  static const char *const Kinds[] = {"wrapper", "wrapper-dll", "dynamic",
+                                      "trampoline", "callback"};
+  const TraceRecord &R = E.R;
+  double Time = double(R.Time - Origin) * 1e6 / Frequency;
+  printf("%12.3f us [%5u] ", Time, E.ThreadID);
+  if (R.Event == TraceRecord::Instruction) {
+    printf("%s [R0 = 0x%x, R1 = 0x%x, R7 = 0x%x, R12 = 0x%x, SP = 0x%x, "
+           "LR = 0x%x]\n",
+           symbolize(R.PC).c_str(), R.Regs[0], R.Regs[1], R.Regs[2],
+           R.Regs[3], R.Regs[4], R.Regs[5]);
+    return;
+  }
+  if (R.Event == TraceRecord::WindowStart ||
+      R.Event == TraceRecord::WindowEnd) {
+    printf("window %s %s\n",
+           R.Event == TraceRecord::WindowStart ? "start" : "end",
+           symbolize(R.Target).c_str());
+    return;
+  }
+  const char *Kind = R.Kind < size(Kinds) ? Kinds[R.Kind] : "?";
+  printf("%s %s %s\n", R.Event == TraceRecord::Enter ? "enter" : "leave", Kind,
+         symbolize(R.Target).c_str());
+}
+
+} // namespace
+
+int main(int ArgC, char **ArgV) {
+  if (ArgC < 2) {
+    fprintf(stderr, "usage: %s <trace-folder> [<max-records>]\n", ArgV[0]);
+    return 1;
+  }
+  filesystem::path Dir(ArgV[1]);
+  size_t Max = ArgC > 2 ? strtoull(ArgV[2], nullptr, 10) : SIZE_MAX;
+  if (!loadImages(Dir))
+    fprintf(stderr, "warning: no images.txt, addresses won't be symbolized\n");
+
+  vector<Event> Events;
+  uint64_t Frequency = 1;
+  error_code Error;
+  for (const auto &Entry : filesystem::directory_iterator(Dir, Error))
+    if (Entry.path().extension() == ".bin" &&
+        !readRing(Entry.path(), Events, Frequency))
+      fprintf(stderr, "warning: cannot read %s\n",
+              Entry.path().string().c_str());
+  if (Events.empty())
+    return 0;
+
+  // Only the latest `Max` records are printed.
+  stable_sort(Events.begin(), Events.end());
+  size_t Begin = Events.size() > Max ? Events.size() - Max : 0;
+  for (size_t I = Begin; I != Events.size(); ++I)
+    print(Events[I], Events[Begin].R.Time, Frequency);
+  return 0;
+}
@@ -1,37 +1,368 @@
-// IpaSimulator.cpp: Implementation of class `IpaSimulator` and
-// `IpaSimLibrary`'s public API.
+// IpaSimulator.cpp: Implementation of classes `IpaSimulator` and
+// `ThreadContext` and `IpaSimLibrary`'s public API.
 
 #include "ipasim/IpaSimulator.hpp"
 
+#include "ipasim/CacheFile.hpp"
 #include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaArchive.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/LaunchProfile.hpp"
 #include "ipasim/LoadedLibrary.hpp"
+#include "ipasim/StackWalker.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <unordered_map>
+#include <psapi.h> // For `GetProcessMemoryInfo`
+#include <winrt/Windows.UI.Core.h>
 
 using namespace ipasim;
 using namespace std;
 using namespace winrt;
 using namespace Windows::ApplicationModel::Activation;
+using namespace Windows::UI::Core;
 
 // TODO: This Emu-Dyld circular reference is not very cool.
-IpaSimulator::IpaSimulator() : Emu(Dyld), Dyld(Emu), Sys(Dyld, Emu) {}
+IpaSimulator::IpaSimulator()
+    : Emu(Dyld, Space), Dyld(Space), Heap(Dyld.getArena(), Space),
+      TSD(Heap), Stacks(Dyld.getArena(), Space), Clock(Dyld.getArena(), Space),
+      Watches(Space), Profiler(Dyld), Allocations(Dyld), Crossings(Dyld, Trace),
+      Sys(Dyld, Emu), MainThread(this_thread::get_id()) {}
 
-void ipasim::start(const hstring &Path,
-                   const LaunchActivatedEventArgs &LaunchArgs) {
-  // Load the binary.
-  IpaSim.MainBinary = to_string(Path);
+SysTranslator &IpaSimulator::sys() {
+  if (this_thread::get_id() == MainThread)
+    return Sys;
+
+  thread_local unique_ptr<ThreadContext> Ctx;
+  if (!Ctx)
+    Ctx = make_unique<ThreadContext>(Dyld, Space);
+  return Ctx->Sys;
+}
+
+void IpaSimulator::reportStartup(StartupStage Stage, const string &Detail) {
+  // The handler is called without the lock, so that it can replace itself.
+  StartupHandler Handler;
+  {
+    lock_guard<mutex> Lock(StartupMutex);
+    Handler = OnStartup;
+  }
+  if (Handler)
+    Handler(Stage, Detail);
+}
+
+void IpaSimulator::setStartupHandler(StartupHandler Handler) {
+  lock_guard<mutex> Lock(StartupMutex);
+  OnStartup = move(Handler);
+}
+
+uint32_t IpaSimulator::getProgress() {
+  uint32_t Progress = RetiredProgress.load(memory_order_relaxed);
+  forEachTranslator(
+      [&](const SysTranslator &T) { Progress += T.getProgress(); });
+  return Progress;
+}
+
+ThreadContext::ThreadContext(DynamicLoader &Dyld, GuestMemoryMap &Space)
+    : Emu(Dyld, Space), Sys(Dyld, Emu) {
+  if (IpaSim.Traces.isEnabled(TraceCategory::Emulation))
+    Log.info() << "creating emulator for thread " << this_thread::get_id()
+               << Log.end();
+  Sys.initialize(ThreadStackSize);
+  lock_guard<mutex> Lock(IpaSim.TranslatorsMutex);
+  IpaSim.Translators.push_back(&Sys);
+}
+
+ThreadContext::~ThreadContext() {
+  lock_guard<mutex> Lock(IpaSim.TranslatorsMutex);
+  auto &Ts = IpaSim.Translators;
+  Ts.erase(find(Ts.begin(), Ts.end(), &Sys));
+  // Hosts see progress stop only when the guest stops running.
+  IpaSim.RetiredProgress.fetch_add(Sys.getProgress(), memory_order_relaxed);
+}
+
+namespace {
+
+// Finds address of `Spec` (`[library!]symbol`, in `App` if there is no
+// library). Instead of a symbol, `+0x` followed by an unslid address can be
+// used. Returns `0` if it's not found.
+uint64_t findGuestSymbol(const string &Spec, LoadedLibrary *App) {
+  string Symbol(Spec);
+  LoadedLibrary *Lib = App;
+  if (size_t Sep = Symbol.find('!'); Sep != string::npos) {
+    Lib = IpaSim.Dyld.load(Symbol.substr(0, Sep));
+    Symbol.erase(0, Sep + 1);
+  }
+  uint64_t Addr = 0;
+  if (Lib && !Symbol.compare(0, 3, "+0x"))
+    Addr = Lib->StartAddress + strtoull(Symbol.c_str() + 3, nullptr, 16);
+  else if (Lib)
+    Addr = Lib->findSymbol(IpaSim.Dyld, Symbol);
+  if (!Addr)
+    Log.error() << "cannot find symbol " << Spec << Log.end();
+  return Addr;
+}
+
+// Lets the main `SysTranslator` report reaching `IpaSim.ReachSymbol` and
+// record `IpaSim.TraceWindows`.
+void watchSymbols(LoadedLibrary *App) {
+  if (IpaSim.ReachCallback)
+    if (uint64_t Addr = findGuestSymbol(IpaSim.ReachSymbol, App))
+      IpaSim.Sys.onReached(Addr, IpaSim.ReachCallback);
+  for (auto &[Symbol, MaxInstructions] : IpaSim.TraceWindows)
+    if (uint64_t Addr = findGuestSymbol(Symbol, App))
+      IpaSim.Sys.addTraceWindow(Addr, MaxInstructions);
+}
+
+// Returns path of the main executable inside `Path` if it's an `.ipa` archive.
+// Returns `Path` as it is otherwise or an empty string on error.
+string findBinary(const string &Path) {
+  if (!IpaArchive::isArchivePath(Path))
+    return Path;
+  IpaArchive *Archive = IpaArchive::get(Path);
+  if (!Archive || Archive->getExecutable().empty()) {
+    Log.error() << "cannot find executable in " << Path << Log.end();
+    return string();
+  }
+  return Path + IpaArchive::Separator + Archive->getExecutable();
+}
+
+// Path whose launch profile has already been replayed. `prefetch` and `load`
+// are called one after another, so it doesn't need to be synchronized.
+string PrefetchedPath;
+// `HotEntries` of the replayed profile by image path, scheduled by `load` when
+// the images are loaded.
+vector<pair<string, vector<uint32_t>>> ProfiledEntries;
+// Classes used by the replayed launch, prioritized by `load`.
+vector<string> ProfiledClasses;
+
+// Implements `ipasim::prefetch`.
+void prefetchBinary(const string &ArgPath) {
+  if constexpr (LaunchProfileWindow != 0) {
+    string Path(findBinary(ArgPath));
+    if (Path.empty() || PrefetchedPath == Path)
+      return;
+    PrefetchedPath = Path;
+    openBundle(Path);
+    LaunchProfile Profile(Path);
+    if (Profile.load()) {
+      ProfiledEntries.clear();
+      ProfiledClasses.clear();
+      for (LaunchProfile::Image &Img : Profile.Images) {
+        if constexpr (Pretranslation)
+          if (!Img.Entries.empty())
+            ProfiledEntries.emplace_back(Img.Path, move(Img.Entries));
+        if constexpr (PrerealizeClasses)
+          for (string &Class : Img.Classes)
+            ProfiledClasses.push_back(move(Class));
+      }
+      Profile.replay();
+    }
+  }
+}
+
+// Schedules `ProfiledEntries` of loaded images for pretranslation.
+void scheduleEntries() {
+  unordered_map<string, LoadedLibrary *> Loaded;
+  for (size_t I = 0, Count = IpaSim.Dyld.getImageCount(); I != Count; ++I) {
+    LibraryInfo LI(IpaSim.Dyld.getImage(I));
+    if (LI.Lib && LI.LibPath)
+      Loaded.try_emplace(*LI.LibPath, LI.Lib);
+  }
+
+  vector<uint64_t> Addrs;
+  for (const auto &[Path, Offsets] : ProfiledEntries) {
+    auto It = Loaded.find(Path);
+    if (It == Loaded.end())
+      continue;
+    // Offsets are relative to the slide and the image's range starts at
+    // `VMAddr` (see `LoadedLibrary::StartAddress`).
+    LoadedLibrary *Lib = It->second;
+    for (uint32_t Offset : Offsets)
+      if (Offset - Lib->VMAddr < Lib->Size)
+        Addrs.push_back(Lib->StartAddress + Offset);
+  }
+  ProfiledEntries.clear();
+  IpaSim.Entries.schedule(move(Addrs));
+}
+
+// Implements `ipasim::load` and the first half of `ipaSim_run`. Doesn't
+// execute any guest code, so it can run on any thread.
+LoadedLibrary *loadBinary(const string &Path) {
+  IpaSim.Clock.start();
+
+  // Load the binary. Images used by the previous launch are read ahead. Images
+  // registered by initializers of DLLs are collected until the entry point is
+  // about to run (see `SysTranslator::execute`).
+  if constexpr (BatchStartupImages)
+    IpaSim.Dyld.beginBatch();
+  IpaSim.MainBinary = findBinary(Path);
+  if (IpaSim.MainBinary.empty()) {
+    IpaSim.Dyld.endBatch();
+    IpaSim.reportStartup(StartupStage::Failed);
+    return nullptr;
+  }
+  // Caches prepared by `ipasim-prep` (if any) are used before those of
+  // previous launches.
+  if (openBundle(IpaSim.MainBinary))
+    Log.info() << "using bundle " << getBundlePath(IpaSim.MainBinary).string()
+               << Log.end();
+  if constexpr (LaunchProfileWindow != 0) {
+    prefetchBinary(IpaSim.MainBinary);
+    IpaSim.Dyld.recordLaunchProfile(IpaSim.MainBinary);
+  }
   LoadedLibrary *App = IpaSim.Dyld.load(IpaSim.MainBinary);
-  if (!App)
-    return;
+  if (!App) {
+    IpaSim.Dyld.endBatch();
+    IpaSim.reportStartup(StartupStage::Failed);
+    return nullptr;
+  }
+  watchSymbols(App);
+  IpaSim.Translations.load(App, IpaSim.MainBinary);
+  if constexpr (Pretranslation)
+    scheduleEntries();
+  if constexpr (PrerealizeClasses)
+    IpaSim.Classes.prioritize(move(ProfiledClasses));
+  return App;
+}
+
+// Implements `ipasim::run` and the second half of `ipaSim_run`. `LaunchArgs`
+// are passed to `UIApplicationLaunched` as they are (it's C++/CX
+// `LaunchActivatedEventArgs` or `nullptr` if there is no UI host).
+void runBinary(LoadedLibrary *App, void *LaunchArgs) {
+  // Emulation of the main binary happens on this thread.
+  IpaSim.MainThread = this_thread::get_id();
 
   // Execute it.
+  IpaSim.reportStartup(StartupStage::Initializing);
+  if constexpr (ProfileInterval != 0)
+    IpaSim.Profiler.start();
   IpaSim.Sys.execute(App);
 
-  // Call `UIApplicationLaunched`. `get_abi` converts C++/WinRT object to its
-  // C++/CX equivalent.
-  IpaSim.Sys.call("UIKit.dll", "UIApplicationLaunched", get_abi(LaunchArgs));
+  IpaSim.reportStartup(StartupStage::Launching);
+  auto Launch = [=]() {
+    IpaSim.Sys.call("UIKit.dll", "UIApplicationLaunched", LaunchArgs);
+  };
+  if (IpaSim.UI.isEmulationThread())
+    IpaSim.UI.callOnUI(Launch);
+  else
+    Launch();
+  IpaSim.Frames.launched();
+  IpaSim.reportStartup(StartupStage::Done);
+  IpaSim.setStartupHandler(nullptr);
+}
+
+// Committed bytes attributed to their owners. See `ipaSim_writeMemoryReport`.
+struct MemoryUsage {
+  uint64_t DylibPrivate = 0, DylibShared = 0; // Guest images
+  uint64_t DLLPrivate = 0, DLLShared = 0;     // WinObjC and other DLLs
+  uint64_t Models = 0;                        // LIEF models kept alive
+  uint64_t Stacks, Heap, Faults, Trampolines, Log;
+  // Private executable memory other than trampolines, i.e., mostly code
+  // buffers of Unicorn's translation blocks.
+  uint64_t JIT = 0;
+  uint64_t Total = 0; // All private bytes of the process
+  size_t Regions;     // Unicorn's memory regions
+};
+
+MemoryUsage getMemoryUsage(const vector<ImageMemory> &Images) {
+  MemoryUsage U;
+  for (const ImageMemory &M : Images) {
+    (M.DLL ? U.DLLPrivate : U.DylibPrivate) += M.Private;
+    (M.DLL ? U.DLLShared : U.DylibShared) += M.Shared;
+    U.Models += M.ModelBytes;
+  }
+  U.Stacks = IpaSim.Stacks.getCommittedBytes();
+  U.Heap = IpaSim.Heap.getRegionBytes();
+  U.Faults = IpaSim.Space.getFaultBytes();
+  U.Trampolines = 0;
+  IpaSim.forEachTranslator([&](const SysTranslator &T) {
+    U.Trampolines += T.getTrampolines().getBytes();
+  });
+  U.Log = IpaSim.LogText.getKeptBytes();
+  U.Regions = IpaSim.Space.getRegionCount();
+
+  // Unicorn doesn't report its own allocations, but its code buffers are the
+  // only other private read-write-execute memory.
+  MEMORY_BASIC_INFORMATION MBI;
+  for (auto *P = static_cast<uint8_t *>(nullptr);
+       VirtualQuery(P, &MBI, sizeof(MBI)); P += MBI.RegionSize) {
+    P = static_cast<uint8_t *>(MBI.BaseAddress);
+    if (MBI.State == MEM_COMMIT && MBI.Type == MEM_PRIVATE &&
+        MBI.Protect == PAGE_EXECUTE_READWRITE)
+      U.JIT += MBI.RegionSize;
+  }
+  U.JIT -= min(U.JIT, U.Trampolines);
+
+  PROCESS_MEMORY_COUNTERS_EX Counters;
+  if (GetProcessMemoryInfo(
+          GetCurrentProcess(),
+          reinterpret_cast<PROCESS_MEMORY_COUNTERS *>(&Counters),
+          sizeof(Counters)))
+    U.Total = Counters.PrivateUsage;
+  return U;
+}
+
+} // namespace
+
+void ipasim::prefetch(const hstring &Path) {
+  IpaSim.Frames.start();
+  prefetchBinary(to_string(Path));
+}
+bool ipasim::load(const hstring &Path, StartupHandler Handler) {
+  IpaSim.Frames.start();
+  IpaSim.setStartupHandler(move(Handler));
+  return loadBinary(to_string(Path)) != nullptr;
+}
+void ipasim::run(const LaunchActivatedEventArgs &LaunchArgs) {
+  if (IpaSim.MainBinary.empty()) {
+    Log.error("run called before load");
+    return;
+  }
+  // The binary is already loaded, this just looks it up.
+  LoadedLibrary *App = IpaSim.Dyld.load(IpaSim.MainBinary);
+  if (!App)
+    return;
+
+  // Frames are rendered by this thread.
+  if (CoreWindow::GetForCurrentThread())
+    IpaSim.Frames.attach();
+
+  // Move emulation off the UI thread if there is one. `UIDispatcher` then
+  // marshals UI calls back to it.
+  if constexpr (UIBatchBudget != 0) {
+    if (CoreWindow Window = CoreWindow::GetForCurrentThread()) {
+      CoreDispatcher D(Window.Dispatcher());
+      if (IpaSim.UI.start([D](UIDispatcher::Task T) {
+            D.RunAsync(CoreDispatcherPriority::Normal, [T]() { T(); });
+          })) {
+        IpaSim.UI.post(
+            [App, LaunchArgs]() { runBinary(App, get_abi(LaunchArgs)); });
+        return;
+      }
+    }
+  }
+
+  // `get_abi` converts C++/WinRT object to its C++/CX equivalent.
+  runBinary(App, get_abi(LaunchArgs));
+}
+void ipasim::start(const hstring &Path,
+                   const LaunchActivatedEventArgs &LaunchArgs) {
+  if (load(Path, nullptr))
+    run(LaunchArgs);
+}
+void ipasim::suspend() {
+  IpaSim.Dyld.trim();
+  uint64_t Stack = IpaSim.Stacks.trim();
+  uint64_t Heap = IpaSim.Heap.trim();
+  Log.info() << "trimmed memory on suspend (stacks " << Stack << " B, heap "
+             << Heap << " B)" << Log.end();
 }
 TextBlockProvider &ipasim::logText() { return IpaSim.LogText; }
+void ipasim::trackFrames(bool Enable) { IpaSim.Frames.track(Enable); }
 void ipasim::error(const char *Message) { Log.error(Message); }
 
 IpaSimulator ipasim::IpaSim;
@@ -47,23 +378,488 @@ IPASIM_API void ipaSim_translate4(uint32_t *Addr) {
 IPASIM_API void *ipaSim_translateC(void *FP, size_t ArgC) {
   return IpaSim.Sys.translate(FP, ArgC);
 }
+// Batch versions of `ipaSim_translate`. They should be preferred when bridging
+// whole method lists or block tables, since they share the work of looking up
+// pointers from the same image. `Types` can be `nullptr`.
+IPASIM_API void ipaSim_translateMany(void **FPs, const char *const *Types,
+                                     size_t Count) {
+  IpaSim.Sys.translate(FPs, Types, Count);
+}
+// Stores `List->count` translated implementations of runtime's `method_list_t`
+// into `Imps`.
+IPASIM_API void ipaSim_translateMethodList(void *List, void **Imps) {
+  IpaSim.Sys.translateMethodList(List, Imps);
+}
+// Should be called (e.g., from `_Block_release` or `dealloc`) when the owner of
+// a pointer returned by one of the `ipaSim_translate*` functions dies.
+IPASIM_API void ipaSim_release(void *FP) { IpaSim.Sys.release(FP); }
+// Trampolines of all threads (see `TrampolineArena`).
+IPASIM_API void ipaSim_trampolineStats(size_t *Used, size_t *Capacity) {
+  *Used = *Capacity = 0;
+  IpaSim.forEachTranslator([&](const SysTranslator &T) {
+    *Used += T.getTrampolines().getUsed();
+    *Capacity += T.getTrampolines().getCapacity();
+  });
+}
+// Number of mapped regions and bytes, and of faults at (and bytes of) host
+// memory mapped on demand.
+IPASIM_API void ipaSim_memoryStats(size_t *Regions, uint64_t *MappedBytes,
+                                   size_t *Faults, uint64_t *FaultBytes) {
+  *Regions = IpaSim.Space.getRegionCount();
+  *MappedBytes = IpaSim.Space.getMappedBytes();
+  *Faults = IpaSim.Space.getFaultCount();
+  *FaultBytes = IpaSim.Space.getFaultBytes();
+}
+// Writes counters of `RuntimeStats` and current gauges as a flat JSON object
+// into `Buffer` (if `Size` is enough for it with terminating null) and returns
+// its length. Hit rates of caches can be computed from their hits and misses
+// (`MessageCache` hits stay in emulated code, so only its misses are counted).
+// Time of native code is only measured if `CountCrossings` is enabled. Guest
+// instructions are estimated from exhausted `InstructionBudget`s, so they're
+// zero without the budget. Frames are only seen in the XAML app (see
+// `FrameStats`), their percentiles and those of main loop turns are computed
+// from recent samples.
+IPASIM_API size_t ipaSim_getStats(char *Buffer, size_t Size) {
+  string JSON(ipasim::getStats());
+  if (Buffer && Size > JSON.size())
+    memcpy(Buffer, JSON.c_str(), JSON.size() + 1);
+  return JSON.size();
+}
+string ipasim::getStats() {
+  string JSON("{");
+  auto Add = [&](const char *Name, uint64_t Value) {
+    if (JSON.size() != 1)
+      JSON += ',';
+    JSON += '"';
+    JSON += Name;
+    JSON += "\":";
+    JSON += to_string(Value);
+  };
+  for (size_t I = 0; I != static_cast<size_t>(Stat::Count); ++I) {
+    auto S = static_cast<Stat>(I);
+    Add(RuntimeStats::getName(S), IpaSim.Stats.get(S));
+  }
+  Add("guest_instructions",
+      IpaSim.Stats.get(Stat::BudgetSlices) * InstructionBudget);
+  size_t Trampolines = 0;
+  IpaSim.forEachTranslator([&](const SysTranslator &T) {
+    Trampolines += T.getTrampolines().getUsed();
+  });
+  Add("live_trampolines", Trampolines);
+  Add("loaded_images", IpaSim.Dyld.getLibraries().size());
+  Add("regions", IpaSim.Space.getRegionCount());
+  Add("mapped_bytes", IpaSim.Space.getMappedBytes());
+  Add("fault_mappings", IpaSim.Space.getFaultCount());
+  Add("fault_bytes", IpaSim.Space.getFaultBytes());
+  // Memory footprint, see `ipaSim_writeMemoryReport` for details.
+  MemoryUsage U(getMemoryUsage(IpaSim.Dyld.getImageMemory()));
+  Add("mem_dylib_private", U.DylibPrivate);
+  Add("mem_dylib_shared", U.DylibShared);
+  Add("mem_dll_private", U.DLLPrivate);
+  Add("mem_dll_shared", U.DLLShared);
+  Add("mem_lief_models", U.Models);
+  Add("mem_stacks", U.Stacks);
+  Add("mem_heap", U.Heap);
+  Add("mem_trampolines", U.Trampolines);
+  Add("mem_jit", U.JIT);
+  Add("mem_log", U.Log);
+  Add("mem_private_total", U.Total);
+  if constexpr (AllocationSampleInterval != 0)
+    Add("heap_live_bytes", IpaSim.Allocations.getLiveBytes());
+  // Time to the launch and the first frame and pacing after it, see
+  // `FrameStats`.
+  Add("launch_us", IpaSim.Frames.getLaunch());
+  Add("first_frame_us", IpaSim.Frames.getFirstFrame());
+  auto AddSeries = [&](const string &Prefix, FrameStats::Series &S) {
+    FrameStats::Percentiles P(S.getPercentiles());
+    Add((Prefix + "_p50_us").c_str(), P.P50);
+    Add((Prefix + "_p95_us").c_str(), P.P95);
+    Add((Prefix + "_p99_us").c_str(), P.P99);
+    Add((Prefix + "_hitches").c_str(), S.getHitches());
+  };
+  Add("frames", IpaSim.Frames.Frames.getCount());
+  AddSeries("frame", IpaSim.Frames.Frames);
+  AddSeries("turn", IpaSim.Frames.Turns);
+  // Counters of `libobjc.dll`'s `objc_msg_lookup` fast path and its locks.
+  if (HMODULE ObjC = GetModuleHandleW(L"libobjc.dll")) {
+    if (auto *GetLookupStats =
+            reinterpret_cast<void (*)(uint64_t *, uint64_t *)>(
+                GetProcAddress(ObjC, "objc_msg_lookup_stats"))) {
+      uint64_t Hits, Misses;
+      GetLookupStats(&Hits, &Misses);
+      Add("msg_lookup_hits", Hits);
+      Add("msg_lookup_misses", Misses);
+    }
+    if (auto *GetLockStats = reinterpret_cast<void (*)(uint64_t *)>(
+            GetProcAddress(ObjC, "objc_lock_stats"))) {
+      uint64_t Contentions;
+      GetLockStats(&Contentions);
+      Add("objc_lock_contentions", Contentions);
+    }
+  }
+  JSON += '}';
+  return JSON;
+}
+vector<pair<string, uint64_t>> ipasim::getHotWrappers(size_t Count) {
+  return IpaSim.Crossings.takeHottest(Count);
+}
+// Writes committed memory by owner and then by image into `Path` (or into the
+// log if it's `nullptr`). Private bytes of the process which are not listed
+// (e.g., Unicorn's internal structures and native allocations of WinObjC) are
+// reported as unattributed. Returns `false` if the file cannot be written.
+IPASIM_API bool ipaSim_writeMemoryReport(const char *Path) {
+  vector<ImageMemory> Images(IpaSim.Dyld.getImageMemory());
+  MemoryUsage U(getMemoryUsage(Images));
+  uint64_t Attributed = U.DylibPrivate + U.DLLPrivate + U.Models + U.Stacks +
+                        U.Heap + U.Faults + U.Trampolines + U.JIT + U.Log;
+
+  string Report;
+  auto Line = [&](const char *Name, uint64_t Bytes) {
+    Report += to_string(Bytes / 1024);
+    Report += " KiB ";
+    Report += Name;
+    Report += '\n';
+  };
+  Line("private bytes of the process", U.Total);
+  Line("guest images (private)", U.DylibPrivate);
+  Line("guest images (shared with their files)", U.DylibShared);
+  Line("DLL images (private)", U.DLLPrivate);
+  Line("DLL images (shared with their files)", U.DLLShared);
+  Line("LIEF models", U.Models);
+  Line("guest stacks", U.Stacks);
+  Line("guest heap", U.Heap);
+  Line("memory mapped on guest faults", U.Faults);
+  Line("trampolines", U.Trampolines);
+  Line("Unicorn's code buffers", U.JIT);
+  Line("log lines (estimated)", U.Log);
+  Line("unattributed", U.Total - min(U.Total, Attributed));
+  Report += to_string(U.Regions) + " Unicorn regions\n";
+  for (const ImageMemory &M : Images) {
+    Report += to_string(M.Private / 1024) + " KiB private, " +
+              to_string(M.Shared / 1024) + " KiB shared";
+    if (M.ModelBytes)
+      Report += ", " + to_string(M.ModelBytes / 1024) + " KiB LIEF";
+    Report += ": " + *M.Path + '\n';
+  }
+
+  if (!Path) {
+    Log.info() << "memory report:\n" << Report << Log.end();
+    return true;
+  }
+  FILE *F = fopen(Path, "w");
+  if (!F)
+    return false;
+  bool Written = fputs(Report.c_str(), F) >= 0;
+  return fclose(F) == 0 && Written;
+}
+// Entry points for hosts without UI (see `IpaSimHeadless`). `ipaSim_run`
+// starts the emulation like `ipasim::start`, but UIKit gets no launch
+// arguments.
+IPASIM_API void ipaSim_run(const char *Path) {
+  IpaSim.Frames.start();
+  if (LoadedLibrary *App = loadBinary(Path))
+    runBinary(App, nullptr);
+}
+// Used by `ipasim-prep`. Must be called before `ipaSim_run`. Caches of app
+// `Path` are then written into its bundle (see `beginBundle`) instead of the
+// cache folder.
+IPASIM_API bool ipaSim_beginBundle(const char *Path) {
+  string Binary(findBinary(Path));
+  return !Binary.empty() && beginBundle(Binary);
+}
+// Makes the bundle of the running app valid. Should be called once the app has
+// run long enough to write its caches.
+IPASIM_API bool ipaSim_finishBundle() {
+  return finishBundle(IpaSim.MainBinary);
+}
+// Writes log into file `Path` (or to standard output if it's `nullptr`)
+// instead of `TextBlock`. Returns `false` if the file cannot be opened.
+IPASIM_API bool ipaSim_setLogFile(const char *Path) {
+  FILE *F = Path ? fopen(Path, "w") : stdout;
+  if (!F)
+    return false;
+  IpaSim.LogText.init(F);
+  return true;
+}
+// Sets how many lines of log are kept by the UI (see `TextBlockProvider`).
+IPASIM_API void ipaSim_setLogLineLimit(size_t Limit) {
+  IpaSim.LogText.setLineLimit(Limit);
+}
+IPASIM_API void ipaSim_flushLog() {
+  TextBlockStream::flushAll();
+  if (FILE *F = IpaSim.LogText.getFile())
+    fflush(F);
+}
+// Must be called before `ipaSim_run`. `Callback` is called (from inside an
+// emulator hook) when the main thread reaches `Symbol` (`[library!]symbol`,
+// mangled, in the app's binary if there is no library).
+IPASIM_API void ipaSim_onReached(const char *Symbol, void (*Callback)()) {
+  IpaSim.ReachSymbol = Symbol;
+  IpaSim.ReachCallback = Callback;
+}
+// Must be called before `ipaSim_run`. Instructions executed from when the main
+// thread reaches `Symbol` (see `ipaSim_onReached`, it can also be
+// `[library!]+0x<unslid address>`) until it returns or `MaxInstructions` are
+// recorded (`0` means no limit) are written into the binary trace (see
+// `SysTranslator::addTraceWindow`).
+IPASIM_API void ipaSim_traceWindow(const char *Symbol,
+                                   uint64_t MaxInstructions) {
+  IpaSim.TraceWindows.emplace_back(Symbol, MaxInstructions);
+}
+// See `IpaSimulator::getProgress`.
+IPASIM_API uint32_t ipaSim_progress() { return IpaSim.getProgress(); }
+// Stops `GuestProfiler` and writes its samples to `Path` (or to the default
+// location if it's `nullptr`). Returns `false` on failure.
+IPASIM_API bool ipaSim_writeProfile(const char *Path) {
+  // Its timer must not keep running (and flushing) while the host exits.
+  IpaSim.Profiler.stop();
+  return Path ? IpaSim.Profiler.write(Path) : IpaSim.Profiler.write();
+}
+// Writes the report of `AllocationProfiler` to `Path` (or to the default
+// location if it's `nullptr`). Returns `false` on failure.
+IPASIM_API bool ipaSim_writeAllocations(const char *Path) {
+  return Path ? IpaSim.Allocations.write(Path) : IpaSim.Allocations.write();
+}
+// Writes statistics of `CrossingStats` to `Path` (or to the default location if
+// it's `nullptr`). Returns `false` on failure.
+IPASIM_API bool ipaSim_writeCrossings(const char *Path) {
+  return Path ? IpaSim.Crossings.write(Path) : IpaSim.Crossings.write();
+}
+// Adds native functions called by emulated code so far to `Path` (or to the
+// default location if it's `nullptr`). See `CrossingStats::writeCoverage`.
+IPASIM_API bool ipaSim_writeCoverage(const char *Path) {
+  return Path ? IpaSim.Crossings.writeCoverage(Path)
+              : IpaSim.Crossings.writeCoverage();
+}
+// Must be called before `ipaSim_run`. Crossings of the main thread are recorded
+// into `Path` (written by `ipaSim_finishRecording`) or replayed from it. See
+// `CrossingRecorder`.
+IPASIM_API bool ipaSim_recordCrossings(const char *Path) {
+  return IpaSim.Recorder.record(Path);
+}
+IPASIM_API bool ipaSim_replayCrossings(const char *Path) {
+  return IpaSim.Recorder.replay(Path);
+}
+IPASIM_API bool ipaSim_finishRecording() { return IpaSim.Recorder.finish(); }
+// Times (in nanoseconds) of the guest thread currently running on the calling
+// host thread, split into emulated and native code. Returns `false` if they are
+// not measured (see `AccountGuestTimes`).
+IPASIM_API bool ipaSim_guestTimes(uint64_t *EmulatedNs, uint64_t *NativeNs) {
+  GuestTimes *Times = GuestTimes::getCurrent();
+  if (!AccountGuestTimes || !Times)
+    return false;
+  // Re-entering the current mode adds time spent in it so far.
+  GuestTimes::enter(Times->getMode());
+  *EmulatedNs = IpaSim.Clock.toNanoseconds(Times->getEmulated());
+  *NativeNs = IpaSim.Clock.toNanoseconds(Times->getNative());
+  return true;
+}
+// Saves the list of loaded images next to the binary trace (see `TraceBuffer`),
+// so that it can be symbolized later. Returns `false` on failure.
+IPASIM_API bool ipaSim_saveTrace() { return IpaSim.Trace.save(IpaSim.Dyld); }
+// Memory visible to emulated code without faulting (see `GuestHeap`). Meant
+// for objects the Objective-C runtime allocates (see `[use-unicorn-alloc]` in
+// `src/objc/README.md`).
+IPASIM_API void *ipaSim_guestAlloc(size_t Size) {
+  void *Ptr = IpaSim.Heap.allocate(Size);
+  if constexpr (AllocationSampleInterval != 0)
+    IpaSim.Allocations.allocate(Ptr, Size, /* InGuest */ false);
+  return Ptr;
+}
+IPASIM_API void *ipaSim_guestRealloc(void *Ptr, size_t Size) {
+  void *Result = IpaSim.Heap.reallocate(Ptr, Size);
+  if constexpr (AllocationSampleInterval != 0)
+    if (Result || !Size) {
+      IpaSim.Allocations.free(Ptr);
+      IpaSim.Allocations.allocate(Result, Size, /* InGuest */ false);
+    }
+  return Result;
+}
+IPASIM_API void ipaSim_guestFree(void *Ptr) {
+  if constexpr (AllocationSampleInterval != 0)
+    IpaSim.Allocations.free(Ptr);
+  IpaSim.Heap.free(Ptr);
+}
+// Records guest writes to `Size` bytes at `Addr` (see `Watchpoints`). Returns
+// ID for `ipaSim_unwatch` or `0` on failure.
+IPASIM_API uint32_t ipaSim_watch(const void *Addr, size_t Size) {
+  return IpaSim.Watches.add(reinterpret_cast<uint64_t>(Addr), Size);
+}
+IPASIM_API void ipaSim_unwatch(uint32_t ID) { IpaSim.Watches.remove(ID); }
+IPASIM_API bool ipaSim_saveWatchLog() { return IpaSim.Watches.save(); }
+// If `Lib` is not `nullptr`, only instructions inside that library are traced.
+IPASIM_API void ipaSim_traceInstructions(bool Enable, const char *Lib) {
+  IpaSim.Traces.set(TraceCategory::Instructions, Enable);
+  IpaSim.Sys.traceInstructions(Enable, Lib ? IpaSim.Dyld.load(Lib) : nullptr);
+}
+// Switches categories of `Tracepoints` (e.g., `"loader,-crossings"`). Hooks of
+// instructions and memory writes change only for the main thread (other
+// threads install them when they are created). Returns `false` if `Spec`
+// contains unknown categories.
+IPASIM_API bool ipaSim_setTrace(const char *Spec) {
+  uint32_t Old = IpaSim.Traces.getMask();
+  bool Success = IpaSim.Traces.set(Spec);
+  uint32_t Changed = Old ^ IpaSim.Traces.getMask();
+  auto HasChanged = [&](TraceCategory C) {
+    return Changed & (1U << static_cast<uint32_t>(C));
+  };
+  if (HasChanged(TraceCategory::Instructions))
+    IpaSim.Sys.traceInstructions(
+        IpaSim.Traces.isEnabled(TraceCategory::Instructions));
+  if (HasChanged(TraceCategory::MemoryWrites))
+    IpaSim.Sys.traceMemoryWrites(
+        IpaSim.Traces.isEnabled(TraceCategory::MemoryWrites));
+  return Success;
+}
+IPASIM_API uint32_t ipaSim_getTraceMask() { return IpaSim.Traces.getMask(); }
+// Used by libdispatch to execute `Func(Ctx)` asynchronously on the worker pool.
+// `SerialQueue` should identify the queue if it's serial, `nullptr` otherwise.
+IPASIM_API void ipaSim_dispatchAsync(void *Func, void *Ctx,
+                                     const void *SerialQueue) {
+  IpaSim.Pool.async(Func, Ctx, SerialQueue);
+}
+// Guest threads multiplexed on the current host thread (see
+// `SysTranslator::spawn`).
+IPASIM_API void ipaSim_spawnGuestThread(void *Func, void *Arg) {
+  IpaSim.sys().spawn(Func, Arg);
+}
+IPASIM_API void ipaSim_runGuestThreads() { IpaSim.sys().runThreads(); }
+IPASIM_API void ipaSim_traceMemoryWrites(bool Enable) {
+  IpaSim.Traces.set(TraceCategory::MemoryWrites, Enable);
+  IpaSim.Sys.traceMemoryWrites(Enable);
+}
 IPASIM_API const char *ipaSim_processPath() {
   return IpaSim.MainBinary.c_str();
 }
+// Reads file `Path` (relative to the app's bundle) if the app runs from an
+// `.ipa` archive, so that resources are decompressed only when they are used.
+// Returns size of the file (and copies it into `Buffer` if it's big enough) or
+// `-1` if there is no such file.
+IPASIM_API int64_t ipaSim_readBundleFile(const char *Path, void *Buffer,
+                                         size_t Size) {
+  const string &Main = IpaSim.MainBinary;
+  if (!IpaArchive::isArchived(Main))
+    return -1;
+  IpaArchive *Archive;
+  const IpaArchive::Entry *E = IpaArchive::lookup(
+      Main.substr(0, Main.rfind('/') + 1) + Path, Archive);
+  if (!E)
+    return -1;
+  if (Buffer && Size >= E->Size &&
+      !Archive->extract(*E, static_cast<uint8_t *>(Buffer)))
+    return -1;
+  return E->Size;
+}
 IPASIM_API void ipaSim_callBack1(void *FP, void *Arg0) {
-  IpaSim.Sys.callBack(FP, Arg0);
+  IpaSim.callGuest([&](SysTranslator &Sys) { Sys.callBack(FP, Arg0); });
 }
 IPASIM_API void ipaSim_callBack2(void *FP, void *Arg0, void *Arg1) {
-  IpaSim.Sys.callBack(FP, Arg0, Arg1);
+  IpaSim.callGuest([&](SysTranslator &Sys) { Sys.callBack(FP, Arg0, Arg1); });
 }
 IPASIM_API void *ipaSim_callBack1r(void *FP, void *Arg0) {
-  return IpaSim.Sys.callBackR(FP, Arg0);
+  return IpaSim.callGuest(
+      [&](SysTranslator &Sys) { return Sys.callBackR(FP, Arg0); });
 }
 IPASIM_API void *ipaSim_callBack3r(void *FP, void *Arg0, void *Arg1,
                                    void *Arg2) {
-  return IpaSim.Sys.callBackR(FP, Arg0, Arg1, Arg2);
+  return IpaSim.callGuest(
+      [&](SysTranslator &Sys) { return Sys.callBackR(FP, Arg0, Arg1, Arg2); });
+}
+// Calls `FP` for each of `Count` tuples of `ArgC` arguments without restarting
+// emulation each time (see `SysTranslator::callBackBatch`).
+IPASIM_API size_t ipaSim_callBackBatch(void *FP, size_t ArgC, void *const *Args,
+                                       size_t Count, void **Results,
+                                       const bool *Stop) {
+  return IpaSim.callGuest([&](SysTranslator &Sys) {
+    return Sys.callBackBatch(FP, ArgC, Args, Count, Results, Stop);
+  });
 }
 IPASIM_API void ipaSim_register(void *Hdr) { IpaSim.Dyld.registerMachO(Hdr); }
+// Used by the Objective-C runtime instead of iOS's shared cache (see
+// `ObjCPreopt`). They return `nullptr` for names that are not preoptimized.
+IPASIM_API const char *ipaSim_preoptSelector(const char *Name) {
+  return IpaSim.Dyld.getObjCPreopt().findSelector(Name);
+}
+IPASIM_API void *ipaSim_preoptClass(const char *Name) {
+  return IpaSim.Dyld.findPreoptClass(Name, /* Protocol */ false);
+}
+IPASIM_API void *ipaSim_preoptProtocol(const char *Name) {
+  return IpaSim.Dyld.findPreoptClass(Name, /* Protocol */ true);
+}
+// Used by `getsectiondata` and `getsegmentdata` (see `SectionTable`).
+IPASIM_API uint8_t *ipaSim_getSectionData(const void *Hdr, const char *SegName,
+                                          const char *SectName,
+                                          unsigned long *Size) {
+  uint64_t Size64;
+  auto *Data = reinterpret_cast<uint8_t *>(
+      SectionTable::get(Hdr).getSection(SegName, SectName, &Size64));
+  if (Data)
+    *Size = static_cast<unsigned long>(Size64);
+  return Data;
+}
+IPASIM_API uint8_t *ipaSim_getSegmentData(const void *Hdr, const char *SegName,
+                                          unsigned long *Size) {
+  uint64_t Size64;
+  auto *Data = reinterpret_cast<uint8_t *>(
+      SectionTable::get(Hdr).getSegment(SegName, &Size64));
+  if (Data)
+    *Size = static_cast<unsigned long>(Size64);
+  return Data;
+}
+// Stores at most `Max` return addresses of the calling thread (guest and native
+// ones, see `StackWalker`) into `Frames`. Returns their number. Can be used
+// with `dladdr` to print backtraces.
+IPASIM_API size_t ipaSim_backtrace(void **Frames, size_t Max) {
+  StackFrame Walked[StackWalker::MaxDepth];
+  size_t Count = StackWalker(IpaSim.sys())
+                     .walk(Walked, min(Max, StackWalker::MaxDepth),
+                           /* InGuest */ false);
+  for (size_t I = 0; I != Count; ++I)
+    Frames[I] = reinterpret_cast<void *>(Walked[I].Addr);
+  return Count;
+}
+// Used by `dladdr` (see `DynamicLoader::symbolize`). Strings stay valid while
+// the library is loaded.
+IPASIM_API bool ipaSim_symbolize(const void *Addr, const char **Path,
+                                 void **Base, const char **Symbol,
+                                 void **SymbolAddr) {
+  SymbolInfo Info;
+  if (!IpaSim.Dyld.symbolize(reinterpret_cast<uint64_t>(Addr), Info))
+    return false;
+  *Path = Info.Path;
+  *Base = reinterpret_cast<void *>(Info.Base);
+  *Symbol = Info.Symbol;
+  *SymbolAddr = reinterpret_cast<void *>(Info.SymbolAddr);
+  return true;
+}
+// Called by the Objective-C runtime when it attaches method list `List` to
+// class `Cls` (categories, `class_addMethod`), so that `dumpAddr` and dynamic
+// translation can find the methods.
+IPASIM_API void ipaSim_methodsAdded(void *Cls, void *List) {
+  for (ObjCMethod M : ObjCMethod::fromList(Cls, List))
+    IpaSim.Dyld.updateMethod(M, 0);
+}
+// Called by the Objective-C runtime after it replaces implementation `OldImp`
+// of method `Method` (e.g., `method_setImplementation` or
+// `method_exchangeImplementations`). `Cls` can be `nullptr` if unknown.
+IPASIM_API void ipaSim_methodChanged(void *Cls, void *Method, void *OldImp) {
+  IpaSim.Dyld.updateMethod(ObjCMethod(/* Category */ false, Cls, Method),
+                           reinterpret_cast<uint64_t>(OldImp));
+}
+// Called by the Objective-C runtime whenever it flushes its method caches
+// (e.g., `_objc_flush_caches` or `objc_disposeClassPair`), so that generated
+// messengers don't call stale IMPs. See `MessageCache`.
+IPASIM_API void ipaSim_flushMessageCaches() {
+  IpaSim.Dyld.flushMessageCaches();
+}
+// Called by the Objective-C runtime after it inserts `Imp` into method cache of
+// class `Cls`.
+IPASIM_API void ipaSim_cacheFill(void *Cls, void *Sel, void *Imp) {
+  IpaSim.Dyld.fillMessageCaches(
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(Cls)),
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(Sel)),
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(Imp)));
+}
 IPASIM_API void
 _dyld_objc_notify_register(_dyld_objc_notify_mapped Mapped,
                            _dyld_objc_notify_init Init,
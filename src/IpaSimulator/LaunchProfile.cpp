@@ -0,0 +1,119 @@
+// LaunchProfile.cpp: Implementation of class `LaunchProfile`.
+
+#include "ipasim/LaunchProfile.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/Common.hpp"
+#include "ipasim/DynamicLoader.hpp"
+
+#include <Windows.h>
+#include <fstream>
+#include <thread>
+#include <winrt/base.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace winrt;
+
+LaunchProfile::LaunchProfile(const string &AppPath) : AppPath(AppPath) {}
+
+bool LaunchProfile::load() {
+  for (const filesystem::path &File :
+       getCacheFiles("prefetch", getFileName())) {
+    ifstream I(File, ios::binary);
+    if (I && parse(I))
+      return true;
+  }
+  return false;
+}
+
+bool LaunchProfile::parse(istream &I) {
+  uint32_t FileMagic, FileVersion, ImageCount;
+  string FilePath;
+  if (!read(I, FileMagic) || FileMagic != Magic || !read(I, FileVersion) ||
+      FileVersion != Version || !read(I, FilePath) || FilePath != AppPath ||
+      !read(I, ImageCount))
+    return false;
+
+  Images.resize(ImageCount);
+  for (Image &Img : Images) {
+    uint32_t RangeCount, EntryCount, ClassCount;
+    if (!read(I, Img.Path) || !read(I, Img.IsDylib) || !read(I, RangeCount))
+      return false;
+    Img.Ranges.resize(RangeCount);
+    if (!I.read(reinterpret_cast<char *>(Img.Ranges.data()),
+                RangeCount * sizeof(Range)) ||
+        !read(I, EntryCount))
+      return false;
+    Img.Entries.resize(EntryCount);
+    if (!I.read(reinterpret_cast<char *>(Img.Entries.data()),
+                EntryCount * sizeof(uint32_t)) ||
+        !read(I, ClassCount))
+      return false;
+    Img.Classes.resize(ClassCount);
+    for (string &Class : Img.Classes)
+      if (!read(I, Class))
+        return false;
+  }
+  return true;
+}
+
+bool LaunchProfile::save() {
+  error_code Error;
+  filesystem::path Dir(getCacheDir("prefetch"));
+  filesystem::create_directories(Dir, Error);
+  ofstream O(Dir / getFileName(), ios::binary | ios::trunc);
+  if (!O)
+    return false;
+
+  write(O, Magic);
+  write(O, Version);
+  write(O, AppPath);
+  write(O, static_cast<uint32_t>(Images.size()));
+  for (const Image &Img : Images) {
+    write(O, Img.Path);
+    write(O, Img.IsDylib);
+    write(O, static_cast<uint32_t>(Img.Ranges.size()));
+    O.write(reinterpret_cast<const char *>(Img.Ranges.data()),
+            Img.Ranges.size() * sizeof(Range));
+    write(O, static_cast<uint32_t>(Img.Entries.size()));
+    O.write(reinterpret_cast<const char *>(Img.Entries.data()),
+            Img.Entries.size() * sizeof(uint32_t));
+    write(O, static_cast<uint32_t>(Img.Classes.size()));
+    for (const string &Class : Img.Classes)
+      write(O, Class);
+  }
+  return static_cast<bool>(O);
+}
+
+void LaunchProfile::replay() {
+  // The profile is only a hint, so nothing is reported if it's stale.
+  thread([Images = move(Images)]() {
+    for (const Image &Img : Images) {
+      if (!Img.IsDylib) {
+        // The DLL stays loaded, so `DynamicLoader::loadPE` only finds it.
+        LoadPackagedLibrary(to_hstring(Img.Path).c_str(), 0);
+        continue;
+      }
+
+      ImageMapping Mapping;
+      if (!Mapping.open(Img.Path))
+        continue;
+      const uint8_t *Data = Mapping.getImageData();
+      vector<WIN32_MEMORY_RANGE_ENTRY> Entries;
+      for (const Range &R : Img.Ranges)
+        if (uint64_t(R.Offset) + R.Size <= Mapping.getImageSize())
+          Entries.push_back(WIN32_MEMORY_RANGE_ENTRY{
+              const_cast<uint8_t *>(Data + R.Offset), R.Size});
+      // Prefetched pages stay in the system's file cache even after the view
+      // is unmapped.
+      if (!Entries.empty())
+        PrefetchVirtualMemory(GetCurrentProcess(), Entries.size(),
+                              Entries.data(), 0);
+    }
+  }).detach();
+}
+
+string LaunchProfile::getFileName() {
+  return to_hex_string(hashBytes(AppPath.data(), AppPath.size(), HashSeed));
+}
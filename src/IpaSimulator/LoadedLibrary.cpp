@@ -6,32 +6,26 @@
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/IpaSimulator.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+
 using namespace ipasim;
 using namespace std;
 
-DylibSymbolIterator DylibSymbolIterator::begin() {
-  return DylibSymbolIterator(RVA, Symbols.begin()).next();
-}
-
-DylibSymbolIterator &DylibSymbolIterator::next() {
-  while (Symbols != Symbols.end() && Symbols->value() != RVA)
-    ++Symbols;
-  return *this;
-}
-
 DylibSymbolIterator &DylibSymbolIterator::operator++() {
   ++Symbols;
-  return next();
+  return *this;
 }
 
 bool DylibSymbolIterator::operator!=(const DylibSymbolIterator &Other) {
   return Symbols != Other.Symbols;
 }
 
-LIEF::MachO::Symbol &DylibSymbolIterator::operator*() { return *Symbols; }
+const string &DylibSymbolIterator::operator*() { return *Symbols->second; }
 
 bool LoadedLibrary::isInRange(uint64_t Addr) {
-  return StartAddress <= Addr && Addr < StartAddress + Size;
+  uint64_t Start = getStart();
+  return Start <= Addr && Addr < Start + Size;
 }
 
 void LoadedLibrary::checkInRange(uint64_t Addr) {
@@ -40,15 +34,16 @@ void LoadedLibrary::checkInRange(uint64_t Addr) {
 }
 
 uint64_t LoadedDylib::findSymbol(DynamicLoader &DL, const string &Name) {
-  using namespace LIEF::MachO;
+  if (Flattened) {
+    auto It = Symbols.find(Name);
+    return It != Symbols.end() ? It->second : 0;
+  }
 
-  if (!Bin.has_symbol(Name)) {
+  auto It = Exports.find(Name);
+  if (It == Exports.end()) {
     // Try also re-exported libraries.
-    for (DylibCommand &Lib : Bin.libraries()) {
-      if (Lib.command() != LOAD_COMMAND_TYPES::LC_REEXPORT_DYLIB)
-        continue;
-
-      LoadedLibrary *LL = DL.load(Lib.name());
+    for (const string &Lib : Reexports) {
+      LoadedLibrary *LL = DL.load(Lib);
       if (!LL)
         continue;
 
@@ -65,14 +60,144 @@ uint64_t LoadedDylib::findSymbol(DynamicLoader &DL, const string &Name) {
     }
     return 0;
   }
-  return StartAddress + Bin.get_symbol(Name).value();
+  return StartAddress + It->second;
+}
+
+void LoadedDylib::flattenExports(DynamicLoader &DL) {
+  Symbols.reserve(Exports.size());
+  for (auto &[Name, Addr] : Exports)
+    Symbols.emplace(Name, StartAddress + Addr);
+
+  // Symbols of this Dylib take precedence, then re-exported libraries are
+  // searched in order (as in `findSymbol`).
+  bool Complete = true;
+  for (const string &Lib : Reexports) {
+    LoadedLibrary *LL = DL.load(Lib);
+    if (!LL)
+      continue;
+
+    if (auto *Dylib = dynamic_cast<LoadedDylib *>(LL)) {
+      // In case of cyclic re-exports, the other Dylib might not be flattened
+      // yet. Then we have to keep searching it recursively.
+      if (!Dylib->Flattened) {
+        Complete = false;
+        continue;
+      }
+      for (auto &Sym : Dylib->Symbols)
+        Symbols.insert(Sym);
+      continue;
+    }
+
+    // DLLs don't have underscore prefixes, so we need to add them.
+    static_cast<LoadedDll *>(LL)->forEachExport(
+        [&](const char *Name, uint64_t Addr) {
+          OwnedNames.push_front(string("_") + Name);
+          if (!Symbols.emplace(OwnedNames.front(), Addr).second)
+            OwnedNames.pop_front();
+        });
+  }
+
+  if (Complete)
+    Flattened = true;
+  else
+    Symbols.clear();
 }
 
 uint64_t LoadedDll::findSymbol(DynamicLoader &DL, const string &Name) {
+  if (Table) {
+    uint32_t RVA = Table->find(Name);
+    if (RVA == ExportTable::NotFound)
+      return 0;
+    if (RVA != ExportTable::Forwarded)
+      return reinterpret_cast<uint64_t>(Ptr) + RVA;
+  }
   return (uint64_t)GetProcAddress(Ptr, Name.c_str());
 }
 
+const char *LoadedDll::findNearestSymbol(uint64_t Addr, uint64_t &SymAddr) {
+  call_once(Indexed, [this]() {
+    // Forwarded exports can point to other images.
+    forEachExport([&](const char *Name, uint64_t Addr) {
+      if (isInRange(Addr))
+        ExportsByAddr.emplace_back(Addr, Name);
+    });
+    sort(ExportsByAddr.begin(), ExportsByAddr.end());
+  });
+
+  auto It = upper_bound(
+      ExportsByAddr.begin(), ExportsByAddr.end(), Addr,
+      [](uint64_t Addr, const auto &E) { return Addr < E.first; });
+  if (It == ExportsByAddr.begin())
+    return nullptr;
+  --It;
+  SymAddr = It->first;
+  return It->second;
+}
+
+void LoadedDylib::indexExports() {
+  ExportsByAddr.clear();
+  ExportsByAddr.reserve(Exports.size());
+  for (auto &[Name, Addr] : Exports) {
+    ExportsByAddr.emplace_back(Addr, &Name);
+
+    // Decode special symbols of wrappers.
+    if (!startsWith(Name, WrapsPrefix))
+      continue;
+    size_t Underscore = Name.rfind('_');
+    if (Underscore <= WrapsPrefix.Len) {
+      Log.error() << "invalid special symbol " << Name << Log.end();
+      continue;
+    }
+    char *End;
+    uint64_t RVA = strtoull(Name.c_str() + Underscore + 1, &End, 10);
+    if (*End || End == Name.c_str() + Underscore + 1) {
+      Log.error() << "invalid special symbol " << Name << Log.end();
+      continue;
+    }
+    Wrapped.try_emplace(
+        Addr, WrappedFunction{Name.substr(WrapsPrefix.Len,
+                                          Underscore - WrapsPrefix.Len) +
+                                  ".dll",
+                              RVA});
+  }
+
+  // Names are visited in order, so symbols at the same address stay sorted by
+  // name.
+  stable_sort(ExportsByAddr.begin(), ExportsByAddr.end(),
+              [](const auto &A, const auto &B) { return A.first < B.first; });
+}
+
 DylibSymbolIterator LoadedDylib::lookup(uint64_t Addr) {
   uint64_t RVA = Addr - StartAddress;
-  return DylibSymbolIterator(RVA, Bin.exported_symbols());
+  auto [Begin, End] = equal_range(
+      ExportsByAddr.cbegin(), ExportsByAddr.cend(),
+      pair<uint64_t, const string *>(RVA, nullptr),
+      [](const auto &A, const auto &B) { return A.first < B.first; });
+  return DylibSymbolIterator(Begin, End);
+}
+
+const char *LoadedDylib::findNearestSymbol(uint64_t Addr, uint64_t &SymAddr) {
+  uint64_t RVA = Addr - StartAddress;
+  auto It = upper_bound(
+      ExportsByAddr.begin(), ExportsByAddr.end(), RVA,
+      [](uint64_t RVA, const auto &E) { return RVA < E.first; });
+  if (It == ExportsByAddr.begin())
+    return nullptr;
+
+  // Prefer real names to special symbols of wrappers at the same address.
+  uint64_t Found = prev(It)->first;
+  const string *Name = nullptr;
+  for (auto I = prev(It);; --I) {
+    if (!Name || (*Name)[0] == '$')
+      Name = I->second;
+    if (I == ExportsByAddr.begin() || prev(I)->first != Found)
+      break;
+  }
+  SymAddr = StartAddress + Found;
+  return Name->c_str() + ((*Name)[0] == '_');
+}
+
+LoadedDylib::WrappedFunction *LoadedDylib::findWrapped(uint64_t Addr) {
+  auto It = Wrapped.find(Addr - StartAddress);
+  return It != Wrapped.end() ? &It->second : nullptr;
 }
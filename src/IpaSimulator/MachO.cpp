@@ -4,19 +4,23 @@
 
 #include "ipasim/Common.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <llvm/BinaryFormat/MachO.h>
 
 using namespace ipasim;
+using namespace std;
+
+shared_mutex SectionTable::TablesMutex;
+unordered_map<const void *, unique_ptr<SectionTable>> SectionTable::Tables;
 
 // Inspired by
 // https://opensource.apple.com/source/cctools/cctools-895/libmacho/getsecbyname.c.auto.html.
-uint64_t MachO::getSection(const char *SegName, const char *SectName,
-                           uint64_t *Size) {
+SectionTable::SectionTable(const void *Hdr) {
   using namespace llvm::MachO;
 
   // Enumerate segments.
-  uint64_t Slide, Addr;
-  bool HasSlide = false, HasAddr = false;
+  uint64_t Slide = 0;
   auto HdrAddr = reinterpret_cast<uint64_t>(Hdr);
   auto *Header = reinterpret_cast<const mach_header *>(Hdr);
   auto *Cmd = reinterpret_cast<const load_command *>(Header + 1);
@@ -26,38 +30,79 @@ uint64_t MachO::getSection(const char *SegName, const char *SectName,
 
       // Look for segment `__TEXT` to compute slide. Note that section and
       // segment names are not necessarily null-terminated!
-      if (!HasSlide && !strncmp(Seg->segname, "__TEXT", sizeof(Seg->segname))) {
+      if (!strncmp(Seg->segname, "__TEXT", sizeof(Seg->segname)))
         Slide = HdrAddr - Seg->vmaddr;
-        HasSlide = true;
-        if (HasAddr)
-          break;
-      }
-
-      // Enumerate segment's sections.
-      if (!HasAddr && !strncmp(Seg->segname, SegName, sizeof(Seg->segname))) {
-        for (auto *Sect = reinterpret_cast<const section *>(Seg + 1),
-                  *EndSect = Sect + Seg->nsects;
-             Sect != EndSect; ++Sect)
-          if (!strncmp(Sect->sectname, SectName, sizeof(Sect->sectname)) &&
-              !strncmp(Sect->segname, SegName, sizeof(Sect->segname))) {
-            // We have found it.
-            if (Size)
-              *Size = Sect->size;
-            Addr = Sect->addr;
-            HasAddr = true;
-            if (HasSlide)
-              break;
-          }
-      }
+
+      // Addresses are slid after all segments are known. The first segment
+      // or section of the same name is kept.
+      Ranges.try_emplace(makeKey(Seg->segname, ""),
+                         Range{Seg->vmaddr, Seg->vmsize});
+      for (auto *Sect = reinterpret_cast<const section *>(Seg + 1),
+                *EndSect = Sect + Seg->nsects;
+           Sect != EndSect; ++Sect)
+        if (!strncmp(Sect->segname, Seg->segname, sizeof(Sect->segname)))
+          Ranges.try_emplace(makeKey(Sect->segname, Sect->sectname),
+                             Range{Sect->addr, Sect->size});
     }
 
     // Move to the next `load_command`.
     Cmd = reinterpret_cast<const load_command *>(bytes(Cmd) + Cmd->cmdsize);
   }
 
-  if (HasSlide && HasAddr)
-    return Addr + Slide;
-  return 0;
+  for (auto &[Name, R] : Ranges)
+    R.Addr += Slide;
+}
+
+uint64_t SectionTable::getSection(const char *SegName, const char *SectName,
+                                  uint64_t *Size) {
+  auto It = Ranges.find(makeKey(SegName, SectName));
+  if (It == Ranges.end())
+    return 0;
+  if (Size)
+    *Size = It->second.Size;
+  return It->second.Addr;
+}
+
+uint64_t SectionTable::getSegment(const char *SegName, uint64_t *Size) {
+  return getSection(SegName, "", Size);
+}
+
+SectionTable &SectionTable::get(const void *Hdr) {
+  {
+    shared_lock<shared_mutex> Lock(TablesMutex);
+    auto It = Tables.find(Hdr);
+    if (It != Tables.end())
+      return *It->second;
+  }
+
+  unique_lock<shared_mutex> Lock(TablesMutex);
+  unique_ptr<SectionTable> &Table = Tables[Hdr];
+  if (!Table)
+    Table = make_unique<SectionTable>(Hdr);
+  return *Table;
+}
+
+void SectionTable::remove(const void *Hdr) {
+  unique_lock<shared_mutex> Lock(TablesMutex);
+  Tables.erase(Hdr);
+}
+
+size_t SectionTable::KeyHash::operator()(const Key &K) const {
+  // FNV-1a
+  size_t Hash = 2166136261u;
+  for (char C : K) {
+    Hash ^= static_cast<uint8_t>(C);
+    Hash *= 16777619u;
+  }
+  return Hash;
+}
+
+SectionTable::Key SectionTable::makeKey(const char *SegName,
+                                        const char *SectName) {
+  Key K{};
+  strncpy(K.data(), SegName, 16);
+  strncpy(K.data() + 16, SectName, 16);
+  return K;
 }
 
 namespace {
@@ -159,6 +204,8 @@ struct objc_class {
     return (class_rw_t *)((uintptr_t)info & FAST_DATA_MASK);
   }
   bool isRealized() { return data()->flags & RW_REALIZED; }
+  // `vtable` is the rest of `cache_t`, i.e., 16-bit `_mask` and `_occupied`.
+  bool hasCachedMethods() { return reinterpret_cast<uintptr_t>(vtable) >> 16; }
   const class_ro_t *getInfo() { return isRealized() ? data()->ro : info; }
 };
 
@@ -195,53 +242,82 @@ ObjCClass ObjCClass::getCategoryClass() {
                      reinterpret_cast<category_t *>(Data)->cls);
   return ObjCClass();
 }
+bool ObjCClass::isRealized() {
+  return !Category && reinterpret_cast<objc_class *>(Data)->isRealized();
+}
+bool ObjCClass::hasCachedMethods() {
+  if (Category)
+    return false;
+  auto *Class = reinterpret_cast<objc_class *>(Data);
+  return Class->hasCachedMethods() || Class->isa->hasCachedMethods();
+}
+
+uint64_t ObjCMethod::getImp() {
+  return reinterpret_cast<uint64_t>(
+      reinterpret_cast<method_t *>(MethodData)->imp);
+}
+
+vector<ObjCMethod> ObjCMethod::fromList(void *ClassData, void *List) {
+  vector<ObjCMethod> Result;
+  if (auto *Methods = reinterpret_cast<method_list_t *>(List))
+    for (size_t I = 0; I != Methods->count; ++I)
+      Result.emplace_back(/* Category */ false, ClassData,
+                          &Methods->methods[I]);
+  return Result;
+}
 
-static method_t *findMethodImpl(method_list_t *Methods, uint64_t Addr) {
+template <typename FuncTy>
+static method_t *forEachMethodImpl(method_list_t *Methods, FuncTy &Func,
+                                   bool Category, void *ClassData) {
   if (!Methods)
     return nullptr;
   for (size_t J = 0; J != Methods->count; ++J) {
     method_t &Method = Methods->methods[J];
-    if (reinterpret_cast<uint64_t>(Method.imp) == Addr)
+    if (Func(ObjCMethod(Category, ClassData, &Method)))
       return &Method;
   }
   return nullptr;
 }
 
-static method_t *findMethodImpl(objc_class *Class, uint64_t Addr) {
+template <typename FuncTy>
+static method_t *forEachMethodImpl(objc_class *Class, FuncTy &Func) {
   // TODO: Isn't this first part redundant for realized classes?
-  if (method_t *M = findMethodImpl(Class->getInfo()->baseMethodList, Addr))
+  if (method_t *M = forEachMethodImpl(Class->getInfo()->baseMethodList, Func,
+                                      /* Category */ false, Class))
     return M;
   if (Class->isRealized())
     for (auto *L = Class->data()->methods.beginLists(),
               *End = Class->data()->methods.endLists();
          L != End; ++L)
-      if (method_t *M = findMethodImpl(*L, Addr))
+      if (method_t *M =
+              forEachMethodImpl(*L, Func, /* Category */ false, Class))
         return M;
   return nullptr;
 }
 
-ObjCMethod MachO::findMethod(const char *Section, uint64_t Addr) {
+template <typename FuncTy>
+ObjCMethod MachO::forEachMethod(const char *Section, FuncTy &Func) {
   size_t Count;
   if (auto *Classes =
           getSectionData<objc_class *>(MachO::DataSegment, Section, &Count))
     for (size_t I = 0; I != Count; ++I) {
       // Enumerate methods of every class and its meta-class.
       objc_class *Class = Classes[I];
-      if (method_t *M = findMethodImpl(Class, Addr))
+      if (method_t *M = forEachMethodImpl(Class, Func))
         return ObjCMethod(/* Category */ false, Class, M);
-      if (method_t *M = findMethodImpl(Class->isa, Addr))
+      if (method_t *M = forEachMethodImpl(Class->isa, Func))
         return ObjCMethod(/* Category */ false, Class->isa, M);
     }
   return ObjCMethod();
 }
 
-ObjCMethod MachO::findMethod(uint64_t Addr) {
+template <typename FuncTy> ObjCMethod MachO::forEachMethod(FuncTy &&Func) {
   // Enumerate classes in the image.
-  if (ObjCMethod M = findMethod("__objc_classlist", Addr))
+  if (ObjCMethod M = forEachMethod("__objc_classlist", Func))
     return M;
 
   // Try also non-lazy classes.
-  if (ObjCMethod M = findMethod("__objc_nlclslist", Addr))
+  if (ObjCMethod M = forEachMethod("__objc_nlclslist", Func))
     return M;
 
   // Try also categories.
@@ -251,11 +327,93 @@ ObjCMethod MachO::findMethod(uint64_t Addr) {
     for (size_t I = 0; I != Count; ++I) {
       // Enumerate methods of every category.
       category_t *Category = Categories[I];
-      if (method_t *M = findMethodImpl(Category->classMethods, Addr))
+      if (method_t *M = forEachMethodImpl(Category->classMethods, Func,
+                                          /* Category */ true, Category))
         return ObjCMethod(/* Category */ true, Category, M);
-      if (method_t *M = findMethodImpl(Category->instanceMethods, Addr))
+      if (method_t *M = forEachMethodImpl(Category->instanceMethods, Func,
+                                          /* Category */ true, Category))
         return ObjCMethod(/* Category */ true, Category, M);
     }
 
   return ObjCMethod();
 }
+
+ObjCMethod MachO::findMethod(uint64_t Addr) {
+  return forEachMethod([Addr](ObjCMethod M) { return M.getImp() == Addr; });
+}
+
+vector<ObjCClass> MachO::getClasses() {
+  vector<ObjCClass> Result;
+  size_t Count;
+  if (auto *Classes = getSectionData<objc_class *>(
+          MachO::DataSegment, "__objc_classlist", &Count)) {
+    Result.reserve(Count);
+    for (size_t I = 0; I != Count; ++I)
+      Result.emplace_back(/* Category */ false, Classes[I]);
+  }
+  return Result;
+}
+
+ObjCMethod ObjCMethodIndex::find(MachO Image, uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+  if (!Built)
+    build(Image);
+
+  for (bool Rebuilt = false;; Rebuilt = true) {
+    auto It = lower_bound(
+        Entries.begin(), Entries.end(), Addr,
+        [](const Entry &E, uint64_t Addr) { return E.Imp < Addr; });
+    if (It == Entries.end() || It->Imp != Addr)
+      return ObjCMethod();
+    for (; It != Entries.end() && It->Imp == Addr; ++It)
+      if (It->Method.getImp() == Addr)
+        return It->Method;
+
+    // The method list has been reordered since the index was built.
+    if (Rebuilt)
+      return ObjCMethod();
+    build(Image);
+  }
+}
+
+void ObjCMethodIndex::add(ObjCMethod M) {
+  lock_guard<mutex> Lock(Mutex);
+  Entry E{M.getImp(), M};
+  Added.push_back(E);
+  if (!Built)
+    return;
+
+  // Methods found statically take precedence.
+  auto It = upper_bound(
+      Entries.begin(), Entries.end(), E.Imp,
+      [](uint64_t Imp, const Entry &E) { return Imp < E.Imp; });
+  Entries.insert(It, E);
+}
+
+void ObjCMethodIndex::remove(ObjCMethod M, uint64_t Imp) {
+  lock_guard<mutex> Lock(Mutex);
+  auto Matches = [&](const Entry &E) {
+    return E.Imp == Imp && E.Method.isSameAs(M);
+  };
+  Added.erase(remove_if(Added.begin(), Added.end(), Matches), Added.end());
+  auto [Begin, End] = equal_range(
+      Entries.begin(), Entries.end(), Entry{Imp, ObjCMethod()},
+      [](const Entry &A, const Entry &B) { return A.Imp < B.Imp; });
+  Entries.erase(remove_if(Begin, End, Matches), End);
+}
+
+void ObjCMethodIndex::build(MachO Image) {
+  Entries.clear();
+  Image.forEachMethod([this](ObjCMethod M) {
+    Entries.push_back(Entry{M.getImp(), M});
+    return false;
+  });
+  Entries.insert(Entries.end(), Added.begin(), Added.end());
+
+  // Keep the first method of each implementation, so that results are the
+  // same as those of `MachO::findMethod`.
+  stable_sort(Entries.begin(), Entries.end(),
+              [](const Entry &A, const Entry &B) { return A.Imp < B.Imp; });
+  Entries.shrink_to_fit();
+  Built = true;
+}
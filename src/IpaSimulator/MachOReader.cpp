@@ -0,0 +1,426 @@
+// MachOReader.cpp: Implementation of class `MachOReader`.
+
+#include "ipasim/MachOReader.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <llvm/BinaryFormat/MachO.h>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Fat headers are always big-endian.
+uint32_t readBE32(const uint8_t *P) {
+  return (uint32_t(P[0]) << 24) | (uint32_t(P[1]) << 16) |
+         (uint32_t(P[2]) << 8) | uint32_t(P[3]);
+}
+
+// Higher is better, `0` means the slice cannot be used.
+int getSliceScore(uint32_t CPUType, uint32_t CPUSubType) {
+  using namespace llvm::MachO;
+
+  if (CPUType != CPU_TYPE_ARM)
+    return 0;
+  switch (CPUSubType & ~CPU_SUBTYPE_MASK) {
+  case CPU_SUBTYPE_ARM_V7S:
+    return 4;
+  case CPU_SUBTYPE_ARM_V7:
+    return 3;
+  case CPU_SUBTYPE_ARM_V7F:
+  case CPU_SUBTYPE_ARM_V7K:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+} // namespace
+
+bool MachOReader::read(MachOInfo &Info) {
+  return readLoadCommands(Info) &&
+         readRebases(Info, RebaseOffset, RebaseSize) &&
+         readBindings(Info, BindOffset, BindSize, /* Lazy */ false) &&
+         readBindings(Info, Info.LazyBindOffset, Info.LazyBindSize,
+                      /* Lazy */ true) &&
+         readExports(Info, ExportOffset, ExportSize);
+}
+
+bool MachOReader::readLoadCommands(MachOInfo &Info) {
+  using namespace llvm::MachO;
+
+  if (Size < sizeof(mach_header))
+    return false;
+  auto *Header = reinterpret_cast<const mach_header *>(Data);
+  if (Header->magic != MH_MAGIC ||
+      !isInFile(sizeof(mach_header), Header->sizeofcmds))
+    return false;
+  Info.CPUType = Header->cputype;
+  Info.FileType = Header->filetype;
+  Info.Flags = Header->flags;
+
+  const uint8_t *P = Data + sizeof(mach_header);
+  const uint8_t *End = P + Header->sizeofcmds;
+  bool HasDyldInfo = false, HasMain = false;
+  uint64_t EntryOffset = 0;
+  for (size_t I = 0, IEnd = Header->ncmds; I != IEnd; ++I) {
+    auto *Cmd = reinterpret_cast<const load_command *>(P);
+    size_t Remaining = End - P;
+    if (Remaining < sizeof(load_command) ||
+        Cmd->cmdsize < sizeof(load_command) || Remaining < Cmd->cmdsize)
+      return false;
+
+    switch (Cmd->cmd) {
+    case LC_SEGMENT: {
+      auto *Seg = reinterpret_cast<const segment_command *>(Cmd);
+      if (Cmd->cmdsize < sizeof(segment_command) ||
+          !isInFile(Seg->fileoff, Seg->filesize))
+        return false;
+      Info.Segments.push_back(MachOInfo::Segment{
+          Seg->vmaddr, Seg->vmsize, Seg->fileoff, Seg->filesize,
+          static_cast<uint32_t>(Seg->initprot), Data + Seg->fileoff});
+
+      // Mach-O header is mapped at the start of the first segment with some
+      // file content (i.e., `__TEXT`).
+      if (Seg->fileoff == 0 && Seg->filesize)
+        Info.HeaderAddr = Seg->vmaddr;
+      break;
+    }
+    case LC_LOAD_DYLIB:
+    case LC_LOAD_WEAK_DYLIB:
+    case LC_REEXPORT_DYLIB:
+    case LC_LAZY_LOAD_DYLIB:
+    case LC_LOAD_UPWARD_DYLIB: {
+      auto *Lib = reinterpret_cast<const dylib_command *>(Cmd);
+      if (Cmd->cmdsize < sizeof(dylib_command) ||
+          Lib->dylib.name >= Cmd->cmdsize)
+        return false;
+      const char *Name = reinterpret_cast<const char *>(P) + Lib->dylib.name;
+      Info.Dylibs.push_back(MachOInfo::Dylib{
+          string(Name, strnlen(Name, Cmd->cmdsize - Lib->dylib.name)),
+          Cmd->cmd == LC_REEXPORT_DYLIB});
+      break;
+    }
+    case LC_DYLD_INFO:
+    case LC_DYLD_INFO_ONLY: {
+      auto *DI = reinterpret_cast<const dyld_info_command *>(Cmd);
+      if (Cmd->cmdsize < sizeof(dyld_info_command) ||
+          !isInFile(DI->rebase_off, DI->rebase_size) ||
+          !isInFile(DI->bind_off, DI->bind_size) ||
+          !isInFile(DI->lazy_bind_off, DI->lazy_bind_size) ||
+          !isInFile(DI->export_off, DI->export_size))
+        return false;
+      RebaseOffset = DI->rebase_off;
+      RebaseSize = DI->rebase_size;
+      BindOffset = DI->bind_off;
+      BindSize = DI->bind_size;
+      Info.LazyBindOffset = DI->lazy_bind_off;
+      Info.LazyBindSize = DI->lazy_bind_size;
+      ExportOffset = DI->export_off;
+      ExportSize = DI->export_size;
+      HasDyldInfo = true;
+      break;
+    }
+    case LC_MAIN: {
+      auto *Main = reinterpret_cast<const entry_point_command *>(Cmd);
+      if (Cmd->cmdsize < sizeof(entry_point_command))
+        return false;
+      EntryOffset = Main->entryoff;
+      HasMain = true;
+      break;
+    }
+    case LC_UNIXTHREAD: {
+      // Flavor and count are followed by `arm_thread_state`, where PC is the
+      // sixteenth register.
+      auto *Words = reinterpret_cast<const uint32_t *>(Cmd + 1);
+      constexpr uint32_t ARM_THREAD_STATE = 1;
+      if (Cmd->cmdsize >= sizeof(load_command) + 18 * sizeof(uint32_t) &&
+          Words[0] == ARM_THREAD_STATE)
+        Info.EntryPoint = Words[2 + 15];
+      break;
+    }
+    case LC_SEGMENT_64:
+      return false;
+    }
+
+    P += Cmd->cmdsize;
+  }
+
+  if (HasMain)
+    Info.EntryPoint = Info.HeaderAddr + EntryOffset;
+
+  // Binaries without dyld info use classic relocations.
+  return HasDyldInfo;
+}
+
+bool MachOReader::findSlice(const uint8_t *Data, size_t Size,
+                            uint64_t &Offset, uint64_t &SliceSize) {
+  using namespace llvm::MachO;
+
+  Offset = 0;
+  SliceSize = Size;
+  if (Size < sizeof(fat_header) || readBE32(Data) != FAT_MAGIC)
+    return true;
+
+  uint32_t Count = readBE32(Data + offsetof(fat_header, nfat_arch));
+  if (Count > (Size - sizeof(fat_header)) / sizeof(fat_arch))
+    return false;
+  int BestScore = 0;
+  for (uint32_t I = 0; I != Count; ++I) {
+    const uint8_t *Arch = Data + sizeof(fat_header) + I * sizeof(fat_arch);
+    int Score = getSliceScore(readBE32(Arch + offsetof(fat_arch, cputype)),
+                              readBE32(Arch + offsetof(fat_arch, cpusubtype)));
+    uint32_t ArchOffset = readBE32(Arch + offsetof(fat_arch, offset));
+    uint32_t ArchSize = readBE32(Arch + offsetof(fat_arch, size));
+    if (Score > BestScore && ArchOffset <= Size &&
+        ArchSize <= Size - ArchOffset) {
+      BestScore = Score;
+      Offset = ArchOffset;
+      SliceSize = ArchSize;
+    }
+  }
+  return BestScore != 0;
+}
+
+uint64_t MachOReader::readULEB128(const uint8_t *&P, const uint8_t *End) {
+  uint64_t Result = 0;
+  for (unsigned Shift = 0; P != End; Shift += 7) {
+    uint8_t Byte = *P++;
+    if (Shift < 64)
+      Result |= uint64_t(Byte & 0x7F) << Shift;
+    if (!(Byte & 0x80))
+      break;
+  }
+  return Result;
+}
+
+int64_t MachOReader::readSLEB128(const uint8_t *&P, const uint8_t *End) {
+  int64_t Result = 0;
+  unsigned Shift = 0;
+  uint8_t Byte = 0;
+  while (P != End) {
+    Byte = *P++;
+    if (Shift < 64)
+      Result |= int64_t(Byte & 0x7F) << Shift;
+    Shift += 7;
+    if (!(Byte & 0x80))
+      break;
+  }
+  // Sign-extend.
+  if ((Byte & 0x40) && Shift < 64)
+    Result |= -(int64_t(1) << Shift);
+  return Result;
+}
+
+// Inspired by `ImageLoaderMachOCompressed::rebase`.
+bool MachOReader::readRebases(MachOInfo &Info, uint32_t Offset,
+                              uint32_t Size) {
+  constexpr uint32_t PtrSize = sizeof(uint32_t);
+  const uint8_t *P = Data + Offset;
+  const uint8_t *End = P + Size;
+  uint8_t Type = 0;
+  uint32_t Addr = 0;
+  bool HasAddr = false;
+
+  auto Rebase = [&](uint64_t Count, uint64_t Skip) {
+    if (Type != REBASE_TYPE_POINTER || !HasAddr || Skip > UINT32_MAX)
+      return false;
+    uint32_t Stride = static_cast<uint32_t>(Skip + PtrSize);
+    Info.addRebases(Addr, Count, Stride);
+    Addr += static_cast<uint32_t>(Count * Stride);
+    return true;
+  };
+
+  while (P < End) {
+    uint8_t Imm = *P & REBASE_IMMEDIATE_MASK;
+    uint8_t Opcode = *P & REBASE_OPCODE_MASK;
+    ++P;
+    switch (Opcode) {
+    case REBASE_OPCODE_DONE:
+      return true;
+    case REBASE_OPCODE_SET_TYPE_IMM:
+      Type = Imm;
+      break;
+    case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      if (Imm >= Info.Segments.size())
+        return false;
+      Addr = static_cast<uint32_t>(Info.Segments[Imm].VMAddr +
+                                   readULEB128(P, End));
+      HasAddr = true;
+      break;
+    case REBASE_OPCODE_ADD_ADDR_ULEB:
+      Addr += static_cast<uint32_t>(readULEB128(P, End));
+      break;
+    case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+      Addr += Imm * PtrSize;
+      break;
+    case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+      if (!Rebase(Imm, 0))
+        return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ULEB_TIMES:
+      if (!Rebase(readULEB128(P, End), 0))
+        return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+      if (!Rebase(1, readULEB128(P, End)))
+        return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB: {
+      uint64_t Count = readULEB128(P, End);
+      if (!Rebase(Count, readULEB128(P, End)))
+        return false;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Inspired by `ImageLoaderMachOCompressed::eachBind` and
+// `ImageLoaderMachOCompressed::doBindFastLazySymbol`. Only two-level namespace
+// pointer bindings without addends are supported.
+bool MachOReader::readBindings(MachOInfo &Info, uint32_t Offset,
+                               uint32_t Size, bool Lazy) {
+  constexpr uint32_t PtrSize = sizeof(uint32_t);
+  const uint8_t *P = Data + Offset;
+  const uint8_t *End = P + Size;
+  uint64_t Ordinal = 0;
+  const char *Symbol = nullptr;
+  uint8_t Type = BIND_TYPE_POINTER;
+  int64_t Addend = 0;
+  uint32_t Addr = 0;
+  const MachOInfo::Segment *Seg = nullptr; // Of the last `Addr` set
+
+  auto Bind = [&](uint64_t Count, uint64_t Skip) {
+    if (Type != BIND_TYPE_POINTER || Addend || !Symbol || !Seg || !Ordinal ||
+        Ordinal > Info.Dylibs.size() || Skip > UINT32_MAX)
+      return false;
+    // The whole run must stay inside the segment, so that a huge `Count`
+    // cannot make us record (and later write) pointers outside of the image.
+    uint64_t Stride = Skip + PtrSize, SegEnd = Seg->VMAddr + Seg->VMSize;
+    if (Count && (Addr < Seg->VMAddr || uint64_t(Addr) + PtrSize > SegEnd ||
+                  Count - 1 > (SegEnd - PtrSize - Addr) / Stride))
+      return false;
+    for (uint64_t I = 0; I != Count; ++I) {
+      Info.Bindings.push_back(MachOInfo::Binding{
+          Addr, &Info.Dylibs[Ordinal - 1].Name, Symbol, Lazy});
+      Addr += static_cast<uint32_t>(Stride);
+    }
+    return true;
+  };
+
+  while (P < End) {
+    uint8_t Imm = *P & BIND_IMMEDIATE_MASK;
+    uint8_t Opcode = *P & BIND_OPCODE_MASK;
+    ++P;
+    switch (Opcode) {
+    case BIND_OPCODE_DONE:
+      // Lazy bindings are separated by this opcode.
+      if (!Lazy)
+        return true;
+      break;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+      Ordinal = Imm;
+      break;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+      Ordinal = readULEB128(P, End);
+      break;
+    case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+      Symbol = reinterpret_cast<const char *>(P);
+      P += strnlen(Symbol, End - P) + 1;
+      if (P > End)
+        return false;
+      break;
+    case BIND_OPCODE_SET_TYPE_IMM:
+      Type = Imm;
+      break;
+    case BIND_OPCODE_SET_ADDEND_SLEB:
+      Addend = readSLEB128(P, End);
+      break;
+    case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      if (Imm >= Info.Segments.size())
+        return false;
+      Seg = &Info.Segments[Imm];
+      Addr = static_cast<uint32_t>(Seg->VMAddr + readULEB128(P, End));
+      break;
+    case BIND_OPCODE_ADD_ADDR_ULEB:
+      Addr += static_cast<uint32_t>(readULEB128(P, End));
+      break;
+    case BIND_OPCODE_DO_BIND:
+      if (!Bind(1, 0))
+        return false;
+      break;
+    case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+      if (!Bind(1, readULEB128(P, End)))
+        return false;
+      break;
+    case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+      if (!Bind(1, Imm * PtrSize))
+        return false;
+      break;
+    case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB: {
+      uint64_t Count = readULEB128(P, End);
+      if (!Bind(Count, readULEB128(P, End)))
+        return false;
+      break;
+    }
+    default:
+      // E.g., `BIND_OPCODE_SET_DYLIB_SPECIAL_IMM` (flat namespace).
+      return false;
+    }
+  }
+  return true;
+}
+
+// Inspired by `ImageLoaderMachOCompressed::trieWalk`, but enumerates the whole
+// trie. Only regular symbols are collected.
+bool MachOReader::readExports(MachOInfo &Info, uint32_t Offset,
+                              uint32_t Size) {
+  if (!Size)
+    return true;
+
+  const uint8_t *Start = Data + Offset;
+  const uint8_t *End = Start + Size;
+  vector<pair<uint64_t, string>> Stack{{0, string()}};
+  // Valid tries are trees, so each node is visited at most once.
+  for (size_t Visited = 0; !Stack.empty(); ++Visited) {
+    if (Visited > Size)
+      return false;
+    auto [NodeOffset, Name] = move(Stack.back());
+    Stack.pop_back();
+    if (NodeOffset >= Size)
+      return false;
+
+    const uint8_t *P = Start + NodeOffset;
+    uint64_t TerminalSize = readULEB128(P, End);
+    if (TerminalSize > static_cast<uint64_t>(End - P))
+      return false;
+    const uint8_t *Children = P + TerminalSize;
+    if (TerminalSize) {
+      uint64_t Flags = readULEB128(P, End);
+      if (!(Flags & EXPORT_SYMBOL_FLAGS_REEXPORT) &&
+          (Flags & EXPORT_SYMBOL_FLAGS_KIND_MASK) ==
+              EXPORT_SYMBOL_FLAGS_KIND_REGULAR)
+        Info.Exports.emplace_back(Name,
+                                  Info.HeaderAddr + readULEB128(P, End));
+    }
+
+    P = Children;
+    if (P == End)
+      return false;
+    for (uint8_t I = 0, Count = *P++; I != Count; ++I) {
+      const char *Edge = reinterpret_cast<const char *>(P);
+      size_t Length = strnlen(Edge, End - P);
+      P += Length + 1;
+      if (P > End)
+        return false;
+      uint64_t ChildOffset = readULEB128(P, End);
+      Stack.emplace_back(ChildOffset, Name + string(Edge, Length));
+    }
+  }
+  return true;
+}
@@ -0,0 +1,313 @@
+// Microbenchmarks.cpp: Host-side benchmarks of `IpaSimLibrary`'s internals.
+// It's compiled together with the library's sources (see `CMakeLists.txt`),
+// so that it can use classes which are not exported. Each benchmark prints
+// average time of one operation, so that regressions in the hot paths of
+// `SysTranslator` and `DynamicLoader` can be found without running an app.
+//
+// Usage: `IpaSimMicrobenchmarks [--dll <path>]... [--dylib <path> <symbol>]`.
+// DLLs are used by `lookup` and `findMethod` benchmarks (WinObjC DLLs with
+// Objective-C metadata are the interesting ones). Symbol of the Dylib is
+// called through a trampoline, so it should be a function without arguments
+// that doesn't need initialized runtime.
+//
+// NEON benchmarks run small guest loops in the emulator, so that changes of the
+// engine's SIMD helpers (in our Unicorn fork) can be measured.
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/Logger.hpp"
+#include "ipasim/MachOReader.hpp"
+#include "ipasim/SysTranslator.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <llvm/BinaryFormat/MachO.h>
+#include <string>
+#include <vector>
+
+using namespace ipasim;
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Prevents the compiler from optimizing benchmarked code away.
+volatile uint64_t Sink;
+
+// Runs `Func(I)` for `I < Iterations` (after a short warm-up) and prints the
+// average time of one iteration.
+template <typename FuncTy>
+void bench(const char *Name, size_t Iterations, FuncTy &&Func) {
+  for (size_t I = 0, Warmup = Iterations / 10 + 1; I != Warmup; ++I)
+    Func(I);
+  auto Start = steady_clock::now();
+  for (size_t I = 0; I != Iterations; ++I)
+    Func(I);
+  double Total = duration<double, nano>(steady_clock::now() - Start).count();
+  printf("%-40s %12.1f ns/op\n", Name, Total / Iterations);
+}
+
+extern "C" void nativeTarget(uint32_t, uint32_t) { ++Sink; }
+
+void benchTypeDecoder() {
+  static const char *const Types[] = {"v8@0:4", "@12@0:4@8", "c16@0:4@8@12",
+                                      "{CGRect={CGPoint=ff}{CGSize=ff}}8@0:4",
+                                      "v24@0:4{CGPoint=ff}8d16"};
+  for (const char *Type : Types) {
+    string Name(string("TypeDecoder ") + Type);
+    bench(Name.c_str(), 100000, [&](size_t) {
+      CallShape Shape;
+      Sink += TypeDecoder(Type).decode(Shape);
+    });
+  }
+}
+
+void benchDynamicCaller() {
+  CallShape Shape;
+  if (!TypeDecoder("v8@0:4").decode(Shape)) {
+    Log.error("cannot decode shape for DynamicCaller");
+    return;
+  }
+  uint64_t Target = reinterpret_cast<uint64_t>(&nativeTarget);
+  bench("DynamicCaller::call v8@0:4", 1000000, [&](size_t) {
+    DynamicCaller DC(IpaSim.Emu, Shape);
+    DC.call(Target);
+  });
+}
+
+void benchTrampolines() {
+  TrampolineArena Arena;
+  auto Entry = [](Trampoline *, const uint8_t *) {};
+  bench("TrampolineArena allocate+release", 1000000, [&](size_t) {
+    void *Code;
+    Arena.release(Arena.allocate(Entry, Code));
+  });
+
+  vector<void *> Codes(1024);
+  for (void *&Code : Codes)
+    Arena.allocate(Entry, Code);
+  bench("TrampolineArena::lookup", 1000000, [&](size_t I) {
+    Sink += reinterpret_cast<uintptr_t>(Arena.lookup(Codes[I % Codes.size()]));
+  });
+}
+
+void benchLogger() {
+  bench("Logger<StringStream> formatting", 1000000, [](size_t I) {
+    Logger<StringStream> L;
+    L.info() << "calling " << "objc_msgSend" << " at " << I << " from "
+             << "UIKit.dll" << L.end();
+    Sink += L.infs().str().size();
+  });
+}
+
+// Builds an in-memory Mach-O of `Size` bytes with one segment covering the
+// whole file and rebase opcodes sliding every used pointer of it.
+vector<uint8_t> createMachO(size_t Size) {
+  using namespace llvm::MachO;
+
+  vector<uint8_t> Data(Size);
+  constexpr uint32_t CmdsSize =
+      sizeof(segment_command) + sizeof(dyld_info_command);
+  constexpr uint32_t Start = 0x1000;
+
+  // Rebases have irregular gaps, so that they don't form a single run.
+  vector<uint8_t> Opcodes;
+  Opcodes.push_back(REBASE_OPCODE_SET_TYPE_IMM | REBASE_TYPE_POINTER);
+  Opcodes.push_back(REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB);
+  Opcodes.insert(Opcodes.end(), {0x80, 0x20}); // ULEB128 of `Start`
+  size_t Count = (Size - Start) / 16;
+  for (size_t I = 0; I != Count; ++I) {
+    Opcodes.push_back(REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB);
+    Opcodes.push_back(static_cast<uint8_t>((I % 3) * 4));
+  }
+  Opcodes.push_back(REBASE_OPCODE_DONE);
+  uint32_t RebaseOff = static_cast<uint32_t>(Size - Opcodes.size());
+  memcpy(Data.data() + RebaseOff, Opcodes.data(), Opcodes.size());
+
+  uint8_t *P = Data.data();
+  auto *Header = reinterpret_cast<mach_header *>(P);
+  Header->magic = MH_MAGIC;
+  Header->cputype = CPU_TYPE_ARM;
+  Header->cpusubtype = CPU_SUBTYPE_ARM_V7;
+  Header->filetype = MH_DYLIB;
+  Header->ncmds = 2;
+  Header->sizeofcmds = CmdsSize;
+  P += sizeof(mach_header);
+
+  auto *Seg = reinterpret_cast<segment_command *>(P);
+  Seg->cmd = LC_SEGMENT;
+  Seg->cmdsize = sizeof(segment_command);
+  strcpy(Seg->segname, "__DATA");
+  Seg->vmsize = Seg->filesize = static_cast<uint32_t>(Size);
+  Seg->maxprot = Seg->initprot = VM_PROT_READ | VM_PROT_WRITE;
+  P += sizeof(segment_command);
+
+  auto *DI = reinterpret_cast<dyld_info_command *>(P);
+  DI->cmd = LC_DYLD_INFO_ONLY;
+  DI->cmdsize = sizeof(dyld_info_command);
+  DI->rebase_off = RebaseOff;
+  DI->rebase_size = static_cast<uint32_t>(Opcodes.size());
+  return Data;
+}
+
+void benchMachOReader() {
+  vector<uint8_t> Data(createMachO(50 * 1024 * 1024));
+  size_t Rebases = 0;
+  bench("MachOReader::read (50 MB)", 20, [&](size_t) {
+    MachOInfo Info;
+    if (!MachOReader(Data.data(), Data.size()).read(Info))
+      Log.error("cannot read synthetic Mach-O");
+    Rebases = Info.Rebases.size();
+  });
+  printf("  (%zu rebase runs)\n", Rebases);
+}
+
+// Guest loops executing NEON instructions typical for image, audio and crypto
+// code. Each one is repeated `NeonUnroll` times inside the loop.
+struct NeonKernel {
+  const char *Name;
+  uint32_t Insns[2]; // Alternated (e.g., a load and a store)
+};
+constexpr NeonKernel NeonKernels[] = {
+    {"vadd.i8 q0, q1, q2", {0xF2020844, 0xF2020844}},
+    {"vmul.f32 q0, q1, q2", {0xF3020D54, 0xF3020D54}},
+    {"vmla.f32 q0, q1, q2", {0xF2020D54, 0xF2020D54}},
+    {"vqadd.s16 q0, q1, q2", {0xF2120054, 0xF2120054}},
+    {"vtbl.8 d0, {d2, d3}, d4", {0xF3B20904, 0xF3B20904}},
+    // `vld2.8 {d0-d3}, [r0]` and `vst2.8 {d0-d3}, [r1]`
+    {"vld2.8/vst2.8 {d0-d3}", {0xF420030F, 0xF401030F}},
+};
+constexpr size_t NeonUnroll = 8, NeonPasses = 1000;
+
+void stopNeon(uc_engine *, uint64_t, uint32_t, void *) { IpaSim.Emu.stop(); }
+
+void benchNeon() {
+  constexpr uint64_t Size = DynamicLoader::PageSize;
+  auto *Code = reinterpret_cast<uint32_t *>(
+      IpaSim.Dyld.getArena().allocate(2 * Size));
+  if (!Code) {
+    Log.error("cannot allocate memory for NEON benchmarks");
+    return;
+  }
+  uint64_t CodeAddr = reinterpret_cast<uint64_t>(Code);
+  uint64_t DataAddr = CodeAddr + Size;
+  memset(reinterpret_cast<void *>(DataAddr), 0x5A, Size);
+
+  // Every kernel gets its own loop, so that the code is written only once.
+  constexpr size_t LoopSize = NeonUnroll + 3;
+  static_assert(size(NeonKernels) * LoopSize * 4 <= Size);
+  for (size_t K = 0; K != size(NeonKernels); ++K) {
+    uint32_t *Loop = Code + K * LoopSize;
+    for (size_t I = 0; I != NeonUnroll; ++I)
+      Loop[I] = NeonKernels[K].Insns[I % 2];
+    Loop[NeonUnroll] = 0xE2522001; // subs r2, r2, #1
+    // bne <loop start>
+    Loop[NeonUnroll + 1] = 0x1A000000 | ((-int32_t(NeonUnroll) - 3) & 0xFFFFFF);
+    Loop[NeonUnroll + 2] = 0xE320F000; // nop
+  }
+  IpaSim.Emu.mapMemory(CodeAddr, Size, UC_PROT_READ | UC_PROT_EXEC);
+  IpaSim.Emu.mapMemory(DataAddr, Size, UC_PROT_READ | UC_PROT_WRITE);
+
+  // NEON is disabled after reset.
+  IpaSim.Emu.writeReg(UC_ARM_REG_FPEXC, 0x40000000);
+
+  auto Data = static_cast<uint32_t>(DataAddr);
+  for (size_t K = 0; K != size(NeonKernels); ++K) {
+    uint64_t Start = CodeAddr + K * LoopSize * 4;
+    // Emulation is stopped by a hook on the instruction after the loop.
+    uint64_t End = Start + (NeonUnroll + 2) * 4;
+    auto Stop = IpaSim.Emu.hook(UC_HOOK_CODE, &stopNeon, nullptr, End, End);
+
+    string Name(string("Emulated ") + NeonKernels[K].Name + " (x" +
+                to_string(NeonUnroll * NeonPasses) + ")");
+    bench(Name.c_str(), 100, [&](size_t) {
+      IpaSim.Emu.writeRegs({UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2},
+                           {Data, Data + 256, uint32_t(NeonPasses)});
+      IpaSim.Emu.start(Start);
+    });
+  }
+}
+
+void benchLibraries(const vector<LoadedLibrary *> &Libs) {
+  if (Libs.empty())
+    return;
+
+  // Addresses spread over all images, so that every one of them is found.
+  vector<uint64_t> Addrs;
+  for (LoadedLibrary *Lib : Libs)
+    for (uint64_t I = 0; I != 64; ++I)
+      Addrs.push_back(Lib->getStart() + Lib->Size * I / 64);
+  string Name("DynamicLoader::lookup (" + to_string(Libs.size()) +
+              " images)");
+  bench(Name.c_str(), 1000000, [&](size_t I) {
+    Sink += reinterpret_cast<uintptr_t>(
+        IpaSim.Dyld.lookup(Addrs[I % Addrs.size()]).Lib);
+  });
+
+  for (LoadedLibrary *Lib : Libs) {
+    if (!Lib->hasMachO())
+      continue;
+    // The first call builds the index.
+    Lib->findMethod(Lib->getStart());
+    Name = "findMethod (" + to_string(Lib->Size >> 10) + " kB image)";
+    bench(Name.c_str(), 100000, [&](size_t I) {
+      Sink += Lib->findMethod(Lib->getStart() + Lib->Size * (I % 997) / 997)
+                  .RVA;
+    });
+  }
+}
+
+void benchTrampolineCalls(const char *Path, const char *Symbol) {
+  LoadedLibrary *Lib = IpaSim.Dyld.load(Path);
+  if (!Lib)
+    return;
+  uint64_t Addr = Lib->findSymbol(IpaSim.Dyld, Symbol);
+  if (!Addr) {
+    Log.error() << "cannot find symbol " << Symbol << Log.end();
+    return;
+  }
+
+  void *FP = reinterpret_cast<void *>(Addr);
+  bench("SysTranslator::translate (cached)", 1000000,
+        [&](size_t) { Sink += !!IpaSim.Sys.translate(FP, 0, true); });
+  auto *Func = reinterpret_cast<uint32_t (*)()>(
+      IpaSim.Sys.translate(FP, 0, /* Returns */ true));
+  bench("Call through trampoline", 10000, [&](size_t) { Sink += Func(); });
+}
+
+} // namespace
+
+int main(int ArgC, char **ArgV) {
+  IpaSim.LogText.init(stdout);
+
+  vector<LoadedLibrary *> Libs;
+  const char *DylibPath = nullptr, *Symbol = nullptr;
+  for (int I = 1; I != ArgC; ++I) {
+    if (!strcmp(ArgV[I], "--dll") && I + 1 < ArgC) {
+      if (LoadedLibrary *Lib = IpaSim.Dyld.load(ArgV[++I]))
+        Libs.push_back(Lib);
+    } else if (!strcmp(ArgV[I], "--dylib") && I + 2 < ArgC) {
+      DylibPath = ArgV[++I];
+      Symbol = ArgV[++I];
+    } else {
+      fprintf(stderr,
+              "usage: %s [--dll <path>]... [--dylib <path> <symbol>]\n",
+              ArgV[0]);
+      return 1;
+    }
+  }
+
+  benchTypeDecoder();
+  benchDynamicCaller();
+  benchTrampolines();
+  benchLogger();
+  benchMachOReader();
+  benchNeon();
+  benchLibraries(Libs);
+  if (DylibPath)
+    benchTrampolineCalls(DylibPath, Symbol);
+  return 0;
+}
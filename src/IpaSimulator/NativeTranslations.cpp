@@ -0,0 +1,53 @@
+// NativeTranslations.cpp: Implementation of class `NativeTranslations`.
+
+#include "ipasim/NativeTranslations.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/LoadedLibrary.hpp"
+
+#include <Windows.h>
+#include <filesystem>
+#include <winrt/base.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace winrt;
+
+void NativeTranslations::load(LoadedLibrary *Lib, const string &Path) {
+  if constexpr (!NativeTranslationsEnabled)
+    return;
+  string DLLPath(Path + ".lifted.dll");
+  error_code Error;
+  if (!filesystem::exists(DLLPath, Error))
+    return;
+
+  HMODULE DLL = LoadPackagedLibrary(to_hstring(DLLPath).c_str(), 0);
+  if (!DLL) {
+    Log.error() << "couldn't load translations " << DLLPath << Log.end();
+    return;
+  }
+  auto *Table = reinterpret_cast<const NativeTranslation *>(
+      GetProcAddress(DLL, TableSymbol));
+  if (!Table) {
+    Log.error() << "translations " << DLLPath << " have no table"
+                << Log.end();
+    FreeLibrary(DLL);
+    return;
+  }
+
+  // The DLL stays loaded, its functions can be running on any thread.
+  size_t Count = 0;
+  for (; Table->Function; ++Table, ++Count) {
+    if (Table->Offset - Lib->VMAddr >= Lib->Size) {
+      Log.error() << "translated function outside of the image ("
+                  << DLLPath << ")" << Log.end();
+      continue;
+    }
+    uint64_t Addr = Lib->StartAddress + Table->Offset;
+    if (Functions.emplace(Addr, *Table).second)
+      Addrs.push_back(Addr);
+  }
+  Log.info() << "loaded " << Count << " translated functions from " << DLLPath
+             << Log.end();
+}
@@ -0,0 +1,81 @@
+// PrelinkCache.cpp: Implementation of class `PrelinkCache`.
+
+#include "ipasim/PrelinkCache.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/Common.hpp"
+
+#include <fstream>
+
+using namespace ipasim;
+using namespace std;
+
+PrelinkCache::PrelinkCache(const string &Path)
+    : Path(Path), Stamp(getFileStamp(Path)) {}
+
+bool PrelinkCache::load() {
+  if (!Stamp)
+    return false;
+  for (const filesystem::path &File :
+       getCacheFiles("prelink", to_hex_string(Stamp))) {
+    ifstream I(File, ios::binary);
+    if (I && parse(I))
+      return true;
+  }
+  return false;
+}
+
+bool PrelinkCache::parse(istream &I) {
+  uint32_t FileMagic, FileVersion, LibCount, BindingCount;
+  string FilePath;
+  if (!read(I, FileMagic) || FileMagic != Magic || !read(I, FileVersion) ||
+      FileVersion != Version || !read(I, FilePath) || FilePath != Path ||
+      !read(I, LibCount))
+    return false;
+
+  // Check that no library has changed.
+  Libs.resize(LibCount);
+  for (string &Lib : Libs) {
+    uint64_t LibStamp;
+    if (!read(I, Lib) || !read(I, LibStamp) || getFileStamp(Lib) != LibStamp)
+      return false;
+  }
+
+  if (!read(I, BindingCount))
+    return false;
+  Bindings.resize(BindingCount);
+  return static_cast<bool>(
+      I.read(reinterpret_cast<char *>(Bindings.data()),
+             BindingCount * sizeof(Binding)));
+}
+
+bool PrelinkCache::save() {
+  if (!Stamp)
+    return false;
+  error_code Error;
+  filesystem::path Dir(getCacheDir("prelink"));
+  filesystem::create_directories(Dir, Error);
+  ofstream O(Dir / to_hex_string(Stamp), ios::binary | ios::trunc);
+  if (!O)
+    return false;
+
+  write(O, Magic);
+  write(O, Version);
+  write(O, Path);
+  write(O, static_cast<uint32_t>(Libs.size()));
+  for (const string &Lib : Libs) {
+    write(O, Lib);
+    write(O, getFileStamp(Lib));
+  }
+  write(O, static_cast<uint32_t>(Bindings.size()));
+  O.write(reinterpret_cast<const char *>(Bindings.data()),
+          Bindings.size() * sizeof(Binding));
+  return static_cast<bool>(O);
+}
+
+uint32_t PrelinkCache::addLib(const string &Lib) {
+  auto [It, New] = LibIndices.try_emplace(Lib, Libs.size());
+  if (New)
+    Libs.push_back(Lib);
+  return It->second;
+}
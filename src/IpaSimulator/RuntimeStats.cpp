@@ -0,0 +1,61 @@
+// RuntimeStats.cpp: Implementation of class `RuntimeStats`.
+
+#include "ipasim/RuntimeStats.hpp"
+
+#include <iterator>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Indexed by `Stat`
+constexpr const char *Names[] = {"emulator_starts",
+                                 "emulator_stops",
+                                 "budget_slices",
+                                 "pretranslations",
+                                 "prerealized_classes",
+                                 "kernel_returns",
+                                 "stub_binds",
+                                 "unslid_images",
+                                 "guest_mallocs",
+                                 "malloc_batches",
+                                 "string_functions",
+                                 "dyld_functions",
+                                 "tsd_functions",
+                                 "spin_locks",
+                                 "spin_waits",
+                                 "spin_yields",
+                                 "wrapper_calls",
+                                 "fast_returns",
+                                 "deferred_calls",
+                                 "dylib_calls",
+                                 "dynamic_calls",
+                                 "direct_calls",
+                                 "unresolved_calls",
+                                 "callbacks",
+                                 "unmapped_faults",
+                                 "call_target_hits",
+                                 "call_target_misses",
+                                 "shape_hits",
+                                 "shape_misses",
+                                 "message_cache_misses",
+                                 "trampolines_created",
+                                 "translated_calls",
+                                 "ui_calls",
+                                 "ui_batches",
+                                 "main_loop_turns",
+                                 "parked_waits",
+                                 "emulation_ns",
+                                 "native_ns",
+                                 "main_loop_ns",
+                                 "profiler_samples",
+                                 "heap_allocations",
+                                 "heap_bytes"};
+static_assert(size(Names) == static_cast<size_t>(Stat::Count));
+
+} // namespace
+
+const char *RuntimeStats::getName(Stat S) {
+  return Names[static_cast<size_t>(S)];
+}
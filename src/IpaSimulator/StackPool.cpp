@@ -0,0 +1,137 @@
+// StackPool.cpp: Implementation of class `StackPool`.
+
+#include "ipasim/StackPool.hpp"
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/GuestArena.hpp"
+#include "ipasim/GuestMemoryMap.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+
+using namespace ipasim;
+using namespace std;
+
+GuestStack *StackPool::acquire(uint64_t Size) {
+  Size = DynamicLoader::roundToPageSize(Size);
+  lock_guard<mutex> Lock(Mutex);
+
+  // Reuse stack of the same size if possible.
+  auto It = find_if(FreeStacks.begin(), FreeStacks.end(), [&](GuestStack *S) {
+    return S->Top - S->Base == Size;
+  });
+  if (It != FreeStacks.end()) {
+    GuestStack *S = *It;
+    FreeStacks.erase(It);
+    return S;
+  }
+
+  if (Size <= DynamicLoader::PageSize) {
+    Log.error() << "guest stack of " << Size << " bytes is too small"
+                << Log.end();
+    return nullptr;
+  }
+  void *Ptr = Arena.allocateReserved(Size);
+  if (!Ptr)
+    Ptr = VirtualAllocFromApp(nullptr, Size, MEM_RESERVE, PAGE_READWRITE);
+  if (!Ptr) {
+    Log.winError("couldn't reserve guest stack");
+    return nullptr;
+  }
+
+  // Commit the top of the stack right away.
+  uint64_t Base = reinterpret_cast<uint64_t>(Ptr);
+  auto S = make_unique<GuestStack>(GuestStack{Base, Base + Size, Base + Size});
+  if (!commit(*S, max(Base + DynamicLoader::PageSize, S->Top - CommitStep)))
+    return nullptr;
+  GuestStack *Result = S.get();
+  ByTop[Result->Top] = Result;
+  Stacks.push_back(move(S));
+  return Result;
+}
+
+void StackPool::release(GuestStack *S) {
+  if (!S)
+    return;
+  lock_guard<mutex> Lock(Mutex);
+
+  // Keep only the initially committed part.
+  uint64_t Keep = max(S->Base + DynamicLoader::PageSize, S->Top - CommitStep);
+  if (S->Committed < Keep) {
+    Space.unmapRange(S->Committed, Keep - S->Committed);
+    if (VirtualFree(reinterpret_cast<void *>(S->Committed),
+                    Keep - S->Committed, MEM_DECOMMIT))
+      S->Committed = Keep;
+    else
+      Log.winError("couldn't decommit guest stack");
+  }
+  FreeStacks.push_back(S);
+}
+
+uint64_t StackPool::getCommittedBytes() {
+  lock_guard<mutex> Lock(Mutex);
+  uint64_t Bytes = 0;
+  for (const unique_ptr<GuestStack> &S : Stacks)
+    Bytes += S->Top - S->Committed;
+  return Bytes;
+}
+
+uint64_t StackPool::trim() {
+  lock_guard<mutex> Lock(Mutex);
+  uint64_t Bytes = 0;
+  for (GuestStack *S : FreeStacks) {
+    // The top page stays, so that `SysTranslator::initialize` can point the
+    // stack pointer into it. The rest is committed again on fault.
+    uint64_t Keep = S->Top - DynamicLoader::PageSize;
+    if (S->Committed >= Keep)
+      continue;
+    Space.unmapRange(S->Committed, Keep - S->Committed);
+    if (!VirtualFree(reinterpret_cast<void *>(S->Committed),
+                     Keep - S->Committed, MEM_DECOMMIT)) {
+      Log.winError("couldn't decommit guest stack");
+      continue;
+    }
+    Bytes += Keep - S->Committed;
+    S->Committed = Keep;
+  }
+  return Bytes;
+}
+
+GuestStack *StackPool::lookup(uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+  auto It = ByTop.upper_bound(Addr);
+  if (It == ByTop.end() || It->second->Base > Addr)
+    return nullptr;
+  return It->second;
+}
+
+bool StackPool::grow(GuestStack &S, uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+  if (Addr >= S.Committed)
+    return true;
+  uint64_t Limit = S.Base + DynamicLoader::PageSize;
+  if (Addr < Limit) {
+    Log.error() << "guest stack overflow at 0x" << to_hex_string(Addr)
+                << Log.end();
+    return false;
+  }
+
+  // Commit whole steps, so that deep recursion doesn't fault on every page.
+  uint64_t Start = DynamicLoader::alignToPageSize(Addr);
+  if (S.Committed - Start < CommitStep)
+    Start = S.Committed > Limit + CommitStep ? S.Committed - CommitStep : Limit;
+  return commit(S, Start);
+}
+
+bool StackPool::commit(GuestStack &S, uint64_t Start) {
+  uint64_t Size = S.Committed - Start;
+  if (!VirtualAllocFromApp(reinterpret_cast<void *>(Start), Size, MEM_COMMIT,
+                           PAGE_READWRITE)) {
+    Log.winError("couldn't commit guest stack");
+    return false;
+  }
+  Space.mapRange(Start, Size, UC_PROT_READ | UC_PROT_WRITE);
+  S.Committed = Start;
+  return true;
+}
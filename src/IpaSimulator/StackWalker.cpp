@@ -0,0 +1,123 @@
+// StackWalker.cpp: Implementation of class `StackWalker`.
+
+#include "ipasim/StackWalker.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/SysTranslator.hpp"
+
+#include <Windows.h>
+#include <iterator>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Returns address of IpaSimLibrary's own image, its frames are never native.
+uint64_t getSelfBase() {
+  static uint64_t Base = []() {
+    HMODULE Self = nullptr;
+    GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                           GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                       reinterpret_cast<LPCWSTR>(&getSelfBase), &Self);
+    return reinterpret_cast<uint64_t>(Self);
+  }();
+  return Base;
+}
+
+} // namespace
+
+size_t StackWalker::walk(StackFrame *Frames, size_t Max, bool InGuest) {
+  DynamicLoader &Dyld = Sys.Dyld;
+  size_t Count = 0;
+  auto Add = [&](uint32_t Addr, bool Native) {
+    if (Count == Max)
+      return false;
+    Frames[Count++] = {Addr & ~1U, Native};
+    return true;
+  };
+
+  // Native frames are consumed one segment at a time. Frames of the emulator
+  // (and of other host code) separate the segments.
+  constexpr ULONG HostDepth = 62;
+  void *Host[HostDepth];
+  USHORT HostCount = CaptureStackBackTrace(1, HostDepth, Host, nullptr);
+  USHORT HostIdx = 0;
+  auto IsNative = [&](void *Addr) {
+    LibraryInfo LI(Dyld.lookup(reinterpret_cast<uint64_t>(Addr)));
+    return LI.Lib && LI.Lib->isDLL() && LI.Lib->StartAddress != getSelfBase();
+  };
+  auto AddNative = [&]() {
+    while (HostIdx != HostCount && !IsNative(Host[HostIdx]))
+      ++HostIdx;
+    for (; HostIdx != HostCount && IsNative(Host[HostIdx]); ++HostIdx) {
+      auto Addr = reinterpret_cast<uintptr_t>(Host[HostIdx]);
+      if (!Add(static_cast<uint32_t>(Addr), /* Native */ true))
+        return false;
+    }
+    return true;
+  };
+
+  const vector<SysTranslator::ExecutionContext> &Contexts = Sys.Contexts;
+  if (Contexts.empty()) {
+    AddNative();
+    return Count;
+  }
+
+  // Returns `false` if the walk should stop.
+  uint32_t Kernel = static_cast<uint32_t>(Dyld.getKernelAddr());
+  size_t Ctx = Contexts.size();
+  auto AddReturn = [&](uint32_t Ret) {
+    if ((Ret & ~1U) != Kernel)
+      return Add(Ret, /* Native */ false);
+    // Emulation of the current context was started here.
+    if (!AddNative())
+      return false;
+    // Return address of the outermost context is not inside emulated code.
+    uint32_t Caller = Contexts[--Ctx].CallerLR;
+    return Ctx && Add(Caller, /* Native */ false);
+  };
+
+  static constexpr uc_arm_reg RegIds[] = {UC_ARM_REG_PC, UC_ARM_REG_R7,
+                                          UC_ARM_REG_LR};
+  uint32_t Regs[size(RegIds)];
+  Sys.Emu.readRegs(RegIds, Regs);
+  if (!(InGuest ? Add(Regs[0], /* Native */ false) : AddNative()))
+    return Count;
+
+  // Each frame starts with saved R7 followed by saved LR.
+  uint32_t FP = Regs[1], LR = Regs[2];
+  GuestStack *S = IpaSim.Stacks.lookup(FP);
+  auto IsFrame = [S](uint32_t FP) {
+    return S && !(FP & 3) && FP >= S->Committed && FP + 8 <= S->Top;
+  };
+  auto *Frame = reinterpret_cast<const uint32_t *>(FP);
+  // If the current function hasn't pushed its frame yet (or it's a leaf), its
+  // return address is only in LR.
+  bool More = true;
+  if (!IsFrame(FP) || (Frame[1] & ~1U) != (LR & ~1U))
+    More = AddReturn(LR);
+  while (More && IsFrame(FP)) {
+    Frame = reinterpret_cast<const uint32_t *>(FP);
+    More = AddReturn(Frame[1]);
+    // Frames must go up the stack.
+    if (Frame[0] <= FP)
+      break;
+    FP = Frame[0];
+  }
+  // The chain can be broken (e.g., by code without frame pointers), but
+  // the remaining contexts can still be stitched together.
+  while (More && Ctx)
+    More = AddReturn(Kernel);
+  return Count;
+}
+
+void StackWalker::log(bool InGuest) {
+  StackFrame Frames[MaxDepth];
+  size_t Count = walk(Frames, MaxDepth, InGuest);
+  auto &S = Log.error() << "call stack:";
+  for (size_t I = 0; I != Count; ++I)
+    S << "\n  #" << to_string(I) << (Frames[I].Native ? " native " : " ")
+      << Sys.Dyld.dumpAddr(Frames[I].Addr);
+  S << Log.end();
+}
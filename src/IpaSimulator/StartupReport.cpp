@@ -0,0 +1,123 @@
+// StartupReport.cpp: Implementation of classes `StartupReport` and
+// `StartupTimer`.
+
+#include "ipasim/StartupReport.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+using namespace ipasim;
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+constexpr const char *PhaseNames[] = {"validate", "parse",    "map",
+                                      "rebase",   "bind",     "handlers",
+                                      "objcInit"};
+static_assert(size(PhaseNames) == static_cast<size_t>(StartupPhase::Count));
+
+string toMilliseconds(StartupReport::Clock::duration Time) {
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "%.3f", duration<double, milli>(Time).count());
+  return Buf;
+}
+
+const string UnknownLib("?");
+
+string quote(const string &S) {
+  string Result("\"");
+  for (char C : S) {
+    if (C == '"' || C == '\\')
+      Result += '\\';
+    Result += C;
+  }
+  return Result + '"';
+}
+
+} // namespace
+
+void StartupReport::add(const string &Lib, StartupPhase Phase,
+                        Clock::duration Time) {
+  lock_guard<mutex> Lock(Mutex);
+  if (Finished)
+    return;
+  auto [It, New] = LibIndices.try_emplace(Lib, Libs.size());
+  if (New)
+    Libs.emplace_back(Lib, PhaseTimes{});
+  Libs[It->second].second[static_cast<size_t>(Phase)] += Time;
+}
+
+void StartupReport::finish() {
+  if constexpr (!StartupReports)
+    return;
+
+  string JSON;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    if (Finished)
+      return;
+    Finished = true;
+    JSON = toJSON(Clock::now() - Start);
+  }
+
+  error_code Error;
+  filesystem::path Dir(getCacheDir("startup"));
+  filesystem::create_directories(Dir, Error);
+  ofstream O(Dir / "report.json", ios::trunc);
+  if (!(O << JSON))
+    Log.warning("couldn't save startup report");
+  if (IpaSim.Traces.isEnabled(TraceCategory::Loader))
+    Log.info() << "startup report: " << JSON << Log.end();
+}
+
+// Times are in milliseconds, `entry` is the time it took to reach the entry
+// point of the main binary.
+string StartupReport::toJSON(Clock::duration Total) {
+  string JSON("{\"entry\":" + toMilliseconds(Total) + ",\"libraries\":[");
+  PhaseTimes Sums{};
+  for (size_t I = 0, End = Libs.size(); I != End; ++I) {
+    const auto &[Lib, Times] = Libs[I];
+    JSON += (I ? ",{\"path\":" : "{\"path\":") + quote(Lib);
+    for (size_t P = 0; P != Times.size(); ++P) {
+      JSON += ",\"" + string(PhaseNames[P]) + "\":" + toMilliseconds(Times[P]);
+      Sums[P] += Times[P];
+    }
+    JSON += '}';
+  }
+  JSON += "],\"total\":{";
+  for (size_t P = 0; P != Sums.size(); ++P)
+    JSON += (P ? ",\"" : "\"") + string(PhaseNames[P]) +
+            "\":" + toMilliseconds(Sums[P]);
+  return JSON + "}}";
+}
+
+StartupTimer::StartupTimer(StartupReport &Report, const string &Lib,
+                           StartupPhase Phase)
+    : Report(Report), Lib(Lib), Phase(Phase),
+      Start(StartupReport::Clock::now()), Running(StartupReports) {}
+
+StartupTimer::StartupTimer(StartupReport &Report, const string *Lib,
+                           StartupPhase Phase)
+    : StartupTimer(Report, Lib ? *Lib : UnknownLib, Phase) {}
+
+void StartupTimer::next(StartupPhase Phase) {
+  if constexpr (!StartupReports)
+    return;
+  stop();
+  this->Phase = Phase;
+  Start = StartupReport::Clock::now();
+  Running = true;
+}
+
+void StartupTimer::stop() {
+  if (!Running)
+    return;
+  Running = false;
+  Report.add(Lib, Phase, StartupReport::Clock::now() - Start);
+}
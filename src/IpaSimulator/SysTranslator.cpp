@@ -1,60 +1,323 @@
-// SysTranslator.cpp: Implementation of classes `SysTranslator`, `DynamicCaller`
-// and `TypeDecoder`.
+// SysTranslator.cpp: Implementation of classes `SysTranslator`, `DynamicCaller`,
+// `TypeDecoder` and `TrampolineArena`.
 
 #include "ipasim/SysTranslator.hpp"
 
 #include "ipasim/Common.hpp"
+#include "ipasim/EventProvider.hpp"
+#include "ipasim/GuestMallocCache.hpp"
+#include "ipasim/Hypercalls.hpp"
 #include "ipasim/IpaSimulator.hpp"
 #include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/MessageCache.hpp"
+#include "ipasim/StackWalker.hpp"
+#include "ipasim/TraceBuffer.hpp"
 #include "ipasim/WrapperIndex.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <filesystem>
+#include <iterator>
 #include <thread>
+#include <utility>
 
 using namespace ipasim;
 using namespace std;
 
 namespace {
 
-struct Trampoline {
-  ffi_cif CIF;
-  bool Returns;
-  size_t ArgC;
-  uint64_t Addr;
+// Computes size and alignment of type `T` as laid out by the guest (where no
+// type is aligned to more than 4 bytes).
+void getGuestLayout(const ffi_type *T, size_t &Size, size_t &Align) {
+  if (T->type != FFI_TYPE_STRUCT) {
+    Size = T->size;
+    Align = min<size_t>(T->size, 4);
+    return;
+  }
+
+  Size = 0;
+  Align = 1;
+  for (ffi_type **E = T->elements; *E; ++E) {
+    size_t ESize, EAlign;
+    getGuestLayout(*E, ESize, EAlign);
+    Size = (Size + EAlign - 1) / EAlign * EAlign + ESize;
+    Align = max(Align, EAlign);
+  }
+  Size = (Size + Align - 1) / Align * Align;
+}
+
+size_t getGuestSize(const ffi_type *T) {
+  size_t Size, Align;
+  getGuestLayout(T, Size, Align);
+  return Size;
+}
+
+// Checks that struct type `T` (already initialized by `ffi_prep_cif`) has the
+// same layout in the host as in the guest.
+bool hasGuestLayout(const ffi_type *T) {
+  if (T->type != FFI_TYPE_STRUCT)
+    return true;
+  if (T->size != getGuestSize(T))
+    return false;
+  for (ffi_type **E = T->elements; *E; ++E)
+    if (!hasGuestLayout(*E))
+      return false;
+  return true;
+}
+
+// Registers read for each traced instruction (see `SysTranslator::handleCode`)
+constexpr uc_arm_reg TracedRegs[] = {UC_ARM_REG_R0,  UC_ARM_REG_R1,
+                                     UC_ARM_REG_R7,  UC_ARM_REG_R12,
+                                     UC_ARM_REG_R13, UC_ARM_REG_R14};
+
+// Native functions which only block until something happens (see
+// `ParkIdleWaits`). Those with thread affinity (e.g., `CFRunLoopRun` or
+// `pthread_cond_wait`, which must reacquire its mutex on the same thread) must
+// not be listed here.
+constexpr const char *IdleWaits[] = {
+    "dispatch_semaphore_wait", "dispatch_group_wait", "mach_msg",
+    "semaphore_wait",          "semaphore_timedwait", "sem_wait",
+    "usleep",                  "nanosleep",           "sleep",
+    "pthread_join"};
+
+bool isIdleWait(const char *Name) {
+  if (!Name)
+    return false;
+  return any_of(begin(IdleWaits), end(IdleWaits),
+                [&](const char *W) { return !strcmp(Name, W); });
+}
+
+// Functions of `libobjc.dll` taking part in the handshake of optimized return
+// values, in the order of `CallTarget::HandshakeTy` (see `OptimizedReturns`).
+constexpr const char *HandshakeFunctions[] = {
+    "objc_autoreleaseReturnValue", "objc_retainAutoreleaseReturnValue",
+    "objc_retainAutoreleasedReturnValue",
+    "objc_unsafeClaimAutoreleasedReturnValue"};
+
+// Returns position of native function `Addr` in `HandshakeFunctions` plus one
+// or zero if it's not there.
+uint8_t getHandshake(uint64_t Addr) {
+  HMODULE ObjC = GetModuleHandleW(L"libobjc.dll");
+  if (!ObjC || !Addr)
+    return 0;
+  for (size_t I = 0; I != size(HandshakeFunctions); ++I)
+    if (reinterpret_cast<uint64_t>(
+            GetProcAddress(ObjC, HandshakeFunctions[I])) == Addr)
+      return static_cast<uint8_t>(I + 1);
+  return 0;
+}
+
+// Returns `true` if emulated code at return address `LR` is the marker which
+// tells `objc_autoreleaseReturnValue` that the result is going to be passed to
+// `objc_retainAutoreleasedReturnValue`. Like `callerAcceptsOptimizedReturn`
+// of the runtime for ARM.
+bool acceptsOptimizedReturn(uint32_t LR) {
+  // `mov r7, r7`
+  if (LR & 1)
+    return *reinterpret_cast<const uint16_t *>(LR - 1) == 0x463F;
+  return *reinterpret_cast<const uint32_t *>(LR) == 0xE1A07007;
+}
+
+FARPROC getObjCFunction(const char *Name) {
+  return GetProcAddress(GetModuleHandleW(L"libobjc.dll"), Name);
+}
+
+void releaseObject(uint32_t Obj) {
+  static auto *Release =
+      reinterpret_cast<void (*)(uintptr_t)>(getObjCFunction("objc_release"));
+  Release(Obj);
+}
+
+uint32_t pushNativePool() {
+  static auto *Push = reinterpret_cast<void *(*)()>(
+      getObjCFunction("objc_autoreleasePoolPush"));
+  return reinterpret_cast<uintptr_t>(Push());
+}
+
+void popNativePool(uint32_t Token) {
+  static auto *Pop = reinterpret_cast<void (*)(uintptr_t)>(
+      getObjCFunction("objc_autoreleasePoolPop"));
+  Pop(Token);
+}
+
+// A call moved to a thread pool thread by `SysTranslator::parkCall`.
+struct ParkedCall {
+  void (*Thunk)(void *);
+  void *Data;
+  atomic<bool> *Parked;
+  HANDLE Wake;
 };
 
-} // namespace
+void CALLBACK runParkedCall(PTP_CALLBACK_INSTANCE Instance, void *Context) {
+  auto *P = static_cast<ParkedCall *>(Context);
+  CallbackMayRunLong(Instance);
+  P->Thunk(P->Data);
+  // `P` is gone once the guest thread continues.
+  HANDLE Wake = P->Wake;
+  P->Parked->store(false, memory_order_release);
+  SetEvent(Wake);
+}
 
-void SysTranslator::execute(LoadedLibrary *Lib) {
-  auto *Dylib = dynamic_cast<LoadedDylib *>(Lib);
-  if (!Dylib) {
-    Log.error("we can only execute Dylibs right now");
-    return;
+// How many times a contended lock is retried before its waiter blocks on the
+// host (see `SysTranslator::waitForLock`).
+constexpr uint32_t LockSpins = 64;
+// Busy-waits in a row after which the host thread sleeps instead of just
+// yielding (see `SysTranslator::yieldSpin`).
+constexpr uint32_t SpinYieldsBeforeSleep = 16;
+
+bool tryLock(volatile LONG *Lock) {
+  return InterlockedCompareExchange(Lock, 1, 0) == 0;
+}
+
+// Returns `true` if there is `ldrex` or `strex` (or one of their variants)
+// between `Low` and `High`, which contain code in `Thumb` or ARM mode.
+bool hasExclusives(uint32_t Low, uint32_t High, bool Thumb) {
+  if (Thumb) {
+    for (auto *H = reinterpret_cast<const uint16_t *>(Low & ~1U),
+              *End = reinterpret_cast<const uint16_t *>(High & ~1U);
+         H < End; ++H)
+      if ((*H & 0xFFE0) == 0xE840 || (*H & 0xFFE0) == 0xE8C0)
+        return true;
+    return false;
+  }
+  for (auto *W = reinterpret_cast<const uint32_t *>(Low & ~3U),
+            *End = reinterpret_cast<const uint32_t *>(High & ~3U);
+       W < End; ++W)
+    if ((*W & 0x0F800FF0) == 0x01800F90)
+      return true;
+  return false;
+}
+
+// `errno` values of iOS (only some of them match those of the host).
+constexpr uint32_t GuestEAGAIN = 35, GuestEINVAL = 22;
+
+// Callers of native functions with a fixed number of 32-bit words of arguments
+// (see `CallShape::Direct`). With `cdecl`, all arguments are passed on the
+// stack, one after another and padded to 4 bytes (which is also how they are
+// laid out in `DynamicCaller::Args`), so their types don't matter.
+template <size_t> using Word = uint32_t;
+template <size_t... Is>
+uint64_t callWordsImpl(uint64_t Addr, const uint32_t *Args,
+                       index_sequence<Is...>) {
+  return reinterpret_cast<uint64_t (*)(Word<Is>...)>(Addr)(Args[Is]...);
+}
+template <size_t N> uint64_t callWords(uint64_t Addr, const uint32_t *Args) {
+  return callWordsImpl(Addr, Args, make_index_sequence<N>());
+}
+constexpr CallShape::DirectFunc DirectCalls[] = {
+    callWords<0>,  callWords<1>,  callWords<2>, callWords<3>, callWords<4>,
+    callWords<5>,  callWords<6>,  callWords<7>, callWords<8>, callWords<9>,
+    callWords<10>, callWords<11>, callWords<12>};
+
+// Returns `true` if result of type `T` is returned in `EAX` and `EDX` (i.e., it
+// isn't a floating-point number, nor a struct).
+bool hasDirectResult(const ffi_type *T) {
+  switch (T->type) {
+  case FFI_TYPE_VOID:
+  case FFI_TYPE_INT:
+  case FFI_TYPE_UINT8:
+  case FFI_TYPE_SINT8:
+  case FFI_TYPE_UINT16:
+  case FFI_TYPE_SINT16:
+  case FFI_TYPE_UINT32:
+  case FFI_TYPE_SINT32:
+  case FFI_TYPE_UINT64:
+  case FFI_TYPE_SINT64:
+  case FFI_TYPE_POINTER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Extends small integer result of type `T` to the whole register, like libffi
+// does.
+uint32_t extendResult(const ffi_type *T, uint32_t Value) {
+  switch (T->type) {
+  case FFI_TYPE_UINT8:
+    return static_cast<uint8_t>(Value);
+  case FFI_TYPE_SINT8:
+    return static_cast<int8_t>(Value);
+  case FFI_TYPE_UINT16:
+    return static_cast<uint16_t>(Value);
+  case FFI_TYPE_SINT16:
+    return static_cast<int16_t>(Value);
+  default:
+    return Value;
   }
+}
+
+} // namespace
+
+SysTranslator::~SysTranslator() {
+  IpaSim.Stacks.release(Stack);
+  IpaSim.TSD.release(TSD);
+  if (WakeEvent)
+    CloseHandle(WakeEvent);
+}
 
+void SysTranslator::initialize(uint64_t StackSize) {
   // Initialize the stack.
-  size_t StackSize = 8 * 1024 * 1024; // 8 MiB
-  void *StackPtr = _aligned_malloc(StackSize, DynamicLoader::PageSize);
-  uint64_t StackAddr = reinterpret_cast<uint64_t>(StackPtr);
-  Emu.mapMemory(StackAddr, StackSize, UC_PROT_READ | UC_PROT_WRITE);
+  Stack = IpaSim.Stacks.acquire(StackSize);
+  if (!Stack) {
+    Log.error("couldn't allocate guest stack");
+    return;
+  }
   // Reserve 12 bytes on the stack, so that our instruction logger can read
   // them.
-  Emu.writeReg(UC_ARM_REG_SP, StackAddr + StackSize - 12);
+  Emu.writeReg(UC_ARM_REG_SP, Stack->Top - 12);
+  // Initialize thread-specific data (see `GuestTSD`).
+  TSD = IpaSim.TSD.allocate();
+  if (!TSD)
+    Log.error("couldn't allocate guest thread-specific data");
+  Emu.writeReg(UC_ARM_REG_C13_C0_3, reinterpret_cast<uintptr_t>(TSD));
+  if constexpr (AccountGuestTimes)
+    GuestTimes::setCurrent(&Times);
 
   // Install hooks.
   // This hook handles calls across platform boundaries (iOS -> Windows). It
   // works thanks to mapping Windows DLLs as non-executable.
-  Emu.hook(UC_HOOK_MEM_FETCH_PROT, &SysTranslator::handleFetchProtMem, this);
-  if constexpr (PrintInstructions)
-    // This hook logs execution for debugging purposes.
-    Emu.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this);
-  if constexpr (PrintMemoryWrites)
-    // This hook logs all memory writes.
-    Emu.hook(UC_HOOK_MEM_WRITE, &SysTranslator::handleMemWrite, this);
+  FetchProtHook = Emu.hook(UC_HOOK_MEM_FETCH_PROT,
+                           &SysTranslator::handleFetchProtMem, this);
+  // This hook handles the same calls when they are made via `svc` (see
+  // `HypercallWrappers` in `HeadersAnalyzer`).
+  InterruptHook =
+      Emu.hook(UC_HOOK_INTR, &SysTranslator::handleInterrupt, this);
+  // These hooks can be also enabled at runtime.
+  if (IpaSim.Traces.isEnabled(TraceCategory::Instructions))
+    traceInstructions(true);
+  if (IpaSim.Traces.isEnabled(TraceCategory::MemoryWrites))
+    traceMemoryWrites(true);
   // This hook allows through reading and writing to unmapped memory (probably
   // heap or other external objects).
-  Emu.hook(UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED,
-           &SysTranslator::handleMemUnmapped, this);
+  UnmappedHook =
+      Emu.hook(UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED,
+               &SysTranslator::handleMemUnmapped, this);
+  // This hook catches writes to pages protected by watchpoints. It's called
+  // only for read-only pages, so it doesn't slow down other writes.
+  WriteProtHook = Emu.hook(UC_HOOK_MEM_WRITE_PROT,
+                           &SysTranslator::handleMemWriteProt, this);
+  // This hook takes samples for `GuestProfiler`.
+  if constexpr (ProfileInterval != 0)
+    BlockHook = Emu.hook(UC_HOOK_BLOCK, &SysTranslator::handleBlock, this);
+  // These hooks run functions translated ahead of time instead of emulating
+  // them.
+  for (uint64_t Addr : IpaSim.Translations.getAddrs())
+    TranslationHooks.push_back(Emu.hook(
+        UC_HOOK_CODE, &SysTranslator::handleTranslated, this, Addr, Addr));
+}
+
+void SysTranslator::execute(LoadedLibrary *Lib) {
+  auto *Dylib = dynamic_cast<LoadedDylib *>(Lib);
+  if (!Dylib) {
+    Log.error("we can only execute Dylibs right now");
+    Dyld.endBatch();
+    return;
+  }
+
+  initialize(MainStackSize);
 
   // TODO: Do this also for all non-wrapper Dylibs (i.e., Dylibs that come with
   // the `.ipa` file).
@@ -63,66 +326,241 @@ void SysTranslator::execute(LoadedLibrary *Lib) {
   // `MachOInitializer.cpp` does.
   uint64_t Hdr = Dylib->findSymbol(Dyld, "__mh_execute_header");
   IpaSim.Dyld.registerMachO(reinterpret_cast<void *>(Hdr));
-  call("libobjc.dll", "_objc_init");
+  {
+    StartupTimer Timer(Dyld.getStartupReport(), Dyld.lookup(Hdr).LibPath,
+                       StartupPhase::ObjCInit);
+    call("libobjc.dll", "_objc_init");
+  }
+  if constexpr (BatchStartupImages) {
+    StartupTimer Timer(Dyld.getStartupReport(), Dyld.lookup(Hdr).LibPath,
+                       StartupPhase::Handlers);
+    Dyld.endBatch();
+  }
 
   // Start at entry point.
-  execute(Dylib->Bin.entrypoint() + Dylib->StartAddress);
+  Dyld.getStartupReport().finish();
+  execute(Dylib->EntryPoint + Dylib->StartAddress);
 }
 
 void SysTranslator::execute(uint64_t Addr) {
-  if constexpr (PrintEmuInfo)
+  // If we are inside a host fiber, emulation is suspended inside some hook and
+  // cannot be started again. Let the main fiber execute the function instead.
+  if (HostFiber *F = CurrentFiber) {
+    F->Callback = Addr;
+    CurrentFiber = nullptr;
+    SwitchToFiber(MainFiber);
+    // When we get here, the callback has been executed.
+    return;
+  }
+
+  if (IpaSim.Traces.isEnabled(TraceCategory::Emulation))
     Log.info() << "starting emulation at " << Dyld.dumpAddr(Addr)
                << " in thread " << this_thread::get_id() << Log.end();
 
   // Save LR.
-  LRs.push(Emu.readReg(UC_ARM_REG_LR));
+  LRs.push_back(Emu.readReg(UC_ARM_REG_LR));
 
   // Point return address to kernel.
   Emu.writeReg(UC_ARM_REG_LR, Dyld.getKernelAddr());
 
   // Start execution.
+  Contexts.emplace_back();
+  ctx().CallerLR = LRs.back();
+  EventActivity<EmulationEvents> Activity;
+  TraceLoggingWriteStart(Activity, "Emulation",
+                         TraceLoggingHexUInt64(Addr, "Address"));
+
+  // Only the outermost emulation is timed, nested ones are part of it.
+  bool Outermost = Contexts.size() == 1;
   for (;;) {
-    Emu.start(Addr);
-
-    if (Continue) {
-      Continue = false;
-      Continuation();
-      Continuation = nullptr;
+    auto Start = chrono::steady_clock::now();
+    GuestTimes::ModeTy Mode;
+    if constexpr (AccountGuestTimes)
+      Mode = GuestTimes::enter(GuestTimes::Emulated);
+    if constexpr (Pretranslation)
+      IpaSim.Entries.count(Addr);
+    bool Ok = Emu.start(Addr, InstructionBudget);
+    if constexpr (AccountGuestTimes)
+      GuestTimes::enter(Mode);
+    if (Outermost)
+      IpaSim.Stats.add(Stat::EmulationTime,
+                       chrono::duration_cast<chrono::nanoseconds>(
+                           chrono::steady_clock::now() - Start)
+                           .count());
+
+    if (ctx().Continue) {
+      ctx().Continue = false;
+      // The continuation can start nested emulation, hence we move it out of
+      // the context before calling it.
+      Continuation Cont(move(ctx().Cont));
+      Cont();
     }
 
-    if (Restart) {
+    // Note that `Contexts` could have been reallocated by nested emulation.
+    ExecutionContext &Ctx = ctx();
+    if (Ctx.Restart) {
       // If restarting, continue where we left off.
-      Restart = false;
-      if (RestartFromLRs) {
-        RestartFromLRs = false;
-        Addr = LRs.top();
-        LRs.pop();
+      Ctx.Restart = false;
+      if (Ctx.RestartFromLRs) {
+        Ctx.RestartFromLRs = false;
+        Addr = LRs.back();
+        LRs.pop_back();
       } else
         Addr = Emu.readReg(UC_ARM_REG_LR);
+    } else if (InstructionBudget && Ok && !Ctx.Returned && !Ctx.Aborted) {
+      // Instruction budget has been exhausted, let other guest threads run.
+      Addr = Emu.readPC();
+      IpaSim.Stats.add(Stat::BudgetSlices);
+      if (SpinDetection && isSpinning(static_cast<uint32_t>(Addr))) {
+        IpaSim.Stats.add(Stat::SpinYields);
+        yieldSpin();
+      } else
+        preempt();
     } else
       break;
   }
+  Contexts.pop_back();
+  TraceLoggingWriteStop(Activity, "Emulation");
+}
+
+void SysTranslator::executeCallback(uint64_t Addr) {
+  Progress.fetch_add(1, memory_order_relaxed);
+  IpaSim.Stats.add(Stat::Callbacks);
+  CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::Callback, Addr);
+  EventActivity<CallbackEvents> Activity;
+  TraceLoggingWriteStart(Activity, "Callback",
+                         TraceLoggingHexUInt64(Addr, "Address"));
+  if (IpaSim.Recorder.isActive()) {
+    uint32_t Args[RegisterBlock::ArgRegs];
+    Emu.readRegs(Emulator::ArgRegs, Args);
+    IpaSim.Recorder.addCallback(Addr, Args);
+  }
+  // Native frames between pools of the guest and the callback can push their
+  // own (native) pools, so guest pools pushed before are not the innermost
+  // ones anymore. See `GuestPoolPage`.
+  GuestPoolPage *Page = GuestAutoreleasePools ? getPoolPage() : nullptr;
+  uint32_t Top = Page ? exchange(Page->Top, 0) : 0;
+  execute(Addr);
+  if (Page)
+    Page->Top = Top;
+  TraceLoggingWriteStop(Activity, "Callback");
+}
+
+bool SysTranslator::pretranslate(size_t Count) {
+  uint64_t Addr;
+  for (size_t I = 0; I != Count; ++I) {
+    if (!IpaSim.Entries.pop(Addr))
+      return false;
+    if (!Emu.translate(Addr)) {
+      // The backend cannot do it, so don't try the others.
+      IpaSim.Entries.clearPending();
+      return false;
+    }
+    IpaSim.Stats.add(Stat::Pretranslations);
+  }
+  return IpaSim.Entries.hasPending();
+}
+
+size_t SysTranslator::callBackBatch(void *FP, size_t ArgC, void *const *Args,
+                                    size_t Count, void **Results,
+                                    const bool *Stop) {
+  if (ArgC > 4) {
+    Log.error() << "batched callback has too many arguments" << Log.end();
+    return 0;
+  }
+
+  uint64_t Addr = reinterpret_cast<uint64_t>(FP);
+  LibraryInfo LI(Dyld.lookup(Addr));
+  if (!LI.Lib || LI.Lib->isDLL()) {
+    // Native callbacks are simply called. Passing unused arguments is harmless
+    // in the `cdecl` calling convention.
+    using FuncTy = void *(*)(void *, void *, void *, void *);
+    auto *Func = reinterpret_cast<FuncTy>(FP);
+    size_t I = 0;
+    for (; I != Count && !(Stop && *Stop); ++I) {
+      void *Values[4] = {};
+      copy_n(Args + I * ArgC, ArgC, Values);
+      void *Result = Func(Values[0], Values[1], Values[2], Values[3]);
+      if (Results)
+        Results[I] = Result;
+    }
+    return I;
+  }
+
+  // Build `BatchFrame`s below the current guest stack pointer and let the
+  // batch stub make the calls.
+  uint32_t SP = Emu.readReg(UC_ARM_REG_SP);
+  size_t Done = 0;
+  while (Done != Count && !(Stop && *Stop)) {
+    size_t Size = min(Count - Done, BatchSize);
+    uint32_t FrameSize = static_cast<uint32_t>(sizeof(BatchFrame) +
+                                               Size * 5 * sizeof(uint32_t));
+    uint32_t FrameAddr = (SP - FrameSize) & ~7U;
+    auto *Frame = reinterpret_cast<BatchFrame *>(FrameAddr);
+    auto *FrameArgs = reinterpret_cast<uint32_t *>(Frame + 1);
+    auto *FrameResults = FrameArgs + Size * 4;
+    Frame->FP = static_cast<uint32_t>(Addr);
+    Frame->Stop = reinterpret_cast<uint32_t>(Stop);
+    Frame->Count = static_cast<uint32_t>(Size);
+    Frame->Args = reinterpret_cast<uint32_t>(FrameArgs);
+    Frame->Results = Results ? reinterpret_cast<uint32_t>(FrameResults) : 0;
+    for (size_t I = 0; I != Size; ++I)
+      for (size_t J = 0; J != 4; ++J)
+        FrameArgs[I * 4 + J] =
+            J < ArgC ? reinterpret_cast<uint32_t>(Args[(Done + I) * ArgC + J])
+                     : 0;
+
+    Emu.writeReg(UC_ARM_REG_R0, FrameAddr);
+    Emu.writeReg(UC_ARM_REG_SP, FrameAddr);
+    execute(Dyld.getBatchStubAddr());
+    Emu.writeReg(UC_ARM_REG_SP, SP);
+
+    size_t Made = Size - Frame->Count;
+    if (Results)
+      for (size_t I = 0; I != Made; ++I)
+        Results[Done + I] = reinterpret_cast<void *>(FrameResults[I]);
+    Done += Made;
+    if (Made != Size)
+      break;
+  }
+  return Done;
 }
 
 void SysTranslator::returnToKernel() {
-  if constexpr (PrintEmuInfo)
+  if (IpaSim.Traces.isEnabled(TraceCategory::Emulation))
     Log.info() << "executing kernel at 0x"
                << to_hex_string(Dyld.getKernelAddr()) << Log.end();
 
   // Restore LR.
-  Emu.writeReg(UC_ARM_REG_LR, LRs.top());
-  LRs.pop();
+  Emu.writeReg(UC_ARM_REG_LR, LRs.back());
+  LRs.pop_back();
 
   // Stop execution.
+  ctx().Returned = true;
+  Emu.stop();
+}
+
+// Stops emulation without continuing it later.
+void SysTranslator::abort() {
+  StackWalker(*this).log(/* InGuest */ true);
+  ctx().Aborted = true;
   Emu.stop();
 }
 
 void SysTranslator::returnToEmulation() {
-  if constexpr (PrintEmuInfo)
+  if (IpaSim.Traces.isEnabled(TraceCategory::Emulation))
     Log.info() << "returning to " << Dyld.dumpAddr(Emu.readReg(UC_ARM_REG_LR))
                << Log.end();
 
-  Restart = true;
+  ctx().Restart = true;
+}
+
+// Restarts emulation at `Addr` after it stops.
+void SysTranslator::restartAt(uint32_t Addr) {
+  ExecutionContext &Ctx = ctx();
+  Ctx.Restart = true;
+  Ctx.RestartFromLRs = true;
+  LRs.push_back(Addr);
 }
 
 // Calling `uc_emu_start` inside `uc_emu_start` (e.g., inside a hook) is not
@@ -131,27 +569,752 @@ void SysTranslator::returnToEmulation() {
 // used for. All code that calls or could call `uc_emu_start` should be deferred
 // using this function. See also
 // <https://github.com/unicorn-engine/unicorn/issues/591>.
-void SysTranslator::continueOutsideEmulation(function<void()> &&Cont) {
-  assert(!Continue && "Only one continuation is supported.");
-  Continue = true;
-  Continuation = move(Cont);
+void SysTranslator::continueOutsideEmulation(Continuation &&Cont) {
+  ExecutionContext &Ctx = ctx();
+  assert(!Ctx.Continue && "Only one continuation per context is supported.");
+  Ctx.Continue = true;
+  Ctx.Cont = move(Cont);
 
   Emu.stop();
 }
 
+// Calls native function `Addr` directly from inside an emulator hook, so that
+// emulation doesn't have to be stopped and restarted. The function runs on a
+// host fiber, so when it calls back into emulated code (which cannot be done
+// inside a hook), we switch back to the hook, stop emulation and execute the
+// callback outside of it. Then we resume the fiber and continue at
+// `ResumeAddr` after the function returns.
+void SysTranslator::callInsideHook(uint64_t Addr, uint32_t Arg,
+                                   uint32_t ResumeAddr) {
+  HostFiber *F = acquireFiber();
+  if (!F) {
+    // Fall back to calling the function outside emulation.
+    continueOutsideEmulation([=]() {
+      reinterpret_cast<void (*)(uint32_t)>(Addr)(Arg);
+      restartAt(ResumeAddr);
+    });
+    return;
+  }
+
+  F->Addr = Addr;
+  F->Arg = Arg;
+  F->Callback = 0;
+  F->Done = false;
+  MainFiber = GetCurrentFiber();
+  CurrentFiber = F;
+  SwitchToFiber(F->Handle);
+
+  if (F->Done) {
+    // The function returned without calling back, so emulation can simply
+    // continue.
+    FreeFibers.push_back(F);
+    return;
+  }
+
+  continueOutsideEmulation([=]() {
+    while (!F->Done) {
+      uint64_t Callback = F->Callback;
+      F->Callback = 0;
+      execute(Callback);
+
+      // Let the native function continue.
+      CurrentFiber = F;
+      SwitchToFiber(F->Handle);
+    }
+    FreeFibers.push_back(F);
+    restartAt(ResumeAddr);
+  });
+}
+
+bool SysTranslator::convertToFiber() {
+  if (!ThreadFiber) {
+    ThreadFiber = ConvertThreadToFiberEx(nullptr, FIBER_FLAG_FLOAT_SWITCH);
+    if (!ThreadFiber) {
+      Log.winError("couldn't convert thread to fiber");
+      return false;
+    }
+  }
+  return true;
+}
+
+SysTranslator::HostFiber *SysTranslator::acquireFiber() {
+  if (!convertToFiber())
+    return nullptr;
+
+  if (!FreeFibers.empty()) {
+    HostFiber *F = FreeFibers.back();
+    FreeFibers.pop_back();
+    return F;
+  }
+
+  auto *F = new HostFiber;
+  F->Handle =
+      CreateFiberEx(0, 0, FIBER_FLAG_FLOAT_SWITCH, &hostFiberProc, F);
+  if (!F->Handle) {
+    Log.winError("couldn't create fiber");
+    delete F;
+    return nullptr;
+  }
+  return F;
+}
+
+void SysTranslator::hostFiberProc(void *Data) {
+  auto *F = reinterpret_cast<HostFiber *>(Data);
+  SysTranslator &Sys = IpaSim.sys();
+  for (;;) {
+    reinterpret_cast<void (*)(uint32_t)>(F->Addr)(F->Arg);
+    F->Done = true;
+    Sys.CurrentFiber = nullptr;
+    SwitchToFiber(Sys.MainFiber);
+  }
+}
+
+void SysTranslator::spawn(void *Func, void *Arg) {
+  auto *T = new GuestThread;
+  T->Fiber =
+      CreateFiberEx(0, 0, FIBER_FLAG_FLOAT_SWITCH, &guestThreadProc, T);
+  if (!T->Fiber) {
+    Log.winError("couldn't create fiber for guest thread");
+    delete T;
+    return;
+  }
+  // Each guest thread needs its own stack.
+  T->Stack = IpaSim.Stacks.acquire(ThreadStackSize);
+  if (!T->Stack) {
+    DeleteFiber(T->Fiber);
+    delete T;
+    return;
+  }
+  // And its own thread-specific data.
+  T->TSD = IpaSim.TSD.allocate();
+  if (!T->TSD) {
+    Log.error("couldn't allocate guest thread-specific data");
+    IpaSim.Stacks.release(T->Stack);
+    DeleteFiber(T->Fiber);
+    delete T;
+    return;
+  }
+  T->CPU = Emu.allocContext();
+  T->LRs.reserve(LRs.capacity());
+  T->Contexts.reserve(Contexts.capacity());
+  T->MainFiber = nullptr;
+  T->Func = Func;
+  T->Arg = Arg;
+  T->Done = false;
+  T->Parked = false;
+
+  ReadyThreads.push_back(T);
+}
+
+void SysTranslator::runThreads() {
+  if (!convertToFiber())
+    return;
+
+  void *OldSchedulerFiber = SchedulerFiber;
+  SchedulerFiber = GetCurrentFiber();
+  if (!SchedulerCPU)
+    SchedulerCPU = Emu.allocContext();
+
+  // Round-robin.
+  size_t Skipped = 0; // Parked threads seen in a row
+  while (!ReadyThreads.empty()) {
+    GuestThread *T = ReadyThreads.front();
+    ReadyThreads.pop_front();
+    if (T->Parked.load(memory_order_acquire)) {
+      ReadyThreads.push_back(T);
+      // If all threads are parked, there's nothing to do until one of them is
+      // woken up.
+      if (++Skipped == ReadyThreads.size()) {
+        WaitForSingleObject(WakeEvent, INFINITE);
+        Skipped = 0;
+      }
+      continue;
+    }
+    Skipped = 0;
+    switchTo(T);
+
+    if (T->Done) {
+      DeleteFiber(T->Fiber);
+      Emu.freeContext(T->CPU);
+      IpaSim.Stacks.release(T->Stack);
+      IpaSim.TSD.release(T->TSD);
+      delete T;
+    } else
+      ReadyThreads.push_back(T);
+  }
+
+  SchedulerFiber = OldSchedulerFiber;
+}
+
+// Installs state of guest thread `T`, runs it until it's preempted or it
+// finishes and then restores state of the scheduler.
+void SysTranslator::switchTo(GuestThread *T) {
+  Emu.saveContext(SchedulerCPU);
+  if (T->MainFiber) // Not for new threads.
+    Emu.restoreContext(T->CPU);
+  swap(LRs, T->LRs);
+  swap(Contexts, T->Contexts);
+  swap(MainFiber, T->MainFiber);
+  swap(Spin, T->Spin);
+  CurrentThread = T;
+  if constexpr (AccountGuestTimes)
+    GuestTimes::setCurrent(&T->Times);
+
+  SwitchToFiber(T->Fiber);
+
+  if constexpr (AccountGuestTimes)
+    GuestTimes::setCurrent(&Times);
+  CurrentThread = nullptr;
+  Emu.saveContext(T->CPU);
+  swap(LRs, T->LRs);
+  swap(Contexts, T->Contexts);
+  swap(MainFiber, T->MainFiber);
+  swap(Spin, T->Spin);
+  Emu.restoreContext(SchedulerCPU);
+}
+
+void SysTranslator::preempt() {
+  if (CurrentThread && !ReadyThreads.empty()) {
+    // Each guest thread has its own `CommandBuffer`, but its deferred calls
+    // must still reach native code before the next thread's calls do (e.g.,
+    // GL state it set and another thread's draw call which relies on it).
+    flushCommands();
+    SwitchToFiber(SchedulerFiber);
+  }
+}
+
+// Budgets running out at the same few instructions with no crossing in between
+// mean the thread loops, most likely waiting for another one. It's certain if
+// the loop tries to take a lock with exclusive loads and stores.
+bool SysTranslator::isSpinning(uint32_t PC) {
+  uint32_t Now = Progress.load(memory_order_relaxed);
+  uint32_t Low = min(Spin.Low, PC), High = max(Spin.High, PC);
+  if (!Spin.Slices || Now != Spin.Progress || High - Low >= SpinWindow) {
+    Spin = {PC, PC, Now, 1, 0};
+    return false;
+  }
+  Spin.Low = Low;
+  Spin.High = High;
+  if (++Spin.Slices < 2)
+    return false;
+
+  // Look around the samples for exclusives, but not outside of their pages,
+  // which are surely mapped.
+  auto Page = [](uint32_t Addr) {
+    return static_cast<uint32_t>(DynamicLoader::alignToPageSize(Addr));
+  };
+  uint32_t Start = max(Page(Low), Low - SpinWindow / 2);
+  uint32_t End = min(Page(High) + uint32_t(DynamicLoader::PageSize),
+                     High + SpinWindow / 2);
+  return Spin.Slices >= 4 || hasExclusives(Start, End, PC & 1);
+}
+
+void SysTranslator::yieldSpin() {
+  if (CurrentThread && !ReadyThreads.empty()) {
+    preempt();
+    return;
+  }
+
+  // There is no other guest thread here, so let other host threads run. If
+  // there are none for a while, sleep, so that we don't burn the whole core.
+  if (!SwitchToThread() && ++Spin.Yields > SpinYieldsBeforeSleep)
+    Sleep(1);
+}
+
+bool SysTranslator::takeIdleWait() {
+  if (!CurrentThread)
+    return false;
+  bool Park = CurrentThread->PendingIdleWait && !ReadyThreads.empty();
+  CurrentThread->PendingIdleWait = false;
+  return Park;
+}
+
+void SysTranslator::parkCall(void (*Thunk)(void *), void *Data) {
+  if (!WakeEvent) {
+    WakeEvent = CreateEventW(nullptr, /* bManualReset */ FALSE,
+                             /* bInitialState */ FALSE, nullptr);
+    if (!WakeEvent) {
+      Log.winError("couldn't create event for parked guest threads");
+      Thunk(Data);
+      return;
+    }
+  }
+  GuestThread *T = CurrentThread;
+  ParkedCall P{Thunk, Data, &T->Parked, WakeEvent};
+  T->Parked.store(true, memory_order_relaxed);
+  if (!TrySubmitThreadpoolCallback(&runParkedCall, &P, nullptr)) {
+    T->Parked.store(false, memory_order_relaxed);
+    Thunk(Data);
+    return;
+  }
+  IpaSim.Stats.add(Stat::ParkedWaits);
+
+  // Deferred calls were flushed when the guest crossed into the parked call,
+  // so other threads can run now. The scheduler doesn't switch back to us
+  // until the call returns.
+  SwitchToFiber(SchedulerFiber);
+}
+
+void SysTranslator::guestThreadProc(void *Data) {
+  auto *T = reinterpret_cast<GuestThread *>(Data);
+  SysTranslator &Sys = IpaSim.sys();
+
+  // Host fibers of `callInsideHook` should return to this fiber.
+  Sys.MainFiber = GetCurrentFiber();
+  Sys.Emu.writeReg(UC_ARM_REG_SP, T->Stack->Top);
+  Sys.Emu.writeReg(UC_ARM_REG_C13_C0_3, reinterpret_cast<uintptr_t>(T->TSD));
+  Sys.callBack(T->Func, T->Arg);
+  // The runtime drains pools of exiting threads, too.
+  if constexpr (GuestAutoreleasePools)
+    if (GuestPoolPage *Page = Sys.getPoolPage())
+      Sys.popPool(*Page, 0);
+  IpaSim.TSD.runDestructors(T->TSD, [&](uint32_t Destructor, uint32_t Value) {
+    Sys.callBack(reinterpret_cast<void *>(Destructor),
+                 reinterpret_cast<void *>(Value));
+  });
+
+  // Its `CommandBuffer` is freed along with its TSD.
+  Sys.flushCommands();
+  T->Done = true;
+  SwitchToFiber(Sys.SchedulerFiber);
+}
+
 // Note that we never return `true` from this handler, so that protected memory
 // stays protected in Unicorn. If we returned `true`, Unicorn would fetch the
 // memory, and it would get into the cache, effectively becoming unprotected.
 bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
                                        int Size, int64_t Value) {
+  // Native code must see effects of deferred calls. See `CommandBuffer`.
+  flushCommands();
+  Progress.fetch_add(1, memory_order_relaxed);
+
   // Handle return to kernel.
   if (Addr == Dyld.getKernelAddr()) {
+    IpaSim.Stats.add(Stat::KernelReturns);
     returnToKernel();
 
     Emu.ignoreNextError();
     return false;
   }
 
+  // Handle lazy binding.
+  if (Addr == Dyld.getStubBinderAddr()) {
+    IpaSim.Stats.add(Stat::StubBinds);
+    handleStubBinder();
+
+    Emu.ignoreNextError();
+    return false;
+  }
+
+  // Handle guest heap functions.
+  if constexpr (GuestMalloc)
+    if (handleGuestMalloc(Addr)) {
+      IpaSim.Stats.add(Stat::GuestMallocs);
+      Emu.ignoreNextError();
+      return false;
+    }
+
+  // Handle string functions.
+  if constexpr (NativeStringFunctions)
+    if (handleStringFunction(Addr)) {
+      IpaSim.Stats.add(Stat::StringFunctions);
+      Emu.ignoreNextError();
+      return false;
+    }
+
+  // Handle `libdyld` functions.
+  if (handleDyldFunction(Addr)) {
+    IpaSim.Stats.add(Stat::DyldFunctions);
+    Emu.ignoreNextError();
+    return false;
+  }
+
+  // Handle thread-specific data functions.
+  if constexpr (NativeTSD)
+    if (handleTSDFunction(Addr)) {
+      IpaSim.Stats.add(Stat::TSDFunctions);
+      Emu.ignoreNextError();
+      return false;
+    }
+
+  // Handle spin lock functions.
+  if constexpr (NativeSpinLocks)
+    if (handleSpinLockFunction(Addr)) {
+      IpaSim.Stats.add(Stat::SpinLocks);
+      Emu.ignoreNextError();
+      return false;
+    }
+
+  const CallTarget *Target = getCallTarget(Addr);
+  if (!Target) {
+    IpaSim.Stats.add(Stat::UnresolvedCalls);
+    return false;
+  }
+  callTarget(*Target);
+
+  Emu.ignoreNextError();
+  return false;
+}
+
+// Emulates `dyld_stub_binder`. Entries of `__stub_helper` push lazy binding
+// info offset and address inside the image onto the stack and jump here. Other
+// registers still contain arguments of the function being bound.
+void SysTranslator::handleStubBinder() {
+  uint32_t SP = Emu.readReg(UC_ARM_REG_SP);
+  auto *Stack = reinterpret_cast<const uint32_t *>(SP);
+  uint64_t Target = Dyld.bindLazySymbol(Stack[0], Stack[1]);
+  if (!Target) {
+    abort();
+    return;
+  }
+
+  if (IpaSim.Traces.isEnabled(TraceCategory::Loader))
+    Log.info() << "lazily bound " << Dyld.dumpAddr(Target) << Log.end();
+
+  // Pop what `__stub_helper` pushed and continue to the bound function.
+  Emu.writeReg(UC_ARM_REG_SP, SP + 8);
+  Emu.stop();
+  restartAt(Target);
+}
+
+// Emulates CRT heap functions using `GuestHeap`, so that memory allocated by
+// the guest is mapped before it's returned. See `GuestMalloc`.
+bool SysTranslator::handleGuestMalloc(uint64_t Addr) {
+  using KernelFunction = DynamicLoader::KernelFunction;
+
+  if (!Dyld.isKernelAddr(Addr))
+    return false;
+  uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
+  uint32_t R1 = Emu.readReg(UC_ARM_REG_R1);
+  auto *Ptr = reinterpret_cast<void *>(R0);
+  void *Result = nullptr;
+  // Size of the allocation, if any (see `AllocationProfiler`).
+  size_t Allocated = 0;
+  switch (static_cast<KernelFunction>(Addr - Dyld.getKernelAddr())) {
+  case KernelFunction::Malloc:
+    Result = IpaSim.Heap.allocate(R0);
+    Allocated = R0;
+    break;
+  case KernelFunction::Calloc:
+    Result = IpaSim.Heap.allocateZeroed(R0, R1);
+    Allocated = size_t(R0) * R1;
+    break;
+  case KernelFunction::Realloc:
+    Result = IpaSim.Heap.reallocate(Ptr, R1);
+    if constexpr (AllocationSampleInterval != 0)
+      if (Result || !R1)
+        IpaSim.Allocations.free(Ptr);
+    Allocated = R1;
+    break;
+  case KernelFunction::Free:
+    if constexpr (AllocationSampleInterval != 0)
+      IpaSim.Allocations.free(Ptr);
+    IpaSim.Heap.free(Ptr);
+    break;
+  default:
+    return false;
+  }
+  if constexpr (AllocationSampleInterval != 0)
+    IpaSim.Allocations.allocate(Result, Allocated, /* InGuest */ true);
+
+  // Return to the caller.
+  Emu.writeReg(UC_ARM_REG_R0, reinterpret_cast<uint32_t>(Result));
+  Emu.stop();
+  restartAt(Emu.readReg(UC_ARM_REG_LR));
+  return true;
+}
+
+// Runs host versions of string functions bound by `findKernelSymbol`. Guest
+// and host share address space, so pointer arguments can be used directly.
+// This is much cheaper than going through their wrappers, since the functions
+// are called very often and none of them can call back into emulated code.
+bool SysTranslator::handleStringFunction(uint64_t Addr) {
+  using KernelFunction = DynamicLoader::KernelFunction;
+
+  if (!Dyld.isKernelAddr(Addr))
+    return false;
+  uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
+  uint32_t R1 = Emu.readReg(UC_ARM_REG_R1);
+  uint32_t R2 = Emu.readReg(UC_ARM_REG_R2);
+  auto *P0 = reinterpret_cast<void *>(R0);
+  auto *P1 = reinterpret_cast<void *>(R1);
+  uint32_t Result = R0;
+  switch (static_cast<KernelFunction>(Addr - Dyld.getKernelAddr())) {
+  case KernelFunction::Memcpy:
+    memcpy(P0, P1, R2);
+    break;
+  case KernelFunction::Memmove:
+    memmove(P0, P1, R2);
+    break;
+  case KernelFunction::Memset:
+    memset(P0, static_cast<int>(R1), R2);
+    break;
+  case KernelFunction::Bzero:
+    memset(P0, 0, R1);
+    break;
+  case KernelFunction::Strlen:
+    Result = static_cast<uint32_t>(strlen(static_cast<const char *>(P0)));
+    break;
+  case KernelFunction::Strcmp:
+    Result = static_cast<uint32_t>(strcmp(static_cast<const char *>(P0),
+                                          static_cast<const char *>(P1)));
+    break;
+  case KernelFunction::Memcmp:
+    Result = static_cast<uint32_t>(memcmp(P0, P1, R2));
+    break;
+  default:
+    return false;
+  }
+
+  // Return to the caller.
+  Emu.writeReg(UC_ARM_REG_R0, Result);
+  Emu.stop();
+  restartAt(Emu.readReg(UC_ARM_REG_LR));
+  return true;
+}
+
+// Implements `libdyld` functions bound by `findKernelSymbol` on top of indexes
+// of `DynamicLoader`. Most of them only read the indexes, so they return right
+// from the fetch hook. `dlopen` and `dlclose` can run guest code (e.g., `+load`
+// methods or handlers of unmapped images), so they are called outside
+// emulation.
+bool SysTranslator::handleDyldFunction(uint64_t Addr) {
+  using KernelFunction = DynamicLoader::KernelFunction;
+
+  if (!Dyld.isKernelAddr(Addr))
+    return false;
+  uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
+  uint32_t R1 = Emu.readReg(UC_ARM_REG_R1);
+  auto *S0 = reinterpret_cast<const char *>(R0);
+  auto *S1 = reinterpret_cast<const char *>(R1);
+  uint64_t Result = 0;
+  switch (static_cast<KernelFunction>(Addr - Dyld.getKernelAddr())) {
+  case KernelFunction::Dlopen:
+    continueOutsideEmulation([=]() {
+      uint64_t Handle = Dyld.openHandle(S0, R1);
+      if (!Handle)
+        setDlError("image not found: ", S0 ? S0 : "(main binary)");
+      Emu.writeReg(UC_ARM_REG_R0, static_cast<uint32_t>(Handle));
+      returnToEmulation();
+    });
+    return true;
+  case KernelFunction::Dlclose:
+    continueOutsideEmulation([=]() {
+      bool Closed = Dyld.closeHandle(R0);
+      if (!Closed)
+        setDlError("invalid handle", "");
+      Emu.writeReg(UC_ARM_REG_R0, Closed ? 0 : uint32_t(-1));
+      returnToEmulation();
+    });
+    return true;
+  case KernelFunction::Dlsym:
+    Result = Dyld.findExport(R0, S1, Emu.readReg(UC_ARM_REG_LR));
+    if (!Result)
+      setDlError("symbol not found: ", S1);
+    break;
+  case KernelFunction::Dlerror:
+    Result = DlFailed ? reinterpret_cast<uintptr_t>(DlError.c_str()) : 0;
+    DlFailed = false;
+    break;
+  case KernelFunction::Dladdr: {
+    // Fills `Dl_info`.
+    SymbolInfo Info;
+    if (Dyld.symbolize(R0, Info)) {
+      auto *Out = reinterpret_cast<uint32_t *>(R1);
+      Out[0] = reinterpret_cast<uintptr_t>(Info.Path);
+      Out[1] = static_cast<uint32_t>(Info.Base);
+      Out[2] = reinterpret_cast<uintptr_t>(Info.Symbol);
+      Out[3] = static_cast<uint32_t>(Info.SymbolAddr);
+      Result = 1;
+    }
+    break;
+  }
+  case KernelFunction::ImageCount:
+    Result = Dyld.getImageCount();
+    break;
+  case KernelFunction::ImageHeader:
+  case KernelFunction::ImageSlide:
+  case KernelFunction::ImageName: {
+    LibraryInfo LI(Dyld.getImage(R0));
+    if (!LI.Lib)
+      break;
+    auto F = static_cast<KernelFunction>(Addr - Dyld.getKernelAddr());
+    if (F == KernelFunction::ImageHeader)
+      Result = LI.Lib->getBase();
+    else if (F == KernelFunction::ImageName)
+      Result = reinterpret_cast<uintptr_t>(LI.LibPath->c_str());
+    // Mach-O headers inside DLLs already contain actual addresses.
+    else if (LI.Lib->isDylib())
+      Result = LI.Lib->StartAddress;
+    break;
+  }
+  default:
+    return false;
+  }
+
+  // Return to the caller.
+  Emu.writeReg(UC_ARM_REG_R0, static_cast<uint32_t>(Result));
+  Emu.stop();
+  restartAt(Emu.readReg(UC_ARM_REG_LR));
+  return true;
+}
+
+void SysTranslator::setDlError(const char *Message, const char *Detail) {
+  DlError = string(Message) + Detail;
+  DlFailed = true;
+}
+
+// Implements `pthread_*specific` and `pthread_key_*` bound by
+// `findKernelSymbol`. Values are read from the block TPIDRURO points to, so
+// that they are the same ones inlined accessors see.
+bool SysTranslator::handleTSDFunction(uint64_t Addr) {
+  using KernelFunction = DynamicLoader::KernelFunction;
+
+  if (!Dyld.isKernelAddr(Addr))
+    return false;
+  uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
+  uint32_t R1 = Emu.readReg(UC_ARM_REG_R1);
+  // The lowest bits are reserved for the CPU number on iOS.
+  auto *Block = reinterpret_cast<uint32_t *>(
+      static_cast<uintptr_t>(Emu.readReg(UC_ARM_REG_C13_C0_3) & ~3U));
+  uint32_t Result = 0;
+  switch (static_cast<KernelFunction>(Addr - Dyld.getKernelAddr())) {
+  case KernelFunction::Getspecific:
+    if (Block && GuestTSD::isValid(R0))
+      Result = Block[R0];
+    break;
+  case KernelFunction::Setspecific:
+    if (Block && GuestTSD::isValid(R0))
+      Block[R0] = R1;
+    else
+      Result = GuestEINVAL;
+    break;
+  case KernelFunction::KeyCreate: {
+    uint32_t Key;
+    if (IpaSim.TSD.createKey(R1, Key))
+      *reinterpret_cast<uint32_t *>(R0) = Key;
+    else
+      Result = GuestEAGAIN;
+    break;
+  }
+  case KernelFunction::KeyDelete:
+    if (!IpaSim.TSD.deleteKey(R0))
+      Result = GuestEINVAL;
+    break;
+  default:
+    return false;
+  }
+
+  // Return to the caller.
+  Emu.writeReg(UC_ARM_REG_R0, Result);
+  Emu.stop();
+  restartAt(Emu.readReg(UC_ARM_REG_LR));
+  return true;
+}
+
+// Implements spin locks bound by `findKernelSymbol`. Unlike in emulated code,
+// contended locks don't spin. Waiters yield to other guest threads (one of
+// which might hold the lock) or block on the host until the lock is released.
+bool SysTranslator::handleSpinLockFunction(uint64_t Addr) {
+  using KernelFunction = DynamicLoader::KernelFunction;
+
+  if (!Dyld.isKernelAddr(Addr))
+    return false;
+  auto *Lock = reinterpret_cast<volatile LONG *>(
+      static_cast<uintptr_t>(Emu.readReg(UC_ARM_REG_R0)));
+  uint32_t Result = 0;
+  switch (static_cast<KernelFunction>(Addr - Dyld.getKernelAddr())) {
+  case KernelFunction::SpinLockLock:
+  case KernelFunction::UnfairLock:
+    if (tryLock(Lock))
+      break;
+    IpaSim.Stats.add(Stat::SpinWaits);
+    // Waiting can switch to other guest threads, which must be done outside
+    // emulation.
+    continueOutsideEmulation([=]() {
+      for (uint32_t Spins = 0; !tryLock(Lock); ++Spins)
+        waitForLock(Lock, Spins);
+      returnToEmulation();
+    });
+    return true;
+  case KernelFunction::SpinLockTry:
+  case KernelFunction::UnfairTrylock:
+    Result = tryLock(Lock);
+    break;
+  case KernelFunction::SpinLockUnlock:
+  case KernelFunction::UnfairUnlock:
+    InterlockedExchange(Lock, 0);
+    WakeByAddressAll(const_cast<LONG *>(Lock));
+    break;
+  default:
+    return false;
+  }
+
+  // Return to the caller.
+  Emu.writeReg(UC_ARM_REG_R0, Result);
+  Emu.stop();
+  restartAt(Emu.readReg(UC_ARM_REG_LR));
+  return true;
+}
+
+void SysTranslator::waitForLock(volatile long *Lock, uint32_t Spins) {
+  if (CurrentThread && !ReadyThreads.empty()) {
+    preempt();
+    return;
+  }
+  if (Spins < LockSpins) {
+    YieldProcessor();
+    return;
+  }
+  // The holder wakes us up when it unlocks, unless it does so by other means
+  // than the functions above, hence the timeout.
+  LONG Held = *Lock;
+  if (Held)
+    WaitOnAddress(const_cast<LONG *>(Lock), &Held, sizeof(Held), 1);
+}
+
+// Resolves target of a call to native address `Addr` (or uses the cached one).
+// Returns `nullptr` if it cannot be resolved.
+const SysTranslator::CallTarget *SysTranslator::getCallTarget(uint64_t Addr) {
+  if (SeenUnloads != Dyld.getUnloadCount())
+    forgetUnloaded();
+  auto It = CallTargets.find(Addr);
+  if (It == CallTargets.end()) {
+    IpaSim.Stats.add(Stat::CallTargetMisses);
+    CallTarget Target;
+    if (!resolveCallTarget(Addr, Target))
+      return nullptr;
+    if constexpr (WrapperCoverage)
+      IpaSim.Crossings.cover(Addr);
+    It = CallTargets.emplace(Addr, move(Target)).first;
+  } else {
+    IpaSim.Stats.add(Stat::CallTargetHits);
+    if (IpaSim.Traces.isEnabled(TraceCategory::Crossings))
+      Log.info() << "fetch prot. mem. at " << Dyld.dumpAddr(Addr)
+                 << " (cached)" << Log.end();
+  }
+  return &It->second;
+}
+
+void SysTranslator::forgetUnloaded() {
+  lock_guard<recursive_mutex> Lock(TranslationMutex);
+  uint32_t Since = SeenUnloads;
+  SeenUnloads = Dyld.getUnloadCount();
+  // Targets are cheap to resolve again.
+  CallTargets.clear();
+  for (auto It = Trampolines.begin(); It != Trampolines.end();) {
+    if (!Dyld.wasUnloaded(It->first.first, Since)) {
+      ++It;
+      continue;
+    }
+    if (Trampoline *Tr = Arena.lookup(It->second))
+      Arena.release(Tr);
+    It = Trampolines.erase(It);
+  }
+}
+
+// Finds out what should be done when the guest calls native address `Addr`.
+bool SysTranslator::resolveCallTarget(uint64_t Addr, CallTarget &Target) {
   // Check that the target address is in some loaded library.
   LibraryInfo LI(Dyld.lookup(Addr));
   if (!LI.Lib) {
@@ -167,7 +1330,7 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
   bool Wrapper = LI.Lib->IsWrapper;
 
   // Log details.
-  if constexpr (PrintEmuInfo) {
+  if (IpaSim.Traces.isEnabled(TraceCategory::Crossings)) {
     Log.info() << "fetch prot. mem. at " << Dyld.dumpAddr(Addr, LI);
     if (!Wrapper)
       Log.infs() << " (not a wrapper)";
@@ -175,138 +1338,676 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
   }
 
   if (Wrapper) {
-    // Read register R0 containing address of our structure with function
-    // arguments and return value.
-    uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
-
-    continueOutsideEmulation([=]() {
-      // Call the target function.
-      auto *Func = reinterpret_cast<void (*)(uint32_t)>(Addr);
-      Func(R0);
-
-      returnToEmulation();
-    });
-
-    Emu.ignoreNextError();
-    return false;
+    Target.Kind = CallTarget::WrapperDLL;
+    Target.Addr = Addr;
+    uint32_t Info = WrapperInfo::get(Addr);
+    Target.Leaf = Info & WrapperInfo::Leaf;
+    Target.Registers = Info & WrapperInfo::Registers;
+    Target.UIThread = IpaSim.UI.needsUIThread(Addr);
+    if constexpr (AllocationSampleInterval != 0)
+      Target.Allocator =
+          IpaSim.Allocations.isAllocator(Dyld.getWrappedFunction(Addr));
+    if constexpr (OptimizedReturns)
+      if (Target.Registers)
+        Target.Handshake = static_cast<CallTarget::HandshakeTy>(
+            getHandshake(Dyld.getWrappedFunction(Addr)));
+    if constexpr (GuestAutoreleasePools) {
+      FARPROC Pop = getObjCFunction("objc_autoreleasePoolPop");
+      Target.PoolPop = Pop && Dyld.getWrappedFunction(Addr) ==
+                                  reinterpret_cast<uint64_t>(Pop);
+    }
+    return true;
   }
 
   // If the target is not a wrapper DLL, we must find and call the corresponding
   // wrapper instead.
   filesystem::path DLLPath(*LI.LibPath);
-  filesystem::path WrapperPath(
-      filesystem::path("gen") /
-      DLLPath.filename().replace_extension(".wrapper.dll"));
-  LoadedLibrary *WrapperLib = Dyld.load(WrapperPath.string());
+  string WrapperPath(DynamicLoader::getWrapperPath(*LI.LibPath));
+  LoadedLibrary *WrapperLib = Dyld.load(WrapperPath);
   if (!WrapperLib) {
     Log.error() << "cannot find wrapper DLL " << WrapperPath << Log.end();
     return false;
   }
 
   // Load `WrapperIndex`.
-  uint64_t IdxAddr =
-      WrapperLib->findSymbol(Dyld, "?Idx@@3UWrapperIndex@ipasim@@A");
-  auto *Idx = reinterpret_cast<WrapperIndex *>(IdxAddr);
+  const WrapperIndex *Idx = Dyld.getWrapperIndex(WrapperLib);
 
   uint64_t RVA = Addr - LI.Lib->StartAddress + DLLBase;
 
   // Find Dylib with the corresponding wrapper.
-  auto Entry = Idx->Map.find(RVA);
-  if (Entry != Idx->Map.end()) {
-    const string &Dylib = Idx->Dylibs[Entry->second];
+  uint32_t Entry = Idx ? Idx->find(RVA) : WrapperIndex::NotFound;
+  if (Entry != WrapperIndex::NotFound) {
+    const char *Dylib = Idx->Dylibs[Idx->DylibIdxs[Entry]];
     LoadedLibrary *WrapperDylib = Dyld.load(Dylib);
     if (!WrapperDylib) {
       Log.error() << "cannot load wrapper Dylib " << Dylib << Log.end();
       return false;
     }
 
-    // Find the correct wrapper using its alias.
-    Addr = WrapperDylib->findSymbol(
-        Dyld, WrapsPrefix.S + DLLPath.stem().string() + "_" + to_string(RVA));
-    if (!Addr) {
+    // Find the correct wrapper. Its offset is usually recorded in the index,
+    // otherwise we look it up using its alias.
+    uint64_t WrapperAddr =
+        Idx->Offsets[Entry]
+            ? WrapperDylib->StartAddress + Idx->Offsets[Entry]
+            : WrapperDylib->findSymbol(Dyld, LoadedDylib::WrapsPrefix.S +
+                                                 DLLPath.stem().string() + "_" +
+                                                 to_string(RVA));
+    if (!WrapperAddr) {
       Log.error() << "cannot find wrapper for 0x" << to_hex_string(RVA)
                   << " in " << *LI.LibPath << Log.end();
       return false;
     }
 
-    if constexpr (PrintEmuInfo)
-      Log.info() << "found wrapper at " << Dyld.dumpAddr(Addr) << Log.end();
+    if (IpaSim.Traces.isEnabled(TraceCategory::Crossings))
+      Log.info() << "found wrapper at " << Dyld.dumpAddr(WrapperAddr)
+                 << Log.end();
+
+    // Waits are parked only if they go through here.
+    uint64_t SymAddr = 0;
+    const char *Name = LI.Lib->findNearestSymbol(Addr, SymAddr);
+    Target.IdleWait = ParkIdleWaits && SymAddr == Addr && isIdleWait(Name);
+
+    // Let the next calls go to the wrapper directly.
+    if constexpr (PatchCallSites)
+      if (!Target.IdleWait)
+        if (size_t Count = Dyld.patchCallSites(Addr, WrapperAddr))
+          Log.info() << "patched " << Count << " call site(s) of "
+                     << Dyld.dumpAddr(Addr, LI) << " (total "
+                     << Dyld.getPatchedCallSites() << ")" << Log.end();
+
+    Target.Kind = CallTarget::WrapperDylib;
+    Target.Addr = WrapperAddr;
+    return true;
+  }
+
+  // If there's no corresponding wrapper, maybe this is a simple Objective-C
+  // method and we can translate it dynamically. Its type encoding is usually
+  // recorded in the index, otherwise we find the method in metadata.
+  ObjCMethod M;
+  const char *Type = Idx ? Idx->findMethodType(RVA) : nullptr;
+  if (!Type) {
+    M = LI.Lib->findMethod(Addr);
+    if (!M) {
+      Log.error() << "cannot find Objective-C method for "
+                  << Dyld.dumpAddr(Addr, LI) << Log.end();
+      return false;
+    }
+    Type = M.getType();
+  }
+  auto DumpMethod = [&]() {
+    return M ? Dyld.dumpAddr(Addr, LI, M) : Dyld.dumpAddr(Addr, LI);
+  };
+
+  if (IpaSim.Traces.isEnabled(TraceCategory::ObjC))
+    Log.info() << "dynamically handling method " << DumpMethod() << Log.end();
 
+  const CallShape *Shape = getCallShape(Type);
+  if (!Shape) {
+    Log.error() << "unsupported signature of " << DumpMethod() << Log.end();
+    return false;
+  }
+  if (Shape->ArgWords > DynamicCaller::MaxArgs) {
+    Log.error() << "too many arguments of " << DumpMethod() << Log.end();
+    return false;
+  }
+
+  Target.Kind = CallTarget::DynamicMethod;
+  Target.Addr = Addr;
+  Target.Shape = Shape;
+  Target.UIThread = IpaSim.UI.needsUIThread(Addr);
+  return true;
+}
+
+// Call shapes are cached by type encoding, so that each distinct signature is
+// decoded only once. Failures are cached, too. Note that `Type` must be
+// pointer-stable (like Objective-C type encodings are), since we also cache
+// shapes by its address to avoid hashing the whole string.
+const CallShape *SysTranslator::getCallShape(const char *Type) {
+  lock_guard<recursive_mutex> Lock(TranslationMutex);
+  auto PtrIt = ShapesByType.find(Type);
+  if (PtrIt != ShapesByType.end()) {
+    IpaSim.Stats.add(Stat::ShapeHits);
+    return PtrIt->second;
+  }
+  IpaSim.Stats.add(Stat::ShapeMisses);
+
+  auto [It, New] = CallShapes.try_emplace(Type);
+  if (New) {
+    auto Shape = make_unique<CallShape>();
+    if (TypeDecoder(Type).decode(*Shape))
+      It->second = move(Shape);
+  }
+  const CallShape *Shape = It->second.get();
+  ShapesByType[Type] = Shape;
+  return Shape;
+}
+
+template <typename FuncTy>
+void SysTranslator::callNative(bool UIThread, FuncTy &&Func, bool Reentrant,
+                               bool Park) {
+  if (UIThread && IpaSim.UI.isEmulationThread())
+    IpaSim.UI.callOnUI(Func, Reentrant);
+  else if (Park)
+    parkCall(
+        [](void *F) { (*static_cast<remove_reference_t<FuncTy> *>(F))(); },
+        &Func);
+  else
+    Func();
+}
+
+void SysTranslator::callTarget(const CallTarget &Target) {
+  uint64_t Addr = Target.Addr;
+  switch (Target.Kind) {
+  case CallTarget::WrapperDLL: {
+    IpaSim.Stats.add(Stat::WrapperCalls);
+    // The class is the first argument, i.e., the first field of the wrapper's
+    // argument structure.
+    if constexpr (AllocationSampleInterval != 0) {
+      uint32_t Class = 0;
+      if (Target.Allocator) {
+        Class = Emu.readReg(UC_ARM_REG_R0);
+        if (!Target.Registers)
+          Class = *reinterpret_cast<const uint32_t *>(Class);
+      }
+      AllocationProfiler::expectClass(Class);
+    }
+    if (Target.Handshake != CallTarget::NoHandshake &&
+        handleHandshake(Target)) {
+      IpaSim.Stats.add(Stat::FastReturns);
+      break;
+    }
+    // Objects autoreleased by native code belong to the innermost guest pool.
+    if constexpr (GuestAutoreleasePools)
+      if (!Target.PoolPop)
+        syncPools();
+    if (Target.Registers) {
+      callRegisterWrapper(Target);
+      break;
+    }
+    if (IpaSim.Recorder.isActive())
+      recordCall(Target);
+
+    // Read register R0 containing address of our structure with function
+    // arguments and return value.
+    uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
+
+    // Leaf functions cannot start emulation, so we can call them right away.
+    // Unless they are parked, since that switches to other guest threads.
+    bool Park = takeIdleWait();
+    if (Target.Leaf && !Park) {
+      {
+        CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::WrapperDLL,
+                                   Addr);
+        callNative(
+            Target.UIThread,
+            [=]() { reinterpret_cast<void (*)(uint32_t)>(Addr)(R0); },
+            /* Reentrant */ false);
+      }
+      Emu.stop();
+      returnToEmulation();
+      break;
+    }
+
+    continueOutsideEmulation([=, UIThread = Target.UIThread]() {
+      // Call the target function.
+      auto *Func = reinterpret_cast<void (*)(uint32_t)>(Addr);
+      {
+        CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::WrapperDLL,
+                                   Addr);
+        callNative(
+            UIThread, [=]() { Func(R0); }, /* Reentrant */ true, Park);
+      }
+
+      returnToEmulation();
+    });
+    break;
+  }
+  case CallTarget::WrapperDylib: {
+    IpaSim.Stats.add(Stat::DylibCalls);
+    // The wrapper is going to make the native call.
+    // Only guest threads can be parked.
+    if constexpr (ParkIdleWaits)
+      if (CurrentThread)
+        CurrentThread->PendingIdleWait = Target.IdleWait;
+    // Only the redirection itself is measured, the wrapper is emulated.
+    CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::Wrapper, Addr);
     // Note that doing just `Emu.writeReg(UC_ARM_REG_PC, Addr);` instead of all
     // this didn't work in Release mode for some reason.
     Emu.stop();
-    Restart = true;
-    RestartFromLRs = true;
-    LRs.push(Addr);
+    restartAt(Addr);
+    break;
+  }
+  case CallTarget::DynamicMethod:
+    IpaSim.Stats.add(Stat::DynamicCalls);
+    if constexpr (GuestAutoreleasePools)
+      syncPools();
+    if (IpaSim.Recorder.isActive())
+      recordCall(Target);
+    continueOutsideEmulation([=, Shape = Target.Shape,
+                              UIThread = Target.UIThread]() {
+      // Emulation is stopped at this point, so arguments can still be loaded
+      // from the emulator.
+      CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::Dynamic,
+                                 Addr);
+      DynamicCaller DC(Emu, *Shape);
+      callNative(UIThread, [&]() { DC.call(Addr); });
+
+      returnToEmulation();
+    });
+    break;
+  }
+}
+
+// Calls DLL wrapper with `WrapperInfo::Registers`. It reads arguments from
+// `RegisterBlock` loaded from the emulator, so the guest doesn't have to store
+// them anywhere.
+void SysTranslator::callRegisterWrapper(const CallTarget &Target) {
+  static constexpr uc_arm_reg Regs[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                        UC_ARM_REG_R2, UC_ARM_REG_R3,
+                                        UC_ARM_REG_SP};
+  uint32_t Values[5];
+  Emu.readRegs(Regs, Values);
+  RegisterBlock Block;
+  copy(begin(Values), begin(Values) + RegisterBlock::ArgRegs, Block.R);
+  Block.SP = Values[RegisterBlock::ArgRegs];
+  auto *Func = reinterpret_cast<void (*)(RegisterBlock *)>(Target.Addr);
+  size_t Recorded = IpaSim.Recorder.isActive()
+                        ? recordCall(Target, Values)
+                        : CrossingRecorder::None;
+
+  bool Park = takeIdleWait();
+  if (Target.Leaf && !Park) {
+    if (!IpaSim.Recorder.replayResult(Recorded, Block)) {
+      CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::WrapperDLL,
+                                 Target.Addr);
+      callNative(
+          Target.UIThread, [&]() { Func(&Block); }, /* Reentrant */ false);
+    }
+    IpaSim.Recorder.setResult(Recorded, Block);
+    writeResult(Block);
+    Emu.stop();
+    returnToEmulation();
+    return;
+  }
+
+  continueOutsideEmulation([=, UIThread = Target.UIThread]() mutable {
+    {
+      CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::WrapperDLL,
+                                 reinterpret_cast<uint64_t>(Func));
+      callNative(
+          UIThread, [&]() { Func(&Block); }, /* Reentrant */ true, Park);
+    }
+    IpaSim.Recorder.setResult(Recorded, Block);
+    writeResult(Block);
+    returnToEmulation();
+  });
+}
+
+// Adds call of `Target` to `IpaSim.Recorder`. `Regs` are R0-R3 and SP if they
+// have already been read.
+size_t SysTranslator::recordCall(const CallTarget &Target,
+                                 const uint32_t *Regs) {
+  static constexpr uc_arm_reg RegIds[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                          UC_ARM_REG_R2, UC_ARM_REG_R3,
+                                          UC_ARM_REG_SP};
+  uint32_t Values[size(RegIds)];
+  if (!Regs) {
+    Emu.readRegs(RegIds, Values);
+    Regs = Values;
+  }
+  uint8_t Flags = 0;
+  if (Target.Kind == CallTarget::WrapperDLL) {
+    if (Target.Leaf)
+      Flags |= CrossingRecord::Leaf;
+    if (Target.Registers)
+      Flags |= CrossingRecord::Registers;
+  }
+  return IpaSim.Recorder.addCall(Target.Addr, Flags, Regs);
+}
+
+// The runtime decides whether a value can be returned without autoreleasing
+// it by looking at its own return address, which is in a DLL wrapper for
+// emulated callers, so we do it here instead. Both sides run as emulated code,
+// hence the disposition is stored in the guest's thread-specific data.
+bool SysTranslator::handleHandshake(const CallTarget &Target) {
+  // The lowest bits are reserved for the CPU number on iOS.
+  auto *Block = reinterpret_cast<uint32_t *>(
+      static_cast<uintptr_t>(Emu.readReg(UC_ARM_REG_C13_C0_3) & ~3U));
+  if (!Block)
+    return false;
+  uint32_t &AtPlusOne = Block[GuestTSD::ReturnDispositionKey];
+  uint32_t Obj = Emu.readReg(UC_ARM_REG_R0);
+  switch (Target.Handshake) {
+  case CallTarget::AutoreleaseRV:
+    // The caller takes over our reference instead of the pool.
+    if (!acceptsOptimizedReturn(Emu.readReg(UC_ARM_REG_LR)))
+      return false;
+    AtPlusOne = 1;
+    break;
+  case CallTarget::RetainAutoreleaseRV:
+    // Neither retained nor autoreleased, the caller retains it.
+    if (!acceptsOptimizedReturn(Emu.readReg(UC_ARM_REG_LR)))
+      return false;
+    AtPlusOne = 0;
+    break;
+  case CallTarget::RetainAutoreleasedRV:
+    // Otherwise, the runtime retains the object.
+    if (!AtPlusOne)
+      return false;
+    AtPlusOne = 0;
+    break;
+  case CallTarget::ClaimAutoreleasedRV:
+    // At +0, the object is already in the pool (or it's ours), so there is
+    // nothing to do. At +1, we must release the reference we were given, which
+    // can run `dealloc` of emulated classes.
+    if (AtPlusOne) {
+      AtPlusOne = 0;
+      continueOutsideEmulation([=]() {
+        callNative(false, [=]() { releaseObject(Obj); });
+        Emu.writeReg(UC_ARM_REG_R0, Obj);
+        returnToEmulation();
+      });
+      return true;
+    }
+    break;
+  default:
+    return false;
+  }
+  // The object stays in R0 as the result.
+  Emu.stop();
+  returnToEmulation();
+  return true;
+}
+
+uint32_t SysTranslator::getTSDSlot(uint32_t Key) {
+  // The lowest bits are reserved for the CPU number on iOS.
+  auto *Block = reinterpret_cast<uint32_t *>(
+      static_cast<uintptr_t>(Emu.readReg(UC_ARM_REG_C13_C0_3) & ~3U));
+  return Block ? Block[Key] : 0;
+}
+
+GuestPoolPage *SysTranslator::getPoolPage() {
+  return reinterpret_cast<GuestPoolPage *>(
+      static_cast<uintptr_t>(getTSDSlot(GuestTSD::AutoreleasePoolKey)));
+}
+
+void SysTranslator::syncPools() {
+  GuestPoolPage *Page = getPoolPage();
+  if (!Page || !Page->Top)
+    return;
+  uint32_t &Token = Page->Objects[Page->Top - 1];
+  if (Token == GuestPoolPage::Tag)
+    Token = pushNativePool() | GuestPoolPage::Tag;
+}
+
+CommandBuffer *SysTranslator::getCommandBuffer() {
+  return reinterpret_cast<CommandBuffer *>(
+      static_cast<uintptr_t>(getTSDSlot(GuestTSD::CommandBufferKey)));
+}
+
+void SysTranslator::flushCommands() {
+  if constexpr (!DeferredCalls)
+    return;
+  CommandBuffer *Buffer = getCommandBuffer();
+  if (!Buffer || !Buffer->Used)
+    return;
+  if constexpr (GuestAutoreleasePools)
+    syncPools();
+  executeCommands(*Buffer);
+}
+
+// Deferred wrappers don't call back into emulated code, so they are called
+// right here, like leaf wrappers in `callRegisterWrapper`, and they get the
+// same accounting.
+void SysTranslator::executeCommands(CommandBuffer &Buffer) {
+  uint32_t Used = Buffer.Used;
+  for (uint32_t I = 0; I < Used;) {
+    uint32_t *Record = Buffer.Words + I;
+    uint32_t Words = Record[1];
+    uint32_t *Args = Record + CommandBuffer::HeaderWords;
+
+    uint32_t Regs[RegisterBlock::ArgRegs + 1];
+    for (uint32_t J = 0; J != RegisterBlock::ArgRegs; ++J)
+      Regs[J] = J < Words ? Args[J] : 0;
+    Regs[RegisterBlock::ArgRegs] = static_cast<uint32_t>(
+        reinterpret_cast<uintptr_t>(Args + RegisterBlock::ArgRegs));
+    RegisterBlock Block;
+    copy(begin(Regs), begin(Regs) + RegisterBlock::ArgRegs, Block.R);
+    Block.SP = Regs[RegisterBlock::ArgRegs];
+
+    IpaSim.Stats.add(Stat::WrapperCalls);
+    IpaSim.Stats.add(Stat::DeferredCalls);
+    size_t Recorded =
+        IpaSim.Recorder.isActive()
+            ? IpaSim.Recorder.addCall(
+                  Record[0], CrossingRecord::Leaf | CrossingRecord::Registers,
+                  Regs)
+            : CrossingRecorder::None;
+    if (!IpaSim.Recorder.replayResult(Recorded, Block)) {
+      CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::WrapperDLL,
+                                 Record[0]);
+      reinterpret_cast<void (*)(RegisterBlock *)>(
+          static_cast<uintptr_t>(Record[0]))(&Block);
+    }
+    IpaSim.Recorder.setResult(Recorded, Block);
+
+    I += CommandBuffer::HeaderWords + Words;
+  }
+  Buffer.Used = 0;
+}
+
+// Like `AutoreleasePoolPage::pop`, the newest objects are released first.
+// Releasing can run emulated `dealloc`s which can autorelease more objects, so
+// the page is reread after each one.
+void SysTranslator::popPool(GuestPoolPage &Page, uint32_t Index) {
+  while (Page.Used > Index) {
+    uint32_t Word = Page.Objects[Page.Used - 1];
+    if (!GuestPoolPage::isBoundary(Word)) {
+      --Page.Used;
+      callNative(false, [=]() { releaseObject(Word); });
+      continue;
+    }
+    // This is the second word of a boundary.
+    Page.Used -= GuestPoolPage::BoundaryWords;
+    Page.Top = Page.Objects[Page.Used] >> 1;
+    if (uint32_t Token = GuestPoolPage::untag(Word))
+      callNative(false, [=]() { popNativePool(Token); });
+  }
+}
+
+// Moves result of DLL wrapper with `WrapperInfo::Registers` into R0-R1.
+// Doubles and 64-bit integers occupy both, R1 is scratch otherwise.
+void SysTranslator::writeResult(const RegisterBlock &Block) {
+  static constexpr uc_arm_reg Regs[] = {UC_ARM_REG_R0, UC_ARM_REG_R1};
+  static_assert(size(Regs) == RegisterBlock::ResultRegs);
+  uint32_t Values[RegisterBlock::ResultRegs] = {Block.R[0], Block.R[1]};
+  Emu.writeRegs(Regs, Values);
+}
+
+void SysTranslator::traceInstructions(bool Enable, LoadedLibrary *Lib) {
+  CodeHook.reset();
+  if (!Enable)
+    return;
+
+  // This hook logs execution for debugging purposes.
+  if (Lib)
+    CodeHook = Emu.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this,
+                        Lib->getStart(), Lib->getStart() + Lib->Size - 1);
+  else
+    CodeHook = Emu.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this);
+}
+
+void SysTranslator::traceMemoryWrites(bool Enable) {
+  MemWriteHook.reset();
+  if (Enable)
+    // This hook logs all memory writes.
+    MemWriteHook =
+        Emu.hook(UC_HOOK_MEM_WRITE, &SysTranslator::handleMemWrite, this);
+}
 
-    Emu.ignoreNextError();
-    return false;
-  }
+void SysTranslator::onReached(uint64_t Addr, void (*Callback)()) {
+  ReachCallback = Callback;
+  // Thumb functions have their lowest bit set.
+  ReachHook = Emu.hook(UC_HOOK_CODE, &SysTranslator::handleReached, this,
+                       Addr & ~1ULL, Addr & ~1ULL);
+}
 
-  // If there's no corresponding wrapper, maybe this is a simple Objective-C
-  // method and we can translate it dynamically.
-  ObjCMethod M = LI.Lib->getMachO().findMethod(Addr);
-  if (!M) {
-    Log.error() << "cannot find Objective-C method for "
-                << Dyld.dumpAddr(Addr, LI) << Log.end();
-    return false;
-  }
+void SysTranslator::handleReached(uint64_t Addr, uint32_t Size) {
+  if (IpaSim.Traces.isEnabled(TraceCategory::Emulation))
+    Log.info() << "reached " << Dyld.dumpAddr(Addr) << Log.end();
+  ReachCallback();
+}
 
-  if constexpr (PrintEmuInfo)
-    Log.info() << "dynamically handling method " << Dyld.dumpAddr(Addr, LI, M)
+void SysTranslator::handleTranslated(uint64_t Addr, uint32_t Size) {
+  const NativeTranslation *Func = IpaSim.Translations.find(Addr);
+  if (!Func || ctx().Continue)
+    return;
+  // Guest stacks are committed as they grow (see `handleMemUnmapped`), but
+  // native code would just crash on the uncommitted pages.
+  uint32_t SP = Emu.readReg(UC_ARM_REG_SP);
+  if (Func->FrameSize)
+    if (GuestStack *S = IpaSim.Stacks.lookup(SP)) {
+      // The bound can be too pessimistic near the guard page. If not, the
+      // emulator runs into the overflow.
+      uint64_t Bottom = uint64_t(SP) - Func->FrameSize;
+      if (Bottom < S->Base + DynamicLoader::PageSize ||
+          !IpaSim.Stacks.grow(*S, Bottom))
+        return;
+      Emu.syncMemory();
+    }
+  IpaSim.Stats.add(Stat::TranslatedCalls);
+  if (IpaSim.Traces.isEnabled(TraceCategory::Emulation))
+    Log.info() << "running translation of " << Dyld.dumpAddr(Addr)
                << Log.end();
 
-  // Handle return value.
-  TypeDecoder TD(M.getType());
-  bool Returns;
-  switch (TD.getNextTypeSize()) {
-  case 0:
-    Returns = false;
-    break;
-  case 4:
-    Returns = true;
-    break;
-  default:
-    Log.error() << "unsupported return type of " << Dyld.dumpAddr(Addr, LI, M)
-                << Log.end();
+  static constexpr uc_arm_reg RegIds[] = {
+      UC_ARM_REG_R0,  UC_ARM_REG_R1,  UC_ARM_REG_R2,  UC_ARM_REG_R3,
+      UC_ARM_REG_R4,  UC_ARM_REG_R5,  UC_ARM_REG_R6,  UC_ARM_REG_R7,
+      UC_ARM_REG_R8,  UC_ARM_REG_R9,  UC_ARM_REG_R10, UC_ARM_REG_R11,
+      UC_ARM_REG_R12, UC_ARM_REG_SP,  UC_ARM_REG_LR,  UC_ARM_REG_PC,
+      UC_ARM_REG_CPSR};
+  static_assert(sizeof(GuestCPU) == sizeof(uint32_t) * size(RegIds));
+  GuestCPU CPU;
+  Emu.readRegs(RegIds, reinterpret_cast<uint32_t *>(&CPU), size(RegIds));
+  Func->Function(&CPU);
+  // PC is set by the restart below.
+  Emu.writeRegs(RegIds, CPU.R, 15);
+  Emu.writeReg(UC_ARM_REG_CPSR, CPU.CPSR);
+
+  // Like the instruction at `Addr`, the rest of the function is skipped.
+  Emu.stop();
+  restartAt(CPU.R[15]);
+}
+
+bool SysTranslator::addTraceWindow(uint64_t Addr, uint64_t MaxInstructions) {
+  if constexpr (!BinaryTrace) {
+    Log.error("trace windows require IPASIM_BINARY_TRACE");
     return false;
   }
+  // Thumb functions have their lowest bit set.
+  Addr &= ~1ULL;
+  Windows.push_back(TraceWindow{
+      Addr, MaxInstructions,
+      Emu.hook(UC_HOOK_CODE, &SysTranslator::handleWindowStart, this, Addr,
+               Addr)});
+  return true;
+}
 
-  // Process function arguments.
-  auto DC = make_unique<DynamicCaller>(Emu);
-  while (TD.hasNext()) {
-    size_t Size = TD.getNextTypeSize();
-    if (Size == TypeDecoder::InvalidSize)
-      return false;
-    DC->loadArg(Size);
-  }
+void SysTranslator::handleWindowStart(uint64_t Addr, uint32_t Size) {
+  // Recursive calls are part of the active window.
+  if (ActiveWindow || ctx().Continue)
+    return;
+  auto It = find_if(Windows.begin(), Windows.end(),
+                    [&](const TraceWindow &W) { return W.Addr == Addr; });
+  if (It == Windows.end())
+    return;
+  ActiveWindow = &*It;
+  WindowReturn = Emu.readReg(UC_ARM_REG_LR) & ~1U;
+  WindowSP = Emu.readReg(UC_ARM_REG_SP);
+  WindowInstructions = 0;
+
+  TraceRecord R{};
+  R.Time = TraceBuffer::now();
+  R.Target = static_cast<uint32_t>(Addr);
+  R.Event = TraceRecord::WindowStart;
+  IpaSim.Trace.add(R);
+
+  // The code hook cannot be installed from inside a hook, so emulation is
+  // restarted.
+  continueOutsideEmulation([this]() {
+    WindowHook =
+        Emu.hook(UC_HOOK_CODE, &SysTranslator::handleWindowCode, this);
+    restartAt(Emu.readPC());
+  });
+}
 
-  continueOutsideEmulation([=, DCP = DC.release()]() {
-    unique_ptr<DynamicCaller> DC(DCP);
+void SysTranslator::handleWindowCode(uint64_t Addr, uint32_t Size) {
+  if (!ActiveWindow)
+    return;
+  recordInstruction(Addr);
+
+  // The window ends when the function returns to its caller (i.e., not from a
+  // recursive call) or when enough instructions have been recorded.
+  uint64_t Max = ActiveWindow->MaxInstructions;
+  bool Returned =
+      Addr == WindowReturn && Emu.readReg(UC_ARM_REG_SP) >= WindowSP;
+  if ((!Returned && (!Max || ++WindowInstructions < Max)) || ctx().Continue)
+    return;
 
-    // Call the function.
-    if (!DC->call(Returns, Addr))
-      return;
+  TraceRecord R{};
+  R.Time = TraceBuffer::now();
+  R.Target = static_cast<uint32_t>(ActiveWindow->Addr);
+  R.Event = TraceRecord::WindowEnd;
+  IpaSim.Trace.add(R);
+  ActiveWindow = nullptr;
 
-    returnToEmulation();
+  continueOutsideEmulation([this]() {
+    WindowHook.reset();
+    restartAt(Emu.readPC());
   });
+}
 
-  Emu.ignoreNextError();
-  return false;
+void SysTranslator::recordInstruction(uint64_t Addr) {
+  TraceRecord R{};
+  R.Time = TraceBuffer::now();
+  R.PC = static_cast<uint32_t>(Addr);
+  static_assert(size(TracedRegs) == size(R.Regs));
+  Emu.readRegs(TracedRegs, R.Regs);
+  R.Event = TraceRecord::Instruction;
+  IpaSim.Trace.add(R);
 }
 
 void SysTranslator::handleCode(uint64_t Addr, uint32_t Size) {
-  auto *R13 = reinterpret_cast<uint32_t *>(Emu.readReg(UC_ARM_REG_R13));
+  if constexpr (BinaryTrace) {
+    recordInstruction(Addr);
+    return;
+  }
+  uint32_t Regs[size(TracedRegs)];
+  Emu.readRegs(TracedRegs, Regs);
+  auto *R13 = reinterpret_cast<uint32_t *>(Regs[4]);
   Log.info() << "executing at " << Dyld.dumpAddr(Addr) << " [R0 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R0)) << ", R1 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R1)) << ", R7 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R7)) << ", R12 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R12)) << ", R13 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R13)) << ", [R13] = 0x"
+             << to_hex_string(Regs[0]) << ", R1 = 0x" << to_hex_string(Regs[1])
+             << ", R7 = 0x" << to_hex_string(Regs[2]) << ", R12 = 0x"
+             << to_hex_string(Regs[3]) << ", R13 = 0x"
+             << to_hex_string(Regs[4]) << ", [R13] = 0x"
              << to_hex_string(R13[0]) << ", [R13+4] = 0x"
              << to_hex_string(R13[1]) << ", [R13+8] = 0x"
-             << to_hex_string(R13[2]) << ", R14 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R14)) << "]" << Log.end();
+             << to_hex_string(R13[2]) << ", R14 = 0x" << to_hex_string(Regs[5])
+             << "]" << Log.end();
+}
+
+void SysTranslator::handleBlock(uint64_t Addr, uint32_t Size) {
+  if (!IpaSim.Profiler.shouldSample(ProfileTick))
+    return;
+
+  // Native frames between nested emulations are part of the sample, too.
+  StackFrame Frames[GuestProfiler::MaxDepth];
+  size_t Count = StackWalker(*this).walk(Frames, GuestProfiler::MaxDepth,
+                                         /* InGuest */ true);
+  uint32_t Addrs[GuestProfiler::MaxDepth];
+  for (size_t I = 0; I != Count; ++I)
+    Addrs[I] = Frames[I].Addr;
+  IpaSim.Profiler.addSample(Addrs, Count);
 }
 
 bool SysTranslator::handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
@@ -317,65 +2018,359 @@ bool SysTranslator::handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
   return true;
 }
 
+// If this returns `true`, Unicorn performs the write (the page stays read-only,
+// though, so the next write is caught, too).
+bool SysTranslator::handleMemWriteProt(uc_mem_type Type, uint64_t Addr,
+                                       int Size, int64_t Value) {
+  if (IpaSim.Watches.handleWrite(Addr, Size, Value,
+                                 Emu.readReg(UC_ARM_REG_PC)))
+    return true;
+
+  Log.error() << "write to read-only memory at " << Dyld.dumpAddr(Addr)
+              << Log.end();
+  return false;
+}
+
 // TODO: Maybe this happens when the emulated app accesses some non-directly
 // dependent DLL and we should load it as a whole.
 bool SysTranslator::handleMemUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
                                       int64_t Value) {
-  if constexpr (PrintEmuInfo)
+  IpaSim.Stats.add(Stat::UnmappedFaults);
+  if (IpaSim.Traces.isEnabled(TraceCategory::Faults))
     Log.info() << "unmapped memory manipulation at " << Dyld.dumpAddr(Addr)
                << " (" << Size << ")" << Log.end();
 
-  // Map the memory, so that emulation can continue.
-  Addr = DynamicLoader::alignToPageSize(Addr);
-  Size = DynamicLoader::roundToPageSize(Size);
-  Emu.mapMemory(Addr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  // The memory might have been mapped by another engine.
+  if (Emu.syncMemory())
+    return true;
+
+  // Guest stacks are committed as they grow.
+  if (GuestStack *S = IpaSim.Stacks.lookup(Addr)) {
+    if (!IpaSim.Stacks.grow(*S, Addr))
+      return false;
+    Emu.syncMemory();
+    return true;
+  }
+
+  // Map the memory, so that emulation can continue. Whole committed host
+  // allocation around `Addr` (at most `FaultGranule` of it) is mapped, so that
+  // code walking bigger buffers doesn't fault on every page.
+  uint64_t Start = DynamicLoader::alignToPageSize(Addr);
+  uint64_t End = DynamicLoader::roundToPageSize(Addr + Size);
+  MEMORY_BASIC_INFORMATION Info;
+  if (VirtualQuery(reinterpret_cast<void *>(Addr), &Info, sizeof(Info)) &&
+      Info.State == MEM_COMMIT) {
+    uint64_t RegionStart = reinterpret_cast<uint64_t>(Info.BaseAddress);
+    uint64_t RegionEnd = RegionStart + Info.RegionSize;
+    if constexpr (FaultGranule != 0) {
+      RegionStart = max(RegionStart, Addr / FaultGranule * FaultGranule);
+      RegionEnd = min(RegionEnd, (Addr / FaultGranule + 1) * FaultGranule);
+    }
+    Start = min(Start, RegionStart);
+    End = max(End, RegionEnd);
+  }
+  Emu.mapHostMemory(Addr, Start, End, UC_PROT_READ | UC_PROT_WRITE);
+  TraceLoggingWrite(IpaSimProvider, "FaultMapping",
+                    TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                    TraceLoggingKeyword(FaultEvents),
+                    TraceLoggingHexUInt64(Addr, "Address"),
+                    TraceLoggingHexUInt64(Start, "Start"),
+                    TraceLoggingUInt64(End - Start, "Size"));
 
   return true;
 }
 
-void SysTranslator::handleTrampoline(void *Ret, void **Args, void *Data) {
-  auto *Tr = reinterpret_cast<Trampoline *>(Data);
+// Handles `svc #ID` instructions emitted into Dylib wrappers. `ID` indexes
+// table of DLL wrappers, so no address lookup is needed.
+void SysTranslator::handleInterrupt(uint32_t IntNo) {
+  // Software interrupt, see `EXCP_SWI` in QEMU.
+  constexpr uint32_t SWI = 2;
+  if (IntNo != SWI) {
+    Log.error() << "unhandled interrupt " << IntNo << " at "
+                << Dyld.dumpAddr(Emu.readReg(UC_ARM_REG_PC)) << Log.end();
+    abort();
+    return;
+  }
+
+  // PC already points to the next instruction. In ARM mode, the immediate is
+  // encoded in the lower 24 bits of the previous instruction. In Thumb mode,
+  // the instruction has only 16 bits. See `Hypercalls`.
+  uint32_t PC = Emu.readPC();
+  bool Thumb = PC & 1;
+  uint32_t SvcAddr = (PC & ~1U) - (Thumb ? 2 : 4);
+  uint32_t ID;
+  if (Thumb) {
+    ID = *reinterpret_cast<uint16_t *>(SvcAddr) & 0xFF;
+    if (ID == Hypercalls::ThumbInR12)
+      ID = Emu.readReg(UC_ARM_REG_R12);
+  } else
+    ID = *reinterpret_cast<uint32_t *>(SvcAddr) & 0xFFFFFF;
+  // Deferred calls are executed before any other hypercall. The flush
+  // hypercall only executes them. See `CommandBuffer`.
+  flushCommands();
+  if (ID == CommandBuffer::FlushID)
+    return;
+  if (ID == GuestMallocCache::RefillID || ID == GuestMallocCache::ReturnID) {
+    // Only `GuestHeap` is called, so emulation can simply continue.
+    auto *Cache = reinterpret_cast<GuestMallocCache *>(
+        static_cast<uintptr_t>(getTSDSlot(GuestTSD::MallocCacheKey)));
+    uint32_t Class = Emu.readReg(UC_ARM_REG_R0);
+    if (!Cache)
+      return;
+    IpaSim.Stats.add(Stat::MallocBatches);
+    if (ID == GuestMallocCache::RefillID)
+      IpaSim.Heap.refill(*Cache, Class);
+    else
+      IpaSim.Heap.drain(*Cache, Class, GuestMallocCache::BatchSize);
+    return;
+  }
+  if (ID == GuestPoolPage::DrainID) {
+    // The token was checked by the wrapper.
+    uint32_t Token = Emu.readReg(UC_ARM_REG_R0);
+    GuestPoolPage *Page = getPoolPage();
+    continueOutsideEmulation([=]() {
+      popPool(*Page, (Token - reinterpret_cast<uintptr_t>(Page->Objects)) /
+                         sizeof(uint32_t));
+      restartAt(PC);
+    });
+    return;
+  }
+  if constexpr (GuestAutoreleasePools)
+    syncPools();
+  if (ID == MessageCache::DispatchID || ID == MessageCache::DispatchStretID) {
+    handleMsgDispatch(ID == MessageCache::DispatchStretID);
+    return;
+  }
+  Hypercall H = Dyld.getHypercall(ID);
+  if (!H.Addr) {
+    Log.error() << "unknown hypercall " << ID << " at "
+                << Dyld.dumpAddr(SvcAddr) << Log.end();
+    abort();
+    return;
+  }
+
+  if (IpaSim.Traces.isEnabled(TraceCategory::Crossings))
+    Log.info() << "hypercall " << ID << " to " << Dyld.dumpAddr(H.Addr)
+               << Log.end();
+
+  uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
+
+  // Leaf functions can be called directly, emulation then simply continues
+  // after the `svc` instruction.
+  auto *Func = reinterpret_cast<void (*)(uint32_t)>(H.Addr);
+  bool UIThread = IpaSim.UI.needsUIThread(H.Addr);
+  if (H.Leaf) {
+    callNative(UIThread, [=]() { Func(R0); }, /* Reentrant */ false);
+    return;
+  }
+
+  // Host fibers of `callInsideHook` cannot wait for the UI thread, since it
+  // might call back into emulated code.
+  if (UIThread && IpaSim.UI.isEmulationThread()) {
+    continueOutsideEmulation([=]() {
+      IpaSim.UI.callOnUI([=]() { Func(R0); });
+      restartAt(PC);
+    });
+    return;
+  }
+
+  // Call the target function and continue after the `svc` instruction (in the
+  // same mode, since `PC` has the Thumb bit).
+  callInsideHook(H.Addr, R0, PC);
+}
+
+// Handles messengers' `MessageCache` misses. We look the message up, fill the
+// caches and continue at the IMP, so the messenger doesn't have to call it
+// itself. Messengers jump to the hypercall with arguments and return address of
+// the message send intact.
+void SysTranslator::handleMsgDispatch(bool Stret) {
+  static constexpr uc_arm_reg ArgRegs[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                           UC_ARM_REG_R2, UC_ARM_REG_R3};
+  uint32_t Args[4];
+  Emu.readRegs(ArgRegs, Args);
+  IpaSim.Stats.add(Stat::MessageCacheMisses);
+
+  continueOutsideEmulation([=]() {
+    uint64_t &LookupAddr = MsgLookups[Stret];
+    if (!LookupAddr) {
+      LoadedLibrary *ObjC = Dyld.load("libobjc.dll");
+      if (ObjC)
+        LookupAddr = ObjC->findSymbol(
+            Dyld, Stret ? "objc_msgLookup_stret" : "objc_msgLookup");
+      if (!LookupAddr) {
+        Log.error("cannot find objc_msgLookup");
+        abort();
+        return;
+      }
+    }
+
+    // The lookup can call back into emulated code (e.g., `+initialize`), so
+    // argument registers must be restored after it. It's a crossing of its
+    // own, the IMP's is counted separately (see below).
+    using LookupTy = uint32_t (*)(uint32_t, uint32_t, uint32_t, uint32_t);
+    uint32_t Imp;
+    {
+      CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::Dynamic,
+                                 LookupAddr);
+      Imp = reinterpret_cast<LookupTy>(LookupAddr)(Args[0], Args[1], Args[2],
+                                                   Args[3]);
+    }
+    Emu.writeRegs(ArgRegs, Args);
+    if (uint32_t Self = Args[Stret ? 1 : 0])
+      Dyld.fillMessageCaches(*reinterpret_cast<uint32_t *>(Self),
+                             Args[Stret ? 2 : 1], Imp);
+
+    // The IMP is simply jumped to. If it's native, emulation faults right away
+    // and `handleFetchProtMem` calls it through `callTarget` like any other
+    // call from the guest, so it gets the same handling and accounting.
+    restartAt(Imp);
+  });
+}
+
+uint64_t SysTranslator::handleTrampoline(Trampoline *Tr, const uint8_t *Args) {
+  const CallShape &Shape = *Tr->Shape;
+  CrossingStats::Scope Timer(IpaSim.Crossings, CrossingStats::Trampoline,
+                             Tr->Addr);
+  Progress.fetch_add(1, memory_order_relaxed);
+  IpaSim.Stats.add(Stat::Callbacks);
 
-  if constexpr (PrintEmuInfo) {
-    Log.info() << "handling trampoline (arguments: " << Tr->ArgC;
-    if (Tr->Returns)
+  if (IpaSim.Traces.isEnabled(TraceCategory::Trampolines)) {
+    Log.info() << "handling trampoline (arguments: " << Shape.ArgWords;
+    if (Shape.Returns != CallShape::Void)
       Log.infs() << ", returns)" << Log.end();
     else
       Log.infs() << ", void)" << Log.end();
   }
 
-  // Pass arguments.
-  uc_arm_reg RegId = UC_ARM_REG_R0;
-  for (size_t I = 0, ArgC = Tr->ArgC; I != ArgC; ++I)
-    Emu.writeReg(RegId++, *reinterpret_cast<uint32_t *>(Args[I]));
+  // Convert arguments. Native ones are aligned to 4 bytes on the stack.
+  uint32_t Words[DynamicCaller::MaxArgs] = {};
+  size_t Offset = 0;
+  for (size_t I = 0, ArgC = Shape.ArgTypes.size(); I != ArgC; ++I) {
+    ffi_type *ArgTy = Shape.ArgTypes[I];
+    const uint8_t *Arg = Args + Offset;
+    Offset += (ArgTy->size + 3) & ~size_t(3);
+    uint32_t *Word = &Words[Shape.ArgOffsets[I]];
+    if (ArgTy == &ffi_type_sint8)
+      *Word = *reinterpret_cast<const int8_t *>(Arg);
+    else if (ArgTy == &ffi_type_sint16)
+      *Word = *reinterpret_cast<const int16_t *>(Arg);
+    else
+      memcpy(Word, Arg, ArgTy->size);
+  }
+
+  // The first four words are passed in registers, the rest on stack.
+  Emu.writeRegs(Emulator::ArgRegs, Words, min<size_t>(Shape.ArgWords, 4));
+  uint32_t SP = 0;
+  if (Shape.ArgWords > 4) {
+    SP = Emu.readReg(UC_ARM_REG_SP);
+    uint32_t ArgsSP = (SP - (Shape.ArgWords - 4) * 4) & ~7U;
+    copy(Words + 4, Words + Shape.ArgWords,
+         reinterpret_cast<uint32_t *>(ArgsSP));
+    Emu.writeReg(UC_ARM_REG_SP, ArgsSP);
+  }
 
   // Call the function.
   execute(Tr->Addr);
+  if (SP)
+    Emu.writeReg(UC_ARM_REG_SP, SP);
 
   // Extract return value.
-  if (Tr->Returns)
-    *reinterpret_cast<ffi_arg *>(Ret) = Emu.readReg(UC_ARM_REG_R0);
+  switch (Shape.Returns) {
+  case CallShape::Void:
+    break;
+  case CallShape::Reg:
+    return Emu.readReg(UC_ARM_REG_R0);
+  case CallShape::RegPair: {
+    uint32_t Regs[2];
+    Emu.readRegs(Emulator::ArgRegs, Regs, 2);
+    return Regs[0] | (static_cast<uint64_t>(Regs[1]) << 32);
+  }
+  case CallShape::Stret:
+    assert(false && "Trampolines cannot return structs in memory.");
+    break;
+  }
+  return 0;
 }
 
-void SysTranslator::handleTrampolineStatic(ffi_cif *, void *Ret, void **Args,
-                                           void *Data) {
-  IpaSim.Sys.handleTrampoline(Ret, Args, Data);
+// Trampolines can be called from any thread, so these use its context.
+uint64_t SysTranslator::handleTrampolineStatic(Trampoline *Tr,
+                                               const uint8_t *Args) {
+  return IpaSim.callGuest(
+      [&](SysTranslator &Sys) { return Sys.handleTrampoline(Tr, Args); });
+}
+float SysTranslator::handleTrampolineFloat(Trampoline *Tr,
+                                           const uint8_t *Args) {
+  // The guest uses soft-float calling convention, so the result is in R0.
+  auto R = static_cast<uint32_t>(IpaSim.callGuest(
+      [&](SysTranslator &Sys) { return Sys.handleTrampoline(Tr, Args); }));
+  float F;
+  memcpy(&F, &R, sizeof(F));
+  return F;
+}
+double SysTranslator::handleTrampolineDouble(Trampoline *Tr,
+                                             const uint8_t *Args) {
+  uint64_t R = IpaSim.callGuest(
+      [&](SysTranslator &Sys) { return Sys.handleTrampoline(Tr, Args); });
+  double D;
+  memcpy(&D, &R, sizeof(D));
+  return D;
 }
 
 // If `FP` points to emulated code, returns address of wrapper that should be
 // called instead. Otherwise, returns `FP` unchanged.
 void *SysTranslator::translate(void *FP) {
+  lock_guard<recursive_mutex> Lock(TranslationMutex);
   uint64_t Addr = reinterpret_cast<uint64_t>(FP);
   LibraryInfo LI(Dyld.lookup(Addr));
+  return translateMethod(FP, LI, dynamic_cast<LoadedDylib *>(LI.Lib), nullptr);
+}
 
-  auto *Dylib = dynamic_cast<LoadedDylib *>(LI.Lib);
+void SysTranslator::translate(void **FPs, const char *const *Types,
+                              size_t Count) {
+  lock_guard<recursive_mutex> Lock(TranslationMutex);
+  LibraryInfo LI{nullptr, nullptr};
+  LoadedDylib *Dylib = nullptr;
+  for (size_t I = 0; I != Count; ++I) {
+    if (!FPs[I])
+      continue;
+
+    // Pointers from one method list or block table usually lie in the same
+    // image, so the last lookup is reused while it matches.
+    uint64_t Addr = reinterpret_cast<uint64_t>(FPs[I]);
+    if (!LI.Lib || !LI.Lib->isInRange(Addr)) {
+      LI = Dyld.lookup(Addr);
+      Dylib = dynamic_cast<LoadedDylib *>(LI.Lib);
+    }
+    FPs[I] = translateMethod(FPs[I], LI, Dylib, Types ? Types[I] : nullptr);
+  }
+}
+
+void SysTranslator::translateMethodList(void *List, void **Imps) {
+  vector<ObjCMethod> Methods(ObjCMethod::fromList(nullptr, List));
+  vector<const char *> Types;
+  Types.reserve(Methods.size());
+  for (size_t I = 0, Count = Methods.size(); I != Count; ++I) {
+    Imps[I] = reinterpret_cast<void *>(Methods[I].getImp());
+    Types.push_back(Methods[I].getType());
+  }
+  translate(Imps, Types.data(), Methods.size());
+}
+
+void *SysTranslator::translateMethod(void *FP, const LibraryInfo &LI,
+                                     LoadedDylib *Dylib, const char *Type) {
   if (!Dylib)
     return FP;
 
-  ObjCMethod M = Dylib->getMachO().findMethod(Addr);
-  if (!M) {
-    Log.error("callback not found");
-    return nullptr;
+  // Without type encoding, we have to find the method's metadata.
+  uint64_t Addr = reinterpret_cast<uint64_t>(FP);
+  ObjCMethod M;
+  if (!Type) {
+    M = Dylib->findMethod(Addr);
+    if (!M) {
+      Log.error("callback not found");
+      return nullptr;
+    }
+    Type = M.getType();
   }
 
   // We have found metadata of the callback method. Now, for simple methods,
@@ -383,52 +2378,20 @@ void *SysTranslator::translate(void *FP) {
   // so that's what we do here.
   // TODO: Generate wrappers for callbacks, too (see README of
   // `HeadersAnalyzer` for more details).
-  if constexpr (PrintEmuInfo)
+  if (IpaSim.Traces.isEnabled(TraceCategory::ObjC))
     Log.info() << "dynamically handling callback " << Dyld.dumpAddr(Addr, LI, M)
                << Log.end();
 
-  // First, handle the return value.
-  TypeDecoder TD(M.getType());
-  bool Returns;
-  switch (TD.getNextTypeSize()) {
-  case 0:
-    Returns = false;
-    break;
-  case 4:
-    Returns = true;
-    break;
-  default:
-    Log.error("unsupported return type of callback");
+  const CallShape *Shape = getCallShape(Type);
+  if (!Shape) {
+    Log.error("unsupported signature of callback");
     return nullptr;
   }
-
-  // Next, process function arguments.
-  size_t ArgC = 0;
-  while (TD.hasNext()) {
-    switch (TD.getNextTypeSize()) {
-    case TypeDecoder::InvalidSize:
-      return nullptr;
-    case 4: {
-      if (ArgC > 3) {
-        Log.error("callback has too many arguments");
-        return nullptr;
-      }
-      ++ArgC;
-      break;
-    }
-    default:
-      Log.error("unsupported callback argument type");
-      return nullptr;
-    }
-  }
-
-  // Now, create trampoline.
-  return createTrampoline(FP, ArgC, Returns);
+  return createTrampoline(FP, *Shape);
 }
 
 void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
-  using namespace LIEF::MachO;
-
+  lock_guard<recursive_mutex> Lock(TranslationMutex);
   uint64_t Addr = reinterpret_cast<uint64_t>(FP);
   LibraryInfo LI(IpaSim.Dyld.lookup(Addr));
 
@@ -441,169 +2404,508 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
   // If `FP` is a Dylib wrapper, we can skip it, we just need to find what it
   // wraps.
   if (Dylib->IsWrapper)
-    for (Symbol &Symbol : Dylib->lookup(Addr)) {
-      // Find special symbol name.
-      if (!startsWith(Symbol.name(), WrapsPrefix))
-        continue;
-
-      // Parse the special name.
-      const char *Postfix = Symbol.name().c_str() + WrapsPrefix.Len;
-      const char *Underscore = strchr(Postfix, '_');
-      if (!Underscore) {
-        Log.error() << "invalid special symbol " << Symbol.name() << Log.end();
-        continue;
-      }
-      uint64_t RVA = atol(Underscore + 1);
-      string DLLName = string(Postfix, Underscore - Postfix) + ".dll";
-
+    if (LoadedDylib::WrappedFunction *W = Dylib->findWrapped(Addr)) {
       // Load the wrapped library.
-      LoadedLibrary *Lib = Dyld.load(DLLName);
-      if (!Lib) {
-        Log.error() << "couldn't load DLL for symbol " << Symbol.name()
-                    << Log.end();
-        continue;
+      if (!W->Lib)
+        W->Lib = Dyld.load(W->DLL);
+      if (!W->Lib)
+        Log.error() << "couldn't load DLL " << W->DLL << " wrapped at "
+                    << Dyld.dumpAddr(Addr) << Log.end();
+      else if (W->RVA >= W->Lib->Size)
+        Log.error() << "RVA out of bounds for wrapper at "
+                    << Dyld.dumpAddr(Addr) << Log.end();
+      else {
+        Addr = W->Lib->StartAddress + W->RVA - DLLBase;
+        if (IpaSim.Traces.isEnabled(TraceCategory::Crossings))
+          Log.info() << "skipped wrapper for " << W->DLL << " ("
+                     << Dyld.dumpAddr(Addr) << ")" << Log.end();
+        return reinterpret_cast<void *>(Addr);
       }
-      if (RVA >= Lib->Size) {
-        Log.error() << "RVA out of bounds for symbol " << Symbol.name()
-                    << Log.end();
-        continue;
-      }
-
-      Addr = Lib->StartAddress + RVA - DLLBase;
-      if constexpr (PrintEmuInfo)
-        Log.info() << "skipped wrapper for symbol " << Symbol.name() << " ("
-                   << Dyld.dumpAddr(Addr) << ")" << Log.end();
-      return reinterpret_cast<void *>(Addr);
     }
 
-  return createTrampoline(FP, ArgC, Returns);
-}
-
-void *SysTranslator::createTrampoline(void *FP, size_t ArgC, bool Returns) {
+  // Type encodings of functions with `ArgC` 32-bit arguments.
+  static const char *const Types[2][5] = {{"v", "vI", "vII", "vIII", "vIIII"},
+                                          {"I", "II", "III", "IIII", "IIIII"}};
   assert(ArgC <= 4);
+  return createTrampoline(FP, *getCallShape(Types[Returns][ArgC]));
+}
 
-  // TODO: Don't create different trampolines for the same `FP`.
-  auto *Tr = new Trampoline;
-  Tr->Returns = Returns;
-  Tr->ArgC = ArgC;
-  Tr->Addr = reinterpret_cast<uint64_t>(FP);
-
-  void *Ptr;
-  // TODO: `Closure` nor `Tr` are never deallocated.
-  auto *Closure = reinterpret_cast<ffi_closure *>(
-      ffi_closure_alloc(sizeof(ffi_closure), &Ptr));
-  if (!Closure) {
-    Log.error("couldn't allocate closure");
+void *SysTranslator::createTrampoline(void *FP, const CallShape &Shape) {
+  if (Shape.ArgWords > DynamicCaller::MaxArgs) {
+    Log.error("callback has too many arguments");
     return nullptr;
   }
-  static ffi_type *ArgTypes[4] = {&ffi_type_uint32, &ffi_type_uint32,
-                                  &ffi_type_uint32, &ffi_type_uint32};
-  if (ffi_prep_cif(&Tr->CIF, FFI_MS_CDECL, Tr->ArgC,
-                   Tr->Returns ? &ffi_type_uint32 : &ffi_type_void,
-                   ArgTypes) != FFI_OK) {
-    Log.error("couldn't prepare CIF");
+  if (Shape.Returns == CallShape::Stret) {
+    Log.error("unsupported return type of callback");
     return nullptr;
   }
-  if (ffi_prep_closure_loc(Closure, &Tr->CIF, handleTrampolineStatic, Tr,
-                           Ptr) != FFI_OK) {
-    Log.error("couldn't prepare closure");
+
+  if (SeenUnloads != Dyld.getUnloadCount())
+    forgetUnloaded();
+  // Reuse existing trampoline if there is one. Note that shapes are unique per
+  // type encoding, so this also distinguishes different signatures.
+  void *&Cached = Trampolines[{reinterpret_cast<uint64_t>(FP), &Shape}];
+  if (Cached)
+    return Cached;
+
+  // Native callers expect floating-point results in x87 registers.
+  TrampolineArena::EntryTy Entry;
+  switch (Shape.CIF.rtype->type) {
+  case FFI_TYPE_FLOAT:
+    Entry = reinterpret_cast<TrampolineArena::EntryTy>(handleTrampolineFloat);
+    break;
+  case FFI_TYPE_DOUBLE:
+    Entry = reinterpret_cast<TrampolineArena::EntryTy>(handleTrampolineDouble);
+    break;
+  default:
+    Entry = reinterpret_cast<TrampolineArena::EntryTy>(handleTrampolineStatic);
+    break;
+  }
+
+  void *Ptr;
+  Trampoline *Tr = Arena.allocate(Entry, Ptr);
+  if (!Tr) {
+    Log.error("couldn't allocate trampoline");
     return nullptr;
   }
+  Tr->Shape = &Shape;
+  Tr->Addr = reinterpret_cast<uint64_t>(FP);
+  Cached = Ptr;
+  IpaSim.Stats.add(Stat::TrampolinesCreated);
   return Ptr;
 }
 
+void SysTranslator::release(void *FP) {
+  lock_guard<recursive_mutex> Lock(TranslationMutex);
+  Trampoline *Tr = Arena.lookup(FP);
+  if (!Tr)
+    return;
+
+  if (IpaSim.Traces.isEnabled(TraceCategory::Trampolines))
+    Log.info() << "releasing trampoline for " << Dyld.dumpAddr(Tr->Addr)
+               << Log.end();
+
+  Trampolines.erase({Tr->Addr, Tr->Shape});
+  Arena.release(Tr);
+}
+
+// =============================================================================
+// TrampolineArena
+// =============================================================================
+
+TrampolineArena::~TrampolineArena() {
+  for (Chunk &C : Chunks)
+    ffi_closure_free(C.Slots);
+}
+
+Trampoline *TrampolineArena::allocate(EntryTy Entry, void *&Code) {
+  if (FreeSlots.empty()) {
+    // Allocate new chunk. We let libffi do this, because it knows how to get
+    // executable memory.
+    void *CodePtr;
+    auto *Slots =
+        reinterpret_cast<Slot *>(ffi_closure_alloc(ChunkSize, &CodePtr));
+    if (!Slots)
+      return nullptr;
+    Chunks.push_back({Slots, reinterpret_cast<uintptr_t>(CodePtr)});
+    ChunkCount.store(Chunks.size(), memory_order_relaxed);
+
+    // Slots are taken from the back, so push them in reverse order.
+    FreeSlots.reserve(FreeSlots.size() + SlotsPerChunk);
+    for (size_t I = SlotsPerChunk; I != 0; --I) {
+      Slots[I - 1].Tr.Addr = 0; // Marks free slots.
+      FreeSlots.push_back(&Slots[I - 1]);
+    }
+  }
+
+  Slot *S = FreeSlots.back();
+  FreeSlots.pop_back();
+  Used.fetch_add(1, memory_order_relaxed);
+
+  // Find the chunk to compute address of the code.
+  for (Chunk &C : Chunks)
+    if (C.Slots <= S && S < C.Slots + SlotsPerChunk) {
+      Code = reinterpret_cast<void *>(C.Code +
+                                      reinterpret_cast<uintptr_t>(S->Code) -
+                                      reinterpret_cast<uintptr_t>(C.Slots));
+      break;
+    }
+
+  // Emit the code (32-bit x86, `Entry` is `__cdecl`):
+  //   lea eax, [esp + 4] ; Arguments of the native caller
+  //   push eax
+  //   push Tr
+  //   mov eax, Entry
+  //   call eax
+  //   add esp, 8
+  //   ret ; The result is still in `eax`, `edx` or `st(0)`.
+  static constexpr uint8_t Template[] = {
+      0x8D, 0x44, 0x24, 0x04, 0x50, 0x68, 0,    0,    0,    0,    0xB8,
+      0,    0,    0,    0,    0xFF, 0xD0, 0x83, 0xC4, 0x08, 0xC3};
+  static_assert(sizeof(Template) <= sizeof(Slot::Code), "Slot is too small.");
+  auto TrAddr = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&S->Tr));
+  auto EntryAddr = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(Entry));
+  memcpy(S->Code, Template, sizeof(Template));
+  memcpy(S->Code + 6, &TrAddr, sizeof(TrAddr));
+  memcpy(S->Code + 11, &EntryAddr, sizeof(EntryAddr));
+  FlushInstructionCache(GetCurrentProcess(), Code, sizeof(Template));
+  return &S->Tr;
+}
+
+Trampoline *TrampolineArena::lookup(void *Code) {
+  auto Addr = reinterpret_cast<uintptr_t>(Code);
+  for (Chunk &C : Chunks) {
+    if (Addr < C.Code || Addr >= C.Code + SlotsPerChunk * sizeof(Slot))
+      continue;
+
+    // Only starts of slots are valid trampolines.
+    size_t Offset = Addr - C.Code;
+    if (Offset % sizeof(Slot))
+      return nullptr;
+    Trampoline *Tr = &C.Slots[Offset / sizeof(Slot)].Tr;
+    return Tr->Addr ? Tr : nullptr;
+  }
+  return nullptr;
+}
+
+void TrampolineArena::release(Trampoline *Tr) {
+  auto *S = reinterpret_cast<Slot *>(reinterpret_cast<char *>(Tr) -
+                                     offsetof(Slot, Tr));
+  Tr->Addr = 0;
+  FreeSlots.push_back(S);
+  Used.fetch_sub(1, memory_order_relaxed);
+}
+
 // =============================================================================
 // DynamicCaller
 // =============================================================================
 
-void DynamicCaller::loadArg(size_t Size) {
-  for (size_t I = 0; I != Size; I += 4) {
-    if (RegId <= UC_ARM_REG_R3)
-      // We have some registers left, use them.
-      Args.push_back(Emu.readReg(RegId++));
-    else {
-      // Otherwise, use stack.
-      Args.push_back(*reinterpret_cast<uint32_t *>(SP));
-      SP += 4;
-    }
-  }
-}
-
-bool DynamicCaller::call(bool Returns, uint32_t Addr) {
-#define CASE(N)                                                                \
-  case N:                                                                      \
-    call<N>(Returns, Addr);                                                    \
-    break
-
-  switch (Args.size()) {
-    CASE(0);
-    CASE(1);
-    CASE(2);
-    CASE(3);
-    CASE(4);
-    CASE(5);
-    CASE(6);
-  default:
-    Log.error("function has too many arguments");
-    return false;
+// Callers must ensure that `Shape.ArgWords` doesn't exceed `MaxArgs`.
+DynamicCaller::DynamicCaller(Emulator &Emu, const CallShape &Shape)
+    : Emu(Emu), Shape(&Shape) {
+  assert(Shape.ArgWords <= MaxArgs && "Too many arguments.");
+
+  // The first four words are in registers, the rest is on stack.
+  if (Shape.ArgWords <= 4) {
+    Emu.readRegs(Emulator::ArgRegs, Args, Shape.ArgWords);
+    return;
+  }
+  static constexpr uc_arm_reg RegIds[] = {UC_ARM_REG_R0, UC_ARM_REG_R1,
+                                          UC_ARM_REG_R2, UC_ARM_REG_R3,
+                                          UC_ARM_REG_SP};
+  uint32_t Regs[size(RegIds)];
+  Emu.readRegs(RegIds, Regs);
+  copy(Regs, Regs + 4, Args);
+  auto *SP = reinterpret_cast<uint32_t *>(Regs[4]);
+  copy(SP, SP + (Shape.ArgWords - 4), Args + 4);
+}
+
+void DynamicCaller::call(uint64_t Addr) {
+  if (Shape->Direct) {
+    IpaSim.Stats.add(Stat::DirectCalls);
+    uint64_t Result = Shape->Direct(Addr, Args);
+    if (Shape->Returns == CallShape::Reg)
+      Emu.writeReg(UC_ARM_REG_R0, extendResult(Shape->CIF.rtype,
+                                               static_cast<uint32_t>(Result)));
+    else if (Shape->Returns == CallShape::RegPair) {
+      uint32_t RetVal[] = {static_cast<uint32_t>(Result),
+                           static_cast<uint32_t>(Result >> 32)};
+      Emu.writeRegs(Emulator::ArgRegs, RetVal, 2);
+    }
+    return;
   }
-  return true;
 
-#undef CASE
+  // Arguments are passed to libffi directly from the words we loaded. Note
+  // that the host is little-endian and doesn't require aligned access, so this
+  // works even for small integers and 64-bit types.
+  void *Values[MaxArgs];
+  for (size_t I = 0, E = Shape->ArgTypes.size(); I != E; ++I)
+    Values[I] = &Args[Shape->ArgOffsets[I]];
+
+  auto *CIF = const_cast<ffi_cif *>(&Shape->CIF);
+  auto Func = reinterpret_cast<void (*)()>(Addr);
+  switch (Shape->Returns) {
+  case CallShape::Void:
+    ffi_call(CIF, Func, nullptr, Values);
+    break;
+  case CallShape::Reg: {
+    uint32_t RetVal = 0;
+    ffi_call(CIF, Func, &RetVal, Values);
+    Emu.writeReg(UC_ARM_REG_R0, RetVal);
+    break;
+  }
+  case CallShape::RegPair: {
+    uint32_t RetVal[2];
+    ffi_call(CIF, Func, RetVal, Values);
+    Emu.writeRegs(Emulator::ArgRegs, RetVal, 2);
+    break;
+  }
+  case CallShape::Stret:
+    // Guest memory is directly accessible by the host, so the result can be
+    // written right where the caller wants it.
+    ffi_call(CIF, Func, reinterpret_cast<void *>(Args[0]), Values);
+    break;
+  }
 }
 
 // =============================================================================
 // TypeDecoder
 // =============================================================================
 
-size_t TypeDecoder::getNextTypeSizeImpl() {
-  switch (*T) {
+bool TypeDecoder::decode(CallShape &Shape) {
+  ffi_type *RetTy = getNextType(Shape);
+  if (!RetTy)
+    return false;
+  while (hasNext()) {
+    ffi_type *ArgTy = getNextType(Shape);
+    if (!ArgTy)
+      return false;
+    if (ArgTy == &ffi_type_void) {
+      Log.error("void argument type");
+      return false;
+    }
+    Shape.ArgTypes.push_back(ArgTy);
+  }
+
+  // Classify return value.
+  if (RetTy == &ffi_type_void)
+    Shape.Returns = CallShape::Void;
+  else if (getGuestSize(RetTy) <= 4)
+    Shape.Returns = CallShape::Reg;
+  else if (RetTy->type == FFI_TYPE_STRUCT)
+    Shape.Returns = CallShape::Stret;
+  else
+    Shape.Returns = CallShape::RegPair;
+
+  // Compute positions of arguments. When the result is returned in memory, R0
+  // contains pointer to it and real arguments start at R1.
+  size_t Words = Shape.Returns == CallShape::Stret ? 1 : 0;
+  for (ffi_type *ArgTy : Shape.ArgTypes) {
+    Shape.ArgOffsets.push_back(Words);
+    Words += (getGuestSize(ArgTy) + 3) / 4;
+  }
+  Shape.ArgWords = Words;
+
+  if (ffi_prep_cif(&Shape.CIF, FFI_MS_CDECL, Shape.ArgTypes.size(), RetTy,
+                   Shape.ArgTypes.data()) != FFI_OK) {
+    Log.error("couldn't prepare CIF");
+    return false;
+  }
+
+  // Structs are passed by copying guest memory, so their layout must match.
+  if (!hasGuestLayout(RetTy)) {
+    Log.error("struct layout differs between guest and host");
+    return false;
+  }
+  for (ffi_type *ArgTy : Shape.ArgTypes)
+    if (!hasGuestLayout(ArgTy)) {
+      Log.error("struct layout differs between guest and host");
+      return false;
+    }
+
+  if constexpr (DirectDynamicCalls)
+    if (Shape.ArgWords < size(DirectCalls) && hasDirectResult(RetTy))
+      Shape.Direct = DirectCalls[Shape.ArgWords];
+  return true;
+}
+
+ffi_type *TypeDecoder::getNextType(CallShape &Shape) {
+  skipQualifiers();
+  ffi_type *Result = getNextTypeImpl(Shape);
+  skipOffset();
+  return Result;
+}
+
+ffi_type *TypeDecoder::getNextTypeImpl(CallShape &Shape) {
+  switch (*T++) {
   case 'v': // void
-    return 0;
+    return &ffi_type_void;
   case 'c': // char
-  case '@': // id
-  case '#': // Class
-  case ':': // SEL
+    return &ffi_type_sint8;
+  case 'C': // unsigned char
+  case 'B': // bool
+    return &ffi_type_uint8;
+  case 's': // short
+    return &ffi_type_sint16;
+  case 'S': // unsigned short
+    return &ffi_type_uint16;
   case 'i': // int
+  case 'l': // long
+    return &ffi_type_sint32;
   case 'I': // unsigned int
+  case 'L': // unsigned long
+    return &ffi_type_uint32;
+  case 'q': // long long
+    return &ffi_type_sint64;
+  case 'Q': // unsigned long long
+    return &ffi_type_uint64;
   case 'f': // float
-    return 4;
+    return &ffi_type_float;
+  case 'd': // double
+  case 'D': // long double (same as double on both sides)
+    return &ffi_type_double;
+  case '@': // id
+    if (*T == '?') // block
+      ++T;
+    else if (*T == '"') // class name
+      skipName();
+    return &ffi_type_pointer;
+  case '*': // char *
+  case '#': // Class
+  case ':': // SEL
+  case '?': // unknown (e.g., function pointer)
+    return &ffi_type_pointer;
   case '^': // pointer to type
+    // Skip the underlying type, it's not important.
+    if (!skipType())
+      return nullptr;
+    return &ffi_type_pointer;
+  case '{':   // struct
+  case '(': { // union
+    char End = T[-1] == '{' ? '}' : ')';
+
+    // Skip name of the aggregate.
+    for (; *T != '='; ++T)
+      if (!*T || *T == End) {
+        Log.error("opaque or unterminated aggregate type");
+        return nullptr;
+      }
     ++T;
-    getNextTypeSizeImpl(); // Skip the underlying type, it's not important.
-    return 4;
-  case '{': { // struct
-    // Skip name of the struct.
-    for (++T; *T != '='; ++T)
+
+    // Parse fields recursively.
+    vector<ffi_type *> Elements;
+    while (*T != End) {
       if (!*T) {
-        Log.error("struct type ended unexpectedly");
-        return InvalidSize;
+        Log.error("aggregate type ended unexpectedly");
+        return nullptr;
+      }
+      if (*T == '"') // field name
+        skipName();
+      ffi_type *E = getNextTypeImpl(Shape);
+      if (!E)
+        return nullptr;
+      if (E == &ffi_type_void) {
+        Log.error("void field type");
+        return nullptr;
       }
+      Elements.push_back(E);
+    }
     ++T;
 
-    // Parse type recursively (note that the struct can be also empty).
-    size_t TotalSize = 0;
-    while (*T != '}') {
-      size_t Size = getNextTypeSize();
-      if (Size == InvalidSize)
-        return InvalidSize;
-      TotalSize += Size;
+    if (Elements.empty()) {
+      Log.error("empty aggregates are not supported");
+      return nullptr;
+    }
+
+    // libffi doesn't know unions, we represent them by their largest member.
+    if (End == ')')
+      return *max_element(Elements.begin(), Elements.end(),
+                          [](ffi_type *A, ffi_type *B) {
+                            return getGuestSize(A) < getGuestSize(B);
+                          });
+    return createStruct(Shape, move(Elements));
+  }
+  case '[': { // array
+    size_t Count = 0;
+    for (; '0' <= *T && *T <= '9'; ++T)
+      Count = Count * 10 + (*T - '0');
+    ffi_type *E = getNextTypeImpl(Shape);
+    if (!E)
+      return nullptr;
+    if (*T != ']' || !Count || E == &ffi_type_void) {
+      Log.error("invalid array type");
+      return nullptr;
     }
+    ++T;
 
-    return TotalSize;
+    // Arrays are laid out the same as structs with repeated fields.
+    return createStruct(Shape, vector<ffi_type *>(Count, E));
   }
   default:
-    Log.error("unsupported type encoding");
-    return InvalidSize;
+    Log.error() << "unsupported type encoding '" << T[-1] << "'"
+                << Log.end();
+    return nullptr;
   }
 }
 
-size_t TypeDecoder::getNextTypeSize() {
-  size_t Result = getNextTypeSizeImpl();
+ffi_type *TypeDecoder::createStruct(CallShape &Shape,
+                                    vector<ffi_type *> &&Elements) {
+  size_t Count = Elements.size();
+  auto Elems = make_unique<ffi_type *[]>(Count + 1);
+  copy(Elements.begin(), Elements.end(), Elems.get());
+  Elems[Count] = nullptr;
+
+  // Size and alignment are computed by `ffi_prep_cif`.
+  auto Type = make_unique<ffi_type>();
+  Type->type = FFI_TYPE_STRUCT;
+  Type->elements = Elems.get();
+
+  ffi_type *Result = Type.get();
+  Shape.Structs.push_back(move(Type));
+  Shape.Elements.push_back(move(Elems));
+  return Result;
+}
+
+bool TypeDecoder::skipType() {
+  switch (*T++) {
+  case '\0':
+    --T;
+    Log.error("type ended unexpectedly");
+    return false;
+  case '@':
+    if (*T == '?')
+      ++T;
+    else if (*T == '"')
+      skipName();
+    return true;
+  case '^':
+    return skipType();
+  case '{':
+  case '(':
+  case '[': {
+    // Skip everything up to the matching bracket.
+    size_t Depth = 1;
+    for (; Depth; ++T)
+      switch (*T) {
+      case '\0':
+        Log.error("type ended unexpectedly");
+        return false;
+      case '{':
+      case '(':
+      case '[':
+        ++Depth;
+        break;
+      case '}':
+      case ')':
+      case ']':
+        --Depth;
+        break;
+      }
+    return true;
+  }
+  case 'b': // bitfield
+    for (; '0' <= *T && *T <= '9'; ++T)
+      ;
+    return true;
+  default:
+    return true;
+  }
+}
 
-  // Skip digits.
-  for (++T; '0' <= *T && *T <= '9'; ++T)
+void TypeDecoder::skipName() {
+  for (++T; *T && *T != '"'; ++T)
     ;
+  if (*T)
+    ++T;
+}
 
-  return Result;
+void TypeDecoder::skipQualifiers() {
+  // const, in, inout, out, bycopy, byref, oneway
+  while (*T && strchr("rnNoORV", *T))
+    ++T;
+}
+
+void TypeDecoder::skipOffset() {
+  for (; '0' <= *T && *T <= '9'; ++T)
+    ;
 }
@@ -1,26 +1,202 @@
-// TextBlockStream.cpp: Implementation of class `TextBlockStream`.
+// TextBlockStream.cpp: Implementation of classes `TextBlockProvider` and
+// `TextBlockStream`.
 
 #include "ipasim/TextBlockStream.hpp"
 
+#include "ipasim/Unicode.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cwctype>
+#include <utility>
+#include <vector>
+#include <winrt/Windows.System.Threading.h>
 #include <winrt/Windows.UI.Core.h>
-#include <winrt/Windows.UI.Xaml.Documents.h>
-#include <winrt/Windows.UI.Xaml.Media.h>
 
 using namespace ipasim;
 using namespace winrt;
-using namespace Windows::UI;
+using namespace Windows::Foundation;
+using namespace Windows::System::Threading;
 using namespace Windows::UI::Core;
 using namespace Windows::UI::Xaml::Controls;
-using namespace Windows::UI::Xaml::Documents;
-using namespace Windows::UI::Xaml::Media;
-
-void TextBlockStream::write(const hstring &S) {
-  TextBlock TB(TBP.get());
-  TB.Dispatcher().RunAsync(CoreDispatcherPriority::Normal, [this, S, TB]() {
-    Run R;
-    R.Text(S);
-    if (Error)
-      R.Foreground(SolidColorBrush(Colors::Red()));
-    TB.Inlines().Append(R);
-  });
+
+void TextBlockProvider::init(ListView ListView) {
+  LV = ListView;
+  Items = single_threaded_observable_vector<IInspectable>();
+  Errors.clear();
+  LV.ItemsSource(Items);
+}
+
+void TextBlockProvider::push(std::wstring &&Text, bool Error) {
+  // Files are written directly, `fputws` is atomic.
+  if (File) {
+    fputws(Text.c_str(), File);
+    return;
+  }
+  if (!LV)
+    return;
+
+  auto *L = new Line{std::move(Text), Error, Pending.load()};
+  while (!Pending.compare_exchange_weak(L->Next, L))
+    ;
+  if (!FlushScheduled.exchange(true))
+    scheduleFlush();
+}
+
+void TextBlockProvider::scheduleFlush() {
+  ThreadPoolTimer::CreateTimer(
+      [this](const ThreadPoolTimer &) {
+        LV.Dispatcher().RunAsync(CoreDispatcherPriority::Low,
+                                 [this]() { flush(); });
+      },
+      FlushInterval);
+}
+
+void TextBlockProvider::flush() {
+  // Lines pushed from now on will schedule another flush.
+  FlushScheduled = false;
+  Line *L = Pending.exchange(nullptr);
+
+  // Restore the order in which the lines were pushed.
+  Line *Oldest = nullptr;
+  while (L) {
+    Line *Next = L->Next;
+    L->Next = Oldest;
+    Oldest = L;
+    L = Next;
+  }
+
+  // Each item is one line, but pushed text can contain more of them.
+  std::vector<std::pair<std::wstring_view, bool>> Batch;
+  for (Line *I = Oldest; I; I = I->Next)
+    for (std::wstring_view Text(I->Text); !Text.empty();) {
+      size_t End = Text.find(L'\n');
+      Batch.emplace_back(Text.substr(0, End), I->Error);
+      FlushedChars += Batch.back().first.size();
+      Text.remove_prefix(End == Text.npos ? Text.size() : End + 1);
+    }
+  FlushedLines += Batch.size();
+
+  // Drop the oldest lines over the limit (including new ones if there are too
+  // many of them). Removing each item shifts all the others, so if many of
+  // them go, the remaining ones are rather set at once.
+  size_t Limit = LineLimit, Size = Items.Size();
+  size_t Excess = Size + Batch.size() > Limit ? Size + Batch.size() - Limit : 0;
+  size_t First = Excess > Size ? Excess - Size : 0;
+  if (Excess > Size / 2) {
+    std::vector<IInspectable> All;
+    All.reserve(std::min(Limit, Size + Batch.size()));
+    for (size_t I = Excess; I < Size; ++I)
+      All.push_back(Items.GetAt(static_cast<uint32_t>(I)));
+    Errors.erase(Errors.begin(), Errors.begin() + std::min(Excess, Size));
+    for (size_t I = First; I != Batch.size(); ++I) {
+      All.push_back(box_value(hstring(Batch[I].first)));
+      Errors.push_back(Batch[I].second);
+    }
+    Items.ReplaceAll(All);
+  } else {
+    for (size_t I = 0; I != Excess; ++I) {
+      Items.RemoveAt(0);
+      Errors.pop_front();
+    }
+    for (const auto &[Text, Error] : Batch) {
+      Items.Append(box_value(hstring(Text)));
+      Errors.push_back(Error);
+    }
+  }
+
+  // Item lengths are not tracked (it's not worth unboxing removed ones), so
+  // kept lines are assumed to be as long as lines are on average.
+  if (FlushedLines)
+    KeptBytes = Items.Size() * FlushedChars / FlushedLines * sizeof(wchar_t);
+
+  while (Oldest)
+    delete std::exchange(Oldest, Oldest->Next);
+}
+
+std::optional<uint32_t> TextBlockProvider::find(std::wstring_view Query,
+                                                uint32_t From) const {
+  uint32_t Size = Items ? Items.Size() : 0;
+  if (Query.empty() || !Size)
+    return std::nullopt;
+  auto Equal = [](wchar_t A, wchar_t B) {
+    return std::towlower(A) == std::towlower(B);
+  };
+  for (uint32_t I = 0; I != Size; ++I) {
+    uint32_t Index = (From + I) % Size;
+    auto Text(unbox_value<hstring>(Items.GetAt(Index)));
+    if (std::search(Text.begin(), Text.end(), Query.begin(), Query.end(),
+                    Equal) != Text.end())
+      return Index;
+  }
+  return std::nullopt;
+}
+
+std::wstring TextBlockProvider::getText() const {
+  std::wstring Result;
+  if (Items)
+    for (const IInspectable &Item : Items) {
+      Result += unbox_value<hstring>(Item);
+      Result += L"\r\n";
+    }
+  return Result;
+}
+
+thread_local TextBlockStream::LineBuffer TextBlockStream::Buffer;
+std::mutex TextBlockStream::BuffersMutex;
+std::vector<TextBlockStream::LineBuffer *> TextBlockStream::Buffers;
+
+TextBlockStream::LineBuffer::LineBuffer() {
+  std::lock_guard<std::mutex> Lock(BuffersMutex);
+  Buffers.push_back(this);
+}
+
+TextBlockStream::LineBuffer::~LineBuffer() {
+  {
+    std::lock_guard<std::mutex> Lock(BuffersMutex);
+    Buffers.erase(std::find(Buffers.begin(), Buffers.end(), this));
+  }
+  push();
+}
+
+void TextBlockStream::LineBuffer::push() {
+  if (!Text.empty() && TBP)
+    TBP->push(std::move(Text), Error);
+  Text.clear();
+}
+
+void TextBlockStream::flushAll() {
+  std::lock_guard<std::mutex> Lock(BuffersMutex);
+  for (LineBuffer *B : Buffers) {
+    std::lock_guard<std::mutex> BufferLock(B->Mutex);
+    B->push();
+  }
+}
+
+void TextBlockStream::write(const char *S) {
+  std::lock_guard<std::mutex> Lock(Buffer.Mutex);
+  appendUTF16(getBuffer().Text, S, strlen(S));
+  commit();
+}
+void TextBlockStream::write(const wchar_t *S) {
+  std::lock_guard<std::mutex> Lock(Buffer.Mutex);
+  getBuffer().Text += S;
+  commit();
+}
+
+TextBlockStream::LineBuffer &TextBlockStream::getBuffer() {
+  // Lines of different colors (or of different providers) are pushed
+  // separately.
+  if (Buffer.Error != Error || Buffer.TBP != &TBP) {
+    Buffer.push();
+    Buffer.Error = Error;
+    Buffer.TBP = &TBP;
+  }
+  return Buffer;
+}
+
+void TextBlockStream::commit() {
+  if (!Buffer.Text.empty() && Buffer.Text.back() == L'\n')
+    Buffer.push();
 }
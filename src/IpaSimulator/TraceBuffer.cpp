@@ -0,0 +1,107 @@
+// TraceBuffer.cpp: Implementation of class `TraceBuffer`.
+
+#include "ipasim/TraceBuffer.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/Common.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <Windows.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+using namespace ipasim;
+using namespace std;
+
+TraceBuffer::Ring::~Ring() {
+  if (Header)
+    UnmapViewOfFile(Header);
+  if (Section)
+    CloseHandle(Section);
+  if (File)
+    CloseHandle(File);
+}
+
+// Views are flushed by the system even if they are not unmapped explicitly.
+TraceBuffer::~TraceBuffer() = default;
+
+void TraceBuffer::addCrossing(TraceRecord::EventTy Event, uint8_t Kind,
+                              uint64_t Target) {
+  TraceRecord R{};
+  R.Time = now();
+  R.Target = static_cast<uint32_t>(Target);
+  R.Event = Event;
+  R.Kind = Kind;
+  add(R);
+}
+
+uint64_t TraceBuffer::now() {
+  LARGE_INTEGER Counter;
+  QueryPerformanceCounter(&Counter);
+  return Counter.QuadPart;
+}
+
+TraceBuffer::Ring *TraceBuffer::createRing() {
+  lock_guard<mutex> Lock(Mutex);
+  filesystem::path Dir(getCacheDir("trace"));
+  error_code Error;
+  // Rings of the previous run shouldn't be mixed with the new ones.
+  if (Rings.empty())
+    filesystem::remove_all(Dir, Error);
+  filesystem::create_directories(Dir, Error);
+
+  DWORD ThreadID = GetCurrentThreadId();
+  filesystem::path Path(Dir / ("thread-" + to_string(ThreadID) + ".bin"));
+  constexpr uint64_t Size =
+      sizeof(TraceHeader) + BinaryTraceRecords * sizeof(TraceRecord);
+  auto Rg = make_unique<Ring>();
+  HANDLE File = CreateFile2(Path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ, CREATE_ALWAYS, nullptr);
+  if (File == INVALID_HANDLE_VALUE) {
+    Log.error() << "cannot create trace file " << Path.string()
+                << Log.appendWinError();
+    return nullptr;
+  }
+  Rg->File = File;
+  Rg->Section = CreateFileMappingFromApp(File, nullptr, PAGE_READWRITE, Size,
+                                         nullptr);
+  if (Rg->Section)
+    Rg->Header = static_cast<TraceHeader *>(
+        MapViewOfFileFromApp(Rg->Section, FILE_MAP_WRITE, 0, Size));
+  if (!Rg->Header) {
+    Log.error() << "cannot map trace file " << Path.string()
+                << Log.appendWinError();
+    return nullptr;
+  }
+  Rg->Records = reinterpret_cast<TraceRecord *>(Rg->Header + 1);
+
+  LARGE_INTEGER Frequency;
+  QueryPerformanceFrequency(&Frequency);
+  TraceHeader &H = *Rg->Header;
+  memcpy(H.Magic, TraceHeader::MagicValue, sizeof(H.Magic));
+  H.Version = TraceHeader::CurrentVersion;
+  H.RecordSize = sizeof(TraceRecord);
+  H.Capacity = BinaryTraceRecords;
+  H.Frequency = Frequency.QuadPart;
+  H.ThreadID = ThreadID;
+  return Rings.emplace_back(move(Rg)).get();
+}
+
+bool TraceBuffer::save(DynamicLoader &Dyld) {
+  error_code Error;
+  filesystem::path Dir(getCacheDir("trace"));
+  filesystem::create_directories(Dir, Error);
+  ofstream OS(Dir / "images.txt");
+  // Each line contains start address, size, kind and path of one image.
+  for (const LibraryInfo &LI : Dyld.getLibraries())
+    OS << "0x" << to_hex_string(LI.Lib->getStart()) << " 0x"
+       << to_hex_string(LI.Lib->Size) << " "
+       << (LI.Lib->isDylib() ? "dylib" : "dll") << " " << *LI.LibPath << "\n";
+  OS.flush();
+  if (OS)
+    return true;
+  Log.warning("couldn't save list of traced images");
+  return false;
+}
@@ -0,0 +1,76 @@
+// Tracepoints.cpp: Implementation of class `Tracepoints`.
+
+#include "ipasim/Tracepoints.hpp"
+
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <string_view>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+// Indexed by `TraceCategory`
+constexpr const char *Names[] = {
+    "loader",      "emulation", "crossings",    "objc",
+    "trampolines", "faults",    "instructions", "memory"};
+static_assert(size(Names) == static_cast<size_t>(TraceCategory::Count));
+
+} // namespace
+
+Tracepoints::Tracepoints() : Mask(0) {
+  uint32_t Initial = 0;
+  if constexpr (PrintEmuInfo)
+    Initial = getBit(TraceCategory::Instructions) - 1;
+  if constexpr (PrintInstructions)
+    Initial |= getBit(TraceCategory::Instructions);
+  if constexpr (PrintMemoryWrites)
+    Initial |= getBit(TraceCategory::MemoryWrites);
+  Mask = Initial;
+  if (const char *Spec = getenv("IPASIM_TRACE"))
+    set(Spec);
+}
+
+void Tracepoints::set(TraceCategory C, bool Enable) {
+  if (Enable)
+    Mask.fetch_or(getBit(C));
+  else
+    Mask.fetch_and(~getBit(C));
+}
+
+bool Tracepoints::set(const char *Spec) {
+  bool Success = true;
+  string_view Rest(Spec);
+  while (!Rest.empty()) {
+    size_t Comma = Rest.find(',');
+    string_view Name(Rest.substr(0, Comma));
+    Rest.remove_prefix(Comma == string_view::npos ? Rest.size() : Comma + 1);
+
+    bool Enable = true;
+    if (!Name.empty() && Name[0] == '-') {
+      Enable = false;
+      Name.remove_prefix(1);
+    }
+    if (Name.empty())
+      continue;
+    if (Name == "all" || Name == "none") {
+      Mask = Enable == (Name == "all") ? getBit(TraceCategory::Count) - 1 : 0;
+      continue;
+    }
+    auto *It = find(begin(Names), end(Names), Name);
+    if (It == end(Names)) {
+      Success = false;
+      continue;
+    }
+    set(static_cast<TraceCategory>(It - begin(Names)), Enable);
+  }
+  return Success;
+}
+
+const char *Tracepoints::getName(TraceCategory C) {
+  return Names[static_cast<size_t>(C)];
+}
@@ -0,0 +1,203 @@
+// UIDispatcher.cpp: Implementation of class `UIDispatcher`.
+
+#include "ipasim/UIDispatcher.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+using namespace ipasim;
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// WinObjC frameworks implemented on top of XAML, i.e., those which must be
+// called on the UI thread.
+constexpr const char *UILibraries[] = {"UIKit", "QuartzCore", "CoreAnimation"};
+
+// How long the UI thread waits for the next call before it returns to its
+// message loop. The guest usually makes UI calls in bursts.
+constexpr auto Linger = microseconds(500);
+
+// Number of `HotEntries` translated at once while the emulation thread is idle.
+// Tasks wait for at most that many.
+constexpr size_t PretranslateBatch = 8;
+
+// Number of classes realized at once while the emulation thread is idle (see
+// `ClassRealizer`).
+constexpr size_t RealizeBatch = 16;
+
+} // namespace
+
+UIDispatcher::~UIDispatcher() {
+  if (!Thread.joinable())
+    return;
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Stopping = true;
+  }
+  Changed.notify_all();
+  Thread.join();
+}
+
+bool UIDispatcher::start(PostFunc Post) {
+  lock_guard<mutex> Lock(Mutex);
+  if (Thread.joinable())
+    return false;
+  this->Post = move(Post);
+  UIThread = this_thread::get_id();
+  Thread = thread(&UIDispatcher::runEmulation, this);
+  EmulationThread = Thread.get_id();
+  Active.store(true, memory_order_release);
+  return true;
+}
+
+bool UIDispatcher::needsUIThread(uint64_t Addr) {
+  LibraryInfo LI(IpaSim.Dyld.lookup(Addr));
+  if (!LI.Lib || !LI.LibPath)
+    return false;
+
+  lock_guard<mutex> Lock(LibsMutex);
+  auto [It, New] = UILibs.try_emplace(LI.Lib, false);
+  if (New) {
+    // Wrapper DLLs (e.g., `gen\UIKit.wrapper.dll`) belong to the framework
+    // they wrap.
+    string Name(filesystem::path(*LI.LibPath).filename().string());
+    Name.erase(min(Name.find('.'), Name.size()));
+    It->second = any_of(begin(UILibraries), end(UILibraries),
+                        [&](const char *Lib) { return Name == Lib; });
+  }
+  return It->second;
+}
+
+void UIDispatcher::forget(const LoadedLibrary *Lib) {
+  lock_guard<mutex> Lock(LibsMutex);
+  UILibs.erase(Lib);
+}
+
+void UIDispatcher::post(Task Func) {
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Tasks.push_back(move(Func));
+  }
+  Changed.notify_all();
+}
+
+void UIDispatcher::callOnUI(const Task &Func, bool Reentrant) {
+  Request R{&Func};
+  unique_lock<mutex> Lock(Mutex);
+  UIRequests.push_back(&R);
+  bool Schedule = !DrainScheduled;
+  DrainScheduled = true;
+  Lock.unlock();
+  Changed.notify_all();
+  // If the UI thread is waiting for us, it executes the call right away.
+  // Otherwise, it's woken up by its message loop.
+  if (Schedule)
+    Post([this]() { drain(); });
+  Lock.lock();
+  wait(Lock, R, Reentrant ? &EmulationRequests : nullptr);
+}
+
+void UIDispatcher::callOnEmulation(const Task &Func) {
+  Request R{&Func};
+  unique_lock<mutex> Lock(Mutex);
+  EmulationRequests.push_back(&R);
+  Changed.notify_all();
+  wait(Lock, R, &UIRequests);
+}
+
+void UIDispatcher::runEmulation() {
+  unique_lock<mutex> Lock(Mutex);
+  for (;;) {
+    auto HasWork = [&]() {
+      return Stopping || !Tasks.empty() || !EmulationRequests.empty();
+    };
+    // Warm up translations of the guest's main thread meanwhile.
+    if constexpr (Pretranslation)
+      while (!HasWork() && IpaSim.Entries.hasPending()) {
+        Lock.unlock();
+        IpaSim.Sys.pretranslate(PretranslateBatch);
+        Lock.lock();
+      }
+    // Then realize classes the guest is going to use.
+    if constexpr (PrerealizeClasses)
+      while (!HasWork() && IpaSim.Classes.hasPending()) {
+        Lock.unlock();
+        IpaSim.Classes.realize(RealizeBatch);
+        Lock.lock();
+      }
+    Changed.wait(Lock, HasWork);
+    if (Stopping)
+      return;
+    // Each turn is one iteration of the guest's main run loop, e.g., an event
+    // handler or a timer callback.
+    auto Start = steady_clock::now();
+    if (!EmulationRequests.empty())
+      execute(Lock, EmulationRequests);
+    else {
+      Task T(move(Tasks.front()));
+      Tasks.pop_front();
+      Lock.unlock();
+      T();
+      Lock.lock();
+    }
+    auto Time = steady_clock::now() - Start;
+    IpaSim.Stats.add(Stat::MainLoopTurns);
+    IpaSim.Stats.add(Stat::MainLoopTime,
+                     duration_cast<nanoseconds>(Time).count());
+    IpaSim.Frames.turn(Time);
+  }
+}
+
+void UIDispatcher::drain() {
+  auto Deadline = steady_clock::now() + microseconds(UIBatchBudget);
+  size_t Count = 0;
+  unique_lock<mutex> Lock(Mutex);
+  for (;;) {
+    if (!UIRequests.empty()) {
+      execute(Lock, UIRequests);
+      ++Count;
+      if (steady_clock::now() < Deadline)
+        continue;
+      break;
+    }
+    if (!Changed.wait_until(Lock, min(steady_clock::now() + Linger, Deadline),
+                            [&]() { return !UIRequests.empty(); }))
+      break;
+  }
+
+  // Let the message loop run, but come back if there is more work.
+  bool Reschedule = !UIRequests.empty();
+  DrainScheduled = Reschedule;
+  Lock.unlock();
+  IpaSim.Stats.add(Stat::UIBatches);
+  IpaSim.Stats.add(Stat::UICalls, Count);
+  if (Reschedule)
+    Post([this]() { drain(); });
+}
+
+void UIDispatcher::wait(unique_lock<mutex> &Lock, Request &R, Queue *Own) {
+  while (!R.Done) {
+    if (Own && !Own->empty()) {
+      execute(Lock, *Own);
+      continue;
+    }
+    Changed.wait(Lock);
+  }
+}
+
+void UIDispatcher::execute(unique_lock<mutex> &Lock, Queue &Requests) {
+  Request *R = Requests.front();
+  Requests.pop_front();
+  Lock.unlock();
+  (*R->Func)();
+  Lock.lock();
+  R->Done = true;
+  Changed.notify_all();
+}
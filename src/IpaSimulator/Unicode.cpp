@@ -0,0 +1,146 @@
+// Unicode.cpp: Implementation of UTF-8 to UTF-16 conversion.
+
+#include "ipasim/Unicode.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+#include <intrin.h>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+constexpr wchar_t Replacement = 0xFFFD;
+
+// `_xgetbv` needs this target feature.
+__attribute__((target("xsave"))) bool detectAVX2() {
+  int Info[4];
+  __cpuid(Info, 0);
+  if (Info[0] < 7)
+    return false;
+
+  // The OS must save YMM registers on context switches.
+  __cpuid(Info, 1);
+  bool OSXSAVE = Info[2] & (1 << 27);
+  bool AVX = Info[2] & (1 << 28);
+  if (!OSXSAVE || !AVX || (_xgetbv(0) & 6) != 6)
+    return false;
+
+  __cpuidex(Info, 7, 0);
+  return Info[1] & (1 << 5);
+}
+
+bool hasAVX2() {
+  static const bool Result = detectAVX2();
+  return Result;
+}
+
+// Widens the ASCII prefix of `S` (rounded down to whole vectors) into `Out`
+// and returns its length.
+size_t widenASCIISSE2(const char *S, size_t Len, wchar_t *Out) {
+  const __m128i Zero = _mm_setzero_si128();
+  size_t I = 0;
+  for (; I + 16 <= Len; I += 16) {
+    __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(S + I));
+    if (_mm_movemask_epi8(V))
+      break;
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + I),
+                     _mm_unpacklo_epi8(V, Zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + I + 8),
+                     _mm_unpackhi_epi8(V, Zero));
+  }
+  return I;
+}
+__attribute__((target("avx2"))) size_t
+widenASCIIAVX2(const char *S, size_t Len, wchar_t *Out) {
+  size_t I = 0;
+  for (; I + 32 <= Len; I += 32) {
+    __m256i V = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(S + I));
+    if (_mm256_movemask_epi8(V))
+      break;
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(Out + I),
+                        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(V)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(Out + I + 16),
+                        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(V, 1)));
+  }
+  return I + widenASCIISSE2(S + I, Len - I, Out + I);
+}
+
+bool isContinuation(uint8_t B) { return (B & 0xC0) == 0x80; }
+
+// Decodes one UTF-8 sequence at `S[I]`, advancing `I` past it. Returns
+// `Replacement` for invalid sequences, skipping only their first byte.
+uint32_t decodeUTF8(const uint8_t *S, size_t Len, size_t &I) {
+  uint8_t B0 = S[I++];
+  if (B0 < 0x80)
+    return B0;
+
+  // Number of continuation bytes and bounds of the first one, which exclude
+  // overlong encodings, surrogates and code points above U+10FFFF.
+  size_t N;
+  uint8_t Min = 0x80, Max = 0xBF;
+  uint32_t C;
+  if (B0 >= 0xC2 && B0 <= 0xDF) {
+    N = 1;
+    C = B0 & 0x1F;
+  } else if (B0 >= 0xE0 && B0 <= 0xEF) {
+    N = 2;
+    C = B0 & 0x0F;
+    if (B0 == 0xE0)
+      Min = 0xA0;
+    else if (B0 == 0xED)
+      Max = 0x9F;
+  } else if (B0 >= 0xF0 && B0 <= 0xF4) {
+    N = 3;
+    C = B0 & 0x07;
+    if (B0 == 0xF0)
+      Min = 0x90;
+    else if (B0 == 0xF4)
+      Max = 0x8F;
+  } else
+    return Replacement;
+
+  if (Len - I < N || S[I] < Min || S[I] > Max)
+    return Replacement;
+  for (size_t J = 0; J != N; ++J) {
+    if (!isContinuation(S[I + J]))
+      return Replacement;
+    C = (C << 6) | (S[I + J] & 0x3F);
+  }
+  I += N;
+  return C;
+}
+
+} // namespace
+
+void ipasim::appendUTF16(wstring &Out, const char *S, size_t Len) {
+  // UTF-16 never needs more code units than UTF-8 needs bytes.
+  size_t Start = Out.size();
+  Out.resize(Start + Len);
+  wchar_t *W = Out.data() + Start;
+  auto *Bytes = reinterpret_cast<const uint8_t *>(S);
+  bool AVX2 = hasAVX2();
+
+  size_t I = 0;
+  while (I != Len) {
+    size_t ASCII = AVX2 ? widenASCIIAVX2(S + I, Len - I, W)
+                        : widenASCIISSE2(S + I, Len - I, W);
+    I += ASCII;
+    W += ASCII;
+
+    // Decode the rest of the vector which wasn't ASCII one by one.
+    size_t End = min(I + 16, Len);
+    while (I < End) {
+      uint32_t C = decodeUTF8(Bytes, Len, I);
+      if (C >= 0x10000) {
+        C -= 0x10000;
+        *W++ = static_cast<wchar_t>(0xD800 | (C >> 10));
+        *W++ = static_cast<wchar_t>(0xDC00 | (C & 0x3FF));
+      } else
+        *W++ = static_cast<wchar_t>(C);
+    }
+  }
+  Out.resize(W - Out.data());
+}
@@ -0,0 +1,133 @@
+// UnicornBackend.cpp: Implementation of class `UnicornBackend`.
+
+#include "ipasim/UnicornBackend.hpp"
+
+#include "ipasim/Emulator.hpp"
+
+#include <cassert>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+uc_context *toUC(CPUContext *Ctx) {
+  return reinterpret_cast<uc_context *>(Ctx);
+}
+
+int *toIds(const uc_arm_reg *RegIds) {
+  static_assert(sizeof(uc_arm_reg) == sizeof(int));
+  return const_cast<int *>(reinterpret_cast<const int *>(RegIds));
+}
+
+constexpr size_t MaxBatch = Emulator::MaxBatch;
+
+} // namespace
+
+UnicornBackend::UnicornBackend() {
+  // This is only the initial mode, `start` switches to Thumb mode as needed.
+  if (uc_open(UC_ARCH_ARM, UC_MODE_ARM, &UC) != UC_ERR_OK)
+    UC = nullptr;
+}
+
+UnicornBackend::~UnicornBackend() {
+  if (Saved)
+    uc_free(Saved);
+  if (UC)
+    uc_close(UC);
+}
+
+uc_err UnicornBackend::readRegs(const uc_arm_reg *RegIds, uint32_t *Values,
+                                size_t Count) {
+  assert(Count <= MaxBatch && "Too many registers.");
+  if (Count == 1)
+    return uc_reg_read(UC, RegIds[0], Values);
+  void *Ptrs[MaxBatch];
+  for (size_t I = 0; I != Count; ++I)
+    Ptrs[I] = &Values[I];
+  return uc_reg_read_batch(UC, toIds(RegIds), Ptrs, static_cast<int>(Count));
+}
+
+uc_err UnicornBackend::writeRegs(const uc_arm_reg *RegIds,
+                                 const uint32_t *Values, size_t Count) {
+  assert(Count <= MaxBatch && "Too many registers.");
+  if (Count == 1)
+    return uc_reg_write(UC, RegIds[0], Values);
+  void *Ptrs[MaxBatch];
+  for (size_t I = 0; I != Count; ++I)
+    Ptrs[I] = const_cast<uint32_t *>(&Values[I]);
+  return uc_reg_write_batch(UC, toIds(RegIds), Ptrs, static_cast<int>(Count));
+}
+
+uc_err UnicornBackend::mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms,
+                                 void *Host) {
+  return uc_mem_map_ptr(UC, Addr, Size, Perms, Host);
+}
+
+uc_err UnicornBackend::unmapMemory(uint64_t Addr, uint64_t Size) {
+  return uc_mem_unmap(UC, Addr, Size);
+}
+
+uc_err UnicornBackend::protectMemory(uint64_t Addr, uint64_t Size,
+                                     uc_prot Perms) {
+  return uc_mem_protect(UC, Addr, Size, Perms);
+}
+
+// Unicorn switches to Thumb mode (and clears the bit) itself when PC is set to
+// an odd address.
+uc_err UnicornBackend::start(uint64_t Addr, size_t Count) {
+  return uc_emu_start(UC, Addr, 0, 0, Count);
+}
+
+uc_err UnicornBackend::stop() { return uc_emu_stop(UC); }
+
+// Unicorn 2 can translate a block without executing it. Blocks are translated
+// in the current mode, so PC is set like in `start` and then restored.
+uc_err UnicornBackend::translate(uint64_t Addr) {
+#if defined(uc_ctl_request_cache)
+  if (!Saved)
+    if (uc_err Err = uc_context_alloc(UC, &Saved))
+      return Err;
+  if (uc_err Err = uc_context_save(UC, Saved))
+    return Err;
+  uint32_t PC = static_cast<uint32_t>(Addr);
+  uc_err Err = uc_reg_write(UC, UC_ARM_REG_PC, &PC);
+  if (Err == UC_ERR_OK) {
+    uc_tb TB;
+    Err = uc_ctl_request_cache(UC, Addr & ~uint64_t(1), &TB);
+  }
+  uc_context_restore(UC, Saved);
+  return Err;
+#else
+  return UC_ERR_ARG;
+#endif
+}
+
+uc_err UnicornBackend::allocContext(CPUContext *&Ctx) {
+  uc_context *C = nullptr;
+  uc_err Err = uc_context_alloc(UC, &C);
+  Ctx = reinterpret_cast<CPUContext *>(C);
+  return Err;
+}
+
+uc_err UnicornBackend::saveContext(CPUContext *Ctx) {
+  return uc_context_save(UC, toUC(Ctx));
+}
+
+uc_err UnicornBackend::restoreContext(CPUContext *Ctx) {
+  return uc_context_restore(UC, toUC(Ctx));
+}
+
+uc_err UnicornBackend::freeContext(CPUContext *Ctx) {
+  return uc_free(toUC(Ctx));
+}
+
+uc_err UnicornBackend::addHook(uc_hook_type Type, void *Callback, void *Data,
+                               uint64_t Begin, uint64_t End, size_t &Hook) {
+  uc_hook H = 0;
+  uc_err Err = uc_hook_add(UC, &H, Type, Callback, Data, Begin, End);
+  Hook = H;
+  return Err;
+}
+
+uc_err UnicornBackend::removeHook(size_t Hook) { return uc_hook_del(UC, Hook); }
@@ -0,0 +1,107 @@
+// Watchpoints.cpp: Implementation of class `Watchpoints`.
+
+#include "ipasim/Watchpoints.hpp"
+
+#include "ipasim/CacheFile.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/GuestMemoryMap.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+using namespace ipasim;
+using namespace std;
+
+uint32_t Watchpoints::add(uint64_t Addr, uint64_t Size) {
+  if (!Size)
+    return 0;
+  uint64_t Start = DynamicLoader::alignToPageSize(Addr);
+  uint64_t End = DynamicLoader::roundToPageSize(Addr + Size);
+  lock_guard<mutex> Lock(Mutex);
+  if (!Events)
+    Events = make_unique<Event[]>(Capacity);
+
+  // Make the pages read-only.
+  for (uint64_t P = Start; P != End; P += DynamicLoader::PageSize) {
+    auto It = Pages.find(P);
+    if (It != Pages.end()) {
+      ++It->second.Refs;
+      continue;
+    }
+    uc_prot Perms;
+    if (!Space.getPerms(P, Perms) ||
+        !Space.protectRange(P, DynamicLoader::PageSize,
+                            static_cast<uc_prot>(Perms & ~UC_PROT_WRITE))) {
+      Log.error() << "cannot watch unmapped memory at 0x" << to_hex_string(P)
+                  << Log.end();
+      unwatchPages(Start, P);
+      return 0;
+    }
+    Pages[P] = Page{Perms, 1};
+  }
+
+  uint32_t ID = NextID++;
+  Watches[ID] = Range{Addr, Size};
+  return ID;
+}
+
+void Watchpoints::remove(uint32_t ID) {
+  lock_guard<mutex> Lock(Mutex);
+  auto It = Watches.find(ID);
+  if (It == Watches.end())
+    return;
+  unwatchPages(DynamicLoader::alignToPageSize(It->second.Addr),
+               DynamicLoader::roundToPageSize(It->second.Addr +
+                                              It->second.Size));
+  Watches.erase(It);
+}
+
+bool Watchpoints::handleWrite(uint64_t Addr, int Size, int64_t Value,
+                              uint32_t PC) {
+  lock_guard<mutex> Lock(Mutex);
+  auto PageIt = Pages.find(DynamicLoader::alignToPageSize(Addr));
+  if (PageIt == Pages.end() || !(PageIt->second.Perms & UC_PROT_WRITE))
+    return false;
+
+  // There are usually only a few watches, so they are simply all checked.
+  for (const auto &[ID, R] : Watches)
+    if (Addr < R.Addr + R.Size && R.Addr < Addr + Size) {
+      uint64_t I = EventCount++;
+      Events[I % Capacity] =
+          Event{static_cast<uint64_t>(Value), static_cast<uint32_t>(Addr), PC,
+                ID, static_cast<uint32_t>(Size)};
+    }
+  return true;
+}
+
+bool Watchpoints::save() {
+  lock_guard<mutex> Lock(Mutex);
+  uint64_t Total = EventCount;
+  uint64_t Count = min(Total, Capacity);
+  LogHeader Header{Magic, Version, Total - Count, Count};
+
+  error_code Error;
+  filesystem::path Dir(getCacheDir("watch"));
+  filesystem::create_directories(Dir, Error);
+  ofstream O(Dir / "events.bin", ios::binary | ios::trunc);
+  write(O, Header);
+  // Oldest events first.
+  for (uint64_t I = Total - Count; I != Total; ++I)
+    write(O, Events[I % Capacity]);
+  if (!O) {
+    Log.warning("couldn't save watchpoint events");
+    return false;
+  }
+  return true;
+}
+
+void Watchpoints::unwatchPages(uint64_t Start, uint64_t End) {
+  for (uint64_t P = Start; P != End; P += DynamicLoader::PageSize) {
+    auto It = Pages.find(P);
+    if (It == Pages.end() || --It->second.Refs)
+      continue;
+    Space.protectRange(P, DynamicLoader::PageSize, It->second.Perms);
+    Pages.erase(It);
+  }
+}
@@ -17,6 +17,224 @@
 #import <UWP/ObjCHelpers.h>
 #import <UWP/interopBase.h>
 #import <Starboard.h>
+#import "RTBuffers.h"
+
+#include <mutex>
+#include <robuffer.h>
+#include <vector>
+#include <windows.storage.streams.h>
+#include <wrl/implements.h>
+
+namespace {
+// Element types of primitive arrays exchanged with `IPropertyValue` in bulk.
+// They match the scalar conversions of `_convertToPropertyValueType`.
+enum class PrimitiveKind { None, Int64, UInt64, Single, Double };
+
+PrimitiveKind primitiveKindOf(id item) {
+    if (![item isKindOfClass:[NSNumber class]]) {
+        return PrimitiveKind::None;
+    }
+    const char* type = [item objCType];
+    if (type[0] == '\0' || type[1] != '\0') {
+        return PrimitiveKind::None;
+    }
+    switch (type[0]) {
+        case 'c':
+        case 'i':
+        case 'l':
+        case 's':
+        case 'q':
+            return PrimitiveKind::Int64;
+        case 'C':
+        case 'I':
+        case 'L':
+        case 'S':
+        case 'Q':
+            return PrimitiveKind::UInt64;
+        case 'f':
+            return PrimitiveKind::Single;
+        case 'd':
+            return PrimitiveKind::Double;
+        default:
+            return PrimitiveKind::None;
+    }
+}
+
+// Fast-pass HSTRING over a local copy of an NSString's characters. It's valid
+// only while this object lives, so it's meant for strings WinRT borrows just
+// for the duration of a call. Callees which keep the string duplicate it,
+// which copies fast-pass strings, so this is safe for them, too. Unlike
+// `nsStrToHstr`, no HSTRING is allocated.
+class StringReference {
+public:
+    explicit StringReference(NSString* str) {
+        UINT32 length = [str length];
+        wchar_t* chars = _inline;
+        if (length >= ARRAY_COUNT(_inline)) {
+            _heap.resize(length + 1);
+            chars = _heap.data();
+        }
+        [str getCharacters:reinterpret_cast<unichar*>(chars) range:NSMakeRange(0, length)];
+        chars[length] = L'\0';
+        THROW_NS_IF_FAILED(WindowsCreateStringReference(chars, length, &_header, &_hstr));
+    }
+    StringReference(const StringReference&) = delete;
+    StringReference& operator=(const StringReference&) = delete;
+
+    HSTRING Get() const {
+        return _hstr;
+    }
+
+private:
+    HSTRING_HEADER _header;
+    HSTRING _hstr = nullptr;
+    wchar_t _inline[128];
+    std::vector<wchar_t> _heap;
+};
+} // namespace
+
+namespace {
+// Identifies `NSDataBuffer`s, so that they can be unwrapped back to NSData.
+MIDL_INTERFACE("6A1D3C52-8E0B-4F5B-9C53-2D7B8F4E91A6")
+INSDataBuffer : public IUnknown {
+    virtual NSData* STDMETHODCALLTYPE data() = 0;
+};
+
+// `IBuffer` exposing bytes of an NSData without copying them. It retains the
+// NSData until the last COM reference is released. Its capacity is the NSData's
+// length. `Buffer` hands out writable bytes, so immutable NSData is copied the
+// first time they are requested (or the length is changed), and the buffer
+// then owns the copy. NSMutableData is shared as it is.
+class NSDataBuffer
+    : public Microsoft::WRL::RuntimeClass<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::WinRtClassicComMix>,
+                                          ABI::Windows::Storage::Streams::IBuffer,
+                                          Windows::Storage::Streams::IBufferByteAccess,
+                                          INSDataBuffer> {
+    InspectableClass(L"RTObjCInterop.NSDataBuffer", BaseTrust);
+
+public:
+    HRESULT RuntimeClassInitialize(NSData* data) {
+        _data = data;
+        _capacity = [data length];
+        return S_OK;
+    }
+
+    IFACEMETHODIMP get_Capacity(UINT32* value) override {
+        *value = _capacity;
+        return S_OK;
+    }
+
+    IFACEMETHODIMP get_Length(UINT32* value) override {
+        *value = [_data length];
+        return S_OK;
+    }
+
+    IFACEMETHODIMP put_Length(UINT32 value) override {
+        if (value > _capacity) {
+            return E_INVALIDARG;
+        }
+        [mutableData() setLength:value];
+        return S_OK;
+    }
+
+    IFACEMETHODIMP Buffer(BYTE** value) override {
+        *value = static_cast<BYTE*>([mutableData() mutableBytes]);
+        return S_OK;
+    }
+
+    NSData* STDMETHODCALLTYPE data() override {
+        return _data;
+    }
+
+private:
+    NSMutableData* mutableData() {
+        if (![_data isKindOfClass:[NSMutableData class]]) {
+            _data.attach([_data mutableCopy]);
+        }
+        return static_cast<NSMutableData*>(static_cast<NSData*>(_data));
+    }
+
+    StrongId<NSData> _data;
+    UINT32 _capacity = 0;
+};
+} // namespace
+
+// Immutable NSData over the bytes of an `IBuffer`, which it keeps alive.
+@interface RTBufferData : NSData {
+@public
+    ComPtr<ABI::Windows::Storage::Streams::IBuffer> _buffer;
+    BYTE* _bytes;
+}
+- (instancetype)initWithBuffer:(const ComPtr<ABI::Windows::Storage::Streams::IBuffer>&)buffer;
+@end
+
+// Immutable NSArray over a buffer returned by `IPropertyValue::Get*Array`.
+// Elements are boxed into NSNumbers only when they are accessed, and the
+// buffer can be passed back to WinRT as it is.
+@interface RTPrimitiveArray : NSArray {
+@public
+    PrimitiveKind _kind;
+    void* _buffer; // Owned, freed with `CoTaskMemFree`.
+    UINT32 _length;
+}
+- (instancetype)initWithKind:(PrimitiveKind)kind buffer:(void*)buffer length:(UINT32)length;
+@end
+
+// Immutable NSDictionary over a property set. Keys and the (unconverted)
+// values are taken from the map when the dictionary is created, so later
+// changes of the map don't show through. Values are converted only when they are
+// looked up or enumerated (and then cached under a lock, so the dictionary can
+// be read from any thread like other immutable ones), so large property sets
+// cost little unless they are actually read.
+@interface RTPropertySetDictionary : NSDictionary {
+    StrongId<NSArray> _keys;
+    StrongId<NSDictionary> _indices; // Keys to indices into `_objects`
+    std::vector<ComPtr<IInspectable>> _objects;
+    std::mutex _valuesMutex;
+    StrongId<NSMutableDictionary> _values; // Converted `_objects`
+}
+- (instancetype)initWithMapView:(ComPtr<IMapView<HSTRING, IInspectable*>>)map;
+@end
+
+@implementation RTPrimitiveArray
+- (instancetype)initWithKind:(PrimitiveKind)kind buffer:(void*)buffer length:(UINT32)length {
+    if (self = [super init]) {
+        _kind = kind;
+        _buffer = buffer;
+        _length = length;
+    } else {
+        CoTaskMemFree(buffer);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    CoTaskMemFree(_buffer);
+    [super dealloc];
+}
+
+- (NSUInteger)count {
+    return _length;
+}
+
+- (id)objectAtIndex:(NSUInteger)index {
+    if (index >= _length) {
+        THROW_NS_HR(E_BOUNDS);
+    }
+    switch (_kind) {
+        case PrimitiveKind::Int64:
+            return [NSNumber numberWithLongLong:static_cast<INT64*>(_buffer)[index]];
+        case PrimitiveKind::UInt64:
+            return [NSNumber numberWithUnsignedLongLong:static_cast<UINT64*>(_buffer)[index]];
+        case PrimitiveKind::Single:
+            return [NSNumber numberWithFloat:static_cast<FLOAT*>(_buffer)[index]];
+        case PrimitiveKind::Double:
+            return [NSNumber numberWithDouble:static_cast<DOUBLE*>(_buffer)[index]];
+        default:
+            return nil;
+    }
+}
+@end
 
 namespace CommonConvertors {
 Microsoft::WRL::ComPtr<IInspectable> _convertNSArrayToPropertyValue(id obj);
@@ -29,11 +247,17 @@ id _convertDoubleArrayToNSArray(Microsoft::WRL::ComPtr<IPropertyValue> ip);
 id _convertStringArrayToNSArray(Microsoft::WRL::ComPtr<IPropertyValue> ip);
 id _convertMapToNSDictionary(Microsoft::WRL::ComPtr<IInspectable> ip);
 id _convertPropertyValueToObjC(Microsoft::WRL::ComPtr<IPropertyValue> obj);
+id _convertPropertySetValueToObjC(Microsoft::WRL::ComPtr<IInspectable> obj);
 
+// `PropertyValue` statics are agile, so they are activated only once per
+// process instead of on every conversion.
 ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propertyValueCreator() {
-    ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propValueCreator;
-    THROW_NS_IF_FAILED(ABI::Windows::Foundation::GetActivationFactory(HString::MakeReference(L"Windows.Foundation.PropertyValue").Get(),
-                                                                      &propValueCreator));
+    static const ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propValueCreator = []() {
+        ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> creator;
+        THROW_NS_IF_FAILED(ABI::Windows::Foundation::GetActivationFactory(
+            HString::MakeReference(L"Windows.Foundation.PropertyValue").Get(), &creator));
+        return creator;
+    }();
     return propValueCreator;
 }
 
@@ -44,37 +268,118 @@ ComPtr<IInspectable> _convertToPropertyValueType(id item) {
     ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propValueCreator = propertyValueCreator();
     ComPtr<IInspectable> propValue;
     if ([item isKindOfClass:[NSString class]]) {
-        HSTRING hstr = ToWRLConvertor<HSTRING, dummyWRLCreator>::convert(item);
-        THROW_NS_IF_FAILED(propValueCreator->CreateString(hstr, propValue.GetAddressOf()));
-        WindowsDeleteString(hstr);
+        StringReference hstr(item);
+        THROW_NS_IF_FAILED(propValueCreator->CreateString(hstr.Get(), propValue.GetAddressOf()));
     } else if ([item isKindOfClass:[NSArray class]]) {
         propValue = _convertNSArrayToPropertyValue(item);
+    } else if ([item isKindOfClass:[NSData class]]) {
+        // Bytes are copied as they are, not boxed one by one.
+        THROW_NS_IF_FAILED(propValueCreator->CreateUInt8Array([item length],
+                                                              static_cast<BYTE*>(const_cast<void*>([item bytes])),
+                                                              propValue.GetAddressOf()));
     } else if ([item isKindOfClass:[NSDictionary class]]) {
         propValue = convertNSDictionaryToPropertySet(item);
     } else if ([item isKindOfClass:[NSNumber class]]) {
-        const char* type = [item objCType];
-        if (strstr("cilsq", type) != NULL) {
-            THROW_NS_IF_FAILED(
-                propValueCreator->CreateInt64(ToWRLConvertor<int64_t, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
-        } else if (strstr("CILSQ", type) != NULL) {
-            THROW_NS_IF_FAILED(
-                propValueCreator->CreateUInt64(ToWRLConvertor<uint64_t, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
-        } else if (strcmp("f", type) == 0) {
-            THROW_NS_IF_FAILED(
-                propValueCreator->CreateSingle(ToWRLConvertor<float, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
-        } else if (strcmp("d", type) == 0) {
-            THROW_NS_IF_FAILED(
-                propValueCreator->CreateDouble(ToWRLConvertor<double, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
+        switch (primitiveKindOf(item)) {
+            case PrimitiveKind::Int64:
+                THROW_NS_IF_FAILED(
+                    propValueCreator->CreateInt64(ToWRLConvertor<int64_t, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
+                break;
+            case PrimitiveKind::UInt64:
+                THROW_NS_IF_FAILED(
+                    propValueCreator->CreateUInt64(ToWRLConvertor<uint64_t, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
+                break;
+            case PrimitiveKind::Single:
+                THROW_NS_IF_FAILED(
+                    propValueCreator->CreateSingle(ToWRLConvertor<float, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
+                break;
+            case PrimitiveKind::Double:
+                THROW_NS_IF_FAILED(
+                    propValueCreator->CreateDouble(ToWRLConvertor<double, dummyWRLCreator>::convert(item), propValue.GetAddressOf()));
+                break;
+            default:
+                break;
         }
     }
     return propValue;
 }
 
+// Creates a primitive array from `buffer` of `kind`.
+ComPtr<IInspectable> _createPrimitiveArray(ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propValueCreator,
+                                           PrimitiveKind kind,
+                                           void* buffer,
+                                           UINT32 length) {
+    ComPtr<IInspectable> returnObj;
+    switch (kind) {
+        case PrimitiveKind::Int64:
+            THROW_NS_IF_FAILED(propValueCreator->CreateInt64Array(length, static_cast<INT64*>(buffer), returnObj.GetAddressOf()));
+            break;
+        case PrimitiveKind::UInt64:
+            THROW_NS_IF_FAILED(propValueCreator->CreateUInt64Array(length, static_cast<UINT64*>(buffer), returnObj.GetAddressOf()));
+            break;
+        case PrimitiveKind::Single:
+            THROW_NS_IF_FAILED(propValueCreator->CreateSingleArray(length, static_cast<FLOAT*>(buffer), returnObj.GetAddressOf()));
+            break;
+        case PrimitiveKind::Double:
+            THROW_NS_IF_FAILED(propValueCreator->CreateDoubleArray(length, static_cast<DOUBLE*>(buffer), returnObj.GetAddressOf()));
+            break;
+        default:
+            break;
+    }
+    return returnObj;
+}
+
+// If all items of `obj` are NSNumbers of the same kind, converts them to a
+// primitive array in one go. Returns `nullptr` otherwise.
+template <typename T>
+ComPtr<IInspectable> _convertNumbersToPrimitiveArray(ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propValueCreator,
+                                                     id obj,
+                                                     PrimitiveKind kind) {
+    std::vector<T> values;
+    values.reserve([obj count]);
+    for (id item in obj) {
+        if (primitiveKindOf(item) != kind) {
+            return nullptr;
+        }
+        values.push_back(ToWRLConvertor<T, dummyWRLCreator>::convert(item));
+    }
+    return _createPrimitiveArray(propValueCreator, kind, values.data(), values.size());
+}
+
 ComPtr<IInspectable> _convertNSArrayToPropertyValue(id obj) {
     if (obj == nil) {
         return nullptr;
     }
     ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> propValueCreator = propertyValueCreator();
+
+    // Primitive arrays are passed without boxing their elements.
+    if ([obj isKindOfClass:[RTPrimitiveArray class]]) {
+        RTPrimitiveArray* arr = obj;
+        return _createPrimitiveArray(propValueCreator, arr->_kind, arr->_buffer, arr->_length);
+    }
+    if ([obj count]) {
+        ComPtr<IInspectable> primitive;
+        switch (primitiveKindOf([obj objectAtIndex:0])) {
+            case PrimitiveKind::Int64:
+                primitive = _convertNumbersToPrimitiveArray<int64_t>(propValueCreator, obj, PrimitiveKind::Int64);
+                break;
+            case PrimitiveKind::UInt64:
+                primitive = _convertNumbersToPrimitiveArray<uint64_t>(propValueCreator, obj, PrimitiveKind::UInt64);
+                break;
+            case PrimitiveKind::Single:
+                primitive = _convertNumbersToPrimitiveArray<float>(propValueCreator, obj, PrimitiveKind::Single);
+                break;
+            case PrimitiveKind::Double:
+                primitive = _convertNumbersToPrimitiveArray<double>(propValueCreator, obj, PrimitiveKind::Double);
+                break;
+            default:
+                break;
+        }
+        if (primitive) {
+            return primitive;
+        }
+    }
+
     // This array will maintain the lifetime of the ComPtrs till the function exits.
     std::vector<ComPtr<IInspectable>> arr;
     std::vector<IInspectable*> arrIInspectable;
@@ -105,7 +410,7 @@ ComPtr<IInspectable> convertNSDictionaryToPropertySet(id obj) {
         if ([key isKindOfClass:[NSString class]]) {
             id value = obj[key];
             ComPtr<IInspectable> propValue = _convertToPropertyValueType(value);
-            _map->Insert(nsStrToHstr(key).Get(), propValue.Get(), &replaced);
+            _map->Insert(StringReference(key).Get(), propValue.Get(), &replaced);
         }
     }
     THROW_NS_IF_FAILED(_map->GetView(_mapView.GetAddressOf()));
@@ -124,13 +429,13 @@ ComPtr<IInspectable> convertNSErrorToPropertySet(id obj) {
     ComPtr<IInspectable> propValue = _convertToPropertyValueType([NSNumber numberWithLongLong:(int64_t)[obj code]]);
     NSString* code = @"code";
     boolean replaced;
-    _map->Insert(nsStrToHstr(code).Get(), propValue.Get(), &replaced);
+    _map->Insert(StringReference(code).Get(), propValue.Get(), &replaced);
     id userInfo = [obj userInfo];
     for (id key in userInfo) {
         if ([key isKindOfClass:[NSString class]]) {
             id value = userInfo[key];
             propValue = _convertToPropertyValueType(value);
-            _map->Insert(nsStrToHstr(key).Get(), propValue.Get(), &replaced);
+            _map->Insert(StringReference(key).Get(), propValue.Get(), &replaced);
         }
     }
     THROW_NS_IF_FAILED(_map->GetView(_mapView.GetAddressOf()));
@@ -264,14 +569,8 @@ id _convertDoubleArrayToNSArray(ComPtr<IPropertyValue> ip) {
     if (ip == nullptr) {
         return nil;
     }
-    NSMutableArray* values = [[[NSMutableArray alloc] init] autorelease];
     THROW_NS_IF_FAILED(ip->GetDoubleArray(&length, &arr));
-    for (UINT32 i = 0; i < length; i++) {
-        [values addObject:[NSNumber numberWithDouble:arr[i]]];
-    }
-    NSArray* value = [NSArray arrayWithArray:values];
-    CoTaskMemFree(arr);
-    return value;
+    return [[[RTPrimitiveArray alloc] initWithKind:PrimitiveKind::Double buffer:arr length:length] autorelease];
 }
 
 id _convertSingleArrayToNSArray(ComPtr<IPropertyValue> ip) {
@@ -280,14 +579,8 @@ id _convertSingleArrayToNSArray(ComPtr<IPropertyValue> ip) {
     if (ip == nullptr) {
         return nil;
     }
-    NSMutableArray* values = [[[NSMutableArray alloc] init] autorelease];
     THROW_NS_IF_FAILED(ip->GetSingleArray(&length, &arr));
-    for (UINT32 i = 0; i < length; i++) {
-        [values addObject:[NSNumber numberWithFloat:arr[i]]];
-    }
-    NSArray* value = [NSArray arrayWithArray:values];
-    CoTaskMemFree(arr);
-    return value;
+    return [[[RTPrimitiveArray alloc] initWithKind:PrimitiveKind::Single buffer:arr length:length] autorelease];
 }
 
 id _convertUIntArrayToNSArray(ComPtr<IPropertyValue> ip) {
@@ -296,14 +589,8 @@ id _convertUIntArrayToNSArray(ComPtr<IPropertyValue> ip) {
     if (ip == nullptr) {
         return nil;
     }
-    NSMutableArray* values = [[[NSMutableArray alloc] init] autorelease];
     THROW_NS_IF_FAILED(ip->GetUInt64Array(&length, &arr));
-    for (UINT32 i = 0; i < length; i++) {
-        [values addObject:[NSNumber numberWithUnsignedLongLong:arr[i]]];
-    }
-    NSArray* value = [NSArray arrayWithArray:values];
-    CoTaskMemFree(arr);
-    return value;
+    return [[[RTPrimitiveArray alloc] initWithKind:PrimitiveKind::UInt64 buffer:arr length:length] autorelease];
 }
 
 id _convertIntArrayToNSArray(ComPtr<IPropertyValue> ip) {
@@ -312,14 +599,8 @@ id _convertIntArrayToNSArray(ComPtr<IPropertyValue> ip) {
     if (ip == nullptr) {
         return nil;
     }
-    NSMutableArray* values = [[[NSMutableArray alloc] init] autorelease];
     THROW_NS_IF_FAILED(ip->GetInt64Array(&length, &arr));
-    for (UINT32 i = 0; i < length; i++) {
-        [values addObject:[NSNumber numberWithLongLong:arr[i]]];
-    }
-    NSArray* value = [NSArray arrayWithArray:values];
-    CoTaskMemFree(arr);
-    return value;
+    return [[[RTPrimitiveArray alloc] initWithKind:PrimitiveKind::Int64 buffer:arr length:length] autorelease];
 }
 
 id _convertInspectableArrayToNSArray(ComPtr<IPropertyValue> ip) {
@@ -341,41 +622,23 @@ id _convertInspectableArrayToNSArray(ComPtr<IPropertyValue> ip) {
     return value;
 }
 
+id _convertPropertySetValueToObjC(ComPtr<IInspectable> obj) {
+    ComPtr<IPropertyValue> obj1;
+    ComPtr<IMap<HSTRING, IInspectable*>> obj2;
+    ComPtr<IMapView<HSTRING, IInspectable*>> obj3;
+    if (SUCCEEDED(obj.As(&obj1))) {
+        return _convertPropertyValueToObjC(obj1);
+    } else if (SUCCEEDED(obj.As(&obj2)) || SUCCEEDED(obj.As(&obj3))) {
+        return _convertMapToNSDictionary(obj);
+    }
+    THROW_NS_HR(E_NOINTERFACE);
+}
+
 id convertPropertySetToNSDictionary(ComPtr<IMapView<HSTRING, IInspectable*>> ip) {
-    ComPtr<IIterable<IKeyValuePair<HSTRING, IInspectable*>*>> iterable;
-    ComPtr<IIterator<IKeyValuePair<HSTRING, IInspectable*>*>> iterator;
     if (ip == nullptr) {
         return nil;
     }
-    THROW_NS_IF_FAILED(ip.As(&iterable));
-    THROW_NS_IF_FAILED(iterable->First(&iterator));
-    boolean hasCurrent = false;
-    THROW_NS_IF_FAILED(iterator->get_HasCurrent(&hasCurrent));
-    NSMutableDictionary* _dictionary = [[[NSMutableDictionary alloc] init] autorelease];
-    while (hasCurrent) {
-        ComPtr<IKeyValuePair<HSTRING, IInspectable*>> kvp;
-        THROW_NS_IF_FAILED(iterator->get_Current(&kvp));
-        HSTRING keyHstr;
-        THROW_NS_IF_FAILED(kvp->get_Key(&keyHstr));
-        NSString* key = hstrToNSStr(keyHstr, true);
-        id value;
-        ComPtr<IInspectable> obj;
-        THROW_NS_IF_FAILED(kvp->get_Value(obj.GetAddressOf()));
-        ComPtr<IPropertyValue> obj1;
-        ComPtr<IMap<HSTRING, IInspectable*>> obj2;
-        ComPtr<IMapView<HSTRING, IInspectable*>> obj3;
-        if (SUCCEEDED(obj.As(&obj1))) {
-            value = _convertPropertyValueToObjC(obj1);
-        } else if (SUCCEEDED(obj.As(&obj2)) || SUCCEEDED(obj.As(&obj3))) {
-            value = _convertMapToNSDictionary(obj);
-        } else {
-            THROW_NS_HR(E_NOINTERFACE);
-        }
-        [_dictionary setObject:value forKey:key];
-        THROW_NS_IF_FAILED(iterator->MoveNext(&hasCurrent));
-    }
-    NSDictionary* _ret = [NSDictionary dictionaryWithDictionary:_dictionary];
-    return _ret;
+    return [[[RTPropertySetDictionary alloc] initWithMapView:ip] autorelease];
 }
 
 ABI::Windows::Foundation::DateTime convertNSDateToWinRT(NSDate* obj) {
@@ -429,67 +692,141 @@ NSURL* convertWinRTUriToNSURL(const ComPtr<ABI::Windows::Foundation::IUriRuntime
 }
 
 ComPtr<IInspectable> convertNSNumberToPropertyValue(NSNumber* obj) {
-    ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> inst;
-    THROW_NS_IF_FAILED(
-        ABI::Windows::Foundation::GetActivationFactory(HString::MakeReference(L"Windows.Foundation.PropertyValue").Get(), &inst));
+    ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> inst = propertyValueCreator();
     ComPtr<IInspectable> ret;
     const char* type = [obj objCType];
-    if (strstr("cC", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateUInt8(ToWRLConvertor<uint8_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
-    }
-
-    if (strstr("il", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateInt32(ToWRLConvertor<int32_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
-    }
-
-    if (strstr("s", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateInt16(ToWRLConvertor<int16_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
-    }
-
-    if (strstr("q", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateInt64(ToWRLConvertor<int64_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
+    if (type[0] == '\0' || type[1] != '\0') {
+        return nullptr;
     }
-
-    if (strstr("IL", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateUInt32(ToWRLConvertor<uint32_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
+    switch (type[0]) {
+        case 'c':
+        case 'C':
+            THROW_NS_IF_FAILED(inst->CreateUInt8(ToWRLConvertor<uint8_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'i':
+        case 'l':
+            THROW_NS_IF_FAILED(inst->CreateInt32(ToWRLConvertor<int32_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 's':
+            THROW_NS_IF_FAILED(inst->CreateInt16(ToWRLConvertor<int16_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'q':
+            THROW_NS_IF_FAILED(inst->CreateInt64(ToWRLConvertor<int64_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'I':
+        case 'L':
+            THROW_NS_IF_FAILED(inst->CreateUInt32(ToWRLConvertor<uint32_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'S':
+            THROW_NS_IF_FAILED(inst->CreateUInt16(ToWRLConvertor<uint16_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'Q':
+            THROW_NS_IF_FAILED(inst->CreateUInt64(ToWRLConvertor<uint64_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'f':
+            THROW_NS_IF_FAILED(inst->CreateSingle(ToWRLConvertor<float, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        case 'd':
+            THROW_NS_IF_FAILED(inst->CreateDouble(ToWRLConvertor<double, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
+            return ret;
+        default:
+            return nullptr;
     }
+}
 
-    if (strstr("S", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateUInt16(ToWRLConvertor<uint16_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
+// See `RTBuffers.h`.
+NSData* convertWinRTBufferToNSData(ComPtr<ABI::Windows::Storage::Streams::IBuffer> buffer) {
+    if (buffer == nullptr) {
+        return nil;
     }
-
-    if (strstr("Q", type) != NULL) {
-        THROW_NS_IF_FAILED(inst->CreateUInt64(ToWRLConvertor<uint64_t, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
+    ComPtr<INSDataBuffer> dataBuffer;
+    if (SUCCEEDED(buffer.As(&dataBuffer))) {
+        return [[dataBuffer->data() retain] autorelease];
     }
+    return [[[RTBufferData alloc] initWithBuffer:buffer] autorelease];
+}
 
-    if (strcmp("f", type) == 0) {
-        THROW_NS_IF_FAILED(inst->CreateSingle(ToWRLConvertor<float, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
+ComPtr<ABI::Windows::Storage::Streams::IBuffer> convertNSDataToWinRTBuffer(NSData* data) {
+    if (data == nil) {
+        return nullptr;
     }
-
-    if (strcmp("d", type) == 0) {
-        THROW_NS_IF_FAILED(inst->CreateDouble(ToWRLConvertor<double, dummyWRLCreator>::convert(obj), ret.GetAddressOf()));
-        return ret;
+    if ([data isKindOfClass:[RTBufferData class]]) {
+        return static_cast<RTBufferData*>(data)->_buffer;
     }
-
-    return nullptr;
+    ComPtr<NSDataBuffer> buffer;
+    THROW_NS_IF_FAILED(Microsoft::WRL::MakeAndInitialize<NSDataBuffer>(&buffer, data));
+    ComPtr<ABI::Windows::Storage::Streams::IBuffer> ret;
+    THROW_NS_IF_FAILED(buffer.As(&ret));
+    return ret;
 }
 
 ComPtr<IInspectable> convertNSStringToPropertyValue(NSString* obj) {
-    ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> inst;
-    THROW_NS_IF_FAILED(
-        ABI::Windows::Foundation::GetActivationFactory(HString::MakeReference(L"Windows.Foundation.PropertyValue").Get(), &inst));
+    ComPtr<ABI::Windows::Foundation::IPropertyValueStatics> inst = propertyValueCreator();
     ComPtr<IInspectable> ret;
-    Microsoft::WRL::Wrappers::HString hstr;
-    hstr.Attach(ToWRLConvertor<HSTRING, dummyWRLCreator>::convert(obj));
+    StringReference hstr(obj);
     THROW_NS_IF_FAILED(inst->CreateString(hstr.Get(), ret.GetAddressOf()));
     return ret;
 }
 } // namespace CommonConvertors
+
+@implementation RTPropertySetDictionary
+- (instancetype)initWithMapView:(ComPtr<IMapView<HSTRING, IInspectable*>>)map {
+    if (self = [super init]) {
+        unsigned int size;
+        THROW_NS_IF_FAILED(map->get_Size(&size));
+        NSMutableArray* keys = [NSMutableArray arrayWithCapacity:size];
+        NSMutableDictionary* indices = [NSMutableDictionary dictionaryWithCapacity:size];
+        _objects.reserve(size);
+
+        ComPtr<IIterable<IKeyValuePair<HSTRING, IInspectable*>*>> iterable;
+        ComPtr<IIterator<IKeyValuePair<HSTRING, IInspectable*>*>> iterator;
+        THROW_NS_IF_FAILED(map.As(&iterable));
+        THROW_NS_IF_FAILED(iterable->First(&iterator));
+        boolean hasCurrent = false;
+        THROW_NS_IF_FAILED(iterator->get_HasCurrent(&hasCurrent));
+        while (hasCurrent) {
+            ComPtr<IKeyValuePair<HSTRING, IInspectable*>> kvp;
+            THROW_NS_IF_FAILED(iterator->get_Current(&kvp));
+            HSTRING keyHstr;
+            THROW_NS_IF_FAILED(kvp->get_Key(&keyHstr));
+            NSString* key = hstrToNSStr(keyHstr, true);
+            ComPtr<IInspectable> obj;
+            THROW_NS_IF_FAILED(kvp->get_Value(obj.GetAddressOf()));
+            [indices setObject:@(_objects.size()) forKey:key];
+            [keys addObject:key];
+            _objects.emplace_back(std::move(obj));
+            THROW_NS_IF_FAILED(iterator->MoveNext(&hasCurrent));
+        }
+
+        _keys = keys;
+        _indices = indices;
+        _values.attach([[NSMutableDictionary alloc] init]);
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    return [_keys count];
+}
+
+- (id)objectForKey:(id)key {
+    NSNumber* index = [_indices objectForKey:key];
+    if (index == nil) {
+        return nil;
+    }
+    std::lock_guard<std::mutex> lock(_valuesMutex);
+    id value = [_values objectForKey:key];
+    if (value != nil) {
+        return value;
+    }
+    value = CommonConvertors::_convertPropertySetValueToObjC(_objects[[index unsignedIntegerValue]]);
+    if (value != nil) {
+        [_values setObject:value forKey:key];
+    }
+    return value;
+}
+
+- (NSEnumerator*)keyEnumerator {
+    return [_keys objectEnumerator];
+}
+@end
@@ -0,0 +1,95 @@
+// RTAsync.h: Delivering completion of WinRT async operations to dispatch
+// queues.
+
+#pragma once
+
+#import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
+
+#include <Windows.Foundation.h>
+#include <wrl/client.h>
+#include <wrl/event.h>
+
+#include <type_traits>
+
+namespace RTAsync {
+// Error reported to completion blocks of canceled operations.
+constexpr HRESULT Canceled = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+
+// Failure code of a completed async operation with `status`.
+inline HRESULT errorCode(IInspectable* operation, AsyncStatus status) {
+    if (status == AsyncStatus::Completed) {
+        return S_OK;
+    }
+    if (status == AsyncStatus::Canceled) {
+        return Canceled;
+    }
+    Microsoft::WRL::ComPtr<ABI::Windows::Foundation::IAsyncInfo> info;
+    HRESULT hr = E_FAIL;
+    if (SUCCEEDED(operation->QueryInterface(IID_PPV_ARGS(&info)))) {
+        info->get_ErrorCode(&hr);
+    }
+    return FAILED(hr) ? hr : E_FAIL;
+}
+
+// Results are owned by the completion block only for its duration. Interface
+// pointers are matched by conversion, so a single template is used (an
+// overload taking `IUnknown*` would lose to a generic one taking `const T&`).
+template <typename T>
+inline void releaseResult(const T& result) {
+    if constexpr (std::is_convertible_v<T, IUnknown*>) {
+        if (result) {
+            result->Release();
+        }
+    } else if constexpr (std::is_same_v<T, HSTRING>) {
+        WindowsDeleteString(result);
+    }
+}
+} // namespace RTAsync
+
+// Calls `completion` on `queue` once `action` completes (with `S_OK` or the
+// failure code). Unlike waiting for the action, this returns immediately, so
+// guest code calling asynchronous WinRT APIs never holds up emulation.
+OBJCWINRT_EXPORT void dispatchAsyncAction(ABI::Windows::Foundation::IAsyncAction* action,
+                                          dispatch_queue_t queue,
+                                          void (^completion)(HRESULT));
+
+// Like `dispatchAsyncAction`, but `completion` also receives the operation's
+// result (a default value if it failed). The result is released after the
+// block returns, so the block must retain (or convert) it to keep it.
+template <typename TResult>
+void dispatchAsyncOperation(ABI::Windows::Foundation::IAsyncOperation<TResult>* operation,
+                            dispatch_queue_t queue,
+                            void (^completion)(HRESULT,
+                                               typename ABI::Windows::Foundation::Internal::GetAbiType<
+                                                   typename ABI::Windows::Foundation::IAsyncOperation<TResult>::TResult_complex>::type)) {
+    using namespace ABI::Windows::Foundation;
+    using TAbi = typename Internal::GetAbiType<typename IAsyncOperation<TResult>::TResult_complex>::type;
+
+    auto block = Block_copy(completion);
+    dispatch_retain(queue);
+    auto handler = Microsoft::WRL::Callback<IAsyncOperationCompletedHandler<TResult>>(
+        [queue, block](IAsyncOperation<TResult>* op, AsyncStatus status) -> HRESULT {
+            // The operation has completed, so getting its results doesn't block.
+            HRESULT hr = RTAsync::errorCode(op, status);
+            TAbi result{};
+            if (SUCCEEDED(hr)) {
+                hr = op->GetResults(&result);
+            }
+            dispatch_async(queue, ^{
+                block(hr, result);
+                RTAsync::releaseResult(result);
+                Block_release(block);
+            });
+            dispatch_release(queue);
+            return S_OK;
+        });
+    HRESULT hr = handler ? operation->put_Completed(handler.Get()) : E_OUTOFMEMORY;
+    if (FAILED(hr)) {
+        dispatch_async(queue, ^{
+            block(hr, TAbi{});
+            Block_release(block);
+        });
+        dispatch_release(queue);
+    }
+}
@@ -0,0 +1,31 @@
+// RTAsync.mm: Implementation of `dispatchAsyncAction`.
+
+#import "RTAsync.h"
+
+using namespace ABI::Windows::Foundation;
+using namespace Microsoft::WRL;
+
+void dispatchAsyncAction(IAsyncAction* action, dispatch_queue_t queue, void (^completion)(HRESULT)) {
+    auto block = Block_copy(completion);
+    dispatch_retain(queue);
+    auto handler = Callback<IAsyncActionCompletedHandler>([queue, block](IAsyncAction* op, AsyncStatus status) -> HRESULT {
+        HRESULT hr = RTAsync::errorCode(op, status);
+        if (SUCCEEDED(hr)) {
+            hr = op->GetResults();
+        }
+        dispatch_async(queue, ^{
+            block(hr);
+            Block_release(block);
+        });
+        dispatch_release(queue);
+        return S_OK;
+    });
+    HRESULT hr = handler ? action->put_Completed(handler.Get()) : E_OUTOFMEMORY;
+    if (FAILED(hr)) {
+        dispatch_async(queue, ^{
+            block(hr);
+            Block_release(block);
+        });
+        dispatch_release(queue);
+    }
+}
@@ -0,0 +1,21 @@
+// RTBuffers.h: Sharing bytes of NSData with WinRT buffers.
+
+#pragma once
+
+#import <Foundation/Foundation.h>
+
+#include <windows.storage.streams.h>
+#include <wrl/client.h>
+
+namespace CommonConvertors {
+// Wraps `buffer` in an immutable NSData without copying its bytes. The NSData
+// keeps the buffer alive. Buffers created by `convertNSDataToWinRTBuffer` are
+// unwrapped back to their NSData.
+OBJCWINRT_EXPORT NSData* convertWinRTBufferToNSData(Microsoft::WRL::ComPtr<ABI::Windows::Storage::Streams::IBuffer> buffer);
+
+// Exposes bytes of `data` as an `IBuffer`, which retains it. Bytes of
+// NSMutableData are shared, immutable NSData is copied once WinRT asks for
+// writable bytes (see `IBufferByteAccess::Buffer`). NSData created by
+// `convertWinRTBufferToNSData` is unwrapped back to its buffer.
+OBJCWINRT_EXPORT Microsoft::WRL::ComPtr<ABI::Windows::Storage::Streams::IBuffer> convertNSDataToWinRTBuffer(NSData* data);
+} // namespace CommonConvertors
@@ -19,8 +19,58 @@
 #import <Foundation/Foundation.h>
 #import <Starboard.h>
 
+#include <algorithm>
+
 using namespace Microsoft::WRL;
 
+namespace {
+// Fills the enumeration buffer straight from the array adapter of an
+// `RTProxied*Array`. Unlike `fastEnumArrayImpl`, this doesn't send `count` and
+// `objectAtIndex:` messages for every chunk and element, only the adapter's
+// own calls are made.
+template <typename TAdapter>
+NSUInteger fastEnumAdapterImpl(TAdapter& adapter, NSFastEnumerationState* state, id* buffer, NSUInteger len) {
+    NSUInteger first = state->state;
+    if (first == 0) {
+        state->itemsPtr = buffer;
+        state->mutationsPtr = &state->extra[0];
+    }
+
+    // The size is read once per chunk, so that mutations are noticed like in
+    // `fastEnumArrayImpl`.
+    NSUInteger arrayLen = adapter.count();
+    NSUInteger count = first < arrayLen ? std::min(len, arrayLen - first) : 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        buffer[i] = adapter.objectAtIndex(first + i);
+    }
+
+    state->state = first + count;
+    return count;
+}
+
+// Replaces elements in `range` of a proxied mutable array with `objects`.
+// Overlapping elements are replaced in place and only the difference is
+// inserted or removed (from the back), so that bulk updates need as few vector
+// operations and change notifications as possible.
+template <typename TAdapter>
+void replaceAdapterRange(TAdapter& adapter, NSRange range, NSArray* objects) {
+    if (range.location + range.length > adapter.count()) {
+        THROW_NS_HR(E_BOUNDS);
+    }
+    NSUInteger count = [objects count];
+    NSUInteger common = std::min(count, range.length);
+    for (NSUInteger i = 0; i < common; i++) {
+        adapter.replaceObjectAtIndexWithObject(range.location + i, [objects objectAtIndex:i]);
+    }
+    for (NSUInteger i = common; i < count; i++) {
+        adapter.insertObjectAtIndex([objects objectAtIndex:i], range.location + i);
+    }
+    for (NSUInteger i = range.length; i > common; i--) {
+        adapter.removeObjectAtIndex(range.location + i - 1);
+    }
+}
+} // namespace
+
 NSUInteger fastEnumArrayImpl(id self, NSFastEnumerationState* state, id* buffer, NSUInteger len) {
     NSUInteger count = 0;
     NSUInteger first = state->state;
@@ -71,6 +121,13 @@ NSUInteger fastEnumIteratorImpl(id self, NSFastEnumerationState* state, id* buff
 }
 
 UINT32 SizeByEnumeration(id<NSFastEnumeration> obj) {
+    // Collections usually know their size (proxied WinRT collections ask
+    // `IVectorView::get_Size` or `IMapView::get_Size`), only opaque iterables
+    // must be enumerated.
+    if ([(id)obj respondsToSelector:@selector(count)]) {
+        return (UINT32)[(id)obj count];
+    }
+
     NSFastEnumerationState state = { 0 };
     UINT32 totalCount = 0;
     id items[16] = { 0 };
@@ -164,7 +221,7 @@ void getPropertyValueArrayInfo(ComPtr<IPropertyValue> comPtr, unsigned int& res,
 
 @implementation RTProxiedNSArrayFull
 - (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState*)state objects:(id __unsafe_unretained[])buffer count:(NSUInteger)len {
-    return fastEnumArrayImpl(self, state, buffer, len);
+    return fastEnumAdapterImpl(*adapter, state, buffer, len);
 }
 @end
 
@@ -215,10 +272,43 @@ void getPropertyValueArrayInfo(ComPtr<IPropertyValue> comPtr, unsigned int& res,
 - (void)replaceObjectAtIndex:(NSUInteger)idx withObject:(id)obj {
     adapter->replaceObjectAtIndexWithObject(idx, obj);
 }
+
+- (void)addObjectsFromArray:(NSArray*)array {
+    for (id obj in array) {
+        adapter->appendObject(obj);
+    }
+}
+
+- (void)removeAllObjects {
+    replaceAdapterRange(*adapter, NSMakeRange(0, adapter->count()), nil);
+}
+
+- (void)setArray:(NSArray*)array {
+    replaceAdapterRange(*adapter, NSMakeRange(0, adapter->count()), array);
+}
+
+- (void)replaceObjectsInRange:(NSRange)range withObjectsFromArray:(NSArray*)array {
+    replaceAdapterRange(*adapter, range, array);
+}
 @end
 
 @implementation RTProxiedObservableNSMutableArray {
     StrongId<ListenerMgr> _mgr;
+    // Bulk mutations in progress and whether any of them raised a change.
+    // Observers are then notified once with a reset (see `endBatch`).
+    NSUInteger _batchDepth;
+    BOOL _batchChanged;
+}
+
+- (void)beginBatch {
+    _batchDepth++;
+}
+
+- (void)endBatch {
+    if (--_batchDepth == 0 && _batchChanged) {
+        _batchChanged = NO;
+        [_mgr notify:RTCollectionOperationReset value:[NSNumber numberWithUnsignedInt:0]];
+    }
 }
 
 - (ComPtr<IInspectable>)getInternalComObj {
@@ -269,6 +359,29 @@ void getPropertyValueArrayInfo(ComPtr<IPropertyValue> comPtr, unsigned int& res,
     adapter->replaceObjectAtIndexWithObject(idx, obj);
 }
 
+- (void)addObjectsFromArray:(NSArray*)array {
+    [self replaceObjectsInRange:NSMakeRange(adapter->count(), 0) withObjectsFromArray:array];
+}
+
+- (void)removeAllObjects {
+    [self replaceObjectsInRange:NSMakeRange(0, adapter->count()) withObjectsFromArray:nil];
+}
+
+- (void)setArray:(NSArray*)array {
+    [self replaceObjectsInRange:NSMakeRange(0, adapter->count()) withObjectsFromArray:array];
+}
+
+- (void)replaceObjectsInRange:(NSRange)range withObjectsFromArray:(NSArray*)array {
+    [self beginBatch];
+    try {
+        replaceAdapterRange(*adapter, range, array);
+    } catch (...) {
+        [self endBatch];
+        throw;
+    }
+    [self endBatch];
+}
+
 - (void)registerSelf {
     adapter->registerSelf(self);
 }
@@ -286,6 +399,10 @@ void getPropertyValueArrayInfo(ComPtr<IPropertyValue> comPtr, unsigned int& res,
 }
 
 - (void)notify:(RTCollectionOperation)op at:(unsigned int)idx {
+    if (_batchDepth != 0) {
+        _batchChanged = YES;
+        return;
+    }
     [_mgr notify:op value:[NSNumber numberWithUnsignedInt:idx]];
 }
 @end
@@ -385,7 +502,7 @@ void getPropertyValueArrayInfo(ComPtr<IPropertyValue> comPtr, unsigned int& res,
 
 @implementation RTProxiedNSMutableArrayFull
 - (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState*)state objects:(id __unsafe_unretained[])buffer count:(NSUInteger)len {
-    return fastEnumArrayImpl(self, state, buffer, len);
+    return fastEnumAdapterImpl(*adapter, state, buffer, len);
 }
 @end
 
@@ -428,7 +545,7 @@ void getPropertyValueArrayInfo(ComPtr<IPropertyValue> comPtr, unsigned int& res,
 
 @implementation RTProxiedIterableNSArrayFull
 - (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState*)state objects:(id __unsafe_unretained[])buffer count:(NSUInteger)len {
-    return fastEnumArrayImpl(self, state, buffer, len);
+    return fastEnumAdapterImpl(*adapter, state, buffer, len);
 }
 @end
 
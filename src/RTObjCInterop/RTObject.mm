@@ -22,6 +22,98 @@
 #include <Windows.Foundation.h>
 
 #import <Starboard.h>
+#import <objc/runtime.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace {
+// Weak map from COM identity (the object's `IUnknown`) and wrapper class to
+// the live ObjC wrapper, so that the same WinRT object marshaled repeatedly
+// gets the same wrapper instead of a new allocation each time. Entries don't
+// keep wrappers alive. The identity pointer cannot be reused while its wrapper
+// lives, because the wrapper holds a reference to the COM object.
+class WrapperCache {
+public:
+    template <typename TCreate>
+    id get(IInspectable* obj, Class cls, TCreate&& create) {
+        ComPtr<IUnknown> identity;
+        if (FAILED(obj->QueryInterface(IID_PPV_ARGS(&identity)))) {
+            return create();
+        }
+        Key key(identity.Get(), cls);
+        if (id wrapper = find(key)) {
+            return wrapper;
+        }
+
+        // The wrapper is created without the lock held, since creating it can
+        // marshal other objects.
+        id wrapper = create();
+        if (wrapper == nil) {
+            return nil;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(key);
+        if (it != _entries.end()) {
+            // Another thread might have been faster.
+            if (id existing = objc_loadWeak(&it->second->wrapper)) {
+                return existing;
+            }
+        } else {
+            // Dead entries are dropped when the map grows, so that it stays
+            // proportional to the number of live wrappers.
+            if (_entries.size() >= _sweepAt) {
+                sweep();
+            }
+            it = _entries.emplace(key, std::make_unique<Entry>()).first;
+        }
+        objc_storeWeak(&it->second->wrapper, wrapper);
+        return wrapper;
+    }
+
+private:
+    using Key = std::pair<IUnknown*, Class>;
+    struct Entry {
+        id wrapper = nil;
+        Entry() = default;
+        Entry(const Entry&) = delete;
+        ~Entry() {
+            objc_storeWeak(&wrapper, nil);
+        }
+    };
+
+    id find(const Key& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(key);
+        return it != _entries.end() ? objc_loadWeak(&it->second->wrapper) : nil;
+    }
+
+    void sweep() {
+        for (auto it = _entries.begin(); it != _entries.end();) {
+            if (objc_loadWeak(&it->second->wrapper) == nil) {
+                it = _entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _sweepAt = std::max<size_t>(64, _entries.size() * 2);
+    }
+
+    std::mutex _mutex;
+    // Entries are allocated separately, since weak references must not move.
+    std::map<Key, std::unique_ptr<Entry>> _entries;
+    size_t _sweepAt = 64;
+};
+
+WrapperCache& wrapperCache() {
+    static WrapperCache cache;
+    return cache;
+}
+} // namespace
 
 @implementation RTObject
 + (instancetype)alloc {
@@ -32,7 +124,7 @@
 
 + (instancetype)createWith:(IInspectable*)obj {
     // We need to do no checking here since we're just mimicing a base object. The real testing happens in derived classes.
-    return _createBareRTObj(obj);
+    return wrapperCache().get(obj, self, [obj]() { return _createBareRTObj(obj); });
 }
 
 @end
@@ -51,5 +143,6 @@ id rt_dynamic_cast(Class classType, RTObject* rtObject) {
         THROW_NS_HR_MSG(E_UNEXPECTED, "Underlying COM object is NULL");
     }
 
-    return [classType createWith:[rtObject comObj].Get()];
+    IInspectable* obj = [rtObject comObj].Get();
+    return wrapperCache().get(obj, classType, [classType, obj]() { return [classType createWith:obj]; });
 }
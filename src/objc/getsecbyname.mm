@@ -9,6 +9,14 @@
  */
 #ifndef __LP64__
 
+// Lookups are answered by `IpaSimLibrary`, which indexes sections of every
+// image only once (see `SectionTable`).
+extern "C" uint8_t *ipaSim_getSectionData(const void *Hdr, const char *SegName,
+                                          const char *SectName,
+                                          unsigned long *Size);
+extern "C" uint8_t *ipaSim_getSegmentData(const void *Hdr, const char *SegName,
+                                          unsigned long *Size);
+
 uint8_t * 
 getsectiondata(
 const struct mach_header *mhp,
@@ -16,39 +24,7 @@ const char *segname,
 const char *sectname,
 unsigned long *size)
 {
-    struct segment_command *sgp;
-    struct section *sp;
-    uint32_t i, j;
-    intptr_t slide;
-    
-	slide = 0;
-	sp = 0;
-	sgp = (struct segment_command *)
-	      ((char *)mhp + sizeof(struct mach_header));
-	for(i = 0; i < mhp->ncmds; i++){
-	    if(sgp->cmd == LC_SEGMENT){
-		if(strcmp(sgp->segname, "__TEXT") == 0){
-		    slide = (uintptr_t)mhp - sgp->vmaddr;
-		}
-		if(strncmp(sgp->segname, segname, sizeof(sgp->segname)) == 0){
-		    sp = (struct section *)((char *)sgp +
-			 sizeof(struct segment_command));
-		    for(j = 0; j < sgp->nsects; j++){
-			if(strncmp(sp->sectname, sectname,
-			   sizeof(sp->sectname)) == 0 &&
-			   strncmp(sp->segname, segname,
-			   sizeof(sp->segname)) == 0){
-			    *size = sp->size;
-			    return((uint8_t *)(sp->addr) + slide);
-			}
-			sp = (struct section *)((char *)sp +
-			     sizeof(struct section));
-		    }
-		}
-	    }
-	    sgp = (struct segment_command *)((char *)sgp + sgp->cmdsize);
-	}
-	return(0);
+	return ipaSim_getSectionData(mhp, segname, sectname, size);
 }
 
 uint8_t * 
@@ -57,26 +33,7 @@ const struct mach_header *mhp,
 const char *segname,
 unsigned long *size)
 {
-    struct segment_command *sgp;
-    intptr_t slide;
-    uint32_t i;
-
-	slide = 0;
-	sgp = (struct segment_command *)
-	      ((char *)mhp + sizeof(struct mach_header));
-	for(i = 0; i < mhp->ncmds; i++){
-	    if(sgp->cmd == LC_SEGMENT){
-		if(strcmp(sgp->segname, "__TEXT") == 0){
-		    slide = (uintptr_t)mhp - sgp->vmaddr;
-		}
-		if(strncmp(sgp->segname, segname, sizeof(sgp->segname)) == 0){
-		    *size = sgp->vmsize;
-		    return((uint8_t *)(sgp->vmaddr + slide));
-		}
-	    }
-	    sgp = (struct segment_command *)((char *)sgp + sgp->cmdsize);
-	}
-	return(0);
+	return ipaSim_getSegmentData(mhp, segname, size);
 }
 
 #else /* defined(__LP64__) */
@@ -0,0 +1,150 @@
+// Runtime locks built on native Windows primitives (see `[srw-locks]` in
+// `README.md`).
+//
+// objc4 calls these `mutex_t`, `rwlock_t` and `recursive_mutex_t`. On macOS,
+// they are `os_unfair_lock`s and pthread rwlocks. pthreads-win32 implements
+// those with several kernel objects and extra bookkeeping, so instead, all of
+// them are `SRWLOCK`s here. These are pointer-sized, statically initialized and
+// only enter the kernel when contended.
+//
+// Each lock first tries to get acquired without blocking. If that fails, the
+// contention is counted (see `objc_lock_stats`) before the thread blocks.
+
+#ifndef _OBJC_IPASIM_LOCKS_H
+#define _OBJC_IPASIM_LOCKS_H
+
+#include <windows.h>
+
+// Called when a lock couldn't be acquired without blocking.
+void objc_lock_contended();
+// Calls `_objc_fatal`, which cannot be declared here.
+[[noreturn]] void objc_lock_fatal(const char *msg);
+
+class objc_srw_mutex {
+    SRWLOCK srw;
+
+public:
+    constexpr objc_srw_mutex() : srw(SRWLOCK_INIT) { }
+    objc_srw_mutex(const objc_srw_mutex &) = delete;
+
+    void lock() {
+        if (!TryAcquireSRWLockExclusive(&srw)) {
+            objc_lock_contended();
+            AcquireSRWLockExclusive(&srw);
+        }
+    }
+    bool tryLock() { return TryAcquireSRWLockExclusive(&srw); }
+    void unlock() { ReleaseSRWLockExclusive(&srw); }
+
+    void forceReset() { srw = SRWLOCK_INIT; }
+
+    // `SRWLOCK`s don't know their owner, so these cannot check anything.
+    void assertLocked() { }
+    void assertUnlocked() { }
+};
+
+class objc_srw_rwlock {
+    SRWLOCK srw;
+
+public:
+    constexpr objc_srw_rwlock() : srw(SRWLOCK_INIT) { }
+    objc_srw_rwlock(const objc_srw_rwlock &) = delete;
+
+    void read() {
+        if (!TryAcquireSRWLockShared(&srw)) {
+            objc_lock_contended();
+            AcquireSRWLockShared(&srw);
+        }
+    }
+    bool tryRead() { return TryAcquireSRWLockShared(&srw); }
+    void unlockRead() { ReleaseSRWLockShared(&srw); }
+
+    void write() {
+        if (!TryAcquireSRWLockExclusive(&srw)) {
+            objc_lock_contended();
+            AcquireSRWLockExclusive(&srw);
+        }
+    }
+    bool tryWrite() { return TryAcquireSRWLockExclusive(&srw); }
+    void unlockWrite() { ReleaseSRWLockExclusive(&srw); }
+
+    void forceReset() { srw = SRWLOCK_INIT; }
+
+    void assertReading() { }
+    void assertWriting() { }
+    void assertLocked() { }
+    void assertUnlocked() { }
+};
+
+// `SRWLOCK`s are not recursive, so the owner and depth are tracked here. Only
+// the owner ever writes them, so other threads can read `owner` racily: it's
+// either some other thread's ID or `0`, never theirs.
+class objc_srw_recursive_mutex {
+    SRWLOCK srw;
+    volatile DWORD owner;
+    unsigned depth;
+
+public:
+    constexpr objc_srw_recursive_mutex()
+        : srw(SRWLOCK_INIT), owner(0), depth(0) { }
+    objc_srw_recursive_mutex(const objc_srw_recursive_mutex &) = delete;
+
+    void lock() {
+        DWORD self = GetCurrentThreadId();
+        if (owner == self) {
+            depth++;
+            return;
+        }
+        if (!TryAcquireSRWLockExclusive(&srw)) {
+            objc_lock_contended();
+            AcquireSRWLockExclusive(&srw);
+        }
+        owner = self;
+        depth = 1;
+    }
+    bool tryLock() {
+        DWORD self = GetCurrentThreadId();
+        if (owner == self) {
+            depth++;
+            return true;
+        }
+        if (!TryAcquireSRWLockExclusive(&srw)) return false;
+        owner = self;
+        depth = 1;
+        return true;
+    }
+    void unlock() {
+        if (owner != GetCurrentThreadId()) {
+            objc_lock_fatal("recursive_mutex_t unlocked by a non-owner");
+        }
+        if (--depth == 0) {
+            owner = 0;
+            ReleaseSRWLockExclusive(&srw);
+        }
+    }
+    // Returns `false` if the calling thread doesn't own the lock.
+    bool tryUnlock() {
+        if (owner != GetCurrentThreadId()) return false;
+        unlock();
+        return true;
+    }
+
+    void forceReset() {
+        srw = SRWLOCK_INIT;
+        owner = 0;
+        depth = 0;
+    }
+
+    void assertLocked() {
+        if (owner != GetCurrentThreadId()) {
+            objc_lock_fatal("recursive_mutex_t incorrectly not locked");
+        }
+    }
+    void assertUnlocked() {
+        if (owner == GetCurrentThreadId()) {
+            objc_lock_fatal("recursive_mutex_t incorrectly locked");
+        }
+    }
+};
+
+#endif
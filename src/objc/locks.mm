@@ -0,0 +1,25 @@
+// See `locks.h`.
+
+#include "..\..\deps\objc4\runtime\objc-private.h"
+
+#include <atomic>
+
+// Only incremented on the slow path, so it can afford to be atomic.
+static std::atomic<uint64_t> lock_contentions;
+
+void objc_lock_contended()
+{
+    lock_contentions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void objc_lock_fatal(const char *msg)
+{
+    _objc_fatal("%s", msg);
+}
+
+// Reports how many times runtime locks (e.g., `runtimeLock` or
+// `cacheUpdateLock`) had to wait for another thread.
+OBJC_EXPORT void objc_lock_stats(uint64_t *contentions)
+{
+    *contentions = lock_contentions.load(std::memory_order_relaxed);
+}
@@ -2,6 +2,11 @@
 
 #include "..\..\deps\objc4\runtime\objc-private.h"
 
+#include <atomic>
+#include <dlfcn.h>
+
+// Never called, `IpaSimulator` binds `dyld_stub_binder` to its own handler (see
+// `DynamicLoader::getStubBinderAddr`).
 OBJC_EXPORT void dyld_stub_binder() { assert(false); }
 
 // The original is in libobjc2/arc.mm.
@@ -180,13 +185,96 @@ static const char *alignof_type(const char *type, size_t *align)
 	abort();
 	return NULL;
 }
-OBJC_EXPORT size_t objc_alignof_type (const char *type)
+static const char *sizeof_type(const char *type, size_t *size);
+
+// Layouts computed by `objc_sizeof_type`, `objc_alignof_type` and
+// `objc_skip_typespec` are cached, since `NSMethodSignature`, `NSInvocation`
+// and KVC ask about the same encodings over and over. The cache is keyed by
+// the encoding's address and lock-free: slots are claimed with a CAS and never
+// overwritten, so readers see either an empty slot or a complete entry.
+// Encodings inside loaded images (method lists, `@encode`) stay put, so a hit
+// on their address is enough. Others need not be static, so their entries also
+// remember a hash of the encoding, checked on each hit, so that a different
+// string reusing the same address is never mistaken for the cached one. When
+// all probed slots are taken, layouts are simply computed.
+struct type_layout
+{
+	const char *end;
+	size_t size;  // In bytes
+	size_t align; // In bytes
+};
+struct type_layout_slot
 {
-	size_t align = 0;
+	std::atomic<unsigned> state; // 0 = empty, 1 = being filled, 2 = ready
+	const char *type;
+	bool in_image; // If not, `hash` must match
+	uint64_t hash;
+	type_layout layout;
+};
+static const size_t type_layout_slots = 1024;
+static const size_t type_layout_probes = 4;
+static type_layout_slot type_layouts[type_layout_slots];
+
+static uint64_t hash_type(const char *type, const char *end)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (; type != end; type++)
+	{
+		hash = (hash ^ (unsigned char)*type) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static type_layout compute_type_layout(const char *type)
+{
+	size_t size = 0, align = 0;
+	type_layout layout;
+	layout.end = sizeof_type(type, &size);
 	alignof_type(type, &align);
-	return align / 8;
+	layout.size = size / 8;
+	layout.align = align / 8;
+	return layout;
+}
+
+static type_layout get_type_layout(const char *type)
+{
+	size_t index = ((uintptr_t)type >> 2) * 2654435761U;
+	type_layout_slot *free_slot = NULL;
+	for (size_t i = 0; i < type_layout_probes; i++)
+	{
+		type_layout_slot &slot = type_layouts[(index + i) % type_layout_slots];
+		unsigned state = slot.state.load(std::memory_order_acquire);
+		if (state == 2 && slot.type == type && (slot.in_image ||
+			slot.hash == hash_type(type, slot.layout.end)))
+		{
+			return slot.layout;
+		}
+		if (state == 0 && !free_slot)
+		{
+			free_slot = &slot;
+		}
+	}
+
+	type_layout layout = compute_type_layout(type);
+	unsigned expected = 0;
+	if (free_slot && free_slot->state.compare_exchange_strong(expected, 1,
+			std::memory_order_acquire))
+	{
+		Dl_info info;
+		free_slot->type = type;
+		free_slot->in_image = dladdr(type, &info) != 0;
+		free_slot->hash = free_slot->in_image ? 0 : hash_type(type, layout.end);
+		free_slot->layout = layout;
+		free_slot->state.store(2, std::memory_order_release);
+	}
+	return layout;
+}
+
+OBJC_EXPORT size_t objc_alignof_type (const char *type)
+{
+	return get_type_layout(type).align;
 }
-static const char *sizeof_type(const char *type, size_t *size);
 static const char *sizeof_union_field(const char *type, size_t *size)
 {
 	size_t field_size = 0;
@@ -242,8 +330,10 @@ static const char *sizeof_type(const char *type, size_t *size)
 		{
 			const char *t = type;
 			parse_struct(&t, (type_parser)sizeof_type, size);
-			size_t align = objc_alignof_type(type);
-			round_up(size, align * 8);
+			// Not `objc_alignof_type`, it would recurse through the cache.
+			size_t align = 0;
+			alignof_type(type, &align);
+			round_up(size, align);
 			return t;
 		}
 		case '[':
@@ -289,14 +379,11 @@ static const char *sizeof_type(const char *type, size_t *size)
 }
 OBJC_EXPORT const char *objc_skip_typespec(const char *type)
 {
-	size_t ignored = 0;
-	return sizeof_type(type, &ignored);
+	return get_type_layout(type).end;
 }
 OBJC_EXPORT size_t objc_sizeof_type(const char *type)
 {
-	size_t size = 0;
-	sizeof_type(type, &size);
-	return size / 8;
+	return get_type_layout(type).size;
 }
 OBJC_EXPORT size_t objc_aligned_size(const char *type)
 {
@@ -310,13 +397,56 @@ OBJC_EXPORT size_t objc_aligned_size(const char *type)
 // TODO: From obj-abi.h on `objc_msgLookup` and related:
 // "These are not callable C functions. Do not call them directly."
 // Maybe just modify WinObjC so that it doesn't use this.
-OBJC_EXPORT IMP objc_msg_lookup(id self, SEL _cmd) {
+//
+// Every guest message send ends up here, so hits are served by probing the
+// method cache with `cache_getImp` first, without locks. Only misses (and `nil`
+// receivers) go to the full messengers. The probe must not be done in C: the
+// runtime frees replaced buckets once no thread is inside a cache-reading
+// function (see `_collecting_in_critical`), and only the assembly ones listed in
+// `objc_entryPoints` count. `cache_getImp` is one of them.
+//
+// Hits and misses are counted for `ipaSim_getStats` (see
+// `objc_msg_lookup_stats`). Lookups run on any thread, so the counters are
+// atomic. Their increments are lock-free as well and need no ordering, hence
+// they are relaxed.
+static std::atomic<uint64_t> msg_lookup_hits, msg_lookup_misses;
+
+// Slow paths are kept out of line, so that the fast paths stay compact.
+static __attribute__((noinline)) IMP msg_lookup_slow(id self, SEL _cmd) {
+    msg_lookup_misses.fetch_add(1, std::memory_order_relaxed);
     return reinterpret_cast<IMP (*)(id, SEL)>(objc_msgLookup)(self, _cmd);
 }
-OBJC_EXPORT IMP objc_msg_lookup_super(struct objc_super *super, SEL _cmd) {
+static __attribute__((noinline)) IMP msg_lookup_super_slow(struct objc_super *super, SEL _cmd) {
+    msg_lookup_misses.fetch_add(1, std::memory_order_relaxed);
     return reinterpret_cast<IMP (*)(struct objc_super *, SEL)>(objc_msgLookupSuper2)(super, _cmd);
 }
 
+OBJC_EXPORT IMP objc_msg_lookup(id self, SEL _cmd) {
+    if (__builtin_expect(self != nil, 1)) {
+        if (IMP imp = cache_getImp(self->getIsa(), _cmd)) {
+            msg_lookup_hits.fetch_add(1, std::memory_order_relaxed);
+            return imp;
+        }
+    }
+    return msg_lookup_slow(self, _cmd);
+}
+OBJC_EXPORT IMP objc_msg_lookup_super(struct objc_super *super, SEL _cmd) {
+    // `objc_msgLookupSuper2` searches the superclass of `super_class`.
+    if (__builtin_expect(super->receiver != nil, 1)) {
+        Class cls = ((Class)super->super_class)->superclass;
+        if (IMP imp = cache_getImp(cls, _cmd)) {
+            msg_lookup_hits.fetch_add(1, std::memory_order_relaxed);
+            return imp;
+        }
+    }
+    return msg_lookup_super_slow(super, _cmd);
+}
+// Reports counters of `objc_msg_lookup` and `objc_msg_lookup_super`.
+OBJC_EXPORT void objc_msg_lookup_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = msg_lookup_hits.load(std::memory_order_relaxed);
+    *misses = msg_lookup_misses.load(std::memory_order_relaxed);
+}
+
 // Originals are in libobjc2/associate.m.
 // TODO: Implement these correctly!
 OBJC_EXPORT BOOL object_addMethod_np(id object, SEL name, IMP imp, const char *types)
@@ -0,0 +1,44 @@
+// Thread-local storage of the runtime's hot per-thread data (see
+// `[direct-tls]` in `README.md`).
+//
+// On macOS, the runtime keeps autorelease pool pages, `@synchronized` data and
+// similar in "direct" pthread keys, which are just slots in the thread's TSD.
+// pthreads-win32 has no such thing, so instead of going through
+// `pthread_getspecific` (see `[no-direct-keys]`), these are plain
+// `thread_local` slots. Reading or writing one is a single TLS access.
+// pthread keys are used only to run destructors at thread exit.
+
+#ifndef _OBJC_IPASIM_TLS_H
+#define _OBJC_IPASIM_TLS_H
+
+enum objc_tls_slot {
+    OBJC_TLS_SYNC_DATA,          // SYNC_DATA_DIRECT_KEY
+    OBJC_TLS_SYNC_COUNT,         // SYNC_COUNT_DIRECT_KEY
+    OBJC_TLS_AUTORELEASE_POOL,   // AUTORELEASE_POOL_KEY
+    OBJC_TLS_RETURN_DISPOSITION, // RETURN_DISPOSITION_KEY
+    OBJC_TLS_PTHREAD_DATA,       // _objc_pthread_key
+    OBJC_TLS_SLOT_COUNT
+};
+
+extern thread_local void *objc_tls_slots[OBJC_TLS_SLOT_COUNT];
+
+static inline void *objc_tls_get(objc_tls_slot slot)
+{
+    return objc_tls_slots[slot];
+}
+
+// Registers destructor `dtor`, which is called with the slot's value when a
+// thread holding a non-null value exits (like `pthread_key_init_np`). Must be
+// called before the slot is first set from any thread.
+void objc_tls_init(objc_tls_slot slot, void (*dtor)(void *));
+
+// Slow part of `objc_tls_set`, arms the slot's destructor for this thread.
+void objc_tls_arm(objc_tls_slot slot);
+
+static inline void objc_tls_set(objc_tls_slot slot, void *value)
+{
+    objc_tls_slots[slot] = value;
+    if (value) objc_tls_arm(slot);
+}
+
+#endif
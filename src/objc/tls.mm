@@ -0,0 +1,51 @@
+// See `tls.h`.
+
+#include "tls.h"
+
+#include <pthread.h>
+
+thread_local void *objc_tls_slots[OBJC_TLS_SLOT_COUNT];
+
+namespace {
+
+struct tls_destructor {
+    void (*dtor)(void *);
+    pthread_key_t key;
+};
+
+tls_destructor destructors[OBJC_TLS_SLOT_COUNT];
+
+// Bit `i` is set if destructor of slot `i` is armed on this thread.
+thread_local unsigned armed;
+
+// Registered with pthreads-win32 for every slot that has a destructor. The
+// pthread key's value is just the slot's destructor entry, the real value is
+// read from `objc_tls_slots`. If the destructor sets the slot again, it's
+// re-armed, so pthreads-win32 calls it again (up to
+// `PTHREAD_DESTRUCTOR_ITERATIONS` times) like it does for ordinary keys.
+void run_destructor(void *entry)
+{
+    objc_tls_slot slot = (objc_tls_slot)((tls_destructor *)entry - destructors);
+    armed &= ~(1u << slot);
+    void *value = objc_tls_slots[slot];
+    objc_tls_slots[slot] = nullptr;
+    if (value) destructors[slot].dtor(value);
+}
+
+} // namespace
+
+void objc_tls_init(objc_tls_slot slot, void (*dtor)(void *))
+{
+    if (!dtor || destructors[slot].dtor) return;
+    destructors[slot].dtor = dtor;
+    pthread_key_create(&destructors[slot].key, run_destructor);
+}
+
+void objc_tls_arm(objc_tls_slot slot)
+{
+    unsigned bit = 1u << slot;
+    if (armed & bit) return;
+    if (!destructors[slot].dtor) return;
+    armed |= bit;
+    pthread_setspecific(destructors[slot].key, &destructors[slot]);
+}